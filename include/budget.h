@@ -0,0 +1,72 @@
+/*
+ * budget.h - A global memory budget for audio buffers
+ *
+ * Copyright (c) 2014   A. Dilly
+ *
+ * AirCat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * AirCat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with AirCat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _BUDGET_H
+#define _BUDGET_H
+
+#include <stddef.h>
+
+#include "json.h"
+#include "httpd.h"
+
+/**
+ * Subsystems which take audio memory from the budget.
+ */
+enum budget_type {
+	BUDGET_CACHE,
+	BUDGET_VRING,
+	BUDGET_RTP,
+	BUDGET_SHOUTCAST,
+	BUDGET_READAHEAD,
+	BUDGET_COUNT
+};
+
+/**
+ * Reserve size bytes for a subsystem before allocating them. If the global
+ * limit would be exceeded, nothing is reserved and -1 is returned: the caller
+ * must then degrade gracefully (stop growing or refuse the new stream).
+ */
+int budget_reserve(enum budget_type type, size_t size);
+
+/**
+ * Give back size bytes previously reserved with budget_reserve().
+ */
+void budget_release(enum budget_type type, size_t size);
+
+/**
+ * Set / get the global limit in bytes. A limit of 0 disables the budget.
+ * Lowering the limit never frees memory: it only refuses next reservations.
+ */
+void budget_set_limit(size_t limit);
+size_t budget_get_limit(void);
+
+/**
+ * Get memory currently used by a subsystem, or by all subsystems when type is
+ * BUDGET_COUNT.
+ */
+size_t budget_get_usage(enum budget_type type);
+
+/**
+ * Configuration: "limit" is the global limit in MB (0 for unlimited).
+ */
+int budget_set_config(struct json *cfg);
+struct json *budget_get_config(void);
+
+extern struct url_table budget_urls[];
+
+#endif
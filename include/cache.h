@@ -33,12 +33,43 @@ int cache_is_ready(struct cache_handle *h);
 unsigned char cache_get_filling(struct cache_handle *h);
 int cache_read(void *h, unsigned char *buffer, size_t size,
 	       struct a_format *fmt);
+/* Same as cache_read() but wait up to timeout ms for cache to become ready */
+int cache_read_timeout(void *h, unsigned char *buffer, size_t size,
+		       struct a_format *fmt, unsigned long timeout);
 ssize_t cache_write(void *h, const unsigned char *buffer, size_t size,
 		    struct a_format *fmt);
+/* Zero-copy write for a cache without input callback: reserve a contiguous area
+ * of up to size samples in cache memory, fill it and commit written samples
+ * with their format. Only one area can be reserved at a time and it is dropped
+ * on commit when cache has been flushed meanwhile. 0 is returned by reserve
+ * when cache is full. */
+ssize_t cache_write_reserve(struct cache_handle *h, size_t size,
+			    unsigned char **buffer);
+ssize_t cache_write_commit(struct cache_handle *h, size_t size,
+			   struct a_format *fmt);
 void cache_flush(struct cache_handle *h);
+/* Same as cache_flush() but cache is ready again as soon as time ms are
+ * buffered, instead of waiting for a full cache (after a seek) */
+void cache_flush_ready(struct cache_handle *h, unsigned long time);
+/* Change format of cached samples: the cache is flushed as with
+ * cache_flush_ready() and input_user replaces user data of input callback (when
+ * cache has been opened with one) */
+int cache_set_format(struct cache_handle *h, unsigned long samplerate,
+		     unsigned char channels, void *input_user,
+		     unsigned long ready);
+/* Same as cache_set_format() when input callback is already locked by caller
+ * with cache_lock() (after a flush or an abort) */
+int cache_set_format_locked(struct cache_handle *h, unsigned long samplerate,
+			    unsigned char channels, void *input_user,
+			    unsigned long ready);
 void cache_lock(struct cache_handle *h);
 void cache_unlock(struct cache_handle *h);
 unsigned long cache_delay(struct cache_handle *h);
+
+/* Trace latency of samples written to and read from cache (see trace.h) */
+struct trace;
+void cache_set_trace(struct cache_handle *h, struct trace *trace);
+
 int cache_close(struct cache_handle *h);
 
 #endif
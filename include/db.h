@@ -19,6 +19,8 @@
 #ifndef _DB_H
 #define _DB_H
 
+#include "json.h"
+
 enum db_type {
 	DB_INTEGER,
 	DB_FLOAT,
@@ -39,6 +41,16 @@ struct db_query;
 typedef int (*db_cb)(void *user_data, int col_count, char **values,
 		     char **names);
 
+/* Connection settings applied to databases opened afterwards:
+ * "journal_mode" and "synchronous" are SQLite pragma values, "cache_size" is
+ * the page cache size in KiB, "mmap_size" the memory mapped I/O size in MiB and
+ * "statements" the count of prepared statements cached per database. Only
+ * statements with parameters (bound with db_bind_*()) are cached: they are
+ * given back to cache by db_finalize().
+ */
+int db_set_config(struct json *cfg);
+struct json *db_get_config(void);
+
 int db_open(struct db_handle **handle, const char *path, const char *name);
 const char *db_get_name(struct db_handle *h);
 void *db_get_db(struct db_handle *h);
@@ -52,6 +64,9 @@ char *db_mprintf(const char *str, ...);
 void db_free(void *ptr);
 
 struct db_query *db_prepare(struct db_handle *h, const char *sql, size_t len);
+int db_bind_blob(struct db_query *query, int i, const void *blob, size_t len);
+int db_bind_text(struct db_query *query, int i, const char *str);
+int db_bind_int64(struct db_query *query, int i, int64_t value);
 int db_step(struct db_query *query);
 int db_finalize(struct db_query *query);
 
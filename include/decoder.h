@@ -29,6 +29,21 @@ struct decoder_info {
 	unsigned char channels;		// Channel count for this frame
 };
 
+/* Input frame for batch decoding */
+struct decoder_frame {
+	unsigned char *data;		// Frame data
+	size_t len;			// Frame length
+};
+
+/* Output status for batch decoder */
+struct decoder_batch_info {
+	unsigned int frames;		// Frames fully consumed from list
+	unsigned long used;		// Bytes consumed in next frame of list
+	unsigned long remaining;	// Remaining samples in decoder
+	unsigned long samplerate;	// Samplerate of decoded samples
+	unsigned char channels;		// Channel count of decoded samples
+};
+
 enum {
 	DECODER_ERROR_BUFLEN = -1,
 	DECODER_ERROR_SYNC = -2
@@ -42,6 +57,14 @@ struct decoder_handle {
 	int (*decode)(struct decoder*, unsigned char*, size_t, unsigned char*,
 		      size_t, struct decoder_info*);
 	int (*close)(struct decoder*);
+	/* Optional: select output sample format (default is native) */
+	int (*set_sample)(struct decoder*, enum a_sample);
+	/* Optional: decode a list of frames in one call */
+	int (*decode_batch)(struct decoder*, const struct decoder_frame*,
+			    unsigned int, unsigned char*, size_t,
+			    struct decoder_batch_info*);
+	/* Output sample format (set by decoder_set_sample()) */
+	enum a_sample sample;
 };
 
 int decoder_open(struct decoder_handle **handle, enum a_codec codec,
@@ -50,6 +73,20 @@ int decoder_open(struct decoder_handle **handle, enum a_codec codec,
 int decoder_decode(struct decoder_handle *h, unsigned char *in_buffer,
 		   size_t in_size, unsigned char *out_buffer,
 		   size_t out_size, struct decoder_info *info);
+/* Decode frames from list until output buffer is full or audio format changes.
+ * The expected format is given in info (0 to accept format of first frame) and
+ * all returned samples have the format reported in info. Decoding stops on the
+ * first frame which decodes with another format: its samples are kept in
+ * decoder and returned by the next call. Remaining samples in decoder are
+ * returned first and an empty list only returns them. The frames fully
+ * consumed and used bytes in next frame are reported in info. A decoder
+ * without decode_batch() is driven frame by frame with decode().
+ */
+int decoder_decode_batch(struct decoder_handle *h,
+			 const struct decoder_frame *frames, unsigned int count,
+			 unsigned char *out_buffer, size_t out_size,
+			 struct decoder_batch_info *info);
+int decoder_set_sample(struct decoder_handle *h, enum a_sample sample);
 int decoder_close(struct decoder_handle *h);
 
 #endif
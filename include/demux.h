@@ -19,6 +19,8 @@
 #ifndef _DEMUX_H
 #define _DEMUX_H
 
+#include <stdint.h>
+
 #include "format.h"
 #include "meta.h"
 #include "fs.h"
@@ -29,27 +31,39 @@
  *
  * demux_frame is a container to handle an audio frame in the ring buffer used
  * in Demuxer. This structure contains frame length, original frame position in
- * stream and its data. It must be allocated with sizeof(struct demux_frame) + 
- * frame length.
+ * stream and a pointer to its data. It always takes
+ * sizeof(struct demux_frame) + frame length in ring buffer and data follows the
+ * structure by default, but a demux module can point data into a readahead
+ * block mapped with fs_readahead_map() to avoid a copy: the block reference is
+ * then kept in ref and is released by Demuxer when frame is consumed.
  */
 struct demux_frame {
 	off_t pos;		/*!< Original frame position in stream */
 	size_t len;		/*!< Frame length */
-	unsigned char data[0];	/*!< Frame data */
+	unsigned char *data;	/*!< Frame data */
+	void *ref;		/*!< Mapped block reference (or NULL) */
+	uint64_t time;		/*!< Read time when tracing (or 0) */
 };
 
+/* Demuxer open flags: by default, only what is needed for playback is read */
+#define DEMUX_META_TAGS		1	/*!< Read text tags (title, ...) */
+#define DEMUX_META_PICTURE	2	/*!< Read cover art */
+
 struct demux;
 
 /* Demux module */
 struct demux_module {
 	int (*open)(struct demux **, struct fs_file *, size_t, unsigned long *,
-		    unsigned char *);
+		    unsigned char *, unsigned int);
 	struct meta *(*get_meta)(struct demux *);
 	int (*get_dec_config)(struct demux *, int *, const unsigned char **,
 			      size_t *);
 	ssize_t (*next_frame)(struct demux *, struct demux_frame *, size_t);
 	unsigned long (*set_pos)(struct demux *, unsigned long);
 	unsigned long (*calc_pos)(struct demux *, unsigned long, off_t *);
+	unsigned long (*get_seek_table)(struct demux *, const uint32_t **);
+	int (*set_seek_table)(struct demux *, const uint32_t *, unsigned long);
+	unsigned long (*get_seek_skip)(struct demux *);
 	void (*close)(struct demux *);
 	const size_t min_buffer_size;
 };
@@ -58,10 +72,12 @@ struct demux_handle;
 
 /**
  * Open a new demuxer.
+ * Metadata which are not needed for playback are skipped, unless asked with
+ * DEMUX_META_* flags.
  */
 int demux_open(struct demux_handle **handle, const char *uri,
 	       unsigned long *samplerate, unsigned char *channels,
-	       size_t cache_size, int use_thread);
+	       size_t cache_size, int use_thread, unsigned int flags);
 
 /**
  * Get metadata extracted from stream.
@@ -95,11 +111,54 @@ void demux_set_used_frame(struct demux_handle *h, ssize_t len);
  */
 ssize_t demux_get_next_frame(struct demux_handle *h, unsigned char **buffer);
 
+/**
+ * Get a list of up to count consecutive frames from current frame, without
+ * consuming them. The first frame is the current frame and the bytes already
+ * used in it are returned in pos. Frames are valid until
+ * demux_set_used_frames() is called.
+ * The number of frames is returned, 0 if no frame is available and -1 at end
+ * of stream.
+ */
+int demux_get_frames(struct demux_handle *h, struct demux_frame **frames,
+		     unsigned int count, size_t *pos);
+
+/**
+ * Consume frames returned by demux_get_frames(): count frames are fully used
+ * and len bytes are used in the next one.
+ */
+void demux_set_used_frames(struct demux_handle *h, unsigned int count,
+			   size_t len);
+
 /**
  * Set position in demuxer. The position is expressed in seconds.
  */
 unsigned long demux_set_pos(struct demux_handle *h, unsigned long pos);
 
+/**
+ * Get count of samples (per channel) to drop after decoder, from start of first
+ * frame after last demux_set_pos() up to exact asked position. The count is
+ * 0 when the demuxer can't know it (position is then the one returned by
+ * demux_set_pos()).
+ */
+unsigned long demux_get_seek_skip(struct demux_handle *h);
+
+/**
+ * Get a copy of the seek table built by demuxer while reading the stream. The
+ * table is opaque and can only be given back to demux_set_seek_table() for the
+ * same unmodified stream. A copy is returned only when new entries have been
+ * added since opening or last call to one of these functions, otherwise -1 is
+ * returned. The table must be freed with free().
+ */
+int demux_get_seek_table(struct demux_handle *h, uint32_t **table,
+			 unsigned long *count);
+
+/**
+ * Set a seek table previously returned by demux_get_seek_table() for the same
+ * stream, in order to seek exactly and immediately.
+ */
+int demux_set_seek_table(struct demux_handle *h, const uint32_t *table,
+			 unsigned long count);
+
 /**
  * Close demuxer.
  */
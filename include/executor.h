@@ -0,0 +1,97 @@
+/*
+ * executor.h - Shared worker pool and event loop for background tasks
+ *
+ * Copyright (c) 2014   A. Dilly
+ *
+ * AirCat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * AirCat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with AirCat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _EXECUTOR_H
+#define _EXECUTOR_H
+
+#include "json.h"
+#include "httpd.h"
+
+/**
+ * The executor runs background work of components (cache input, demuxer,
+ * radio stream and threaded HTTP requests) as tasks on a small pool of worker
+ * threads, instead of a thread per component. Each worker has its own queue
+ * and steals tasks from other queues when it is idle. A reactor thread wakes
+ * tasks waiting for a socket or a timeout with epoll.
+ *
+ * A task is a callback which does a bounded amount of work and returns:
+ *  - TASK_AGAIN: run it again (after other queued tasks),
+ *  - TASK_WAIT: park it until task_wake() or, when set by the callback before
+ *    returning, a timeout (task_timeout()) or a socket event
+ *    (task_wait_fd()),
+ *  - TASK_DONE: the task has finished and task_join() returns.
+ * A callback never runs concurrently with itself and a wake up during a run is
+ * never lost: the task runs again. It can be woken for nothing (an old timeout
+ * or socket event) and must check its own state on each run.
+ */
+enum task_result {
+	TASK_AGAIN,
+	TASK_WAIT,
+	TASK_DONE
+};
+
+struct task;
+typedef int (*task_cb)(void *user_data, struct task *t);
+
+/**
+ * Task mode is enabled when the worker count is not 0 (and epoll is
+ * available): components use a task instead of a thread when they are open.
+ */
+int executor_is_enabled(void);
+
+/**
+ * Create a task and queue its first run. The pool is started on first task.
+ * NULL is returned on failure.
+ */
+struct task *task_new(task_cb cb, void *user_data, const char *name);
+
+/* Queue next run of a parked task (it can be called from any thread) */
+void task_wake(struct task *t);
+
+/**
+ * From the callback of a task which returns TASK_WAIT: wake it after timeout
+ * ms and / or when fd is readable (or writable when out is not 0).
+ */
+void task_timeout(struct task *t, unsigned long timeout);
+int task_wait_fd(struct task *t, int fd, int out);
+
+/**
+ * From the callback of a task: unregister the socket of task_wait_fd(). The
+ * owner must call it before the socket is closed or handed over (another
+ * socket could get the same number), and so before it returns TASK_DONE when
+ * the socket outlives the task.
+ */
+void task_release_fd(struct task *t);
+
+/**
+ * Wait until the callback returns TASK_DONE and free the task. The owner must
+ * have asked its task to stop (and woken it) before.
+ */
+void task_join(struct task *t);
+
+/**
+ * Configuration: "workers" is the count of worker threads (0 to disable task
+ * mode, which is the default). The pool never shrinks while it runs: a lower
+ * count is used after a restart.
+ */
+int executor_set_config(struct json *cfg);
+struct json *executor_get_config(void);
+
+extern struct url_table executor_urls[];
+
+#endif
@@ -19,6 +19,8 @@
 #ifndef _FILE_CLIENT_H
 #define _FILE_CLIENT_H
 
+#include <stdint.h>
+
 #include "format.h"
 
 /* File status */
@@ -32,17 +34,32 @@ enum {
 struct file_handle;
 
 int file_open(struct file_handle **h, const char *uri);
+const char *file_get_uri(struct file_handle *h);
 
 unsigned long file_get_samplerate(struct file_handle *h);
 unsigned char file_get_channels(struct file_handle *h);
 
 unsigned long file_set_pos(struct file_handle *h, unsigned long pos);
+/* Same as file_set_pos() but decode and drop samples from found frame up to
+ * asked position, when demuxer knows it: new position is then exact */
+unsigned long file_set_pos_exact(struct file_handle *h, unsigned long pos);
 unsigned long file_get_pos(struct file_handle *h);
 long file_get_length(struct file_handle *h);
 int file_get_status(struct file_handle *h);
 
+/* Seek table (see demux_get_seek_table()) */
+int file_get_seek_table(struct file_handle *h, uint32_t **table,
+			unsigned long *count);
+int file_set_seek_table(struct file_handle *h, const uint32_t *table,
+			unsigned long count);
+
 int file_read(void *h, unsigned char *buffer, size_t size,
 	      struct a_format *fmt);
+
+/* Trace latency of frames from demuxer to decoder output */
+struct trace;
+void file_set_trace(struct file_handle *h, struct trace *trace);
+
 void file_close(struct file_handle *h);
 
 /* File event */
@@ -19,7 +19,7 @@
 #ifndef _FORMAT_H
 #define _FORMAT_H
 
-#define A_FORMAT_INIT {0, 0}
+#define A_FORMAT_INIT {0, 0, SAMPLE_NATIVE}
 
 enum a_codec {
 	CODEC_NO,
@@ -29,9 +29,20 @@ enum a_codec {
 	CODEC_MP3
 };
 
+/* Sample formats: all are in native endianness. SAMPLE_NATIVE is the format
+ * used for mixing (float with USE_FLOAT, 32-bit signed otherwise).
+ */
+enum a_sample {
+	SAMPLE_NATIVE = 0,
+	SAMPLE_S16,
+	SAMPLE_S32,
+	SAMPLE_FLOAT
+};
+
 struct a_format {
 	unsigned long samplerate;
 	unsigned char channels;
+	enum a_sample sample;
 };
 
 typedef int (*a_read_cb) (void *user_data, unsigned char *buffer,
@@ -45,11 +56,28 @@ static inline void format_cpy(struct a_format *f1, struct a_format *f2)
 		memcpy(f1, f2, sizeof(struct a_format));
 }
 
+static inline enum a_sample format_sample(enum a_sample sample)
+{
+	if(sample != SAMPLE_NATIVE)
+		return sample;
+#ifdef USE_FLOAT
+	return SAMPLE_FLOAT;
+#else
+	return SAMPLE_S32;
+#endif
+}
+
+static inline size_t format_sample_size(enum a_sample sample)
+{
+	return format_sample(sample) == SAMPLE_S16 ? 2 : 4;
+}
+
 static inline int format_cmp(struct a_format *f1, struct a_format *f2)
 {
 	if(f1 != NULL && f2 != NULL &&
 	   f1->samplerate == f2->samplerate &&
-	   f1->channels == f2->channels)
+	   f1->channels == f2->channels &&
+	   format_sample(f1->sample) == format_sample(f2->sample))
 		return 0;
 
 	return 1;
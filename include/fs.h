@@ -48,6 +48,20 @@ struct fs_dirent {
 	char name[256];
 };
 
+/* Open flag: map a local regular file in memory for reading, so reads are
+ * copies from memory and seeks are free (ignored on other file systems)
+ */
+#define FS_O_MMAP 0x40000000
+
+/* Access pattern hints for fs_advise() */
+enum fs_advice {
+	FS_ADVICE_NORMAL,
+	FS_ADVICE_SEQUENTIAL,
+	FS_ADVICE_RANDOM,
+	FS_ADVICE_WILLNEED,
+	FS_ADVICE_DONTNEED,
+};
+
 struct fs_file {
 	/* Data */
 	int fd;
@@ -80,6 +94,7 @@ struct fs_handle {
 	off_t (*lseek)(struct fs_file *, off_t, int);
 	int (*ftruncate)(struct fs_file *, off_t);
 	void (*close)(struct fs_file *);
+	int (*advise)(struct fs_file *, off_t, off_t, enum fs_advice);
 	/* Filesystem I/O */
 	int (*mkdir)(const char *, mode_t);
 	int (*unlink)(const char *);
@@ -115,6 +130,57 @@ ssize_t fs_write_timeout(struct fs_file *f, const void *buf, size_t count,
 off_t fs_lseek(struct fs_file *f, off_t offset, int whence);
 int fs_ftruncate(struct fs_file *f, off_t length);
 void fs_close(struct fs_file *f);
+/* Give an access pattern hint on len bytes from offset (0 for end of file).
+ * -1 is returned when the file system doesn't support hints.
+ */
+int fs_advise(struct fs_file *f, off_t offset, off_t len,
+	      enum fs_advice advice);
+
+/* Readahead: wrap a file just opened with fs_open() to read it by large
+ * aligned blocks, the next block being prefetched by a thread. The returned
+ * file is read-only and closes the wrapped file when closed. A block size of 0
+ * selects the global size. NULL is returned on failure (or when the memory
+ * budget is exceeded) and the file can still be used directly.
+ */
+struct fs_file *fs_readahead_open(struct fs_file *f, size_t block_size);
+/* Map len bytes at pos directly from a readahead block and move the file
+ * position after them. The block is pinned until fs_readahead_unmap() is
+ * called with the returned ref. It fails (without moving the position) when
+ * the file is not a readahead file or the bytes are not in a single block:
+ * they must then be read with fs_read().
+ */
+int fs_readahead_map(struct fs_file *f, off_t pos, size_t len,
+		     unsigned char **data, void **ref);
+void fs_readahead_unmap(struct fs_file *f, void *ref);
+void fs_readahead_set_size(size_t size);
+size_t fs_readahead_get_size(void);
+/* Configuration: "size" is the readahead block size in kB (0 for default) */
+struct json;
+int fs_readahead_set_config(struct json *cfg);
+struct json *fs_readahead_get_config(void);
+
+/* Asynchronous reads: a queue of reads done in parallel by the kernel with
+ * io_uring. A queue must be used by a single thread. NULL is returned when
+ * asynchronous I/O is not available, and fs_aio_can_read() tells if a file can
+ * be read with it (only local files which are not memory mapped): files must
+ * be read with fs_read() otherwise. The file position is not moved by
+ * asynchronous reads.
+ */
+struct fs_aio;
+struct fs_aio *fs_aio_new(unsigned int depth);
+int fs_aio_can_read(struct fs_file *f);
+/* Submit a read of len bytes at pos: the whole length is read unless end of
+ * file is reached. -1 is returned when the queue is full.
+ */
+int fs_aio_read(struct fs_aio *a, struct fs_file *f, void *buf, size_t len,
+		off_t pos, void *user);
+/* Get a completed read with its user data and its result (the bytes read or
+ * -1 on error). If block is set, it waits for a read to complete, otherwise 0
+ * is returned when none is completed. -1 is returned when no read is pending.
+ */
+int fs_aio_complete(struct fs_aio *a, void **user, ssize_t *res, int block);
+unsigned int fs_aio_pending(struct fs_aio *a);
+void fs_aio_free(struct fs_aio *a);
 
 /* Filesystem I/O */
 int fs_mkdir(const char *url, mode_t mode);
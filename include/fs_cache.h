@@ -0,0 +1,49 @@
+/*
+ * fs_cache.h - A disk cache for remote files
+ *
+ * Copyright (c) 2014   A. Dilly
+ *
+ * AirCat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * AirCat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with AirCat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _FS_CACHE_H
+#define _FS_CACHE_H
+
+#include "json.h"
+#include "httpd.h"
+#include "fs.h"
+
+/**
+ * Wrap a remote file just opened read-only with fs_open(): it is then read by
+ * fixed-size chunks stored in the cache directory, keyed by URL, size and
+ * modification time. The same file is returned when the cache is disabled, on
+ * failure or when the file size is unknown (live streams).
+ */
+struct fs_file *fs_cache_open(struct fs_file *f, const char *url);
+
+/**
+ * Configuration: "path" is the cache directory (cache is disabled when it is
+ * not set) and "size" is the disk budget in MB (0 for default). Least recently
+ * used chunks are removed when the budget is exceeded.
+ */
+int fs_cache_set_config(struct json *cfg);
+struct json *fs_cache_get_config(void);
+
+/**
+ * Free cache index (cached chunks are kept on disk for next run).
+ */
+void fs_cache_free(void);
+
+extern struct url_table fs_cache_urls[];
+
+#endif
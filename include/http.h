@@ -25,7 +25,8 @@ enum {
 	HTTP_PROXY_PORT,
 	HTTP_FOLLOW_REDIRECT,
 	HTTP_MAX_REDIRECT,
-	HTTP_EXTRA_HEADER
+	HTTP_EXTRA_HEADER,
+	HTTP_KEEP_ALIVE
 };
 
 struct http_handle;
@@ -37,13 +38,19 @@ int http_set_default_option(int option, const char *c_value,
 			    unsigned int i_value);
 /* Get default values for HTTP client */
 int http_get_default_option(int option, char **c_value, unsigned int *i_value);
-/* Free default values for HTTP client */
+/* Free default values for HTTP client and close idle connections */
 void http_free_default_options(void);
 
 /* Create a new HTTP client */
 int http_open(struct http_handle **h, int use_default);
 
-/* Set options for next HTTP connection */
+/* Set options for next HTTP connection.
+ * With HTTP_KEEP_ALIVE (enabled by default), the connection is reused by next
+ * request to the same server if the whole respond content has been read. When
+ * the request is for another server or the connection is closed, it is kept in
+ * a process-wide pool of idle connections (up to 4 per server for 15s) to be
+ * reused by any handle. After the respond content, http_read() returns -1.
+ */
 int http_set_option(struct http_handle *h, int option, const char *c_value,
 		    unsigned int i_value);
 
@@ -96,6 +103,9 @@ int http_request_thread(struct http_handle *h, const char *url,
 int http_download_to_file(struct http_handle *h, const char *url,
 			  const char *dst);
 
+/* Get socket of current connection to wait data (-1 if not connected) */
+int http_get_socket(struct http_handle *h);
+
 /* Get respond code of last HTTP request */
 int http_get_code(struct http_handle *h);
 
@@ -111,6 +121,11 @@ void http_close_connection(struct http_handle *h);
 /* Close connection and free handle */
 void http_close(struct http_handle *h);
 
+/* Get count of TLS handshakes which resumed a previous session of server and
+ * of full handshakes
+ */
+void http_get_tls_stats(unsigned long *resumed, unsigned long *full);
+
 #endif
 
 
@@ -91,6 +91,16 @@ int httpd_add_urls(struct httpd_handle *h, const char *name,
 		   struct url_table *urls, void *user_data);
 int httpd_remove_urls(struct httpd_handle *h, const char *name);
 
+/* Add a URL group which user data is created on its first request: open is
+ * called with open_data and must return the user data passed to URL callbacks,
+ * or NULL on failure (the request is then rejected with a 503 and next request
+ * will try again).
+ */
+typedef void *(*httpd_open_cb)(void *open_data);
+int httpd_add_lazy_urls(struct httpd_handle *h, const char *name,
+			struct url_table *urls, httpd_open_cb open,
+			void *open_data);
+
 /* Create HTTP response */
 typedef ssize_t (*httpd_res_cb)(void *user_data, uint64_t pos, char *buffer,
 				size_t size);
@@ -102,7 +112,23 @@ struct httpd_res *httpd_new_data_response(unsigned char *buffer, size_t len,
 struct httpd_res *httpd_new_cb_response(uint64_t size, size_t block_size,
 					httpd_res_cb cb, void *user_data,
 					httpd_res_free_cb free_cb);
-struct httpd_res *httpd_new_file_response(const char *path, const char *file,
+/* Create a response of unknown size which can wait for its data: when cb
+ * returns 0, the connection is suspended until httpd_resume_stream() is
+ * called. The stream handle is valid until free_cb is called. NULL is
+ * returned if the HTTP server doesn't support it.
+ */
+struct httpd_stream;
+struct httpd_res *httpd_new_stream_response(struct httpd_req *req,
+					    size_t block_size,
+					    httpd_res_cb cb, void *user_data,
+					    httpd_res_free_cb free_cb,
+					    struct httpd_stream **stream);
+void httpd_resume_stream(struct httpd_stream *s);
+/* Create a response from a file: if req is not NULL, conditional (ETag and
+ * Last-Modified) and single range requests are handled.
+ */
+struct httpd_res *httpd_new_file_response(struct httpd_req *req,
+					  const char *path, const char *file,
 					  int *code);
 int httpd_add_header(struct httpd_res *res, const char *header,
 		     const char *value);
@@ -110,6 +136,9 @@ int httpd_add_header(struct httpd_res *res, const char *header,
 /* Get stringquery values in URL */
 const char *httpd_get_query(struct httpd_req *req, const char *key);
 
+/* Get header values of request */
+const char *httpd_get_header(struct httpd_req *req, const char *key);
+
 /* Set/Get values in session */
 int httpd_set_session_value(struct httpd_req *req, const char *key,
 			     const char *value);
@@ -0,0 +1,41 @@
+/*
+ * image.h - Cover art thumbnails
+ *
+ * Copyright (c) 2014   A. Dilly
+ *
+ * AirCat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * AirCat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with AirCat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _IMAGE_H
+#define _IMAGE_H
+
+#include <stddef.h>
+
+/* Sizes of thumbnails (in pixels, for the largest side) */
+#define IMAGE_THUMB_SIZES { 128, 256, 512 }
+#define IMAGE_THUMB_QUALITY 85
+
+/* Get the nearest thumbnail size (not smaller than size when possible) */
+unsigned int image_thumbnail_size(unsigned long size);
+
+/**
+ * Create a JPEG thumbnail of a JPEG or PNG image, scaled down to fit in a
+ * size x size square. The thumbnail must be freed with free().
+ * Returns 0 on success, 1 if the image is already small enough (the original
+ * should be used) and -1 on error or if format is not supported (or aircat is
+ * built without libjpeg).
+ */
+int image_thumbnail(const unsigned char *data, size_t len, unsigned int size,
+		    unsigned char **thumb, size_t *thumb_len);
+
+#endif
@@ -0,0 +1,50 @@
+/*
+ * json_stream.h - An incremental JSON writer
+ *
+ * Copyright (c) 2014   A. Dilly
+ *
+ * AirCat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * AirCat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with AirCat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _JSON_STREAM_H
+#define _JSON_STREAM_H
+
+#include "json.h"
+
+/* A JSON stream writes a JSON document directly as a string: objects and
+ * arrays are opened and closed in order, and values are added one by one so
+ * that a large list never has to be built as a whole JSON tree. The document
+ * is still written in memory and returned as a whole by json_stream_finish():
+ * it is not streamed to the HTTP client, so it saves the tree, its export and
+ * copy, but not the time to first byte. The key is NULL for values in an
+ * array and must not need escaping.
+ * All functions return -1 on error: the stream is then invalid and
+ * json_stream_finish() returns NULL.
+ */
+struct json_stream;
+
+struct json_stream *json_stream_new(void);
+int json_stream_begin_object(struct json_stream *s, const char *key);
+int json_stream_end_object(struct json_stream *s);
+int json_stream_begin_array(struct json_stream *s, const char *key);
+int json_stream_end_array(struct json_stream *s);
+/* Add a value: it is freed after being written */
+int json_stream_add(struct json_stream *s, const char *key, struct json *j);
+/* Add a value already exported with json_export() */
+int json_stream_add_string(struct json_stream *s, const char *key,
+			   const char *str);
+/* Get the string (to free with free()) and free the stream */
+char *json_stream_finish(struct json_stream *s, size_t *len);
+void json_stream_free(struct json_stream *s);
+
+#endif
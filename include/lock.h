@@ -0,0 +1,102 @@
+/*
+ * lock.h - Instrumented mutexes for lock contention profiling
+ *
+ * Copyright (c) 2014   A. Dilly
+ *
+ * AirCat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * AirCat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with AirCat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _LOCK_H
+#define _LOCK_H
+
+#include <stdio.h>
+#include <pthread.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+/**
+ * Core mutexes are locked with lock_mutex() / unlock_mutex() and a lock class
+ * defined with LOCK_CLASS(): a class is a name shared by all mutexes of same
+ * role ("cache", "output", ...). When built with --enable-lock-profile, each
+ * class records:
+ *  - acquires and contended acquires (mutex already locked by another thread),
+ *  - wait time of contended acquires,
+ *  - hold time, from acquire to release (by any thread): a condition wait
+ *    ends the hold and its wakeup starts a new one without counting an
+ *    acquire.
+ * Statistics are exported as metrics on /metrics ("aircat_lock_<name>_*") and
+ * printed on stderr by lock_dump() when aircat receives SIGUSR1. Otherwise the
+ * macros are plain pthread calls.
+ */
+#ifdef LOCK_PROFILE
+
+#include "metrics.h"
+
+struct lock_class {
+	const char *name;
+	struct metric acquires;
+	struct metric contended;
+	struct metric wait;
+	struct metric hold;
+	/* Registration */
+	int registered;
+	struct lock_class *next;
+};
+
+#define LOCK_CLASS(var, name) \
+	static struct lock_class var = { name, \
+		METRIC_INIT(METRIC_COUNTER, "aircat_lock_" name "_acquires_total", \
+			    "Acquires of " name " locks"), \
+		METRIC_INIT(METRIC_COUNTER, \
+			    "aircat_lock_" name "_contended_total", \
+			    "Acquires of " name " locks which had to wait"), \
+		METRIC_INIT(METRIC_HISTOGRAM, \
+			    "aircat_lock_" name "_wait_seconds", \
+			    "Wait time of contended " name " locks"), \
+		METRIC_INIT(METRIC_HISTOGRAM, \
+			    "aircat_lock_" name "_hold_seconds", \
+			    "Hold time of " name " locks"), \
+		0, NULL }
+
+int lock_profile_lock(struct lock_class *c, pthread_mutex_t *m);
+int lock_profile_trylock(struct lock_class *c, pthread_mutex_t *m);
+int lock_profile_unlock(struct lock_class *c, pthread_mutex_t *m);
+int lock_profile_cond_wait(struct lock_class *c, pthread_cond_t *cond,
+			   pthread_mutex_t *m, const struct timespec *ts);
+
+#define lock_mutex(c, m) lock_profile_lock(&(c), m)
+#define trylock_mutex(c, m) lock_profile_trylock(&(c), m)
+#define unlock_mutex(c, m) lock_profile_unlock(&(c), m)
+#define lock_cond_wait(c, cond, m) lock_profile_cond_wait(&(c), cond, m, NULL)
+#define lock_cond_timedwait(c, cond, m, ts) \
+	lock_profile_cond_wait(&(c), cond, m, ts)
+
+#else
+
+#define LOCK_CLASS(var, name) \
+	static const char var[] __attribute__((unused)) = name
+
+#define lock_mutex(c, m) pthread_mutex_lock(m)
+#define trylock_mutex(c, m) pthread_mutex_trylock(m)
+#define unlock_mutex(c, m) pthread_mutex_unlock(m)
+#define lock_cond_wait(c, cond, m) pthread_cond_wait(cond, m)
+#define lock_cond_timedwait(c, cond, m, ts) pthread_cond_timedwait(cond, m, ts)
+
+#endif
+
+/* Print statistics of all lock classes (nothing without profiling) */
+void lock_dump(FILE *fp);
+
+#endif
@@ -37,7 +37,12 @@ enum {
 	TAG_ENCODED = 8,
 	TAG_LANGUAGE = 16,
 	TAG_PUBLISHER = 32,
-	TAG_ALL = 0xFFFFF
+	TAG_ALL = 0xFFFFF,
+	/* Fast parsing for scan: MP3 and MP4 files are parsed natively by
+	 * reading only tags and first frames (TagLib is used for other
+	 * formats or unsupported tags)
+	 */
+	TAG_SCAN = 0x100000
 };
 
 struct tag_picture {
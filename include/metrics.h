@@ -0,0 +1,74 @@
+/*
+ * metrics.h - Registry of counters, gauges and histograms
+ *
+ * Copyright (c) 2014   A. Dilly
+ *
+ * AirCat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * AirCat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with AirCat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _METRICS_H
+#define _METRICS_H
+
+#include <stdint.h>
+
+#include "httpd.h"
+
+/**
+ * A metric is defined as static variable by a component with METRIC_INIT() and
+ * is registered on its first update. Updates are atomic additions in a slot
+ * of calling thread (never a lock), and slots are summed when metrics are
+ * exported on /metrics in Prometheus text format.
+ */
+enum metric_type {
+	METRIC_COUNTER,		/*!< Value which only grows */
+	METRIC_GAUGE,		/*!< Value which goes up and down */
+	METRIC_HISTOGRAM	/*!< Durations (in us, exported in seconds) */
+};
+
+/* Slots for updating threads and histogram buckets (last is +Inf) */
+#define METRIC_SLOTS 8
+#define METRIC_BUCKETS 12
+
+struct metric_slot {
+	int64_t value;				/*!< Value or sum of durations */
+	uint64_t count;				/*!< Count of durations */
+	uint64_t buckets[METRIC_BUCKETS];	/*!< Durations by bucket */
+} __attribute__((aligned(64)));
+
+struct metric {
+	const char *name;
+	const char *help;
+	enum metric_type type;
+	/* Registration */
+	int registered;
+	struct metric *next;
+	struct metric_slot slots[METRIC_SLOTS];
+};
+
+#define METRIC_INIT(type, name, help) { name, help, type, 0, NULL }
+
+/* Add a value to a counter or a gauge */
+void metric_add(struct metric *m, int64_t value);
+#define metric_inc(m) metric_add(m, 1)
+
+/* Add a duration to histogram: metric_now() gives a time in us */
+void metric_observe(struct metric *m, uint64_t us);
+uint64_t metric_now(void);
+#define metric_since(m, start) metric_observe(m, metric_now() - (start))
+
+/* Get sum of a metric (and count of durations for a histogram) */
+int64_t metric_get(struct metric *m, uint64_t *count);
+
+extern struct url_table metrics_urls[];
+
+#endif
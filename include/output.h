@@ -20,6 +20,7 @@
 #define _OUTPUT_H
 
 #include "format.h"
+#include "resample.h"
 
 #define OUTPUT_VOLUME_MAX 65535
 
@@ -33,7 +34,12 @@ enum output_stream_key {
 	/* Stream cache fill (in %) */
 	OUTPUT_STREAM_CACHE_FILLING,
 	/* Stream cache current delay (in ms) */
-	OUTPUT_STREAM_CACHE_DELAY
+	OUTPUT_STREAM_CACHE_DELAY,
+	/* Count of cache starvations while playing */
+	OUTPUT_STREAM_STARVATIONS,
+	/* Delay of samples read from input callback until they are played,
+	 * through resampler, cache and device (in ms) */
+	OUTPUT_STREAM_DELAY
 };
 
 enum stream_status {
@@ -54,13 +60,16 @@ struct output_stream_handle;
 int output_set_volume(struct output_handle *h, unsigned int volume);
 unsigned int output_get_volue(struct output_handle *h);
 
-/* Add/Remove output stream */
+/* Add/Remove output stream: the resampler profile can be NULL or partially
+ * set to use the output default values.
+ */
 struct output_stream_handle *output_add_stream(struct output_handle *h,
 					       const char *name,
 					       unsigned long samplerate,
 					       unsigned char channels,
 					       unsigned long cache,
 					       int use_cache_thread,
+				      const struct resample_profile *profile,
 					       a_read_cb input_callback,
 					       void *user_data);
 void output_remove_stream(struct output_handle *h,
@@ -73,12 +82,34 @@ int output_pause_stream(struct output_handle *h,
 void output_flush_stream(struct output_handle *h,
 			 struct output_stream_handle *s);
 
+/* Flush output stream but play it again as soon as ready ms are cached,
+ * instead of waiting for a full cache (for a fast seek)
+ */
+void output_flush_stream_ready(struct output_handle *h,
+			       struct output_stream_handle *s,
+			       unsigned long ready);
+
 /* Write to stream */
 ssize_t output_write_stream(struct output_handle *h, 
 			    struct output_stream_handle *s,
 			    const unsigned char *buffer, size_t size,
 			    struct a_format *fmt);
 
+/* Zero-copy write to stream: reserve an area for up to frames frames, fill it
+ * and commit written frames with their format. When stream is in output
+ * format (native samples), the area is in cache memory and samples are not
+ * copied again. The area holds frames of 4 bytes samples at most and is valid
+ * until commit, which takes all frames. Reserve returns the count of frames of area (0 when stream is
+ * full) and -1 when the output doesn't support it: output_write_stream() must
+ * be used then.
+ */
+ssize_t output_stream_reserve(struct output_handle *h,
+			      struct output_stream_handle *s, size_t frames,
+			      unsigned char **buffer);
+ssize_t output_stream_commit(struct output_handle *h,
+			     struct output_stream_handle *s, size_t frames,
+			     struct a_format *fmt);
+
 /* Volume output stream control */
 int output_set_volume_stream(struct output_handle *h,
 			     struct output_stream_handle *s,
@@ -91,6 +122,20 @@ int output_set_cache_stream(struct output_handle *h,
 			    struct output_stream_handle *s,
 			    unsigned long cache);
 
+/* Fine playback rate control: a ratio above 1 plays stream slower, to follow
+ * the clock of a sender (the resampler profile must allow variable rate).
+ */
+int output_set_ratio_stream(struct output_handle *h,
+			    struct output_stream_handle *s, double ratio);
+
+/* Trace latency of stream through output (see trace.h): the trace must be kept
+ * until the stream is removed.
+ */
+struct trace;
+int output_set_trace_stream(struct output_handle *h,
+			    struct output_stream_handle *s,
+			    struct trace *trace);
+
 /* Output stream status */
 unsigned long output_get_status_stream(struct output_handle *h,
 				       struct output_stream_handle *s,
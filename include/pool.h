@@ -0,0 +1,53 @@
+/*
+ * pool.h - Recycled buffers for audio hot paths
+ *
+ * Copyright (c) 2014   A. Dilly
+ *
+ * AirCat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * AirCat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with AirCat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _POOL_H
+#define _POOL_H
+
+#include <stddef.h>
+
+/**
+ * Buffers are sorted in size classes (powers of two from 32 bytes to 64 kB,
+ * plus a slack of 64 bytes for a small header next to a power of two buffer).
+ * A freed buffer is kept in a cache of the calling thread, and moved by
+ * batches to a global depot shared by all threads: once all streams have
+ * warmed up the classes they use, pool_alloc() and pool_free() don't call
+ * malloc() or free() anymore. Larger sizes are always allocated with
+ * malloc().
+ */
+void *pool_alloc(size_t size);
+
+/**
+ * Give back a buffer allocated with pool_alloc(). A NULL buffer is ignored.
+ */
+void pool_free(void *ptr);
+
+/**
+ * Counters since start: "allocs" is the count of pool_alloc() calls, while
+ * "mallocs" and "frees" are the real malloc() and free() calls done by the
+ * pool. These two last values don't change during steady state playback.
+ */
+struct pool_stats {
+	unsigned long allocs;
+	unsigned long mallocs;
+	unsigned long frees;
+};
+
+void pool_get_stats(struct pool_stats *stats);
+
+#endif
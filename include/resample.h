@@ -23,16 +23,72 @@
 
 struct resample_handle;
 
+/**
+ * Resampler quality recipes (see libsoxr recipes). A higher quality costs more
+ * CPU time and adds more delay. RESAMPLE_DEFAULT lets the owner of the stream
+ * choose (the output configuration, then RESAMPLE_HIGH).
+ */
+enum resample_quality {
+	RESAMPLE_DEFAULT = 0,
+	RESAMPLE_QUICK,
+	RESAMPLE_LOW,
+	RESAMPLE_MEDIUM,
+	RESAMPLE_HIGH,
+	RESAMPLE_VERY_HIGH
+};
+
+/**
+ * Resampler profile of a stream:
+ *  - quality: recipe used by the converter,
+ *  - threads: number of threads used by libsoxr (0 is the default value),
+ *  - variable_rate: allow fine rate changes with resample_set_ratio() (to
+ *    follow the clock of a sender), which costs more CPU time.
+ */
+struct resample_profile {
+	enum resample_quality quality;
+	unsigned int threads;
+	int variable_rate;
+};
+
+/**
+ * Get quality from its name ("quick", "low", "medium", "high" or
+ * "very-high"). RESAMPLE_DEFAULT is returned when name is unknown or NULL.
+ */
+enum resample_quality resample_quality_from_name(const char *name);
+const char *resample_quality_name(enum resample_quality quality);
+
+/**
+ * Open a new resampler. The profile can be NULL to use default values.
+ */
 int resample_open(struct resample_handle **h, unsigned long in_samplerate,
 		  unsigned char in_channels, unsigned long out_samplerate,
-		  unsigned char out_channels, a_read_cb input_callback,
-		  a_write_cb output_callback, void *user_data);
+		  unsigned char out_channels,
+		  const struct resample_profile *profile,
+		  a_read_cb input_callback, a_write_cb output_callback,
+		  void *user_data);
 int resample_read(void *h, unsigned char *buffer, size_t size,
 		  struct a_format *fmt);
 ssize_t resample_write(void *h, const unsigned char *buffer, size_t size,
 		       struct a_format *fmt);
 unsigned long resample_delay(struct resample_handle *h);
+
+/* Samples given to resample_write() in input format are passed as is to the
+ * output callback (same format on both sides and no pending samples): a writer
+ * can then fill output memory directly. */
+int resample_is_bypass(struct resample_handle *h);
+
+/**
+ * Change output rate by a ratio close to 1 (bounded to +/- 1%): a ratio above 1
+ * produces more output samples, so input is consumed slower. It fails when
+ * the resampler has not been opened with a variable rate profile.
+ */
+int resample_set_ratio(struct resample_handle *h, double ratio);
 void resample_flush(struct resample_handle *h);
+
+/* Trace latency of samples through converter (see trace.h) */
+struct trace;
+void resample_set_trace(struct resample_handle *h, struct trace *trace);
+
 int resample_close(struct resample_handle *h);
 
 #endif
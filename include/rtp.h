@@ -29,6 +29,9 @@
 #define RTP_LOST_PACKET -1
 #define RTP_DISCARDED_PACKET -2
 
+/* Size of a RTP header without CSRC */
+#define RTP_HEADER_SIZE 12
+
 struct rtp_attr {
 	/* RTP configuration */
 	unsigned char *ip;
@@ -44,6 +47,14 @@ struct rtp_attr {
 	uint16_t pool_packet_count;	// Pool of allocated packets
 	uint16_t delay_packet_count;	// Delay of jitter buffer (fixed in
 					//  packet count)
+	int adaptive;			// Adaptive delay: the delay follows
+					//  observed jitter, from
+					//  min_delay_packet_count up to
+					//  delay_packet_count (needs
+					//  clock_rate)
+	uint16_t min_delay_packet_count;// Minimum delay in adaptive mode
+	unsigned long clock_rate;	// RTP timestamp rate (in Hz) for
+					//  jitter: 0 if unknown
 	unsigned char resent_ratio;	// Packet resent threshold event (%)
 					//  max is 80% of delay_packet_count.
 	unsigned char fill_ratio;	/*!< Packet count threshold (in %) 
@@ -70,13 +81,32 @@ struct rtp_attr {
 	size_t (*cust_cb)(void *, unsigned char *, size_t);
 	void *cust_data;
 	/* Resent callback:
-	 *   This function is called when a packet has not been received after
-	 *   the `resent` delay.
+	 *   This function is called with ranges of missing packets (first
+	 *   sequence number and count): nearby missing packets are merged in
+	 *   a range, which can include some received packets. Requests are
+	 *   sent at most once per round trip time, and packets which would
+	 *   arrive after being played are not requested.
 	 */
 	void (*resent_cb)(void *, unsigned int, unsigned int);
 	void *resent_data;
 };
 
+/* Reception statistics (RFC 3550 section 6.4.1) */
+struct rtp_stats {
+	unsigned long received;		// Packets received
+	unsigned long lost;		// Packets lost (expected - received)
+	unsigned char fraction_lost;	// Lost since last call (on 256)
+	unsigned long jitter;		// Interarrival jitter (timestamp units)
+	uint16_t delay_packet_count;	// Current delay of jitter buffer
+	unsigned long inserted;		// Silences inserted to grow delay
+	unsigned long dropped;		// Packets dropped to shrink delay
+	unsigned long resend_requested;	// Missing packets requested
+	unsigned long resend_received;	// Requested packets received
+	unsigned long resend_skipped;	// Missing packets not requested since
+					//  they would arrive after their play
+	unsigned long rtt;		// Round trip time of resends (in ms)
+};
+
 struct rtp_handle;
 
 int rtp_open(struct rtp_handle **h, struct rtp_attr *attr);
@@ -85,6 +115,21 @@ ssize_t rtp_read(struct rtp_handle *h, unsigned char *buffer, size_t len);
 int rtp_put(struct rtp_handle *h, unsigned char *buffer, size_t len);
 ssize_t rtp_send_rtcp(struct rtp_handle *h, unsigned char *buffer, size_t len);
 void rtp_flush(struct rtp_handle *h, uint16_t seq, uint32_t ts);
+int rtp_get_stats(struct rtp_handle *h, struct rtp_stats *stats);
+/* Get RTP timestamp of packet returned by last rtp_read() call: -1 is returned
+ * when it returned no packet (buffering, lost or inserted silence).
+ */
+int rtp_get_read_timestamp(struct rtp_handle *h, uint32_t *ts);
+
+/* Get arrival time (see trace_now()) of packet returned by last rtp_read()
+ * call: -1 is returned when it returned no packet or tracing was disabled when
+ * the packet has been received.
+ */
+int rtp_get_read_time(struct rtp_handle *h, uint64_t *time);
 int rtp_close(struct rtp_handle *h);
 
+/* Fill a RTP header (RTP_HEADER_SIZE bytes) for sending */
+size_t rtp_set_header(unsigned char *buffer, uint8_t payload, int marker,
+		      uint16_t seq, uint32_t timestamp, uint32_t ssrc);
+
 #endif
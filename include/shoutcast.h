@@ -80,6 +80,22 @@ enum shout_status shoutcast_get_status(struct shout_handle *h);
 
 int shoutcast_get_filling(struct shout_handle *h);
 
+/**
+ * Fast start (enabled by default): playback starts as soon as the buffered
+ * data and the download rate allow to play without underrun, instead of
+ * waiting for the whole cache. The cache then keeps filling in background.
+ */
+int shoutcast_set_fast_start(struct shout_handle *h, int enable);
+
+/**
+ * Standby: a stream which is not played is kept connected by an internal
+ * thread, and its cache always holds the latest audio (oldest data is dropped
+ * when it is full). When standby is disabled, the stream is resynchronized and
+ * can be played again almost immediately. It is only available for a stream
+ * opened without internal thread, and it must not be read while in standby.
+ */
+int shoutcast_set_standby(struct shout_handle *h, int enable);
+
 int shoutcast_play(struct shout_handle *h);
 
 int shoutcast_pause(struct shout_handle *h);
@@ -90,8 +106,49 @@ unsigned long shoutcast_skip(struct shout_handle *h, unsigned long skip);
 
 void shoutcast_reset(struct shout_handle *h);
 
+/**
+ * Set / get the memory used by the pause buffer of a stream (in bytes): when
+ * it is exceeded, the pause buffer is continued in a temporary file. A size of
+ * 0 selects the default size.
+ */
+void shoutcast_set_pause_ram(size_t size);
+size_t shoutcast_get_pause_ram(void);
+
 int shoutcast_close(struct shout_handle *h);
 
+/**
+ * Relay: the live stream is served again to local listeners from the single
+ * upstream connection, without decoding it. A listener gets the compressed
+ * audio and, if metadata is requested, ICY metadata inserted every
+ * SHOUT_RELAY_METAINT bytes. Listeners are not affected by pause and skip of
+ * local playback, and can be read from any thread: a listener stays valid
+ * after the stream is closed and then reaches its end.
+ */
+#define SHOUT_RELAY_METAINT 16000
+
+struct shout_listener;
+
+struct shout_listener *shoutcast_listen(struct shout_handle *h, int metadata);
+
+/**
+ * Read next bytes for listener, waiting up to timeout ms for new data. 0 is
+ * returned on timeout and -1 at end of stream. With a timeout of 0, the call
+ * never blocks.
+ */
+ssize_t shoutcast_listen_read(struct shout_listener *l, unsigned char *buffer,
+			      size_t size, unsigned long timeout);
+
+/**
+ * Set a callback called when new data or end of stream is available for
+ * listener, to read it without blocking. It is called from the stream thread
+ * with the relay locked: it must not call any listener function.
+ */
+typedef void (*shout_wake_cb)(void *user_data);
+void shoutcast_listen_set_wake(struct shout_listener *l, shout_wake_cb cb,
+			       void *user_data);
+
+void shoutcast_unlisten(struct shout_listener *l);
+
 /* Shoutcast event */
 enum shoutcast_event {
 	SHOUT_EVENT_READY,	/*!< Cache is full */
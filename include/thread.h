@@ -0,0 +1,63 @@
+/*
+ * thread.h - Scheduling, CPU affinity and names of threads
+ *
+ * Copyright (c) 2014   A. Dilly
+ *
+ * AirCat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * AirCat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with AirCat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _THREAD_H
+#define _THREAD_H
+
+#include "json.h"
+
+/**
+ * Thread classes: each class has its own scheduling policy, priority and CPU
+ * affinity. Audio threads which must never starve are THREAD_OUTPUT (ALSA
+ * mixer and premix workers) and THREAD_CACHE (cache fill threads). All
+ * threads which are not part of the audio path (library scan, HTTP clients,
+ * timers, ...) are in THREAD_DEFAULT.
+ */
+enum thread_class {
+	THREAD_OUTPUT,
+	THREAD_CACHE,
+	THREAD_DEMUX,
+	THREAD_RTSP,
+	THREAD_DEFAULT,
+	THREAD_CLASS_COUNT
+};
+
+/**
+ * Apply settings of a class to calling thread and name it (the name is
+ * truncated to 15 characters and shown by "top -H" or "ps -L"). It must be
+ * called at start of each thread. A failure (missing privilege for realtime
+ * scheduling or a bad CPU) is reported once and the thread keeps running with
+ * default settings.
+ */
+void thread_setup(enum thread_class class, const char *name);
+
+/**
+ * Configuration: an object for each class ("output", "cache", "demux", "rtsp"
+ * and "default") with:
+ *  - "policy": "other" (default), "fifo" or "rr",
+ *  - "priority": realtime priority (1 to 99) for "fifo" and "rr",
+ *  - "cpus": CPU list as "0,2-3" (all CPUs when empty),
+ * and "lock_memory" to lock all memory of the process in RAM (mlockall()),
+ * so audio buffers are never paged out.
+ * Class settings are applied to threads started after the change: a stream
+ * must be restarted to use them.
+ */
+int thread_set_config(struct json *cfg);
+struct json *thread_get_config(void);
+
+#endif
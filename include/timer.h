@@ -37,6 +37,7 @@ enum timer_type {
 	TIMER_PERIODIC,
 	TIMER_DATE,
 	TIMER_TIME,
+	TIMER_DELAY,
 };
 
 struct timer_handle;
@@ -52,6 +53,8 @@ typedef int (*timer_event_cb)(void *);
  *             day = 0
  * TIMER_TIME: value = minute of day since midnight (in second)
  *             day = day of week when to do event
+ * TIMER_DELAY: same as TIMER_ONE_SHUT but value is in ms
+ *              day = 0
  */
 int timer_event_add(struct timer_handle *h, const char *name,
 		    const char *description, timer_event_cb cb, void *user_data,
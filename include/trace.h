@@ -0,0 +1,90 @@
+/*
+ * trace.h - Audio latency tracing
+ *
+ * Copyright (c) 2014   A. Dilly
+ *
+ * AirCat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * AirCat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with AirCat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "httpd.h"
+
+/**
+ * Stage boundaries crossed by audio of a stream, in pipeline order. Each stage
+ * marks the samples it gives to next stage: the latency of a stage is the time
+ * between the moment a sample left previous stage and the moment it left this
+ * one. The input stage marks when data has entered the pipeline (arrival of an
+ * RTP packet or frame read by demuxer) and play stage marks when samples are
+ * heard (ALSA write time plus device delay).
+ */
+enum trace_stage {
+	TRACE_INPUT,
+	TRACE_DECODE,
+	TRACE_RESAMPLE,
+	TRACE_CACHE_WRITE,
+	TRACE_CACHE_READ,
+	TRACE_MIX,
+	TRACE_WRITE,
+	TRACE_PLAY,
+	TRACE_STAGE_COUNT
+};
+
+struct trace;
+
+/**
+ * Create a trace for a stream: it is listed in trace URLs until it is freed.
+ * Memory for marks is only allocated when tracing is enabled.
+ */
+struct trace *trace_new(const char *name);
+void trace_free(struct trace *t);
+
+/**
+ * Forget positions of all stages: it must be called when buffered samples are
+ * dropped (flush or seek).
+ */
+void trace_reset(struct trace *t);
+
+/* Tracing is disabled by default and enabled with URLs */
+int trace_is_enabled(void);
+
+/* Get monotonic time (in ns) */
+uint64_t trace_now(void);
+
+/**
+ * Mark size samples (of all channels together, as in audio callbacks) which
+ * left a stage at time. trace_mark() uses current time.
+ */
+void trace_mark_at(struct trace *t, enum trace_stage stage, size_t size,
+		   unsigned long samplerate, unsigned char channels,
+		   uint64_t time);
+void trace_mark(struct trace *t, enum trace_stage stage, size_t size,
+		unsigned long samplerate, unsigned char channels);
+
+/**
+ * Mark a stage which converts samples from one format to another: in_size
+ * samples have been consumed and out_size samples have been produced.
+ */
+void trace_mark_convert(struct trace *t, enum trace_stage stage,
+			size_t in_size, unsigned long in_samplerate,
+			unsigned char in_channels, size_t out_size,
+			unsigned long out_samplerate,
+			unsigned char out_channels);
+
+extern struct url_table trace_urls[];
+
+#endif
@@ -19,6 +19,7 @@
 #ifndef _UTILS_H
 #define _UTILS_H
 
+#include <stdint.h>
 #include <dirent.h>
 #include <sys/stat.h>
 
@@ -30,6 +31,12 @@ int base64_decode(char *buffer);
 unsigned char *md5_encode(const unsigned char *buffer, long length);
 char *md5_encode_str(const unsigned char *buffer, long length);
 
+/* FNV-1a hash (64 bits) of data: hash is UTILS_FNV1A_INIT for the first data,
+ * or the hash returned for previous data to hash them together.
+ */
+#define UTILS_FNV1A_INIT 0xcbf29ce484222325ULL
+uint64_t utils_hash_fnv1a(uint64_t hash, const void *data, size_t len);
+
 /* URL parser */
 enum { URL_HTTP, URL_HTTPS };
 int parse_url(const char *url, int *protocol, char **hostname,
@@ -67,5 +74,29 @@ int _scandir(const char *path, struct _dirent ***list,
 	     int (*selector)(const struct dirent *, const struct stat *),
 	     int (*compar)(const struct _dirent **, const struct _dirent **));
 
+/* Directory iterator: entries are read by large batches with getdents64() and
+ * their type (DT_*) is taken from the directory, so a tree can be walked
+ * without any stat. The entries . and .. are skipped and an entry is valid
+ * until the next read. Sub-directories and stats are resolved relative to the
+ * directory, so no full path is needed: dir_iter_stat() with a NULL entry gets
+ * the status of the directory itself.
+ */
+#define DIR_ITER_BUFFER_SIZE 32768
+
+struct dir_entry {
+	ino_t inode;
+	unsigned char type;
+	size_t name_len;
+	const char *name;
+};
+
+struct dir_iter;
+struct dir_iter *dir_iter_open(const char *path);
+struct dir_iter *dir_iter_openat(struct dir_iter *parent, const char *name);
+struct dir_entry *dir_iter_read(struct dir_iter *it);
+int dir_iter_stat(struct dir_iter *it, const struct dir_entry *e,
+		  struct stat *st, int follow);
+void dir_iter_close(struct dir_iter *it);
+
 #endif
 
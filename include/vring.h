@@ -21,15 +21,25 @@
 
 struct vring_handle;
 
+/**
+ * Open flags:
+ *  - VRING_SPSC: only one thread reads and only one thread writes, so no lock
+ *    is taken: positions are exchanged with acquire/release atomics.
+ */
+#define VRING_SPSC 1
+
 /**
  * Open a new Virtual Ring buffer of buffer_size bytes with a direct read/write
  * of maximum max_rw_size bytes.
- * The allocated memory is buffer_size + max_rw_size bytes.
+ * When memfd_create() is available, the buffer is mapped twice back to back
+ * so no copy is done on overlap and buffer_size is rounded up to a page.
+ * Otherwise, the allocated memory is buffer_size + max_rw_size bytes.
  * All functions are thread-safe but a read/write access must be unique
  * since a direct access is performed.
+ * Flags is a combination of VRING_* flags.
  */
 int vring_open(struct vring_handle **handle, size_t buffer_size,
-	       size_t max_rw_size);
+	       size_t max_rw_size, int flags);
 
 /**
  * Get current data length in buffer.
@@ -61,6 +71,22 @@ ssize_t vring_write(struct vring_handle *h, unsigned char **buffer);
  */
 ssize_t vring_write_forward(struct vring_handle *h, size_t len);
 
+/**
+ * Wait until at least len bytes can be read (resp. written) or timeout (in ms)
+ * expires. With a timeout of 0, wait until the condition is met or
+ * vring_wake() is called. Readable (resp. writable) length is returned, which
+ * can be smaller than len on timeout or wake up.
+ */
+size_t vring_wait_readable(struct vring_handle *h, size_t len,
+			   unsigned long timeout);
+size_t vring_wait_writable(struct vring_handle *h, size_t len,
+			   unsigned long timeout);
+
+/**
+ * Wake up all threads currently waiting in vring_wait_*().
+ */
+void vring_wake(struct vring_handle *h);
+
 /**
  * Close Virtual Ring buffer and deallocate memory.
  */
@@ -19,6 +19,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <pthread.h>
 
 #include <openssl/bio.h>
@@ -33,6 +34,9 @@
 #include "sdp.h"
 #include "output.h"
 #include "utils.h"
+#include "image.h"
+#include "trace.h"
+#include "thread.h"
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
@@ -40,6 +44,9 @@
 
 #define BUFFER_SIZE 512
 #define AIRTUNES_ID_SIZE 10
+#define AIRTUNES_MAX_CLIENTS 2
+#define AIRTUNES_DECODE_CACHE 100
+#define AIRTUNES_SYNC_INTERVAL 250
 #define MAX_VOLUME OUTPUT_VOLUME_MAX
 
 #define AIRPORT_PRIVATE_KEY \
@@ -77,6 +84,8 @@ enum {
 struct airtunes_stream {
 	/* Output stream */
 	struct output_stream_handle *stream;
+	/* RAOP server (for clock synchronization) */
+	struct raop_handle *raop;
 	/* Stream id */
 	char id[AIRTUNES_ID_SIZE+1];
 	/* Stream name */
@@ -104,6 +113,8 @@ struct airtunes_client_data {
 	/* Audio output handlers */
 	struct raop_handle *raop;
 	struct output_stream_handle *stream;
+	/* Latency tracing */
+	struct trace *trace;
 	/* AES key and IV */
 	unsigned char *aes_key;
 	unsigned char aes_iv[16];
@@ -129,15 +140,22 @@ struct airtunes_handle{
 	/* Avahi client */
 	struct avahi_handle *avahi;
 	int local_avahi;
+	pthread_t avahi_thread;
+	char *service_name;
 	unsigned char hw_addr[6];
 	/* Output module */
 	struct output_handle *output;
 	/* Airtunes */
 	char *name;
 	unsigned int port;
+	unsigned int max_clients;
 	char *password;
 	int status;
 	int reload;
+	int adaptive;
+	int clock_sync;
+	unsigned long decode_cache;
+	struct resample_profile profile;
 	/* RSA private key */
 	RSA *rsa;
 	/* RTSP server */
@@ -179,8 +197,16 @@ static int airtunes_open(struct airtunes_handle **handle,
 	h->reload = 0;
 	h->name = NULL;
 	h->port = 5000;
+	h->max_clients = AIRTUNES_MAX_CLIENTS;
+	h->service_name = NULL;
 	h->password = NULL;
+	h->adaptive = 0;
+	h->clock_sync = 0;
+	h->decode_cache = AIRTUNES_DECODE_CACHE;
 	h->streams = NULL;
+	h->profile.quality = RESAMPLE_DEFAULT;
+	h->profile.threads = 0;
+	h->profile.variable_rate = 0;
 	memcpy(h->hw_addr, buf, 6);
 
 	/* Allocate a local avahi client if no avahi has been passed */
@@ -209,17 +235,77 @@ static int airtunes_open(struct airtunes_handle **handle,
 	return 0;
 }
 
+static void airtunes_add_service(struct airtunes_handle *h)
+{
+	avahi_add_service(h->avahi, h->service_name, "_raop._tcp", h->port,
+			  "tp=TCP,UDP", "sm=false", "sv=false", "ek=1",
+			  "et=0,1", "cn=0,1", "ch=2", "ss=16", "sr=44100",
+			  "pw=false", "vn=3", "md=0,1,2", "txtvers=1", NULL);
+}
+
+static void *airtunes_avahi_thread(void *user_data)
+{
+	struct airtunes_handle *h = (struct airtunes_handle*) user_data;
+
+	/* Set thread scheduling and name */
+	thread_setup(THREAD_DEFAULT, "airtunes-avahi");
+
+	/* Register the service with local Avahi client */
+	airtunes_add_service(h);
+
+	/* Run Avahi loop until RTSP server stops */
+	while(h->status != AIRTUNES_STOPPING && h->status != AIRTUNES_STOPPED)
+		avahi_loop(h->avahi, 500);
+
+	/* Remove the service */
+	avahi_remove_service(h->avahi, h->service_name, h->port);
+	avahi_loop(h->avahi, 10);
+
+	return NULL;
+}
+
+static void airtunes_sync(struct airtunes_handle *h)
+{
+	struct airtunes_stream *s;
+	unsigned long delay;
+	double ratio;
+
+	/* Lock mutex */
+	pthread_mutex_lock(&h->mutex);
+
+	/* Synchronize playing streams on their sender clock */
+	for(s = h->streams; s != NULL; s = s->next)
+	{
+		if(s->raop == NULL || s->stream == NULL ||
+		   output_get_status_stream(h->output, s->stream,
+					    OUTPUT_STREAM_STATUS) !=
+							    STREAM_PLAYING)
+			continue;
+
+		/* Get output delay and correct playback rate */
+		delay = output_get_status_stream(h->output, s->stream,
+						 OUTPUT_STREAM_DELAY);
+		if(raop_sync(s->raop, delay, &ratio) == 0)
+			output_set_ratio_stream(h->output, s->stream, ratio);
+	}
+
+	/* Unlock mutex */
+	pthread_mutex_unlock(&h->mutex);
+}
+
 static void *airtunes_thread(void *user_data)
 {
 	struct airtunes_handle *h = (struct airtunes_handle*) user_data;
-	char *name;
-	int port;
-	int i;
+	struct timespec now, last = { 0, 0 };
+	int avahi_thread = 0;
+
+	/* Set thread scheduling and name */
+	thread_setup(THREAD_RTSP, "airtunes-rtsp");
 
 	/* Open RTSP server */
-	port = h->port;
-	if(rtsp_open(&h->rtsp, port, 2, &airtunes_request_callback, 
-		     &airtunes_read_callback, &airtunes_close_callback, h) < 0)
+	if(rtsp_open(&h->rtsp, h->port, h->max_clients,
+		     &airtunes_request_callback, &airtunes_read_callback,
+		     &airtunes_close_callback, h) < 0)
 	{
 		h->status = AIRTUNES_STOPPED;
 		return NULL;
@@ -228,14 +314,19 @@ static void *airtunes_thread(void *user_data)
 	/* Lock mutex */
 	pthread_mutex_lock(&h->mutex);
 
-	/* Register the service with Avahi */
-	asprintf(&name, "%02x%02x%02x%02x%02x%02x@%s", h->hw_addr[0],
-		 h->hw_addr[1], h->hw_addr[2], h->hw_addr[3], h->hw_addr[4],
-		 h->hw_addr[5], h->name);
-	avahi_add_service(h->avahi, name, "_raop._tcp", h->port, "tp=TCP,UDP",
-			  "sm=false", "sv=false", "ek=1", "et=0,1", "cn=0,1",
-			  "ch=2", "ss=16", "sr=44100", "pw=false", "vn=3",
-			  "md=0,1,2", "txtvers=1", NULL);
+	/* Generate service name */
+	asprintf(&h->service_name, "%02x%02x%02x%02x%02x%02x@%s",
+		 h->hw_addr[0], h->hw_addr[1], h->hw_addr[2], h->hw_addr[3],
+		 h->hw_addr[4], h->hw_addr[5], h->name);
+
+	/* Register the service with Avahi: a local Avahi client runs in its
+	 * own thread to not delay RTSP requests
+	 */
+	if(!h->local_avahi)
+		airtunes_add_service(h);
+	else if(pthread_create(&h->avahi_thread, NULL, airtunes_avahi_thread,
+			       h) == 0)
+		avahi_thread = 1;
 
 	/* Unlock mutex */
 	pthread_mutex_unlock(&h->mutex);
@@ -244,23 +335,37 @@ static void *airtunes_thread(void *user_data)
 	if(h->status != AIRTUNES_STOPPING)
 		h->status = AIRTUNES_RUNNING;
 
-	/* Run RTSP server loop */
+	/* Run RTSP server loop (timeout is used to check status and to
+	 * synchronize streams)
+	 */
 	while(h->status != AIRTUNES_STOPPING && h->status != AIRTUNES_STOPPED)
 	{
-		if(rtsp_loop(h->rtsp, 1000) != 0)
+		if(rtsp_loop(h->rtsp, h->clock_sync ? AIRTUNES_SYNC_INTERVAL :
+						      1000) != 0)
 			break;
-		if(h->local_avahi)
-			avahi_loop(h->avahi, 10);
+
+		/* Synchronize streams periodically */
+		if(!h->clock_sync)
+			continue;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if((now.tv_sec - last.tv_sec) * 1000 +
+		   (now.tv_nsec - last.tv_nsec) / 1000000 <
+							 AIRTUNES_SYNC_INTERVAL)
+			continue;
+		airtunes_sync(h);
+		last = now;
 	}
 	h->status = AIRTUNES_STOPPING;
 
 	/* Remove the service */
-	avahi_remove_service(h->avahi, name, port);
-	if(h->local_avahi)
-		avahi_loop(h->avahi, 10);
+	if(avahi_thread)
+		pthread_join(h->avahi_thread, NULL);
+	else if(!h->local_avahi)
+		avahi_remove_service(h->avahi, h->service_name, h->port);
 
 	/* Free name */
-	free(name);
+	free(h->service_name);
+	h->service_name = NULL;
 
 	/* Close RTSP server */
 	rtsp_close(h->rtsp);
@@ -316,6 +421,13 @@ static int airtunes_set_config(struct airtunes_handle *h, const struct json *c)
 		free(h->password);
 	h->name = NULL;
 	h->password = NULL;
+	h->adaptive = 0;
+	h->max_clients = AIRTUNES_MAX_CLIENTS;
+	h->clock_sync = 0;
+	h->decode_cache = AIRTUNES_DECODE_CACHE;
+	h->profile.quality = RESAMPLE_DEFAULT;
+	h->profile.threads = 0;
+	h->profile.variable_rate = 0;
 
 	/* Parse config */
 	if(c != NULL)
@@ -327,6 +439,26 @@ static int airtunes_set_config(struct airtunes_handle *h, const struct json *c)
 		password = json_get_string(c, "password");
 		if(password != NULL && *password != '\0')
 			h->password = strdup(password);
+
+		/* Get adaptive latency (follow network jitter) */
+		h->adaptive = json_get_bool(c, "adaptive_latency");
+
+		/* Get clock synchronization (play on sender clock) */
+		h->clock_sync = json_get_bool(c, "clock_sync");
+
+		/* Get maximum concurrent senders (used on next start) */
+		if(json_get_int(c, "max_clients") > 0)
+			h->max_clients = json_get_int(c, "max_clients");
+
+		/* Get decoded audio cache (in ms, 0 to decode in mixer) */
+		if(json_has_key(c, "decode_cache") &&
+		   json_get_int(c, "decode_cache") >= 0)
+			h->decode_cache = json_get_int(c, "decode_cache");
+
+		/* Get resampler profile */
+		h->profile.quality = resample_quality_from_name(
+				       json_get_string(c, "resample_quality"));
+		h->profile.threads = json_get_int(c, "resample_threads");
 	}
 
 	/* Set default values */
@@ -353,6 +485,13 @@ static struct json *airtunes_get_config(struct airtunes_handle *h)
 	/* Set name and password */
 	json_set_string(c, "name", h->name);
 	json_set_string(c, "password", h->password);
+	json_set_bool(c, "adaptive_latency", h->adaptive);
+	json_set_bool(c, "clock_sync", h->clock_sync);
+	json_set_int(c, "max_clients", h->max_clients);
+	json_set_int(c, "decode_cache", h->decode_cache);
+	json_set_string(c, "resample_quality",
+			resample_quality_name(h->profile.quality));
+	json_set_int(c, "resample_threads", h->profile.threads);
 
 	/* Unlock mutex */
 	pthread_mutex_unlock(&h->mutex);
@@ -577,7 +716,9 @@ static int airtunes_request_callback(struct rtsp_client *c, int request,
 	struct airtunes_handle *h = (struct airtunes_handle *) user_data;
 	struct airtunes_client_data *cdata = (struct airtunes_client_data *)
 							  rtsp_get_user_data(c);
+	struct resample_profile profile;
 	struct raop_attr attr;
+	unsigned long cache;
 	char buffer[BUFFER_SIZE];
 	char *username;
 	const char *str;
@@ -675,25 +816,48 @@ static int airtunes_request_callback(struct rtsp_client *c, int request,
 			attr.codec = cdata->codec;
 			attr.format = cdata->format;
 			attr.ip = rtsp_get_ip(c);
+			attr.adaptive = h->adaptive;
+			attr.sync = h->clock_sync;
 
 			/* Launch RAOP Server */
 			raop_open(&cdata->raop, &attr);
 			cdata->port = attr.port;
 
+			/* Trace latency from packet arrival to ALSA */
+			if(cdata->trace == NULL)
+				cdata->trace = trace_new(cdata->infos->name);
+			raop_set_trace(cdata->raop, cdata->trace);
+
 			/* Get stream format */
 			cdata->samplerate = raop_get_samplerate(cdata->raop);
 			cdata->channels = raop_get_channels(cdata->raop);
 
-			/* Create audio stream output */
+			/* Get resampler profile and cache */
+			pthread_mutex_lock(&h->mutex);
+			profile = h->profile;
+			profile.variable_rate = h->clock_sync;
+			cache = h->decode_cache;
+			pthread_mutex_unlock(&h->mutex);
+
+			/* Create audio stream output: with a cache, packets are
+			 * received, decrypted and decoded by the cache thread
+			 * and the mixer only copies decoded samples, so network
+			 * jitter doesn't delay audio output.
+			 */
 			cdata->stream = output_add_stream(h->output,
 							  cdata->infos->name,
 							  cdata->samplerate,
-							  cdata->channels, 0, 0,
+							  cdata->channels,
+							  cache, cache != 0,
+							  &profile,
 							  &raop_read,
 							  cdata->raop);
+			output_set_trace_stream(h->output, cdata->stream,
+						cdata->trace);
 
 			/* Copy output stream handle in stream structure */
 			cdata->infos->stream = cdata->stream;
+			cdata->infos->raop = cdata->raop;
 
 			/* Send answer */
 			RESPONSE_BEGIN(c, h->hw_addr);
@@ -736,11 +900,14 @@ static int airtunes_request_callback(struct rtsp_client *c, int request,
 			/* Stop stream */
 			output_remove_stream(h->output, cdata->stream);
 			cdata->infos->stream = NULL;
+			cdata->infos->raop = NULL;
 			cdata->stream = NULL;
 
 			/* Close raop */
 			raop_close(cdata->raop);
 			cdata->raop = NULL;
+			trace_free(cdata->trace);
+			cdata->trace = NULL;
 
 			RESPONSE_BEGIN(c, h->hw_addr);
 			break;
@@ -1140,7 +1307,9 @@ static int airtunes_close_callback(struct rtsp_client *c, void *user_data)
 		/* Stop stream */
 		output_remove_stream(h->output, cdata->stream);
 		cdata->infos->stream = NULL;
+		cdata->infos->raop = NULL;
 		raop_close(cdata->raop);
+		trace_free(cdata->trace);
 
 		/* Remove info stream */
 		airtunes_remove_stream(h, cdata->infos);
@@ -1220,6 +1389,9 @@ static int airtunes_httpd_img(void *user_data, struct httpd_req *req,
 {
 	struct airtunes_handle *h = user_data;
 	struct airtunes_stream *s;
+	unsigned char *thumb;
+	const char *value;
+	size_t thumb_len;
 
 	/* Check id from URL */
 	if(req->resource == NULL)
@@ -1246,12 +1418,29 @@ static int airtunes_httpd_img(void *user_data, struct httpd_req *req,
 		return 404;
 	}
 
-	/* Create response */
-	*res = httpd_new_data_response(s->img, s->img_len, 1, 1);
+	/* Create a thumbnail when a size is requested */
+	value = httpd_get_query(req, "size");
+	if(value != NULL && strtoul(value, NULL, 10) > 0 &&
+	   image_thumbnail(s->img, s->img_len,
+			   image_thumbnail_size(strtoul(value, NULL, 10)),
+			   &thumb, &thumb_len) == 0)
+	{
+		/* Create response with thumbnail */
+		*res = httpd_new_data_response(thumb, thumb_len, 1, 0);
 
-	/* Add content type */
-	if(s->img_type != NULL)
-		httpd_add_header(*res, HTTPD_HEADER_CONTENT_TYPE, s->img_type);
+		/* Add content type */
+		httpd_add_header(*res, HTTPD_HEADER_CONTENT_TYPE, "image/jpeg");
+	}
+	else
+	{
+		/* Create response */
+		*res = httpd_new_data_response(s->img, s->img_len, 1, 1);
+
+		/* Add content type */
+		if(s->img_type != NULL)
+			httpd_add_header(*res, HTTPD_HEADER_CONTENT_TYPE,
+					 s->img_type);
+	}
 
 	/* Unlock mutex */
 	pthread_mutex_unlock(&h->mutex);
@@ -35,6 +35,9 @@
 		((b)[6] << 8 & 0x000000000000FF00) | \
 		((b)[7] & 0x00000000000000FF)
 
+/* Tag table: it must be kept sorted by tag (in byte order) since tags are
+ * looked up with a binary search.
+ */
 static struct dmap_tag {
 	const char *tag;
 	enum dmap_type type;
@@ -294,6 +297,27 @@ static struct dmap_tag {
 };
 static int dmap_tags_count = sizeof(dmap_tags) / sizeof(struct dmap_tag);
 
+static struct dmap_tag *dmap_find_tag(const unsigned char *tag)
+{
+	int first = 0, last = dmap_tags_count - 1;
+	int i, ret;
+
+	/* Binary search in sorted table */
+	while(first <= last)
+	{
+		i = (first + last) / 2;
+		ret = memcmp(tag, dmap_tags[i].tag, 4);
+		if(ret == 0)
+			return &dmap_tags[i];
+		if(ret < 0)
+			last = i - 1;
+		else
+			first = i + 1;
+	}
+
+	return NULL;
+}
+
 struct dmap {
 	/* Callbacks */
 	dmap_cb cb;
@@ -347,6 +371,7 @@ struct dmap *dmap_init(dmap_cb cb, dmap_in_cb in_cb, dmap_out_cb out_cb,
 
 int dmap_parse(struct dmap *d, unsigned char *buffer, size_t len)
 {
+	struct dmap_tag *tag;
 	unsigned char *data = NULL;
 	uint64_t value = 0;
 	size_t size = 0;
@@ -368,15 +393,12 @@ int dmap_parse(struct dmap *d, unsigned char *buffer, size_t len)
 				return 0;
 
 			/* Find tag */
-			for(i = 0; i < dmap_tags_count; i++)
+			tag = dmap_find_tag(d->header);
+			if(tag != NULL)
 			{
-				if(strncmp(d->header, dmap_tags[i].tag, 4) == 0)
-				{
-					d->full_tag = dmap_tags[i].full_tag;
-					d->type = dmap_tags[i].type;
-					d->tag = dmap_tags[i].tag;
-					break;
-				}
+				d->full_tag = tag->full_tag;
+				d->type = tag->type;
+				d->tag = tag->tag;
 			}
 
 			/* Get length */
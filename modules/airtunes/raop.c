@@ -19,16 +19,19 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <unistd.h>
 #include <pthread.h>
 
-#include <openssl/aes.h>
+#include <openssl/evp.h>
 
 #include "rtp.h"
 #include "raop_tcp.h"
 #include "decoder.h"
+#include "trace.h"
 #include "raop.h"
 
 #ifdef HAVE_CONFIG_H
@@ -41,10 +44,34 @@
 
 /* Default values for RTP module:
  *  RAOP_DEFAULT_POOL:  time allocated in memory (in ms),
- *  RAOP_DEFAULT_DELAY: delay of RTP output (in ms).
+ *  RAOP_DEFAULT_DELAY: delay of RTP output (in ms),
+ *  RAOP_MIN_DELAY: minimum delay of RTP output with adaptive latency (in ms).
  */
 #define RAOP_DEFAULT_POOL  1000
 #define RAOP_DEFAULT_DELAY 100
+#define RAOP_MIN_DELAY     200
+
+/* Clock synchronization:
+ *  RAOP_TIMING_SAMPLES: timing replies kept to find the best clock offset,
+ *  RAOP_TIMING_FAST: interval between first timing requests (in ms),
+ *  RAOP_TIMING_INTERVAL: interval between next timing requests (in ms),
+ *  RAOP_SYNC_RESET: error above which playout is moved at once (in ms),
+ *  RAOP_SYNC_SMOOTH: weight of a new error in smoothed error,
+ *  RAOP_SYNC_KP/KI: proportional and integral gains of drift correction,
+ *  RAOP_SYNC_MAX_RATIO: maximum correction of playback rate.
+ */
+#define RAOP_TIMING_SAMPLES  8
+#define RAOP_TIMING_FAST     200
+#define RAOP_TIMING_INTERVAL 2000
+#define RAOP_SYNC_RESET      50
+#define RAOP_SYNC_SMOOTH     0.25
+#define RAOP_SYNC_KP         0.05
+#define RAOP_SYNC_KI         0.005
+#define RAOP_SYNC_MAX_RATIO  0.002
+
+/* NTP time is a 32.32 fixed point number of seconds since 1900 */
+#define NTP_ONE (1ULL << 32)
+#define NTP_UNIX_OFFSET 2208988800ULL
 
 struct raop_handle {
 	/* Protocol handler */
@@ -52,7 +79,7 @@ struct raop_handle {
 	struct raop_tcp_handle *tcp;	// RAOP TCP server handle
 	struct rtp_handle *rtp;		// RTP Server handle
 	/* Crypto */
-	AES_KEY aes;			// AES Key
+	EVP_CIPHER_CTX *aes;		// AES context
 	unsigned char aes_iv[16];	// AES IV
 	/* Decoder */
 	struct decoder_handle *dec;	// Decoder structure
@@ -61,10 +88,34 @@ struct raop_handle {
 	unsigned long packet_len;
 	unsigned long pcm_remaining;
 	unsigned long silence_remaining;
+	/* Clock synchronization */
+	int sync;			// Playout follows sender clock
+	int timing_sock;		// Socket for timing requests
+	uint64_t timing_last;		// Time of last timing request
+	unsigned int timing_count;	// Timing requests sent
+	int64_t timing_offset[RAOP_TIMING_SAMPLES]; // Sender - local clock
+	uint64_t timing_rtt[RAOP_TIMING_SAMPLES]; // Round trip of requests
+	unsigned int timing_len;	// Timing replies saved
+	unsigned int timing_pos;	// Next timing reply position
+	int sync_valid;			// A sync packet has been received
+	uint32_t sync_rtp;		// RTP timestamp played at sync_ntp
+	uint64_t sync_ntp;		// Sender time of sync_rtp
+	int ts_valid;			// next_ts is known
+	uint32_t next_ts;		// RTP timestamp after last packet read
+	int synced;			// Playout has been aligned once
+	unsigned long drop_remaining;	// Samples to drop
+	double sync_error;		// Smoothed playout error (in s)
+	double sync_integral;		// Integral of playout error
+	uint64_t sync_last;		// Time of last synchronization
 	/* Stream properties */
 	unsigned long samplerate;
 	unsigned char channels;
 	unsigned long samples;
+	enum a_sample sample;
+	size_t sample_size;
+	/* Latency tracing */
+	struct trace *trace;
+	uint64_t packet_time;		// Arrival time of current packet
 	/* Mutex for read() calls */
 	pthread_mutex_t mutex;
 };
@@ -74,6 +125,131 @@ static size_t raop_cust_cb(void *user_data, unsigned char *buffer, size_t len);
 static void raop_rtcp_cb(void *user_data, unsigned char *buffer, size_t len);
 static void raop_resent_cb(void *user_data, unsigned int seq, unsigned count);
 
+static uint64_t raop_ntp_now(void)
+{
+	struct timespec now;
+
+	/* Local clock in NTP format: same time base than sender clock */
+	clock_gettime(CLOCK_REALTIME, &now);
+	return ((uint64_t) now.tv_sec + NTP_UNIX_OFFSET) << 32 |
+	       (((uint64_t) now.tv_nsec << 32) / 1000000000);
+}
+
+static uint64_t raop_get_ntp(const unsigned char *buffer)
+{
+	return ((uint64_t) buffer[0] << 56) | ((uint64_t) buffer[1] << 48) |
+	       ((uint64_t) buffer[2] << 40) | ((uint64_t) buffer[3] << 32) |
+	       ((uint64_t) buffer[4] << 24) | (buffer[5] << 16) |
+	       (buffer[6] << 8) | buffer[7];
+}
+
+static void raop_put_ntp(unsigned char *buffer, uint64_t ntp)
+{
+	int i;
+
+	for(i = 7; i >= 0; i--, ntp >>= 8)
+		buffer[i] = ntp;
+}
+
+static inline uint64_t raop_ms_to_ntp(unsigned long ms)
+{
+	return ((uint64_t) ms << 32) / 1000;
+}
+
+static int raop_timing_open(struct raop_handle *h, unsigned char *ip,
+			    unsigned int port)
+{
+	struct sockaddr_in addr;
+
+	/* Open socket */
+	h->timing_sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if(h->timing_sock < 0)
+		return -1;
+
+	/* Send requests to sender timing port: it replies to our port */
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	memcpy(&addr.sin_addr, ip, 4);
+	if(connect(h->timing_sock, (struct sockaddr *) &addr,
+		   sizeof(addr)) != 0)
+	{
+		close(h->timing_sock);
+		h->timing_sock = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void raop_timing_request(struct raop_handle *h, uint64_t now)
+{
+	unsigned char request[32];
+
+	/* Prepare timing request: only send time is set */
+	memset(request, 0, sizeof(request));
+	request[0] = 0x80; // RTP header
+	request[1] = 0xD2; // Payload 0x52 with marker bit
+	request[3] = 0x07; // Sequence number
+	raop_put_ntp(request + 24, now);
+
+	/* Send request */
+	send(h->timing_sock, request, sizeof(request), MSG_DONTWAIT);
+	h->timing_last = now;
+	h->timing_count++;
+}
+
+static void raop_timing_receive(struct raop_handle *h)
+{
+	unsigned char reply[32];
+	uint64_t t1, t2, t3, t4;
+	ssize_t len;
+
+	/* Get all timing replies */
+	while((len = recv(h->timing_sock, reply, sizeof(reply),
+			  MSG_DONTWAIT)) > 0)
+	{
+		/* Payload: 0x53 for "Timing reply" */
+		if(len != 32 || (reply[1] & 0x7F) != 0x53)
+			continue;
+		t4 = raop_ntp_now();
+
+		/* Get origin (our send time), receive and send times */
+		t1 = raop_get_ntp(reply + 8);
+		t2 = raop_get_ntp(reply + 16);
+		t3 = raop_get_ntp(reply + 24);
+		if(t1 == 0 || t1 > t4)
+			continue;
+
+		/* Save clock offset and round trip time */
+		h->timing_offset[h->timing_pos] = ((int64_t) (t2 - t1) +
+						   (int64_t) (t3 - t4)) / 2;
+		h->timing_rtt[h->timing_pos] = (t4 - t1) -
+					       (t3 > t2 ? t3 - t2 : 0);
+		h->timing_pos = (h->timing_pos + 1) % RAOP_TIMING_SAMPLES;
+		if(h->timing_len < RAOP_TIMING_SAMPLES)
+			h->timing_len++;
+	}
+}
+
+static int64_t raop_timing_offset(struct raop_handle *h)
+{
+	unsigned int i, best = 0;
+
+	/* No timing reply: sender and local clocks are expected to be set
+	 * on same time (by NTP)
+	 */
+	if(h->timing_len == 0)
+		return 0;
+
+	/* Use offset of fastest reply: it is the less disturbed by network */
+	for(i = 1; i < h->timing_len; i++)
+		if(h->timing_rtt[i] < h->timing_rtt[best])
+			best = i;
+
+	return h->timing_offset[best];
+}
+
 static void raop_prepare_pcm(unsigned char *header, char *format,
 			     unsigned long *sr, unsigned char *c,
 			     unsigned long *s)
@@ -204,17 +380,40 @@ int raop_open(struct raop_handle **handle, struct raop_attr *attr)
 	h->tcp = NULL;
 	h->rtp = NULL;
 	h->dec = NULL;
+	h->aes = NULL;
+	h->sync = attr->sync && attr->transport == RAOP_UDP;
+	h->timing_sock = -1;
+	h->timing_last = 0;
+	h->timing_count = 0;
+	h->timing_len = 0;
+	h->timing_pos = 0;
+	h->sync_valid = 0;
+	h->ts_valid = 0;
+	h->synced = 0;
+	h->drop_remaining = 0;
+	h->sync_error = 0;
+	h->sync_integral = 0;
+	h->sync_last = 0;
 	h->packet_len = 0;
 	h->pcm_remaining = 0;
 	h->silence_remaining = 0;
 	h->samples = 352;
+	h->trace = NULL;
+	h->packet_time = 0;
 
 	/* Init mutex */
 	pthread_mutex_init(&h->mutex, NULL);
 
-	/* Prepare openssl for AES */
-	AES_set_decrypt_key(attr->aes_key, 128, &h->aes);
+	/* Prepare openssl for AES: the EVP API uses hardware acceleration when
+	 * available (AES-NI, ARMv8 crypto extensions). Packets are not padded.
+	 */
 	memcpy(h->aes_iv, attr->aes_iv, sizeof(h->aes_iv));
+	h->aes = EVP_CIPHER_CTX_new();
+	if(h->aes == NULL ||
+	   EVP_DecryptInit_ex(h->aes, EVP_aes_128_cbc(), NULL, attr->aes_key,
+			      h->aes_iv) != 1)
+		return -1;
+	EVP_CIPHER_CTX_set_padding(h->aes, 0);
 
 	/* Prepare configuration */
 	switch(attr->codec)
@@ -262,6 +461,11 @@ int raop_open(struct raop_handle **handle, struct raop_attr *attr)
 					    h->samples / 1000;
 		r_attr.delay_packet_count = RAOP_DEFAULT_DELAY * h->samplerate /
 					    h->samples / 1000;
+		r_attr.adaptive = attr->adaptive;
+		r_attr.min_delay_packet_count = RAOP_MIN_DELAY *
+						h->samplerate / h->samples /
+						1000;
+		r_attr.clock_rate = h->samplerate;
 		r_attr.resent_ratio = 10;
 		r_attr.fill_ratio = 5;
 		r_attr.cust_cb = &raop_cust_cb;
@@ -278,6 +482,10 @@ int raop_open(struct raop_handle **handle, struct raop_attr *attr)
 				return -1;
 		}
 		attr->port = r_attr.port;
+
+		/* Open timing socket for clock synchronization */
+		if(h->sync && attr->timing_port != 0 && attr->ip != NULL)
+			raop_timing_open(h, attr->ip, attr->timing_port);
 	}
 
 	/* Open decoder */
@@ -285,21 +493,34 @@ int raop_open(struct raop_handle **handle, struct raop_attr *attr)
 		     &h->channels) != 0)
 		return -1;
 
+	/* Get 16-bit samples from decoder when possible: the resampler takes
+	 * them as is and no widening is done here.
+	 */
+	h->sample = SAMPLE_S16;
+	if(decoder_set_sample(h->dec, h->sample) != 0)
+		h->sample = SAMPLE_NATIVE;
+	h->sample_size = format_sample_size(h->sample);
+
 	return 0;
 }
 
 static int raop_get_next_packet(struct raop_handle *h)
 {
-	unsigned char packet[MAX_PACKET_SIZE];
-	unsigned char iv[16];
+	unsigned char *packet;
 	size_t in_size;
-	ssize_t read_len, aes_len;
+	ssize_t read_len;
+	int aes_len;
+
+	/* RTP packets are always read at buffer start */
+	if(h->transport != RAOP_TCP)
+		h->packet_len = 0;
 
 	in_size = MAX_PACKET_SIZE - h->packet_len;
 	if(in_size == 0)
 		return 0;
 
-	/* Read next packet */
+	/* Read next packet directly in input buffer */
+	packet = &h->packet[h->packet_len];
 	if(h->transport == RAOP_TCP)
 	{
 		/* Read packet from TCP */
@@ -311,7 +532,21 @@ static int raop_get_next_packet(struct raop_handle *h)
 		do{
 			read_len = rtp_read(h->rtp, packet, in_size);
 		} while (read_len == RTP_DISCARDED_PACKET);
-		h->packet_len = 0;
+
+		/* Get timestamp after packet for clock synchronization: a lost
+		 * packet is replaced by a silence of same duration
+		 */
+		if(read_len > 0 && h->trace != NULL &&
+		   rtp_get_read_time(h->rtp, &h->packet_time) != 0)
+			h->packet_time = trace_now();
+		if(read_len > 0 &&
+		   rtp_get_read_timestamp(h->rtp, &h->next_ts) == 0)
+		{
+			h->next_ts += h->samples;
+			h->ts_valid = 1;
+		}
+		else if(read_len == RTP_LOST_PACKET)
+			h->next_ts += h->samples;
 
 		/* When packet is lost or RTP is buffering, add a silence of
 		 * packet duration
@@ -323,24 +558,62 @@ static int raop_get_next_packet(struct raop_handle *h)
 	/* If a packet has been received: decrypt it */
 	if(read_len > 0)
 	{
-		/* Decrypt AES packet */
+		/* Decrypt AES packet in place: CBC is restarted with the same
+		 * IV for each packet and the unencrypted tail is kept as is
+		 */
 		aes_len = read_len & ~0xf;
-		memcpy(iv, h->aes_iv, sizeof(h->aes_iv));
-		AES_cbc_encrypt(packet, &h->packet[h->packet_len], aes_len,
-				&h->aes, iv, AES_DECRYPT);
-		memcpy(&h->packet[h->packet_len+aes_len], packet+aes_len,
-		       read_len - aes_len);
+		if(aes_len > 0)
+		{
+			EVP_DecryptInit_ex(h->aes, NULL, NULL, NULL, h->aes_iv);
+			EVP_DecryptUpdate(h->aes, packet, &aes_len, packet,
+					  aes_len);
+		}
 
 		h->packet_len += read_len;
+
+		/* Arrival time of a TCP packet */
+		if(h->transport == RAOP_TCP && h->trace != NULL)
+			h->packet_time = trace_now();
 	}
 
 	return 0;
 }
 
+static void raop_trace(struct raop_handle *h, size_t samples, uint64_t time)
+{
+	if(h->trace == NULL || samples == 0 || !trace_is_enabled())
+		return;
+
+	/* Samples entered with packet and leave decoder now */
+	trace_mark_at(h->trace, TRACE_INPUT, samples, h->samplerate,
+		      h->channels, time != 0 ? time : trace_now());
+	trace_mark(h->trace, TRACE_DECODE, samples, h->samplerate,
+		   h->channels);
+}
+
+static size_t raop_drop(struct raop_handle *h, unsigned char *buffer,
+			size_t samples)
+{
+	size_t drop;
+
+	if(h->drop_remaining == 0)
+		return samples;
+
+	/* Drop first samples to catch up presentation time */
+	drop = samples < h->drop_remaining ? samples : h->drop_remaining;
+	memmove(buffer, buffer + drop * h->sample_size,
+		(samples - drop) * h->sample_size);
+	h->drop_remaining -= drop;
+
+	return samples - drop;
+}
+
 int raop_read(void *user_data, unsigned char *buffer, size_t size,
 	      struct a_format *fmt)
 {
 	struct raop_handle *h = (struct raop_handle *) user_data;
+	struct decoder_batch_info batch_info;
+	struct decoder_frame frame;
 	struct decoder_info info;
 	int total_samples = 0;
 	int samples;
@@ -352,15 +625,29 @@ int raop_read(void *user_data, unsigned char *buffer, size_t size,
 	pthread_mutex_lock(&h->mutex);
 
 silence:
+	/* A silence and a drop cancel each other */
+	if(h->silence_remaining > 0 && h->drop_remaining > 0)
+	{
+		samples = h->silence_remaining < h->drop_remaining ?
+				h->silence_remaining : h->drop_remaining;
+		h->silence_remaining -= samples;
+		h->drop_remaining -= samples;
+	}
+
 	/* Play silence */
 	if(h->silence_remaining > 0)
 	{
+		/* Keep receiving packets during a long silence */
+		if(h->sync)
+			rtp_read(h->rtp, NULL, 0);
+
 		samples = h->silence_remaining > size ? size :
 							h->silence_remaining;
-		memset(buffer, 0, samples * 4);
+		memset(buffer, 0, samples * h->sample_size);
 		h->silence_remaining -= samples;
+		raop_trace(h, samples, 0);
 		total_samples += samples;
-		buffer += samples * 4;
+		buffer += samples * h->sample_size;
 		size -= samples;
 	}
 
@@ -377,8 +664,10 @@ silence:
 		}
 
 		h->pcm_remaining -= samples;
+		samples = raop_drop(h, buffer, samples);
+		raop_trace(h, samples, h->packet_time);
 		total_samples += samples;
-		buffer += samples * 4;
+		buffer += samples * h->sample_size;
 		size -= samples;
 	}
 
@@ -393,17 +682,22 @@ silence:
 			goto silence;
 
 		/* Decode next frame */
-		samples = decoder_decode(h->dec, h->packet, h->packet_len,
-					 buffer, size, &info);
+		frame.data = h->packet;
+		frame.len = h->packet_len;
+		batch_info.samplerate = 0;
+		batch_info.channels = 0;
+		samples = decoder_decode_batch(h->dec, &frame, 1, buffer, size,
+					       &batch_info);
 		if(samples <= 0)
 			break;
 
 		/* Move input buffer to next frame (ignore RTP errors) */
-		if(h->transport == RAOP_TCP && info.used < h->packet_len)
+		if(h->transport == RAOP_TCP && batch_info.frames == 0 &&
+		   batch_info.used < h->packet_len)
 		{
-			memmove(h->packet, &h->packet[info.used],
-				h->packet_len - info.used);
-			h->packet_len -=  info.used;
+			memmove(h->packet, &h->packet[batch_info.used],
+				h->packet_len - batch_info.used);
+			h->packet_len -=  batch_info.used;
 		}
 		else
 		{
@@ -411,15 +705,21 @@ silence:
 		}
 
 		/* Update remaining counter */
-		h->pcm_remaining = info.remaining;
+		h->pcm_remaining = batch_info.remaining;
+		samples = raop_drop(h, buffer, samples);
+		raop_trace(h, samples, h->packet_time);
 		total_samples += samples;
-		buffer += samples * 4;
+		buffer += samples * h->sample_size;
 		size -= samples;
 	}
 
 	/* Unlock buffer access */
 	pthread_mutex_unlock(&h->mutex);
 
+	/* Fill format */
+	if(fmt != NULL)
+		fmt->sample = h->sample;
+
 	return total_samples;
 }
 
@@ -456,12 +756,130 @@ int raop_flush(struct raop_handle *h, unsigned int seq)
 	h->pcm_remaining = 0;
 	h->packet_len = 0;
 
+	/* Align playout again on next sync packet */
+	h->sync_valid = 0;
+	h->ts_valid = 0;
+	h->synced = 0;
+	h->drop_remaining = 0;
+
+	/* Buffered samples are lost */
+	trace_reset(h->trace);
+
 	/* Unlock buffers access */
 	pthread_mutex_unlock(&h->mutex);
 
 	return 0;
 }
 
+int raop_sync(struct raop_handle *h, unsigned long delay, double *ratio)
+{
+	uint64_t now, target, play;
+	unsigned long samples;
+	double error, dt;
+	uint32_t ts;
+	int32_t frames;
+	int ret = -1;
+
+	if(h == NULL || !h->sync)
+		return -1;
+
+	/* Lock buffers access */
+	pthread_mutex_lock(&h->mutex);
+
+	/* Exchange timing packets with sender */
+	now = raop_ntp_now();
+	if(h->timing_sock >= 0)
+	{
+		raop_timing_receive(h);
+		if(now - h->timing_last >= raop_ms_to_ntp(
+					h->timing_count < RAOP_TIMING_SAMPLES ?
+					RAOP_TIMING_FAST : RAOP_TIMING_INTERVAL))
+			raop_timing_request(h, now);
+	}
+
+	/* Sender clock or stream position is unknown */
+	if(!h->sync_valid || !h->ts_valid)
+		goto end;
+
+	/* Get RTP timestamp of next sample read (after dropped samples) */
+	ts = h->next_ts - h->pcm_remaining / h->channels +
+	     h->drop_remaining / h->channels;
+	frames = (int32_t) (ts - h->sync_rtp);
+	if(frames > (int32_t) h->samplerate * 60 ||
+	   frames < -(int32_t) h->samplerate * 60)
+		goto end;
+
+	/* Get presentation time of this sample on local clock */
+	target = h->sync_ntp + (int64_t) frames * (int64_t) NTP_ONE /
+		 (int64_t) h->samplerate - raop_timing_offset(h);
+
+	/* Get time when it will be played: after output delay and silence */
+	play = now + raop_ms_to_ntp(delay) +
+	       (((uint64_t) h->silence_remaining / h->channels) << 32) /
+	       h->samplerate;
+	error = (double) (int64_t) (play - target) / NTP_ONE;
+
+	/* First synchronization or too far: move playout at once */
+	if(!h->synced || error > RAOP_SYNC_RESET / 1000.0 ||
+	   error < -RAOP_SYNC_RESET / 1000.0)
+	{
+		samples = (unsigned long) ((error > 0 ? error : -error) *
+					   h->samplerate) * h->channels;
+		if(error > 0)
+			h->drop_remaining += samples;
+		else
+			h->silence_remaining += samples;
+		h->synced = 1;
+		h->sync_error = 0;
+		h->sync_integral = 0;
+		*ratio = 1.0;
+		ret = 0;
+		goto end;
+	}
+
+	/* Smooth error and get its integral */
+	dt = (double) (now - h->sync_last) / NTP_ONE;
+	if(dt > 1.0)
+		dt = 1.0;
+	h->sync_error += (error - h->sync_error) * RAOP_SYNC_SMOOTH;
+	h->sync_integral += h->sync_error * dt;
+	if(h->sync_integral > RAOP_SYNC_MAX_RATIO / RAOP_SYNC_KI)
+		h->sync_integral = RAOP_SYNC_MAX_RATIO / RAOP_SYNC_KI;
+	else if(h->sync_integral < -RAOP_SYNC_MAX_RATIO / RAOP_SYNC_KI)
+		h->sync_integral = -RAOP_SYNC_MAX_RATIO / RAOP_SYNC_KI;
+
+	/* Play faster when late and slower when early */
+	*ratio = 1.0 - (RAOP_SYNC_KP * h->sync_error +
+			RAOP_SYNC_KI * h->sync_integral);
+	if(*ratio > 1.0 + RAOP_SYNC_MAX_RATIO)
+		*ratio = 1.0 + RAOP_SYNC_MAX_RATIO;
+	else if(*ratio < 1.0 - RAOP_SYNC_MAX_RATIO)
+		*ratio = 1.0 - RAOP_SYNC_MAX_RATIO;
+	ret = 0;
+
+end:
+	h->sync_last = now;
+
+	/* Unlock buffers access */
+	pthread_mutex_unlock(&h->mutex);
+
+	return ret;
+}
+
+void raop_set_trace(struct raop_handle *h, struct trace *trace)
+{
+	if(h == NULL)
+		return;
+
+	/* Lock buffer access */
+	pthread_mutex_lock(&h->mutex);
+
+	h->trace = trace;
+
+	/* Unlock buffer access */
+	pthread_mutex_unlock(&h->mutex);
+}
+
 int raop_close(struct raop_handle *h)
 {
 	if(h == NULL)
@@ -470,6 +888,14 @@ int raop_close(struct raop_handle *h)
 	/* Close decoder */
 	decoder_close(h->dec);
 
+	/* Free AES context */
+	if(h->aes != NULL)
+		EVP_CIPHER_CTX_free(h->aes);
+
+	/* Close timing socket */
+	if(h->timing_sock >= 0)
+		close(h->timing_sock);
+
 	/* Close socket */
 	if(h->transport == RAOP_TCP)
 	{
@@ -522,6 +948,11 @@ static void raop_rtcp_cb(void *user_data, unsigned char *buffer, size_t len)
 
 		/* Adjust RTP delay module */
 		rtp_set_delay_packet(h->rtp, delay / h->samples);
+
+		/* Save sender clock: RTP timestamp played at NTP time */
+		h->sync_rtp = ntohl((uint32_t)(*(uint32_t*)(buffer+4)));
+		h->sync_ntp = raop_get_ntp(buffer + 8);
+		h->sync_valid = 1;
 	}
 	else if(buffer[1] == 0xD6)
 	{
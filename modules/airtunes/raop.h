@@ -41,6 +41,14 @@ struct raop_attr{
 	int codec;
 	/* Format string for codec parameters: provided by RTSP */
 	char *format;
+	/* Adaptive latency: the delay follows network jitter instead of the
+	 * latency requested by sender (UDP only)
+	 */
+	int adaptive;
+	/* Clock synchronization: playout follows the sender clock, given by
+	 * the sync packets and timing requests sent to timing_port (UDP only)
+	 */
+	int sync;
 };
 
 struct raop_handle;
@@ -56,6 +64,19 @@ unsigned char raop_get_channels(struct raop_handle *h);
 
 int raop_flush(struct raop_handle *h, unsigned int seq);
 
+/* Synchronize playout on sender clock: it must be called periodically while
+ * playing, with delay (in ms) of samples already read until they are played.
+ * When playout is far from presentation time, a silence is inserted or
+ * samples are dropped, otherwise ratio is filled with a playback rate ratio
+ * to correct clock drift (above 1 to play slower). -1 is returned when the
+ * sender clock is not known yet.
+ */
+int raop_sync(struct raop_handle *h, unsigned long delay, double *ratio);
+
+/* Trace latency of packets from their arrival to decoder output */
+struct trace;
+void raop_set_trace(struct raop_handle *h, struct trace *trace);
+
 int raop_close(struct raop_handle *h);
 
 #endif
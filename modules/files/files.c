@@ -26,13 +26,24 @@
 #include <unistd.h>
 
 #include "files_list.h"
+#include "files_watch.h"
+#include "files_meta.h"
 #include "module.h"
 #include "utils.h"
+#include "json_stream.h"
 #include "file.h"
+#include "trace.h"
 #include "fs.h"
+#include "thread.h"
 
 #define PLAYLIST_ALLOC_SIZE 32
 
+/* Delay before end of current file to open next file (in s) */
+#define FILES_PREOPEN_DELAY 5
+
+/* Cached audio to play again after a seek (in ms) */
+#define FILES_SEEK_READY 200
+
 /**
  * Event defines
  */
@@ -41,8 +52,8 @@
 #define FILES_EVENT_STATUS "status"
 
 struct files_playlist {
-	char *filename;
-	struct json *tag;
+	/* Path and tags (with strings shared in meta_pool) */
+	struct files_meta *meta;
 };
 
 struct files_handle {
@@ -52,17 +63,37 @@ struct files_handle {
 	struct event_handle *event;
 	/* Database handle */
 	struct db_handle *db;
+	/* Live updates of local media */
+	struct files_watch *watch;
+	int use_watch;
 	/* Current file player */
 	struct file_handle *file;
 	struct output_stream_handle *stream;
 	unsigned long pos;
+	unsigned long offset;
+	/* Next file player (opened before end of current file) */
+	struct file_handle *next_file;
+	int next_index;
+	/* Stream reader: next file is read as soon as current file ends */
+	pthread_mutex_t read_mutex;
+	struct file_handle *read_file;
+	uint64_t read_time;
+	uint64_t switch_time;
 	/* Previous file player */
 	struct file_handle *prev_file;
 	struct output_stream_handle *prev_stream;
+	/* Latency tracing of played stream */
+	struct trace *trace;
 	/* Player status */
 	int is_playing;
+	/* Seek requests: only last position is used while a seek is running */
+	pthread_mutex_t seek_mutex;
+	unsigned long seek_pos;
+	int seek_pending;
+	int seeking;
 	/* Playlist */
 	struct files_playlist *playlist;
+	struct files_meta_pool *meta_pool;
 	int playlist_alloc;
 	int playlist_len;
 	int playlist_cur;
@@ -74,6 +105,7 @@ struct files_handle {
 	char *cover_path;
 	char *mount_path;
 	char *path;
+	struct resample_profile profile;
 };
 
 /* Data structure used for playlist add from database */
@@ -108,16 +140,30 @@ static int files_open(struct files_handle **handle, struct module_attr *attr)
 	h->output = attr->output;
 	h->event = attr->event;
 	h->db = attr->db;
+	h->watch = NULL;
 	h->file = NULL;
 	h->prev_file = NULL;
+	h->next_file = NULL;
+	h->read_file = NULL;
+	h->next_index = -1;
+	h->read_time = 0;
+	h->switch_time = 0;
+	h->offset = 0;
 	h->stream = NULL;
 	h->prev_stream = NULL;
+	h->trace = trace_new("files");
 	h->is_playing = 0;
+	h->seek_pos = 0;
+	h->seek_pending = 0;
+	h->seeking = 0;
 	h->playlist_cur = -1;
 	h->stop = 0;
 	h->cover_path = NULL;
 	h->mount_path = NULL;
 	h->path = NULL;
+	h->profile.quality = RESAMPLE_DEFAULT;
+	h->profile.threads = 0;
+	h->profile.variable_rate = 0;
 
 	/* Allocate playlist */
 	h->playlist = malloc(PLAYLIST_ALLOC_SIZE *
@@ -125,6 +171,7 @@ static int files_open(struct files_handle **handle, struct module_attr *attr)
 	if(h->playlist != NULL)
 		h->playlist_alloc = PLAYLIST_ALLOC_SIZE;
 	h->playlist_len = 0;
+	h->meta_pool = files_meta_pool_new();
 
 	/* Set configuration */
 	files_set_config(h, attr->config);
@@ -132,8 +179,14 @@ static int files_open(struct files_handle **handle, struct module_attr *attr)
 	/* Init database */
 	files_list_init(h->db, h->path);
 
+	/* Watch local media */
+	if(h->use_watch)
+		h->watch = files_watch_new(h->db, h->cover_path, 1);
+
 	/* Init thread */
 	pthread_mutex_init(&h->mutex, NULL);
+	pthread_mutex_init(&h->read_mutex, NULL);
+	pthread_mutex_init(&h->seek_mutex, NULL);
 
 	/* Create thread */
 	if(pthread_create(&h->thread, NULL, files_thread, h) != 0)
@@ -142,6 +195,249 @@ static int files_open(struct files_handle **handle, struct module_attr *attr)
 	return 0;
 }
 
+static int files_read(void *user_data, unsigned char *buffer, size_t size,
+		      struct a_format *fmt)
+{
+	struct files_handle *h = (struct files_handle *) user_data;
+	unsigned long samplerate;
+	unsigned char channels;
+	int samples;
+
+	/* Lock reader */
+	pthread_mutex_lock(&h->read_mutex);
+
+	/* Read current file */
+	samples = file_read(h->read_file, buffer, size, fmt);
+
+	/* End of file: continue with next file in the same stream */
+	if(samples <= 0 && h->next_file != NULL &&
+	   h->read_file != h->next_file &&
+	   file_get_status(h->read_file) == FILE_EOF)
+	{
+		/* Next file is played when all samples read are played */
+		h->read_file = h->next_file;
+		h->switch_time = h->read_time;
+
+		/* Read next file */
+		samples = file_read(h->read_file, buffer, size, fmt);
+	}
+
+	/* Update time read from stream (in us) */
+	if(samples > 0)
+	{
+		samplerate = file_get_samplerate(h->read_file);
+		channels = file_get_channels(h->read_file);
+		if(samplerate > 0 && channels > 0)
+			h->read_time += (uint64_t) samples * 1000000 /
+					samplerate / channels;
+	}
+
+	/* Unlock reader */
+	pthread_mutex_unlock(&h->read_mutex);
+
+	return samples;
+}
+
+static inline unsigned long files_get_played(struct files_handle *h)
+{
+	unsigned long played;
+
+	/* Get time played of current file in stream (in ms) */
+	played = output_get_status_stream(h->output, h->stream,
+					  OUTPUT_STREAM_PLAYED);
+
+	return played > h->offset ? played - h->offset : 0;
+}
+
+static int files_open_file(struct files_handle *h, struct file_handle **file,
+			   const char *filename)
+{
+	unsigned long count;
+	uint32_t *table;
+	struct stat st;
+
+	/* Open file */
+	if(file_open(file, filename) != 0)
+		return -1;
+	file_set_trace(*file, h->trace);
+
+	/* Restore seek table built during a previous playback */
+	if(fs_stat(filename, &st) == 0 &&
+	   files_list_get_seek_table(h->db, filename, st.st_mtime, &table,
+				     &count) == 0)
+	{
+		file_set_seek_table(*file, table, count);
+		free(table);
+	}
+
+	return 0;
+}
+
+static void files_close_file(struct files_handle *h, struct file_handle *file)
+{
+	unsigned long count;
+	uint32_t *table;
+	struct stat st;
+
+	if(file == NULL)
+		return;
+
+	/* Save seek table when new entries have been found */
+	if(file_get_seek_table(file, &table, &count) == 0)
+	{
+		if(fs_stat(file_get_uri(file), &st) == 0)
+			files_list_set_seek_table(h->db, file_get_uri(file),
+						  st.st_mtime, table, count);
+		free(table);
+	}
+
+	/* Close file */
+	file_close(file);
+}
+
+static void files_reset_reader(struct files_handle *h)
+{
+	struct file_handle *next;
+
+	/* Lock reader */
+	pthread_mutex_lock(&h->read_mutex);
+
+	/* Read current file from now */
+	next = h->next_file;
+	h->read_file = h->file;
+	h->next_file = NULL;
+	h->next_index = -1;
+	h->read_time = 0;
+	h->switch_time = 0;
+	h->offset = 0;
+
+	/* Unlock reader */
+	pthread_mutex_unlock(&h->read_mutex);
+
+	/* Close next file */
+	files_close_file(h, next);
+}
+
+static void files_drop_next(struct files_handle *h)
+{
+	struct file_handle *next = NULL;
+
+	/* Lock reader */
+	pthread_mutex_lock(&h->read_mutex);
+
+	/* Next file can be closed until it is read */
+	if(h->read_file != h->next_file)
+	{
+		next = h->next_file;
+		h->next_file = NULL;
+		h->next_index = -1;
+	}
+
+	/* Unlock reader */
+	pthread_mutex_unlock(&h->read_mutex);
+
+	/* Close next file */
+	files_close_file(h, next);
+}
+
+static void files_preopen_next(struct files_handle *h)
+{
+	struct file_handle *file = NULL;
+	int index;
+
+	/* Find next playable file in playlist */
+	for(index = h->playlist_cur + 1; index < h->playlist_len; index++)
+	{
+		if(files_open_file(h, &file,
+			   files_meta_filename(h->playlist[index].meta)) == 0)
+			break;
+		files_close_file(h, file);
+		file = NULL;
+	}
+
+	/* Lock reader */
+	pthread_mutex_lock(&h->read_mutex);
+
+	/* Next file is ready (or end of playlist is reached) */
+	h->next_file = file;
+	h->next_index = index;
+
+	/* Unlock reader */
+	pthread_mutex_unlock(&h->read_mutex);
+}
+
+static struct file_handle *files_take_next(struct files_handle *h)
+{
+	struct file_handle *file;
+	int is_read;
+
+	/* Lock reader */
+	pthread_mutex_lock(&h->read_mutex);
+
+	/* Remove next file from reader */
+	file = h->next_file;
+	is_read = file != NULL && h->read_file == file;
+	if(is_read)
+		h->read_file = h->file;
+	h->next_file = NULL;
+	h->next_index = -1;
+
+	/* Unlock reader */
+	pthread_mutex_unlock(&h->read_mutex);
+
+	/* Restart from beginning when it has already been read */
+	if(is_read)
+		file_set_pos(file, 0);
+
+	return file;
+}
+
+static void files_switch_next(struct files_handle *h)
+{
+	struct file_handle *file = NULL;
+	unsigned long played;
+
+	/* Get time played in stream (in ms) */
+	played = output_get_status_stream(h->output, h->stream,
+					  OUTPUT_STREAM_PLAYED);
+
+	/* Lock reader */
+	pthread_mutex_lock(&h->read_mutex);
+
+	/* Next file is read and all samples of current file have been played */
+	if(h->next_file != NULL && h->read_file == h->next_file &&
+	   played >= h->switch_time / 1000)
+	{
+		/* Next file becomes current file */
+		file = h->file;
+		h->file = h->next_file;
+		h->offset = h->switch_time / 1000;
+		h->playlist_cur = h->next_index;
+		h->next_file = NULL;
+		h->next_index = -1;
+		h->pos = 0;
+	}
+
+	/* Unlock reader */
+	pthread_mutex_unlock(&h->read_mutex);
+
+	if(file == NULL)
+		return;
+
+	/* Close previous file */
+	files_close_file(h, file);
+
+	/* Notify player update */
+	files_event_player(h);
+}
+
+static void files_trace_stream(struct files_handle *h)
+{
+	/* Positions restart with a new stream */
+	trace_reset(h->trace);
+	output_set_trace_stream(h->output, h->stream, h->trace);
+}
+
 static int files_new_player(struct files_handle *h)
 {
 	unsigned long samplerate;
@@ -149,9 +445,11 @@ static int files_new_player(struct files_handle *h)
 	struct json *event;
 
 	/* Start new player */
-	if(file_open(&h->file, h->playlist[h->playlist_cur].filename) != 0)
+	if(files_open_file(h, &h->file,
+			   files_meta_filename(h->playlist[h->playlist_cur].meta))
+		   != 0)
 	{
-		file_close(h->file);
+		files_close_file(h, h->file);
 		h->file = NULL;
 		h->stream = NULL;
 		return -1;
@@ -164,44 +462,97 @@ static int files_new_player(struct files_handle *h)
 	samplerate = file_get_samplerate(h->file);
 	channels = file_get_channels(h->file);
 
+	/* Reset stream reader */
+	files_reset_reader(h);
+
 	/* Open new Audio stream output and play */
 	h->stream = output_add_stream(h->output, NULL, samplerate, channels, 0,
-				      0, &file_read, h->file);
+				      0, &h->profile, &files_read, h);
+	files_trace_stream(h);
 	output_play_stream(h->output, h->stream);
 
 	return 0;
 }
 
-static void files_play_next(struct files_handle *h)
+static void files_switch_player(struct files_handle *h,
+				struct file_handle *file, int index)
 {
+	/* Switch file in the same stream (if it has not ended) */
+	if(file != NULL && h->stream != NULL &&
+	   output_get_status_stream(h->output, h->stream,
+				    OUTPUT_STREAM_STATUS) != STREAM_ENDED)
+	{
+		/* Pause stream */
+		output_pause_stream(h->output, h->stream);
+
+		/* Lock reader */
+		pthread_mutex_lock(&h->read_mutex);
+
+		/* Replace current file */
+		files_close_file(h, h->file);
+		h->file = file;
+		h->read_file = file;
+
+		/* Unlock reader */
+		pthread_mutex_unlock(&h->read_mutex);
+
+		/* Flush stream and reset reader */
+		output_flush_stream(h->output, h->stream);
+		files_reset_reader(h);
+		h->playlist_cur = index;
+		h->pos = 0;
+
+		/* Play stream */
+		if(h->is_playing)
+			output_play_stream(h->output, h->stream);
+
+		return;
+	}
+
 	/* Close previous stream */
 	if(h->prev_stream != NULL)
 		output_remove_stream(h->output, h->prev_stream);
 
 	/* Close previous file */
-	file_close(h->prev_file);
+	files_close_file(h, h->prev_file);
 
 	/* Move current stream to previous */
 	h->prev_stream = h->stream;
 	h->prev_file = h->file;
 
-	/* Open next file in playlist */
-	while(h->playlist_cur <= h->playlist_len)
+	/* End of playlist */
+	if(file == NULL)
 	{
-		h->playlist_cur++;
-		if(h->playlist_cur >= h->playlist_len)
-		{
-			h->playlist_cur = -1;
-			h->stream = NULL;
-			h->file = NULL;
-			break;
-		}
+		h->playlist_cur = -1;
+		h->stream = NULL;
+		h->file = NULL;
+		return;
+	}
 
-		if(files_new_player(h) != 0)
-			continue;
+	/* Open a new stream (previous one has ended) */
+	h->playlist_cur = index;
+	h->file = file;
+	h->pos = 0;
+	files_reset_reader(h);
+	h->stream = output_add_stream(h->output, NULL,
+				      file_get_samplerate(file),
+				      file_get_channels(file), 0, 0,
+				      &h->profile, &files_read, h);
+	files_trace_stream(h);
+	output_play_stream(h->output, h->stream);
+}
 
-		break;
-	}
+static void files_play_next(struct files_handle *h)
+{
+	int index;
+
+	/* Open next playable file if not already done */
+	if(h->next_index == -1)
+		files_preopen_next(h);
+
+	/* Switch to next file (or end of playlist) */
+	index = h->next_index;
+	files_switch_player(h, files_take_next(h), index);
 
 	/* Notify player update */
 	files_event_player(h);
@@ -209,35 +560,22 @@ static void files_play_next(struct files_handle *h)
 
 static void files_play_prev(struct files_handle *h)
 {
-	/* Close previous stream */
-	if(h->prev_stream != NULL)
-		output_remove_stream(h->output, h->prev_stream);
+	struct file_handle *file = NULL;
+	int index = h->playlist_cur;
 
-	/* Close previous file */
-	file_close(h->prev_file);
-
-	/* Move current stream to previous */
-	h->prev_stream = h->stream;
-	h->prev_file = h->file;
-
-	/* Open next file in playlist */
-	while(h->playlist_cur >= 0)
+	/* Find previous playable file in playlist */
+	while(--index >= 0)
 	{
-		h->playlist_cur--;
-		if(h->playlist_cur < 0)
-		{
-			h->playlist_cur = -1;
-			h->stream = NULL;
-			h->file = NULL;
+		if(files_open_file(h, &file,
+			   files_meta_filename(h->playlist[index].meta)) == 0)
 			break;
-		}
-
-		if(files_new_player(h) != 0)
-			continue;
-
-		break;
+		files_close_file(h, file);
+		file = NULL;
 	}
 
+	/* Switch to previous file (or end of playlist) */
+	files_switch_player(h, file, index);
+
 	/* Notify player update */
 	files_event_player(h);
 }
@@ -246,23 +584,37 @@ static void *files_thread(void *user_data)
 {
 	struct files_handle *h = (struct files_handle *) user_data;
 	unsigned long played;
+	long length;
+
+	/* Set thread scheduling and name */
+	thread_setup(THREAD_DEFAULT, "files");
 
 	while(!h->stop)
 	{
 		/* Lock playlist */
 		pthread_mutex_lock(&h->mutex);
 
-		if(h->playlist_cur != -1 &&
+		if(h->playlist_cur != -1 && h->file != NULL &&
 		   h->playlist_cur+1 <= h->playlist_len)
 		{
-			/* Get current played from stream */
-			played = output_get_status_stream(h->output, h->stream,
-						  OUTPUT_STREAM_PLAYED) / 1000;
-
-			/* Check position */
-			if(h->file != NULL && 
-			   (played + h->pos >= file_get_length(h->file)-1
-			   || file_get_status(h->file) == FILE_EOF))
+			/* Next file has started in stream */
+			files_switch_next(h);
+
+			/* Get current position */
+			played = files_get_played(h) / 1000 + h->pos;
+			length = file_get_length(h->file);
+
+			/* Open next file before end of current file */
+			if(h->next_index == -1 &&
+			   played + FILES_PREOPEN_DELAY >= length)
+				files_preopen_next(h);
+
+			/* Check position: next file can't be read in stream */
+			if((h->next_file == NULL ||
+			    output_get_status_stream(h->output, h->stream,
+				   OUTPUT_STREAM_STATUS) == STREAM_ENDED) &&
+			   (played >= length-1 ||
+			    file_get_status(h->file) == FILE_EOF))
 			{
 				files_play_next(h);
 			}
@@ -278,23 +630,26 @@ static void *files_thread(void *user_data)
 	return NULL;
 }
 
-static inline void files_free_playlist(struct files_playlist *p)
+static inline void files_free_playlist(struct files_handle *h,
+				       struct files_playlist *p)
 {
-	if(p->filename != NULL)
-		free(p->filename);
-	if(p->tag != NULL)
-		json_free(p->tag);
+	files_meta_free(h->meta_pool, p->meta);
 }
 
 static int files_add(struct files_handle *h, unsigned long media_id,
 		     const char *file_path, int path_len)
 {
 	struct files_playlist *p;
-	int len;
+	struct files_meta *meta;
+	struct json *tag;
 
 	if(file_path == NULL)
 		return -1;
 
+	/* Get tags of file */
+	tag = files_list_file(h->db, h->cover_path, media_id,
+			      file_path+path_len);
+
 	/* Lock playlist */
 	pthread_mutex_lock(&h->mutex);
 
@@ -316,15 +671,27 @@ static int files_add(struct files_handle *h, unsigned long media_id,
 		h->playlist_alloc += PLAYLIST_ALLOC_SIZE;
 	}
 
+	/* Create compact meta */
+	meta = files_meta_new(h->meta_pool, file_path, tag);
+	json_free(tag);
+	if(meta == NULL)
+	{
+		/* Unlock playlist */
+		pthread_mutex_unlock(&h->mutex);
+		return -1;
+	}
+
 	/* Fill the new playlist entry */
 	p = &h->playlist[h->playlist_len];
-	p->filename = strdup(file_path);
-	p->tag = files_list_file(h->db, h->cover_path, media_id,
-				 file_path+path_len);
+	p->meta = meta;
 
 	/* Increment playlist len */
 	h->playlist_len++;
 
+	/* End of playlist was reached: look for next file again */
+	if(h->next_file == NULL)
+		h->next_index = -1;
+
 	/* Unlock playlist */
 	pthread_mutex_unlock(&h->mutex);
 
@@ -483,8 +850,14 @@ static int files_remove(struct files_handle *h, int index)
 		h->playlist_cur--;
 	}
 
+	/* Update next file */
+	if(h->next_index == index)
+		files_drop_next(h);
+	else if(h->next_index > index)
+		h->next_index--;
+
 	/* Free index playlist structure */
-	files_free_playlist(&h->playlist[index]);
+	files_free_playlist(h, &h->playlist[index]);
 
 	/* Remove the index from playlist */
 	memmove(&h->playlist[index], &h->playlist[index+1], 
@@ -511,7 +884,7 @@ static void files_flush(struct files_handle *h)
 	/* Flush all playlist */
 	for(; h->playlist_len--;)
 	{
-		files_free_playlist(&h->playlist[h->playlist_len]);
+		files_free_playlist(h, &h->playlist[h->playlist_len]);
 	}
 	h->playlist_len = 0;
 	h->playlist_cur = -1;
@@ -617,11 +990,14 @@ static int files_stop(struct files_handle *h)
 	h->prev_stream = NULL;
 
 	/* Close file */
-	file_close(h->file);
-	file_close(h->prev_file);
+	files_close_file(h, h->file);
+	files_close_file(h, h->prev_file);
 	h->file = NULL;
 	h->prev_file = NULL;
 
+	/* Close next file */
+	files_reset_reader(h);
+
 	/* Rreset playlist position */
 	h->playlist_cur = -1;
 
@@ -649,7 +1025,7 @@ static int files_prev(struct files_handle *h)
 			output_remove_stream(h->output, h->prev_stream);
 
 		/* Close previous file */
-		file_close(h->prev_file);
+		files_close_file(h, h->prev_file);
 
 		h->prev_stream = NULL;
 		h->prev_file = NULL;
@@ -676,7 +1052,7 @@ static int files_next(struct files_handle *h)
 			output_remove_stream(h->output, h->prev_stream);
 
 		/* Close previous file */
-		file_close(h->prev_file);
+		files_close_file(h, h->prev_file);
 
 		h->prev_stream = NULL;
 		h->prev_file = NULL;
@@ -688,7 +1064,7 @@ static int files_next(struct files_handle *h)
 	return 0;
 }
 
-static int files_seek(struct files_handle *h, unsigned long pos)
+static void files_do_seek(struct files_handle *h, unsigned long pos)
 {
 	/* Lock playlist */
 	pthread_mutex_lock(&h->mutex);
@@ -696,11 +1072,15 @@ static int files_seek(struct files_handle *h, unsigned long pos)
 	/* Pause stream */
 	output_pause_stream(h->output, h->stream);
 
-	/* Flush stream */
-	output_flush_stream(h->output, h->stream);
+	/* Flush stream: decoder and output stream are kept, and playback
+	 * starts again with a small part of cache */
+	output_flush_stream_ready(h->output, h->stream, FILES_SEEK_READY);
+
+	/* Seek at exact sample and get new position */
+	h->pos = file_set_pos_exact(h->file, pos);
 
-	/* Seek and get new exact position */
-	h->pos = file_set_pos(h->file, pos);
+	/* Read current file again (next file is opened later) */
+	files_reset_reader(h);
 
 	/* Play stream */
 	output_play_stream(h->output, h->stream);
@@ -710,6 +1090,42 @@ static int files_seek(struct files_handle *h, unsigned long pos)
 
 	/* Unlock playlist */
 	pthread_mutex_unlock(&h->mutex);
+}
+
+static int files_seek(struct files_handle *h, unsigned long pos)
+{
+	/* Lock seek requests */
+	pthread_mutex_lock(&h->seek_mutex);
+
+	/* Save last position: a running seek will use it when done */
+	h->seek_pos = pos;
+	h->seek_pending = 1;
+	if(h->seeking)
+	{
+		pthread_mutex_unlock(&h->seek_mutex);
+		return 0;
+	}
+	h->seeking = 1;
+
+	/* Seek until no new position has been asked meanwhile */
+	while(h->seek_pending)
+	{
+		pos = h->seek_pos;
+		h->seek_pending = 0;
+
+		/* Unlock seek requests */
+		pthread_mutex_unlock(&h->seek_mutex);
+
+		/* Seek in stream */
+		files_do_seek(h, pos);
+
+		/* Lock seek requests */
+		pthread_mutex_lock(&h->seek_mutex);
+	}
+	h->seeking = 0;
+
+	/* Unlock seek requests */
+	pthread_mutex_unlock(&h->seek_mutex);
 
 	return 0;
 }
@@ -725,17 +1141,16 @@ static struct json *files_json_status(struct files_handle *h, int tags)
 		return NULL;
 
 	/* Add filename */
-	json_set_string(status, "file",
-			basename(h->playlist[h->playlist_cur].filename));
+	json_set_string(status, "file", basename((char *) files_meta_filename(
+				       h->playlist[h->playlist_cur].meta)));
 
 	/* Add tags */
 	if(tags)
 		json_add(status, "tag",
-			 json_copy(h->playlist[h->playlist_cur].tag));
+			 files_meta_to_json(h->playlist[h->playlist_cur].meta));
 
 	/* Get curent postion in output stream  */
-	played = output_get_status_stream(h->output, h->stream,
-					  OUTPUT_STREAM_PLAYED) / 1000;
+	played = files_get_played(h) / 1000;
 	json_set_int(status, "pos", played + h->pos);
 
 	/* Add stream length */
@@ -778,42 +1193,29 @@ static char *files_get_json_status(struct files_handle *h)
 
 static char *files_get_json_playlist(struct files_handle *h)
 {
-	struct json *root, *tmp;
-	char *str;
+	struct json_stream *root;
 	int i;
 
-	/* Create JSON object */
-	root = json_new_array();
+	/* Create JSON stream */
+	root = json_stream_new();
 	if(root == NULL)
 		return NULL;
+	json_stream_begin_array(root, NULL);
 
 	/* Lock playlist */
 	pthread_mutex_lock(&h->mutex);
 
-	/* Fill the JSON array with playlist */
+	/* Write tags of all playlist entries */
 	for(i = 0; i < h->playlist_len; i++)
-	{
-		/* Create temporary object */
-		str = basename(h->playlist[i].filename);
-		tmp = json_copy(h->playlist[i].tag);
-		if(tmp == NULL)
-			continue;
-
-		/* Add to list */
-		if(json_array_add(root, tmp) != 0)
-			json_free(tmp);
-	}
+		json_stream_add(root, NULL,
+				files_meta_to_json(h->playlist[i].meta));
 
 	/* Unlock playlist */
 	pthread_mutex_unlock(&h->mutex);
 
 	/* Get JSON string */
-	str = strdup(json_export(root));
-
-	/* Free JSON object */
-	json_free(root);
-
-	return str;
+	json_stream_end_array(root);
+	return json_stream_finish(root, NULL);
 }
 
 static int files_set_config(struct files_handle *h, const struct json *c)
@@ -835,6 +1237,10 @@ static int files_set_config(struct files_handle *h, const struct json *c)
 	h->cover_path = NULL;
 	h->mount_path = NULL;
 	h->path = NULL;
+	h->profile.quality = RESAMPLE_DEFAULT;
+	h->profile.threads = 0;
+	h->profile.variable_rate = 0;
+	h->use_watch = 1;
 
 	/* Parse configuration */
 	if(c != NULL)
@@ -853,6 +1259,15 @@ static int files_set_config(struct files_handle *h, const struct json *c)
 		cover_path = json_get_string(c, "cover_path");
 		if(cover_path != NULL)
 			h->cover_path = strdup(cover_path);
+
+		/* Get resampler profile */
+		h->profile.quality = resample_quality_from_name(
+				       json_get_string(c, "resample_quality"));
+		h->profile.threads = json_get_int(c, "resample_threads");
+
+		/* Enable live updates of local media */
+		if(json_get(c, "watch") != NULL)
+			h->use_watch = json_get_bool(c, "watch");
 	}
 
 	/* Set default values */
@@ -863,6 +1278,16 @@ static int files_set_config(struct files_handle *h, const struct json *c)
 	if(h->cover_path == NULL)
 		h->cover_path = strdup("/var/aircat/files/cover");
 
+	/* Restart a running watcher with new configuration (it is started on
+	 * open, once database is ready)
+	 */
+	if(h->watch != NULL)
+	{
+		files_watch_free(h->watch);
+		h->watch = h->use_watch ? files_watch_new(h->db, h->cover_path,
+							  1) : NULL;
+	}
+
 	return 0;
 }
 
@@ -879,6 +1304,10 @@ static struct json *files_get_config(struct files_handle *h)
 	json_set_string(c, "path", h->path);
 	json_set_string(c, "mount_path", h->mount_path);
 	json_set_string(c, "cover_path", h->cover_path);
+	json_set_string(c, "resample_quality",
+			resample_quality_name(h->profile.quality));
+	json_set_int(c, "resample_threads", h->profile.threads);
+	json_set_bool(c, "watch", h->use_watch);
 
 	return c;
 }
@@ -896,12 +1325,17 @@ static int files_close(struct files_handle *h)
 	if(pthread_join(h->thread, NULL) < 0)
 		return -1;
 
+	/* Stop watcher */
+	files_watch_free(h->watch);
+
 	/* Free playlist */
 	if(h->playlist != NULL)
 	{
 		files_flush(h);
 		free(h->playlist);
 	}
+	files_meta_pool_free(h->meta_pool);
+	trace_free(h->trace);
 
 	/* Free files path */
 	if(h->path != NULL)
@@ -1161,10 +1595,29 @@ static int files_httpd_img(void *user_data, struct httpd_req *req,
 			   struct httpd_res **res)
 {
 	struct files_handle *h = user_data;
+	const char *value;
+	char *thumb = NULL;
+	size_t len;
 	int code;
 
+	/* Get a thumbnail when a size is requested */
+	value = httpd_get_query(req, "size");
+	if(value != NULL && strtoul(value, NULL, 10) > 0)
+		thumb = files_list_get_thumbnail(h->cover_path, req->resource,
+						 strtoul(value, NULL, 10));
+
 	/* Create a file response */
-	*res = httpd_new_file_response(h->cover_path, req->resource, &code);
+	*res = httpd_new_file_response(req, h->cover_path,
+				       thumb != NULL ? thumb : req->resource,
+				       &code);
+	free(thumb);
+
+	/* Covers named by hash of image never change: cache them forever */
+	len = strspn(req->resource, "0123456789abcdef");
+	if(code == 200 && *res != NULL && len == 32 &&
+	   req->resource[len] == '.')
+		httpd_add_header(*res, "Cache-Control",
+				 "public, max-age=31536000, immutable");
 
 	return code;
 }
@@ -1229,6 +1682,7 @@ static int files_httpd_list(void *user_data, struct httpd_req *req,
 	int sort = FILES_LIST_SORT_DEFAULT;
 	const char *filter = NULL;
 	const char *value;
+	char *cursor = NULL;
 	char *list = NULL;
 	long artist_id = 0;
 	long album_id = 0;
@@ -1325,7 +1779,8 @@ static int files_httpd_list(void *user_data, struct httpd_req *req,
 	list = files_list_files(h->db, h->cover_path, media_id, req->resource,
 				page, count, sort, display,
 				(int64_t) artist_id, (int64_t) album_id,
-				(int64_t) genre_id, filter);
+				(int64_t) genre_id, filter,
+				httpd_get_query(req, "cursor"), &cursor);
 	if(list == NULL)
 	{
 		*res = httpd_new_response("Bad directory", 0, 0);
@@ -1333,6 +1788,15 @@ static int files_httpd_list(void *user_data, struct httpd_req *req,
 	}
 
 	*res = httpd_new_response(list, 1, 0);
+
+	/* Add cursor of next page */
+	if(cursor != NULL)
+	{
+		if(*res != NULL)
+			httpd_add_header(*res, "X-Next-Cursor", cursor);
+		free(cursor);
+	}
+
 	return 200;
 }
 
@@ -1342,8 +1806,10 @@ static int files_httpd_scan(void *user_data, struct httpd_req *req,
 	struct files_handle *h = user_data;
 	struct json *j;
 	const char *value;
+	unsigned long found, done;
 	char *status;
 	long media_id = 1;
+	int full = 0;
 
 	if(req->method == HTTPD_PUT)
 	{
@@ -1360,8 +1826,13 @@ static int files_httpd_scan(void *user_data, struct httpd_req *req,
 		if(value != NULL)
 			media_id = strtol(value, NULL, 10);
 
+		/* Parse all files (and not only modified folders) */
+		value = httpd_get_query(req, "full");
+		if(value != NULL)
+			full = strtol(value, NULL, 10);
+
 		/* Scan all music folder */
-		if(files_list_scan(h->db, h->cover_path, media_id, 1) != 0)
+		if(files_list_scan(h->db, h->cover_path, media_id, 1, full) != 0)
 		{
 			*res = httpd_new_response("Scan failed", 0, 0);
 			return 500;
@@ -1384,6 +1855,11 @@ static int files_httpd_scan(void *user_data, struct httpd_req *req,
 			json_set_string(j, "file", status);
 			if(status != NULL)
 				free(status);
+
+			/* Get progress */
+			files_list_get_scan_count(&found, &done);
+			json_set_int64(j, "found", found);
+			json_set_int64(j, "done", done);
 		}
 		else
 		{
@@ -0,0 +1,48 @@
+/*
+ * files_keyset.c - Keyset pagination of library listings for Files module
+ *
+ * Copyright (c) 2014   A. Dilly
+ *
+ * AirCat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * AirCat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with AirCat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "files_keyset.h"
+#include "db.h"
+
+char *files_keyset_where(const char *col, const char *id_col, int desc,
+			 const char *key, int64_t id)
+{
+	/* Last row has a NULL key: NULL rows are first in ascending order */
+	if(key == NULL && !desc)
+		return db_mprintf("AND ((%s IS NULL AND %s > '%lld') OR "
+				  "%s IS NOT NULL)", col, id_col,
+				  (long long) id, col);
+
+	/* Last row has a NULL key: only NULL rows remain in descending order */
+	if(key == NULL)
+		return db_mprintf("AND %s IS NULL AND %s < '%lld'", col,
+				  id_col, (long long) id);
+
+	/* Ascending order: NULL rows are all before key */
+	if(!desc)
+		return db_mprintf("AND (%s,%s) > ('%q','%lld')", col, id_col,
+				  key, (long long) id);
+
+	/* Descending order: NULL rows are all after key */
+	return db_mprintf("AND ((%s,%s) < ('%q','%lld') OR %s IS NULL)", col,
+			  id_col, key, (long long) id, col);
+}
@@ -0,0 +1,34 @@
+/*
+ * files_keyset.h - Keyset pagination of library listings for Files module
+ *
+ * Copyright (c) 2014   A. Dilly
+ *
+ * AirCat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * AirCat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with AirCat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _FILES_KEYSET_H
+#define _FILES_KEYSET_H
+
+#include <stdint.h>
+
+/* Build SQL condition (starting with "AND") which selects rows following the
+ * row (key, id) in "ORDER BY col dir,id_col dir". A NULL key is the key of a
+ * row with a NULL column: SQLite sorts NULL values first in ascending order
+ * and last in descending order, which a plain row value comparison can't
+ * reach since it is NULL for these rows.
+ * String must be freed with db_free().
+ */
+char *files_keyset_where(const char *col, const char *id_col, int desc,
+			 const char *key, int64_t id);
+
+#endif
@@ -16,26 +16,60 @@
  * along with AirCat.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <inttypes.h>
 #include <string.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <time.h>
 
 #include "files_list.h"
+#include "files_keyset.h"
 #include "utils.h"
 #include "json.h"
+#include "json_stream.h"
 #include "meta.h"
+#include "image.h"
 #include "fs.h"
+#include "thread.h"
 
 #define FILES_LIST_DEFAULT_COUNT 25
 
+/* Scan pipeline: the folder walker sends new and modified files to a pool of
+ * workers which parse tags and save covers, while a single writer thread adds
+ * them to database in large transactions (committed every
+ * FILES_LIST_TRANSACTION files or FILES_LIST_COMMIT_DELAY seconds).
+ */
+#define FILES_LIST_WORKERS 4
+#define FILES_LIST_QUEUE 64
+#define FILES_LIST_TRANSACTION 256
+#define FILES_LIST_COMMIT_DELAY 1
+
 static pthread_mutex_t scan_mutex =  PTHREAD_MUTEX_INITIALIZER;
 static char *scan_status = NULL;
 static int scan_len = 0;
 static int scanning = 0;
+static unsigned long scan_found = 0;
+static unsigned long scan_done = 0;
+
+/* Only one scan transaction can be opened on database at a time */
+static pthread_mutex_t scan_write_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Full-text index of songs (title, artist, album, genre and file name) used
+ * for search: it is kept in sync by triggers on song table, so all additions,
+ * updates and removals are indexed. Search falls back to LIKE when SQLite is
+ * built without FTS5.
+ */
+static int files_fts = 0;
 
 char *files_ext[] = {
 	".mp3", ".m4a", ".mp4", ".aac", ".ogg", ".wav",
@@ -45,7 +79,116 @@ char *files_ext[] = {
 static int files_list_recursive_scan(struct db_handle *db,
 				     const char *cover_path, int64_t media_id,
 				     const char *path, int len, int recursive,
-				     int update_status);
+				     int full, int update_status);
+
+#define FILES_FTS_VALUES "(SELECT artist FROM artist " \
+			 "WHERE artist_id=new.artist_id)," \
+			 "(SELECT album FROM album " \
+			 "WHERE album_id=new.album_id)," \
+			 "(SELECT genre FROM genre " \
+			 "WHERE genre_id=new.genre_id)"
+
+static int files_list_init_fts(struct db_handle *db)
+{
+	struct db_query *q;
+	int exists;
+
+	/* Check if index already exists */
+	q = db_prepare(db, "SELECT 1 FROM sqlite_master "
+			   "WHERE type='table' AND name='song_fts'", -1);
+	if(q == NULL)
+		return -1;
+	exists = db_step(q) == DB_ROW;
+	db_finalize(q);
+	if(exists)
+		return 0;
+
+	/* Create index and its triggers */
+	if(db_exec(db, "CREATE VIRTUAL TABLE song_fts USING fts5("
+		       " title, artist, album, genre, file,"
+		       " prefix = '2 3'"
+		       ");"
+		       "CREATE TRIGGER IF NOT EXISTS song_fts_insert "
+		       "AFTER INSERT ON song BEGIN"
+		       " INSERT INTO song_fts "
+		       "(rowid,title,artist,album,genre,file) "
+		       "VALUES (new.id,new.title," FILES_FTS_VALUES ",new.file);"
+		       "END;"
+		       "CREATE TRIGGER IF NOT EXISTS song_fts_update "
+		       "AFTER UPDATE ON song BEGIN"
+		       " DELETE FROM song_fts WHERE rowid=old.id;"
+		       " INSERT INTO song_fts "
+		       "(rowid,title,artist,album,genre,file) "
+		       "VALUES (new.id,new.title," FILES_FTS_VALUES ",new.file);"
+		       "END;"
+		       "CREATE TRIGGER IF NOT EXISTS song_fts_delete "
+		       "AFTER DELETE ON song BEGIN"
+		       " DELETE FROM song_fts WHERE rowid=old.id;"
+		       "END", NULL, NULL) != 0)
+		return -1;
+
+	/* Index songs already in database */
+	return db_exec(db, "INSERT INTO song_fts "
+			   "(rowid,title,artist,album,genre,file) "
+			   "SELECT id,title,artist,album,genre,file FROM song "
+			   "LEFT JOIN artist USING (artist_id) "
+			   "LEFT JOIN album USING (album_id) "
+			   "LEFT JOIN genre USING (genre_id)", NULL, NULL);
+}
+
+static char *files_list_fts_match(const char *filter, const char *column)
+{
+	const char *p, *t;
+	char *match, *m;
+	size_t len;
+
+	/* Allocate match string: each character can be doubled */
+	len = strlen(filter);
+	match = malloc(3 * len + (column != NULL ? strlen(column) : 0) + 10);
+	if(match == NULL)
+		return NULL;
+	m = match;
+
+	/* Restrict search to a column */
+	if(column != NULL)
+		m += sprintf(m, "{%s} : (", column);
+
+	/* Search all words as prefixes ("word"*) */
+	for(p = filter; *p != '\0'; p = t)
+	{
+		/* Skip spaces */
+		for(; *p == ' ' || *p == '\t'; p++);
+		if(*p == '\0')
+			break;
+
+		/* Quote word */
+		if(m != match && m[-1] != '(')
+			*m++ = ' ';
+		*m++ = '"';
+		for(t = p; *t != '\0' && *t != ' ' && *t != '\t'; t++)
+		{
+			if(*t == '"')
+				*m++ = '"';
+			*m++ = *t;
+		}
+		*m++ = '"';
+		*m++ = '*';
+	}
+
+	/* No word to search */
+	if(m == match || m[-1] == '(')
+	{
+		free(match);
+		return NULL;
+	}
+
+	/* Close column restriction */
+	if(column != NULL)
+		*m++ = ')';
+	*m = '\0';
+
+	return match;
+}
 
 void files_list_init(struct db_handle *db, const char *path)
 {
@@ -125,7 +268,33 @@ void files_list_init(struct db_handle *db, const char *path)
 			 " FOREIGN KEY (album_id) REFERENCES album,"
 			 " FOREIGN KEY (genre_id) REFERENCES genre,"
 			 " FOREIGN KEY (cover_id) REFERENCES cover"
-			 ")");
+			 ");"
+			 "CREATE TABLE IF NOT EXISTS seek_table ("
+			 " file TEXT,"
+			 " mtime INTEGER,"
+			 " data BLOB,"
+			 " UNIQUE (file)"
+			 ");"
+			 /* Indexes for folder listing by each sort (rows
+			  * with same key are ordered by id for cursors) and
+			  * for artist, album and genre listing
+			  */
+			 "CREATE INDEX IF NOT EXISTS song_path_file "
+			 "ON song (path_id,file);"
+			 "CREATE INDEX IF NOT EXISTS song_path_title "
+			 "ON song (path_id,title);"
+			 "CREATE INDEX IF NOT EXISTS song_path_track "
+			 "ON song (path_id,track);"
+			 "CREATE INDEX IF NOT EXISTS song_path_year "
+			 "ON song (path_id,year);"
+			 "CREATE INDEX IF NOT EXISTS song_path_duration "
+			 "ON song (path_id,duration);"
+			 "CREATE INDEX IF NOT EXISTS song_artist "
+			 "ON song (artist_id);"
+			 "CREATE INDEX IF NOT EXISTS song_album "
+			 "ON song (album_id);"
+			 "CREATE INDEX IF NOT EXISTS song_genre "
+			 "ON song (genre_id)");
 	if(sql == NULL)
 		return;
 
@@ -154,6 +323,8 @@ void files_list_init(struct db_handle *db, const char *path)
 	db_exec(db, sql, NULL, NULL);
 	db_free(sql);
 
+	/* Create full-text index */
+	files_fts = files_list_init_fts(db) == 0;
 }
 
 static int files_list_get_path(struct db_handle *db, int64_t media_id,
@@ -233,7 +404,7 @@ static int files_list_get_path(struct db_handle *db, int64_t media_id,
 	g = gpath != NULL ? gpath : "";
 retry:
 	/* Generate SQL */
-	sql = db_mprintf("SELECT p.path_id,p.path,m.path FROM path AS p "
+	sql = db_mprintf("SELECT p.path_id,p.mtime,m.path FROM path AS p "
 			 "LEFT JOIN media AS m using (media_id) "
 			 "WHERE p.path='%q%q%q' AND media_id='%ld'",
 			 m, s, g, media_id);
@@ -297,11 +468,12 @@ end:
 static char *files_list_save_cover(struct meta *meta, const char *path,
 				   const char *file)
 {
-	char *file_path;
+	char *file_path = NULL;
+	char *tmp = NULL;
 	char *cover;
 	char *md5;
-	FILE *fp;
-	int len;
+	int len, fd;
+	int ret;
 
 	/* Calculate hash of image */
 	md5 = md5_encode_str(meta->picture.data, meta->picture.size);
@@ -355,29 +527,158 @@ static char *files_list_save_cover(struct meta *meta, const char *path,
 	if(file_path == NULL)
 		goto end;
 
-	/* Create file */
+	/* Cover already saved */
 	if(access(file_path, F_OK ) == 0)
 		goto end;
 
-	/* Open new file */
-	fp = fopen(file_path, "wb");
-	if(fp == NULL)
+	/* Write to a temporary file and publish it (cover is never seen
+	 * partially written by a concurrent scan or request)
+	 */
+	asprintf(&tmp, "%s/tmpXXXXXX", path);
+	if(tmp == NULL)
 		goto end;
-
-	/* Write data to it */
-	fwrite(meta->picture.data, meta->picture.size, 1, fp);
-
-	/* Close file */
-	fclose(fp);
+	fd = mkstemp(tmp);
+	if(fd < 0)
+		goto end;
+	ret = write(fd, meta->picture.data, meta->picture.size) ==
+					 (ssize_t) meta->picture.size ? 0 : -1;
+	fchmod(fd, 0644);
+	close(fd);
+	if(ret != 0 || rename(tmp, file_path) != 0)
+		unlink(tmp);
 
 end:
 	if(md5 != NULL)
 		free(md5);
 	if(file_path != NULL)
 		free(file_path);
+	if(tmp != NULL)
+		free(tmp);
 	return cover;
 }
 
+static unsigned char *files_list_read_cover(const char *path, size_t *len)
+{
+	unsigned char *data;
+	struct stat st;
+	ssize_t ret;
+	size_t pos;
+	int fd;
+
+	/* Open cover */
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(fd < 0)
+		return NULL;
+	if(fstat(fd, &st) != 0 || st.st_size <= 0)
+	{
+		close(fd);
+		return NULL;
+	}
+
+	/* Read all cover */
+	data = malloc(st.st_size);
+	for(pos = 0; data != NULL && pos < (size_t) st.st_size; pos += ret)
+	{
+		ret = read(fd, data + pos, st.st_size - pos);
+		if(ret <= 0)
+		{
+			free(data);
+			data = NULL;
+		}
+	}
+	close(fd);
+	*len = st.st_size;
+
+	return data;
+}
+
+char *files_list_get_thumbnail(const char *cover_path, const char *cover,
+			       unsigned long size)
+{
+	char *path = NULL, *tmp = NULL, *name = NULL;
+	unsigned char *data, *thumb;
+	size_t len, thumb_len;
+	unsigned int t_size;
+	const char *ext;
+	int fd, ret;
+
+	/* Only covers of cover folder are allowed */
+	if(cover == NULL || *cover == '\0' || strchr(cover, '/') != NULL ||
+	   *cover == '.')
+		return NULL;
+
+	/* Thumbnail is named with cover name (hash of image) and its size */
+	t_size = image_thumbnail_size(size);
+	ext = strrchr(cover, '.');
+	asprintf(&name, "thumbs/%u/%.*s.jpg", t_size,
+		 ext != NULL ? (int) (ext - cover) : (int) strlen(cover), cover);
+	if(name == NULL)
+		return NULL;
+	asprintf(&path, "%s/%s", cover_path, name);
+	if(path == NULL)
+		goto error;
+
+	/* Thumbnail already exists */
+	if(access(path, F_OK) == 0)
+		goto end;
+
+	/* Read original cover */
+	asprintf(&tmp, "%s/%s", cover_path, cover);
+	if(tmp == NULL)
+		goto error;
+	data = files_list_read_cover(tmp, &len);
+	free(tmp);
+	tmp = NULL;
+	if(data == NULL)
+		goto error;
+
+	/* Generate thumbnail: original is used if it is already small */
+	ret = image_thumbnail(data, len, t_size, &thumb, &thumb_len);
+	free(data);
+	if(ret != 0)
+		goto error;
+
+	/* Create thumbnail folders */
+	asprintf(&tmp, "%s/thumbs/%u/tmpXXXXXX", cover_path, t_size);
+	if(tmp == NULL)
+		goto free_thumb;
+	*strrchr(tmp, '/') = '\0';
+	*strrchr(tmp, '/') = '\0';
+	mkdir(tmp, 0755);
+	tmp[strlen(tmp)] = '/';
+	mkdir(tmp, 0755);
+	tmp[strlen(tmp)] = '/';
+
+	/* Write to a temporary file and publish it (thumbnail is never seen
+	 * partially written by a concurrent request)
+	 */
+	fd = mkstemp(tmp);
+	if(fd < 0)
+		goto free_thumb;
+	ret = write(fd, thumb, thumb_len) == (ssize_t) thumb_len ? 0 : -1;
+	fchmod(fd, 0644);
+	close(fd);
+	if(ret != 0 || rename(tmp, path) != 0)
+	{
+		unlink(tmp);
+		goto free_thumb;
+	}
+	free(thumb);
+
+end:
+	free(path);
+	free(tmp);
+	return name;
+
+free_thumb:
+	free(thumb);
+error:
+	free(path);
+	free(tmp);
+	free(name);
+	return NULL;
+}
+
 #define FILES_SQL_INSERT "INSERT INTO song (file,title,artist_id,album_id," \
 			 "comment,genre_id,track,year,duration,bitrate," \
 			 "samplerate,channels,copyright,encoded,language," \
@@ -426,35 +727,43 @@ static int64_t files_list_update_sub_table(struct db_handle *db,
 	return id;
 }
 
-static int files_list_update_file(struct db_handle *db, const char *cover_path,
-				  const char *path, const char *file,
-				  int64_t mtime, int64_t path_id, int64_t id)
+static struct meta *files_list_parse_file(const char *cover_path,
+					  const char *path, const char *file,
+					  char **cover)
 {
-	struct meta *meta = NULL;
-	int64_t artist_id = 1;
-	int64_t album_id = 1;
-	int64_t cover_id = 1;
-	int64_t genre_id = 1;
-	char *cover = NULL;
+	struct meta *meta;
 	char *file_path;
-	char *in_sql = NULL;
-	char *se_sql = NULL;
-	char *str = NULL;
-	int ret = -1;
 
 	/* Generate complete path */
+	*cover = NULL;
 	asprintf(&file_path, "%s/%s", path, file);
 	if(file_path == NULL)
-		return -1;
+		return NULL;
 
 	/* Get format and tag from file */
-	meta = meta_parse(file_path, TAG_PICTURE);
+	meta = meta_parse(file_path, TAG_PICTURE | TAG_SCAN);
 	free(file_path);
 
-	/* Save format */
+	/* Save cover */
 	if(meta != NULL && meta->picture.data != NULL &&
 	   meta->picture.size > 0)
-		cover = files_list_save_cover(meta, cover_path, file);
+		*cover = files_list_save_cover(meta, cover_path, file);
+
+	return meta;
+}
+
+static int files_list_write_file(struct db_handle *db, struct meta *meta,
+				 const char *cover, const char *file,
+				 int64_t mtime, int64_t path_id, int64_t id)
+{
+	int64_t artist_id = 1;
+	int64_t album_id = 1;
+	int64_t cover_id = 1;
+	int64_t genre_id = 1;
+	char *in_sql = NULL;
+	char *se_sql = NULL;
+	char *str = NULL;
+	int ret = -1;
 
 	/* Add artist and album to database */
 	if(meta != NULL)
@@ -613,6 +922,21 @@ end:
 	if(str != NULL)
 		db_free(str);
 
+	return ret;
+}
+
+static int files_list_update_file(struct db_handle *db, const char *cover_path,
+				  const char *path, const char *file,
+				  int64_t mtime, int64_t path_id, int64_t id)
+{
+	struct meta *meta;
+	char *cover;
+	int ret;
+
+	/* Parse file and add it to database */
+	meta = files_list_parse_file(cover_path, path, file, &cover);
+	ret = files_list_write_file(db, meta, cover, file, mtime, path_id, id);
+
 	/* Free meta */
 	if(meta != NULL)
 		meta_free(meta);
@@ -630,29 +954,26 @@ static int files_list_add_meta(struct db_handle *db, struct json *root,
 			       const char *cover_path)
 {
 	struct db_query *query;
-	char *sql = NULL;
 	int up = 0;
 	int ret;
 
-	/* Prepare SQL request */
-	sql = db_mprintf("SELECT id,mtime,title,artist,album,cover,genre,"
-			 "artist_id,album_id,genre_id "
-			 "FROM song "
-			 "LEFT JOIN artist USING (artist_id) "
-			 "LEFT JOIN album USING (album_id) "
-			 "LEFT JOIN cover USING (cover_id) "
-			 "LEFT JOIN genre USING (genre_id) "
-			 "WHERE file='%q' AND path_id='%ld'",
-			 file, path_id);
-	if(sql == NULL)
-		goto end;
-
 retry:
 	/* Prepare request */
-	query = db_prepare(db, sql, -1);
+	query = db_prepare(db, "SELECT id,mtime,title,artist,album,cover,"
+			       "genre,artist_id,album_id,genre_id "
+			       "FROM song "
+			       "LEFT JOIN artist USING (artist_id) "
+			       "LEFT JOIN album USING (album_id) "
+			       "LEFT JOIN cover USING (cover_id) "
+			       "LEFT JOIN genre USING (genre_id) "
+			       "WHERE file=? AND path_id=?", -1);
 	if(query == NULL)
 		goto end;
 
+	/* Bind file and path */
+	db_bind_text(query, 1, file);
+	db_bind_int64(query, 2, path_id);
+
 	/* Do request */
 	ret = db_step(query);
 
@@ -697,16 +1018,110 @@ retry:
 end:
 	/* Finalize request */
 	db_finalize(query);
-	if(sql != NULL)
-		db_free(sql);
 
 	return 0;
 }
 
+/* A page of listing filled by SQL callbacks: key and id of last row are kept
+ * to generate the cursor of next page.
+ */
+struct files_list_page {
+	struct json_stream *list;
+	unsigned long count;
+	int key_col;
+	int id_col;
+	char *key;
+	int64_t id;
+};
+
+static void files_list_page_last(struct files_list_page *p, char **values)
+{
+	/* Keep sort key and id of row */
+	if(p->key != NULL)
+		free(p->key);
+	p->key = values[p->key_col] != NULL ? strdup(values[p->key_col]) :
+					      NULL;
+	p->id = strtoll(values[p->id_col], NULL, 10);
+	p->count++;
+}
+
+static char *files_list_encode_cursor(const char *fmt, ...)
+{
+	static const char hex[] = "0123456789abcdef";
+	char *str, *cursor;
+	va_list ap;
+	int len, i;
+
+	/* Generate cursor string */
+	va_start(ap, fmt);
+	len = vasprintf(&str, fmt, ap);
+	va_end(ap);
+	if(len < 0)
+		return NULL;
+
+	/* Encode in hexadecimal to get an opaque string usable in URL */
+	cursor = malloc(len * 2 + 1);
+	if(cursor != NULL)
+	{
+		for(i = 0; i < len; i++)
+		{
+			cursor[i*2] = hex[(unsigned char) str[i] >> 4];
+			cursor[i*2+1] = hex[(unsigned char) str[i] & 0x0F];
+		}
+		cursor[len*2] = '\0';
+	}
+	free(str);
+
+	return cursor;
+}
+
+static int files_list_hex(char c)
+{
+	if(c >= '0' && c <= '9')
+		return c - '0';
+	if(c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+static char *files_list_decode_cursor(const char *cursor)
+{
+	size_t len, i;
+	char *str;
+	int h, l;
+
+	/* Check length */
+	len = strlen(cursor);
+	if(len % 2 != 0)
+		return NULL;
+
+	/* Allocate string */
+	str = malloc(len / 2 + 1);
+	if(str == NULL)
+		return NULL;
+
+	/* Decode hexadecimal string */
+	for(i = 0; i < len / 2; i++)
+	{
+		h = files_list_hex(cursor[i*2]);
+		l = files_list_hex(cursor[i*2+1]);
+		if(h < 0 || l < 0 || (h == 0 && l == 0))
+		{
+			free(str);
+			return NULL;
+		}
+		str[i] = (h << 4) | l;
+	}
+	str[len/2] = '\0';
+
+	return str;
+}
+
 static int files_list_add_file(void *user_data, int col_count, char **values,
 			       char **names)
 {
-	struct json *list = user_data;
+	struct files_list_page *page = user_data;
+	struct json_stream *list = page->list;
 	struct json *tmp;
 
 	/* Create JSON object */
@@ -728,8 +1143,8 @@ static int files_list_add_file(void *user_data, int col_count, char **values,
 	json_set_int64(tmp, "genre_id", strtoul(values[8], NULL, 10));
 
 	/* Add object to array */
-	if(json_array_add(list, tmp) != 0)
-		json_free(tmp);
+	json_stream_add(list, NULL, tmp);
+	files_list_page_last(page, values);
 
 	return 0;
 }
@@ -737,7 +1152,8 @@ static int files_list_add_file(void *user_data, int col_count, char **values,
 static int files_list_add_album(void *user_data, int col_count, char **values,
 			        char **names)
 {
-	struct json *list = user_data;
+	struct files_list_page *page = user_data;
+	struct json_stream *list = page->list;
 	struct json *tmp;
 
 	/* Create JSON object */
@@ -751,8 +1167,8 @@ static int files_list_add_album(void *user_data, int col_count, char **values,
 	json_set_string(tmp, "cover", values[2]);
 
 	/* Add object to array */
-	if(json_array_add(list, tmp) != 0)
-		json_free(tmp);
+	json_stream_add(list, NULL, tmp);
+	files_list_page_last(page, values);
 
 	return 0;
 }
@@ -760,7 +1176,8 @@ static int files_list_add_album(void *user_data, int col_count, char **values,
 static int files_list_add_artist(void *user_data, int col_count, char **values,
 			         char **names)
 {
-	struct json *list = user_data;
+	struct files_list_page *page = user_data;
+	struct json_stream *list = page->list;
 	struct json *tmp;
 
 	/* Create JSON object */
@@ -773,8 +1190,8 @@ static int files_list_add_artist(void *user_data, int col_count, char **values,
 	json_set_int64(tmp, "artist_id", strtoul(values[1], NULL, 10));
 
 	/* Add object to array */
-	if(json_array_add(list, tmp) != 0)
-		json_free(tmp);
+	json_stream_add(list, NULL, tmp);
+	files_list_page_last(page, values);
 
 	return 0;
 }
@@ -782,7 +1199,8 @@ static int files_list_add_artist(void *user_data, int col_count, char **values,
 static int files_list_add_genre(void *user_data, int col_count, char **values,
 			        char **names)
 {
-	struct json *list = user_data;
+	struct files_list_page *page = user_data;
+	struct json_stream *list = page->list;
 	struct json *tmp;
 
 	/* Create JSON object */
@@ -795,8 +1213,8 @@ static int files_list_add_genre(void *user_data, int col_count, char **values,
 	json_set_int64(tmp, "genre_id", strtoul(values[1], NULL, 10));
 
 	/* Add object to array */
-	if(json_array_add(list, tmp) != 0)
-		json_free(tmp);
+	json_stream_add(list, NULL, tmp);
+	files_list_page_last(page, values);
 
 	return 0;
 }
@@ -874,26 +1292,46 @@ char *files_list_files(struct db_handle *db, const char *cover_path,
 		       int64_t media_id, const char *uri, unsigned long page,
 		       unsigned long count, enum files_list_sort sort,
 		       enum files_list_display display, int64_t artist_id,
-		       int64_t album_id, int64_t genre_id, const char *filter)
+		       int64_t album_id, int64_t genre_id, const char *filter,
+		       const char *cursor, char **next_cursor)
 {
 	int (*_sort)(const struct fs_dirent **, const struct fs_dirent **);
 	int (*_filter)(const struct fs_dirent *) = files_list_filter;
 	struct fs_dirent **list_dir = NULL;
-	struct json *root, *tmp;
+	struct files_list_page p = { .count = 0, .key = NULL, .key_col = 0,
+				     .id_col = 1 };
+	struct json_stream *root;
+	struct json *tmp;
 	char *real_path = NULL;
+	char *match = NULL;
 	char *str = NULL;
 	char *tag_sort;
+	const char *dir;
+	char *c_str = NULL;
+	char *key = NULL;
+	char *keyset = NULL;
+	int64_t key_id = 0;
+	int key_null = 0;
+	int desc;
 	int64_t path_id = 0;
 	int list_count = 0;
 	int only_dir = 0;
 	unsigned long offset = 0;
+	unsigned long sql_offset;
+	unsigned long max;
+	int use_key = 1;
 	time_t mtime;
+	int c_display, c_sort, n;
 	int i;
 
 	/* Create new JSON array */
-	root = json_new_array();
+	root = json_stream_new();
 	if(root == NULL)
 		return NULL;
+	json_stream_begin_array(root, NULL);
+	p.list = root;
+	if(next_cursor != NULL)
+		*next_cursor = NULL;
 
 	/* Set default values */
 	if(page == 0)
@@ -901,9 +1339,31 @@ char *files_list_files(struct db_handle *db, const char *cover_path,
 	if(count == 0)
 		count = FILES_LIST_DEFAULT_COUNT;
 	offset = (page-1) * count;
+	max = count;
 	if(!media_id)
 		media_id = 1;
 
+	/* Continue listing from a cursor: an offset ("o:offset"), the sort
+	 * key and id of last row ("k:display:sort:id:key") or the id of last
+	 * row when its sort key is NULL ("n:display:sort:id")
+	 */
+	if(cursor != NULL && (c_str = files_list_decode_cursor(cursor)) != NULL)
+	{
+		if(sscanf(c_str, "o:%lu%n", &offset, &n) == 1 &&
+		   c_str[n] == '\0')
+			;
+		else if(sscanf(c_str, "k:%d:%d:%" SCNd64 ":%n", &c_display,
+			       &c_sort, &key_id, &n) == 3 &&
+			c_display == display && c_sort == sort)
+			key = c_str + n;
+		else if(sscanf(c_str, "n:%d:%d:%" SCNd64 "%n", &c_display,
+			       &c_sort, &key_id, &n) == 3 && c_str[n] == '\0' &&
+			c_display == display && c_sort == sort)
+			key_null = 1;
+		else
+			offset = 0;
+	}
+
 	/* Skip directory scan */
 	if(media_id == 0)
 	{
@@ -949,9 +1409,14 @@ char *files_list_files(struct db_handle *db, const char *cover_path,
 
 		/* Scan all directory not recursively */
 		files_list_recursive_scan(db, cover_path, media_id, real_path,
-					  strlen(real_path)-strlen(uri), 0, 0);
+					  strlen(real_path)-strlen(uri), 0, 0,
+					  0);
 	}
 
+	/* Folders are all listed before rows of a keyset cursor */
+	if(key != NULL || key_null)
+		goto do_sql;
+
 	/* Scan folder in alphabetic order */
 	list_count = fs_scandir(real_path, &list_dir, _filter, _sort);
 	if(list_count < 0)
@@ -980,8 +1445,7 @@ char *files_list_files(struct db_handle *db, const char *cover_path,
 				json_set_string(tmp, "type", "directory");
 
 			/* Add to array */
-			if(json_array_add(root, tmp) != 0)
-				json_free(tmp);
+			json_stream_add(root, NULL, tmp);
 
 			count--;
 		}
@@ -1002,25 +1466,35 @@ char *files_list_files(struct db_handle *db, const char *cover_path,
 					    NULL);
 
 			/* Add to array */
-			if(json_array_add(root, tmp) != 0)
-				json_free(tmp);
+			json_stream_add(root, NULL, tmp);
 
 			count--;
 		}
 next:
 		/* Free dir entry */
 		free(list_dir[i]);
+		list_dir[i] = NULL;
 	}
 
-	/* Free list */
+	/* Free list (with entries out of page) */
 	if(list_dir != NULL)
+	{
+		for(i = 0; i < list_count; i++)
+			free(list_dir[i]);
 		free(list_dir);
+	}
 
 do_sql:
 	/* No more files to retrieve */
 	if(only_dir == 0 || count == 0)
 		goto end;
 
+	/* Sort direction and keyset comparison */
+	desc = sort >= FILES_LIST_SORT_TITLE_REVERSE;
+	dir = desc ? "DESC" : "ASC";
+	sql_offset = key != NULL || key_null || offset < list_count ? 0 :
+							  offset - list_count;
+
 	/* Sort by tag */
 	if(display == FILES_LIST_DISPLAY_DEFAULT)
 	{
@@ -1055,10 +1529,38 @@ do_sql:
 				tag_sort = "file";
 		}
 
+		/* Search in full-text index (best matches first by default) */
+		if(filter != NULL && files_fts)
+		{
+			match = files_list_fts_match(filter, NULL);
+			if(match == NULL)
+				filter = NULL;
+			else if(sort < FILES_LIST_SORT_TITLE)
+				tag_sort = "fts_rank";
+		}
+
+		/* Rank is not a stable key: continue by offset */
+		if(strcmp(tag_sort, "fts_rank") == 0)
+		{
+			use_key = 0;
+			key = NULL;
+			key_null = 0;
+		}
+		p.key_col = 10;
+		p.id_col = 9;
+
+		/* Continue after last row of cursor */
+		if(key != NULL || key_null)
+			keyset = files_keyset_where(tag_sort, "song.id", desc,
+						    key, key_id);
+
 		/* Complete request with data from database */
 		str = db_mprintf("SELECT file,title,artist,album,cover,genre,"
-				 "artist_id,album_id,genre_id "
-				 "FROM song "
+				 "artist_id,album_id,genre_id,song.id,%s "
+				 "FROM song \n"
+				 "%s JOIN (SELECT rowid AS fts_id,rank AS fts_rank "
+				 "FROM song_fts WHERE song_fts MATCH '%q') "
+				 "ON fts_id=song.id \n"
 				 "LEFT JOIN artist USING (artist_id) "
 				 "LEFT JOIN album USING (album_id) "
 				 "LEFT JOIN cover USING (cover_id) "
@@ -1071,90 +1573,167 @@ do_sql:
 				 "%s (title LIKE '%%%q%%' OR "
 				 "album LIKE '%%%q%%' OR "
 				 "artist LIKE '%%%q%%') \n"
-				 "ORDER BY %s %s LIMIT %ld, %ld",
+				 "%s \n"
+				 "ORDER BY %s %s,song.id %s LIMIT %ld, %ld",
+				 tag_sort, match == NULL ? "--" : "", match,
 				 media_id == 0 ? "--" : "AND", path_id,
 				 album_id == 0 ? "--" : "AND", album_id,
 				 artist_id == 0 ? "--" : "AND", artist_id,
 				 genre_id == 0 ? "--" : "AND", genre_id,
-				 filter == NULL ? "--" : "AND", filter, filter,
-				 filter, tag_sort,
-				 sort >= FILES_LIST_SORT_TITLE_REVERSE ?
-								 "DESC" : "ASC",
-				 offset > list_count ? offset - list_count : 0,
-				 count);
+				 filter == NULL || match != NULL ? "--" : "AND",
+				 filter, filter, filter,
+				 keyset != NULL ? keyset : "", tag_sort, dir,
+				 dir, sql_offset, count);
 
 		/* Do request */
 		if(str != NULL)
 		{
-			db_exec(db, str, files_list_add_file, root);
+			db_exec(db, str, files_list_add_file, &p);
 			db_free(str);
 		}
 	}
 	else if(display == FILES_LIST_DISPLAY_ALBUM)
 	{
+		/* Search in full-text index */
+		if(filter != NULL && files_fts)
+		{
+			match = files_list_fts_match(filter, "album");
+			if(match == NULL)
+				filter = NULL;
+		}
+
+		/* Continue after last row of cursor */
+		if(key != NULL || key_null)
+			keyset = files_keyset_where("album", "album_id", desc, key,
+						    key_id);
+
 		/* Prepare request */
 		str = db_mprintf("SELECT album,album_id,cover FROM album "
 				 "LEFT JOIN cover USING (cover_id) \n"
-				 "%sWHERE album LIKE '%%%q%%' \n"
-				 "ORDER BY album %s LIMIT %ld, %ld",
-				 filter == NULL ? "--" : "", filter,
-				 sort >= FILES_LIST_SORT_TITLE_REVERSE ?
-								 "DESC" : "ASC",
-				 offset > list_count ? offset - list_count : 0,
-				 count);
+				 "WHERE 1 \n"
+				 "%s AND album LIKE '%%%q%%' \n"
+				 "%s AND album_id IN (SELECT album_id FROM song "
+				 "WHERE id IN (SELECT rowid FROM song_fts "
+				 "WHERE song_fts MATCH '%q')) \n"
+				 "%s \n"
+				 "ORDER BY album %s,album_id %s LIMIT %ld, %ld",
+				 filter == NULL || match != NULL ? "--" : "",
+				 filter, match == NULL ? "--" : "", match,
+				 keyset != NULL ? keyset : "", dir, dir,
+				 sql_offset, count);
 
 		/* Do request */
 		if(str != NULL)
 		{
-			db_exec(db, str, files_list_add_album, root);
+			db_exec(db, str, files_list_add_album, &p);
 			db_free(str);
 		}
 	}
 	else if(display == FILES_LIST_DISPLAY_ARTIST)
 	{
+		/* Search in full-text index */
+		if(filter != NULL && files_fts)
+		{
+			match = files_list_fts_match(filter, "artist");
+			if(match == NULL)
+				filter = NULL;
+		}
+
+		/* Continue after last row of cursor */
+		if(key != NULL || key_null)
+			keyset = files_keyset_where("artist", "artist_id", desc,
+						    key, key_id);
+
 		/* Prepare request */
 		str = db_mprintf("SELECT artist,artist_id FROM artist \n"
-				 "%sWHERE artist LIKE '%%%q%%' \n"
-				 "ORDER BY artist %s LIMIT %ld, %ld",
-				 filter == NULL ? "--" : "", filter,
-				 sort >= FILES_LIST_SORT_TITLE_REVERSE ?
-								 "DESC" : "ASC",
-				 offset > list_count ? offset - list_count : 0,
-				 count);
+				 "WHERE 1 \n"
+				 "%s AND artist LIKE '%%%q%%' \n"
+				 "%s AND artist_id IN (SELECT artist_id FROM song "
+				 "WHERE id IN (SELECT rowid FROM song_fts "
+				 "WHERE song_fts MATCH '%q')) \n"
+				 "%s \n"
+				 "ORDER BY artist %s,artist_id %s LIMIT %ld, %ld",
+				 filter == NULL || match != NULL ? "--" : "",
+				 filter, match == NULL ? "--" : "", match,
+				 keyset != NULL ? keyset : "", dir, dir,
+				 sql_offset, count);
 
 		/* Do request */
 		if(str != NULL)
 		{
-			db_exec(db, str, files_list_add_artist, root);
+			db_exec(db, str, files_list_add_artist, &p);
 			db_free(str);
 		}
 	}
 	else if(display == FILES_LIST_DISPLAY_GENRE)
 	{
+		/* Search in full-text index */
+		if(filter != NULL && files_fts)
+		{
+			match = files_list_fts_match(filter, "genre");
+			if(match == NULL)
+				filter = NULL;
+		}
+
+		/* Continue after last row of cursor */
+		if(key != NULL || key_null)
+			keyset = files_keyset_where("genre", "genre_id", desc,
+						    key, key_id);
+
 		/* Prepare request */
 		str = db_mprintf("SELECT genre,genre_id FROM genre \n"
-				 "%sWHERE genre LIKE '%%%q%%' \n"
-				 "ORDER BY genre %s LIMIT %ld, %ld",
-				 filter == NULL ? "--" : "", filter,
-				 sort >= FILES_LIST_SORT_TITLE_REVERSE ?
-								 "DESC" : "ASC",
-				 offset > list_count ? offset - list_count : 0,
-				 count);
+				 "WHERE 1 \n"
+				 "%s AND genre LIKE '%%%q%%' \n"
+				 "%s AND genre_id IN (SELECT genre_id FROM song "
+				 "WHERE id IN (SELECT rowid FROM song_fts "
+				 "WHERE song_fts MATCH '%q')) \n"
+				 "%s \n"
+				 "ORDER BY genre %s,genre_id %s LIMIT %ld, %ld",
+				 filter == NULL || match != NULL ? "--" : "",
+				 filter, match == NULL ? "--" : "", match,
+				 keyset != NULL ? keyset : "", dir, dir,
+				 sql_offset, count);
 
 		/* Do request */
 		if(str != NULL)
 		{
-			db_exec(db, str, files_list_add_genre, root);
+			db_exec(db, str, files_list_add_genre, &p);
 			db_free(str);
 		}
 	}
 
 end:
-	/* Get string from JSON object */
-	str = strdup(json_export(root));
+	/* Generate cursor of next page when page is full: keyset after rows
+	 * from database, or offset of next entry
+	 */
+	if(next_cursor != NULL && (count == 0 || p.count == count))
+	{
+		if(p.count > 0 && use_key && p.key != NULL)
+			*next_cursor = files_list_encode_cursor(
+						   "k:%d:%d:%" PRId64 ":%s",
+						   display, sort, p.id, p.key);
+		else if(p.count > 0 && use_key)
+			*next_cursor = files_list_encode_cursor(
+						   "n:%d:%d:%" PRId64,
+						   display, sort, p.id);
+		else
+			*next_cursor = files_list_encode_cursor("o:%lu",
+								offset + max);
+	}
+
+	/* Get string from JSON array */
+	json_stream_end_array(root);
+	str = json_stream_finish(root, NULL);
 
-	/* Free JSON object */
-	json_free(root);
+	/* Free search string and cursor */
+	if(match != NULL)
+		free(match);
+	if(c_str != NULL)
+		free(c_str);
+	if(keyset != NULL)
+		db_free(keyset);
+	if(p.key != NULL)
+		free(p.key);
 
 	/* Free path */
 	if(real_path != NULL)
@@ -1163,8 +1742,9 @@ end:
 	return str;
 }
 
-static int files_list_update_media(struct db_handle *db, struct json *list,
-				   const char *name, const char *path)
+static int files_list_update_media(struct db_handle *db,
+				   struct json_stream *list, const char *name,
+				   const char *path)
 {
 	struct db_query *query;
 	struct json *tmp;
@@ -1227,8 +1807,7 @@ retry:
 	json_set_string(tmp, "path", path);
 
 	/* Add object to array */
-	if(json_array_add(list, tmp) != 0)
-		json_free(tmp);
+	json_stream_add(list, NULL, tmp);
 
 end:
 	/* Finalize request */
@@ -1251,7 +1830,7 @@ error:
 static int files_list_user_media(void *user_data, int col_count, char **values,
 				 char **names)
 {
-	struct json *list = user_data;
+	struct json_stream *list = user_data;
 	struct json *tmp;
 
 	/* Create JSON object */
@@ -1265,8 +1844,7 @@ static int files_list_user_media(void *user_data, int col_count, char **values,
 	json_set_string(tmp, "path", values[2]);
 
 	/* Add object to array */
-	if(json_array_add(list, tmp) != 0)
-		json_free(tmp);
+	json_stream_add(list, NULL, tmp);
 
 	return 0;
 }
@@ -1274,7 +1852,7 @@ static int files_list_user_media(void *user_data, int col_count, char **values,
 char *files_list_media(struct db_handle *db, const char *path,
 		       const char *mount_path)
 {
-	struct json *root, *list;
+	struct json_stream *root;
 	struct fs_dirent *d;
 	struct fs_dir *dir;
 	char *name;
@@ -1282,17 +1860,16 @@ char *files_list_media(struct db_handle *db, const char *path,
 	int len;
 
 	/* Create a new JSON object */
-	root = json_new();
+	root = json_stream_new();
 	if(root == NULL)
 		return NULL;
+	json_stream_begin_object(root, NULL);
 
 	/* Create local media list */
-	list = json_new_array();
-	if(list == NULL)
-		goto end;
+	json_stream_begin_array(root, "local");
 
 	/* Add main media source */
-	files_list_update_media(db, list, "Local", path);
+	files_list_update_media(db, root, "Local", path);
 
 	/* Get local media sources */
 	dir = fs_mount("/");
@@ -1315,7 +1892,7 @@ char *files_list_media(struct db_handle *db, const char *path,
 					str++;
 
 				/* Update media database */
-				files_list_update_media(db, list, str, d->name);
+				files_list_update_media(db, root, str, d->name);
 			}
 		}
 
@@ -1323,24 +1900,20 @@ char *files_list_media(struct db_handle *db, const char *path,
 		fs_closedir(dir);
 	}
 
-	/* Add list to JSON object */
-	json_add(root, "local", list);
+	/* Close local media list */
+	json_stream_end_array(root);
 
 	/* Create network media list */
-	list = json_new_array();
-	if(list == NULL)
-		goto end;
+	json_stream_begin_array(root, "network");
 
 	/* Add network media source */
-	files_list_update_media(db, list, "Samba", "smb://");
+	files_list_update_media(db, root, "Samba", "smb://");
 
-	/* Add list to JSON object */
-	json_add(root, "network", list);
+	/* Close network media list */
+	json_stream_end_array(root);
 
 	/* Create user media list */
-	list = json_new_array();
-	if(list == NULL)
-		goto end;
+	json_stream_begin_array(root, "user");
 
 	/* Add user media source */
 	str = db_mprintf("SELECT media_id,name,path FROM media "
@@ -1348,21 +1921,16 @@ char *files_list_media(struct db_handle *db, const char *path,
 	if(str != NULL)
 	{
 		/* Get user media */
-		db_exec(db, str, files_list_user_media, list);
+		db_exec(db, str, files_list_user_media, root);
 		db_free(str);
 	}
 
-	/* Add list to JSON object */
-	json_add(root, "user", list);
+	/* Close user media list */
+	json_stream_end_array(root);
 
-end:
 	/* Get output */
-	str = strdup(json_export(root));
-
-	/* Free JSON object */
-	json_free(root);
-
-	return str;
+	json_stream_end_object(root);
+	return json_stream_finish(root, NULL);
 }
 
 int files_list_add_media(struct db_handle *db, const char *name,
@@ -1451,19 +2019,13 @@ char *files_list_get_media(struct db_handle *db, int64_t media_id)
 {
 	struct db_query *q;
 	char *str = NULL;
-	char *sql;
 
 	if(media_id == 0)
 		media_id = 1;
 
-	/* Generate SQL request */
-	sql = db_mprintf("SELECT path FROM media WHERE media_id='%ld'",
-			 media_id);
-	if(sql == NULL)
-		return NULL;
-
 	/* Prepare request */
-	q = db_prepare(db, sql, -1);
+	q = db_prepare(db, "SELECT path FROM media WHERE media_id=?", -1);
+	db_bind_int64(q, 1, media_id);
 
 	/* Do request */
 	if(db_step(q) == 0)
@@ -1475,63 +2037,551 @@ char *files_list_get_media(struct db_handle *db, int64_t media_id)
 
 	/* Finalize request */
 	db_finalize(q);
-	db_free(sql);
 
 	return str;
 }
 
-static int files_list_recursive_scan(struct db_handle *db,
-				     const char *cover_path, int64_t media_id,
-				     const char *path, int len, int recursive,
-				     int update_status)
+int files_list_get_seek_table(struct db_handle *db, const char *file,
+			      int64_t mtime, uint32_t **table,
+			      unsigned long *count)
 {
-	struct dirent *dir = NULL;
+	struct db_query *q;
+	const void *blob;
+	int ret = -1;
+	int len;
+
+	/* Prepare request */
+	q = db_prepare(db, "SELECT data FROM seek_table "
+			   "WHERE file=? AND mtime=?", -1);
+	db_bind_text(q, 1, file);
+	db_bind_int64(q, 2, mtime);
+
+	/* Do request and copy table */
+	if(db_step(q) == 0)
+	{
+		len = db_column_blob(q, 0, &blob);
+		if(blob != NULL && len >= sizeof(uint32_t) &&
+		   (*table = malloc(len)) != NULL)
+		{
+			memcpy(*table, blob, len);
+			*count = len / sizeof(uint32_t);
+			ret = 0;
+		}
+	}
+
+	/* Finalize request */
+	db_finalize(q);
+
+	return ret;
+}
+
+int files_list_set_seek_table(struct db_handle *db, const char *file,
+			      int64_t mtime, const uint32_t *table,
+			      unsigned long count)
+{
+	struct db_query *q;
+	int ret = -1;
+
+	/* Prepare request */
+	q = db_prepare(db, "INSERT OR REPLACE INTO seek_table "
+			   "(file,mtime,data) VALUES (?,?,?)", -1);
+
+	/* Bind values and do request */
+	if(db_bind_text(q, 1, file) == 0 && db_bind_int64(q, 2, mtime) == 0 &&
+	   db_bind_blob(q, 3, table, count * sizeof(uint32_t)) == 0 &&
+	   db_step(q) == DB_DONE)
+		ret = 0;
+
+	/* Finalize request */
+	db_finalize(q);
+
+	return ret;
+}
+
+struct files_list_job {
+	/* File to parse */
+	char *path;
+	char *name;
+	int64_t mtime;
+	int64_t path_id;
+	int64_t id;
+	/* Parsed tags and cover */
+	struct meta *meta;
+	char *cover;
+	struct files_list_job *next;
+};
+
+struct files_list_queue {
+	struct files_list_job *first;
+	struct files_list_job *last;
+	unsigned int count;
+	int closed;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond_get;
+	pthread_cond_t cond_put;
+};
+
+struct files_list_dir {
 	int64_t path_id;
 	int64_t mtime;
-	struct stat s;
-	char *r_path;
+};
+
+struct files_list_scan {
+	struct db_handle *db;
+	const char *cover_path;
+	int64_t media_id;
+	int recursive;
+	int update_status;
+	int full;
+	/* Path buffer shared by all levels */
+	char *path;
+	size_t size;
+	int len;
+	/* Modification times of scanned folders, saved at end of scan */
+	struct files_list_dir *dirs;
+	size_t dir_count;
+	size_t dir_size;
+	time_t start;
+	/* Files to parse (walker -> workers) and to add (workers -> writer) */
+	struct files_list_queue jobs;
+	struct files_list_queue results;
+	pthread_t workers[FILES_LIST_WORKERS];
+	unsigned int worker_count;
+	unsigned int running;
+	pthread_t writer;
+	int threaded;
+};
+
+static void files_list_queue_init(struct files_list_queue *q)
+{
+	q->first = NULL;
+	q->last = NULL;
+	q->count = 0;
+	q->closed = 0;
+	pthread_mutex_init(&q->mutex, NULL);
+	pthread_cond_init(&q->cond_get, NULL);
+	pthread_cond_init(&q->cond_put, NULL);
+}
+
+static void files_list_queue_push(struct files_list_queue *q,
+				  struct files_list_job *j)
+{
+	/* Lock queue access */
+	pthread_mutex_lock(&q->mutex);
+
+	/* Wait for a free place */
+	while(q->count >= FILES_LIST_QUEUE && !q->closed)
+		pthread_cond_wait(&q->cond_put, &q->mutex);
+
+	/* Add job at end of queue */
+	j->next = NULL;
+	if(q->last != NULL)
+		q->last->next = j;
+	else
+		q->first = j;
+	q->last = j;
+	q->count++;
+
+	/* Wake up a consumer */
+	pthread_cond_signal(&q->cond_get);
+
+	/* Unlock queue access */
+	pthread_mutex_unlock(&q->mutex);
+}
+
+/* Get next job: return 1 on timeout and -1 when queue is closed and empty */
+static int files_list_queue_pop(struct files_list_queue *q,
+				const struct timespec *deadline,
+				struct files_list_job **job)
+{
+	struct files_list_job *j;
+	int ret = 0;
+
+	/* Lock queue access */
+	pthread_mutex_lock(&q->mutex);
+
+	/* Wait for a job */
+	while(q->first == NULL && !q->closed && ret == 0)
+	{
+		if(deadline == NULL)
+			pthread_cond_wait(&q->cond_get, &q->mutex);
+		else if(pthread_cond_timedwait(&q->cond_get, &q->mutex,
+					       deadline) != 0)
+			ret = 1;
+	}
+
+	/* Remove job from queue */
+	j = q->first;
+	if(j != NULL)
+	{
+		q->first = j->next;
+		if(q->first == NULL)
+			q->last = NULL;
+		q->count--;
+		pthread_cond_signal(&q->cond_put);
+		ret = 0;
+	}
+	else if(q->closed)
+		ret = -1;
+	*job = j;
+
+	/* Unlock queue access */
+	pthread_mutex_unlock(&q->mutex);
+
+	return ret;
+}
+
+static void files_list_queue_close(struct files_list_queue *q)
+{
+	/* Lock queue access */
+	pthread_mutex_lock(&q->mutex);
+
+	/* Close queue and wake up all threads */
+	q->closed = 1;
+	pthread_cond_broadcast(&q->cond_get);
+	pthread_cond_broadcast(&q->cond_put);
+
+	/* Unlock queue access */
+	pthread_mutex_unlock(&q->mutex);
+}
+
+static void files_list_queue_destroy(struct files_list_queue *q)
+{
+	pthread_cond_destroy(&q->cond_put);
+	pthread_cond_destroy(&q->cond_get);
+	pthread_mutex_destroy(&q->mutex);
+}
+
+static void files_list_free_job(struct files_list_job *j)
+{
+	if(j->meta != NULL)
+		meta_free(j->meta);
+	if(j->cover != NULL)
+		free(j->cover);
+	free(j->path);
+	free(j->name);
+	free(j);
+}
+
+static void files_list_scan_write(struct files_list_scan *s,
+				  struct files_list_job *j)
+{
+	/* Add file to database */
+	files_list_write_file(s->db, j->meta, j->cover, j->name, j->mtime,
+			      j->path_id, j->id);
+
+	/* Update progress */
+	if(s->update_status)
+		__atomic_add_fetch(&scan_done, 1, __ATOMIC_RELAXED);
+
+	/* Free job */
+	files_list_free_job(j);
+}
+
+static void *files_list_scan_worker(void *user_data)
+{
+	struct files_list_scan *s = user_data;
+	struct files_list_job *j;
+
+	/* Set thread scheduling and name */
+	thread_setup(THREAD_DEFAULT, "scan-parse");
+
+	/* Parse files until walker is done */
+	while(files_list_queue_pop(&s->jobs, NULL, &j) == 0)
+	{
+		j->meta = files_list_parse_file(s->cover_path, j->path,
+						j->name, &j->cover);
+		files_list_queue_push(&s->results, j);
+	}
+
+	/* Last worker closes writer queue */
+	if(__atomic_sub_fetch(&s->running, 1, __ATOMIC_ACQ_REL) == 0)
+		files_list_queue_close(&s->results);
+
+	return NULL;
+}
+
+static void *files_list_scan_writer(void *user_data)
+{
+	struct files_list_scan *s = user_data;
+	struct files_list_job *j;
+	struct timespec deadline;
+	unsigned int count = 0;
+	int ret;
+
+	/* Set thread scheduling and name */
+	thread_setup(THREAD_DEFAULT, "scan-write");
+
+	do {
+		/* Get next parsed file (wait until commit time) */
+		ret = files_list_queue_pop(&s->results,
+					   count > 0 ? &deadline : NULL, &j);
+
+		/* Add file in current transaction */
+		if(j != NULL)
+		{
+			/* Begin a new transaction */
+			if(count == 0)
+			{
+				pthread_mutex_lock(&scan_write_mutex);
+				db_exec(s->db, "BEGIN", NULL, NULL);
+				clock_gettime(CLOCK_REALTIME, &deadline);
+				deadline.tv_sec += FILES_LIST_COMMIT_DELAY;
+			}
+
+			/* Add file to database */
+			files_list_scan_write(s, j);
+			count++;
+		}
+
+		/* Commit when transaction is full, too old or scan is done */
+		if(count > 0 && (count >= FILES_LIST_TRANSACTION || ret != 0))
+		{
+			db_exec(s->db, "COMMIT", NULL, NULL);
+			pthread_mutex_unlock(&scan_write_mutex);
+			count = 0;
+		}
+	} while(ret >= 0);
+
+	return NULL;
+}
+
+static void files_list_scan_start(struct files_list_scan *s)
+{
+	unsigned int i;
+
+	/* Prepare queues */
+	files_list_queue_init(&s->jobs);
+	files_list_queue_init(&s->results);
+	s->worker_count = 0;
+	s->threaded = 0;
+
+	/* Start writer thread */
+	if(pthread_create(&s->writer, NULL, files_list_scan_writer, s) != 0)
+		return;
+	s->threaded = 1;
+
+	/* Start parsing workers */
+	s->running = FILES_LIST_WORKERS;
+	for(i = 0; i < FILES_LIST_WORKERS; i++)
+	{
+		if(pthread_create(&s->workers[s->worker_count], NULL,
+				  files_list_scan_worker, s) == 0)
+			s->worker_count++;
+		else
+			__atomic_sub_fetch(&s->running, 1, __ATOMIC_ACQ_REL);
+	}
+
+	/* No worker: jobs are parsed by walker and sent to writer */
+	if(s->worker_count == 0)
+		files_list_queue_close(&s->jobs);
+}
+
+static void files_list_scan_stop(struct files_list_scan *s)
+{
+	unsigned int i;
+
+	if(s->threaded)
+	{
+		/* Wait end of parsing */
+		files_list_queue_close(&s->jobs);
+		for(i = 0; i < s->worker_count; i++)
+			pthread_join(s->workers[i], NULL);
+
+		/* Wait end of writing */
+		if(s->worker_count == 0)
+			files_list_queue_close(&s->results);
+		pthread_join(s->writer, NULL);
+	}
+
+	/* Free queues */
+	files_list_queue_destroy(&s->results);
+	files_list_queue_destroy(&s->jobs);
+}
+
+static void files_list_scan_add(struct files_list_scan *s, const char *name,
+				int64_t mtime, int64_t path_id, int64_t id)
+{
+	struct files_list_job *j;
+
+	/* Allocate job */
+	j = calloc(1, sizeof(struct files_list_job));
+	if(j == NULL)
+		return;
+	j->path = strdup(s->path);
+	j->name = strdup(name);
+	if(j->path == NULL || j->name == NULL)
+	{
+		files_list_free_job(j);
+		return;
+	}
+	j->mtime = mtime;
+	j->path_id = path_id;
+	j->id = id;
+
+	/* Update progress */
+	if(s->update_status)
+		__atomic_add_fetch(&scan_found, 1, __ATOMIC_RELAXED);
+
+	/* Send file to workers */
+	if(s->worker_count > 0)
+	{
+		files_list_queue_push(&s->jobs, j);
+		return;
+	}
+
+	/* Parse file here and send it to writer (or write it directly) */
+	j->meta = files_list_parse_file(s->cover_path, j->path, j->name,
+					&j->cover);
+	if(s->threaded)
+		files_list_queue_push(&s->results, j);
+	else
+		files_list_scan_write(s, j);
+}
+
+static void files_list_scan_save_dirs(struct files_list_scan *s)
+{
+	struct db_query *query;
+	size_t i;
+
+	if(s->dir_count == 0)
+		return;
+
+	/* Update all folders in one transaction */
+	pthread_mutex_lock(&scan_write_mutex);
+	db_exec(s->db, "BEGIN", NULL, NULL);
+	for(i = 0; i < s->dir_count; i++)
+	{
+		/* Prepare request (statement is cached) */
+		query = db_prepare(s->db, "UPDATE path SET mtime=? "
+					  "WHERE path_id=?", -1);
+		if(query == NULL)
+			break;
+
+		/* Bind values and do request */
+		db_bind_int64(query, 1, s->dirs[i].mtime);
+		db_bind_int64(query, 2, s->dirs[i].path_id);
+		db_step(query);
+		db_finalize(query);
+	}
+	db_exec(s->db, "COMMIT", NULL, NULL);
+	pthread_mutex_unlock(&scan_write_mutex);
+}
+
+static int files_list_file_changed(struct db_handle *db, const char *file,
+				   int64_t path_id, int64_t mtime, int64_t *id)
+{
+	struct db_query *query;
+	int ret = 1;
+
+	/* File is not present or out of date in database */
+	*id = 0;
+	query = db_prepare(db, "SELECT id,mtime FROM song "
+			       "WHERE file=? AND path_id=?", -1);
+	if(query != NULL)
+	{
+		db_bind_text(query, 1, file);
+		db_bind_int64(query, 2, path_id);
+		if(db_step(query) == 0)
+		{
+			*id = db_column_int64(query, 0);
+			if(db_column_int64(query, 1) == mtime)
+				ret = 0;
+		}
+		db_finalize(query);
+	}
+
+	return ret;
+}
+
+static int files_list_scan_dir(struct files_list_scan *s, struct dir_iter *it,
+			       size_t p_len)
+{
+	struct dir_iter *sub;
+	struct dir_entry *e;
+	int64_t path_id;
+	int64_t mtime;
+	int64_t id;
+	struct files_list_dir *d;
+	struct stat st;
+	unsigned char type;
 	char *status;
+	size_t r_len;
+	int changed = 1;
 	int s_len;
-	DIR *dp;
+	char *p;
 
 	/* Get path id and time in database */
-	if(files_list_get_path(db, media_id, path+len, NULL, &path_id, &mtime)
-	   != 0)
+	if(files_list_get_path(s->db, s->media_id, s->path + s->len, NULL,
+			       &path_id, &mtime) != 0)
 		return -1;
 
-	/* Open directory */
-	dp = opendir(path);
-	if(dp == NULL)
-		return -1;
+	/* Folder entries are unchanged since last scan: only sub-folders are
+	 * scanned. A folder modified during the last second can still change
+	 * within the same mtime, so its time is not saved.
+	 */
+	if(dir_iter_stat(it, NULL, &st, 0) == 0)
+	{
+		if(!s->full && mtime > 0 && st.st_mtime == mtime)
+			changed = 0;
+		else if(st.st_mtime < s->start)
+		{
+			/* Grow folder list */
+			if(s->dir_count == s->dir_size)
+			{
+				d = realloc(s->dirs, (s->dir_size + 64) *
+						     sizeof(*d));
+				if(d != NULL)
+				{
+					s->dirs = d;
+					s->dir_size += 64;
+				}
+			}
+
+			/* Add folder time */
+			if(s->dir_count < s->dir_size)
+			{
+				d = &s->dirs[s->dir_count++];
+				d->path_id = path_id;
+				d->mtime = st.st_mtime;
+			}
+		}
+	}
+
+	/* Nothing to do in an unchanged folder when not recursive */
+	if(!changed && !s->recursive)
+		return 0;
 
 	/* Parse all entries */
-	while((dir = readdir(dp)) != NULL)
+	while((e = dir_iter_read(it)) != NULL)
 	{
-		/* Skip . and .. */
-		if(dir->d_name[0] == '.' && (dir->d_name[1] == '\0' ||
-		   (dir->d_name[1] == '.' && dir->d_name[2] == '\0')))
-			continue;
+		/* Grow path buffer */
+		r_len = p_len + 1 + e->name_len;
+		if(r_len + 1 > s->size)
+		{
+			p = realloc(s->path, r_len + 256);
+			if(p == NULL)
+				continue;
+			s->path = p;
+			s->size = r_len + 256;
+		}
 
-		/* Generate item path */
-		asprintf(&r_path, "%s/%s", path, dir->d_name);
-		if(r_path == NULL)
+		/* Skip files of unchanged folder */
+		if(!changed && e->type != DT_DIR)
 			continue;
 
-		/* Get entry stat */
-		if(fs_stat(r_path, &s) != 0)
-		{
-			free(r_path);
-			continue;
-		}
+		/* Generate item path */
+		s->path[p_len] = '/';
+		memcpy(s->path + p_len + 1, e->name, e->name_len + 1);
 
 		/* Update status */
-		if(update_status)
+		if(s->update_status)
 		{
 			/* Lock scan status access */
 			pthread_mutex_lock(&scan_mutex);
 
 			/* Update string status */
-			s_len = strlen(r_path) - len + 1;
+			s_len = r_len - s->len + 1;
 			if(s_len > scan_len)
 			{
 				status = realloc(scan_status, s_len);
@@ -1541,46 +2591,113 @@ static int files_list_recursive_scan(struct db_handle *db,
 					scan_status = status;
 				}
 			}
-			strncpy(scan_status, r_path + len, scan_len);
+			strncpy(scan_status, s->path + s->len, scan_len);
 
 			/* Unlock scan status access */
 			pthread_mutex_unlock(&scan_mutex);
 		}
 
+		/* Follow links to files (links to folders are skipped) */
+		type = e->type;
+		if(type == DT_LNK)
+		{
+			if(dir_iter_stat(it, e, &st, 1) != 0 ||
+			   !S_ISREG(st.st_mode))
+				goto next;
+			type = DT_REG;
+		}
+
 		/* Process entry */
-		if(s.st_mode & S_IFDIR && recursive)
+		if(type == DT_DIR && s->recursive)
 		{
-			/* Skip links */
-			if(lstat(r_path, &s) == 0 && s.st_mode & S_IFLNK)
+			/* Scan sub_folder */
+			sub = dir_iter_openat(it, e->name);
+			if(sub != NULL)
 			{
-				free(r_path);
-				continue;
+				files_list_scan_dir(s, sub, r_len);
+				dir_iter_close(sub);
 			}
-
-			/* Scan sub_folder */
-			files_list_recursive_scan(db, cover_path, media_id,
-						  r_path, len, recursive,
-						  update_status);
 		}
-		else if(s.st_mode & S_IFREG && files_ext_check(dir->d_name))
+		else if(type == DT_REG && files_ext_check(e->name))
 		{
-			/* Scan file */
-			files_list_add_meta(db, NULL, path, dir->d_name,
-					    path_id, s.st_mtime, 1, cover_path);
+			/* Get modification time (links are already stated) */
+			if(e->type != DT_LNK && dir_iter_stat(it, e, &st, 0) != 0)
+				goto next;
+
+			/* Send file to parsing if it is new or modified */
+			s->path[p_len] = '\0';
+			if(files_list_file_changed(s->db, e->name, path_id,
+						   st.st_mtime, &id))
+				files_list_scan_add(s, e->name, st.st_mtime,
+						    path_id, id);
 		}
+next:
+		/* Restore folder path */
+		s->path[p_len] = '\0';
+	}
+
+	return 0;
+}
 
-		/* Free item path */
-		free(r_path);
+static int files_list_recursive_scan(struct db_handle *db,
+				     const char *cover_path, int64_t media_id,
+				     const char *path, int len, int recursive,
+				     int full, int update_status)
+{
+	struct files_list_scan s;
+	struct dir_iter *it;
+	size_t p_len;
+	int ret;
+
+	/* Open directory */
+	it = dir_iter_open(path);
+	if(it == NULL)
+		return -1;
+
+	/* Prepare scan */
+	p_len = strlen(path);
+	s.db = db;
+	s.cover_path = cover_path;
+	s.media_id = media_id;
+	s.recursive = recursive;
+	s.full = full;
+	s.update_status = update_status;
+	s.len = len;
+	s.dirs = NULL;
+	s.dir_count = 0;
+	s.dir_size = 0;
+	s.start = time(NULL) - 1;
+	s.size = p_len + 1024;
+	s.path = malloc(s.size);
+	if(s.path == NULL)
+	{
+		dir_iter_close(it);
+		return -1;
 	}
+	memcpy(s.path, path, p_len + 1);
+
+	/* Start parsing workers and database writer */
+	files_list_scan_start(&s);
+
+	/* Scan folder tree */
+	ret = files_list_scan_dir(&s, it, p_len);
+
+	/* Wait end of parsing and writing */
+	files_list_scan_stop(&s);
+
+	/* Save folder times once all their files are in database */
+	files_list_scan_save_dirs(&s);
 
 	/* Close directory */
-	closedir(dp);
+	dir_iter_close(it);
+	free(s.dirs);
+	free(s.path);
 
-	return 0;
+	return ret;
 }
 
 int files_list_scan(struct db_handle *db, const char *cover_path,
-		    int64_t media_id, int recursive)
+		    int64_t media_id, int recursive, int full)
 {
 	char *path;
 	int ret;
@@ -1599,6 +2716,8 @@ int files_list_scan(struct db_handle *db, const char *cover_path,
 		return 1;
 	}
 	scanning = 1;
+	__atomic_store_n(&scan_found, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&scan_done, 0, __ATOMIC_RELAXED);
 
 	/* Unlock scan access */
 	pthread_mutex_unlock(&scan_mutex);
@@ -1610,7 +2729,7 @@ int files_list_scan(struct db_handle *db, const char *cover_path,
 
 	/* Scan directory with status */
 	ret = files_list_recursive_scan(db, cover_path, media_id, path,
-					strlen(path), recursive, 1);
+					strlen(path), recursive, full, 1);
 
 	/* Free path */
 	free(path);
@@ -1650,6 +2769,93 @@ char *files_list_get_scan(void)
 	return status;
 }
 
+int files_list_scan_path(struct db_handle *db, const char *cover_path,
+			 int64_t media_id, const char *path)
+{
+	char *m_path, *r_path;
+	int len;
+	int ret;
+
+	/* Get media path */
+	m_path = files_list_get_media(db, media_id);
+	if(m_path == NULL)
+		return -1;
+	len = strlen(m_path);
+
+	/* Generate complete path */
+	asprintf(&r_path, "%s/%s", m_path, path);
+	free(m_path);
+	if(r_path == NULL)
+		return -1;
+
+	/* Scan folder tree without status */
+	ret = files_list_recursive_scan(db, cover_path, media_id, r_path, len,
+					1, 0, 0);
+	free(r_path);
+
+	return ret;
+}
+
+int files_list_remove_file(struct db_handle *db, int64_t media_id,
+			   const char *path, const char *file)
+{
+	struct db_query *q;
+	int ret = -1;
+
+	/* Prepare request */
+	q = db_prepare(db, "DELETE FROM song WHERE file=? AND path_id IN "
+			   "(SELECT path_id FROM path "
+			   "WHERE path=? AND media_id=?)", -1);
+
+	/* Bind values and do request */
+	if(db_bind_text(q, 1, file) == 0 && db_bind_text(q, 2, path) == 0 &&
+	   db_bind_int64(q, 3, media_id) == 0 && db_step(q) == DB_DONE)
+		ret = 0;
+
+	/* Finalize request */
+	db_finalize(q);
+
+	return ret;
+}
+
+int files_list_remove_path(struct db_handle *db, int64_t media_id,
+			   const char *path)
+{
+	struct db_query *q;
+	int ret = 0;
+	int i;
+
+	/* Remove songs of folder tree and then its paths */
+	for(i = 0; i < 2 && ret == 0; i++)
+	{
+		/* Prepare request */
+		q = db_prepare(db, i == 0 ?
+			       "DELETE FROM song WHERE path_id IN "
+			       "(SELECT path_id FROM path WHERE media_id=?1 "
+			       "AND (path=?2 OR "
+			       "substr(path,1,length(?2)+1)=?2||'/'))" :
+			       "DELETE FROM path WHERE media_id=?1 "
+			       "AND (path=?2 OR "
+			       "substr(path,1,length(?2)+1)=?2||'/')", -1);
+
+		/* Bind values and do request */
+		if(db_bind_int64(q, 1, media_id) != 0 ||
+		   db_bind_text(q, 2, path) != 0 || db_step(q) != DB_DONE)
+			ret = -1;
+
+		/* Finalize request */
+		db_finalize(q);
+	}
+
+	return ret;
+}
+
+void files_list_get_scan_count(unsigned long *found, unsigned long *done)
+{
+	*found = __atomic_load_n(&scan_found, __ATOMIC_RELAXED);
+	*done = __atomic_load_n(&scan_done, __ATOMIC_RELAXED);
+}
+
 int files_list_is_scanning(void)
 {
 	int status;
@@ -55,13 +55,17 @@ void files_list_init(struct db_handle *db, const char *path);
 struct json *files_list_file(struct db_handle *db, const char *cover_path,
 			     int64_t media_id, const char *uri);
 
-/* List files */
+/* List files: a page can also be selected with a cursor returned in
+ * next_cursor by previous call (NULL when there is no more entry), which lists
+ * entries sorted by tag without skipping all previous rows.
+ */
 char *files_list_files(struct db_handle *db, const char *cover_path,
 		       int64_t media_id, const char *uri, unsigned long page,
 		       unsigned long count, enum files_list_sort sort,
 		       enum files_list_display display, int64_t artist_id,
 		       int64_t album_id, int64_t genre_id,
-		       const char *filter);
+		       const char *filter, const char *cursor,
+		       char **next_cursor);
 
 /* List/scan Media storage (local or network) */
 char *files_list_media(struct db_handle *db, const char *path,
@@ -71,12 +75,41 @@ int files_list_add_media(struct db_handle *db, const char *name,
 int files_list_delete_media(struct db_handle *db, int64_t media_id);
 char *files_list_get_media(struct db_handle *db, int64_t media_id);
 
-/* Scan files */
+/* Scan files: only folders modified since last scan are parsed, unless full
+ * is set (needed to catch modified tags of existing files)
+ */
 int files_list_scan(struct db_handle *db, const char *cover_path,
-		    int64_t media_id, int recursive);
+		    int64_t media_id, int recursive, int full);
 char *files_list_get_scan(void);
+/* Files found to parse and files already added during current scan */
+void files_list_get_scan_count(unsigned long *found, unsigned long *done);
 int files_list_is_scanning(void);
 
+/* Live updates of a media: scan a new folder tree or remove a file or a folder
+ * tree (path is relative to media)
+ */
+int files_list_scan_path(struct db_handle *db, const char *cover_path,
+			 int64_t media_id, const char *path);
+int files_list_remove_file(struct db_handle *db, int64_t media_id,
+			   const char *path, const char *file);
+int files_list_remove_path(struct db_handle *db, int64_t media_id,
+			   const char *path);
+
+/* Get a thumbnail of a cover (from cover folder) not smaller than size when
+ * possible: it is created on first call and its path relative to cover folder
+ * is returned. NULL is returned when the original cover should be used.
+ */
+char *files_list_get_thumbnail(const char *cover_path, const char *cover,
+			       unsigned long size);
+
+/* Seek table of a file, valid while its modification time is unchanged */
+int files_list_get_seek_table(struct db_handle *db, const char *file,
+			      int64_t mtime, uint32_t **table,
+			      unsigned long *count);
+int files_list_set_seek_table(struct db_handle *db, const char *file,
+			      int64_t mtime, const uint32_t *table,
+			      unsigned long count);
+
 /* List files with callback */
 typedef int (*files_list_fn)(void *, int64_t, const char *, int, int);
 int files_list_list(struct db_handle *db, const char *uri, files_list_fn fn,
@@ -0,0 +1,274 @@
+/*
+ * files_meta.c - Compact song meta for Files module
+ *
+ * Copyright (c) 2014   A. Dilly
+ *
+ * AirCat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * AirCat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with AirCat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "files_meta.h"
+#include "utils.h"
+
+#define FILES_META_POOL_SIZE 256
+
+struct files_meta_str {
+	struct files_meta_str *next;
+	unsigned int refs;
+	uint32_t hash;
+	char str[];
+};
+
+struct files_meta_pool {
+	/* Interned strings hash table */
+	struct files_meta_str **table;
+	unsigned int size;
+	unsigned int count;
+};
+
+struct files_meta_pool *files_meta_pool_new(void)
+{
+	struct files_meta_pool *p;
+
+	/* Allocate pool */
+	p = calloc(1, sizeof(struct files_meta_pool));
+	if(p == NULL)
+		return NULL;
+
+	/* Allocate hash table */
+	p->table = calloc(FILES_META_POOL_SIZE, sizeof(struct files_meta_str *));
+	if(p->table == NULL)
+	{
+		free(p);
+		return NULL;
+	}
+	p->size = FILES_META_POOL_SIZE;
+
+	return p;
+}
+
+void files_meta_pool_free(struct files_meta_pool *p)
+{
+	struct files_meta_str *s;
+	unsigned int i;
+
+	if(p == NULL)
+		return;
+
+	/* Free remaining strings */
+	for(i = 0; i < p->size; i++)
+	{
+		while((s = p->table[i]) != NULL)
+		{
+			p->table[i] = s->next;
+			free(s);
+		}
+	}
+
+	free(p->table);
+	free(p);
+}
+
+static uint32_t files_meta_hash(const char *str)
+{
+	/* FNV-1a (low bits are used for buckets) */
+	return utils_hash_fnv1a(UTILS_FNV1A_INIT, str, strlen(str));
+}
+
+static void files_meta_pool_grow(struct files_meta_pool *p)
+{
+	struct files_meta_str **table, *s;
+	unsigned int i, size;
+
+	/* Allocate a larger table */
+	size = p->size * 2;
+	table = calloc(size, sizeof(struct files_meta_str *));
+	if(table == NULL)
+		return;
+
+	/* Move all strings */
+	for(i = 0; i < p->size; i++)
+	{
+		while((s = p->table[i]) != NULL)
+		{
+			p->table[i] = s->next;
+			s->next = table[s->hash & (size - 1)];
+			table[s->hash & (size - 1)] = s;
+		}
+	}
+	free(p->table);
+	p->table = table;
+	p->size = size;
+}
+
+static const char *files_meta_intern(struct files_meta_pool *p,
+				     const char *str)
+{
+	struct files_meta_str *s;
+	uint32_t hash;
+	size_t len;
+
+	if(str == NULL)
+		return NULL;
+
+	/* Find string */
+	hash = files_meta_hash(str);
+	for(s = p->table[hash & (p->size - 1)]; s != NULL; s = s->next)
+	{
+		if(s->hash == hash && strcmp(s->str, str) == 0)
+		{
+			s->refs++;
+			return s->str;
+		}
+	}
+
+	/* Keep chains short */
+	if(p->count >= p->size)
+		files_meta_pool_grow(p);
+
+	/* Add string */
+	len = strlen(str);
+	s = malloc(sizeof(struct files_meta_str) + len + 1);
+	if(s == NULL)
+		return NULL;
+	memcpy(s->str, str, len + 1);
+	s->hash = hash;
+	s->refs = 1;
+	s->next = p->table[hash & (p->size - 1)];
+	p->table[hash & (p->size - 1)] = s;
+	p->count++;
+
+	return s->str;
+}
+
+static void files_meta_release(struct files_meta_pool *p, const char *str)
+{
+	struct files_meta_str *s, **ps;
+
+	if(str == NULL)
+		return;
+
+	/* Get string from its value */
+	s = (struct files_meta_str *) (str - offsetof(struct files_meta_str,
+						      str));
+	if(--s->refs > 0)
+		return;
+
+	/* Remove string from pool */
+	for(ps = &p->table[s->hash & (p->size - 1)]; *ps != NULL;
+	    ps = &(*ps)->next)
+	{
+		if(*ps == s)
+		{
+			*ps = s->next;
+			p->count--;
+			break;
+		}
+	}
+	free(s);
+}
+
+struct files_meta *files_meta_new(struct files_meta_pool *p,
+				  const char *filename,
+				  const struct json *tag)
+{
+	const char *file = NULL, *title = NULL;
+	size_t len, f_len = 0, t_len = 0;
+	struct files_meta *m;
+
+	if(filename == NULL)
+		return NULL;
+
+	/* Get strings stored in meta */
+	file = json_get_string(tag, "file");
+	title = json_get_string(tag, "title");
+	len = strlen(filename) + 1;
+	if(file != NULL)
+		f_len = strlen(file) + 1;
+	if(title != NULL)
+		t_len = strlen(title) + 1;
+
+	/* Allocate meta with its strings */
+	m = malloc(sizeof(struct files_meta) + len + f_len + t_len);
+	if(m == NULL)
+		return NULL;
+
+	/* Copy strings */
+	memcpy(m->data, filename, len);
+	m->file = FILES_META_NONE;
+	m->title = FILES_META_NONE;
+	if(file != NULL)
+	{
+		m->file = len;
+		memcpy(&m->data[m->file], file, f_len);
+	}
+	if(title != NULL)
+	{
+		m->title = len + f_len;
+		memcpy(&m->data[m->title], title, t_len);
+	}
+
+	/* Intern shared strings */
+	m->has_tags = file != NULL;
+	m->artist = files_meta_intern(p, json_get_string(tag, "artist"));
+	m->album = files_meta_intern(p, json_get_string(tag, "album"));
+	m->genre = files_meta_intern(p, json_get_string(tag, "genre"));
+	m->cover = files_meta_intern(p, json_get_string(tag, "cover"));
+
+	/* Copy IDs */
+	m->artist_id = json_get_int64(tag, "artist_id");
+	m->album_id = json_get_int64(tag, "album_id");
+	m->genre_id = json_get_int64(tag, "genre_id");
+
+	return m;
+}
+
+void files_meta_free(struct files_meta_pool *p, struct files_meta *m)
+{
+	if(m == NULL)
+		return;
+
+	/* Release shared strings */
+	files_meta_release(p, m->artist);
+	files_meta_release(p, m->album);
+	files_meta_release(p, m->genre);
+	files_meta_release(p, m->cover);
+
+	free(m);
+}
+
+struct json *files_meta_to_json(const struct files_meta *m)
+{
+	struct json *tag;
+
+	/* Create JSON object */
+	tag = json_new();
+	if(tag == NULL || !m->has_tags)
+		return tag;
+
+	/* Fill with same values as files_list_file() */
+	json_set_string(tag, "file", files_meta_string(m, m->file));
+	json_set_string(tag, "title", files_meta_string(m, m->title));
+	json_set_string(tag, "artist", m->artist);
+	json_set_string(tag, "album", m->album);
+	json_set_string(tag, "cover", m->cover);
+	json_set_string(tag, "genre", m->genre);
+	json_set_int64(tag, "artist_id", m->artist_id);
+	json_set_int64(tag, "album_id", m->album_id);
+	json_set_int64(tag, "genre_id", m->genre_id);
+
+	return tag;
+}
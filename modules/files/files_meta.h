@@ -0,0 +1,83 @@
+/*
+ * files_meta.h - Compact song meta for Files module
+ *
+ * Copyright (c) 2014   A. Dilly
+ *
+ * AirCat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * AirCat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with AirCat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _FILES_META_H
+#define _FILES_META_H
+
+#include <stdint.h>
+
+#include "json.h"
+
+/* Pool of interned strings: artist, album, genre and cover names are shared
+ * by all songs which use them. A pool is not thread safe: it must be used
+ * under the playlist lock.
+ */
+struct files_meta_pool;
+
+struct files_meta_pool *files_meta_pool_new(void);
+/* All meta of pool must be freed before */
+void files_meta_pool_free(struct files_meta_pool *p);
+
+#define FILES_META_NONE ((uint32_t) -1)
+
+/* Meta of a song in a single allocation: complete path, file name and title
+ * follow the structure and are referenced by their offset (FILES_META_NONE if
+ * not set). Cover is only referenced by its name in cover folder.
+ */
+struct files_meta {
+	/* Interned strings (NULL if not set) */
+	const char *artist;
+	const char *album;
+	const char *genre;
+	const char *cover;
+	/* IDs in database */
+	int64_t artist_id;
+	int64_t album_id;
+	int64_t genre_id;
+	/* Offsets of strings in data */
+	uint32_t file;
+	uint32_t title;
+	/* Song has been found in database */
+	int has_tags;
+	/* Strings */
+	char data[];
+};
+
+/* Create a meta from a song path and its JSON tag returned by
+ * files_list_file() (tag can be NULL).
+ */
+struct files_meta *files_meta_new(struct files_meta_pool *p,
+				  const char *filename,
+				  const struct json *tag);
+void files_meta_free(struct files_meta_pool *p, struct files_meta *m);
+
+/* Get JSON tag (as returned by files_list_file()) */
+struct json *files_meta_to_json(const struct files_meta *m);
+
+static inline const char *files_meta_filename(const struct files_meta *m)
+{
+	return m->data;
+}
+
+static inline const char *files_meta_string(const struct files_meta *m,
+					    uint32_t off)
+{
+	return off != FILES_META_NONE ? &m->data[off] : NULL;
+}
+
+#endif
@@ -0,0 +1,415 @@
+/*
+ * files_watch.c - Live updates of local media for Files module
+ *
+ * Copyright (c) 2014   A. Dilly
+ *
+ * AirCat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * AirCat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with AirCat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include "files_watch.h"
+#include "files_list.h"
+#include "utils.h"
+#include "thread.h"
+
+#define FILES_WATCH_MASK (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | \
+			  IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR | \
+			  IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+#define FILES_WATCH_BUFFER_SIZE 16384
+
+struct files_watch_dir {
+	int wd;
+	/* Path relative to media (as in path table) */
+	char *path;
+};
+
+struct files_watch {
+	/* Database and media */
+	struct db_handle *db;
+	char *cover_path;
+	char *media_path;
+	int64_t media_id;
+	/* Watched folders sorted by watch descriptor */
+	struct files_watch_dir *dirs;
+	size_t count;
+	size_t size;
+	/* inotify and stop pipe */
+	int fd;
+	int pipe[2];
+	pthread_t thread;
+};
+
+static void *files_watch_thread(void *user_data);
+
+static size_t files_watch_find(struct files_watch *w, int wd)
+{
+	size_t first = 0, last = w->count;
+	size_t i;
+
+	/* Binary search of watch descriptor (or its insert position) */
+	while(first < last)
+	{
+		i = (first + last) / 2;
+		if(w->dirs[i].wd < wd)
+			first = i + 1;
+		else
+			last = i;
+	}
+
+	return first;
+}
+
+static struct files_watch_dir *files_watch_get(struct files_watch *w, int wd)
+{
+	size_t i;
+
+	i = files_watch_find(w, wd);
+	if(i < w->count && w->dirs[i].wd == wd)
+		return &w->dirs[i];
+	return NULL;
+}
+
+static void files_watch_remove(struct files_watch *w, size_t i)
+{
+	free(w->dirs[i].path);
+	memmove(&w->dirs[i], &w->dirs[i+1],
+		(w->count - i - 1) * sizeof(struct files_watch_dir));
+	w->count--;
+}
+
+static void files_watch_add_tree(struct files_watch *w, struct dir_iter *it,
+				 const char *path)
+{
+	struct files_watch_dir *d;
+	struct dir_iter *sub;
+	struct dir_entry *e;
+	char *f_path, *s_path;
+	size_t i;
+	int wd;
+
+	/* Add watch on folder */
+	if(asprintf(&f_path, "%s/%s", w->media_path, path) < 0)
+		return;
+	wd = inotify_add_watch(w->fd, f_path, FILES_WATCH_MASK);
+	free(f_path);
+	if(wd < 0)
+		return;
+
+	/* Folder is already watched (moved): update its path */
+	i = files_watch_find(w, wd);
+	if(i < w->count && w->dirs[i].wd == wd)
+	{
+		s_path = strdup(path);
+		if(s_path != NULL)
+		{
+			free(w->dirs[i].path);
+			w->dirs[i].path = s_path;
+		}
+	}
+	else
+	{
+		/* Grow folder list */
+		if(w->count == w->size)
+		{
+			d = realloc(w->dirs, (w->size + 64) *
+					     sizeof(struct files_watch_dir));
+			if(d == NULL)
+				return;
+			w->dirs = d;
+			w->size += 64;
+		}
+
+		/* Insert folder */
+		s_path = strdup(path);
+		if(s_path == NULL)
+			return;
+		memmove(&w->dirs[i+1], &w->dirs[i],
+			(w->count - i) * sizeof(struct files_watch_dir));
+		w->dirs[i].wd = wd;
+		w->dirs[i].path = s_path;
+		w->count++;
+	}
+
+	/* Add all sub-folders */
+	while((e = dir_iter_read(it)) != NULL)
+	{
+		if(e->type != DT_DIR)
+			continue;
+
+		/* Generate sub-folder path */
+		if(*path == '\0')
+			s_path = strdup(e->name);
+		else if(asprintf(&s_path, "%s/%s", path, e->name) < 0)
+			s_path = NULL;
+		if(s_path == NULL)
+			continue;
+
+		/* Watch sub-folder */
+		sub = dir_iter_openat(it, e->name);
+		if(sub != NULL)
+		{
+			files_watch_add_tree(w, sub, s_path);
+			dir_iter_close(sub);
+		}
+		free(s_path);
+	}
+}
+
+static void files_watch_add(struct files_watch *w, const char *path)
+{
+	struct dir_iter *it;
+	char *f_path;
+
+	/* Open folder */
+	if(asprintf(&f_path, "%s/%s", w->media_path, path) < 0)
+		return;
+	it = dir_iter_open(f_path);
+	free(f_path);
+	if(it == NULL)
+		return;
+
+	/* Watch folder tree */
+	files_watch_add_tree(w, it, path);
+	dir_iter_close(it);
+}
+
+static void files_watch_remove_tree(struct files_watch *w, const char *path)
+{
+	size_t len = strlen(path);
+	size_t i = 0;
+
+	/* Remove watches of folder and all its sub-folders */
+	while(i < w->count)
+	{
+		if(strncmp(w->dirs[i].path, path, len) == 0 &&
+		   (w->dirs[i].path[len] == '\0' ||
+		    w->dirs[i].path[len] == '/'))
+		{
+			inotify_rm_watch(w->fd, w->dirs[i].wd);
+			files_watch_remove(w, i);
+		}
+		else
+			i++;
+	}
+}
+
+struct files_watch *files_watch_new(struct db_handle *db,
+				    const char *cover_path, int64_t media_id)
+{
+	struct files_watch *w;
+
+	/* Allocate structure */
+	w = calloc(1, sizeof(struct files_watch));
+	if(w == NULL)
+		return NULL;
+	w->db = db;
+	w->media_id = media_id;
+	w->fd = -1;
+	w->pipe[0] = -1;
+	w->pipe[1] = -1;
+
+	/* Get media path */
+	w->media_path = files_list_get_media(db, media_id);
+	w->cover_path = strdup(cover_path);
+	if(w->media_path == NULL || w->cover_path == NULL)
+		goto error;
+
+	/* Init inotify and stop pipe */
+	w->fd = inotify_init1(IN_CLOEXEC);
+	if(w->fd < 0 || pipe(w->pipe) != 0)
+		goto error;
+
+	/* Watch all media folders */
+	files_watch_add(w, "");
+	if(w->count == 0)
+		goto error;
+
+	/* Start thread */
+	if(pthread_create(&w->thread, NULL, files_watch_thread, w) != 0)
+		goto error;
+
+	return w;
+
+error:
+	if(w->pipe[0] >= 0)
+	{
+		close(w->pipe[0]);
+		close(w->pipe[1]);
+	}
+	w->pipe[0] = -1;
+	files_watch_free(w);
+	return NULL;
+}
+
+static void files_watch_event(struct files_watch *w,
+			      const struct inotify_event *ev)
+{
+	struct files_watch_dir *d;
+	struct json *tag;
+	char *d_path;
+	char *path;
+
+	/* Get folder */
+	d = files_watch_get(w, ev->wd);
+	if(d == NULL)
+		return;
+
+	/* Watch removed by kernel */
+	if(ev->mask & IN_IGNORED)
+	{
+		files_watch_remove(w, d - w->dirs);
+		return;
+	}
+	if(ev->len == 0 || ev->name[0] == '\0')
+		return;
+
+	/* Generate entry path */
+	d_path = d->path;
+	if(*d_path == '\0')
+		path = strdup(ev->name);
+	else if(asprintf(&path, "%s/%s", d_path, ev->name) < 0)
+		path = NULL;
+	if(path == NULL)
+		return;
+
+	if(ev->mask & IN_ISDIR)
+	{
+		/* Folder moved away or removed: forget its tree */
+		if(ev->mask & (IN_DELETE | IN_MOVED_FROM))
+		{
+			files_watch_remove_tree(w, path);
+			files_list_remove_path(w->db, w->media_id, path);
+		}
+
+		/* New folder: watch it before scan to not miss a file */
+		if(ev->mask & (IN_CREATE | IN_MOVED_TO))
+		{
+			files_watch_add(w, path);
+			files_list_scan_path(w->db, w->cover_path, w->media_id,
+					     path);
+		}
+	}
+	else if(files_ext_check(ev->name))
+	{
+		/* File removed or moved away */
+		if(ev->mask & (IN_DELETE | IN_MOVED_FROM))
+			files_list_remove_file(w->db, w->media_id, d_path,
+					       ev->name);
+
+		/* File written or moved in: add or update it */
+		if(ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+		{
+			tag = files_list_file(w->db, w->cover_path,
+					      w->media_id, path);
+			if(tag != NULL)
+				json_free(tag);
+		}
+	}
+
+	free(path);
+}
+
+static void *files_watch_thread(void *user_data)
+{
+	struct files_watch *w = user_data;
+	char buffer[FILES_WATCH_BUFFER_SIZE]
+			__attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	struct pollfd fds[2];
+	int overflow;
+	ssize_t len;
+	char *p;
+
+	/* Set thread scheduling and name */
+	thread_setup(THREAD_DEFAULT, "files-watch");
+
+	/* Prepare poll */
+	fds[0].fd = w->fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = w->pipe[0];
+	fds[1].events = POLLIN;
+
+	while(1)
+	{
+		/* Wait events or stop */
+		if(poll(fds, 2, -1) < 0)
+			continue;
+		if(fds[1].revents != 0)
+			break;
+
+		/* Read events */
+		len = read(w->fd, buffer, sizeof(buffer));
+		if(len <= 0)
+			continue;
+
+		/* Process events */
+		overflow = 0;
+		for(p = buffer; p < buffer + len;
+		    p += sizeof(struct inotify_event) + ev->len)
+		{
+			ev = (const struct inotify_event *) p;
+			if(ev->mask & IN_Q_OVERFLOW)
+				overflow = 1;
+			else
+				files_watch_event(w, ev);
+		}
+
+		/* Some events are lost: update modified folders */
+		if(overflow)
+			files_list_scan(w->db, w->cover_path, w->media_id, 1,
+					0);
+	}
+
+	return NULL;
+}
+
+void files_watch_free(struct files_watch *w)
+{
+	if(w == NULL)
+		return;
+
+	/* Stop thread */
+	if(w->pipe[0] >= 0)
+	{
+		if(write(w->pipe[1], "", 1) == 1)
+			pthread_join(w->thread, NULL);
+		close(w->pipe[0]);
+		close(w->pipe[1]);
+	}
+
+	/* Close inotify (all watches are removed) */
+	if(w->fd >= 0)
+		close(w->fd);
+
+	/* Free folder list */
+	while(w->count > 0)
+		files_watch_remove(w, w->count - 1);
+	free(w->dirs);
+
+	free(w->media_path);
+	free(w->cover_path);
+	free(w);
+}
@@ -0,0 +1,34 @@
+/*
+ * files_watch.h - Live updates of local media for Files module
+ *
+ * Copyright (c) 2014   A. Dilly
+ *
+ * AirCat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * AirCat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with AirCat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _FILES_WATCH_H
+#define _FILES_WATCH_H
+
+#include "db.h"
+
+/* A watcher follows all folders of a local media with inotify and keeps
+ * database up to date when files or folders are added, modified, removed or
+ * renamed: only network medias still need a scan to be updated.
+ */
+struct files_watch;
+
+struct files_watch *files_watch_new(struct db_handle *db,
+				    const char *cover_path, int64_t media_id);
+void files_watch_free(struct files_watch *w);
+
+#endif
@@ -0,0 +1,536 @@
+/*
+ * multiroom.c - A Multi-room module
+ *
+ * Play the RTP stream sent by the "rtp" output of another AirCat instance: the
+ * source is decoded and resampled once by the sender, and each room only
+ * receives the final mix in L16.
+ *
+ * Copyright (c) 2014   A. Dilly
+ *
+ * AirCat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * AirCat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with AirCat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "module.h"
+#include "rtp.h"
+
+/* Default multicast group and port (same as the "rtp" output) */
+#define MULTIROOM_GROUP "239.255.77.77"
+#define MULTIROOM_PORT 5004
+
+/* Default stream format (format of the sender output) */
+#define MULTIROOM_SAMPLERATE 44100
+#define MULTIROOM_CHANNELS 2
+
+/* Maximum PCM payload in a RTP packet (same as the "rtp" output) */
+#define MULTIROOM_PACKET_SIZE 1408
+
+/* RTP payload types for L16 (RFC 3551): static types are only defined for
+ * 44.1kHz, a dynamic type is used for other formats.
+ */
+#define MULTIROOM_PAYLOAD_STEREO 10
+#define MULTIROOM_PAYLOAD_MONO 11
+#define MULTIROOM_PAYLOAD_DYNAMIC 96
+
+/* Jitter buffer: time allocated in memory, default delay, minimum delay with
+ * adaptive latency and maximum delay (in ms)
+ */
+#define MULTIROOM_POOL 1000
+#define MULTIROOM_DELAY 200
+#define MULTIROOM_MIN_DELAY 50
+#define MULTIROOM_MAX_DELAY 5000
+
+struct multiroom_handle {
+	/* Output module */
+	struct output_handle *output;
+	struct output_stream_handle *stream;
+	/* RTP receiver */
+	struct rtp_handle *rtp;
+	unsigned char ip[4];
+	unsigned int port;
+	/* Format of stream */
+	unsigned long samplerate;
+	unsigned char channels;
+	size_t packet_samples;
+	/* Packet being read (in L16) and silence to play */
+	unsigned char packet[MULTIROOM_PACKET_SIZE];
+	size_t packet_len;
+	size_t packet_pos;
+	size_t silence_remaining;
+	/* Mutex for play / stop */
+	pthread_mutex_t mutex;
+	/* Config part */
+	char *group;
+	unsigned long delay;
+	int adaptive;
+	unsigned long cache;
+	int autostart;
+};
+
+static int multiroom_play(struct multiroom_handle *h);
+static int multiroom_stop(struct multiroom_handle *h);
+static int multiroom_set_config(struct multiroom_handle *h,
+				const struct json *c);
+
+static int multiroom_open(struct multiroom_handle **handle,
+			  struct module_attr *attr)
+{
+	struct multiroom_handle *h;
+
+	/* Allocate structure */
+	*handle = malloc(sizeof(struct multiroom_handle));
+	if(*handle == NULL)
+		return -1;
+	h = *handle;
+
+	/* Init structure */
+	h->output = attr->output;
+	h->stream = NULL;
+	h->rtp = NULL;
+	h->samplerate = MULTIROOM_SAMPLERATE;
+	h->channels = MULTIROOM_CHANNELS;
+	h->group = NULL;
+	h->delay = MULTIROOM_DELAY;
+	h->adaptive = 1;
+	h->cache = 0;
+	h->autostart = 0;
+
+	/* Init mutex */
+	pthread_mutex_init(&h->mutex, NULL);
+
+	/* Load configuration */
+	multiroom_set_config(h, attr->config);
+
+	/* Play stream at startup */
+	if(h->autostart)
+		multiroom_play(h);
+
+	return 0;
+}
+
+static const char *multiroom_get_group(struct multiroom_handle *h)
+{
+	return h->group != NULL ? h->group : MULTIROOM_GROUP;
+}
+
+static int multiroom_parse_group(struct multiroom_handle *h)
+{
+	char group[INET_ADDRSTRLEN];
+	struct in_addr ip;
+	const char *device;
+	const char *p;
+	size_t len;
+
+	/* Group is "group[:port]" */
+	device = multiroom_get_group(h);
+	p = strchr(device, ':');
+	len = p != NULL ? (size_t) (p - device) : strlen(device);
+	if(len >= sizeof(group))
+		return -1;
+	memcpy(group, device, len);
+	group[len] = '\0';
+
+	/* Get port: RTCP is on next port */
+	h->port = p != NULL ? strtoul(p + 1, NULL, 10) : MULTIROOM_PORT;
+	if(h->port == 0 || h->port > 65534)
+		return -1;
+
+	/* Get IP address */
+	if(inet_aton(group, &ip) == 0)
+		return -1;
+	memcpy(h->ip, &ip, 4);
+
+	return 0;
+}
+
+static int multiroom_read(void *user_data, unsigned char *buffer, size_t size,
+			  struct a_format *fmt)
+{
+	struct multiroom_handle *h = user_data;
+	int16_t *out = (int16_t *) buffer;
+	const unsigned char *in;
+	size_t total = 0, count, i;
+	ssize_t len;
+
+	while(total < size)
+	{
+		/* Play silence of a lost packet (or while buffering) */
+		if(h->silence_remaining > 0)
+		{
+			count = size - total;
+			if(count > h->silence_remaining)
+				count = h->silence_remaining;
+			memset(&out[total], 0, count * 2);
+			h->silence_remaining -= count;
+			total += count;
+			continue;
+		}
+
+		/* Convert remaining samples of packet from big endian */
+		if(h->packet_pos < h->packet_len)
+		{
+			count = (h->packet_len - h->packet_pos) / 2;
+			if(count > size - total)
+				count = size - total;
+			in = &h->packet[h->packet_pos];
+			for(i = 0; i < count; i++, in += 2)
+				out[total + i] = (int16_t) ((in[0] << 8) |
+							    in[1]);
+			h->packet_pos += count * 2;
+			total += count;
+			continue;
+		}
+
+		/* Get next packet from jitter buffer */
+		do {
+			len = rtp_read(h->rtp, h->packet, sizeof(h->packet));
+		} while(len == RTP_DISCARDED_PACKET);
+		h->packet_pos = 0;
+		h->packet_len = 0;
+		if(len > 0)
+		{
+			/* Keep whole frames only */
+			h->packet_len = len - (len % (2 * h->channels));
+			continue;
+		}
+
+		/* When packet is lost or RTP is buffering, add a silence of
+		 * packet duration
+		 */
+		h->silence_remaining = h->packet_samples;
+	}
+
+	/* Fill format */
+	if(fmt != NULL)
+		fmt->sample = SAMPLE_S16;
+
+	return total;
+}
+
+static int multiroom_play(struct multiroom_handle *h)
+{
+	struct rtp_attr attr;
+	unsigned long packets;
+
+	/* Lock play / stop */
+	pthread_mutex_lock(&h->mutex);
+
+	/* Already playing */
+	if(h->stream != NULL)
+	{
+		pthread_mutex_unlock(&h->mutex);
+		return 0;
+	}
+
+	/* Get multicast group */
+	if(multiroom_parse_group(h) != 0)
+	{
+		fprintf(stderr, "[multiroom] bad group: %s\n",
+			multiroom_get_group(h));
+		goto error;
+	}
+
+	/* Packet size of sender: packets are always full */
+	h->packet_samples = MULTIROOM_PACKET_SIZE / 2;
+	packets = h->samplerate * h->channels / h->packet_samples;
+	h->packet_len = 0;
+	h->packet_pos = 0;
+	h->silence_remaining = 0;
+
+	/* Open RTP receiver: SSRC and first sequence number are taken from
+	 * first packet received.
+	 */
+	memset(&attr, 0, sizeof(struct rtp_attr));
+	attr.ip = h->ip;
+	attr.port = h->port;
+	attr.rtcp_port = h->port + 1;
+	if(h->samplerate == 44100 && h->channels <= 2)
+		attr.payload = h->channels == 2 ? MULTIROOM_PAYLOAD_STEREO :
+						  MULTIROOM_PAYLOAD_MONO;
+	else
+		attr.payload = MULTIROOM_PAYLOAD_DYNAMIC;
+	attr.max_packet_size = RTP_HEADER_SIZE + MULTIROOM_PACKET_SIZE;
+	attr.delay_packet_count = h->delay * packets / 1000 + 1;
+	attr.pool_packet_count = MULTIROOM_POOL * packets / 1000;
+	if(attr.pool_packet_count < 2 * attr.delay_packet_count)
+		attr.pool_packet_count = 2 * attr.delay_packet_count;
+	attr.adaptive = h->adaptive;
+	attr.min_delay_packet_count = MULTIROOM_MIN_DELAY * packets / 1000 + 1;
+	attr.clock_rate = h->samplerate;
+	attr.fill_ratio = 5;
+	h->rtp = NULL;
+	if(rtp_open(&h->rtp, &attr) != 0)
+	{
+		fprintf(stderr, "[multiroom] can't receive RTP stream\n");
+		rtp_close(h->rtp);
+		h->rtp = NULL;
+		goto error;
+	}
+
+	/* Open new Audio stream output and play */
+	h->stream = output_add_stream(h->output, "multiroom", h->samplerate,
+				      h->channels, h->cache, h->cache != 0,
+				      NULL, &multiroom_read, h);
+	if(h->stream == NULL)
+	{
+		rtp_close(h->rtp);
+		h->rtp = NULL;
+		goto error;
+	}
+	output_play_stream(h->output, h->stream);
+
+	/* Unlock play / stop */
+	pthread_mutex_unlock(&h->mutex);
+
+	return 0;
+
+error:
+	pthread_mutex_unlock(&h->mutex);
+	return -1;
+}
+
+static int multiroom_stop(struct multiroom_handle *h)
+{
+	/* Lock play / stop */
+	pthread_mutex_lock(&h->mutex);
+
+	/* Remove stream: the read callback is not called anymore */
+	if(h->stream != NULL)
+		output_remove_stream(h->output, h->stream);
+	h->stream = NULL;
+
+	/* Close RTP receiver */
+	if(h->rtp != NULL)
+		rtp_close(h->rtp);
+	h->rtp = NULL;
+
+	/* Unlock play / stop */
+	pthread_mutex_unlock(&h->mutex);
+
+	return 0;
+}
+
+static char *multiroom_get_json_status(struct multiroom_handle *h)
+{
+	struct rtp_stats stats;
+	struct json *root;
+	char *str;
+
+	/* Create JSON object */
+	root = json_new();
+	if(root == NULL)
+		return NULL;
+
+	/* Lock play / stop */
+	pthread_mutex_lock(&h->mutex);
+
+	/* Set status and reception statistics */
+	json_set_bool(root, "playing", (h->stream != NULL));
+	json_set_string(root, "group", multiroom_get_group(h));
+	if(h->rtp != NULL && rtp_get_stats(h->rtp, &stats) == 0)
+	{
+		json_set_int64(root, "received", stats.received);
+		json_set_int64(root, "lost", stats.lost);
+		json_set_int64(root, "jitter", stats.jitter * 1000 /
+					       h->samplerate);
+		json_set_int64(root, "delay", stats.delay_packet_count *
+					      h->packet_samples * 1000 /
+					      h->channels / h->samplerate);
+	}
+
+	/* Unlock play / stop */
+	pthread_mutex_unlock(&h->mutex);
+
+	/* Get JSON string */
+	str = strdup(json_export(root));
+
+	/* Free JSON object */
+	json_free(root);
+
+	return str;
+}
+
+static int multiroom_set_config(struct multiroom_handle *h,
+				const struct json *c)
+{
+	const char *group = NULL;
+
+	if(h == NULL)
+		return -1;
+
+	/* Lock play / stop */
+	pthread_mutex_lock(&h->mutex);
+
+	/* Free previous values */
+	free(h->group);
+	h->group = NULL;
+	h->samplerate = MULTIROOM_SAMPLERATE;
+	h->channels = MULTIROOM_CHANNELS;
+	h->delay = MULTIROOM_DELAY;
+	h->adaptive = 1;
+	h->cache = 0;
+	h->autostart = 0;
+
+	/* Parse config */
+	if(c != NULL)
+	{
+		/* Get multicast group of sender as "group[:port]" */
+		group = json_get_string(c, "group");
+		if(group != NULL && *group != '\0')
+			h->group = strdup(group);
+
+		/* Get stream format of sender */
+		if(json_has_key(c, "samplerate"))
+			h->samplerate = json_get_int(c, "samplerate");
+		if(json_has_key(c, "channels"))
+			h->channels = json_get_int(c, "channels");
+
+		/* Get delay of jitter buffer (in ms): with adaptive latency,
+		 * it is the maximum delay
+		 */
+		if(json_has_key(c, "delay"))
+			h->delay = json_get_int(c, "delay");
+		if(json_has_key(c, "adaptive"))
+			h->adaptive = json_get_bool(c, "adaptive");
+
+		/* Get cache (in ms) and play at startup */
+		h->cache = json_get_int(c, "cache");
+		h->autostart = json_get_bool(c, "autostart");
+	}
+
+	/* Check values */
+	if(h->samplerate == 0)
+		h->samplerate = MULTIROOM_SAMPLERATE;
+	if(h->channels == 0 || h->channels > 2)
+		h->channels = MULTIROOM_CHANNELS;
+	if(h->delay > MULTIROOM_MAX_DELAY)
+		h->delay = MULTIROOM_MAX_DELAY;
+
+	/* Unlock play / stop */
+	pthread_mutex_unlock(&h->mutex);
+
+	return 0;
+}
+
+static struct json *multiroom_get_config(struct multiroom_handle *h)
+{
+	struct json *c;
+
+	c = json_new();
+	if(c == NULL)
+		return NULL;
+
+	/* Lock play / stop */
+	pthread_mutex_lock(&h->mutex);
+
+	/* Set sender group and format */
+	json_set_string(c, "group", multiroom_get_group(h));
+	json_set_int(c, "samplerate", h->samplerate);
+	json_set_int(c, "channels", h->channels);
+
+	/* Set jitter buffer, cache and startup */
+	json_set_int(c, "delay", h->delay);
+	json_set_bool(c, "adaptive", h->adaptive);
+	json_set_int(c, "cache", h->cache);
+	json_set_bool(c, "autostart", h->autostart);
+
+	/* Unlock play / stop */
+	pthread_mutex_unlock(&h->mutex);
+
+	return c;
+}
+
+static int multiroom_close(struct multiroom_handle *h)
+{
+	if(h == NULL)
+		return 0;
+
+	/* Stop stream */
+	multiroom_stop(h);
+
+	/* Free configuration */
+	free(h->group);
+
+	pthread_mutex_destroy(&h->mutex);
+	free(h);
+
+	return 0;
+}
+
+static int multiroom_httpd_play(void *user_data, struct httpd_req *req,
+				struct httpd_res **res)
+{
+	struct multiroom_handle *h = user_data;
+
+	/* Play stream of sender */
+	if(multiroom_play(h) != 0)
+	{
+		*res = httpd_new_response("Can't receive stream", 0, 0);
+		return 503;
+	}
+
+	return 200;
+}
+
+static int multiroom_httpd_stop(void *user_data, struct httpd_req *req,
+				struct httpd_res **res)
+{
+	struct multiroom_handle *h = user_data;
+
+	/* Stop stream */
+	multiroom_stop(h);
+
+	return 200;
+}
+
+static int multiroom_httpd_status(void *user_data, struct httpd_req *req,
+				  struct httpd_res **res)
+{
+	struct multiroom_handle *h = user_data;
+	char *stat;
+
+	/* Get status */
+	stat = multiroom_get_json_status(h);
+	if(stat == NULL)
+	{
+		*res = httpd_new_response("No status", 0, 0);
+		return 500;
+	}
+
+	*res = httpd_new_response(stat, 1, 0);
+	return 200;
+}
+
+static struct url_table multiroom_url[] = {
+	{"/play",   0, HTTPD_PUT, 0, &multiroom_httpd_play},
+	{"/stop",   0, HTTPD_PUT, 0, &multiroom_httpd_stop},
+	{"/status", 0, HTTPD_GET, 0, &multiroom_httpd_status},
+	{0, 0, 0}
+};
+
+struct module module_entry = {
+	.id = "multiroom",
+	.name = "Multi-room",
+	.description = "Play the stream of another AirCat in this room.",
+	.open = (void*) &multiroom_open,
+	.close = (void*) &multiroom_close,
+	.set_config = (void*) &multiroom_set_config,
+	.get_config = (void*) &multiroom_get_config,
+	.urls = (void*) &multiroom_url,
+};
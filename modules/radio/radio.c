@@ -24,6 +24,21 @@
 #include "shoutcast.h"
 #include "radio_list.h"
 
+/* Relay: response block size */
+#define RADIO_RELAY_BLOCK_SIZE 8192
+
+/* Standby: default count of last radios kept connected and bitrate used for
+ * streams without bitrate information (in kb/s)
+ */
+#define RADIO_STANDBY_DEFAULT 2
+#define RADIO_STANDBY_BITRATE 128
+
+struct radio_standby {
+	struct radio_item *radio;
+	struct shout_handle *shout;
+	struct radio_standby *next;
+};
+
 struct radio_handle {
 	/* Output module */
 	struct output_handle *output;
@@ -31,10 +46,18 @@ struct radio_handle {
 	/* Radio player */
 	struct shout_handle *shout;
 	struct radio_item *radio;
+	/* Radios kept connected (most recent first) */
+	struct radio_standby *standby;
 	/* Databse: radio list */
 	struct db_handle *db;
+	struct radio_list_cache *list_cache;
 	/* Config part */
 	unsigned long cache;
+	int fast_start;
+	unsigned int standby_count;
+	unsigned long standby_bitrate;
+	struct json *favourites;
+	struct resample_profile profile;
 };
 
 static int radio_stop(struct radio_handle *h);
@@ -54,9 +77,18 @@ static int radio_open(struct radio_handle **handle, struct module_attr *attr)
 	h->shout = NULL;
 	h->output = attr->output;
 	h->db = attr->db;
+	h->list_cache = radio_list_cache_new(h->db);
 	h->stream = NULL;
 	h->radio = NULL;
 	h->cache = 0;
+	h->fast_start = 1;
+	h->standby = NULL;
+	h->standby_count = RADIO_STANDBY_DEFAULT;
+	h->standby_bitrate = 0;
+	h->favourites = NULL;
+	h->profile.quality = RESAMPLE_DEFAULT;
+	h->profile.threads = 0;
+	h->profile.variable_rate = 0;
 
 	/* Load configuration */
 	radio_set_config(h, attr->config);
@@ -64,8 +96,155 @@ static int radio_open(struct radio_handle **handle, struct module_attr *attr)
 	return 0;
 }
 
+static int radio_is_favourite(struct radio_handle *h, const char *id)
+{
+	const char *str;
+	int i, len;
+
+	if(h->favourites == NULL)
+		return 0;
+
+	/* Find radio ID in favourites */
+	len = json_array_length(h->favourites);
+	for(i = 0; i < len; i++)
+	{
+		str = json_to_string(json_array_get(h->favourites, i));
+		if(str != NULL && strcmp(str, id) == 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+static unsigned long radio_standby_bitrate(struct shout_handle *shout)
+{
+	const struct radio_info *info;
+
+	/* Get stream bitrate (in kb/s) */
+	info = shoutcast_get_info(shout);
+	return info->bitrate > 0 ? info->bitrate : RADIO_STANDBY_BITRATE;
+}
+
+static void radio_standby_free(struct radio_standby *s)
+{
+	shoutcast_close(s->shout);
+	radio_free_radio_item(s->radio);
+	free(s);
+}
+
+static void radio_standby_trim(struct radio_handle *h)
+{
+	struct radio_standby **p, **last, **last_pinned, **del;
+	struct radio_standby *s;
+	unsigned long bitrate;
+	unsigned int count;
+
+	do
+	{
+		/* Find oldest radios and count them (favourites are not
+		 * counted)
+		 */
+		bitrate = 0;
+		count = 0;
+		last = NULL;
+		last_pinned = NULL;
+		for(p = &h->standby; *p != NULL; p = &(*p)->next)
+		{
+			bitrate += radio_standby_bitrate((*p)->shout);
+			if(radio_is_favourite(h, (*p)->radio->id))
+				last_pinned = p;
+			else
+			{
+				last = p;
+				count++;
+			}
+		}
+
+		/* Remove oldest radio when over limits: favourites are removed
+		 * only to respect the bitrate limit
+		 */
+		if(count > h->standby_count)
+			del = last;
+		else if(h->standby_bitrate > 0 && bitrate > h->standby_bitrate)
+			del = last != NULL ? last : last_pinned;
+		else
+			break;
+
+		s = *del;
+		*del = s->next;
+		radio_standby_free(s);
+	} while(h->standby != NULL);
+}
+
+static void radio_standby_add(struct radio_handle *h, struct radio_item *radio,
+			      struct shout_handle *shout)
+{
+	struct radio_standby *s;
+
+	/* Stream is not worth keeping */
+	if((h->standby_count == 0 && !radio_is_favourite(h, radio->id)) ||
+	   shoutcast_get_status(shout) == SHOUT_PAUSED ||
+	   shoutcast_get_status(shout) == SHOUT_STOPPED)
+		goto close;
+
+	/* Allocate standby entry */
+	s = malloc(sizeof(struct radio_standby));
+	if(s == NULL)
+		goto close;
+
+	/* Keep stream connected */
+	if(shoutcast_set_standby(shout, 1) != 0)
+	{
+		free(s);
+		goto close;
+	}
+
+	/* Add as most recent radio */
+	s->radio = radio;
+	s->shout = shout;
+	s->next = h->standby;
+	h->standby = s;
+
+	/* Remove radios over limits */
+	radio_standby_trim(h);
+	return;
+
+close:
+	shoutcast_close(shout);
+	radio_free_radio_item(radio);
+}
+
+static struct radio_standby *radio_standby_get(struct radio_handle *h,
+					       const char *id)
+{
+	struct radio_standby **p, *s;
+
+	/* Find radio in standby list */
+	for(p = &h->standby; *p != NULL; p = &(*p)->next)
+	{
+		if(strcmp((*p)->radio->id, id) != 0)
+			continue;
+
+		/* Remove from list */
+		s = *p;
+		*p = s->next;
+
+		/* Stream has ended */
+		if(shoutcast_get_status(s->shout) == SHOUT_STOPPED)
+		{
+			radio_standby_free(s);
+			return NULL;
+		}
+
+		return s;
+	}
+
+	return NULL;
+}
+
 static int radio_play(struct radio_handle *h, const char *id)
 {
+	struct radio_standby *s;
 	unsigned long samplerate;
 	unsigned char channels;
 
@@ -81,14 +260,36 @@ static int radio_play(struct radio_handle *h, const char *id)
 	/* Stop previous radio */
 	radio_stop(h);
 
-	/* Get radio item */
-	h->radio = radio_get_radio_item(h->db, id);
-	if(h->radio == NULL)
-		return -1;
+	/* Radio is still connected: play it from its cache */
+	s = radio_standby_get(h, id);
+	if(s != NULL)
+	{
+		h->radio = s->radio;
+		h->shout = s->shout;
+		free(s);
+		shoutcast_set_standby(h->shout, 0);
+	}
+	else
+	{
+		/* Get radio item */
+		h->radio = radio_get_radio_item(h->db, id);
+		if(h->radio == NULL)
+			return -1;
+
+		/* Open radio */
+		if(shoutcast_open(&h->shout, h->radio->url, h->cache/1000,
+				  0) != 0)
+		{
+			shoutcast_close(h->shout);
+			radio_free_radio_item(h->radio);
+			h->shout = NULL;
+			h->radio = NULL;
+			return -1;
+		}
+	}
 
-	/* Open radio */
-	if(shoutcast_open(&h->shout, h->radio->url, h->cache/1000, 0) != 0)
-		return -1;
+	/* Start playing before cache is full */
+	shoutcast_set_fast_start(h->shout, h->fast_start);
 
 	/* Get samplerate and channels */
 	samplerate = shoutcast_get_samplerate(h->shout);
@@ -96,7 +297,8 @@ static int radio_play(struct radio_handle *h, const char *id)
 
 	/* Open new Audio stream output and play */
 	h->stream = output_add_stream(h->output, NULL, samplerate, channels,
-				      0, 0, &shoutcast_read, h->shout);
+				      0, 0, &h->profile, &shoutcast_read,
+				      h->shout);
 	output_play_stream(h->output, h->stream);
 
 	return 0;
@@ -137,11 +339,11 @@ static int radio_stop(struct radio_handle *h)
 	if(h->stream != NULL)
 		output_remove_stream(h->output, h->stream);
 
-	if(h->shout != NULL)
-		shoutcast_close(h->shout);
-
+	/* Keep radio connected for a next play */
 	if(h->radio != NULL)
-		radio_free_radio_item(h->radio);
+		radio_standby_add(h, h->radio, h->shout);
+	else
+		shoutcast_close(h->shout);
 
 	h->stream = NULL;
 	h->shout = NULL;
@@ -259,24 +461,64 @@ static int radio_set_config(struct radio_handle *h, const struct json *c)
 {
 	unsigned long cache;
 	const char *file;
+	int pause_ram = 0;
 
 	if(h == NULL)
 		return -1;
 
 	/* Free previous values */
 	cache = 0;
+	h->fast_start = 1;
+	h->standby_count = RADIO_STANDBY_DEFAULT;
+	h->standby_bitrate = 0;
+	json_free(h->favourites);
+	h->favourites = NULL;
+	h->profile.quality = RESAMPLE_DEFAULT;
+	h->profile.threads = 0;
+	h->profile.variable_rate = 0;
 
 	/* Parse config */
 	if(c != NULL)
 	{
 		/* Get cache size (in ms) */
 		cache = json_get_int(c, "cache");
+
+		/* Get fast start (enabled by default) */
+		if(json_has_key(c, "fast_start"))
+			h->fast_start = json_get_bool(c, "fast_start");
+
+		/* Get count of last radios kept connected and bitrate limit
+		 * of these radios (in kb/s, 0 for no limit)
+		 */
+		if(json_has_key(c, "standby"))
+			h->standby_count = json_get_int(c, "standby");
+		h->standby_bitrate = json_get_int(c, "standby_bitrate");
+
+		/* Get favourite radios: kept connected once played */
+		h->favourites = json_copy(json_get(c, "favourites"));
+
+		/* Get resampler profile (used for next radio) */
+		h->profile.quality = resample_quality_from_name(
+				       json_get_string(c, "resample_quality"));
+		h->profile.threads = json_get_int(c, "resample_threads");
+
+		/* Get memory of pause buffer (in MB) before it is continued on
+		 * disk (0 for default) */
+		pause_ram = json_get_int(c, "pause_ram");
 	}
 
+	/* Set pause buffer memory of streams */
+	if(pause_ram < 0)
+		pause_ram = 0;
+	shoutcast_set_pause_ram((size_t) pause_ram * 1024 * 1024);
+
 	/* Set default values */
 	if(cache == 0)
 		cache = 5000;
 
+	/* Apply standby limits */
+	radio_standby_trim(h);
+
 	/* Reload cache */
 	if(h->cache != cache)
 	{
@@ -300,12 +542,29 @@ static struct json *radio_get_config(struct radio_handle *h)
 
 	/* Set current cache */
 	json_set_int(c, "cache", h->cache);
+	json_set_bool(c, "fast_start", h->fast_start);
+
+	/* Set standby radios */
+	json_set_int(c, "standby", h->standby_count);
+	json_set_int(c, "standby_bitrate", h->standby_bitrate);
+	if(h->favourites != NULL)
+		json_add(c, "favourites", json_copy(h->favourites));
+
+	/* Set resampler profile */
+	json_set_string(c, "resample_quality",
+			resample_quality_name(h->profile.quality));
+	json_set_int(c, "resample_threads", h->profile.threads);
+
+	/* Set pause buffer memory (in MB) */
+	json_set_int(c, "pause_ram", shoutcast_get_pause_ram() / (1024 * 1024));
 
 	return c;
 }
 
 static int radio_close(struct radio_handle *h)
 {
+	struct radio_standby *s;
+
 	if(h == NULL)
 		return 0;
 
@@ -316,6 +575,20 @@ static int radio_close(struct radio_handle *h)
 	if(h->shout != NULL)
 		shoutcast_close(h->shout);
 
+	/* Close radios kept connected */
+	while(h->standby != NULL)
+	{
+		s = h->standby;
+		h->standby = s->next;
+		radio_standby_free(s);
+	}
+
+	/* Free favourites */
+	json_free(h->favourites);
+
+	/* Free cached lists */
+	radio_list_cache_free(h->list_cache);
+
 	free(h);
 
 	return 0;
@@ -395,6 +668,98 @@ static int radio_httpd_stop(void *user_data, struct httpd_req *req,
 	return 200;
 }
 
+static ssize_t radio_relay_read_cb(void *user_data, uint64_t pos,
+				   char *buffer, size_t size)
+{
+	struct shout_listener *l = user_data;
+	ssize_t len;
+
+	/* Get next bytes of live stream without waiting: the connection is
+	 * suspended when no data is available */
+	len = shoutcast_listen_read(l, (unsigned char *) buffer, size, 0);
+
+	/* End of stream (-1 is end of response for HTTP server) */
+	return len < 0 ? -1 : len;
+}
+
+static void radio_relay_wake_cb(void *user_data)
+{
+	/* Resume connection: new data is available */
+	httpd_resume_stream(user_data);
+}
+
+static void radio_relay_free_cb(void *user_data)
+{
+	/* Remove listener */
+	shoutcast_unlisten(user_data);
+}
+
+static int radio_httpd_relay(void *user_data, struct httpd_req *req,
+			     struct httpd_res **res)
+{
+	struct radio_handle *h = user_data;
+	const struct radio_info *info;
+	struct shout_listener *l;
+	struct httpd_stream *stream;
+	const char *value;
+	char str[32];
+	int metadata;
+
+	/* No radio is playing */
+	if(h->shout == NULL)
+	{
+		*res = httpd_new_response("No radio playing", 0, 0);
+		return 404;
+	}
+
+	/* Listener asks for ICY metadata */
+	value = httpd_get_header(req, "Icy-MetaData");
+	metadata = value != NULL && atoi(value) == 1;
+
+	/* Add a listener to current radio */
+	l = shoutcast_listen(h->shout, metadata);
+	if(l == NULL)
+	{
+		*res = httpd_new_response("Relay not available", 0, 0);
+		return 503;
+	}
+
+	/* Create a never ending response from live stream */
+	*res = httpd_new_stream_response(req, RADIO_RELAY_BLOCK_SIZE,
+					 radio_relay_read_cb, l,
+					 radio_relay_free_cb, &stream);
+	if(*res == NULL)
+	{
+		shoutcast_unlisten(l);
+		return 500;
+	}
+
+	/* Resume connection from stream thread when new data is received */
+	shoutcast_listen_set_wake(l, radio_relay_wake_cb, stream);
+
+	/* Add stream info */
+	info = shoutcast_get_info(h->shout);
+	httpd_add_header(*res, HTTPD_HEADER_CONTENT_TYPE,
+			 info->type == AAC_STREAM ? "audio/aacp" :
+						    "audio/mpeg");
+	if(info->name != NULL)
+		httpd_add_header(*res, "icy-name", info->name);
+	if(info->genre != NULL)
+		httpd_add_header(*res, "icy-genre", info->genre);
+	if(info->bitrate > 0)
+	{
+		snprintf(str, sizeof(str), "%d", info->bitrate);
+		httpd_add_header(*res, "icy-br", str);
+	}
+	if(metadata)
+	{
+		snprintf(str, sizeof(str), "%d", SHOUT_RELAY_METAINT);
+		httpd_add_header(*res, "icy-metaint", str);
+	}
+
+	return 200;
+}
+
 static int radio_httpd_status(void *user_data, struct httpd_req *req,
 			      struct httpd_res **res)
 {
@@ -413,13 +778,42 @@ static int radio_httpd_status(void *user_data, struct httpd_req *req,
 	return 200;
 }
 
+static int radio_httpd_cached(struct httpd_req *req, struct httpd_res **res,
+			      char *json, const char *etag)
+{
+	const char *value;
+
+	/* Client has already last version of JSON */
+	value = httpd_get_header(req, "If-None-Match");
+	if(value != NULL && (strcmp(value, "*") == 0 ||
+			     strstr(value, etag) != NULL))
+	{
+		free(json);
+		*res = httpd_new_data_response(NULL, 0, 0, 0);
+		httpd_add_header(*res, "ETag", etag);
+		return 304;
+	}
+
+	/* Send JSON and its ETag: it must be revalidated before use */
+	*res = httpd_new_response(json, 1, 0);
+	httpd_add_header(*res, "ETag", etag);
+	httpd_add_header(*res, "Cache-Control", "no-cache");
+
+	return 200;
+}
+
 static int radio_httpd_cat_info(void *user_data, struct httpd_req *req,
 				struct httpd_res **res)
 {
 	struct radio_handle *h = user_data;
+	char etag[RADIO_LIST_ETAG_SIZE];
 	char *info;
 
-	/* Get info about category */
+	/* Get info about category (from cache if possible) */
+	info = radio_list_cache_get_category_info(h->list_cache, req->resource,
+						  etag);
+	if(info != NULL)
+		return radio_httpd_cached(req, res, info, etag);
 	info = radio_get_json_category_info(h->db, req->resource);
 	if(info == NULL)
 	{
@@ -454,6 +848,7 @@ static int radio_httpd_list(void *user_data, struct httpd_req *req,
 {
 	struct radio_handle *h = user_data;
 	unsigned long page = 0, count = 0;
+	char etag[RADIO_LIST_ETAG_SIZE];
 	const char *value;
 	char *list = NULL;
 
@@ -467,7 +862,11 @@ static int radio_httpd_list(void *user_data, struct httpd_req *req,
 	if(value != NULL)
 		count = strtoul(value, NULL, 10);
 
-	/* Get Radio list */
+	/* Get Radio list (from cache if possible) */
+	list = radio_list_cache_get_list(h->list_cache, req->resource, page,
+					 count, etag);
+	if(list != NULL)
+		return radio_httpd_cached(req, res, list, etag);
 	list = radio_get_json_list(h->db, req->resource, page, count);
 	if(list == NULL)
 	{
@@ -489,6 +888,7 @@ static struct url_table radio_url[] = {
 	{"/reset" ,         0,             HTTPD_PUT, 0, &radio_httpd_reset},
 	{"/stop",           0,             HTTPD_PUT, 0, &radio_httpd_stop},
 	{"/status",         HTTPD_EXT_URL, HTTPD_GET, 0, &radio_httpd_status},
+	{"/relay",          0,             HTTPD_GET, 0, &radio_httpd_relay},
 	{0, 0, 0}
 };
 
@@ -22,31 +22,47 @@
 #include <pthread.h>
 
 #include "radio_list.h"
+#include "utils.h"
 #include "json.h"
+#include "json_stream.h"
 
 #define RADIO_LIST_DEFAULT_COUNT 25
 
+/* Cached responses (cache is emptied when full) */
+#define RADIO_LIST_CACHE_SIZE 256
+
+struct radio_list_entry {
+	char *key;
+	char *json;
+	char etag[RADIO_LIST_ETAG_SIZE];
+};
+
+struct radio_list_cache {
+	struct db_handle *db;
+	/* Responses sorted by key */
+	struct radio_list_entry entries[RADIO_LIST_CACHE_SIZE];
+	unsigned int count;
+	/* Database version when responses were generated */
+	int64_t version;
+	pthread_mutex_t mutex;
+};
+
 /* Get a radio by id */
 struct radio_item *radio_get_radio_item(struct db_handle *db, const char *id)
 {
 	struct radio_item *radio = NULL;
 	struct db_query *q = NULL;
-	char *sql;
-	int len;
 
-	/* Prepare SQL */
-	len = asprintf(&sql, "SELECT id,name,url,description "
-			     "FROM radio_list "
-			     "WHERE id = %ld", atol(id));
-	if(len < 0)
-		return NULL;
-
-	/* Send SQL query */
-	q = db_prepare(db, sql, len);
-	free(sql);
+	/* Prepare SQL query */
+	q = db_prepare(db, "SELECT id,name,url,description "
+			   "FROM radio_list "
+			   "WHERE id = ?", -1);
 	if(q == NULL)
 		return NULL;
 
+	/* Bind id */
+	db_bind_int64(q, 1, atol(id));
+
 	/* Get first row */
 	if(db_step(q) < 0)
 		goto end;
@@ -75,22 +91,17 @@ struct category_item *radio_get_category_item(struct db_handle *db,
 {
 	struct category_item *category = NULL;
 	struct db_query *q = NULL;
-	char *sql;
-	int len;
-
-	/* Prepare SQL */
-	len = asprintf(&sql, "SELECT id,name "
-			     "FROM category_list "
-			     "WHERE id = %ld", atol(id));
-	if(len < 0)
-		return NULL;
 
-	/* Send SQL query */
-	q = db_prepare(db, sql, len);
-	free(sql);
+	/* Prepare SQL query */
+	q = db_prepare(db, "SELECT id,name "
+			   "FROM category_list "
+			   "WHERE id = ?", -1);
 	if(q == NULL)
 		return NULL;
 
+	/* Bind id */
+	db_bind_int64(q, 1, atol(id));
+
 	/* Get first row */
 	if(db_step(q) < 0)
 		goto end;
@@ -148,22 +159,17 @@ char *radio_get_json_category_info(struct db_handle *db, const char *id)
 	struct db_query *q = NULL;
 	struct json *info;
 	char *str = NULL;
-	char *sql;
-	int len;
 
-	/* Prepare SQL */
-	len = asprintf(&sql, "SELECT id,name "
-			     "FROM category_list "
-			     "WHERE id = %ld", atol(id));
-	if(len < 0)
-		return NULL;
-
-	/* Send SQL query */
-	q = db_prepare(db, sql, len);
-	free(sql);
+	/* Prepare SQL query */
+	q = db_prepare(db, "SELECT id,name "
+			   "FROM category_list "
+			   "WHERE id = ?", -1);
 	if(q == NULL)
 		return NULL;
 
+	/* Bind id */
+	db_bind_int64(q, 1, atol(id));
+
 	/* Get first row */
 	if(db_step(q) < 0)
 		goto end;
@@ -196,22 +202,17 @@ char *radio_get_json_radio_info(struct db_handle *db, const char *id)
 	struct db_query *q = NULL;
 	struct json *info;
 	char *str = NULL;
-	char *sql;
-	int len;
-
-	/* Prepare SQL */
-	len = asprintf(&sql, "SELECT id,name,url,description "
-			     "FROM radio_list "
-			     "WHERE id = %ld", atol(id));
-	if(len < 0)
-		return NULL;
 
-	/* Send SQL query */
-	q = db_prepare(db, sql, len);
-	free(sql);
+	/* Prepare SQL query */
+	q = db_prepare(db, "SELECT id,name,url,description "
+			   "FROM radio_list "
+			   "WHERE id = ?", -1);
 	if(q == NULL)
 		return NULL;
 
+	/* Bind id */
+	db_bind_int64(q, 1, atol(id));
+
 	/* Get first row */
 	if(db_step(q) < 0)
 		goto end;
@@ -243,7 +244,7 @@ end:
 static int radio_to_json(void *user_data, int col_count, char **values,
 			 char **names)
 {
-	struct json *list = user_data;
+	struct json_stream *list = user_data;
 	struct json *tmp;
 
 	/* Create JSON object */
@@ -258,8 +259,7 @@ static int radio_to_json(void *user_data, int col_count, char **values,
 	json_set_string(tmp, "description", values[3]);
 
 	/* Add object to array */
-	if(json_array_add(list, tmp) != 0)
-		json_free(tmp);
+	json_stream_add(list, NULL, tmp);
 
 	return 0;
 }
@@ -267,7 +267,7 @@ static int radio_to_json(void *user_data, int col_count, char **values,
 static int category_to_json(void *user_data, int col_count, char **values,
 			    char **names)
 {
-	struct json *list = user_data;
+	struct json_stream *list = user_data;
 	struct json *tmp;
 
 	/* Create JSON object */
@@ -280,8 +280,7 @@ static int category_to_json(void *user_data, int col_count, char **values,
 	json_set_string(tmp, "name", values[1]);
 
 	/* Add object to array */
-	if(json_array_add(list, tmp) != 0)
-		json_free(tmp);
+	json_stream_add(list, NULL, tmp);
 
 	return 0;
 }
@@ -289,9 +288,8 @@ static int category_to_json(void *user_data, int col_count, char **values,
 char *radio_get_json_list(struct db_handle *db, const char *id,
 			  unsigned long page, unsigned long count)
 {
-	struct json *root, *list;
+	struct json_stream *root;
 	char limit[30] = "";
-	char *str = NULL;
 	long p_id;
 	char *sql;
 	int len;
@@ -303,12 +301,15 @@ char *radio_get_json_list(struct db_handle *db, const char *id,
 		count = RADIO_LIST_DEFAULT_COUNT;
 	snprintf(limit, 30, "LIMIT %lu, %lu", (page-1) * count, count);
 
+	/* Create JSON writer */
+	root = json_stream_new();
+	if(root == NULL)
+		return NULL;
+
 	if(id != NULL && strcmp(id, "all") == 0)
 	{
 		/* Create radio array */
-		list = json_new_array();
-		if(list == NULL)
-			return NULL;
+		json_stream_begin_array(root, NULL);
 
 		/* Prepare SQL */
 		len = asprintf(&sql, "SELECT id,name,url,description "
@@ -318,52 +319,41 @@ char *radio_get_json_list(struct db_handle *db, const char *id,
 		/* List all radios */
 		if(len > 0)
 		{
-			db_exec(db, sql, &radio_to_json, list);
+			db_exec(db, sql, &radio_to_json, root);
 			free(sql);
 		}
 
-		/* Get string from JSON object */
-		str = strdup(json_export(list));
-
-		/* Free JSON object */
-		json_free(list);
+		/* Close radio array */
+		json_stream_end_array(root);
 	}
 	else
 	{
 		/* Create a new JSON object */
-		root = json_new();
-		if(root == NULL)
-			return NULL;
+		json_stream_begin_object(root, NULL);
 
 		/* Get id */
 		p_id = id == NULL || *id == '\0' ? 0 : atol(id);
 
 		/* Create category array */
-		list = json_new_array();
-		if(list == NULL)
-			goto end;
+		json_stream_begin_array(root, "category");
 
 		/* Prepare SQL */
 		len = asprintf(&sql, "SELECT id,name FROM category_list "
 				     "WHERE p_id = '%ld' "
 				     "ORDER BY name ASC %s", p_id, limit);
-		if(len < 0)
-		{
-			json_free(list);
-			goto end;
-		}
 
 		/* List all categories with p_id as parent */
-		db_exec(db, sql, &category_to_json, list);
-		free(sql);
+		if(len > 0)
+		{
+			db_exec(db, sql, &category_to_json, root);
+			free(sql);
+		}
 
-		/* Add array to JSON object */
-		json_add(root, "category", list);
+		/* Close category array */
+		json_stream_end_array(root);
 
 		/* Create radio array */
-		list = json_new_array();
-		if(list == NULL)
-			goto end;
+		json_stream_begin_array(root, "radio");
 
 		/* Prepare SQL */
 		len = asprintf(&sql, "SELECT id,name,url,description "
@@ -373,27 +363,223 @@ char *radio_get_json_list(struct db_handle *db, const char *id,
 				     "WHERE rc.cat_id = '%ld' "
 				     "ORDER BY name ASC %s", p_id, limit);
 
-		if(len < 0)
+		/* List all radios of category */
+		if(len > 0)
 		{
-			json_free(list);
-			goto end;
+			db_exec(db, sql, &radio_to_json, root);
+			free(sql);
 		}
 
-		/* List all categories with p_id as parent */
-		db_exec(db, sql, &radio_to_json, list);
-		free(sql);
+		/* Close radio array */
+		json_stream_end_array(root);
 
-		/* Add array to JSON object */
-		json_add(root, "radio", list);
+		/* Close JSON object */
+		json_stream_end_object(root);
+	}
+
+	/* Get string from JSON writer */
+	return json_stream_finish(root, NULL);
+}
 
-end:
-		/* Get string from JSON object */
-		str = strdup(json_export(root));
 
-		/* Free JSON object */
-		json_free(root);
+struct radio_list_cache *radio_list_cache_new(struct db_handle *db)
+{
+	struct radio_list_cache *c;
+
+	/* Allocate cache */
+	c = calloc(1, sizeof(struct radio_list_cache));
+	if(c == NULL)
+		return NULL;
+	c->db = db;
+	c->version = -1;
+	pthread_mutex_init(&c->mutex, NULL);
+
+	return c;
+}
+
+static void radio_list_cache_clear(struct radio_list_cache *c)
+{
+	/* Free all responses */
+	while(c->count > 0)
+	{
+		c->count--;
+		free(c->entries[c->count].key);
+		free(c->entries[c->count].json);
 	}
+}
 
-	return str;
+static int64_t radio_list_cache_version(struct radio_list_cache *c)
+{
+	struct db_query *q;
+	int64_t version = -1;
+
+	/* Version changes each time database is modified by another
+	 * connection (when radio list is updated)
+	 */
+	q = db_prepare(c->db, "PRAGMA data_version", -1);
+	if(q == NULL)
+		return -1;
+	if(db_step(q) == DB_ROW)
+		version = db_column_int64(q, 0);
+	db_finalize(q);
+
+	return version;
+}
+
+static int radio_list_cache_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct radio_list_entry *) a)->key,
+		      ((const struct radio_list_entry *) b)->key);
+}
+
+static char *radio_list_cache_get(struct radio_list_cache *c, const char *key,
+				  char *(*get)(struct db_handle *, void *),
+				  void *user_data, char *etag)
+{
+	struct radio_list_entry *e, k;
+	uint64_t hash;
+	int64_t version;
+	unsigned int i;
+	char *json;
+
+	/* Lock cache access */
+	pthread_mutex_lock(&c->mutex);
+
+	/* Radio database has changed: drop all responses */
+	version = radio_list_cache_version(c);
+	if(version != c->version)
+	{
+		radio_list_cache_clear(c);
+		c->version = version;
+	}
+
+	/* Find response */
+	k.key = (char *) key;
+	e = bsearch(&k, c->entries, c->count, sizeof(struct radio_list_entry),
+		    radio_list_cache_cmp);
+	if(e == NULL)
+	{
+		/* Generate response */
+		json = get(c->db, user_data);
+		if(json == NULL)
+			goto error;
+
+		/* Cache is full */
+		if(c->count == RADIO_LIST_CACHE_SIZE)
+			radio_list_cache_clear(c);
+
+		/* Find position */
+		for(i = 0; i < c->count &&
+			   strcmp(c->entries[i].key, key) < 0; i++);
+
+		/* Insert response */
+		k.key = strdup(key);
+		if(k.key == NULL)
+		{
+			free(json);
+			goto error;
+		}
+		k.json = json;
+
+		/* Generate a strong ETag from content (FNV-1a) */
+		hash = utils_hash_fnv1a(UTILS_FNV1A_INIT, json, strlen(json));
+		snprintf(k.etag, sizeof(k.etag), "\"%016llx\"",
+			 (unsigned long long) hash);
+
+		memmove(&c->entries[i+1], &c->entries[i],
+			(c->count - i) * sizeof(struct radio_list_entry));
+		c->entries[i] = k;
+		c->count++;
+		e = &c->entries[i];
+	}
+
+	/* Copy response and its ETag */
+	json = strdup(e->json);
+	strcpy(etag, e->etag);
+
+	/* Unlock cache access */
+	pthread_mutex_unlock(&c->mutex);
+
+	return json;
+
+error:
+	pthread_mutex_unlock(&c->mutex);
+	return NULL;
 }
 
+struct radio_list_params {
+	const char *id;
+	unsigned long page;
+	unsigned long count;
+};
+
+static char *radio_list_cache_get_list_cb(struct db_handle *db,
+					  void *user_data)
+{
+	struct radio_list_params *p = user_data;
+
+	return radio_get_json_list(db, p->id, p->page, p->count);
+}
+
+char *radio_list_cache_get_list(struct radio_list_cache *c, const char *id,
+				unsigned long page, unsigned long count,
+				char *etag)
+{
+	struct radio_list_params p;
+	char key[64];
+
+	if(c == NULL)
+		return NULL;
+
+	/* Generate key from parameters as used for list */
+	if(page == 0)
+		page = 1;
+	if(count == 0)
+		count = RADIO_LIST_DEFAULT_COUNT;
+	if(id != NULL && strcmp(id, "all") == 0)
+		snprintf(key, sizeof(key), "l:all:%lu:%lu", page, count);
+	else
+		snprintf(key, sizeof(key), "l:%ld:%lu:%lu",
+			 id == NULL || *id == '\0' ? 0 : atol(id), page,
+			 count);
+
+	/* Get list */
+	p.id = id;
+	p.page = page;
+	p.count = count;
+	return radio_list_cache_get(c, key, radio_list_cache_get_list_cb, &p,
+				    etag);
+}
+
+static char *radio_list_cache_get_category_cb(struct db_handle *db,
+					      void *user_data)
+{
+	return radio_get_json_category_info(db, user_data);
+}
+
+char *radio_list_cache_get_category_info(struct radio_list_cache *c,
+					 const char *id, char *etag)
+{
+	char key[32];
+
+	if(c == NULL || id == NULL)
+		return NULL;
+
+	/* Generate key from category id */
+	snprintf(key, sizeof(key), "c:%ld", atol(id));
+
+	/* Get category info */
+	return radio_list_cache_get(c, key, radio_list_cache_get_category_cb,
+				    (void *) id, etag);
+}
+
+void radio_list_cache_free(struct radio_list_cache *c)
+{
+	if(c == NULL)
+		return;
+
+	/* Free all responses */
+	radio_list_cache_clear(c);
+	pthread_mutex_destroy(&c->mutex);
+	free(c);
+}
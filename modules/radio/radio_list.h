@@ -48,5 +48,19 @@ char *radio_get_json_radio_info(struct db_handle *db, const char *id);
 char *radio_get_json_list(struct db_handle *db, const char *id,
 			  unsigned long page, unsigned long count);
 
+/* Cache of JSON lists: responses are generated once and kept with their ETag
+ * until radio database is modified. A copy of response is returned and its
+ * ETag is copied in etag (RADIO_LIST_ETAG_SIZE bytes).
+ */
+#define RADIO_LIST_ETAG_SIZE 20
+struct radio_list_cache;
+struct radio_list_cache *radio_list_cache_new(struct db_handle *db);
+char *radio_list_cache_get_list(struct radio_list_cache *c, const char *id,
+				unsigned long page, unsigned long count,
+				char *etag);
+char *radio_list_cache_get_category_info(struct radio_list_cache *c,
+					 const char *id, char *etag);
+void radio_list_cache_free(struct radio_list_cache *c);
+
 #endif
 
@@ -0,0 +1,193 @@
+/*
+ * budget.c - A global memory budget for audio buffers
+ *
+ * Copyright (c) 2014   A. Dilly
+ *
+ * AirCat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * AirCat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with AirCat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "budget.h"
+#include "pool.h"
+
+#define LOAD(v) __atomic_load_n(&(v), __ATOMIC_ACQUIRE)
+#define STORE(v, x) __atomic_store_n(&(v), x, __ATOMIC_RELEASE)
+#define ADD(v, x) __atomic_add_fetch(&(v), x, __ATOMIC_ACQ_REL)
+#define SUB(v, x) __atomic_sub_fetch(&(v), x, __ATOMIC_ACQ_REL)
+
+#define MB (1024*1024)
+
+static const char *budget_names[BUDGET_COUNT] = {
+	[BUDGET_CACHE] = "cache",
+	[BUDGET_VRING] = "vring",
+	[BUDGET_RTP] = "rtp",
+	[BUDGET_SHOUTCAST] = "shoutcast",
+	[BUDGET_READAHEAD] = "readahead",
+};
+
+/* Global accounting: lock-free since reservations are done from audio
+ * threads.
+ */
+static size_t budget_limit = 0;
+static size_t budget_total = 0;
+static size_t budget_used[BUDGET_COUNT];
+static unsigned long budget_refused[BUDGET_COUNT];
+
+int budget_reserve(enum budget_type type, size_t size)
+{
+	size_t total, limit;
+
+	if(type >= BUDGET_COUNT)
+		return -1;
+
+	/* Add size to total only if limit is not exceeded */
+	total = LOAD(budget_total);
+	do {
+		limit = LOAD(budget_limit);
+		if(limit != 0 && total + size > limit)
+		{
+			ADD(budget_refused[type], 1);
+			return -1;
+		}
+	} while(!__atomic_compare_exchange_n(&budget_total, &total,
+					     total + size, 1, __ATOMIC_ACQ_REL,
+					     __ATOMIC_ACQUIRE));
+
+	/* Update subsystem usage */
+	ADD(budget_used[type], size);
+
+	return 0;
+}
+
+void budget_release(enum budget_type type, size_t size)
+{
+	if(type >= BUDGET_COUNT)
+		return;
+
+	SUB(budget_used[type], size);
+	SUB(budget_total, size);
+}
+
+void budget_set_limit(size_t limit)
+{
+	STORE(budget_limit, limit);
+}
+
+size_t budget_get_limit(void)
+{
+	return LOAD(budget_limit);
+}
+
+size_t budget_get_usage(enum budget_type type)
+{
+	if(type >= BUDGET_COUNT)
+		return LOAD(budget_total);
+
+	return LOAD(budget_used[type]);
+}
+
+int budget_set_config(struct json *cfg)
+{
+	int limit;
+
+	/* Default is unlimited */
+	if(cfg == NULL)
+	{
+		budget_set_limit(0);
+		return 0;
+	}
+
+	/* Get limit in MB */
+	limit = json_get_int(cfg, "limit");
+	if(limit < 0)
+		limit = 0;
+	budget_set_limit((size_t) limit * MB);
+
+	return 0;
+}
+
+struct json *budget_get_config(void)
+{
+	struct json *cfg;
+
+	/* Create a new object */
+	cfg = json_new();
+	if(cfg == NULL)
+		return NULL;
+
+	/* Set limit in MB */
+	json_set_int(cfg, "limit", budget_get_limit() / MB);
+
+	return cfg;
+}
+
+/******************************************************************************
+ *                           Budget URLs for AirCat                           *
+ ******************************************************************************/
+
+static int budget_httpd_status(void *user_data, struct httpd_req *req,
+			       struct httpd_res **res)
+{
+	struct pool_stats stats;
+	struct json *root, *tmp;
+	char *str;
+	int i;
+
+	/* Create a new object */
+	root = json_new();
+
+	/* Set global values */
+	json_set_int64(root, "limit", budget_get_limit());
+	json_set_int64(root, "used", budget_get_usage(BUDGET_COUNT));
+
+	/* Set usage of each subsystem */
+	for(i = 0; i < BUDGET_COUNT; i++)
+	{
+		tmp = json_new();
+		if(tmp == NULL)
+			continue;
+		json_set_int64(tmp, "used", budget_get_usage(i));
+		json_set_int64(tmp, "refused", LOAD(budget_refused[i]));
+		json_add(root, budget_names[i], tmp);
+	}
+
+	/* Set buffer pool counters: mallocs and frees are steady during
+	 * playback
+	 */
+	pool_get_stats(&stats);
+	tmp = json_new();
+	if(tmp != NULL)
+	{
+		json_set_int64(tmp, "allocs", stats.allocs);
+		json_set_int64(tmp, "mallocs", stats.mallocs);
+		json_set_int64(tmp, "frees", stats.frees);
+		json_add(root, "pool", tmp);
+	}
+
+	/* Get JSON string */
+	str = strdup(json_export(root));
+	*res = httpd_new_response(str, 1, 0);
+
+	/* Free JSON object */
+	json_free(root);
+
+	return 200;
+}
+
+struct url_table budget_urls[] = {
+	{"/status", 0, HTTPD_GET, 0, &budget_httpd_status},
+	{0, 0, 0, 0}
+};
@@ -21,9 +21,18 @@
 #include <string.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
 #include <pthread.h>
 
 #include "cache.h"
+#include "budget.h"
+#include "pool.h"
+#include "trace.h"
+#include "thread.h"
+#include "executor.h"
+#include "metrics.h"
+#include "lock.h"
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
@@ -31,10 +40,28 @@
 
 #define BUFFER_SIZE 8192
 
+/* Cache memory is a list of chunks of CHUNK_SIZE samples: a resize only
+ * changes the cache limit and never moves audio data. Released chunks are
+ * kept in a spare pool (up to CHUNK_SPARE) for next writes. New chunks are
+ * taken from the global memory budget: when it is exhausted, the cache stops
+ * growing and behaves as full until a chunk is released.
+ */
+#define CHUNK_SIZE 4096
+#define CHUNK_SPARE 4
+
+struct cache_chunk {
+	struct cache_chunk *next;
+	unsigned char data[CHUNK_SIZE * 4];
+};
+
+/* Format changes are stored in a fixed ring of FORMAT_COUNT entries: when
+ * all entries are used, writers wait for the reader to consume a format.
+ */
+#define FORMAT_COUNT 16
+
 struct cache_format {
 	struct a_format fmt;
 	unsigned long len;
-	struct cache_format *next;
 };
 
 struct cache_handle {
@@ -48,27 +75,74 @@ struct cache_handle {
 	a_write_cb output_callback;
 	void *input_user;
 	void *output_user;
-	/* Buffer handling */
-	unsigned char *buffer;
+	/* Chunk list handling: len samples are available from pos in first
+	 * chunk up to end in last chunk. Size is the cache size.
+	 */
+	struct cache_chunk *first;
+	struct cache_chunk *last;
+	struct cache_chunk *spare;
+	unsigned int spare_count;
 	unsigned long size;
 	unsigned long len;
 	unsigned long pos;
+	unsigned long end;
 	int is_ready;
+	/* Cache is ready again once this length is reached after a flush (0
+	 * to wait for a full cache) */
+	unsigned long ready_len;
 	int end_of_stream;
-	int new_size;
+	int mem_full;
+	/* An area of last chunk is written without lock (see
+	 * cache_write_reserve()): it is dropped on commit after a flush */
+	int reserved;
+	int reserve_cancel;
+	unsigned long reserve_len;
 	/* Associated format to buffer */
-	struct cache_format *fmt_first;
-	struct cache_format *fmt_last;
+	struct cache_format fmts[FORMAT_COUNT];
+	unsigned int fmt_first;
+	unsigned int fmt_count;
 	unsigned long fmt_len;
-	/* Thread objects */
+	/* Thread objects (a task is used instead of thread in task mode) */
 	pthread_t thread;
+	struct task *task;
 	pthread_mutex_t mutex;
 	pthread_mutex_t input_lock;
+	/* Thread sleeps on cond while cache is full or stream has ended and
+	 * readers wait on ready_cond until cache is ready.
+	 */
+	pthread_cond_t cond;
+	pthread_cond_t ready_cond;
 	int flush;
 	int stop;
+	/* Input buffer of thread: len samples are not copied yet */
+	unsigned char *in_buffer;
+	unsigned long in_len;
+	struct a_format in_fmt;
+	/* Latency tracing */
+	struct trace *trace;
 };
 
+/* Result of a pass of input thread */
+enum cache_input_result {
+	CACHE_INPUT_AGAIN,
+	CACHE_INPUT_LOCKED,
+	CACHE_INPUT_WAIT_READ,
+	CACHE_INPUT_WAIT_FLUSH,
+	CACHE_INPUT_SLEEP,
+	CACHE_INPUT_STOP
+};
+
+/* Audio buffered in all caches */
+static struct metric cache_metric_fill = METRIC_INIT(METRIC_GAUGE,
+	"aircat_cache_buffered_bytes", "Audio data buffered in caches");
+
+/* Lock classes of cache data and input callback */
+LOCK_CLASS(cache_class, "cache");
+LOCK_CLASS(cache_input_class, "cache_input");
+
 static void *cache_read_thread(void *user_data);
+static int cache_task(void *user_data, struct task *t);
+static struct cache_chunk *cache_chunk_get(struct cache_handle *h);
 
 int cache_open(struct cache_handle **handle, unsigned long time,
 	       unsigned long samplerate, unsigned char channels, int use_thread,
@@ -93,46 +167,73 @@ int cache_open(struct cache_handle **handle, unsigned long time,
 	h->time = time;
 	h->samplerate = samplerate;
 	h->channels = channels;
-	h->buffer = NULL;
+	h->trace = NULL;
+	h->first = NULL;
+	h->last = NULL;
+	h->spare = NULL;
+	h->spare_count = 0;
 	h->size = time * samplerate * channels / 1000;
 	h->len = 0;
 	h->pos = 0;
+	h->end = 0;
 	h->is_ready = 0;
+	h->ready_len = 0;
 	h->end_of_stream = 0;
-	h->new_size = 0;
+	h->mem_full = 0;
+	h->reserved = 0;
+	h->reserve_cancel = 0;
+	h->reserve_len = 0;
 	h->input_callback = input_callback;
 	h->output_callback = output_callback;
 	h->input_user = input_user;
 	h->output_user = output_user;
 	h->use_thread = use_thread;
+	h->task = NULL;
 	h->flush = 0;
 	h->stop = 0;
-	h->fmt_first = NULL;
-	h->fmt_last = NULL;
+	h->in_buffer = NULL;
+	h->in_len = 0;
+	h->in_fmt = (struct a_format) A_FORMAT_INIT;
+	h->fmt_first = 0;
+	h->fmt_count = 0;
 	h->fmt_len = 0;
 
-	/* Buffer must be allocated with a thread using input callback and no
+	/* Buffer must be used with a thread using input callback and no
 	 * output callback */
 	if(time == 0 && ((input_callback == NULL && output_callback == NULL) ||
 	   ((input_callback == NULL || output_callback == NULL) && use_thread)))
 		h->size = BUFFER_SIZE;
 
-	/* Allocate buffer */
-	if(h->size != 0)
+	/* Keep a first chunk in spare pool: stream is refused when memory
+	 * budget is already exhausted */
+	h->spare = cache_chunk_get(h);
+	if(h->spare == NULL)
 	{
-		h->buffer = malloc(h->size * 4);
-		if(h->buffer == NULL)
-			return -1;
+		free(h);
+		*handle = NULL;
+		return -1;
 	}
+	h->spare->next = NULL;
+	h->spare_count = 1;
 
 	/* Init thread mutex */
 	pthread_mutex_init(&h->mutex, NULL);
 	pthread_mutex_init(&h->input_lock, NULL);
+	pthread_cond_init(&h->cond, NULL);
+	pthread_cond_init(&h->ready_cond, NULL);
 
 	if(use_thread)
 	{
-		/* Create thread */
-		if(pthread_create(&h->thread, NULL, cache_read_thread, h) != 0)
+		/* Allocate input buffer */
+		h->in_buffer = pool_alloc(BUFFER_SIZE);
+		if(h->in_buffer == NULL)
+			return -1;
+
+		/* Run input on shared workers or create thread */
+		if(executor_is_enabled())
+			h->task = task_new(cache_task, h, "cache");
+		if(h->task == NULL &&
+		   pthread_create(&h->thread, NULL, cache_read_thread, h) != 0)
 			return -1;
 	}
 
@@ -147,42 +248,273 @@ unsigned long cache_get_time(struct cache_handle *h)
 		return 0;
 
 	/* Lock cache access */
-	pthread_mutex_lock(&h->mutex);
+	lock_mutex(cache_class, &h->mutex);
 
 	/* Get time */
 	time = h->time;
 
 	/* Unlock cache access */
-	pthread_mutex_unlock(&h->mutex);
+	unlock_mutex(cache_class, &h->mutex);
 
 	return time;
 }
 
+static inline void cache_signal(struct cache_handle *h)
+{
+	/* Wake up input thread or task (cache access is locked) */
+	pthread_cond_signal(&h->cond);
+	task_wake(h->task);
+}
+
+static inline void cache_set_ready(struct cache_handle *h)
+{
+	/* Wake up readers when cache becomes ready */
+	if(!h->is_ready)
+	{
+		h->is_ready = 1;
+		pthread_cond_broadcast(&h->ready_cond);
+	}
+	h->ready_len = 0;
+}
+
+static inline void cache_check_ready(struct cache_handle *h)
+{
+	/* Cache is full or early ready threshold is reached */
+	if(h->len >= h->size || h->mem_full ||
+	   (h->ready_len > 0 && h->len >= h->ready_len))
+		cache_set_ready(h);
+}
+
+static inline int cache_is_used(struct cache_handle *h)
+{
+	/* Data goes through chunks while cache has a size or remaining data */
+	return h->size > 0 || h->len > 0;
+}
+
+static struct cache_chunk *cache_chunk_get(struct cache_handle *h)
+{
+	struct cache_chunk *c;
+
+	/* Take a chunk from spare pool or allocate a new one */
+	if(h->spare != NULL)
+	{
+		c = h->spare;
+		h->spare = c->next;
+		h->spare_count--;
+	}
+	else
+	{
+		/* Memory budget is exhausted: cache is full */
+		if(budget_reserve(BUDGET_CACHE, sizeof(struct cache_chunk)) != 0)
+		{
+			h->mem_full = 1;
+			return NULL;
+		}
+
+		c = pool_alloc(sizeof(struct cache_chunk));
+		if(c == NULL)
+		{
+			budget_release(BUDGET_CACHE,
+				       sizeof(struct cache_chunk));
+			h->mem_full = 1;
+			return NULL;
+		}
+	}
+	c->next = NULL;
+
+	return c;
+}
+
+static void cache_chunk_put(struct cache_handle *h, struct cache_chunk *c)
+{
+	/* Give chunk back to spare pool or free it */
+	if(h->spare_count < CHUNK_SPARE)
+	{
+		c->next = h->spare;
+		h->spare = c;
+		h->spare_count++;
+	}
+	else
+	{
+		pool_free(c);
+		budget_release(BUDGET_CACHE, sizeof(struct cache_chunk));
+	}
+
+	/* A chunk is available again for writers */
+	h->mem_full = 0;
+}
+
+static void cache_release(struct cache_handle *h)
+{
+	struct cache_chunk *c, *kept = NULL;
+
+	/* Release all chunks but the one of a reserved area, which can be
+	 * written right now */
+	while(h->first != NULL)
+	{
+		c = h->first;
+		h->first = c->next;
+		if(h->reserved && c == h->last)
+			kept = c;
+		else
+			cache_chunk_put(h, c);
+	}
+	metric_add(&cache_metric_fill, -(int64_t) h->len * 4);
+	h->len = 0;
+
+	/* Reserved area is kept after an empty first chunk */
+	if(kept != NULL)
+	{
+		h->first = kept;
+		h->last = kept;
+		h->pos = h->end;
+		return;
+	}
+	h->last = NULL;
+	h->pos = 0;
+	h->end = 0;
+}
+
+static unsigned long cache_write_area(struct cache_handle *h,
+				      unsigned char **buffer)
+{
+	struct cache_chunk *c;
+
+	/* Append a new chunk when last one is full */
+	if(h->last == NULL || h->end == CHUNK_SIZE)
+	{
+		c = cache_chunk_get(h);
+		if(c == NULL)
+			return 0;
+		if(h->last == NULL)
+		{
+			h->first = c;
+			h->pos = 0;
+		}
+		else
+			h->last->next = c;
+		h->last = c;
+		h->end = 0;
+	}
+
+	/* Return free contiguous area of last chunk */
+	*buffer = &h->last->data[h->end*4];
+
+	return CHUNK_SIZE - h->end;
+}
+
+static inline void cache_commit(struct cache_handle *h, unsigned long len)
+{
+	/* Samples have been written in write area */
+	h->end += len;
+	h->len += len;
+	metric_add(&cache_metric_fill, len * 4);
+}
+
+static unsigned long cache_put(struct cache_handle *h,
+			       const unsigned char *buffer, unsigned long len)
+{
+	unsigned long done = 0, n;
+	unsigned char *p;
+
+	/* Copy data to chunks */
+	while(done < len)
+	{
+		n = cache_write_area(h, &p);
+		if(n == 0)
+			break;
+		if(n > len - done)
+			n = len - done;
+		memcpy(p, &buffer[done*4], n * 4);
+		cache_commit(h, n);
+		done += n;
+	}
+
+	return done;
+}
+
+static inline unsigned long cache_read_area(struct cache_handle *h,
+					    unsigned char **buffer)
+{
+	if(h->first == NULL)
+		return 0;
+
+	/* Return contiguous data of first chunk */
+	*buffer = &h->first->data[h->pos*4];
+
+	return (h->first == h->last ? h->end : CHUNK_SIZE) - h->pos;
+}
+
+static void cache_forward(struct cache_handle *h, unsigned long len)
+{
+	struct cache_chunk *c;
+	unsigned long n;
+	unsigned char *p;
+
+	while(len > 0 && (n = cache_read_area(h, &p)) > 0)
+	{
+		/* Move read position */
+		if(n > len)
+			n = len;
+		h->pos += n;
+		h->len -= n;
+		len -= n;
+		metric_add(&cache_metric_fill, -(int64_t) n * 4);
+
+		/* First chunk has been consumed */
+		if(h->pos == (h->first == h->last ? h->end : CHUNK_SIZE))
+		{
+			if(h->first == h->last)
+			{
+				cache_release(h);
+				break;
+			}
+			c = h->first;
+			h->first = c->next;
+			h->pos = 0;
+			cache_chunk_put(h, c);
+		}
+	}
+}
+
+static void cache_get(struct cache_handle *h, unsigned char *buffer,
+		      unsigned long len)
+{
+	struct cache_chunk *c = h->first;
+	unsigned long pos = h->pos;
+	unsigned long done = 0, n;
+
+	/* Copy data from chunks */
+	while(done < len && c != NULL)
+	{
+		n = (c == h->last ? h->end : CHUNK_SIZE) - pos;
+		if(n > len - done)
+			n = len - done;
+		memcpy(&buffer[done*4], &c->data[pos*4], n * 4);
+		done += n;
+		c = c->next;
+		pos = 0;
+	}
+
+	/* Release read data */
+	cache_forward(h, len);
+}
+
 static void cache_resize(struct cache_handle *h, int unset_is_ready)
 {
 	unsigned long size;
-	unsigned char *p;
 
 	/* Calculate new cache size */
 	size = h->time * h->samplerate * h->channels / 1000;
 	if(size == h->size)
 		return;
 
-	/* Check new size */
+	/* Check new size: no data is moved, chunks are added as needed */
 	if(size > h->size && size >= h->len)
 	{
-		/* Reallocate bigger buffer */
-		p = realloc(h->buffer, size*4);
-		if(p == NULL)
-			return;
-		h->buffer = p;
-
 		/* Unset is_ready */
 		if((unset_is_ready && h->len < size) || h->size == 0)
 			h->is_ready = 0;
-
-		/* Unset new lower size signal */
-		h->new_size = 0;
 	}
 	else
 	{
@@ -194,9 +526,8 @@ static void cache_resize(struct cache_handle *h, int unset_is_ready)
 		     h->use_thread)))
 			size = BUFFER_SIZE;
 
-		/* Signal new lower size */
-		h->new_size = 1;
-		h->is_ready = 1;
+		/* Remaining data above new size must be read first */
+		cache_set_ready(h);
 	}
 
 	/* Update size */
@@ -209,7 +540,7 @@ int cache_set_time(struct cache_handle *h, unsigned long time)
 		return -1;
 
 	/* Lock cache access */
-	pthread_mutex_lock(&h->mutex);
+	lock_mutex(cache_class, &h->mutex);
 
 	/* Check time */
 	if(time != h->time)
@@ -217,10 +548,13 @@ int cache_set_time(struct cache_handle *h, unsigned long time)
 		/* Change size */
 		h->time = time;
 		cache_resize(h, 1);
+
+		/* Wake up thread if it is waiting for free space */
+		cache_signal(h);
 	}
 
 	/* Unlock cache access */
-	pthread_mutex_unlock(&h->mutex);
+	unlock_mutex(cache_class, &h->mutex);
 
 	return 0;
 }
@@ -233,13 +567,13 @@ int cache_is_ready(struct cache_handle *h)
 		return 0;
 
 	/* Lock cache access */
-	pthread_mutex_lock(&h->mutex);
+	lock_mutex(cache_class, &h->mutex);
 
 	/* Check data availability in cache */
 	ret = h->is_ready;
 
 	/* Unlock cache access */
-	pthread_mutex_unlock(&h->mutex);
+	unlock_mutex(cache_class, &h->mutex);
 
 	return ret;
 }
@@ -252,42 +586,44 @@ unsigned char cache_get_filling(struct cache_handle *h)
 		return 0;
 
 	/* Lock cache access */
-	pthread_mutex_lock(&h->mutex);
+	lock_mutex(cache_class, &h->mutex);
 
 	/* Check data availability in cache */
 	if(h->is_ready)
 		percent = 100;
+	else if(h->ready_len > 0)
+		percent = h->len * 100 / h->ready_len;
 	else
 		percent = h->len * 100 / h->size;
 
 	/* Unlock cache access */
-	pthread_mutex_unlock(&h->mutex);
+	unlock_mutex(cache_class, &h->mutex);
 
 	return (unsigned char) percent;
 }
 
+static inline struct cache_format *cache_format(struct cache_handle *h,
+						unsigned int i)
+{
+	/* Get i-th entry from first format */
+	return &h->fmts[(h->fmt_first + i) % FORMAT_COUNT];
+}
+
 static int cache_put_format(struct cache_handle *h, struct a_format *fmt)
 {
 	struct cache_format *cf;
 
-	/* Allocate format entry */
-	cf = malloc(sizeof(struct cache_format));
-	if(cf == NULL)
+	/* Format ring is full */
+	if(h->fmt_count == FORMAT_COUNT)
 		return -1;
 
 	/* Copy format */
+	cf = cache_format(h, h->fmt_count);
 	format_cpy(&cf->fmt, fmt);
 
 	/* Set len before format change */
 	cf->len = h->fmt_len;
-	cf->next = NULL;
-
-	/* Add to format list */
-	if(h->fmt_last != NULL)
-		h->fmt_last->next = cf;
-	h->fmt_last = cf;
-	if(h->fmt_first == NULL)
-		h->fmt_first = cf;
+	h->fmt_count++;
 	h->fmt_len = 0;
 
 	return 0;
@@ -295,26 +631,47 @@ static int cache_put_format(struct cache_handle *h, struct a_format *fmt)
 
 static void cache_get_format(struct cache_handle *h)
 {
-	struct cache_format *cf;
-
-	if(h->fmt_first == NULL)
+	if(h->fmt_count == 0)
 		return;
 
-	/* Update list */
-	cf = h->fmt_first;
-	h->fmt_first = cf->next;
+	/* Drop first format */
+	h->fmt_first = (h->fmt_first + 1) % FORMAT_COUNT;
+	h->fmt_count--;
+}
+
+static inline int cache_need_format(struct cache_handle *h,
+				    struct a_format *fmt)
+{
+	struct a_format *last;
+
+	if(h->fmt_count == 0)
+		return 1;
+
+	/* A sample format switch is a format change, even when samplerate and
+	 * channels are not given (SAMPLE_NATIVE is the mix format)
+	 */
+	last = &cache_format(h, h->fmt_count - 1)->fmt;
+	return (fmt->samplerate != 0 || fmt->channels != 0 ||
+		format_sample(fmt->sample) != format_sample(last->sample)) &&
+	       format_cmp(fmt, last) != 0;
+}
 
-	/* Free current entry */
-	free(cf);
+static inline int cache_is_full(struct cache_handle *h, struct a_format *fmt)
+{
+	/* No space in cache, in memory budget or for a new format */
+	return h->len >= h->size || h->mem_full ||
+	       (h->fmt_count == FORMAT_COUNT &&
+		(fmt == NULL || cache_need_format(h, fmt)));
 }
 
 static void cache_update_format(struct cache_handle *h, size_t size,
 				struct a_format *fmt)
 {
-	if(h->fmt_last == NULL ||
-	   ((fmt->samplerate != 0 || fmt->channels != 0) &&
-	    format_cmp(fmt, &h->fmt_last->fmt) != 0))
-		cache_put_format(h, fmt);
+	/* Add new format: when ring is full, the data is given to last
+	 * format (writers check cache_is_full() before)
+	 */
+	if(cache_need_format(h, fmt) && cache_put_format(h, fmt) != 0)
+		format_cpy(&cache_format(h, h->fmt_count - 1)->fmt, fmt);
 	h->fmt_len += size;
 }
 
@@ -324,13 +681,15 @@ static void cache_next_format(struct cache_handle *h, size_t *size,
 	struct cache_format *next_fmt;
 
 	/* Check format list */
-	if(h->fmt_first != NULL)
+	if(h->fmt_count > 0)
 	{
 		/* Copy current format */
-		format_cpy(fmt, &h->fmt_first->fmt);
+		format_cpy(fmt, &cache_format(h, 0)->fmt);
 
-		/* Check next format */
-		next_fmt = h->fmt_first->next;
+		/* Check next format: entry stays valid in ring after
+		 * cache_get_format() since it becomes the first one
+		 */
+		next_fmt = h->fmt_count > 1 ? cache_format(h, 1) : NULL;
 		if(next_fmt != NULL)
 		{
 			if(next_fmt->len < *size)
@@ -358,57 +717,41 @@ static void cache_next_format(struct cache_handle *h, size_t *size,
 	}
 }
 
-static void cache_reduce(struct cache_handle *h)
+static inline void cache_trace(struct cache_handle *h,
+				enum trace_stage stage, size_t len)
 {
-	unsigned char *p;
+	trace_mark(h->trace, stage, len, h->samplerate, h->channels);
+}
 
-	/* Reduce buffer */
-	if(h->len <= h->size)
-	{
-		/* Zero size case */
-		if(h->size == 0)
-		{
-			/* Free buffer */
-			if(h->buffer != NULL)
-				free(h->buffer);
-			h->buffer = NULL;
-		}
-		else
-		{
-			/* Rallocate buffer */
-			p = realloc(h->buffer, h->size*4);
-			if(p == NULL)
-				return;
-			h->buffer = p;
-		}
-		h->new_size = 0;
-	}
+static inline void cache_trace_bypass(struct cache_handle *h, size_t len)
+{
+	/* Without cache, samples are written and read at same time */
+	if(h->trace == NULL || len == 0)
+		return;
+	cache_trace(h, TRACE_CACHE_WRITE, len);
+	cache_trace(h, TRACE_CACHE_READ, len);
 }
 
 static void cache_output(struct cache_handle *h)
 {
 	struct a_format out_fmt = A_FORMAT_INIT;
+	unsigned char *p = NULL;
 	size_t size;
 
-	if(h->buffer != NULL && h->output_callback != NULL && h->is_ready)
+	if(cache_is_used(h) && h->output_callback != NULL && h->is_ready)
 	{
-		/* Set size to buffer size */
-		size = h->len;
+		/* Set size to contiguous data in first chunk */
+		size = cache_read_area(h, &p);
 
 		/* Check format list */
 		cache_next_format(h, &size, &out_fmt);
 
 		/* Send data */
-		size = h->output_callback(h->output_user, h->buffer, size,
-					  &out_fmt);
+		size = h->output_callback(h->output_user, p, size, &out_fmt);
 		if(size > 0)
 		{
-			h->len -= size;
-			memmove(h->buffer, &h->buffer[size*4], h->size*4);
-
-			/* Reduce buffer to new size */
-			if(h->new_size)
-				cache_reduce(h);
+			cache_forward(h, size);
+			cache_trace(h, TRACE_CACHE_READ, size);
 		}
 
 		/* No more data is available */
@@ -417,170 +760,327 @@ static void cache_output(struct cache_handle *h)
 	}
 }
 
-static void *cache_read_thread(void *user_data)
+static int cache_must_wait(struct cache_handle *h, int end_of_stream)
+{
+	/* Sleep until a read, a flush or close (cache access is locked) */
+	return !h->stop && !h->flush &&
+	       (end_of_stream ? h->end_of_stream : cache_is_full(h, NULL));
+}
+
+static void cache_wait(struct cache_handle *h, int end_of_stream)
+{
+	/* Lock cache access */
+	lock_mutex(cache_class, &h->mutex);
+
+	/* Sleep until a read, a flush or close */
+	if(cache_must_wait(h, end_of_stream))
+		lock_cond_wait(cache_class, &h->cond, &h->mutex);
+
+	/* Unlock cache access */
+	unlock_mutex(cache_class, &h->mutex);
+}
+
+static int cache_input_direct(struct cache_handle *h)
 {
-	struct cache_handle *h = (struct cache_handle *) user_data;
-	struct a_format in_fmt = A_FORMAT_INIT;
-	unsigned char *buffer = NULL;
-	unsigned long in_size = 0;
 	unsigned long len = 0;
+	unsigned char *p;
+	int ret;
+
+	/* Lock cache access */
+	lock_mutex(cache_class, &h->mutex);
+
+	/* Reserve a contiguous area of whole frames in cache memory */
+	if(!cache_is_full(h, &h->in_fmt))
+	{
+		len = cache_write_area(h, &p);
+		if(len > h->size - h->len)
+			len = h->size - h->len;
+		if(len > BUFFER_SIZE / 4)
+			len = BUFFER_SIZE / 4;
+		len -= len % h->channels;
+	}
+	h->reserved = len > 0;
+
+	/* Unlock cache access */
+	unlock_mutex(cache_class, &h->mutex);
+
+	/* Cache is full: use input buffer */
+	if(len == 0)
+		return -2;
+
+	/* Read next packet from input callback directly in cache memory */
+	ret = h->input_callback(h->input_user, p, len, &h->in_fmt);
+
+	/* Lock cache access */
+	lock_mutex(cache_class, &h->mutex);
+	h->reserved = 0;
+
+	/* Commit samples: with a new format and no free format entry, they
+	 * wait in input buffer */
+	if(ret > 0 && cache_is_full(h, &h->in_fmt))
+	{
+		memcpy(h->in_buffer, p, ret * 4);
+		h->in_len = ret;
+	}
+	else if(ret > 0)
+	{
+		cache_commit(h, ret);
+		cache_trace(h, TRACE_CACHE_WRITE, ret);
+		cache_update_format(h, ret, &h->in_fmt);
+		cache_check_ready(h);
+	}
+
+	/* Unlock cache access */
+	unlock_mutex(cache_class, &h->mutex);
+
+	return ret;
+}
+
+static int cache_input(struct cache_handle *h, int blocking)
+{
+	unsigned char *buffer = h->in_buffer;
+	unsigned long in_size = 0;
 	ssize_t size;
 	int ret = 0;
+	int eos = 0;
 
-	/* Allocate buffer */
-	if(h->input_callback != NULL)
+	/* Lock input callback (a task never blocks on it: it is woken by
+	 * cache_unlock()) */
+	if(blocking)
+		cache_lock(h);
+	else if(trylock_mutex(cache_input_class, &h->input_lock) != 0)
+		return CACHE_INPUT_LOCKED;
+
+	/* Check stop */
+	if(h->stop)
 	{
-		buffer = malloc(BUFFER_SIZE);
-		if(buffer == NULL)
-			return NULL;
+		/* Unlock cache */
+		unlock_mutex(cache_input_class, &h->input_lock);
+		return CACHE_INPUT_STOP;
 	}
 
-	/* Read indefinitively the input callback */
-	while(!h->stop)
+	/* No cache */
+	if(!cache_is_used(h))
 	{
-		/* Lock input callback */
-		cache_lock(h);
+		if(h->input_callback == NULL || h->output_callback == NULL)
+		{
+			unlock_mutex(cache_input_class, &h->input_lock);
+			return CACHE_INPUT_STOP;
+		}
 
-		/* Check stop */
-		if(h->stop)
+		/* Get data */
+		if(h->in_len == 0)
 		{
-			/* Unlock cache */
-			cache_unlock(h);
-			break;
+			h->in_len = h->input_callback(h->input_user, buffer,
+						      BUFFER_SIZE / 4,
+						      &h->in_fmt);
 		}
 
-		/* No cache */
-		if(h->buffer == NULL)
+		/* Copy data */
+		if(h->in_len > 0)
 		{
-			if(h->input_callback == NULL ||
-			   h->output_callback == NULL)
-				return NULL;
+			size = h->output_callback(h->output_user, buffer,
+						  h->in_len, &h->in_fmt);
+			if(size > 0)
+				cache_trace_bypass(h, size);
+
+			/* Move unused data */
+			h->in_len -= size;
+			memmove(buffer, &buffer[size*4], h->in_len * 4);
+		}
 
-			/* Get data */
-			if(len == 0)
-			{
-				len = h->input_callback(h->input_user, buffer,
-							BUFFER_SIZE / 4,
-							&in_fmt);
-			}
+		/* Unlock cache */
+		unlock_mutex(cache_input_class, &h->input_lock);
 
-			/* Copy data */
-			if(len > 0)
-			{
-				size = h->output_callback(h->output_user,
-							  buffer, len, &in_fmt);
+		return CACHE_INPUT_AGAIN;
+	}
 
-				/* Move unused data */
-				len -= size;
-				memmove(buffer, &buffer[size*4], len * 4);
-			}
+	if(h->input_callback == NULL)
+		goto flush;
 
-			/* Unlock cache */
-			cache_unlock(h);
+	/* Flush this buffer */
+	if(h->flush)
+	{
+		h->flush = 0;
+		h->in_len = 0;
+	}
 
-			continue;
+	/* Read next packet directly in cache memory: input buffer is only used
+	 * when cache is full, which saves a copy of each sample */
+	if(h->in_len == 0)
+	{
+		ret = cache_input_direct(h);
+		if(ret == -1)
+		{
+			eos = 1;
+			goto copy;
 		}
-
-		if(h->input_callback == NULL)
-			goto flush;
-
-		/* Flush this buffer */
-		if(h->flush)
+		else if(ret >= 0)
 		{
-			h->flush = 0;
-			len = 0;
+			h->end_of_stream = 0;
+			goto copy;
 		}
+		ret = 0;
+	}
 
-		/* Check buffer len */
-		if(len < BUFFER_SIZE / 4)
+	/* Check buffer len */
+	if(h->in_len < BUFFER_SIZE / 4)
+	{
+		/* Read next packet from input callback */
+		ret = h->input_callback(h->input_user, &buffer[h->in_len*4],
+					(BUFFER_SIZE / 4) - h->in_len,
+					&h->in_fmt);
+		if(ret < 0)
 		{
-			/* Read next packet from input callback */
-			ret = h->input_callback(h->input_user, &buffer[len*4],
-						(BUFFER_SIZE / 4) - len,
-						&in_fmt);
-			if(ret < 0)
-			{
-				h->is_ready = 1;
-				h->end_of_stream = 1;
-				usleep(10000);
-				goto copy;
-			}
-			h->end_of_stream = 0;
-			len += ret;
+			eos = 1;
+			goto copy;
 		}
+		h->end_of_stream = 0;
+		h->in_len += ret;
+	}
 
 copy:
-		/* Lock cache access */
-		pthread_mutex_lock(&h->mutex);
+	/* Lock cache access */
+	lock_mutex(cache_class, &h->mutex);
 
-		/* No data to copy: jump to flush */
-		if(len == 0 || h->len > h->size)
-			goto flush;
+	/* End of stream: remaining data can be read */
+	if(eos)
+	{
+		h->end_of_stream = 1;
+		cache_set_ready(h);
+	}
 
-		/* Copy data to cache */
-		in_size = h->size - h->len;
-		if(in_size > len)
-			in_size = len;
-		memcpy(&h->buffer[h->len*4], buffer, in_size * 4);
-		h->len += in_size;
-		len -= in_size;
+	/* No data to copy: jump to flush */
+	if(h->in_len == 0 || cache_is_full(h, &h->in_fmt))
+		goto flush;
 
-		/* Update format list */
-		cache_update_format(h, in_size, &in_fmt);
+	/* Copy data to cache */
+	in_size = h->size - h->len;
+	if(in_size > h->in_len)
+		in_size = h->in_len;
+	in_size = cache_put(h, buffer, in_size);
+	cache_trace(h, TRACE_CACHE_WRITE, in_size);
+	h->in_len -= in_size;
 
-		/* Cache is full */
-		if(h->len == h->size)
-			h->is_ready = 1;
+	/* Update format list */
+	cache_update_format(h, in_size, &h->in_fmt);
+
+	/* Cache is full */
+	cache_check_ready(h);
 
 flush:
-		/* Send data if output callback is available */
-		cache_output(h);
+	/* Send data if output callback is available */
+	cache_output(h);
 
-		/* Unlock cache access */
-		pthread_mutex_unlock(&h->mutex);
+	/* Unlock cache access */
+	unlock_mutex(cache_class, &h->mutex);
 
-		/* Move remaining data*/
-		if(len > 0)
-			memmove(buffer, &buffer[in_size*4], len * 4);
+	/* Move remaining data*/
+	if(h->in_len > 0)
+		memmove(buffer, &buffer[in_size*4], h->in_len * 4);
 
-		/* Unlock cache */
-		cache_unlock(h);
+	/* Unlock cache */
+	unlock_mutex(cache_input_class, &h->input_lock);
 
-		/* Buffer is already fill: sleep 10ms */
-		if(len >= BUFFER_SIZE / 4)
-			usleep(10000);
-	}
+	/* End of stream: sleep until a flush */
+	if(eos)
+		return CACHE_INPUT_WAIT_FLUSH;
+
+	/* Buffer is already fill: sleep until a read when data is consumed by
+	 * reader, or 10ms when it is pushed to output callback */
+	if(h->in_len >= BUFFER_SIZE / 4)
+		return h->output_callback == NULL ? CACHE_INPUT_WAIT_READ :
+						    CACHE_INPUT_SLEEP;
 
-	/* Free buffer */
-	if(buffer != NULL)
-		free(buffer);
+	return CACHE_INPUT_AGAIN;
+}
+
+static void *cache_read_thread(void *user_data)
+{
+	struct cache_handle *h = (struct cache_handle *) user_data;
+
+	/* Set thread scheduling and name */
+	thread_setup(THREAD_CACHE, "cache");
+
+	/* Read indefinitively the input callback */
+	while(!h->stop)
+	{
+		switch(cache_input(h, 1))
+		{
+			case CACHE_INPUT_STOP:
+				return NULL;
+			case CACHE_INPUT_WAIT_FLUSH:
+				cache_wait(h, 1);
+				break;
+			case CACHE_INPUT_WAIT_READ:
+				cache_wait(h, 0);
+				break;
+			case CACHE_INPUT_SLEEP:
+				usleep(10000);
+				break;
+			default:
+				break;
+		}
+	}
 
 	return NULL;
 }
 
+static int cache_task(void *user_data, struct task *t)
+{
+	struct cache_handle *h = (struct cache_handle *) user_data;
+	int ret;
+
+	/* Same pass as thread but waits park the task: it is woken by a read,
+	 * a flush, an unlock or close */
+	ret = cache_input(h, 0);
+	switch(ret)
+	{
+		case CACHE_INPUT_STOP:
+			return TASK_DONE;
+		case CACHE_INPUT_LOCKED:
+			return TASK_WAIT;
+		case CACHE_INPUT_WAIT_FLUSH:
+		case CACHE_INPUT_WAIT_READ:
+			lock_mutex(cache_class, &h->mutex);
+			ret = cache_must_wait(h, ret == CACHE_INPUT_WAIT_FLUSH);
+			unlock_mutex(cache_class, &h->mutex);
+			return ret ? TASK_WAIT : TASK_AGAIN;
+		case CACHE_INPUT_SLEEP:
+			task_timeout(t, 10);
+			return TASK_WAIT;
+		default:
+			return h->stop ? TASK_DONE : TASK_AGAIN;
+	}
+}
+
 int cache_read(void *user_data, unsigned char *buffer, size_t size,
 	       struct a_format *fmt)
 {
 	struct cache_handle *h = (struct cache_handle *) user_data;
 	struct a_format in_fmt = A_FORMAT_INIT;
-	unsigned long in_size;
+	unsigned long in_size, pos;
+	unsigned char *p;
 	long len;
 
 	if(h == NULL || h->output_callback != NULL)
 		return -1;
 
 	/* No cache */
-	if(h->buffer == NULL)
+	if(!cache_is_used(h))
 	{
 		if(h->input_callback == NULL)
 			return -1;
 
 		/* Copy data */
-		return h->input_callback(h->input_user, buffer, size, fmt);
+		len = h->input_callback(h->input_user, buffer, size, fmt);
+		if(len > 0)
+			cache_trace_bypass(h, len);
+		return len;
 	}
 
 	/* Lock cache access */
-	pthread_mutex_lock(&h->mutex);
+	lock_mutex(cache_class, &h->mutex);
 
 	/* Check data availability in cache */
 	if(h->is_ready)
@@ -593,13 +1093,12 @@ int cache_read(void *user_data, unsigned char *buffer, size_t size,
 		cache_next_format(h, &size, fmt);
 
 		/* Read in cache */
-		memcpy(buffer, h->buffer, size*4);
-		h->len -= size;
-		memmove(h->buffer, &h->buffer[size*4], h->len*4);
+		cache_get(h, buffer, size);
+		cache_trace(h, TRACE_CACHE_READ, size);
 
-		/* Reduce buffer to new size */
-		if(h->new_size)
-			cache_reduce(h);
+		/* Some space is available for thread */
+		if(h->use_thread)
+			cache_signal(h);
 
 		/* No more data is available */
 		if(h->len == 0)
@@ -617,23 +1116,33 @@ int cache_read(void *user_data, unsigned char *buffer, size_t size,
 	}
 
 	/* Unlock cache access */
-	pthread_mutex_unlock(&h->mutex);
+	unlock_mutex(cache_class, &h->mutex);
 
 	/* Check cache status */
 	if(h->input_callback != NULL && !h->use_thread && h->len < h->size)
 	{
 		/* Check input callback access */
-		if(pthread_mutex_trylock(&h->input_lock) != 0)
+		if(trylock_mutex(cache_input_class, &h->input_lock) != 0)
 			return size;
 
-		/* Fill cache with some samples */
+		/* Fill cache with some samples: up to end of last chunk */
 		in_size = h->size - h->len;
-		len = h->input_callback(h->input_user, &h->buffer[h->len*4],
-					in_size, &in_fmt);
+		pos = cache_write_area(h, &p);
+		if(pos == 0)
+		{
+			/* Out of memory: play what is already cached */
+			if(h->len > 0)
+				cache_set_ready(h);
+			cache_unlock(h);
+			return size;
+		}
+		if(in_size > pos)
+			in_size = pos;
+		len = h->input_callback(h->input_user, p, in_size, &in_fmt);
 		if(len < 0)
 		{
 			/* End of stream */
-			h->is_ready = 1;
+			cache_set_ready(h);
 
 			/* No more data available */
 			if(h->len == 0)
@@ -644,14 +1153,14 @@ int cache_read(void *user_data, unsigned char *buffer, size_t size,
 
 			return size;
 		}
-		h->len += len;
+		cache_commit(h, len);
+		cache_trace(h, TRACE_CACHE_WRITE, len);
 
 		/* Update format list */
 		cache_update_format(h, len, &in_fmt);
 
 		/* Cache is full */
-		if(h->len >= h->size)
-			h->is_ready = 1;
+		cache_check_ready(h);
 
 		/* Unlock input callback access */
 		cache_unlock(h);
@@ -660,6 +1169,47 @@ int cache_read(void *user_data, unsigned char *buffer, size_t size,
 	return size;
 }
 
+int cache_read_timeout(void *user_data, unsigned char *buffer, size_t size,
+		       struct a_format *fmt, unsigned long timeout)
+{
+	struct cache_handle *h = (struct cache_handle *) user_data;
+	struct timespec ts;
+
+	if(h == NULL || h->output_callback != NULL)
+		return -1;
+
+	/* Wait for cache when it is filled by another thread */
+	if(cache_is_used(h) && timeout > 0 &&
+	   (h->use_thread || h->input_callback == NULL))
+	{
+		/* Calculate end of wait */
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += timeout / 1000;
+		ts.tv_nsec += (timeout % 1000) * 1000000L;
+		if(ts.tv_nsec >= 1000000000L)
+		{
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+
+		/* Lock cache access */
+		lock_mutex(cache_class, &h->mutex);
+
+		/* Wait until cache is ready */
+		while(!h->is_ready && !h->stop)
+		{
+			if(lock_cond_timedwait(cache_class, &h->ready_cond,
+					       &h->mutex, &ts) == ETIMEDOUT)
+				break;
+		}
+
+		/* Unlock cache access */
+		unlock_mutex(cache_class, &h->mutex);
+	}
+
+	return cache_read(h, buffer, size, fmt);
+}
+
 ssize_t cache_write(void *user_data, const unsigned char *buffer, size_t size,
 		    struct a_format *fmt)
 {
@@ -670,35 +1220,37 @@ ssize_t cache_write(void *user_data, const unsigned char *buffer, size_t size,
 		return -1;
 
 	/* No cache */
-	if(h->buffer == NULL)
+	if(!cache_is_used(h))
 	{
 		if(h->output_callback == NULL)
 			return -1;
 
 		/* Copy data */
-		return h->output_callback(h->output_user, buffer, size, fmt);
+		size = h->output_callback(h->output_user, buffer, size, fmt);
+		if((ssize_t) size > 0)
+			cache_trace_bypass(h, size);
+		return size;
 	}
 
 	/* Lock cache access */
-	pthread_mutex_lock(&h->mutex);
+	lock_mutex(cache_class, &h->mutex);
 
 	/* Calculate size to write in cache */
-	in_size = h->size - h->len;
+	in_size = cache_is_full(h, fmt) ? 0 : h->size - h->len;
 	if(size > in_size)
 		size = in_size;
 	if(size == 0)
 		goto end;
 
 	/* Copy data to buffer */
-	memcpy(&h->buffer[h->len*4], buffer, size * 4);
-	h->len += size;
+	size = cache_put(h, buffer, size);
+	cache_trace(h, TRACE_CACHE_WRITE, size);
 
 	/* Update format list */
 	cache_update_format(h, size, fmt);
 
 	/* Cache is full */
-	if(h->len == h->size)
-		h->is_ready = 1;
+	cache_check_ready(h);
 
 end:
 	/* Send data if output callback is available */
@@ -706,15 +1258,100 @@ end:
 		cache_output(h);
 
 	/* Unlock cache access */
-	pthread_mutex_unlock(&h->mutex);
+	unlock_mutex(cache_class, &h->mutex);
+
+	return size;
+}
+
+ssize_t cache_write_reserve(struct cache_handle *h, size_t size,
+			    unsigned char **buffer)
+{
+	unsigned long len = 0;
+
+	if(h == NULL || buffer == NULL || h->input_callback != NULL ||
+	   !cache_is_used(h))
+		return -1;
+
+	/* Lock cache access */
+	lock_mutex(cache_class, &h->mutex);
+
+	/* Get free contiguous area in last chunk */
+	if(!h->reserved && !cache_is_full(h, NULL))
+	{
+		len = cache_write_area(h, buffer);
+		if(len > h->size - h->len)
+			len = h->size - h->len;
+		if(len > size)
+			len = size;
+	}
+
+	/* Area is written without lock until commit */
+	if(len > 0)
+	{
+		h->reserved = 1;
+		h->reserve_cancel = 0;
+		h->reserve_len = len;
+	}
+
+	/* Unlock cache access */
+	unlock_mutex(cache_class, &h->mutex);
+
+	return len;
+}
+
+ssize_t cache_write_commit(struct cache_handle *h, size_t size,
+			   struct a_format *fmt)
+{
+	if(h == NULL || fmt == NULL)
+		return -1;
+
+	/* Lock cache access */
+	lock_mutex(cache_class, &h->mutex);
+
+	/* No area has been reserved */
+	if(!h->reserved)
+	{
+		unlock_mutex(cache_class, &h->mutex);
+		return -1;
+	}
+	h->reserved = 0;
+
+	/* Samples written before a flush are dropped */
+	if(h->reserve_cancel)
+		size = 0;
+	else if(size > h->reserve_len)
+		size = h->reserve_len;
+
+	/* Add samples to cache */
+	if(size > 0)
+	{
+		cache_commit(h, size);
+		cache_trace(h, TRACE_CACHE_WRITE, size);
+
+		/* Update format list */
+		cache_update_format(h, size, fmt);
+
+		/* Cache is full */
+		cache_check_ready(h);
+	}
+
+	/* Send data if output callback is available */
+	if(!h->use_thread)
+		cache_output(h);
+
+	/* Unlock cache access */
+	unlock_mutex(cache_class, &h->mutex);
 
 	return size;
 }
 
 void cache_flush(struct cache_handle *h)
 {
-	struct cache_format *cf;
+	cache_flush_ready(h, 0);
+}
 
+void cache_flush_ready(struct cache_handle *h, unsigned long time)
+{
 	if(h == NULL)
 		return;
 
@@ -722,32 +1359,107 @@ void cache_flush(struct cache_handle *h)
 	cache_lock(h);
 
 	/* Lock cache access */
-	pthread_mutex_lock(&h->mutex);
+	lock_mutex(cache_class, &h->mutex);
 
-	/* Flush the cache */
+	/* Flush the cache: a reserved area is dropped on commit */
 	h->end_of_stream = 0;
 	h->is_ready = 0;
-	h->len = 0;
+	h->reserve_cancel = h->reserved;
+	cache_release(h);
+
+	/* Set early ready threshold */
+	h->ready_len = time * h->samplerate * h->channels / 1000;
+	if(h->ready_len >= h->size)
+		h->ready_len = 0;
 
 	/* Flush format list */
-	while(h->fmt_first != NULL)
+	h->fmt_first = 0;
+	h->fmt_count = 0;
+
+	/* Notice flush to thread */
+	if(h->use_thread)
 	{
-		cf = h->fmt_first;
-		h->fmt_first = cf->next;
-		free(cf);
+		h->flush = 1;
+		cache_signal(h);
 	}
-	h->fmt_last = NULL;
+
+	/* Unlock cache access */
+	unlock_mutex(cache_class, &h->mutex);
+}
+
+int cache_set_format(struct cache_handle *h, unsigned long samplerate,
+		     unsigned char channels, void *input_user,
+		     unsigned long ready)
+{
+	if(h == NULL || samplerate == 0 || channels == 0)
+		return -1;
+
+	/* Lock input callback */
+	cache_lock(h);
+
+	return cache_set_format_locked(h, samplerate, channels, input_user,
+				       ready);
+}
+
+int cache_set_format_locked(struct cache_handle *h, unsigned long samplerate,
+			    unsigned char channels, void *input_user,
+			    unsigned long ready)
+{
+	if(h == NULL || samplerate == 0 || channels == 0)
+		return -1;
+
+	/* Lock cache access */
+	lock_mutex(cache_class, &h->mutex);
+
+	/* Flush the cache: buffered data and a reserved area are in previous
+	 * format */
+	h->end_of_stream = 0;
+	h->reserve_cancel = h->reserved;
+	cache_release(h);
+	h->fmt_first = 0;
+	h->fmt_count = 0;
+	h->fmt_len = 0;
+
+	/* Set new format and input */
+	h->samplerate = samplerate;
+	h->channels = channels;
+	if(h->input_callback != NULL)
+		h->input_user = input_user;
+
+	/* Update size for new format */
+	cache_resize(h, 1);
+	h->is_ready = 0;
+
+	/* Set early ready threshold */
+	h->ready_len = ready * h->samplerate * h->channels / 1000;
+	if(h->ready_len >= h->size)
+		h->ready_len = 0;
 
 	/* Notice flush to thread */
 	if(h->use_thread)
+	{
 		h->flush = 1;
+		cache_signal(h);
+	}
+
+	/* Unlock cache access */
+	unlock_mutex(cache_class, &h->mutex);
+
+	return 0;
+}
+
+void cache_set_trace(struct cache_handle *h, struct trace *trace)
+{
+	if(h == NULL)
+		return;
 
-	/* Reduce buffer */
-	if(h->new_size)
-		cache_reduce(h);
+	/* Lock cache access */
+	lock_mutex(cache_class, &h->mutex);
+
+	h->trace = trace;
 
 	/* Unlock cache access */
-	pthread_mutex_unlock(&h->mutex);
+	unlock_mutex(cache_class, &h->mutex);
 }
 
 void cache_lock(struct cache_handle *h)
@@ -756,7 +1468,7 @@ void cache_lock(struct cache_handle *h)
 		return;
 
 	/* Lock input callback access */
-	pthread_mutex_lock(&h->input_lock);
+	lock_mutex(cache_input_class, &h->input_lock);
 }
 
 void cache_unlock(struct cache_handle *h)
@@ -765,7 +1477,10 @@ void cache_unlock(struct cache_handle *h)
 		return;
 
 	/* Unlock input callback access */
-	pthread_mutex_unlock(&h->input_lock);
+	unlock_mutex(cache_input_class, &h->input_lock);
+
+	/* Wake up input task waiting for the lock */
+	task_wake(h->task);
 }
 
 unsigned long cache_delay(struct cache_handle *h)
@@ -774,29 +1489,29 @@ unsigned long cache_delay(struct cache_handle *h)
 	unsigned long samplerate;
 	unsigned char channels;
 	uint64_t delay = 0;
+	unsigned int i;
 
 	if(h == NULL)
 		return 0;
 
 	/* Lock cache access */
-	pthread_mutex_lock(&h->mutex);
+	lock_mutex(cache_class, &h->mutex);
 
 	/* Check format list */
-	if(h->fmt_first != NULL)
+	if(h->fmt_count > 0)
 	{
 		samplerate = h->samplerate;
 		channels = h->channels;
 		/* Parse all format list */
-		fmt = h->fmt_first->next;
-		while(fmt != NULL)
+		for(i = 1; i < h->fmt_count; i++)
 		{
+			fmt = cache_format(h, i);
 			delay += ((uint64_t)fmt->len) * 1000 / samplerate /
 				 channels;
 			if(fmt->fmt.samplerate != 0)
 				samplerate = fmt->fmt.samplerate;
 			if(fmt->fmt.channels != 0)
 				channels = fmt->fmt.channels;
-			fmt = fmt->next;
 		}
 		delay += ((uint64_t)h->fmt_len) * 1000 / samplerate / channels;
 	}
@@ -805,40 +1520,45 @@ unsigned long cache_delay(struct cache_handle *h)
 			h->channels;
 
 	/* Unlock cache access */
-	pthread_mutex_unlock(&h->mutex);
+	unlock_mutex(cache_class, &h->mutex);
 
 	return delay;
 }
 
 int cache_close(struct cache_handle *h)
 {
-	struct cache_format *cf;
+	struct cache_chunk *c;
 
 	if(h == NULL)
 		return 0;
 
 	/* Stop thread */
+	lock_mutex(cache_class, &h->mutex);
 	h->stop = 1;
+	cache_signal(h);
+	pthread_cond_broadcast(&h->ready_cond);
+	unlock_mutex(cache_class, &h->mutex);
 
 	/* Unlock input callback */
 	cache_unlock(h);
 
 	/* Wait end of the thread */
-	if(h->use_thread)
+	if(h->task != NULL)
+		task_join(h->task);
+	else if(h->use_thread)
 		pthread_join(h->thread, NULL);
+	pool_free(h->in_buffer);
 
-	/* Free format list */
-	while(h->fmt_first != NULL)
+	/* Free chunks and spare pool */
+	cache_release(h);
+	while(h->spare != NULL)
 	{
-		cf = h->fmt_first;
-		h->fmt_first = cf->next;
-		free(cf);
+		c = h->spare;
+		h->spare = c->next;
+		pool_free(c);
+		budget_release(BUDGET_CACHE, sizeof(struct cache_chunk));
 	}
 
-	/* Free buffer */
-	if(h->buffer != NULL)
-		free(h->buffer);
-
 	/* Free structure */
 	free(h);
 
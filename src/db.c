@@ -28,18 +28,198 @@
 #include <sqlite3.h>
 
 #include "db.h"
+#include "metrics.h"
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
 
+/* Time spent in queries */
+static struct metric db_metric_time = METRIC_INIT(METRIC_HISTOGRAM,
+	"aircat_db_query_seconds", "Duration of a database query step");
+
+/* Default connection settings:
+ *    DB_JOURNAL_MODE = journal mode (WAL lets readers run during writes),
+ *    DB_SYNCHRONOUS = synchronous mode (NORMAL is safe with WAL),
+ *    DB_CACHE_SIZE = page cache size in KiB,
+ *    DB_MMAP_SIZE = memory mapped I/O size in MiB (0 to disable),
+ *    DB_STATEMENTS = prepared statements kept per database.
+ */
+#define DB_JOURNAL_MODE "wal"
+#define DB_SYNCHRONOUS "normal"
+#define DB_CACHE_SIZE 2048
+#define DB_MMAP_SIZE 0
+#define DB_STATEMENTS 16
+
+struct db_query {
+	/* Sqlite statement */
+	sqlite3_stmt *stmt;
+	/* SQL text (only for cached statements) */
+	char *sql;
+	size_t len;
+	/* Cache state */
+	int in_use;
+	unsigned long last_use;
+	struct db_query *next;
+	/* Parent database */
+	struct db_handle *handle;
+};
+
 struct db_handle {
 	/* Database name and file path */
 	char *file;
 	char *name;
 	/* Sqlite database handle */
 	sqlite3 *db;
+	/* Prepared statement cache */
+	struct db_query *queries;
+	unsigned int query_count;
+	unsigned long query_tick;
+	pthread_mutex_t mutex;
+};
+
+/* Connection configuration */
+static pthread_mutex_t db_config_mutex = PTHREAD_MUTEX_INITIALIZER;
+static const char *db_journal_mode = DB_JOURNAL_MODE;
+static const char *db_synchronous = DB_SYNCHRONOUS;
+static int db_cache_size = DB_CACHE_SIZE;
+static int db_mmap_size = DB_MMAP_SIZE;
+static int db_statements = DB_STATEMENTS;
+
+static const char *db_journal_modes[] = {
+	"delete", "truncate", "persist", "memory", "wal", "off", NULL
 };
+static const char *db_synchronous_modes[] = {
+	"off", "normal", "full", "extra", NULL
+};
+
+static const char *db_find_mode(const char **modes, const char *mode,
+				const char *def)
+{
+	int i;
+
+	if(mode == NULL)
+		return def;
+
+	/* Only accept known modes (value is used to build SQL) */
+	for(i = 0; modes[i] != NULL; i++)
+	{
+		if(strcasecmp(modes[i], mode) == 0)
+			return modes[i];
+	}
+
+	return def;
+}
+
+int db_set_config(struct json *cfg)
+{
+	/* Lock configuration */
+	pthread_mutex_lock(&db_config_mutex);
+
+	/* Get modes */
+	db_journal_mode = db_find_mode(db_journal_modes,
+				       json_get_string(cfg, "journal_mode"),
+				       DB_JOURNAL_MODE);
+	db_synchronous = db_find_mode(db_synchronous_modes,
+				      json_get_string(cfg, "synchronous"),
+				      DB_SYNCHRONOUS);
+
+	/* Get page cache size in KiB */
+	db_cache_size = json_get_int(cfg, "cache_size");
+	if(db_cache_size <= 0)
+		db_cache_size = DB_CACHE_SIZE;
+
+	/* Get memory mapped I/O size in MiB */
+	db_mmap_size = json_get_int(cfg, "mmap_size");
+	if(db_mmap_size < 0)
+		db_mmap_size = 0;
+
+	/* Get prepared statement count (0 disables caching) */
+	db_statements = json_has_key(cfg, "statements") ?
+					 json_get_int(cfg, "statements") :
+					 DB_STATEMENTS;
+	if(db_statements < 0)
+		db_statements = 0;
+
+	/* Unlock configuration */
+	pthread_mutex_unlock(&db_config_mutex);
+
+	return 0;
+}
+
+struct json *db_get_config(void)
+{
+	struct json *cfg;
+
+	/* Create a new object */
+	cfg = json_new();
+	if(cfg == NULL)
+		return NULL;
+
+	/* Lock configuration */
+	pthread_mutex_lock(&db_config_mutex);
+
+	/* Set connection settings */
+	json_set_string(cfg, "journal_mode", db_journal_mode);
+	json_set_string(cfg, "synchronous", db_synchronous);
+	json_set_int(cfg, "cache_size", db_cache_size);
+	json_set_int(cfg, "mmap_size", db_mmap_size);
+	json_set_int(cfg, "statements", db_statements);
+
+	/* Unlock configuration */
+	pthread_mutex_unlock(&db_config_mutex);
+
+	return cfg;
+}
+
+static int db_connect(struct db_handle *h)
+{
+	char sql[256];
+	sqlite3 *db;
+
+	/* Already opened */
+	if(__atomic_load_n(&h->db, __ATOMIC_ACQUIRE) != NULL)
+		return 0;
+
+	/* Lock database opening */
+	pthread_mutex_lock(&h->mutex);
+	if(h->db != NULL)
+	{
+		pthread_mutex_unlock(&h->mutex);
+		return 0;
+	}
+
+	/* Open database (handle is published only once configured) */
+	if(sqlite3_open(h->file, &db) != SQLITE_OK)
+	{
+		sqlite3_close(db);
+		pthread_mutex_unlock(&h->mutex);
+		return -1;
+	}
+
+	/* Generate connection settings */
+	pthread_mutex_lock(&db_config_mutex);
+	snprintf(sql, sizeof(sql), "PRAGMA journal_mode=%s;"
+				   "PRAGMA synchronous=%s;"
+				   "PRAGMA cache_size=-%d;"
+				   "PRAGMA mmap_size=%lld;",
+		 db_journal_mode, db_synchronous, db_cache_size,
+		 (long long) db_mmap_size * 1024 * 1024);
+	pthread_mutex_unlock(&db_config_mutex);
+
+	/* Apply settings (failure is not fatal) */
+	if(sqlite3_exec(db, sql, NULL, NULL, NULL) != SQLITE_OK)
+		fprintf(stderr, "[db] failed to configure %s: %s\n", h->name,
+			sqlite3_errmsg(db));
+
+	/* Publish configured connection to lock-free readers */
+	__atomic_store_n(&h->db, db, __ATOMIC_RELEASE);
+
+	/* Unlock database opening */
+	pthread_mutex_unlock(&h->mutex);
+
+	return 0;
+}
 
 int db_open(struct db_handle **handle, const char *path, const char *name)
 {
@@ -59,18 +239,25 @@ int db_open(struct db_handle **handle, const char *path, const char *name)
 	h->name = strdup(name);
 	h->file = NULL;
 	h->db = NULL;
+	h->queries = NULL;
+	h->query_count = 0;
+	h->query_tick = 0;
+	pthread_mutex_init(&h->mutex, NULL);
 
 	/* Generate complete file path */
 	if(asprintf(&h->file, "%s/%s.db", path == NULL ? "." : path, h->name)
 	    < 0)
+	{
+		h->file = NULL;
 		return -1;
+	}
 
 	/* Check if file exists */
 	if(access(h->file, R_OK | W_OK) != 0)
 		return 0;
 
 	/* Open database */
-	return sqlite3_open(h->file, &h->db);
+	return db_connect(h);
 }
 
 const char *db_get_name(struct db_handle *h)
@@ -87,7 +274,7 @@ void *db_get_db(struct db_handle *h)
 		return NULL;
 
 	/* Open database */
-	if(h->db == NULL && sqlite3_open(h->file, &h->db) != 0)
+	if(db_connect(h) != 0)
 		return NULL;
 
 	return h->db;
@@ -115,17 +302,20 @@ int db_exec(struct db_handle *h, const char *sql, db_cb callback,
 	    void *user_data)
 {
 	char *error = NULL;
+	uint64_t start;
 	int ret;
 
 	if(h == NULL || h->file == NULL || sql == NULL)
 		return -1;
 
 	/* Open database */
-	if(h->db == NULL && sqlite3_open(h->file, &h->db) != 0)
+	if(db_connect(h) != 0)
 		return -1;
 
 	/* Process */
+	start = metric_now();
 	ret = sqlite3_exec(h->db, sql, callback, user_data, &error);
+	metric_since(&db_metric_time, start);
 
 	/* Display error */
 	if(error != NULL)
@@ -142,11 +332,33 @@ int64_t db_get_last_id(struct db_handle *h)
 	return sqlite3_last_insert_rowid(h->db);
 }
 
+static void db_free_query(struct db_query *q)
+{
+	/* Finalize statement */
+	sqlite3_finalize(q->stmt);
+
+	/* Free query */
+	if(q->sql != NULL)
+		free(q->sql);
+	free(q);
+}
+
 void db_close(struct db_handle *h)
 {
+	struct db_query *q;
+
 	if(h == NULL)
 		return;
 
+	/* Free cached statements (they must not be in use anymore) */
+	while(h->queries != NULL)
+	{
+		q = h->queries;
+		h->queries = q->next;
+		db_free_query(q);
+	}
+	pthread_mutex_destroy(&h->mutex);
+
 	/* Close database */
 	if(h->db != NULL)
 		sqlite3_close(h->db);
@@ -178,31 +390,159 @@ void db_free(void *ptr)
 	sqlite3_free(ptr);
 }
 
+static struct db_query *db_find_query(struct db_handle *h, const char *sql,
+				       size_t len)
+{
+	struct db_query *q;
+
+	/* Find a free statement with same SQL text */
+	for(q = h->queries; q != NULL; q = q->next)
+	{
+		if(!q->in_use && q->len == len && memcmp(q->sql, sql, len) == 0)
+		{
+			q->in_use = 1;
+			q->last_use = ++h->query_tick;
+			return q;
+		}
+	}
+
+	return NULL;
+}
+
+static void db_cache_query(struct db_handle *h, struct db_query *q,
+			   const char *sql, size_t len, int max)
+{
+	struct db_query **qp, **old = NULL;
+	struct db_query *e;
+
+	/* Copy SQL text */
+	q->sql = malloc(len + 1);
+	if(q->sql == NULL)
+		return;
+	memcpy(q->sql, sql, len);
+	q->sql[len] = '\0';
+	q->len = len;
+	q->in_use = 1;
+	q->last_use = ++h->query_tick;
+
+	/* Cache is full: remove least recently used free statement */
+	if(h->query_count >= max)
+	{
+		for(qp = &h->queries; *qp != NULL; qp = &(*qp)->next)
+		{
+			if(!(*qp)->in_use &&
+			   (old == NULL || (*qp)->last_use < (*old)->last_use))
+				old = qp;
+		}
+		if(old == NULL)
+		{
+			/* All statements are in use: don't cache */
+			free(q->sql);
+			q->sql = NULL;
+			return;
+		}
+		e = *old;
+		*old = e->next;
+		db_free_query(e);
+		h->query_count--;
+	}
+
+	/* Add to cache */
+	q->next = h->queries;
+	h->queries = q;
+	h->query_count++;
+}
+
 struct db_query *db_prepare(struct db_handle *h, const char *sql, size_t len)
 {
+	struct db_query *q;
 	sqlite3_stmt *stmt;
+	int max;
 
 	if(h == NULL || h->file == NULL || sql == NULL)
 		return NULL;
 
+	/* Get SQL length */
+	if(len == (size_t) -1)
+		len = strlen(sql);
+
 	/* Open database */
-	if(h->db == NULL && sqlite3_open(h->file, &h->db) != 0)
+	if(db_connect(h) != 0)
 		return NULL;
 
-	if(sqlite3_prepare_v2(h->db, sql, len, &stmt, NULL) < 0)
+	/* Find statement in cache */
+	pthread_mutex_lock(&h->mutex);
+	q = db_find_query(h, sql, len);
+	pthread_mutex_unlock(&h->mutex);
+	if(q != NULL)
+		return q;
+
+	/* Prepare a new statement */
+	if(sqlite3_prepare_v2(h->db, sql, len, &stmt, NULL) != SQLITE_OK ||
+	   stmt == NULL)
 		return NULL;
 
-	return (struct db_query *) stmt;
+	/* Allocate query */
+	q = calloc(1, sizeof(struct db_query));
+	if(q == NULL)
+	{
+		sqlite3_finalize(stmt);
+		return NULL;
+	}
+	q->stmt = stmt;
+	q->handle = h;
+
+	/* Only cache statements with parameters: SQL text with values inside
+	 * is rarely used twice.
+	 */
+	pthread_mutex_lock(&db_config_mutex);
+	max = db_statements;
+	pthread_mutex_unlock(&db_config_mutex);
+	if(max > 0 && sqlite3_bind_parameter_count(stmt) > 0)
+	{
+		pthread_mutex_lock(&h->mutex);
+		db_cache_query(h, q, sql, len, max);
+		pthread_mutex_unlock(&h->mutex);
+	}
+
+	return q;
+}
+
+int db_bind_blob(struct db_query *query, int i, const void *blob, size_t len)
+{
+	if(query == NULL)
+		return -1;
+
+	return sqlite3_bind_blob(query->stmt, i, blob, len, SQLITE_TRANSIENT);
+}
+
+int db_bind_text(struct db_query *query, int i, const char *str)
+{
+	if(query == NULL)
+		return -1;
+
+	return sqlite3_bind_text(query->stmt, i, str, -1, SQLITE_TRANSIENT);
+}
+
+int db_bind_int64(struct db_query *query, int i, int64_t value)
+{
+	if(query == NULL)
+		return -1;
+
+	return sqlite3_bind_int64(query->stmt, i, (sqlite3_int64) value);
 }
 
 int db_step(struct db_query *query)
 {
+	uint64_t start;
 	int ret;
 
 	if(query == NULL)
 		return -1;
 
-	ret = sqlite3_step((sqlite3_stmt *) query);
+	start = metric_now();
+	ret = sqlite3_step(query->stmt);
+	metric_since(&db_metric_time, start);
 	if(ret == SQLITE_DONE)
 		return DB_DONE;
 	else if(ret == SQLITE_ROW)
@@ -213,10 +553,29 @@ int db_step(struct db_query *query)
 
 int db_finalize(struct db_query *query)
 {
+	struct db_handle *h;
+	int ret;
+
 	if(query == NULL)
 		return -1;
 
-	return sqlite3_finalize((sqlite3_stmt *) query);
+	/* Not cached: free statement */
+	if(query->sql == NULL)
+	{
+		ret = sqlite3_finalize(query->stmt);
+		free(query);
+		return ret;
+	}
+
+	/* Reset statement and give it back to cache */
+	ret = sqlite3_reset(query->stmt);
+	sqlite3_clear_bindings(query->stmt);
+	h = query->handle;
+	pthread_mutex_lock(&h->mutex);
+	query->in_use = 0;
+	pthread_mutex_unlock(&h->mutex);
+
+	return ret;
 }
 
 int db_column_count(struct db_query *query)
@@ -224,7 +583,7 @@ int db_column_count(struct db_query *query)
 	if(query == NULL)
 		return -1;
 
-	return sqlite3_column_count((sqlite3_stmt *) query);
+	return sqlite3_column_count(query->stmt);
 }
 
 const char *db_column_text(struct db_query *query, int i)
@@ -232,7 +591,7 @@ const char *db_column_text(struct db_query *query, int i)
 	if(query == NULL)
 		return NULL;
 
-	return (const char *) sqlite3_column_text((sqlite3_stmt *) query, i);
+	return (const char *) sqlite3_column_text(query->stmt, i);
 }
 
 char *db_column_copy_text(struct db_query *query, int i)
@@ -243,7 +602,7 @@ char *db_column_copy_text(struct db_query *query, int i)
 		return NULL;
 
 	/* Get string and copy */
-	str = (const char *) sqlite3_column_text((sqlite3_stmt *) query, i);
+	str = (const char *) sqlite3_column_text(query->stmt, i);
 	if(str != NULL)
 		return strdup(str);
 
@@ -256,10 +615,10 @@ int db_column_blob(struct db_query *query, int i, const void **blob)
 		return -1;
 
 	/* Get blob */
-	*blob = sqlite3_column_blob((sqlite3_stmt *) query, i);
+	*blob = sqlite3_column_blob(query->stmt, i);
 
 	/* Return byte count for blob */
-	return sqlite3_column_bytes((sqlite3_stmt *) query, i);;
+	return sqlite3_column_bytes(query->stmt, i);;
 }
 
 int db_column_int(struct db_query *query, int i)
@@ -267,7 +626,7 @@ int db_column_int(struct db_query *query, int i)
 	if(query == NULL)
 		return -1;
 
-	return sqlite3_column_int((sqlite3_stmt *) query, i);
+	return sqlite3_column_int(query->stmt, i);
 }
 
 int64_t db_column_int64(struct db_query *query, int i)
@@ -275,7 +634,7 @@ int64_t db_column_int64(struct db_query *query, int i)
 	if(query == NULL)
 		return -1;
 
-	return (int64_t) sqlite3_column_int64((sqlite3_stmt *) query, i);
+	return (int64_t) sqlite3_column_int64(query->stmt, i);
 }
 
 double db_column_double(struct db_query *query, int i)
@@ -283,7 +642,7 @@ double db_column_double(struct db_query *query, int i)
 	if(query == NULL)
 		return -1;
 
-	return sqlite3_column_double((sqlite3_stmt *) query, i);
+	return sqlite3_column_double(query->stmt, i);
 }
 
 int db_column_type(struct db_query *query, int i)
@@ -294,7 +653,7 @@ int db_column_type(struct db_query *query, int i)
 		return -1;
 
 	/* Find type */
-	switch(sqlite3_column_type((sqlite3_stmt *) query, i))
+	switch(sqlite3_column_type(query->stmt, i))
 	{
 		case SQLITE_INTEGER:
 			type = DB_INTEGER;
@@ -25,6 +25,11 @@
 #include "decoder_alac.h"
 #include "decoder_aac.h"
 #include "decoder_mp3.h"
+#include "metrics.h"
+
+/* Time spent in decoders */
+static struct metric decoder_metric_time = METRIC_INIT(METRIC_HISTOGRAM,
+	"aircat_decode_seconds", "Duration of a decoder call");
 
 int decoder_open(struct decoder_handle **handle, enum a_codec codec,
 		 const unsigned char *buffer, size_t len,
@@ -64,11 +69,156 @@ int decoder_decode(struct decoder_handle *h, unsigned char *in_buffer,
 		   size_t in_size, unsigned char *out_buffer,
 		   size_t out_size, struct decoder_info *info)
 {
+	uint64_t start;
+	int ret;
+
 	if(h == NULL || h->dec == NULL)
 		return -1;
 
-	return h->decode(h->dec, in_buffer, in_size, out_buffer, out_size,
-			 info);
+	/* Decode and measure time */
+	start = metric_now();
+	ret = h->decode(h->dec, in_buffer, in_size, out_buffer, out_size,
+			info);
+	metric_since(&decoder_metric_time, start);
+
+	return ret;
+}
+
+static int decoder_decode_frames(struct decoder_handle *h,
+				 const struct decoder_frame *frames,
+				 unsigned int count, unsigned char *out_buffer,
+				 size_t out_size,
+				 struct decoder_batch_info *info)
+{
+	size_t bytes = format_sample_size(h->sample);
+	struct decoder_info frame_info;
+	size_t total = 0;
+	int samples;
+
+	/* Empty remaining PCM */
+	if(count == 0)
+	{
+		samples = h->decode(h->dec, NULL, 0, out_buffer, out_size,
+				    &frame_info);
+		if(samples < 0)
+			return samples;
+
+		info->remaining = frame_info.remaining;
+		info->samplerate = frame_info.samplerate;
+		info->channels = frame_info.channels;
+		return samples;
+	}
+
+	/* Decode frame by frame */
+	while(info->frames < count && total < out_size)
+	{
+		frame_info.used = 0;
+		samples = h->decode(h->dec, frames[info->frames].data +
+					    info->used,
+				    frames[info->frames].len - info->used,
+				    &out_buffer[total * bytes],
+				    out_size - total, &frame_info);
+		if(samples < 0)
+		{
+			/* Skip bad data */
+			info->used += frame_info.used;
+			if(info->used >= frames[info->frames].len)
+			{
+				info->frames++;
+				info->used = 0;
+			}
+			return total > 0 ? total : samples;
+		}
+
+		/* Frame without PCM and more data is needed */
+		if(samples == 0 && frame_info.used == 0)
+			break;
+
+		/* Check audio format */
+		if(samples > 0)
+		{
+			if(info->samplerate == 0 && info->channels == 0)
+			{
+				info->samplerate = frame_info.samplerate;
+				info->channels = frame_info.channels;
+			}
+			else if(frame_info.samplerate != info->samplerate ||
+				frame_info.channels != info->channels)
+			{
+				/* Keep samples in decoder for next call */
+				h->decode(h->dec, NULL, 0, NULL, 0, NULL);
+				frame_info.remaining += samples;
+				samples = 0;
+			}
+		}
+
+		/* Update used data in frame */
+		info->used += frame_info.used;
+		if(info->used >= frames[info->frames].len)
+		{
+			info->frames++;
+			info->used = 0;
+		}
+
+		info->remaining = frame_info.remaining;
+		total += samples;
+
+		/* Decoder still has samples or new format is waiting */
+		if(frame_info.remaining > 0)
+			break;
+	}
+
+	return total;
+}
+
+int decoder_decode_batch(struct decoder_handle *h,
+			 const struct decoder_frame *frames, unsigned int count,
+			 unsigned char *out_buffer, size_t out_size,
+			 struct decoder_batch_info *info)
+{
+	uint64_t start;
+	int ret;
+
+	if(h == NULL || h->dec == NULL || info == NULL)
+		return -1;
+
+	/* Expected format is given in info */
+	info->frames = 0;
+	info->used = 0;
+	info->remaining = 0;
+
+	/* Decode and measure time */
+	start = metric_now();
+	if(h->decode_batch != NULL)
+		ret = h->decode_batch(h->dec, frames, count, out_buffer,
+				      out_size, info);
+	else
+		ret = decoder_decode_frames(h, frames, count, out_buffer,
+					    out_size, info);
+	metric_since(&decoder_metric_time, start);
+
+	return ret;
+}
+
+int decoder_set_sample(struct decoder_handle *h, enum a_sample sample)
+{
+	if(h == NULL || h->dec == NULL)
+		return -1;
+
+	/* Native format is always supported */
+	if(format_sample(sample) == format_sample(SAMPLE_NATIVE))
+		sample = SAMPLE_NATIVE;
+
+	/* Decoder doesn't support other sample formats */
+	if(h->set_sample == NULL && sample != SAMPLE_NATIVE)
+		return -1;
+
+	/* Change output sample format */
+	if(h->set_sample != NULL && h->set_sample(h->dec, sample) != 0)
+		return -1;
+	h->sample = sample;
+
+	return 0;
 }
 
 int decoder_close(struct decoder_handle *h)
@@ -44,8 +44,24 @@ struct decoder {
 	/* Infos */
 	unsigned long samplerate;
 	unsigned char channels;
+	enum a_sample sample;
 };
 
+static unsigned char decoder_aac_faad_format(enum a_sample sample)
+{
+	/* faad provides all sample formats of the pipeline */
+	switch(format_sample(sample))
+	{
+		case SAMPLE_S16:
+			return FAAD_FMT_16BIT;
+		case SAMPLE_FLOAT:
+			return FAAD_FMT_FLOAT;
+		case SAMPLE_S32:
+		default:
+			return FAAD_FMT_32BIT;
+	}
+}
+
 int decoder_aac_open(struct decoder **decoder, const unsigned char *dec_config,
 		     size_t dec_config_size, unsigned long *samplerate,
 		     unsigned char *channels)
@@ -64,17 +80,14 @@ int decoder_aac_open(struct decoder **decoder, const unsigned char *dec_config,
 	dec->pcm_buffer = NULL;
 	dec->pcm_length = 0;
 	dec->pcm_remain = 0;
+	dec->sample = SAMPLE_NATIVE;
 
 	/* Initialize faad */
 	dec->hDec = NeAACDecOpen();
 
-	/* Set the default object type and samplerate */
+	/* Output directly in native sample format */
 	config = NeAACDecGetCurrentConfiguration(dec->hDec);
-#ifdef USE_FLOAT
-	config->outputFormat = FAAD_FMT_FLOAT;
-#else
-	config->outputFormat = FAAD_FMT_24BIT;
-#endif
+	config->outputFormat = decoder_aac_faad_format(dec->sample);
 	NeAACDecSetConfiguration(dec->hDec, config);
 
 	/* PCM data remaining in output buffer */
@@ -121,6 +134,7 @@ static long decoder_aac_fill_output(struct decoder *dec,
 {
 	unsigned long pos;
 	unsigned long size;
+	size_t sample_size;
 
 	pos = dec->pcm_length-dec->pcm_remain;
 	if(output_size < dec->pcm_remain)
@@ -128,35 +142,19 @@ static long decoder_aac_fill_output(struct decoder *dec,
 	else
 		size = dec->pcm_remain;
 
-	/* Copy samples to output buffer */
-	if(dec->channels > 2) /* Specific case of surround file */
-	{
-		/* Transform:
-		 * From (3 channels) FC , FL , FR
-		 *      (4 channels) FC , FL , FR , BC
-		 *      (5 channels) FC , FL , FR , BL , BR
-		 *      (6 channels) FC , FL , FR , BL , BR , LFE
-		 *      (8 channels) FC , FL , FR , SL , SR , BL , BR , LFE
-		 *      To    ->     FL , FR , SL , SR , BL , BR , FC , LFE
-		 */
-		/* TODO */
-	}
-	else
-#ifdef USE_FLOAT
-		/* 32-bit wide sample (float or 32-bit fixed) */
-		memcpy(output_buffer, &dec->pcm_buffer[pos * 4], size * 4);
-#else
-	{
-		int32_t *p_in = (int32_t*) &dec->pcm_buffer[pos*4];
-		int32_t *p_out = (int32_t*) output_buffer;
-		size_t i;
-		for(i = 0; i < size; i++)
-		{
-			*(p_out++) = (*p_in << 8);
-			p_in++;
-		}
-	}
-#endif
+	/* Copy samples to output buffer: faad already outputs the requested
+	 * sample format.
+	 * TODO: reorder surround channels (3 channels and more)
+	 *  From (3 channels) FC , FL , FR
+	 *       (4 channels) FC , FL , FR , BC
+	 *       (5 channels) FC , FL , FR , BL , BR
+	 *       (6 channels) FC , FL , FR , BL , BR , LFE
+	 *       (8 channels) FC , FL , FR , SL , SR , BL , BR , LFE
+	 *       To    ->     FL , FR , SL , SR , BL , BR , FC , LFE
+	 */
+	sample_size = format_sample_size(dec->sample);
+	memcpy(output_buffer, &dec->pcm_buffer[pos * sample_size],
+	       size * sample_size);
 
 	dec->pcm_remain -= size;
 
@@ -202,15 +200,25 @@ int decoder_aac_decode(struct decoder *dec, unsigned char *in_buffer,
 		/* Update buffer */
 		info->used = frameInfo.bytesconsumed;
 		info->remaining = 0;
+		info->samplerate = dec->samplerate;
+		info->channels = dec->channels;
 
 		return 0;
 	}
 
+	/* HE-AAC: SBR can double the output samplerate and PS can turn a mono
+	 * stream into stereo once the first frames are decoded. The new format
+	 * is reported with the samples and the caller handles the change.
+	 */
+	if(frameInfo.samples > 0)
+	{
+		dec->samplerate = frameInfo.samplerate;
+		dec->channels = frameInfo.channels;
+	}
+
 	/* Fill output buffer with PCM */
 	dec->pcm_remain = frameInfo.samples;
 	dec->pcm_length = frameInfo.samples;
-	dec->samplerate = frameInfo.samplerate;
-	dec->channels = frameInfo.channels;
 	size = decoder_aac_fill_output(dec, out_buffer, out_size);
 
 	/* Update buffer */
@@ -237,9 +245,30 @@ int decoder_aac_close(struct decoder *dec)
 	return 0;
 }
 
+int decoder_aac_set_sample(struct decoder *dec, enum a_sample sample)
+{
+	NeAACDecConfigurationPtr config;
+
+	/* Format can't be changed while PCM is remaining in faad buffer */
+	if(dec->pcm_remain > 0 &&
+	   format_sample(sample) != format_sample(dec->sample))
+		return -1;
+
+	/* Update faad output format */
+	config = NeAACDecGetCurrentConfiguration(dec->hDec);
+	config->outputFormat = decoder_aac_faad_format(sample);
+	if(NeAACDecSetConfiguration(dec->hDec, config) == 0)
+		return -1;
+
+	dec->sample = sample;
+
+	return 0;
+}
+
 struct decoder_handle decoder_aac = {
 	.dec = NULL,
 	.open = &decoder_aac_open,
 	.decode = &decoder_aac_decode,
 	.close = &decoder_aac_close,
+	.set_sample = &decoder_aac_set_sample,
 };
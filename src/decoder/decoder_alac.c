@@ -27,14 +27,23 @@
 #include <string.h>
 #include <stdint.h>
 
+#if defined(__SSE2__)
+	#define ALAC_SSE2 1
+	#include <emmintrin.h>
+	#if defined(__SSE4_1__)
+		#include <smmintrin.h>
+	#endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	#define ALAC_NEON 1
+	#include <arm_neon.h>
+#endif
+
 #include "decoder_alac.h"
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
 
-#define PACKET_SIZE 16384
-#define BUFFER_SIZE PACKET_SIZE
 
 #define _Swap32(v) do { \
                    v = (((v) & 0x000000FF) << 0x18) | \
@@ -61,9 +70,11 @@ struct {signed int x:24;} se_struct_24;
 #define RICE_THRESHOLD 8 // maximum number of bits for a rice prefix.
 
 struct alac_decoder {
-	/* Input buffers */
-	unsigned char *input_buffer;
-	int input_buffer_bitaccumulator;
+	/* Input bitstream: bits are cached MSB first in a 64-bit word */
+	const unsigned char *input_buffer;
+	const unsigned char *input_end;
+	uint64_t input_cache;
+	int input_cache_bits;
 	/* Decoder buffers */
 	int32_t *predicterror_buffer[2];
 	int32_t *outputsamples_buffer[2];
@@ -88,10 +99,12 @@ struct alac_decoder {
 };
 
 struct decoder {
-	/* PCM output */
-	unsigned char buffer[BUFFER_SIZE];
+	/* PCM output for partial frames (in output sample format) */
+	unsigned char *buffer;
 	unsigned long pcm_length;
 	unsigned long pcm_remain;
+	/* Output sample format */
+	enum a_sample sample;
 	/* ALAC params */
 	struct alac_decoder alac;
 };
@@ -101,8 +114,11 @@ static const int host_bigendian = 0;
 static int decoder_alac_init(struct alac_decoder *alac,
 			     const unsigned char *in_buffer, size_t in_size);
 static void decoder_alac_decode_frame(struct alac_decoder *alac,
-				      unsigned char *in_buffer,
-				      void *out_buffer, int *output_size);
+				      unsigned char *in_buffer, size_t in_size,
+				      void *out_buffer, enum a_sample sample,
+				      int *output_size);
+static void decoder_alac_convert(void *buffer, size_t len,
+				 enum a_sample from, enum a_sample to);
 
 int decoder_alac_open(struct decoder **decoder, const unsigned char *config,
 		      size_t config_size, unsigned long *samplerate,
@@ -117,8 +133,10 @@ int decoder_alac_open(struct decoder **decoder, const unsigned char *config,
 	dec = *decoder;
 
 	/* Init decoder structure */
+	dec->buffer = NULL;
 	dec->pcm_length = 0;
 	dec->pcm_remain = 0;
+	dec->sample = SAMPLE_NATIVE;
 
 	/* Init alac decoder with 0 */
 	memset(&dec->alac, 0, sizeof(struct alac_decoder));
@@ -140,38 +158,39 @@ static long decoder_alac_fill_output(struct decoder *dec,
 				     unsigned char *output_buffer,
 				     size_t output_size)
 {
-#ifdef USE_FLOAT
-	float *p = (float*) output_buffer;
-#else
-	int32_t *p = (int32_t*) output_buffer;
-#endif 
+	size_t bytes = format_sample_size(dec->sample);
 	unsigned long pos;
 	unsigned long size;
-	int i;
 
-	pos = (dec->pcm_length - dec->pcm_remain) * 2;
+	pos = (dec->pcm_length - dec->pcm_remain) * bytes;
 	if(output_size < dec->pcm_remain)
 		size = output_size;
 	else
 		size = dec->pcm_remain;
 
-	/* Copy samples to output buffer */
-	for(i = 0; i < size * 2; i += 2)
-	{
-#ifdef USE_FLOAT
-		*p++ = (float)((int32_t) (dec->buffer[i+1+pos] << 24) |
-				       (dec->buffer[i+pos] << 16)) / 0x7fffffff;
-#else
-		*p++ = (int32_t) (dec->buffer[i+1+pos] << 24) |
-				 (dec->buffer[i+pos] << 16);
-#endif
-	}
-
+	/* Decoded samples are already in output format (in host byte order,
+	 * as all sample formats)
+	 */
+	memcpy(output_buffer, &dec->buffer[pos], size * bytes);
 	dec->pcm_remain -= size;
 
 	return size;
 }
 
+static int decoder_alac_alloc_buffer(struct decoder *dec)
+{
+	/* Allocate PCM output for a full frame (up to 32-bit samples) */
+	if(dec->buffer == NULL)
+	{
+		dec->buffer = malloc(dec->alac.samples_per_frame *
+				     dec->alac.numchannels * 4);
+		if(dec->buffer == NULL)
+			return -1;
+	}
+
+	return 0;
+}
+
 int decoder_alac_decode(struct decoder *dec, unsigned char *in_buffer,
 			size_t in_size, unsigned char *out_buffer,
 			size_t out_size, struct decoder_info *info)
@@ -206,16 +225,41 @@ int decoder_alac_decode(struct decoder *dec, unsigned char *in_buffer,
 	if(in_size == 0)
 		return 0;
 
-	/* Decode the frame */
-	decoder_alac_decode_frame(&dec->alac, in_buffer, dec->buffer,
+	/* Decode the frame directly in output buffer when a full frame fits */
+	if(out_size >= dec->alac.samples_per_frame * dec->alac.numchannels)
+	{
+		decoder_alac_decode_frame(&dec->alac, in_buffer, in_size,
+					  out_buffer, format_sample(dec->sample),
 					  &decode_size);
-					  
+		if(decode_size <= 0)
+			return -1;
+
+		/* No PCM is kept in decoder */
+		dec->pcm_remain = 0;
+		dec->pcm_length = 0;
+
+		/* Fill decoder info */
+		info->used = in_size;
+		info->remaining = 0;
+		info->samplerate = dec->alac.samplerate;
+		info->channels = dec->alac.numchannels;
+
+		return decode_size;
+	}
+
+	/* Allocate PCM output for a full frame */
+	if(decoder_alac_alloc_buffer(dec) != 0)
+		return -1;
+
+	/* Decode the frame */
+	decoder_alac_decode_frame(&dec->alac, in_buffer, in_size, dec->buffer,
+				  format_sample(dec->sample), &decode_size);
 	if(decode_size <= 0)
 		return -1;
 
 	/* Fill output buffer with PCM */
-	dec->pcm_remain = decode_size / 2;
-	dec->pcm_length = decode_size / 2;
+	dec->pcm_remain = decode_size;
+	dec->pcm_length = decode_size;
 
 	size = decoder_alac_fill_output(dec, out_buffer, out_size);
 
@@ -228,6 +272,89 @@ int decoder_alac_decode(struct decoder *dec, unsigned char *in_buffer,
 	return size;
 }
 
+int decoder_alac_decode_batch(struct decoder *dec,
+			      const struct decoder_frame *frames,
+			      unsigned int count, unsigned char *out_buffer,
+			      size_t out_size,
+			      struct decoder_batch_info *info)
+{
+	size_t frame_size = dec->alac.samples_per_frame *
+			    dec->alac.numchannels;
+	size_t bytes = format_sample_size(dec->sample);
+	enum a_sample sample = format_sample(dec->sample);
+	int decode_size;
+	size_t total = 0;
+	int ret = 0;
+
+	/* Audio format is fixed by decoder configuration */
+	info->frames = 0;
+	info->used = 0;
+	info->samplerate = dec->alac.samplerate;
+	info->channels = dec->alac.numchannels;
+
+	/* Empty remaining PCM before decoding other frames */
+	if(dec->pcm_remain > 0 || count == 0)
+	{
+		total = decoder_alac_fill_output(dec, out_buffer, out_size);
+		info->remaining = dec->pcm_remain;
+		return total;
+	}
+
+	/* Decode full frames directly in output buffer */
+	dec->pcm_remain = 0;
+	dec->pcm_length = 0;
+	while(info->frames < count && out_size - total >= frame_size)
+	{
+		decoder_alac_decode_frame(&dec->alac,
+					  frames[info->frames].data,
+					  frames[info->frames].len,
+					  &out_buffer[total * bytes], sample,
+					  &decode_size);
+
+		/* Drop bad frame */
+		info->frames++;
+		if(decode_size <= 0)
+		{
+			ret = -1;
+			goto end;
+		}
+
+		total += decode_size;
+	}
+
+	/* Decode last frame in PCM buffer when it doesn't fit */
+	if(info->frames < count && total < out_size)
+	{
+		if(decoder_alac_alloc_buffer(dec) != 0)
+		{
+			ret = -1;
+			goto end;
+		}
+
+		decoder_alac_decode_frame(&dec->alac,
+					  frames[info->frames].data,
+					  frames[info->frames].len,
+					  dec->buffer, sample, &decode_size);
+		info->frames++;
+		if(decode_size <= 0)
+		{
+			ret = -1;
+			goto end;
+		}
+
+		/* Fill output buffer with PCM */
+		dec->pcm_remain = decode_size;
+		dec->pcm_length = decode_size;
+		total += decoder_alac_fill_output(dec, &out_buffer[total * bytes],
+						  out_size - total);
+	}
+
+end:
+	info->remaining = dec->pcm_remain;
+
+	return total > 0 ? total : ret;
+}
+
 int decoder_alac_close(struct decoder *dec)
 {
 	int i;
@@ -246,17 +373,41 @@ int decoder_alac_close(struct decoder *dec)
 			free(dec->alac.uncompressed_bytes_buffer[i]);
 	}
 
+	/* Free PCM output */
+	if(dec->buffer != NULL)
+		free(dec->buffer);
+
 	/* Free decoder */
 	free(dec);
 
 	return 0;
 }
 
+int decoder_alac_set_sample(struct decoder *dec, enum a_sample sample)
+{
+	/* Only 16-bit output can be provided without conversion */
+	if(dec->alac.sample_size != 16 ||
+	   (sample != SAMPLE_NATIVE && sample != SAMPLE_S16))
+		return -1;
+
+	/* Convert PCM kept for a partial frame to new format */
+	if(format_sample(sample) != format_sample(dec->sample) &&
+	   dec->buffer != NULL && dec->pcm_length > 0)
+		decoder_alac_convert(dec->buffer, dec->pcm_length,
+				     format_sample(dec->sample),
+				     format_sample(sample));
+	dec->sample = sample;
+
+	return 0;
+}
+
 struct decoder_handle decoder_alac = {
 	.dec = NULL,
 	.open = &decoder_alac_open,
 	.decode = &decoder_alac_decode,
 	.close = &decoder_alac_close,
+	.set_sample = &decoder_alac_set_sample,
+	.decode_batch = &decoder_alac_decode_batch,
 };
 
 static int decoder_alac_init(struct alac_decoder *alac,
@@ -320,77 +471,88 @@ static int decoder_alac_init(struct alac_decoder *alac,
 	return 0;
 }
 
-static uint32_t decoder_alac_readbits_16(struct alac_decoder *alac, int bits)
+static inline uint64_t decoder_alac_load_be64(const unsigned char *p)
 {
-	uint32_t result;
-	int new_accumulator;
-
-	result = (alac->input_buffer[0] << 16) | (alac->input_buffer[1] << 8) | (alac->input_buffer[2]);
-
-	/* shift left by the number of bits we've already read,
-	* so that the top 'n' bits of the 24 bits we read will
-	* be the return bits */
-	result = result << alac->input_buffer_bitaccumulator;
-
-	result = result & 0x00ffffff;
-
-	/* and then only want the top 'n' bits from that, where
-	* n is 'bits' */
-	result = result >> (24 - bits);
+	uint64_t v;
 
-	new_accumulator = (alac->input_buffer_bitaccumulator + bits);
+#if defined(__GNUC__) && defined(__BYTE_ORDER__)
+	memcpy(&v, p, 8);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	v = __builtin_bswap64(v);
+#endif
+#else
+	v = ((uint64_t) p[0] << 56) | ((uint64_t) p[1] << 48) |
+	    ((uint64_t) p[2] << 40) | ((uint64_t) p[3] << 32) |
+	    ((uint64_t) p[4] << 24) | ((uint64_t) p[5] << 16) |
+	    ((uint64_t) p[6] << 8) | (uint64_t) p[7];
+#endif
 
-	/* increase the buffer pointer if we've read over n bytes. */
-	alac->input_buffer += (new_accumulator >> 3);
+	return v;
+}
 
-	/* and the remainder goes back into the bit accumulator */
-	alac->input_buffer_bitaccumulator = (new_accumulator & 7);
+static void decoder_alac_refill_slow(struct alac_decoder *alac)
+{
+	/* Load last bytes one by one */
+	while(alac->input_cache_bits <= 56 &&
+	      alac->input_buffer < alac->input_end)
+	{
+		alac->input_cache |= (uint64_t) *alac->input_buffer++ <<
+					       (56 - alac->input_cache_bits);
+		alac->input_cache_bits += 8;
+	}
 
-	return result;
+	/* End of stream: next bits are read as 0 */
+	if(alac->input_buffer >= alac->input_end)
+		alac->input_cache_bits = 64;
 }
 
-static uint32_t decoder_alac_readbits(struct alac_decoder *alac, int bits)
+/* Fill the bit cache: at least 56 bits are available after this call */
+static inline void decoder_alac_refill(struct alac_decoder *alac)
 {
-	int32_t result = 0;
+	int bytes;
 
-	if (bits > 16)
+	if(alac->input_end - alac->input_buffer < 8)
 	{
-		bits -= 16;
-		result = decoder_alac_readbits_16(alac, 16) << bits;
+		decoder_alac_refill_slow(alac);
+		return;
 	}
 
-	result |= decoder_alac_readbits_16(alac, bits);
+	/* Load as many whole bytes as fit in cache */
+	bytes = (63 - alac->input_cache_bits) >> 3;
+	alac->input_cache |= decoder_alac_load_be64(alac->input_buffer) >>
+			     alac->input_cache_bits;
+	alac->input_buffer += bytes;
+	alac->input_cache_bits += bytes * 8;
 
-	return result;
+	/* Drop bits of the partial byte which will be loaded again */
+	alac->input_cache &= ~(~(uint64_t)0 >> alac->input_cache_bits);
 }
 
-static int decoder_alac_readbit(struct alac_decoder *alac)
+/* Get next bits without consuming them (up to 32 bits) */
+static inline uint32_t decoder_alac_peekbits(struct alac_decoder *alac,
+					     int bits)
 {
-	int new_accumulator;
-	int result;
-
-	result = alac->input_buffer[0];
-	result = result << alac->input_buffer_bitaccumulator;
-	result = result >> 7 & 1;
-
-	new_accumulator = (alac->input_buffer_bitaccumulator + 1);
-
-	alac->input_buffer += (new_accumulator / 8);
+	if(alac->input_cache_bits < bits)
+		decoder_alac_refill(alac);
 
-	alac->input_buffer_bitaccumulator = (new_accumulator % 8);
+	return (alac->input_cache >> 1) >> (63 - bits);
+}
 
-	return result;
+static inline void decoder_alac_skipbits(struct alac_decoder *alac, int bits)
+{
+	alac->input_cache <<= bits;
+	alac->input_cache_bits -= bits;
 }
 
-static void decoder_alac_unreadbits(struct alac_decoder *alac, int bits)
+static inline uint32_t decoder_alac_readbits(struct alac_decoder *alac,
+					     int bits)
 {
-	int new_accumulator = (alac->input_buffer_bitaccumulator - bits);
+	uint32_t result;
 
-	alac->input_buffer += (new_accumulator >> 3);
+	result = decoder_alac_peekbits(alac, bits);
+	decoder_alac_skipbits(alac, bits);
 
-	alac->input_buffer_bitaccumulator = (new_accumulator & 7);
-	if (alac->input_buffer_bitaccumulator < 0)
-		alac->input_buffer_bitaccumulator *= -1;
+	return result;
 }
 
 /* various implementations of count_leading_zero:
@@ -487,37 +649,40 @@ found:
 }
 #endif
 
-static int32_t decoder_alac_entropy_decode_value(struct alac_decoder *alac, int readSampleSize, int k, int rice_kmodifier_mask)
+static inline int32_t decoder_alac_entropy_decode_value(struct alac_decoder *alac, int readSampleSize, int k, int rice_kmodifier_mask)
 {
-	int32_t x = 0; // decoded value
-	int32_t value;
+	int32_t x; // decoded value
 	int extraBits;
 
-	// read x, number of 1s before 0 represent the rice value.
-	while (x <= RICE_THRESHOLD && decoder_alac_readbit(alac))
-		x++;
+	// read x, number of 1s before 0 represent the rice value: the prefix
+	// is limited to RICE_THRESHOLD + 1 bits.
+	x = decoder_alac_count_leading_zeros(~decoder_alac_peekbits(alac, 32) |
+					     (1 << (30 - RICE_THRESHOLD)));
 
 	if (x > RICE_THRESHOLD)
 	{
 		// read the number from the bit stream (raw value)
-		value = decoder_alac_readbits(alac, readSampleSize);
-
-		// mask value
-		value &= (((uint32_t)0xffffffff) >> (32 - readSampleSize));
-		x = value;
+		decoder_alac_skipbits(alac, x);
+		x = decoder_alac_readbits(alac, readSampleSize);
 	}
 	else
 	{
+		// skip the 1s and the terminating 0
+		decoder_alac_skipbits(alac, x + 1);
+
 		if (k != 1)
 		{
-			extraBits = decoder_alac_readbits(alac, k);
+			extraBits = decoder_alac_peekbits(alac, k);
 			// x = x * (2^k - 1)
 			x *= (((1 << k) - 1) & rice_kmodifier_mask);
 
 			if (extraBits > 1)
+			{
 				x += extraBits - 1;
+				decoder_alac_skipbits(alac, k);
+			}
 			else
-				decoder_alac_unreadbits(alac, 1);
+				decoder_alac_skipbits(alac, k - 1);
 		}
 	}
 
@@ -586,10 +751,13 @@ static void decoder_alac_entropy_rice_decode(struct alac_decoder *alac, int32_t*
 	}
 }
 
-static void decoder_alac_predictor_decompress_fir_adapt(int32_t *error_buffer, int32_t *buffer_out, int output_size, int readsamplesize, int16_t *predictor_coef_table, int predictor_coef_num, int predictor_quantitization)
+/* Adaptive FIR filter: each output sample depends on the previous ones and
+ * the coefficients are updated after each sample, so samples can't be computed
+ * in parallel. The filter is specialized below for the common orders, where
+ * the loops on predictor_coef_num are unrolled by the compiler.
+ */
+static inline void decoder_alac_predictor_fir(int32_t *error_buffer, int32_t *buffer_out, int output_size, int readsamplesize, int16_t *predictor_coef_table, const int predictor_coef_num, int predictor_quantitization)
 {
-	int32_t prev_value;
-	int32_t error_value;
 	int32_t val;
 	int predictor_num;
 	int error_val;
@@ -598,6 +766,80 @@ static void decoder_alac_predictor_decompress_fir_adapt(int32_t *error_buffer, i
 	int sum;
 	int i, j;
 
+	for (i = predictor_coef_num + 1; i < output_size; i++)
+	{
+		sum = 0;
+		error_val = error_buffer[i];
+
+		for (j = 0; j < predictor_coef_num; j++)
+		{
+			sum += (buffer_out[predictor_coef_num-j] - buffer_out[0]) * predictor_coef_table[j];
+		}
+
+		outval = (1 << (predictor_quantitization-1)) + sum;
+		outval = outval >> predictor_quantitization;
+		outval = outval + buffer_out[0] + error_val;
+		outval = SIGN_EXTENDED32(outval, readsamplesize);
+
+		buffer_out[predictor_coef_num+1] = outval;
+
+		if (error_val > 0)
+		{
+			predictor_num = predictor_coef_num - 1;
+
+			while (predictor_num >= 0 && error_val > 0)
+			{
+				val = buffer_out[0] - buffer_out[predictor_coef_num - predictor_num];
+				sign = SIGN_ONLY(val);
+
+				predictor_coef_table[predictor_num] -= sign;
+
+				val *= sign; /* absolute value */
+
+				error_val -= ((val >> predictor_quantitization) * (predictor_coef_num - predictor_num));
+
+				predictor_num--;
+			}
+		}
+		else if (error_val < 0)
+		{
+			predictor_num = predictor_coef_num - 1;
+
+			while (predictor_num >= 0 && error_val < 0)
+			{
+				val = buffer_out[0] - buffer_out[predictor_coef_num - predictor_num];
+				sign = - SIGN_ONLY(val);
+
+				predictor_coef_table[predictor_num] -= sign;
+
+				val *= sign; /* neg value */
+
+				error_val -= ((val >> predictor_quantitization) * (predictor_coef_num - predictor_num));
+
+				predictor_num--;
+			}
+		}
+		buffer_out++;
+	}
+}
+
+static void decoder_alac_predictor_fir_4(int32_t *error_buffer, int32_t *buffer_out, int output_size, int readsamplesize, int16_t *predictor_coef_table, int predictor_quantitization)
+{
+	decoder_alac_predictor_fir(error_buffer, buffer_out, output_size, readsamplesize, predictor_coef_table, 4, predictor_quantitization);
+}
+
+static void decoder_alac_predictor_fir_8(int32_t *error_buffer, int32_t *buffer_out, int output_size, int readsamplesize, int16_t *predictor_coef_table, int predictor_quantitization)
+{
+	decoder_alac_predictor_fir(error_buffer, buffer_out, output_size, readsamplesize, predictor_coef_table, 8, predictor_quantitization);
+}
+
+static void decoder_alac_predictor_decompress_fir_adapt(int32_t *error_buffer, int32_t *buffer_out, int output_size, int readsamplesize, int16_t *predictor_coef_table, int predictor_coef_num, int predictor_quantitization)
+{
+	int32_t prev_value;
+	int32_t error_value;
+	int32_t val;
+	int i;
+
 	/* first sample always copies */
 	*buffer_out = *error_buffer;
 
@@ -637,203 +879,288 @@ static void decoder_alac_predictor_decompress_fir_adapt(int32_t *error_buffer, i
 		}
 	}
 
-#if 0
-	/* 4 and 8 are very common cases (the only ones i've seen). these
-	 * should be unrolled and optimised
-	 */
+	/* 4 and 8 are very common cases (the only ones i've seen) */
 	if (predictor_coef_num == 4)
-	{
-		/* FIXME: optimised general case */
-		return;
-	}
+		decoder_alac_predictor_fir_4(error_buffer, buffer_out, output_size, readsamplesize, predictor_coef_table, predictor_quantitization);
+	else if (predictor_coef_num == 8)
+		decoder_alac_predictor_fir_8(error_buffer, buffer_out, output_size, readsamplesize, predictor_coef_table, predictor_quantitization);
+	else if (predictor_coef_num > 0)
+		decoder_alac_predictor_fir(error_buffer, buffer_out, output_size, readsamplesize, predictor_coef_table, predictor_coef_num, predictor_quantitization);
+}
 
-	if (predictor_coef_table == 8)
+/* Store a sample: s is the sample left aligned on 32 bits */
+static inline void decoder_alac_store(void *out, int idx, enum a_sample sample,
+				      int32_t s)
+{
+	switch(sample)
 	{
-		/* FIXME: optimised general case */
-		return;
+		case SAMPLE_S16:
+			((int16_t*)out)[idx] = s >> 16;
+			break;
+		case SAMPLE_FLOAT:
+			((float*)out)[idx] = (float)s / 0x7fffffff;
+			break;
+		default:
+			((int32_t*)out)[idx] = s;
 	}
-#endif
-
-	/* general case */
-	if (predictor_coef_num > 0)
-	{
-		for (i = predictor_coef_num + 1; i < output_size; i++)
-		{
-			sum = 0;
-			error_val = error_buffer[i];
-
-			for (j = 0; j < predictor_coef_num; j++)
-			{
-				sum += (buffer_out[predictor_coef_num-j] - buffer_out[0]) * predictor_coef_table[j];
-			}
-
-			outval = (1 << (predictor_quantitization-1)) + sum;
-			outval = outval >> predictor_quantitization;
-			outval = outval + buffer_out[0] + error_val;
-			outval = SIGN_EXTENDED32(outval, readsamplesize);
-
-			buffer_out[predictor_coef_num+1] = outval;
-
-			if (error_val > 0)
-			{
-				predictor_num = predictor_coef_num - 1;
-
-				while (predictor_num >= 0 && error_val > 0)
-				{
-					val = buffer_out[0] - buffer_out[predictor_coef_num - predictor_num];
-					sign = SIGN_ONLY(val);
-
-					predictor_coef_table[predictor_num] -= sign;
-
-					val *= sign; /* absolute value */
-
-					error_val -= ((val >> predictor_quantitization) * (predictor_coef_num - predictor_num));
-
-					predictor_num--;
-				}
-			}
-			else if (error_val < 0)
-			{
-				predictor_num = predictor_coef_num - 1;
-
-				while (predictor_num >= 0 && error_val < 0)
-				{
-					val = buffer_out[0] - buffer_out[predictor_coef_num - predictor_num];
-					sign = - SIGN_ONLY(val);
+}
 
-					predictor_coef_table[predictor_num] -= sign;
+/* Convert samples in place between two output formats: samples are widened
+ * from the end of buffer and narrowed from its start, and are rounded to
+ * nearest in new format.
+ */
+static void decoder_alac_convert(void *buffer, size_t len,
+				 enum a_sample from, enum a_sample to)
+{
+	int widen = format_sample_size(to) > format_sample_size(from);
+	size_t i, n;
+	int64_t v;
+	double s;
 
-					val *= sign; /* neg value */
+	for(n = 0; n < len; n++)
+	{
+		i = widen ? len - 1 - n : n;
 
-					error_val -= ((val >> predictor_quantitization) * (predictor_coef_num - predictor_num));
+		/* Get sample left aligned on 32 bits */
+		switch(from)
+		{
+			case SAMPLE_S16:
+				s = ((int16_t*)buffer)[i] * 65536.0;
+				break;
+			case SAMPLE_FLOAT:
+				s = ((float*)buffer)[i] * (double) 0x7fffffff;
+				break;
+			default:
+				s = ((int32_t*)buffer)[i];
+		}
 
-					predictor_num--;
-				}
-			}
-			buffer_out++;
+		/* Store sample rounded to nearest */
+		if(to == SAMPLE_S16)
+		{
+			v = (int64_t) ((s + 2147483648.0) / 65536 + 0.5) - 32768;
+			((int16_t*)buffer)[i] = v > 32767 ? 32767 : v;
+		}
+		else
+		{
+			v = (int64_t) (s + 2147483648.5) - 2147483648LL;
+			decoder_alac_store(buffer, i, to,
+					   v > INT32_MAX ? INT32_MAX : v);
 		}
 	}
 }
 
-static void decoder_alac_deinterlace_16(int32_t *buffer_a, int32_t *buffer_b, int16_t *buffer_out, int numchannels, int numsamples, uint8_t interlacing_shift, uint8_t interlacing_leftweight)
+#ifdef ALAC_SSE2
+static inline __m128i decoder_alac_mullo_sse2(__m128i a, __m128i b)
 {
-	int32_t difference, midright;
-	int16_t left, right;
-	int i;
+#ifdef __SSE4_1__
+	return _mm_mullo_epi32(a, b);
+#else
+	__m128i even, odd;
+
+	even = _mm_mul_epu32(a, b);
+	odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+	return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0,0,2,0)),
+				  _mm_shuffle_epi32(odd, _MM_SHUFFLE(0,0,2,0)));
+#endif
+}
+#endif
+
+/* Deinterlace and convert samples to output format: for stereo, the mid/side
+ * reconstruction is done when interlacing_leftweight is not 0. The lower bytes
+ * stored as uncompressed are then added and samples are converted from
+ * sample_size bits to the output format. The SIMD versions give exactly the
+ * same result as the scalar loop.
+ */
+static void decoder_alac_deinterlace(int32_t *buffer_a, int32_t *buffer_b, int uncompressed_bytes, int32_t *uncompressed_bytes_buffer_a, int32_t *uncompressed_bytes_buffer_b, void *buffer_out, enum a_sample sample, int sample_size, int numchannels, int numsamples, uint8_t interlacing_shift, uint8_t interlacing_leftweight)
+{
+	uint32_t mask = 0;
+	int32_t left, right;
+	int shift = 32 - sample_size;
+	int i = 0;
 
 	if (numsamples <= 0)
 		return;
 
-	/* weighted interlacing */
-	if (interlacing_leftweight)
+	if (uncompressed_bytes)
+		mask = ~(0xFFFFFFFF << (uncompressed_bytes * 8));
+
+	if (buffer_b != NULL && numchannels == 2)
 	{
-		for (i = 0; i < numsamples; i++)
+#if defined(ALAC_SSE2)
+		const __m128i weight = _mm_set1_epi32(interlacing_leftweight);
+		const __m128i m = _mm_set1_epi32(mask);
+		const __m128i ishift = _mm_cvtsi32_si128(interlacing_shift);
+		const __m128i ushift = _mm_cvtsi32_si128(uncompressed_bytes * 8);
+		const __m128i oshift = _mm_cvtsi32_si128(shift);
+		const __m128 scale = _mm_set1_ps(1.0f / 0x7fffffff);
+		__m128i a, b, l, r, lo, hi;
+
+		for (; i + 4 <= numsamples; i += 4)
 		{
-			midright = buffer_a[i];
-			difference = buffer_b[i];
+			a = _mm_loadu_si128((const __m128i *) &buffer_a[i]);
+			b = _mm_loadu_si128((const __m128i *) &buffer_b[i]);
 
-			right = midright - ((difference * interlacing_leftweight) >> interlacing_shift);
-			left = right + difference;
-
-			/* output is always little endian */
-			if (host_bigendian)
+			/* mid/side reconstruction */
+			if (interlacing_leftweight)
 			{
-				_Swap16(left);
-				_Swap16(right);
+				r = _mm_sub_epi32(a, _mm_sra_epi32(
+					 decoder_alac_mullo_sse2(b, weight), ishift));
+				l = _mm_add_epi32(r, b);
+			}
+			else
+			{
+				l = a;
+				r = b;
 			}
 
-			buffer_out[i*numchannels] = left;
-			buffer_out[i*numchannels + 1] = right;
-		}
-		return;
-	}
+			/* add uncompressed bytes */
+			if (uncompressed_bytes)
+			{
+				a = _mm_loadu_si128((const __m128i *)
+					       &uncompressed_bytes_buffer_a[i]);
+				b = _mm_loadu_si128((const __m128i *)
+					       &uncompressed_bytes_buffer_b[i]);
+				l = _mm_or_si128(_mm_sll_epi32(l, ushift),
+						 _mm_and_si128(a, m));
+				r = _mm_or_si128(_mm_sll_epi32(r, ushift),
+						 _mm_and_si128(b, m));
+			}
 
-	/* otherwise basic interlacing took place */
-	for (i = 0; i < numsamples; i++)
-	{
-		left = buffer_a[i];
-		right = buffer_b[i];
+			/* interleave left aligned samples */
+			l = _mm_sll_epi32(l, oshift);
+			r = _mm_sll_epi32(r, oshift);
+			lo = _mm_unpacklo_epi32(l, r);
+			hi = _mm_unpackhi_epi32(l, r);
 
-		/* output is always little endian */
-		if (host_bigendian)
-		{
-			_Swap16(left);
-			_Swap16(right);
+			switch (sample)
+			{
+				case SAMPLE_S16:
+					_mm_storeu_si128((__m128i *)
+						 &((int16_t*)buffer_out)[i*2],
+						 _mm_packs_epi32(
+						     _mm_srai_epi32(lo, 16),
+						     _mm_srai_epi32(hi, 16)));
+					break;
+				case SAMPLE_FLOAT:
+					_mm_storeu_ps(&((float*)buffer_out)[i*2],
+					       _mm_mul_ps(_mm_cvtepi32_ps(lo),
+							  scale));
+					_mm_storeu_ps(&((float*)buffer_out)[i*2+4],
+					       _mm_mul_ps(_mm_cvtepi32_ps(hi),
+							  scale));
+					break;
+				default:
+					_mm_storeu_si128((__m128i *)
+						 &((int32_t*)buffer_out)[i*2], lo);
+					_mm_storeu_si128((__m128i *)
+						 &((int32_t*)buffer_out)[i*2+4], hi);
+			}
 		}
-
-		buffer_out[i*numchannels] = left;
-		buffer_out[i*numchannels + 1] = right;
-	}
-}
-
-static void decoder_alac_deinterlace_24(int32_t *buffer_a, int32_t *buffer_b, int uncompressed_bytes, int32_t *uncompressed_bytes_buffer_a, int32_t *uncompressed_bytes_buffer_b, void *buffer_out, int numchannels, int numsamples, uint8_t interlacing_shift, uint8_t interlacing_leftweight)
-{
-	int32_t difference, midright;
-	int32_t left, right;
-	int i;
-
-	if (numsamples <= 0)
-		return;
-
-	/* weighted interlacing */
-	if (interlacing_leftweight)
-	{
-		for (i = 0; i < numsamples; i++)
+#elif defined(ALAC_NEON)
+		const int32x4_t weight = vdupq_n_s32(interlacing_leftweight);
+		const int32x4_t m = vdupq_n_s32(mask);
+		const int32x4_t ishift = vdupq_n_s32(-interlacing_shift);
+		const int32x4_t ushift = vdupq_n_s32(uncompressed_bytes * 8);
+		const int32x4_t oshift = vdupq_n_s32(shift);
+		const float scale = 1.0f / 0x7fffffff;
+		int32x4_t a, b, l, r;
+		int16x4x2_t x16;
+		float32x4x2_t xf;
+		int32x4x2_t x32;
+
+		for (; i + 4 <= numsamples; i += 4)
 		{
-			midright = buffer_a[i];
-			difference = buffer_b[i];
+			a = vld1q_s32(&buffer_a[i]);
+			b = vld1q_s32(&buffer_b[i]);
 
-			right = midright - ((difference * interlacing_leftweight) >> interlacing_shift);
-			left = right + difference;
+			/* mid/side reconstruction */
+			if (interlacing_leftweight)
+			{
+				r = vsubq_s32(a, vshlq_s32(vmulq_s32(b, weight),
+							   ishift));
+				l = vaddq_s32(r, b);
+			}
+			else
+			{
+				l = a;
+				r = b;
+			}
 
+			/* add uncompressed bytes */
 			if (uncompressed_bytes)
 			{
-				uint32_t mask = ~(0xFFFFFFFF << (uncompressed_bytes * 8));
-				left <<= (uncompressed_bytes * 8);
-				right <<= (uncompressed_bytes * 8);
-
-				left |= uncompressed_bytes_buffer_a[i] & mask;
-				right |= uncompressed_bytes_buffer_b[i] & mask;
+				a = vld1q_s32(&uncompressed_bytes_buffer_a[i]);
+				b = vld1q_s32(&uncompressed_bytes_buffer_b[i]);
+				l = vorrq_s32(vshlq_s32(l, ushift),
+					      vandq_s32(a, m));
+				r = vorrq_s32(vshlq_s32(r, ushift),
+					      vandq_s32(b, m));
 			}
 
-			((uint8_t*)buffer_out)[i * numchannels * 3] = (left) & 0xFF;
-			((uint8_t*)buffer_out)[i * numchannels * 3 + 1] = (left >> 8) & 0xFF;
-			((uint8_t*)buffer_out)[i * numchannels * 3 + 2] = (left >> 16) & 0xFF;
+			/* interleave left aligned samples */
+			l = vshlq_s32(l, oshift);
+			r = vshlq_s32(r, oshift);
 
-			((uint8_t*)buffer_out)[i * numchannels * 3 + 3] = (right) & 0xFF;
-			((uint8_t*)buffer_out)[i * numchannels * 3 + 4] = (right >> 8) & 0xFF;
-			((uint8_t*)buffer_out)[i * numchannels * 3 + 5] = (right >> 16) & 0xFF;
+			switch (sample)
+			{
+				case SAMPLE_S16:
+					x16.val[0] = vshrn_n_s32(l, 16);
+					x16.val[1] = vshrn_n_s32(r, 16);
+					vst2_s16(&((int16_t*)buffer_out)[i*2],
+						 x16);
+					break;
+				case SAMPLE_FLOAT:
+					xf.val[0] = vmulq_n_f32(vcvtq_f32_s32(l),
+								scale);
+					xf.val[1] = vmulq_n_f32(vcvtq_f32_s32(r),
+								scale);
+					vst2q_f32(&((float*)buffer_out)[i*2], xf);
+					break;
+				default:
+					x32.val[0] = l;
+					x32.val[1] = r;
+					vst2q_s32(&((int32_t*)buffer_out)[i*2],
+						  x32);
+			}
 		}
-		return;
+#endif
 	}
 
-	/* otherwise basic interlacing took place */
-	for (i = 0; i < numsamples; i++)
+	for (; i < numsamples; i++)
 	{
 		left = buffer_a[i];
-		right = buffer_b[i];
+		right = 0;
 
-		if (uncompressed_bytes)
+		if (buffer_b != NULL)
 		{
-			uint32_t mask = ~(0xFFFFFFFF << (uncompressed_bytes * 8));
-			left <<= (uncompressed_bytes * 8);
-			right <<= (uncompressed_bytes * 8);
+			right = buffer_b[i];
 
-			left |= uncompressed_bytes_buffer_a[i] & mask;
-			right |= uncompressed_bytes_buffer_b[i] & mask;
+			/* weighted interlacing */
+			if (interlacing_leftweight)
+			{
+				right = left - ((right * interlacing_leftweight) >> interlacing_shift);
+				left = right + buffer_b[i];
+			}
 		}
 
-		((uint8_t*)buffer_out)[i * numchannels * 3] = (left) & 0xFF;
-		((uint8_t*)buffer_out)[i * numchannels * 3 + 1] = (left >> 8) & 0xFF;
-		((uint8_t*)buffer_out)[i * numchannels * 3 + 2] = (left >> 16) & 0xFF;
+		if (uncompressed_bytes)
+		{
+			left = (uint32_t) left << (uncompressed_bytes * 8);
+			left |= uncompressed_bytes_buffer_a[i] & mask;
+			if (buffer_b != NULL)
+			{
+				right = (uint32_t) right << (uncompressed_bytes * 8);
+				right |= uncompressed_bytes_buffer_b[i] & mask;
+			}
+		}
 
-		((uint8_t*)buffer_out)[i * numchannels * 3 + 3] = (right) & 0xFF;
-		((uint8_t*)buffer_out)[i * numchannels * 3 + 4] = (right >> 8) & 0xFF;
-		((uint8_t*)buffer_out)[i * numchannels * 3 + 5] = (right >> 16) & 0xFF;
+		decoder_alac_store(buffer_out, i * numchannels, sample, (uint32_t) left << shift);
+		if (buffer_b != NULL)
+			decoder_alac_store(buffer_out, i * numchannels + 1, sample, (uint32_t) right << shift);
 	}
 }
 
-void decoder_alac_decode_frame(struct alac_decoder *alac, unsigned char *inbuffer, void *outbuffer, int *outputsize)
+void decoder_alac_decode_frame(struct alac_decoder *alac, unsigned char *inbuffer, size_t insize, void *outbuffer, enum a_sample sample, int *outputsize)
 {
 	int32_t audiobits;
 	int32_t outputsamples;
@@ -855,11 +1182,13 @@ void decoder_alac_decode_frame(struct alac_decoder *alac, unsigned char *inbuffe
 
 	/* setup the stream */
 	alac->input_buffer = inbuffer;
-	alac->input_buffer_bitaccumulator = 0;
+	alac->input_end = inbuffer + insize;
+	alac->input_cache = 0;
+	alac->input_cache_bits = 0;
 
 	channels = decoder_alac_readbits(alac, 3);
 
-	*outputsize = outputsamples * alac->bytespersample;
+	*outputsize = 0;
 
 	/* 2^result = something to do with output waiting.
 	 * perhaps matters if we read > 1 frame in a pass?
@@ -875,9 +1204,13 @@ void decoder_alac_decode_frame(struct alac_decoder *alac, unsigned char *inbuffe
 		/* now read the number of samples,
 		 * as a 32bit integer */
 		outputsamples = decoder_alac_readbits(alac, 32);
-		*outputsize = outputsamples * alac->bytespersample;
 	}
 
+	/* only mono and stereo frames are supported */
+	if (channels > 1 || channels >= alac->numchannels ||
+	    outputsamples > alac->samples_per_frame)
+		return;
+
 	readsamplesize = alac->sample_size - (uncompressed_bytes * 8) + channels;
 
 	if (!isnotcompressed)
@@ -970,46 +1303,10 @@ void decoder_alac_decode_frame(struct alac_decoder *alac, unsigned char *inbuffe
 	switch(alac->sample_size)
 	{
 		case 16:
-		{
-			if(channels == 0)
-			{
-				for (i = 0; i < outputsamples; i++)
-				{
-					int16_t sample = alac->outputsamples_buffer[0][i];
-					if (host_bigendian)
-						_Swap16(sample);
-					((int16_t*)outbuffer)[i * alac->numchannels] = sample;
-				}
-			}
-			else
-				decoder_alac_deinterlace_16(alac->outputsamples_buffer[0], alac->outputsamples_buffer[1], (int16_t*)outbuffer, alac->numchannels, outputsamples, interlacing_shift, interlacing_leftweight);
-			break;
-		}
 		case 24:
-		{
-			if(channels == 0)
-			{
-				for (i = 0; i < outputsamples; i++)
-				{
-					int32_t sample = alac->outputsamples_buffer[0][i];
-
-					if (uncompressed_bytes)
-					{
-						uint32_t mask;
-						sample = sample << (uncompressed_bytes * 8);
-						mask = ~(0xFFFFFFFF << (uncompressed_bytes * 8));
-						sample |= alac->uncompressed_bytes_buffer[0][i] & mask;
-					}
-
-					((uint8_t*)outbuffer)[i * alac->numchannels * 3] = (sample) & 0xFF;
-					((uint8_t*)outbuffer)[i * alac->numchannels * 3 + 1] = (sample >> 8) & 0xFF;
-					((uint8_t*)outbuffer)[i * alac->numchannels * 3 + 2] = (sample >> 16) & 0xFF;
-				}
-			}
-			else
-				decoder_alac_deinterlace_24(alac->outputsamples_buffer[0], alac->outputsamples_buffer[1], uncompressed_bytes, alac->uncompressed_bytes_buffer[0], alac->uncompressed_bytes_buffer[1], (int16_t*)outbuffer, alac->numchannels, outputsamples, interlacing_shift, interlacing_leftweight);
+			decoder_alac_deinterlace(alac->outputsamples_buffer[0], channels ? alac->outputsamples_buffer[1] : NULL, uncompressed_bytes, alac->uncompressed_bytes_buffer[0], alac->uncompressed_bytes_buffer[1], outbuffer, sample, alac->sample_size, alac->numchannels, outputsamples, interlacing_shift, interlacing_leftweight);
+			*outputsize = outputsamples * alac->numchannels;
 			break;
-		}
 		case 20:
 		case 32:
 			fprintf(stderr, "FIXME: unimplemented sample size %i\n", alac->sample_size);
@@ -21,6 +21,16 @@
 #include <stdint.h>
 #include <mad.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+	#if defined(__SSE2__)
+		#define MP3_SSE2 1
+		#include <emmintrin.h>
+	#endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	#define MP3_NEON 1
+	#include <arm_neon.h>
+#endif
+
 #include "decoder_mp3.h"
 
 #ifdef HAVE_CONFIG_H
@@ -37,12 +47,18 @@
  */
 #define BUFFER_SIZE 2881 * 2 + MAD_BUFFER_GUARD
 
+/* Maximum samples count in a MP3 frame (MPEG 1 Layer III with 2 channels) */
+#define MAX_FRAME_SAMPLES 1152 * 2
+
 struct decoder {
 	struct mad_stream Stream;
 	struct mad_frame Frame;
 	struct mad_synth Synth;
 	/* Output cursor */
 	unsigned long pcm_remain;
+	/* Format of last decoded frame */
+	unsigned long samplerate;
+	unsigned char channels;
 	unsigned char buffer[BUFFER_SIZE];
 	size_t buffer_len;
 };
@@ -63,6 +79,8 @@ int decoder_mp3_open(struct decoder **decoder, const unsigned char *config,
 	/* Init structure */
 	dec->pcm_remain = 0;
 	dec->buffer_len = 0;
+	dec->samplerate = 0;
+	dec->channels = 0;
 
 	/* Initialize mad */
 	mad_stream_init(&dec->Stream);
@@ -117,6 +135,130 @@ inline int32_t mad_scale(mad_fixed_t sample)
 }
 #endif
 
+/* Convert planar samples to interleaved output samples: right is NULL for mono
+ * frames. The SIMD versions give exactly the same result as mad_scale().
+ */
+#ifdef USE_FLOAT
+static void decoder_mp3_convert(float *p, const mad_fixed_t *left,
+				const mad_fixed_t *right, size_t len)
+#else
+static void decoder_mp3_convert(int32_t *p, const mad_fixed_t *left,
+				const mad_fixed_t *right, size_t len)
+#endif
+{
+	size_t i = 0;
+
+#if defined(MP3_SSE2)
+#ifdef USE_FLOAT
+	const __m128 scale = _mm_set1_ps(1.0f / (1L << MAD_F_FRACBITS));
+	__m128 l, r;
+
+	for(; i + 4 <= len; i += 4)
+	{
+		l = _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128(
+					     (const __m128i *) &left[i])), scale);
+		if(right == NULL)
+		{
+			_mm_storeu_ps(&p[i], l);
+			continue;
+		}
+		r = _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128(
+					    (const __m128i *) &right[i])), scale);
+		_mm_storeu_ps(&p[i*2], _mm_unpacklo_ps(l, r));
+		_mm_storeu_ps(&p[i*2+4], _mm_unpackhi_ps(l, r));
+	}
+#else
+	const __m128i round = _mm_set1_epi32(1L << 4);
+	const __m128i max = _mm_set1_epi32(MAD_F_ONE - 1);
+	const __m128i min = _mm_set1_epi32(-MAD_F_ONE);
+	const __m128i mask = _mm_set1_epi32(0xFFFFFF00);
+	__m128i l, r, m;
+
+#define MP3_SCALE_SSE2(x) \
+	x = _mm_add_epi32(x, round); \
+	m = _mm_cmpgt_epi32(x, max); \
+	x = _mm_or_si128(_mm_and_si128(m, max), _mm_andnot_si128(m, x)); \
+	m = _mm_cmplt_epi32(x, min); \
+	x = _mm_or_si128(_mm_and_si128(m, min), _mm_andnot_si128(m, x)); \
+	x = _mm_and_si128(_mm_slli_epi32(x, 3), mask);
+
+	for(; i + 4 <= len; i += 4)
+	{
+		l = _mm_loadu_si128((const __m128i *) &left[i]);
+		MP3_SCALE_SSE2(l);
+		if(right == NULL)
+		{
+			_mm_storeu_si128((__m128i *) &p[i], l);
+			continue;
+		}
+		r = _mm_loadu_si128((const __m128i *) &right[i]);
+		MP3_SCALE_SSE2(r);
+		_mm_storeu_si128((__m128i *) &p[i*2], _mm_unpacklo_epi32(l, r));
+		_mm_storeu_si128((__m128i *) &p[i*2+4],
+				 _mm_unpackhi_epi32(l, r));
+	}
+#undef MP3_SCALE_SSE2
+#endif
+#elif defined(MP3_NEON)
+#ifdef USE_FLOAT
+	const float scale = 1.0f / (1L << MAD_F_FRACBITS);
+	float32x4x2_t x;
+	float32x4_t l;
+
+	for(; i + 4 <= len; i += 4)
+	{
+		l = vmulq_n_f32(vcvtq_f32_s32(vld1q_s32(&left[i])), scale);
+		if(right == NULL)
+		{
+			vst1q_f32(&p[i], l);
+			continue;
+		}
+		x.val[0] = l;
+		x.val[1] = vmulq_n_f32(vcvtq_f32_s32(vld1q_s32(&right[i])),
+				       scale);
+		vst2q_f32(&p[i*2], x);
+	}
+#else
+	const int32x4_t round = vdupq_n_s32(1L << 4);
+	const int32x4_t max = vdupq_n_s32(MAD_F_ONE - 1);
+	const int32x4_t min = vdupq_n_s32(-MAD_F_ONE);
+	const int32x4_t mask = vdupq_n_s32(0xFFFFFF00);
+	int32x4x2_t x;
+	int32x4_t l;
+
+#define MP3_SCALE_NEON(v) \
+	vandq_s32(vshlq_n_s32(vmaxq_s32(vminq_s32(vaddq_s32(v, round), max), \
+					min), 3), mask)
+
+	for(; i + 4 <= len; i += 4)
+	{
+		l = MP3_SCALE_NEON(vld1q_s32(&left[i]));
+		if(right == NULL)
+		{
+			vst1q_s32(&p[i], l);
+			continue;
+		}
+		x.val[0] = l;
+		x.val[1] = MP3_SCALE_NEON(vld1q_s32(&right[i]));
+		vst2q_s32(&p[i*2], x);
+	}
+#undef MP3_SCALE_NEON
+#endif
+#endif
+
+	/* Convert last samples */
+	for(; i < len; i++)
+	{
+		if(right == NULL)
+		{
+			p[i] = mad_scale(left[i]);
+			continue;
+		}
+		p[i*2] = mad_scale(left[i]);
+		p[i*2+1] = mad_scale(right[i]);
+	}
+}
+
 static long decoder_mp3_fill_output(struct decoder *dec,
 				    unsigned char *output_buffer,
 				    size_t output_size)
@@ -126,19 +268,32 @@ static long decoder_mp3_fill_output(struct decoder *dec,
 #else
 	int32_t *p = (int32_t*) output_buffer;
 #endif
+	unsigned short channels = dec->Synth.pcm.channels;
 	unsigned short pos;
+	size_t len;
 	int i;
 
 	pos = dec->Synth.pcm.length - dec->pcm_remain;
 
-	for(i = 0; pos < dec->Synth.pcm.length && i < output_size;
-	    pos++, i += dec->Synth.pcm.channels)
+	/* Convert all complete frames which fit in output buffer */
+	len = channels > 0 ? output_size / channels : 0;
+	if(len > dec->pcm_remain)
+		len = dec->pcm_remain;
+	decoder_mp3_convert(p, &dec->Synth.pcm.samples[0][pos],
+			    channels == 2 ? &dec->Synth.pcm.samples[1][pos] :
+					    NULL, len);
+	p += len * channels;
+	pos += len;
+	i = len * channels;
+
+	for(; pos < dec->Synth.pcm.length && i < output_size;
+	    pos++, i += channels)
 	{
 		/* Left channel */
 		*(p++) = mad_scale(dec->Synth.pcm.samples[0][pos]);
 
 		/* Right channel */
-		if(dec->Synth.pcm.channels == 2)
+		if(channels == 2)
 			*(p++) = mad_scale(dec->Synth.pcm.samples[1][pos]);
 	}
 
@@ -151,7 +306,11 @@ int decoder_mp3_decode(struct decoder *dec, unsigned char *in_buffer,
 		       size_t in_size, unsigned char *out_buffer,
 		       size_t out_size, struct decoder_info *info)
 {
-	unsigned short size = 0;
+	unsigned long samplerate = 0;
+	unsigned char channels = 0;
+	size_t size = 0;
+	size_t len;
+	int ret;
 
 	/* Reset position of PCM output buffer */
 	if(in_buffer == NULL && out_buffer == NULL)
@@ -180,27 +339,34 @@ int decoder_mp3_decode(struct decoder *dec, unsigned char *in_buffer,
 	if(in_size == 0)
 		return 0;
 
-	/* Copy data to internal buffer */
-	if(in_size > BUFFER_SIZE-dec->buffer_len)
-		in_size = BUFFER_SIZE-dec->buffer_len;
-	memcpy(dec->buffer+dec->buffer_len, in_buffer, in_size);
-	dec->buffer_len += in_size;
-
-	/* Add frame to stream */
-	mad_stream_buffer(&dec->Stream, dec->buffer, dec->buffer_len);
-
-	/* Decode a new frame */
-	while(mad_frame_decode(&dec->Frame, &dec->Stream))
+	/* Decode as many frames as the output buffer can handle */
+	info->used = 0;
+	while(1)
 	{
-		if(MAD_RECOVERABLE(dec->Stream.error))
-		{
-			/* Needs more frame */
-			continue;
-		}
-		else
+		/* Copy data to internal buffer */
+		len = in_size - info->used;
+		if(len > BUFFER_SIZE - dec->buffer_len)
+			len = BUFFER_SIZE - dec->buffer_len;
+		memcpy(dec->buffer + dec->buffer_len, in_buffer + info->used,
+		       len);
+		dec->buffer_len += len;
+		info->used += len;
+
+		/* Add frame to stream */
+		mad_stream_buffer(&dec->Stream, dec->buffer, dec->buffer_len);
+
+		/* Decode a new frame (skip recoverable errors) */
+		do {
+			ret = mad_frame_decode(&dec->Frame, &dec->Stream);
+		} while(ret != 0 && MAD_RECOVERABLE(dec->Stream.error));
+
+		if(ret != 0)
 		{
+			/* Return already decoded frames */
+			if(size > 0)
+				break;
+
 			/* Update buffer */
-			info->used = in_size;
 			info->remaining = 0;
 
 			if(dec->Stream.error == MAD_ERROR_BUFLEN)
@@ -208,24 +374,41 @@ int decoder_mp3_decode(struct decoder *dec, unsigned char *in_buffer,
 			else
 				return DECODER_ERROR_SYNC;
 		}
-	}
 
-	/* Move remaining data to buffer start */
-	dec->buffer_len -= dec->Stream.next_frame - dec->Stream.buffer;
-	memmove(dec->buffer, dec->Stream.next_frame, dec->buffer_len);
-
-	/* Synthethise PCM */
-	mad_synth_frame(&dec->Synth, &dec->Frame);
-
-	/* Fill output buffer with PCM */
-	dec->pcm_remain = dec->Synth.pcm.length;
-	size = decoder_mp3_fill_output(dec, out_buffer, out_size);
+		/* Move remaining data to buffer start */
+		dec->buffer_len -= dec->Stream.next_frame - dec->Stream.buffer;
+		memmove(dec->buffer, dec->Stream.next_frame, dec->buffer_len);
+
+		/* Synthethise PCM */
+		mad_synth_frame(&dec->Synth, &dec->Frame);
+		dec->pcm_remain = dec->Synth.pcm.length;
+
+		/* Format has changed: keep PCM for next call */
+		if(size > 0 && (dec->Frame.header.samplerate != samplerate ||
+				MAD_NCHANNELS(&dec->Frame.header) != channels))
+			break;
+
+		/* Fill output buffer with PCM */
+		samplerate = dec->Frame.header.samplerate;
+		channels = MAD_NCHANNELS(&dec->Frame.header);
+		size += decoder_mp3_fill_output(dec, out_buffer + size * 4,
+						out_size - size);
+
+		/* Stop when output buffer can't handle another frame or when
+		 * format has changed since last call, since caller can only
+		 * rewind the last frame with a reset.
+		 */
+		if(dec->pcm_remain > 0 || out_size - size < MAX_FRAME_SAMPLES ||
+		   samplerate != dec->samplerate || channels != dec->channels)
+			break;
+	}
+	dec->samplerate = samplerate;
+	dec->channels = channels;
 
 	/* Update buffer */
-	info->used = in_size;
 	info->remaining = dec->pcm_remain;
-	info->samplerate = dec->Frame.header.samplerate;
-	info->channels = MAD_NCHANNELS(&dec->Frame.header);
+	info->samplerate = samplerate;
+	info->channels = channels;
 
 	return size;
 }
@@ -19,18 +19,29 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <pthread.h>
 
 #include "demux_mp3.h"
 #include "demux_mp4.h"
 #include "demux.h"
 #include "vring.h"
+#include "trace.h"
 #include "fs.h"
+#include "thread.h"
+#include "executor.h"
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
 
+/* Maximum time in ms a reader waits for a frame from demuxer thread */
+#define DEMUX_WAIT_TIMEOUT 50
+
+/* In task mode, a full ring buffer is checked again after DEMUX_TASK_POLL ms
+ * (a reader doesn't wake up tasks) */
+#define DEMUX_TASK_POLL 20
+
 struct demux_handle {
 	/* Demuxer handler */
 	struct demux_module module;
@@ -47,22 +58,58 @@ struct demux_handle {
 	/* Stream position in ring buffer */
 	off_t start_pos;
 	off_t end_pos;
-	/* Demuxer thread */
+	/* Demuxer thread (a task is used instead of thread in task mode) */
 	int use_thread;
 	int thread_running;
 	pthread_t thread;
+	struct task *task;
 	pthread_mutex_t mutex;
+	int full;
+	/* Seek table length already known by user */
+	unsigned long seek_count;
 };
 
 static void *demux_thread(void *user_data);
+static int demux_task(void *user_data, struct task *t);
+
+static int demux_start_thread(struct demux_handle *h)
+{
+	/* Fill ring buffer on shared workers or in a thread */
+	h->thread_running = 1;
+	h->task = NULL;
+	if(executor_is_enabled())
+		h->task = task_new(demux_task, h, "demux");
+	if(h->task == NULL &&
+	   pthread_create(&h->thread, NULL, demux_thread, h) != 0)
+	{
+		h->thread_running = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void demux_join_thread(struct demux_handle *h)
+{
+	/* Wait end of task or thread */
+	if(h->task != NULL)
+	{
+		task_wake(h->task);
+		task_join(h->task);
+		h->task = NULL;
+	}
+	else
+		pthread_join(h->thread, NULL);
+}
 
 int demux_open(struct demux_handle **handle, const char *uri,
 	       unsigned long *samplerate, unsigned char *channels,
-	       size_t cache_size, int use_thread)
+	       size_t cache_size, int use_thread, unsigned int flags)
 {
 	struct demux_handle *h;
 	struct demux_module *d;
 	struct fs_file *file;
+	struct fs_file *ra;
 	struct stat st;
 	const char *ext;
 	int len;
@@ -85,6 +132,14 @@ int demux_open(struct demux_handle **handle, const char *uri,
 	if(file == NULL)
 		return -1;
 
+	/* File is read sequentially during playback */
+	fs_advise(file, 0, 0, FS_ADVICE_SEQUENTIAL);
+
+	/* Read file by large blocks (or directly if not possible) */
+	ra = fs_readahead_open(file, 0);
+	if(ra != NULL)
+		file = ra;
+
 	/* Allocate handle */
 	*handle = malloc(sizeof(struct demux_handle));
 	if(*handle == NULL)
@@ -102,12 +157,12 @@ int demux_open(struct demux_handle **handle, const char *uri,
 		h->file_size = st.st_size;
 
 	/* Open demuxer */
-	if(h->module.open(&h->demux, file, h->file_size, samplerate, channels)
-	   != 0)
+	if(h->module.open(&h->demux, file, h->file_size, samplerate, channels,
+			  flags) != 0)
 		return -1;
 
 	/* Allocate vring buffer */
-	if(vring_open(&h->ring, cache_size, 8192) != 0)
+	if(vring_open(&h->ring, cache_size, 8192, VRING_SPSC) != 0)
 		return -1;
 
 	/* Init mutex */
@@ -117,7 +172,7 @@ int demux_open(struct demux_handle **handle, const char *uri,
 	if(h->use_thread)
 	{
 		/* Start thread */
-		if(pthread_create(&h->thread, NULL, demux_thread, h) != 0)
+		if(demux_start_thread(h) != 0)
 			return -1;
 	}
 
@@ -151,11 +206,20 @@ static ssize_t demux_fill_buffer(struct demux_handle *h)
 	/* Get writting buffer from ring buffer */
 	size = vring_write(h->ring, (unsigned char**) &frame);
 	if(size <= sizeof(struct demux_frame))
+	{
+		h->full = 1;
 		return 0;
+	}
+	h->full = 0;
+
+	/* Frame data follows frame by default */
+	frame->data = (unsigned char *) (frame + 1);
+	frame->ref = NULL;
 
 	/* Try to get next frame from stream */
 	len = h->module.next_frame(h->demux, frame,
 				   size - sizeof(struct demux_frame));
+	frame->time = trace_is_enabled() ? trace_now() : 0;
 	if(len <= 0)
 		return len;
 
@@ -168,11 +232,35 @@ static ssize_t demux_fill_buffer(struct demux_handle *h)
 	return len;
 }
 
+static void demux_forward(struct demux_handle *h, size_t len)
+{
+	struct demux_frame *f;
+	size_t off = 0;
+
+	/* Release blocks mapped by forwarded frames */
+	while(off < len)
+	{
+		if(vring_read(h->ring, (unsigned char **) &f,
+			      sizeof(struct demux_frame), off) <
+		   sizeof(struct demux_frame))
+			break;
+		if(f->ref != NULL)
+			fs_readahead_unmap(h->file, f->ref);
+		off += f->len + sizeof(struct demux_frame);
+	}
+
+	/* Forward read position */
+	vring_read_forward(h->ring, len);
+}
+
 static void *demux_thread(void *user_data)
 {
 	struct demux_handle *h = user_data;
 	ssize_t len;
 
+	/* Set thread scheduling and name */
+	thread_setup(THREAD_DEMUX, "demux");
+
 	/* Thread running */
 	h->thread_running = 1;
 
@@ -185,6 +273,17 @@ static void *demux_thread(void *user_data)
 		/* Fill buffer */
 		len = demux_fill_buffer(h);
 
+		/* Ring buffer is full: sleep until reader frees some space */
+		if(len == 0 && h->full)
+		{
+			pthread_mutex_unlock(&h->mutex);
+			if(h->use_thread)
+				vring_wait_writable(h->ring,
+					       sizeof(struct demux_frame) + 1,
+					       0);
+			continue;
+		}
+
 		/* End of stream */
 		if(len < 0)
 		{
@@ -194,12 +293,16 @@ static void *demux_thread(void *user_data)
 			/* Unlock thread */
 			pthread_mutex_unlock(&h->mutex);
 
+			/* Wake up reader waiting for a frame */
+			vring_wake(h->ring);
+
 			return NULL;
 		}
 
 		/* Unlock thread */
 		pthread_mutex_unlock(&h->mutex);
 
+		/* No data available from stream yet */
 		if(len == 0)
 			usleep(10000);
 	}
@@ -210,6 +313,52 @@ static void *demux_thread(void *user_data)
 	return NULL;
 }
 
+static int demux_task(void *user_data, struct task *t)
+{
+	struct demux_handle *h = user_data;
+	ssize_t len;
+
+	/* Closed */
+	if(!h->use_thread)
+	{
+		h->thread_running = 0;
+		return TASK_DONE;
+	}
+
+	/* Lock thread */
+	pthread_mutex_lock(&h->mutex);
+
+	/* Fill buffer */
+	len = demux_fill_buffer(h);
+
+	/* End of stream */
+	if(len < 0)
+	{
+		/* Thread stopped */
+		h->thread_running = 0;
+
+		/* Unlock thread */
+		pthread_mutex_unlock(&h->mutex);
+
+		/* Wake up reader waiting for a frame */
+		vring_wake(h->ring);
+
+		return TASK_DONE;
+	}
+
+	/* Unlock thread */
+	pthread_mutex_unlock(&h->mutex);
+
+	/* Ring buffer is full or no data is available from stream yet */
+	if(len == 0)
+	{
+		task_timeout(t, h->full ? DEMUX_TASK_POLL : 10);
+		return TASK_WAIT;
+	}
+
+	return TASK_AGAIN;
+}
+
 ssize_t demux_get_frame(struct demux_handle *h, unsigned char **buffer)
 {
 	if(h == NULL || buffer == NULL)
@@ -260,12 +409,25 @@ ssize_t demux_get_next_frame(struct demux_handle *h, unsigned char **buffer)
 		h->start_pos += h->frame_len;
 
 		/* Forward to next frame */
-		vring_read_forward(h->ring,
-				   h->frame_len + sizeof(struct demux_frame));
+		demux_forward(h, h->frame_len + sizeof(struct demux_frame));
 		h->frame_data = NULL;
 		h->frame_len = 0;
 	}
 
+	/* Wait for a complete frame from thread */
+	if(h->use_thread && h->thread_running)
+	{
+		len = vring_wait_readable(h->ring, sizeof(struct demux_frame),
+					  DEMUX_WAIT_TIMEOUT);
+		if(len >= sizeof(struct demux_frame))
+		{
+			vring_read(h->ring, (unsigned char **) &f, 0, 0);
+			vring_wait_readable(h->ring,
+					    f->len + sizeof(struct demux_frame),
+					    DEMUX_WAIT_TIMEOUT);
+		}
+	}
+
 	/* Get new frame */
 	len = vring_read(h->ring, (unsigned char **) &f, 0, 0);
 	if(len == 0 && (fill_len < 0 || (h->use_thread && !h->thread_running)))
@@ -288,6 +450,82 @@ ssize_t demux_get_next_frame(struct demux_handle *h, unsigned char **buffer)
 	return f->len;
 }
 
+int demux_get_frames(struct demux_handle *h, struct demux_frame **frames,
+		     unsigned int count, size_t *pos)
+{
+	struct demux_frame *f;
+	unsigned char *buffer;
+	size_t buffer_len;
+	size_t off = 0;
+	unsigned int n;
+	ssize_t len;
+
+	if(h == NULL || frames == NULL || pos == NULL || count == 0)
+		return -1;
+
+	/* Get current frame (or next one when all frame has been used) */
+	len = demux_get_frame(h, &buffer);
+	if(len <= 0)
+		return len;
+	*pos = h->frame_pos;
+
+	/* Current frame is at start of ring buffer and next frames follow */
+	buffer_len = vring_get_length(h->ring);
+	for(n = 0; n < count; n++)
+	{
+		if(off + sizeof(struct demux_frame) > buffer_len)
+			break;
+
+		/* Only complete frames are returned */
+		len = vring_read(h->ring, (unsigned char **) &f, 0, off);
+		if(len < sizeof(struct demux_frame) ||
+		   f->len + sizeof(struct demux_frame) > len)
+			break;
+
+		frames[n] = f;
+		off += f->len + sizeof(struct demux_frame);
+	}
+
+	return n;
+}
+
+void demux_set_used_frames(struct demux_handle *h, unsigned int count,
+			   size_t len)
+{
+	struct demux_frame *f;
+	ssize_t size;
+
+	if(h == NULL)
+		return;
+
+	/* Forward fully used frames */
+	while(count-- > 0 && h->frame_len > 0)
+	{
+		/* Update start position in ring buffer */
+		h->start_pos += h->frame_len;
+
+		/* Forward to next frame */
+		demux_forward(h, h->frame_len + sizeof(struct demux_frame));
+		h->frame_data = NULL;
+		h->frame_len = 0;
+		h->frame_pos = 0;
+
+		/* Next frame has already been returned by demux_get_frames() */
+		size = vring_read(h->ring, (unsigned char **) &f, 0, 0);
+		if(size < sizeof(struct demux_frame) ||
+		   f->len + sizeof(struct demux_frame) > size)
+			break;
+
+		/* Update current frame */
+		h->frame_data = f->data;
+		h->frame_len = f->len;
+		h->start_pos += f->pos;
+	}
+
+	/* Set used bytes in current frame */
+	h->frame_pos += len;
+}
+
 unsigned long demux_set_pos(struct demux_handle *h, unsigned long pos)
 {
 	struct demux_frame *frame;
@@ -306,7 +544,7 @@ unsigned long demux_set_pos(struct demux_handle *h, unsigned long pos)
 		pthread_mutex_lock(&h->mutex);
 
 		/* Flush ring buffer */
-		vring_read_forward(h->ring, vring_get_length(h->ring));
+		demux_forward(h, vring_get_length(h->ring));
 		h->frame_data = NULL;
 		h->frame_len = 0;
 		h->start_pos = 0;
@@ -319,12 +557,14 @@ unsigned long demux_set_pos(struct demux_handle *h, unsigned long pos)
 		if(h->use_thread && !h->thread_running)
 		{
 			/* Wait end of thread */
-			pthread_join(h->thread, NULL);
+			demux_join_thread(h);
 
 			/* Restart thread */
-			if(pthread_create(&h->thread, NULL, demux_thread, h)
-			   != 0)
+			if(demux_start_thread(h) != 0)
+			{
+				pthread_mutex_unlock(&h->mutex);
 				return -1;
+			}
 		}
 
 		/* Unlock thread */
@@ -355,7 +595,7 @@ unsigned long demux_set_pos(struct demux_handle *h, unsigned long pos)
 		len = buffer_len;
 
 	/* Move to this frame */
-	vring_read_forward(h->ring, len);
+	demux_forward(h, len);
 	h->start_pos = frame->pos;
 	h->frame_data = NULL;
 	h->frame_len = 0;
@@ -363,6 +603,69 @@ unsigned long demux_set_pos(struct demux_handle *h, unsigned long pos)
 	return new_pos;
 }
 
+unsigned long demux_get_seek_skip(struct demux_handle *h)
+{
+	if(h == NULL || h->module.get_seek_skip == NULL)
+		return 0;
+
+	return h->module.get_seek_skip(h->demux);
+}
+
+int demux_get_seek_table(struct demux_handle *h, uint32_t **table,
+			 unsigned long *count)
+{
+	const uint32_t *t;
+	unsigned long c;
+	int ret = -1;
+
+	if(h == NULL || h->module.get_seek_table == NULL)
+		return -1;
+
+	/* Lock thread */
+	pthread_mutex_lock(&h->mutex);
+
+	/* Copy table if it has new entries */
+	c = h->module.get_seek_table(h->demux, &t);
+	if(c > h->seek_count)
+	{
+		*table = malloc(c * sizeof(uint32_t));
+		if(*table != NULL)
+		{
+			memcpy(*table, t, c * sizeof(uint32_t));
+			*count = c;
+			h->seek_count = c;
+			ret = 0;
+		}
+	}
+
+	/* Unlock thread */
+	pthread_mutex_unlock(&h->mutex);
+
+	return ret;
+}
+
+int demux_set_seek_table(struct demux_handle *h, const uint32_t *table,
+			 unsigned long count)
+{
+	int ret;
+
+	if(h == NULL || h->module.set_seek_table == NULL || table == NULL)
+		return -1;
+
+	/* Lock thread */
+	pthread_mutex_lock(&h->mutex);
+
+	/* Set table */
+	ret = h->module.set_seek_table(h->demux, table, count);
+	if(ret == 0)
+		h->seek_count = count;
+
+	/* Unlock thread */
+	pthread_mutex_unlock(&h->mutex);
+
+	return ret;
+}
+
 void demux_close(struct demux_handle *h)
 {
 	if(h == NULL)
@@ -372,10 +675,15 @@ void demux_close(struct demux_handle *h)
 	if(h->use_thread)
 	{
 		/* Stop thread */
+		pthread_mutex_lock(&h->mutex);
 		h->use_thread = 0;
+		pthread_mutex_unlock(&h->mutex);
+
+		/* Flush ring buffer to wake up thread waiting for space */
+		demux_forward(h, vring_get_length(h->ring));
 
 		/* Wait end of thread */
-		pthread_join(h->thread, NULL);
+		demux_join_thread(h);
 	}
 
 	/* Close demuxer */
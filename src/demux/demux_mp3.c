@@ -20,6 +20,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <stdint.h>
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
@@ -33,6 +34,11 @@
  */
 #define BUFFER_SIZE 8192
 
+/**
+ * Seek table allocation step (in entries).
+ */
+#define SEEK_TABLE_STEP 256
+
 unsigned int bitrates[2][3][15] = {
 	{ /* MPEG-1 */
 		{0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384,
@@ -66,8 +72,7 @@ struct mp3_frame {
 	unsigned int bitrate;
 	unsigned long samplerate;
 	unsigned char padding;
-	unsigned char channels; /* 0: Mono, 1: Stereo, 2: Joint Stereo,
-				   3: Dual channel */
+	unsigned char channels; /* 1: Mono, 2: Stereo (all other modes) */
 	unsigned int samples;
 	unsigned int length;
 };
@@ -92,6 +97,20 @@ struct demux {
 	unsigned int toc_size;
 	unsigned int toc_count;
 	unsigned int toc_frames;
+	/* Seek table built while reading: offset of one frame every step
+	 * frames (about one second), from first frame.
+	 */
+	uint32_t *seek_table;
+	unsigned long seek_count;
+	unsigned long seek_size;
+	unsigned int seek_step;
+	unsigned long samplerate;
+	unsigned int samples;
+	/* Samples from seek frame up to last asked position (if known) */
+	unsigned long seek_skip;
+	/* Index of next frame (if known) */
+	unsigned long cur_frame;
+	int cur_frame_valid;
 	/* First frame offset */
 	unsigned long offset;
 	/* Waiting frame */
@@ -202,7 +221,7 @@ static int demux_mp3_parse_xing(struct mp3_frame *f,
 		return -1;
 
 	/* Calculate header position */
-	offset = f->channels == 0 ?
+	offset = f->channels == 1 ?
 		(f->mpeg == 0 ? 21 : 13) : (f->mpeg == 0 ? 36 : 21);
 	if(offset + 120 > f->length)
 		return -1;
@@ -225,11 +244,15 @@ static int demux_mp3_parse_xing(struct mp3_frame *f,
 
 	/* Number of Frames */
 	if(flags & 0x0001)
+	{
 		d->nb_frame  = READ32(buffer);
+	}
 
 	/* Number of Bytes */
 	if(flags & 0x0002)
+	{
 		d->nb_bytes  = READ32(buffer);
+	}
 
 	/* TOC entries */
 	if(flags & 0x0004)
@@ -245,7 +268,9 @@ static int demux_mp3_parse_xing(struct mp3_frame *f,
 
 	/* Quality indicator */
 	if(flags & 0x0008)
+	{
 		d->quality  = READ32(buffer);
+	}
 
 	return 0;
 }
@@ -325,7 +350,8 @@ static int demux_mp3_parse_vbri(struct mp3_frame *f,
 #define ID3V2_SIZE(b) (((b)[0] << 21) | ((b)[1] << 14) | ((b)[2] << 7) | (b)[3])
 
 int demux_mp3_open(struct demux **demux, struct fs_file *file, size_t file_size,
-		   unsigned long *samplerate, unsigned char *channels)
+		   unsigned long *samplerate, unsigned char *channels,
+		   unsigned int flags)
 {
 	struct demux *d;
 	struct mp3_frame frame;
@@ -425,6 +451,15 @@ int demux_mp3_open(struct demux **demux, struct fs_file *file, size_t file_size,
 	d->offset = first;
 	fs_lseek(file, d->offset, SEEK_SET);
 
+	/* Seek table is built only when no TOC is available */
+	d->samplerate = frame.samplerate;
+	d->samples = frame.samples;
+	d->seek_step = frame.samplerate / frame.samples;
+	if(d->seek_step == 0)
+		d->seek_step = 1;
+	d->cur_frame_valid = d->toc == NULL && d->vbri_toc == NULL;
+	d->cur_frame = 0;
+
 	/* Calculate stream duration */
 	if(d->nb_frame > 0)
 	{
@@ -442,6 +477,7 @@ int demux_mp3_open(struct demux **demux, struct fs_file *file, size_t file_size,
 	d->meta.channels = frame.channels;
 	d->meta.bitrate = frame.bitrate;
 	d->meta.length = d->duration;
+	d->meta.stream_offset = d->offset;
 	d->meta.title = d->title;
 	d->meta.artist = d->artist;
 	d->meta.album = d->album;
@@ -456,7 +492,7 @@ int demux_mp3_open(struct demux **demux, struct fs_file *file, size_t file_size,
 
 	/* Update samplerate and channels */
 	*samplerate = frame.samplerate;
-	if(frame.channels == 0)
+	if(frame.channels == 1)
 		*channels = 1;
 	else
 		*channels = 2;
@@ -478,6 +514,28 @@ int demux_mp3_get_dec_config(struct demux *d, int *codec,
 	return 0;
 }
 
+static void demux_mp3_add_seek(struct demux *d, off_t pos)
+{
+	uint32_t *table;
+
+	/* Grow seek table */
+	if(d->seek_count == d->seek_size)
+	{
+		table = realloc(d->seek_table, (d->seek_size +
+				SEEK_TABLE_STEP) * sizeof(uint32_t));
+		if(table == NULL)
+		{
+			d->cur_frame_valid = 0;
+			return;
+		}
+		d->seek_table = table;
+		d->seek_size += SEEK_TABLE_STEP;
+	}
+
+	/* Add frame offset */
+	d->seek_table[d->seek_count++] = pos;
+}
+
 ssize_t demux_mp3_next_frame(struct demux *d, struct demux_frame *frame,
 			     size_t size)
 {
@@ -548,7 +606,14 @@ ssize_t demux_mp3_next_frame(struct demux *d, struct demux_frame *frame,
 	if(size < d->waiting_frame.length)
 		return 0;
 
-	/* Get frame content */
+	/* Get frame content: map it with its header from readahead block */
+	if(d->waiting_read == 0 &&
+	   fs_readahead_map(d->file, d->waiting_header_pos,
+			    d->waiting_frame.length, &frame->data,
+			    &frame->ref) == 0)
+		d->waiting_read = d->waiting_frame.length - 4;
+
+	/* Or read it */
 	while(d->waiting_read < d->waiting_frame.length-4)
 	{
 		len = fs_read(d->file, frame->data + 4 + d->waiting_read,
@@ -559,11 +624,20 @@ ssize_t demux_mp3_next_frame(struct demux *d, struct demux_frame *frame,
 	}
 
 	/* Copy header */
-	memcpy(frame->data, d->waiting_header, 4);
+	if(frame->ref == NULL)
+		memcpy(frame->data, d->waiting_header, 4);
 	frame->len = d->waiting_frame.length;
 	frame->pos = d->waiting_header_pos;
 	d->waiting = 0;
 
+	/* Update seek table */
+	if(d->cur_frame_valid)
+	{
+		if(d->cur_frame == d->seek_count * d->seek_step)
+			demux_mp3_add_seek(d, frame->pos);
+		d->cur_frame++;
+	}
+
 	return frame->len;
 }
 
@@ -579,7 +653,18 @@ unsigned long demux_mp3_calc_pos(struct demux *d, unsigned long pos,
 		return pos;
 
 	/* Calculate new position */
-	if(d->vbri_toc != NULL)
+	d->seek_skip = 0;
+	i = (uint64_t) pos * d->samplerate / d->samples / d->seek_step;
+	if(i < d->seek_count)
+	{
+		/* Use seek table: position is exact */
+		*f_pos = d->seek_table[i];
+		d->seek_skip = (uint64_t) pos * d->samplerate -
+			       (uint64_t) i * d->seek_step * d->samples;
+		return (uint64_t) i * d->seek_step * d->samples /
+		       d->samplerate;
+	}
+	else if(d->vbri_toc != NULL)
 	{
 		/* Use TOC from VBRI header */
 		i = pos * (d->toc_count - 1) / d->duration;
@@ -639,8 +724,14 @@ unsigned long demux_mp3_calc_pos(struct demux *d, unsigned long pos,
 
 unsigned long demux_mp3_set_pos(struct demux *d, unsigned long pos)
 {
+	unsigned long i;
 	off_t f_pos;
 
+	/* Frame index is known only from seek table */
+	i = (uint64_t) pos * d->samplerate / d->samples / d->seek_step;
+	d->cur_frame_valid = i < d->seek_count;
+	d->cur_frame = i * d->seek_step;
+
 	/* Calculate position in stream */
 	pos = demux_mp3_calc_pos(d, pos, &f_pos);
 
@@ -648,9 +739,45 @@ unsigned long demux_mp3_set_pos(struct demux *d, unsigned long pos)
 	if(fs_lseek(d->file, f_pos, SEEK_SET) != f_pos)
 		return -1;
 
+	/* Drop partial frame */
+	d->waiting = 0;
+
 	return pos;
 }
 
+unsigned long demux_mp3_get_seek_table(struct demux *d,
+				       const uint32_t **table)
+{
+	*table = d->seek_table;
+	return d->seek_count;
+}
+
+unsigned long demux_mp3_get_seek_skip(struct demux *d)
+{
+	return d->seek_skip;
+}
+
+int demux_mp3_set_seek_table(struct demux *d, const uint32_t *table,
+			     unsigned long count)
+{
+	uint32_t *t;
+
+	/* Not used with a TOC or when already longer */
+	if(d->toc != NULL || d->vbri_toc != NULL || count <= d->seek_count)
+		return -1;
+
+	/* Copy table */
+	t = realloc(d->seek_table, count * sizeof(uint32_t));
+	if(t == NULL)
+		return -1;
+	memcpy(t, table, count * sizeof(uint32_t));
+	d->seek_table = t;
+	d->seek_count = count;
+	d->seek_size = count;
+
+	return 0;
+}
+
 #define FREE_STR(s) if(s != NULL) free(s)
 
 void demux_mp3_close(struct demux *d)
@@ -663,6 +790,8 @@ void demux_mp3_close(struct demux *d)
 		free(d->toc);
 	if(d->vbri_toc != NULL)
 		free(d->vbri_toc);
+	if(d->seek_table != NULL)
+		free(d->seek_table);
 
 	/* Free metadata */
 	FREE_STR(d->title);
@@ -684,6 +813,9 @@ struct demux_module demux_mp3 = {
 	.next_frame = &demux_mp3_next_frame,
 	.calc_pos = &demux_mp3_calc_pos,
 	.set_pos = &demux_mp3_set_pos,
+	.get_seek_table = &demux_mp3_get_seek_table,
+	.set_seek_table = &demux_mp3_set_seek_table,
+	.get_seek_skip = &demux_mp3_get_seek_skip,
 	.close = &demux_mp3_close,
 };
 
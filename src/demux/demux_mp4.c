@@ -34,6 +34,12 @@
  */
 #define BUFFER_SIZE 8192
 
+/**
+ * Maximum forward gap which is read instead of seeked: on remote file systems,
+ * each seek is a new request.
+ */
+#define SKIP_MAX_SIZE 65536
+
 #define ATOM_CHECK(b, a) memcmp(&(b)[4], a, 4)
 #define ATOM_READ16(b) ((b)[0] << 8) | (b)[1]
 #define ATOM_READ32(b) ((b)[0] << 24) | ((b)[1] << 16) | ((b)[2] << 8) | \
@@ -48,34 +54,50 @@
 		       (unsigned long long)(b)[7]
 #define ATOM_LEN(b) (ATOM_READ32(b))
 
+/* Sample-to-chunk run (from "stsc" atom) */
+struct mp4_stsc_run {
+	uint32_t first_chunk;		/* First chunk of run (from 0) */
+	uint32_t first_sample;		/* First sample of run */
+	uint32_t samples_per_chunk;	/* Sample count in each chunk of run */
+};
+
+/* Time-to-sample run (from "stts" atom) */
+struct mp4_stts_run {
+	uint64_t first_time;		/* Time of first sample of run */
+	uint32_t first_sample;		/* First sample of run */
+	uint32_t delta;			/* Duration of each sample of run */
+};
+
 struct demux {
 	/* Internal buffer */
 	struct fs_file *file;
 	unsigned char *buffer;
 	unsigned long buffer_size;
 	unsigned long size;
+	unsigned int flags;
+	/* Stream position: seek to pos is delayed until next read */
+	off_t pos;
+	off_t file_pos;
 	/* Stream meta */
 	struct meta meta;
 	/* MP4 Atoms */
 	/* mdhd atom */
 	int32_t mdhd_time_scale;
 	int64_t mdhd_duration;
-	/* stsz atom */
+	/* stsz atom: sizes are stored on 16 bits when all of them fit */
 	int32_t stsz_sample_size;
 	int32_t stsz_sample_count;
-	int32_t *stsz_table;
+	uint16_t *stsz_table16;
+	uint32_t *stsz_table32;
 	/* stco atom */
 	int32_t stco_entry_count;
-	int32_t *stco_chunk_offset;
-	/* stsc atom */
+	uint32_t *stco_chunk_offset;
+	/* stsc atom: runs with first sample (ended by an extra run) */
 	int32_t stsc_entry_count;
-	int32_t *stsc_first_chunk;
-	int32_t *stsc_samples_per_chunk;
-	int32_t *stsc_sample_desc_index;
-	/* stts atom */
+	struct mp4_stsc_run *stsc_runs;
+	/* stts atom: runs with first time and sample (ended by an extra run) */
 	int32_t stts_entry_count;
-	int32_t *stts_sample_count;
-	int32_t *stts_sample_delta;
+	struct mp4_stts_run *stts_runs;
 	/* mp4a atom */
 	int32_t mp4a_channel_count;
 	int32_t mp4a_sample_size;
@@ -98,6 +120,8 @@ struct demux {
 	unsigned long cur_chunk_idx;
 	unsigned long cur_chunk;
 	unsigned long cur_offset;
+	/* Samples from seek sample up to last asked position */
+	unsigned long seek_skip;
 	/* Meta data */
 	char *title;
 	char *artist;
@@ -112,74 +136,183 @@ struct demux {
 	char *pic_mime;
 };
 
+static int demux_mp4_sync(struct demux *d, unsigned char *buffer,
+			  size_t size)
+{
+	ssize_t len;
+
+	/* Already at position */
+	if(d->pos == d->file_pos)
+		return 0;
+
+	/* Read small forward gaps to avoid a new request */
+	if(buffer != NULL && d->pos > d->file_pos &&
+	   d->pos - d->file_pos <= SKIP_MAX_SIZE)
+	{
+		while(d->file_pos < d->pos)
+		{
+			len = d->pos - d->file_pos;
+			if(len > size)
+				len = size;
+			len = fs_read(d->file, buffer, len);
+			if(len <= 0)
+				break;
+			d->file_pos += len;
+		}
+		if(d->file_pos == d->pos)
+			return 0;
+	}
+
+	/* Seek to position */
+	if(fs_lseek(d->file, d->pos, SEEK_SET) < 0)
+		return -1;
+	d->file_pos = d->pos;
+
+	return 0;
+}
+
+static ssize_t demux_mp4_read(struct demux *d, unsigned char *buffer,
+			      size_t size)
+{
+	ssize_t len;
+
+	/* Go to position */
+	if(demux_mp4_sync(d, d->buffer, d->buffer_size) != 0)
+		return -1;
+
+	/* Read from stream */
+	len = fs_read(d->file, buffer, size);
+	if(len > 0)
+		d->file_pos += len;
+	d->pos = d->file_pos;
+
+	return len;
+}
+
+static inline void demux_mp4_skip(struct demux *d, off_t len)
+{
+	d->pos += len;
+}
+
+static inline uint32_t demux_mp4_sample_size(struct demux *d,
+					     unsigned long sample)
+{
+	if(d->stsz_sample_size != 0)
+		return d->stsz_sample_size;
+	if(sample >= d->stsz_sample_count)
+		return 0;
+	if(d->stsz_table16 != NULL)
+		return d->stsz_table16[sample];
+	return d->stsz_table32[sample];
+}
+
 static int demux_mp4_find_chunk(struct demux *d, unsigned long sample,
 				unsigned long *chunk, unsigned long *chunk_idx,
 				unsigned long *chunk_sample)
 {
-	unsigned long nb_chunk_sample = 0;
-	unsigned long cur_sample = 0;
-	unsigned long cur_chunk = 1;
-	unsigned long nb_sample = 0;
-	unsigned long nb_chunk = 0;
-	unsigned long i = 0;
+	const struct mp4_stsc_run *run;
+	unsigned long low = 0;
+	unsigned long high = d->stsc_entry_count;
+	unsigned long mid;
 
-	/* Find chunk and sample in chunk */
-	for(i = 0; i < d->stsc_entry_count; i++)
+	if(d->stsc_entry_count <= 0)
+		return -1;
+
+	/* Find last run starting before sample */
+	while(high - low > 1)
 	{
-		if(i < d->stsc_entry_count-1)
-			nb_chunk = d->stsc_first_chunk[i+1] - 
-				   d->stsc_first_chunk[i];
+		mid = (low + high) / 2;
+		if(d->stsc_runs[mid].first_sample <= sample)
+			low = mid;
 		else
-			nb_chunk = 1;
-
-		nb_chunk_sample = d->stsc_samples_per_chunk[i];
-		nb_sample = nb_chunk * nb_chunk_sample;
-		if(cur_sample + nb_sample > sample)
-			break;
-
-		cur_sample += nb_sample;
-		cur_chunk += nb_chunk;
+			high = mid;
 	}
+	run = &d->stsc_runs[low];
+	if(run->samples_per_chunk == 0)
+		return -1;
 
-	*chunk = cur_chunk + ((sample - cur_sample) / nb_chunk_sample) - 1;
-	*chunk_sample = sample - (*chunk + 1 - cur_chunk) * nb_chunk_sample - 
-			cur_sample;
-	*chunk_idx = i;
+	/* Find chunk and sample in chunk */
+	*chunk = run->first_chunk + (sample - run->first_sample) /
+				    run->samples_per_chunk;
+	*chunk_sample = (sample - run->first_sample) % run->samples_per_chunk;
+	*chunk_idx = low;
 
-	if(*chunk >= d->stsc_first_chunk[d->stsc_entry_count-1])
+	if(*chunk >= d->stco_entry_count)
 		return -1;
 
 	return 0;
 }
 
-static long demux_mp4_find_sample(struct demux *d, unsigned long pos,
+static long demux_mp4_find_sample(struct demux *d, uint64_t pos,
 				  unsigned long *skip)
 {
-	unsigned long s_count, s_delta;
-	unsigned long sample = 0;
-	unsigned long count = 0;
-	unsigned long delta;
-	unsigned int i;
+	const struct mp4_stts_run *run;
+	unsigned long low = 0;
+	unsigned long high = d->stts_entry_count;
+	unsigned long mid;
+
+	/* Position is after last sample */
+	if(d->stts_entry_count <= 0 ||
+	   pos >= d->stts_runs[d->stts_entry_count].first_time)
+		return -1;
 
-	/* Find sample with stts table */
-	for(i = 0; i < d->stts_entry_count; i++)
+	/* Find last run starting before position */
+	while(high - low > 1)
 	{
-		s_count = d->stts_sample_count[i];
-		s_delta = d->stts_sample_delta[i];
-		delta = s_count * s_delta;
-
-		if(delta + count > pos)
-		{
-			if(skip != NULL)
-				*skip = ((pos - count) % s_delta);
-			return sample + ((pos - count) / s_delta);
-		}
+		mid = (low + high) / 2;
+		if(d->stts_runs[mid].first_time <= pos)
+			low = mid;
 		else
-			count += delta;
-		sample += s_count;
+			high = mid;
+	}
+	run = &d->stts_runs[low];
+
+	/* Find sample in run */
+	if(run->delta == 0)
+	{
+		if(skip != NULL)
+			*skip = 0;
+		return run->first_sample;
+	}
+	if(skip != NULL)
+		*skip = (pos - run->first_time) % run->delta;
+	return run->first_sample + (pos - run->first_time) / run->delta;
+}
+
+static int demux_mp4_find_pos(struct demux *d, unsigned long pos,
+			      unsigned long *sample, unsigned long *chunk,
+			      unsigned long *chunk_idx,
+			      unsigned long *chunk_sample,
+			      unsigned long *offset, unsigned long *to_skip)
+{
+	unsigned long i;
+	long s;
+
+	/* Find sample from time table */
+	s = demux_mp4_find_sample(d, (uint64_t) pos * d->mdhd_time_scale,
+				  to_skip);
+	if(s < 0)
+		return -1;
+	*sample = s;
+
+	/* Get chunk containing the sample */
+	if(demux_mp4_find_chunk(d, *sample, chunk, chunk_idx, chunk_sample)
+	   != 0)
+		return -1;
+
+	/* Get chunk offset */
+	*offset = d->stco_chunk_offset[*chunk];
+
+	/* Get sample offset in chunk */
+	if(d->stsz_sample_size == 0)
+	{
+		for(i = *sample - *chunk_sample; i < *sample; i++)
+			*offset += demux_mp4_sample_size(d, i);
 	}
+	else
+		*offset += *chunk_sample * d->stsz_sample_size;
 
-	return -1;
+	return 0;
 }
 
 static void demux_mp4_parse_mdhd(struct demux *d)
@@ -191,7 +324,7 @@ static void demux_mp4_parse_mdhd(struct demux *d)
 	size = ATOM_LEN(d->buffer);
 
 	/* Get Version */
-	fs_read(d->file, d->buffer, 4);
+	demux_mp4_read(d, d->buffer, 4);
 	version = ATOM_READ32(d->buffer);
 
 	/* Go to first entry */
@@ -199,21 +332,21 @@ static void demux_mp4_parse_mdhd(struct demux *d)
 
 	if(version == 1)
 	{
-		fs_read(d->file, d->buffer, 28);
+		demux_mp4_read(d, d->buffer, 28);
 		d->mdhd_time_scale = ATOM_READ32(&d->buffer[16]);
 		d->mdhd_duration = ATOM_READ64(&d->buffer[20]);
 		size -= 28;
 	}
 	else
 	{
-		fs_read(d->file, d->buffer, 16);
+		demux_mp4_read(d, d->buffer, 16);
 		d->mdhd_time_scale = ATOM_READ32(&d->buffer[8]);
 		d->mdhd_duration = ATOM_READ32(&d->buffer[12]);
 		size -= 16;
 	}
 
 	/* Go to next atom */
-	fs_lseek(d->file, size, SEEK_CUR);
+	demux_mp4_skip(d, size);
 }
 
 static uint32_t demux_mp4_read_len(struct demux *d, unsigned long *count)
@@ -223,7 +356,7 @@ static uint32_t demux_mp4_read_len(struct demux *d, unsigned long *count)
 
 	for(i = 0; b & 0x80 && i < 4; i++)
 	{
-		fs_read(d->file, d->buffer, 1);
+		demux_mp4_read(d, d->buffer, 1);
 		(*count) -= 1;
 		b = d->buffer[0];
 		len = (len << 7) | (b & 0x7F);
@@ -241,11 +374,11 @@ static int demux_mp4_parse_esds(struct demux *d)
 	atom_size = ATOM_LEN(d->buffer);
 
 	/* Skip version and flags */
-	fs_lseek(d->file, 4, SEEK_CUR);
+	demux_mp4_skip(d, 4);
 	atom_size -= 12;
 
 	/* Check ES_DescrTag */
-	fs_read(d->file, d->buffer, 1);
+	demux_mp4_read(d, d->buffer, 1);
 	tag = d->buffer[0];
 	atom_size--;
 	if(tag == 0x03)
@@ -255,18 +388,18 @@ static int demux_mp4_parse_esds(struct demux *d)
 			goto end;
 
 		/* Skip 3 bytes */
-		fs_read(d->file, d->buffer, 3);
+		demux_mp4_read(d, d->buffer, 3);
 		atom_size -= 3;
 	}
 	else
 	{
 		/* Skip 2 bytes */
-		fs_read(d->file, d->buffer, 2);
+		demux_mp4_read(d, d->buffer, 2);
 		atom_size -= 2;
 	}
 
 	/* Check DecoderConfigDescrTab */
-	fs_read(d->file, d->buffer, 1);
+	demux_mp4_read(d, d->buffer, 1);
 	atom_size--;
 	if(d->buffer[0] != 0x04)
 		goto end;
@@ -276,7 +409,7 @@ static int demux_mp4_parse_esds(struct demux *d)
 		goto end;
 
 	/* Get esds properties */
-	fs_read(d->file, d->buffer, 14);
+	demux_mp4_read(d, d->buffer, 14);
 	atom_size -= 14;
 	d->esds_audio_type = d->buffer[0];
 	d->esds_max_bitrate = ATOM_READ32(&d->buffer[5]);
@@ -296,7 +429,7 @@ static int demux_mp4_parse_esds(struct demux *d)
 	if(d->esds_buffer != NULL)
 	{
 		/* Read coder config */
-		fs_read(d->file, d->buffer, d->esds_size);
+		demux_mp4_read(d, d->buffer, d->esds_size);
 		memcpy(d->esds_buffer, d->buffer, d->esds_size);
 		atom_size -= d->esds_size;
 	}
@@ -307,7 +440,7 @@ static int demux_mp4_parse_esds(struct demux *d)
 
 end:
 	/* Go to next atom */
-	fs_lseek(d->file, atom_size, SEEK_CUR);
+	demux_mp4_skip(d, atom_size);
 	return 0;
 }
 
@@ -318,7 +451,7 @@ static void demux_mp4_parse_mp4a(struct demux *d)
 
 	/* Get size */
 	atom_size = ATOM_LEN(d->buffer);
-	fs_read(d->file, d->buffer, 28);
+	demux_mp4_read(d, d->buffer, 28);
 	atom_size -= 36;
 
 	/* Get track properties */
@@ -330,7 +463,7 @@ static void demux_mp4_parse_mp4a(struct demux *d)
 	d->track_found = 1;
 
 	/* Get size of sub-atom */
-	fs_read(d->file, d->buffer, 8);
+	demux_mp4_read(d, d->buffer, 8);
 	size = ATOM_LEN(d->buffer);
 	atom_size -= 8;
 
@@ -342,7 +475,7 @@ static void demux_mp4_parse_mp4a(struct demux *d)
 	}
 
 	/* Go to next atom */
-	fs_lseek(d->file, atom_size, SEEK_CUR);
+	demux_mp4_skip(d, atom_size);
 }
 
 static int demux_mp4_parse_stsd(struct demux *d)
@@ -355,7 +488,7 @@ static int demux_mp4_parse_stsd(struct demux *d)
 
 	/* Get size */
 	atom_size = ATOM_LEN(d->buffer);
-	fs_read(d->file, d->buffer, 8);
+	demux_mp4_read(d, d->buffer, 8);
 
 	/* Count entries */
 	count = ATOM_READ32(&d->buffer[4]);
@@ -367,7 +500,7 @@ static int demux_mp4_parse_stsd(struct demux *d)
 	for(i = 0; i < count; i++)
 	{
 		/* Get size of sub-atom */
-		fs_read(d->file, d->buffer, 8);
+		demux_mp4_read(d, d->buffer, 8);
 		size = ATOM_LEN(d->buffer);
 
 		/* Process sub-atom */
@@ -379,25 +512,28 @@ static int demux_mp4_parse_stsd(struct demux *d)
 		}
 		else
 		{
-			fs_lseek(d->file, size-8, SEEK_CUR);
+			demux_mp4_skip(d, size-8);
 		}
 		atom_size -= size;
 	}
 
 	/* Go to next atom */
-	fs_lseek(d->file, atom_size, SEEK_CUR);
+	demux_mp4_skip(d, atom_size);
 
 	return is_mp4a;
 }
 
 static void demux_mp4_parse_stts(struct demux *d)
 {
+	struct mp4_stts_run *run;
 	unsigned long size;
 	unsigned int i, j, count;
+	uint32_t s_count;
+	uint64_t time = 0;
 
 	/* Get size */
 	size = ATOM_LEN(d->buffer);
-	fs_read(d->file, d->buffer, 8);
+	demux_mp4_read(d, d->buffer, 8);
 
 	/* Get count */
 	d->stts_entry_count = ATOM_READ32(&d->buffer[4]);
@@ -405,42 +541,54 @@ static void demux_mp4_parse_stts(struct demux *d)
 	/* Go to first entry */
 	size -= 16;
 
-	/* Create stts table */
-	d->stts_sample_count = malloc(d->stts_entry_count * sizeof(int32_t));
-	d->stts_sample_delta = malloc(d->stts_entry_count * sizeof(int32_t));
+	/* Create stts runs (with an extra run for end) */
+	d->stts_runs = malloc((d->stts_entry_count + 1) *
+			      sizeof(struct mp4_stts_run));
+	if(d->stts_runs == NULL)
+	{
+		d->stts_entry_count = 0;
+		return;
+	}
 	d->num_samples = 0;
 
-	/* Fill table */
+	/* Fill runs */
 	for(i = 0; i < d->stts_entry_count; i += count)
 	{
 		count = d->buffer_size / 8;
 		if(count > d->stts_entry_count - i)
 			count = d->stts_entry_count - i;
 
-		fs_read(d->file, d->buffer, count*8);
+		demux_mp4_read(d, d->buffer, count*8);
 		for(j = 0; j < count; j++)
 		{
-			d->stts_sample_count[i+j] = ATOM_READ32(
-							   &d->buffer[j*8]);
-			d->stts_sample_delta[i+j] = ATOM_READ32(
-						       &d->buffer[4+(j*8)]);
-			d->num_samples += d->stts_sample_count[i+j];
+			run = &d->stts_runs[i+j];
+			run->first_time = time;
+			run->first_sample = d->num_samples;
+			run->delta = ATOM_READ32(&d->buffer[4+(j*8)]);
+			s_count = ATOM_READ32(&d->buffer[j*8]);
+			time += (uint64_t) s_count * run->delta;
+			d->num_samples += s_count;
 		}
 	}
+	run = &d->stts_runs[d->stts_entry_count];
+	run->first_time = time;
+	run->first_sample = d->num_samples;
+	run->delta = 0;
 	size -= 8 * d->stts_entry_count;
 
 	/* Go to next atom */
-	fs_lseek(d->file, size, SEEK_CUR);
+	demux_mp4_skip(d, size);
 }
 
 static void demux_mp4_parse_stsc(struct demux *d)
 {
+	struct mp4_stsc_run *run;
 	unsigned long size;
 	unsigned int i, j, count;
 
 	/* Get size */
 	size = ATOM_LEN(d->buffer);
-	fs_read(d->file, d->buffer, 8);
+	demux_mp4_read(d, d->buffer, 8);
 
 	/* Get chunk count */
 	d->stsc_entry_count = ATOM_READ32(&d->buffer[4]);
@@ -448,45 +596,80 @@ static void demux_mp4_parse_stsc(struct demux *d)
 	/* Go to first entry */
 	size -= 16;
 
-	/* Create chunk table */
-	d->stsc_first_chunk = malloc(d->stsc_entry_count * sizeof(int32_t));
-	d->stsc_samples_per_chunk = malloc(d->stsc_entry_count *
-							       sizeof(int32_t));
-	d->stsc_sample_desc_index = malloc(d->stsc_entry_count *
-							       sizeof(int32_t));
+	/* Create chunk runs (with an extra run for end) */
+	d->stsc_runs = malloc((d->stsc_entry_count + 1) *
+			      sizeof(struct mp4_stsc_run));
+	if(d->stsc_runs == NULL)
+	{
+		d->stsc_entry_count = 0;
+		return;
+	}
 
-	/* Fill table */
+	/* Fill runs */
 	for(i = 0; i < d->stsc_entry_count; i += count)
 	{
 		count = d->buffer_size / 12;
 		if(count > d->stsc_entry_count - i)
 			count = d->stsc_entry_count - i;
 
-		fs_read(d->file, d->buffer, count*12);
+		demux_mp4_read(d, d->buffer, count*12);
 		for(j = 0; j < count; j++)
 		{
-			d->stsc_first_chunk[i+j] = ATOM_READ32(
-							   &d->buffer[j*12]);
-			d->stsc_samples_per_chunk[i+j] = ATOM_READ32(
+			run = &d->stsc_runs[i+j];
+			run->first_chunk = (ATOM_READ32(&d->buffer[j*12])) - 1;
+			run->samples_per_chunk = ATOM_READ32(
 						       &d->buffer[4+(j*12)]);
-			d->stsc_sample_desc_index[i+j] = ATOM_READ32(
-						       &d->buffer[8+(j*12)]);
 		}
 	}
+
+	/* Calculate first sample of each run */
+	for(i = 0; i < d->stsc_entry_count; i++)
+	{
+		run = &d->stsc_runs[i];
+		run->first_sample = i == 0 ? 0 : run[-1].first_sample +
+				    (run->first_chunk - run[-1].first_chunk) *
+				    run[-1].samples_per_chunk;
+	}
+	run = &d->stsc_runs[d->stsc_entry_count];
+	run->first_chunk = UINT32_MAX;
+	run->first_sample = UINT32_MAX;
+	run->samples_per_chunk = 0;
 	size -= 12 * d->stsc_entry_count;
 
 	/* Go to next atom */
-	fs_lseek(d->file, size, SEEK_CUR);
+	demux_mp4_skip(d, size);
+}
+
+static int demux_mp4_expand_stsz(struct demux *d, unsigned long len)
+{
+	unsigned long i;
+
+	/* Allocate 32-bit table */
+	d->stsz_table32 = malloc(d->stsz_sample_count * sizeof(uint32_t));
+	if(d->stsz_table32 == NULL)
+	{
+		d->stsz_sample_count = 0;
+		return -1;
+	}
+
+	/* Copy sizes already read */
+	for(i = 0; i < len; i++)
+		d->stsz_table32[i] = d->stsz_table16[i];
+	free(d->stsz_table16);
+	d->stsz_table16 = NULL;
+
+	return 0;
 }
 
 static void demux_mp4_parse_stsz(struct demux *d)
 {
 	unsigned long size;
 	unsigned int i, j, count;
+	uint32_t value;
 
 	/* Get size */
 	size = ATOM_LEN(d->buffer);
-	fs_read(d->file, d->buffer, 12);
+	demux_mp4_read(d, d->buffer, 12);
 
 	/* Get sample size and sample count */
 	d->stsz_sample_size = ATOM_READ32(&d->buffer[4]);
@@ -498,7 +681,13 @@ static void demux_mp4_parse_stsz(struct demux *d)
 	/* Create sample size table */
 	if(d->stsz_sample_size == 0)
 	{
-		d->stsz_table = malloc(d->stsz_sample_count * sizeof(int32_t));
+		d->stsz_table16 = malloc(d->stsz_sample_count *
+					 sizeof(uint16_t));
+		if(d->stsz_table16 == NULL)
+		{
+			d->stsz_sample_count = 0;
+			return;
+		}
 
 		/* Fill table */
 		for(i = 0; i < d->stsz_sample_count; i += count)
@@ -507,18 +696,27 @@ static void demux_mp4_parse_stsz(struct demux *d)
 			if(count > d->stsz_sample_count - i)
 				count = d->stsz_sample_count - i;
 
-			fs_read(d->file, d->buffer, count*4);
+			demux_mp4_read(d, d->buffer, count*4);
 			for(j = 0; j < count; j++)
 			{
-				d->stsz_table[i+j] = ATOM_READ32(
-							    &d->buffer[j*4]);
+				value = ATOM_READ32(&d->buffer[j*4]);
+
+				/* Switch to 32-bit table for a large sample */
+				if(value > UINT16_MAX && d->stsz_table32 == NULL
+				   && demux_mp4_expand_stsz(d, i+j) != 0)
+					return;
+
+				if(d->stsz_table32 != NULL)
+					d->stsz_table32[i+j] = value;
+				else
+					d->stsz_table16[i+j] = value;
 			}
 		}
 		size -= 4 * d->stsz_sample_count;
 	}
 
 	/* Go to next atom */
-	fs_lseek(d->file, size, SEEK_CUR);
+	demux_mp4_skip(d, size);
 }
 
 static void demux_mp4_parse_stco(struct demux *d)
@@ -528,7 +726,7 @@ static void demux_mp4_parse_stco(struct demux *d)
 
 	/* Get size */
 	size = ATOM_LEN(d->buffer);
-	fs_read(d->file, d->buffer, 8);
+	demux_mp4_read(d, d->buffer, 8);
 
 	/* Get chunk offset count */
 	d->stco_entry_count = ATOM_READ32(&d->buffer[4]);
@@ -537,7 +735,12 @@ static void demux_mp4_parse_stco(struct demux *d)
 	size -= 16;
 
 	/* Create chunk offset table */
-	d->stco_chunk_offset = malloc(d->stco_entry_count * sizeof(int32_t));
+	d->stco_chunk_offset = malloc(d->stco_entry_count * sizeof(uint32_t));
+	if(d->stco_chunk_offset == NULL)
+	{
+		d->stco_entry_count = 0;
+		return;
+	}
 
 	/* Fill table */
 	for(i = 0; i < d->stco_entry_count; i += count)
@@ -546,7 +749,7 @@ static void demux_mp4_parse_stco(struct demux *d)
 		if(count > d->stco_entry_count - i)
 			count = d->stco_entry_count - i;
 
-		fs_read(d->file, d->buffer, count*4);
+		demux_mp4_read(d, d->buffer, count*4);
 		for(j = 0; j < count; j++)
 		{
 			d->stco_chunk_offset[i+j] = ATOM_READ32(
@@ -556,7 +759,7 @@ static void demux_mp4_parse_stco(struct demux *d)
 	size -= 4 * d->stco_entry_count;
 
 	/* Go to next atom */
-	fs_lseek(d->file, size, SEEK_CUR);
+	demux_mp4_skip(d, size);
 }
 
 static void demux_mp4_parse_track(struct demux *d)
@@ -573,7 +776,7 @@ static void demux_mp4_parse_track(struct demux *d)
 	while(count < atom_size)
 	{
 		/* Size of sub-atom */
-		fs_read(d->file, d->buffer, 8);
+		demux_mp4_read(d, d->buffer, 8);
 		size = ATOM_LEN(d->buffer);
 
 		/* Process sub-atom */
@@ -617,13 +820,13 @@ static void demux_mp4_parse_track(struct demux *d)
 		else
 		{
 			/* Ignore other sub-atoms */
-			fs_lseek(d->file, size-8, SEEK_CUR);
+			demux_mp4_skip(d, size-8);
 		}
 		count += size;
 	}
 
 	/* Finish atom reading */
-	fs_lseek(d->file, atom_size-count, SEEK_CUR);
+	demux_mp4_skip(d, atom_size-count);
 }
 
 static void demux_mp4_parse_txt(struct demux *d, char **str)
@@ -635,7 +838,7 @@ static void demux_mp4_parse_txt(struct demux *d, char **str)
 
 	/* Get size */
 	size = ATOM_LEN(d->buffer);
-	fs_read(d->file, d->buffer, 8);
+	demux_mp4_read(d, d->buffer, 8);
 	size -= 16;
 
 	/* Check sub-atom */
@@ -645,7 +848,7 @@ static void demux_mp4_parse_txt(struct demux *d, char **str)
 		len = ATOM_LEN(d->buffer) - 16;
 
 		/* Skip version and flags */
-		fs_read(d->file, d->buffer, 8);
+		demux_mp4_read(d, d->buffer, 8);
 		size -= 8;
 
 		/* Free previous string */
@@ -662,7 +865,7 @@ static void demux_mp4_parse_txt(struct demux *d, char **str)
 				count = d->buffer_size;
 				if(count > len)
 					count = len;
-				count = fs_read(d->file, d->buffer, count);
+				count = demux_mp4_read(d, d->buffer, count);
 				memcpy(*str + pos, d->buffer, count);
 				pos += count;
 				len -= count;
@@ -672,7 +875,7 @@ static void demux_mp4_parse_txt(struct demux *d, char **str)
 	}
 
 	/* Go to next atom */
-	fs_lseek(d->file, size, SEEK_CUR);
+	demux_mp4_skip(d, size);
 }
 
 static void demux_mp4_parse_trkn(struct demux *d)
@@ -681,14 +884,14 @@ static void demux_mp4_parse_trkn(struct demux *d)
 
 	/* Get size */
 	size = ATOM_LEN(d->buffer);
-	fs_read(d->file, d->buffer, 8);
+	demux_mp4_read(d, d->buffer, 8);
 	size -= 16;
 
 	/* Check sub-atom */
 	if(ATOM_CHECK(d->buffer, "data") == 0 && ATOM_LEN(d->buffer) == 24)
 	{
 		/* Skip version and flags */
-		fs_read(d->file, d->buffer, 14);
+		demux_mp4_read(d, d->buffer, 14);
 		size -= 14;
 
 		/* Read track */
@@ -699,7 +902,7 @@ static void demux_mp4_parse_trkn(struct demux *d)
 	}
 
 	/* Go to next atom */
-	fs_lseek(d->file, size, SEEK_CUR);
+	demux_mp4_skip(d, size);
 }
 
 static void demux_mp4_parse_gnre(struct demux *d)
@@ -709,19 +912,19 @@ static void demux_mp4_parse_gnre(struct demux *d)
 
 	/* Get size */
 	size = ATOM_LEN(d->buffer);
-	fs_read(d->file, d->buffer, 8);
+	demux_mp4_read(d, d->buffer, 8);
 	size -= 16;
 
 	/* Check sub-atom */
 	if(ATOM_CHECK(d->buffer, "data") == 0 && ATOM_LEN(d->buffer) == 18)
 	{
 		/* Read genre index */
-		fs_read(d->file, d->buffer, 10);
+		demux_mp4_read(d, d->buffer, 10);
 		genre = ATOM_READ16(&d->buffer[8]);
 		size -= 10;
 
 		/* Check genre */
-		if(genre > 0 || genre <= ID3v1_genres_count)
+		if(genre > 0 && genre <= ID3v1_genres_count)
 		{
 			/* Free previous genre */
 			if(d->genre != NULL)
@@ -733,7 +936,7 @@ static void demux_mp4_parse_gnre(struct demux *d)
 	}
 
 	/* Go to next atom */
-	fs_lseek(d->file, size, SEEK_CUR);
+	demux_mp4_skip(d, size);
 }
 
 static void demux_mp4_parse_covr(struct demux *d)
@@ -746,7 +949,7 @@ static void demux_mp4_parse_covr(struct demux *d)
 
 	/* Get size */
 	size = ATOM_LEN(d->buffer);
-	fs_read(d->file, d->buffer, 8);
+	demux_mp4_read(d, d->buffer, 8);
 	size -= 16;
 
 	/* Check sub-atom */
@@ -756,7 +959,7 @@ static void demux_mp4_parse_covr(struct demux *d)
 		len =  ATOM_LEN(d->buffer) - 16;
 
 		/* Get flags for type */
-		fs_read(d->file, d->buffer, 8);
+		demux_mp4_read(d, d->buffer, 8);
 		flags = ATOM_READ32(d->buffer);
 		size -= 8;
 
@@ -781,7 +984,7 @@ static void demux_mp4_parse_covr(struct demux *d)
 				count = d->buffer_size;
 				if(count > len)
 					count = len;
-				count = fs_read(d->file, d->buffer, count);
+				count = demux_mp4_read(d, d->buffer, count);
 				memcpy(d->pic + pos, d->buffer, count);
 				pos += count;
 				len -= count;
@@ -797,7 +1000,7 @@ static void demux_mp4_parse_covr(struct demux *d)
 	}
 
 	/* Go to next atom */
-	fs_lseek(d->file, size, SEEK_CUR);
+	demux_mp4_skip(d, size);
 }
 
 static void demux_mp4_parse_ilst(struct demux *d)
@@ -813,11 +1016,19 @@ static void demux_mp4_parse_ilst(struct demux *d)
 	while(count < atom_size)
 	{
 		/* Size of sub-atom */
-		fs_read(d->file, d->buffer, 8);
+		demux_mp4_read(d, d->buffer, 8);
 		size = ATOM_LEN(d->buffer);
 
 		/* Process sub-atom */
-		if(ATOM_CHECK(d->buffer, "\251alb") == 0)
+		if(ATOM_CHECK(d->buffer, "covr") == 0 &&
+		   d->flags & DEMUX_META_PICTURE)
+			demux_mp4_parse_covr(d);
+		else if((d->flags & DEMUX_META_TAGS) == 0)
+		{
+			/* Text tags are not asked */
+			demux_mp4_skip(d, size-8);
+		}
+		else if(ATOM_CHECK(d->buffer, "\251alb") == 0)
 			demux_mp4_parse_txt(d, &d->album);
 		else if(ATOM_CHECK(d->buffer, "\251ART") == 0)
 			demux_mp4_parse_txt(d, &d->artist);
@@ -833,18 +1044,16 @@ static void demux_mp4_parse_ilst(struct demux *d)
 			demux_mp4_parse_trkn(d);
 		else if(ATOM_CHECK(d->buffer, "gnre") == 0)
 			demux_mp4_parse_gnre(d);
-		else if(ATOM_CHECK(d->buffer, "covr") == 0)
-			demux_mp4_parse_covr(d);
 		else
 		{
 			/* Ignore other sub-atoms */
-			fs_lseek(d->file, size-8, SEEK_CUR);
+			demux_mp4_skip(d, size-8);
 		}
 		count += size;
 	}
 
 	/* Finish atom reading */
-	fs_lseek(d->file, atom_size-count, SEEK_CUR);
+	demux_mp4_skip(d, atom_size-count);
 }
 
 static void demux_mp4_parse_meta(struct demux *d)
@@ -857,13 +1066,13 @@ static void demux_mp4_parse_meta(struct demux *d)
 	atom_size = ATOM_LEN(d->buffer);
 
 	/* Skip version and flags */
-	fs_read(d->file, d->buffer, 4);
+	demux_mp4_read(d, d->buffer, 4);
 
 	/* Get all children atoms */
 	while(count < atom_size)
 	{
 		/* Size of sub-atom */
-		fs_read(d->file, d->buffer, 8);
+		demux_mp4_read(d, d->buffer, 8);
 		size = ATOM_LEN(d->buffer);
 
 		/* Process sub-atom */
@@ -875,13 +1084,13 @@ static void demux_mp4_parse_meta(struct demux *d)
 		else
 		{
 			/* Ignore other sub-atoms */
-			fs_lseek(d->file, size-8, SEEK_CUR);
+			demux_mp4_skip(d, size-8);
 		}
 		count += size;
 	}
 
 	/* Finish atom reading */
-	fs_lseek(d->file, atom_size-count, SEEK_CUR);
+	demux_mp4_skip(d, atom_size-count);
 }
 
 static void demux_mp4_parse_udta(struct demux *d)
@@ -897,7 +1106,7 @@ static void demux_mp4_parse_udta(struct demux *d)
 	while(count < atom_size)
 	{
 		/* Size of sub-atom */
-		fs_read(d->file, d->buffer, 8);
+		demux_mp4_read(d, d->buffer, 8);
 		size = ATOM_LEN(d->buffer);
 
 		/* Process sub-atom */
@@ -909,13 +1118,13 @@ static void demux_mp4_parse_udta(struct demux *d)
 		else
 		{
 			/* Ignore other sub-atoms */
-			fs_lseek(d->file, size-8, SEEK_CUR);
+			demux_mp4_skip(d, size-8);
 		}
 		count += size;
 	}
 
 	/* Finish atom reading */
-	fs_lseek(d->file, atom_size-count, SEEK_CUR);
+	demux_mp4_skip(d, atom_size-count);
 }
 
 static void demux_mp4_parse_moov(struct demux *d)
@@ -931,7 +1140,7 @@ static void demux_mp4_parse_moov(struct demux *d)
 	while(count < atom_size)
 	{
 		/* Size of sub-atom */
-		fs_read(d->file, d->buffer, 8);
+		demux_mp4_read(d, d->buffer, 8);
 		size = ATOM_LEN(d->buffer);
 
 		/* Process sub-atom */
@@ -940,7 +1149,8 @@ static void demux_mp4_parse_moov(struct demux *d)
 			/* Parse "track" atom */
 			demux_mp4_parse_track(d);
 		}
-		else if(ATOM_CHECK(d->buffer, "udta") == 0)
+		else if(ATOM_CHECK(d->buffer, "udta") == 0 &&
+			d->flags & (DEMUX_META_TAGS | DEMUX_META_PICTURE))
 		{
 			/* Parse "udta" atom */
 			demux_mp4_parse_udta(d);
@@ -948,17 +1158,18 @@ static void demux_mp4_parse_moov(struct demux *d)
 		else
 		{
 			/* Ignore other sub-atoms */
-			fs_lseek(d->file, size-8, SEEK_CUR);
+			demux_mp4_skip(d, size-8);
 		}
 		count += size;
 	}
 
 	/* Finish atom reading */
-	fs_lseek(d->file, atom_size-count, SEEK_CUR);
+	demux_mp4_skip(d, atom_size-count);
 }
 
 int demux_mp4_open(struct demux **demux, struct fs_file *file, size_t file_size,
-		   unsigned long *samplerate, unsigned char *channels)
+		   unsigned long *samplerate, unsigned char *channels,
+		   unsigned int flags)
 {
 	struct demux *d;
 	unsigned char buffer[BUFFER_SIZE];
@@ -992,21 +1203,30 @@ int demux_mp4_open(struct demux **demux, struct fs_file *file, size_t file_size,
 	d->buffer = buffer;
 	d->buffer_size = BUFFER_SIZE;
 	d->size = file_size;
+	d->flags = flags;
+	d->file_pos = 8;
+	d->pos = 8;
 
 	/* Seek to next atom and get next atom header */
-	fs_lseek(file, size-8, SEEK_CUR);
+	demux_mp4_skip(d, size-8);
 
 	/* Read all atom until "mdat" */
 	while(count < file_size)
 	{
 		/* Get size of sub-atom */
-		fs_read(d->file, buffer, 8);
+		if(demux_mp4_read(d, buffer, 8) != 8)
+			break;
 		size = ATOM_LEN(buffer);
+		if(size < 8)
+			break;
 
 		/* Process sub-atom */
 		if(ATOM_CHECK(buffer, "moov") == 0)
 		{
-			/* Process "moov" */
+			/* Process "moov": load it at once since it is parsed
+			 * with many small reads
+			 */
+			fs_advise(d->file, count, size, FS_ADVICE_WILLNEED);
 			demux_mp4_parse_moov(d);
 			moov_pos = count;
 		}
@@ -1019,22 +1239,24 @@ int demux_mp4_open(struct demux **demux, struct fs_file *file, size_t file_size,
 					break;
 			}
 
-			/* Go to next atom */
-			fs_lseek(file, size-8, SEEK_CUR);
+			/* Go to next atom: only seeked on next read */
+			demux_mp4_skip(d, size-8);
 		}
 		/* Update read bytes count */
 		count += size;
 	}
 
 	/* Check if a valid mp4 file and have found a mp4a track */
-	if(mdat_pos == 0 || d->track_found == 0)
+	if(mdat_pos == 0 || d->track_found == 0 || d->stco_entry_count <= 0 ||
+	   d->stsc_entry_count <= 0)
 		return -1;
 
+	/* Internal buffer is only valid during open */
+	d->buffer = NULL;
+	d->buffer_size = 0;
+
 	/* Go to first frame */
-	if(d->stsz_sample_size != 0)
-		d->cur_sample_size = d->stsz_sample_size;
-	else
-		d->cur_sample_size = d->stsz_table[0];
+	d->cur_sample_size = demux_mp4_sample_size(d, 0);
 	d->cur_sample = 0;
 	d->cur_chunk_sample = 0;
 	d->cur_chunk_idx = 0;
@@ -1096,14 +1318,26 @@ ssize_t demux_mp4_next_frame(struct demux *d, struct demux_frame *frame,
 	if(d->cur_sample_size > size)
 		return 0;
 
-	/* Seek to next frame */
-	if(fs_lseek(d->file, d->cur_offset, SEEK_SET) < 0)
-		return -1;
+	/* Map frame from readahead block */
+	if(fs_readahead_map(d->file, d->cur_offset, d->cur_sample_size,
+			    &frame->data, &frame->ref) == 0)
+	{
+		d->file_pos = d->cur_offset + d->cur_sample_size;
+	}
+	else
+	{
+		/* Seek to next frame (frame buffer is used to skip gaps) */
+		d->pos = d->cur_offset;
+		if(demux_mp4_sync(d, frame->data, size) != 0)
+			return -1;
 
-	/* Read frame */
-	len = fs_read(d->file, frame->data, d->cur_sample_size);
-	if(len < 0)
-		return -1;
+		/* Read frame */
+		len = fs_read(d->file, frame->data, d->cur_sample_size);
+		if(len < 0)
+			return -1;
+		d->file_pos += len;
+	}
+	d->pos = d->file_pos;
 	frame->len = d->cur_sample_size;
 	frame->pos = d->cur_offset;
 
@@ -1114,14 +1348,20 @@ ssize_t demux_mp4_next_frame(struct demux *d, struct demux_frame *frame,
 
 	/* Update current sample counter in current chunk */
 	d->cur_chunk_sample++;
-	if(d->cur_chunk_sample >= d->stsc_samples_per_chunk[d->cur_chunk_idx])
+	if(d->cur_chunk_sample >=
+	   d->stsc_runs[d->cur_chunk_idx].samples_per_chunk)
 	{
 		/* Go to next chunk */
 		d->cur_chunk++;
-		if(d->cur_chunk_idx + 1 > d->stsc_entry_count)
-			return -1;
+		if(d->cur_chunk >= d->stco_entry_count)
+		{
+			d->cur_sample = d->num_samples;
+			return frame->len;
+		}
 
-		if(d->cur_chunk + 1 >= d->stsc_first_chunk[d->cur_chunk_idx+1])
+		/* Go to next run */
+		while(d->cur_chunk >= d->stsc_runs[d->cur_chunk_idx+1].
+								    first_chunk)
 			d->cur_chunk_idx++;
 
 		/* Get chunk offset */
@@ -1132,87 +1372,51 @@ ssize_t demux_mp4_next_frame(struct demux *d, struct demux_frame *frame,
 
 	/* Update offset */
 	d->cur_offset += d->cur_sample_size;
-	if(d->stsz_sample_size != 0)
-		d->cur_sample_size = d->stsz_sample_size;
-	else
-		d->cur_sample_size = d->stsz_table[d->cur_sample];
+	d->cur_sample_size = demux_mp4_sample_size(d, d->cur_sample);
 
 	return frame->len;
 }
 
+static void demux_mp4_set_skip(struct demux *d, unsigned long to_skip)
+{
+	/* Convert time scale of track to samples */
+	d->seek_skip = d->mdhd_time_scale > 0 ?
+		       (uint64_t) to_skip * d->mp4a_samplerate /
+		       d->mdhd_time_scale : 0;
+}
+
 unsigned long demux_mp4_calc_pos(struct demux *d, unsigned long pos,
 				 off_t *f_pos)
 {
-	unsigned long to_skip = 0;
 	unsigned long chunk, chunk_idx, chunk_sample;
-	unsigned long offset, i;
-	long sample;
-
-	/* Find sample friom time table */
-	sample = demux_mp4_find_sample(d, pos*d->mdhd_time_scale, &to_skip);
-	if(sample < 0)
-		return -1;
+	unsigned long to_skip = 0;
+	unsigned long sample;
+	unsigned long offset;
 
-	/* Get chunk containing the sample */
-	if(demux_mp4_find_chunk(d, sample, &chunk, &chunk_idx, &chunk_sample)
-	   != 0)
+	/* Find sample for position */
+	if(demux_mp4_find_pos(d, pos, &sample, &chunk, &chunk_idx,
+			      &chunk_sample, &offset, &to_skip) != 0)
 		return -1;
 
-	/* Get chunk offset */
-	if(chunk >= d->stco_entry_count)
-		return -1;
-	offset = d->stco_chunk_offset[chunk];
-
-	/* Get sample offset in chunk */
-	if(d->stsz_sample_size == 0)
-	{
-		for(i = sample - chunk_sample; i < sample; i++)
-		{
-			offset += d->stsz_table[i];
-		}
-	}
-	else
-		offset += chunk_sample * d->stsz_sample_size;
-
 	/* Set stream position */
 	if(f_pos != NULL)
 		*f_pos = offset;
+	demux_mp4_set_skip(d, to_skip);
 
 	return pos - (to_skip / d->mdhd_time_scale);
 }
 
 unsigned long demux_mp4_set_pos(struct demux *d, unsigned long pos)
 {
-	unsigned long to_skip = 0;
 	unsigned long chunk, chunk_idx, chunk_sample;
-	unsigned long offset, i;
-	long sample;
-
-	/* Find sample friom time table */
-	sample = demux_mp4_find_sample(d, pos*d->mdhd_time_scale, &to_skip);
-	if(sample < 0)
-		return -1;
-
-	/* Get chunk containing the sample */
-	if(demux_mp4_find_chunk(d, sample, &chunk, &chunk_idx, &chunk_sample)
-	   != 0)
-		return -1;
+	unsigned long to_skip = 0;
+	unsigned long sample;
+	unsigned long offset;
 
-	/* Get chunk offset */
-	if(chunk >= d->stco_entry_count)
+	/* Find sample for position */
+	if(demux_mp4_find_pos(d, pos, &sample, &chunk, &chunk_idx,
+			      &chunk_sample, &offset, &to_skip) != 0)
 		return -1;
-	offset = d->stco_chunk_offset[chunk];
-
-	/* Get sample offset in chunk */
-	if(d->stsz_sample_size == 0)
-	{
-		for(i = sample - chunk_sample; i < sample; i++)
-		{
-			offset += d->stsz_table[i];
-		}
-	}
-	else
-		offset += chunk_sample * d->stsz_sample_size;
 
 	/* Update current chunk/sample */
 	d->cur_sample = sample;
@@ -1220,14 +1424,17 @@ unsigned long demux_mp4_set_pos(struct demux *d, unsigned long pos)
 	d->cur_chunk_idx = chunk_idx;
 	d->cur_chunk_sample = chunk_sample;
 	d->cur_offset = offset;
-	if(d->stsz_sample_size != 0)
-		d->cur_sample_size = d->stsz_sample_size;
-	else
-		d->cur_sample_size = d->stsz_table[d->cur_sample];
+	d->cur_sample_size = demux_mp4_sample_size(d, d->cur_sample);
+	demux_mp4_set_skip(d, to_skip);
 
 	return pos - (to_skip / d->mdhd_time_scale);
 }
 
+unsigned long demux_mp4_get_seek_skip(struct demux *d)
+{
+	return d->seek_skip;
+}
+
 #define FREE_MP4(b) if(b != NULL) free(b);
 
 void demux_mp4_close(struct demux *d)
@@ -1236,13 +1443,11 @@ void demux_mp4_close(struct demux *d)
 		return;
 
 	/* Free all buffers */
-	FREE_MP4(d->stsz_table);
+	FREE_MP4(d->stsz_table16);
+	FREE_MP4(d->stsz_table32);
 	FREE_MP4(d->stco_chunk_offset);
-	FREE_MP4(d->stsc_first_chunk);
-	FREE_MP4(d->stsc_samples_per_chunk);
-	FREE_MP4(d->stsc_sample_desc_index);
-	FREE_MP4(d->stts_sample_count);
-	FREE_MP4(d->stts_sample_delta);
+	FREE_MP4(d->stsc_runs);
+	FREE_MP4(d->stts_runs);
 	FREE_MP4(d->esds_buffer);
 	FREE_MP4(d->title);
 	FREE_MP4(d->artist);
@@ -1264,6 +1469,7 @@ struct demux_module demux_mp4 = {
 	.next_frame = &demux_mp4_next_frame,
 	.calc_pos = &demux_mp4_calc_pos,
 	.set_pos = &demux_mp4_set_pos,
+	.get_seek_skip = &demux_mp4_get_seek_skip,
 	.close = &demux_mp4_close,
 };
 
@@ -16,6 +16,12 @@
  * along with AirCat.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+
 #include "id3.h"
 
 const char *ID3v1_genres[] = {
@@ -57,3 +63,549 @@ const char *ID3v1_genres[] = {
 };
 const int ID3v1_genres_count = sizeof(ID3v1_genres) / sizeof(char*);
 
+
+/* ID3v2 text encodings */
+enum {
+	ID3_ENC_LATIN1 = 0,
+	ID3_ENC_UTF16,
+	ID3_ENC_UTF16BE,
+	ID3_ENC_UTF8
+};
+
+/* Frames used for text tags (ID3v2.2 and ID3v2.3/4 names) */
+enum {
+	ID3_FRAME_TITLE = 0,
+	ID3_FRAME_ARTIST,
+	ID3_FRAME_ALBUM,
+	ID3_FRAME_COMMENT,
+	ID3_FRAME_GENRE,
+	ID3_FRAME_TRACK,
+	ID3_FRAME_YEAR,
+	ID3_FRAME_DATE,
+	ID3_FRAME_COPYRIGHT,
+	ID3_FRAME_ENCODED,
+	ID3_FRAME_LANGUAGE,
+	ID3_FRAME_PUBLISHER,
+	ID3_FRAME_PICTURE,
+	ID3_FRAME_COUNT
+};
+
+static const char *id3v2_frames[ID3_FRAME_COUNT][2] = {
+	{ "TT2", "TIT2" },
+	{ "TP1", "TPE1" },
+	{ "TAL", "TALB" },
+	{ "COM", "COMM" },
+	{ "TCO", "TCON" },
+	{ "TRK", "TRCK" },
+	{ "TYE", "TYER" },
+	{ "",    "TDRC" },
+	{ "TCR", "TCOP" },
+	{ "TEN", "TENC" },
+	{ "TLA", "TLAN" },
+	{ "TPB", "TPUB" },
+	{ "PIC", "APIC" },
+};
+
+#define ID3V2_SYNCSAFE(b) (((b)[0] << 21) | ((b)[1] << 14) | ((b)[2] << 7) | \
+			   (b)[3])
+#define ID3V2_READ32(b) (((uint32_t) (b)[0] << 24) | ((b)[1] << 16) | \
+			 ((b)[2] << 8) | (b)[3])
+#define ID3V2_READ24(b) (((b)[0] << 16) | ((b)[1] << 8) | (b)[2])
+
+/* ID3v2 picture type for front cover */
+#define ID3V2_PIC_FRONT_COVER 3
+
+size_t id3v2_size(const unsigned char *h)
+{
+	size_t size;
+
+	/* Check header */
+	if(memcmp(h, "ID3", 3) != 0 || h[3] == 0xFF || h[4] == 0xFF ||
+	   (h[6] | h[7] | h[8] | h[9]) & 0x80)
+		return 0;
+
+	/* Get tag size with header and footer */
+	size = ID3V2_SYNCSAFE(&h[6]) + ID3V2_HEADER_SIZE;
+	if(h[5] & 0x10)
+		size += ID3V2_HEADER_SIZE;
+
+	return size;
+}
+
+static size_t id3v2_unsync(unsigned char *buffer, size_t len)
+{
+	size_t i, j;
+
+	/* Remove all 0x00 inserted after 0xFF */
+	for(i = 0, j = 0; i < len; i++)
+	{
+		buffer[j++] = buffer[i];
+		if(buffer[i] == 0xFF && i + 1 < len && buffer[i+1] == 0x00)
+			i++;
+	}
+
+	return j;
+}
+
+static char *id3v2_get_string(const unsigned char *p, size_t len, int enc,
+			      size_t *used)
+{
+	unsigned char *str, *s;
+	uint32_t c, c2;
+	size_t i = 0;
+	int be = 1;
+
+	/* Allocate string (an UTF-16 character needs up to 3 bytes in UTF-8) */
+	str = malloc(len * 2 + 1);
+	if(str == NULL)
+		return NULL;
+	s = str;
+
+	/* Skip BOM */
+	if(enc == ID3_ENC_UTF16 && len >= 2)
+	{
+		if(p[0] == 0xFF && p[1] == 0xFE)
+			be = 0;
+		if((p[0] == 0xFF && p[1] == 0xFE) ||
+		   (p[0] == 0xFE && p[1] == 0xFF))
+			i = 2;
+	}
+
+	/* Convert to UTF-8 until end of string */
+	if(enc == ID3_ENC_UTF16 || enc == ID3_ENC_UTF16BE)
+	{
+		for(; i + 1 < len; i += 2)
+		{
+			c = be ? (p[i] << 8) | p[i+1] : (p[i+1] << 8) | p[i];
+			if(c == 0)
+			{
+				i += 2;
+				break;
+			}
+
+			/* Surrogate pair */
+			if(c >= 0xD800 && c < 0xDC00 && i + 3 < len)
+			{
+				c2 = be ? (p[i+2] << 8) | p[i+3] :
+					  (p[i+3] << 8) | p[i+2];
+				if(c2 >= 0xDC00 && c2 < 0xE000)
+				{
+					c = 0x10000 + ((c - 0xD800) << 10) +
+					    (c2 - 0xDC00);
+					i += 2;
+				}
+			}
+
+			/* Encode character */
+			if(c < 0x80)
+				*s++ = c;
+			else if(c < 0x800)
+			{
+				*s++ = 0xC0 | (c >> 6);
+				*s++ = 0x80 | (c & 0x3F);
+			}
+			else if(c < 0x10000)
+			{
+				*s++ = 0xE0 | (c >> 12);
+				*s++ = 0x80 | ((c >> 6) & 0x3F);
+				*s++ = 0x80 | (c & 0x3F);
+			}
+			else
+			{
+				*s++ = 0xF0 | (c >> 18);
+				*s++ = 0x80 | ((c >> 12) & 0x3F);
+				*s++ = 0x80 | ((c >> 6) & 0x3F);
+				*s++ = 0x80 | (c & 0x3F);
+			}
+		}
+	}
+	else
+	{
+		for(; i < len; i++)
+		{
+			if(p[i] == 0)
+			{
+				i++;
+				break;
+			}
+
+			/* Latin-1 characters are converted to UTF-8 */
+			if(enc == ID3_ENC_LATIN1 && p[i] >= 0x80)
+			{
+				*s++ = 0xC0 | (p[i] >> 6);
+				*s++ = 0x80 | (p[i] & 0x3F);
+			}
+			else
+				*s++ = p[i];
+		}
+	}
+	*s = '\0';
+
+	if(used != NULL)
+		*used = i > len ? len : i;
+	return (char *) str;
+}
+
+static void id3v2_set_string(char **dest, char *str)
+{
+	/* Only first frame is kept */
+	if(*dest == NULL && str != NULL && *str != '\0')
+		*dest = str;
+	else
+		free(str);
+}
+
+static void id3v2_parse_genre(struct meta *m, char *str)
+{
+	const char *p = str;
+	char *end;
+	long idx;
+
+	/* Genre is an ID3v1 index: "(idx)", "(idx)Refinement" or "idx" */
+	if(*p == '(')
+		p++;
+	idx = strtol(p, &end, 10);
+	if(end != p && (*end == '\0' || (*str == '(' && *end == ')')))
+	{
+		if(*end == ')' && end[1] != '\0')
+		{
+			/* Refinement is used as genre */
+			memmove(str, end + 1, strlen(end + 1) + 1);
+		}
+		else if(idx >= 0 && idx < ID3v1_genres_count)
+		{
+			free(str);
+			str = strdup(ID3v1_genres[idx]);
+		}
+	}
+
+	id3v2_set_string(&m->genre, str);
+}
+
+static void id3v2_parse_picture(struct meta *m, const unsigned char *p,
+				size_t len, int v2, int *best)
+{
+	char *mime = NULL, *desc;
+	size_t used;
+	int enc, type;
+
+	/* Pictures with a front cover is preferred */
+	if(len < 4 || *best == ID3V2_PIC_FRONT_COVER)
+		return;
+	enc = *p++;
+	len--;
+
+	/* Get mime type (ID3v2.2 only has an image format) */
+	if(v2)
+	{
+		if(strncasecmp((const char *) p, "PNG", 3) == 0)
+			mime = strdup("image/png");
+		else
+			mime = strdup("image/jpeg");
+		used = 3;
+	}
+	else
+		mime = id3v2_get_string(p, len, ID3_ENC_LATIN1, &used);
+	if(mime == NULL || used >= len)
+		goto error;
+	p += used;
+	len -= used;
+
+	/* Get picture type and description */
+	type = *p++;
+	len--;
+	desc = id3v2_get_string(p, len, enc, &used);
+	if(desc == NULL || used >= len)
+	{
+		free(desc);
+		goto error;
+	}
+	p += used;
+	len -= used;
+
+	/* Only first picture is kept, unless a front cover follows */
+	if(m->picture.data != NULL && type != ID3V2_PIC_FRONT_COVER)
+	{
+		free(desc);
+		goto error;
+	}
+
+	/* Replace previous picture */
+	free(m->picture.data);
+	free(m->picture.mime);
+	free(m->picture.description);
+	m->picture.size = 0;
+	m->picture.mime = mime;
+	m->picture.description = desc;
+	m->picture.data = malloc(len);
+	if(m->picture.data != NULL)
+	{
+		memcpy(m->picture.data, p, len);
+		m->picture.size = len;
+	}
+	*best = type;
+
+	return;
+
+error:
+	free(mime);
+}
+
+static void id3v2_parse_frame(struct meta *m, int frame, unsigned char *p,
+			      size_t len, int v2, int options, int *pic)
+{
+	unsigned int track, total;
+	char *str, *s;
+	size_t used;
+	int enc;
+
+	/* Get picture */
+	if(frame == ID3_FRAME_PICTURE)
+	{
+		if(options & TAG_PICTURE)
+			id3v2_parse_picture(m, p, len, v2, pic);
+		return;
+	}
+
+	/* Get encoding of text */
+	if(len < 2)
+		return;
+	enc = *p++;
+	len--;
+	if(enc > ID3_ENC_UTF8)
+		return;
+
+	/* Comment: skip language and keep comment without description */
+	if(frame == ID3_FRAME_COMMENT)
+	{
+		if(len < 4 || m->comment != NULL)
+			return;
+		str = id3v2_get_string(p + 3, len - 3, enc, &used);
+		if(str == NULL)
+			return;
+		s = *str == '\0' ? id3v2_get_string(p + 3 + used,
+						    len - 3 - used, enc,
+						    NULL) : NULL;
+		free(str);
+		id3v2_set_string(&m->comment, s);
+		return;
+	}
+
+	/* Get first string of text frame */
+	str = id3v2_get_string(p, len, enc, NULL);
+	if(str == NULL)
+		return;
+
+	switch(frame)
+	{
+		case ID3_FRAME_TITLE:
+			id3v2_set_string(&m->title, str);
+			break;
+		case ID3_FRAME_ARTIST:
+			id3v2_set_string(&m->artist, str);
+			break;
+		case ID3_FRAME_ALBUM:
+			id3v2_set_string(&m->album, str);
+			break;
+		case ID3_FRAME_GENRE:
+			id3v2_parse_genre(m, str);
+			break;
+		case ID3_FRAME_TRACK:
+			/* Track is "track" or "track/total" */
+			if(sscanf(str, "%u/%u", &track, &total) == 2)
+			{
+				m->track = track;
+				if(options & TAG_TOTAL_TRACK)
+					m->total_track = total;
+			}
+			else if(sscanf(str, "%u", &track) == 1)
+				m->track = track;
+			free(str);
+			break;
+		case ID3_FRAME_YEAR:
+		case ID3_FRAME_DATE:
+			/* Date starts with year */
+			if(m->year == 0)
+				m->year = strtol(str, NULL, 10);
+			free(str);
+			break;
+		case ID3_FRAME_COPYRIGHT:
+			if(options & TAG_COPYRIGHT)
+				id3v2_set_string(&m->copyright, str);
+			else
+				free(str);
+			break;
+		case ID3_FRAME_ENCODED:
+			if(options & TAG_ENCODED)
+				id3v2_set_string(&m->encoded, str);
+			else
+				free(str);
+			break;
+		case ID3_FRAME_LANGUAGE:
+			if(options & TAG_LANGUAGE)
+				id3v2_set_string(&m->language, str);
+			else
+				free(str);
+			break;
+		case ID3_FRAME_PUBLISHER:
+			if(options & TAG_PUBLISHER)
+				id3v2_set_string(&m->publisher, str);
+			else
+				free(str);
+			break;
+		default:
+			free(str);
+	}
+}
+
+int id3v2_parse(unsigned char *buffer, size_t len, struct meta *m,
+		int options)
+{
+	unsigned char *p, *end, *id, *data;
+	int version, flags, v2;
+	unsigned int f_flags;
+	size_t id_len, ext;
+	size_t f_len, len2;
+	int pic = -1;
+	int i;
+
+	/* Check tag */
+	if(len < ID3V2_HEADER_SIZE || id3v2_size(buffer) == 0)
+		return -1;
+	version = buffer[3];
+	flags = buffer[5];
+	v2 = version == 2;
+	if(version < 2 || version > 4)
+		return -1;
+
+	/* Get frames (footer is ignored) */
+	f_len = ID3V2_SYNCSAFE(&buffer[6]);
+	p = buffer + ID3V2_HEADER_SIZE;
+	if(f_len > len - ID3V2_HEADER_SIZE)
+		f_len = len - ID3V2_HEADER_SIZE;
+
+	/* Whole tag is unsynchronised before ID3v2.4 */
+	if(flags & 0x80 && version < 4)
+		f_len = id3v2_unsync(p, f_len);
+	end = p + f_len;
+
+	/* Skip extended header (ID3v2.2 compression is not supported) */
+	if(flags & 0x40)
+	{
+		if(v2 || f_len < 4)
+			return -1;
+		ext = version == 3 ? ID3V2_READ32(p) + 4 : ID3V2_SYNCSAFE(p);
+		if(ext > f_len)
+			return -1;
+		p += ext;
+	}
+
+	/* Parse all frames */
+	id_len = v2 ? 3 : 4;
+	while(p + id_len * 2 + (v2 ? 0 : 2) <= end)
+	{
+		/* Padding reached */
+		if(*p == '\0')
+			break;
+
+		/* Get frame size and flags */
+		id = p;
+		if(v2)
+		{
+			f_len = ID3V2_READ24(&p[3]);
+			f_flags = 0;
+			p += 6;
+		}
+		else
+		{
+			f_len = version == 4 ? ID3V2_SYNCSAFE(&p[4]) :
+					       ID3V2_READ32(&p[4]);
+			f_flags = (p[8] << 8) | p[9];
+			p += 10;
+		}
+		if(f_len > (size_t) (end - p))
+			break;
+
+		/* Find frame */
+		for(i = 0; i < ID3_FRAME_COUNT; i++)
+			if(memcmp(id, id3v2_frames[i][v2 ? 0 : 1], id_len) == 0)
+				break;
+
+		/* Skip compressed and encrypted frames */
+		if((version == 3 && (f_flags & 0x00C0)) ||
+		   (version == 4 && (f_flags & 0x000C)))
+			i = ID3_FRAME_COUNT;
+
+		/* ID3v2.4 frame can have a data length indicator and be
+		 * unsynchronised
+		 */
+		data = p;
+		len2 = f_len;
+		if(version == 4 && (f_flags & 0x0001))
+		{
+			data += 4;
+			len2 = len2 >= 4 ? len2 - 4 : 0;
+		}
+		if(i < ID3_FRAME_COUNT && version == 4 &&
+		   (f_flags & 0x0002 || flags & 0x80))
+			len2 = id3v2_unsync(data, len2);
+
+		/* Parse frame */
+		if(i < ID3_FRAME_COUNT)
+			id3v2_parse_frame(m, i, data, len2, v2, options, &pic);
+		p += f_len;
+	}
+
+	return 0;
+}
+
+static char *id3v1_get_string(const unsigned char *p, size_t len)
+{
+	/* Remove trailing spaces */
+	while(len > 0 && (p[len-1] == ' ' || p[len-1] == '\0'))
+		len--;
+	if(len == 0)
+		return NULL;
+
+	return id3v2_get_string(p, len, ID3_ENC_LATIN1, NULL);
+}
+
+int id3v1_parse(const unsigned char *buffer, struct meta *m)
+{
+	char year[5];
+
+	/* Check tag */
+	if(memcmp(buffer, "TAG", 3) != 0)
+		return -1;
+
+	/* Get text tags */
+	if(m->title == NULL)
+		m->title = id3v1_get_string(&buffer[3], 30);
+	if(m->artist == NULL)
+		m->artist = id3v1_get_string(&buffer[33], 30);
+	if(m->album == NULL)
+		m->album = id3v1_get_string(&buffer[63], 30);
+	if(m->year == 0)
+	{
+		memcpy(year, &buffer[93], 4);
+		year[4] = '\0';
+		m->year = strtol(year, NULL, 10);
+	}
+
+	/* ID3v1.1 has a track number at end of comment */
+	if(buffer[125] == 0 && buffer[126] != 0)
+	{
+		if(m->comment == NULL)
+			m->comment = id3v1_get_string(&buffer[97], 28);
+		if(m->track == 0)
+			m->track = buffer[126];
+	}
+	else if(m->comment == NULL)
+		m->comment = id3v1_get_string(&buffer[97], 30);
+
+	/* Get genre */
+	if(m->genre == NULL && buffer[127] < ID3v1_genres_count)
+		m->genre = strdup(ID3v1_genres[buffer[127]]);
+
+	return 0;
+}
@@ -19,8 +19,29 @@
 #ifndef _ID3_H
 #define _ID3_H
 
+#include <stddef.h>
+
+#include "meta.h"
+
+#define ID3V2_HEADER_SIZE 10
+#define ID3V1_SIZE 128
+
 extern const char *ID3v1_genres[];
-const int ID3v1_genres_count;
+extern const int ID3v1_genres_count;
+
+/* Get complete size of an ID3v2 tag (with header and footer) from its 10 bytes
+ * header, or 0 if it is not an ID3v2 tag.
+ */
+size_t id3v2_size(const unsigned char *header);
+
+/* Fill meta with an ID3v2 tag (header included): buffer is modified when tag
+ * is unsynchronised. Only tags asked in options (TAG_*) are extracted, in
+ * addition to common text tags. Returns -1 if the tag is not supported.
+ */
+int id3v2_parse(unsigned char *buffer, size_t len, struct meta *m, int options);
+
+/* Fill meta with an ID3v1 tag (ID3V1_SIZE bytes) for values not set yet */
+int id3v1_parse(const unsigned char *buffer, struct meta *m);
 
 #endif
 
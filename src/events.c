@@ -16,20 +16,33 @@
  * along with AirCat.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <pthread.h>
 
+#include "json_stream.h"
 #include "events.h"
+#include "lock.h"
 
 #define EVENT_SESSION_KEY "event_last"
+#define EVENT_STREAM_TYPE "text/event-stream"
+#define EVENT_STREAM_BLOCK 4096
+
+/* Number of responses kept for the current sequence number */
+#define EVENTS_SNAPSHOTS 4
 
 struct event {
 	char *name;		/*!< Event name */
 	enum event_type type;	/*!< Event type */
-	struct json *data;	/*!< Event data */
+	char *str;		/*!< Event exported in JSON */
 	time_t timestamp;	/*!< Event time stamp */
+	uint64_t seq;		/*!< Event sequence number */
 	struct event *next;	/*!< Next event in list */
 };
 
@@ -41,12 +54,42 @@ struct event_handle {
 	struct event_handle *next;	/*!< Next handle in list */
 };
 
+struct events_snapshot {
+	uint64_t from;			/*!< Last event known by client */
+	uint64_t seq;			/*!< Last event in response */
+	uint64_t generation;		/*!< Generation of event lists */
+	char *str;			/*!< Response in JSON */
+	size_t len;			/*!< Length of response */
+	unsigned long ref;		/*!< Reference counter */
+};
+
+struct events_client {
+	struct events_handle *events;	/*!< Parent events handle */
+	struct httpd_stream *stream;	/*!< HTTP stream of client */
+	uint64_t last;			/*!< Last event sent */
+	char *buffer;			/*!< Message being sent */
+	size_t len;			/*!< Length of message */
+	size_t pos;			/*!< Position in message */
+	struct events_client *next;	/*!< Next client in list */
+};
+
 struct events_handle {
-	time_t timestamp;		/*!< Last event time stamp */
+	uint64_t seq;			/*!< Last event sequence number */
+	uint64_t generation;		/*!< Incremented on event removal */
 	struct event_handle *events;	/*!< Event handle list (children) */
+	struct events_client *clients;	/*!< Clients waiting for events */
 	pthread_mutex_t mutex;		/*!< Mutex for events access */
+	/* Shared responses */
+	struct events_snapshot *snapshots[EVENTS_SNAPSHOTS];
+	unsigned int snapshot_next;
+	pthread_mutex_t snapshot_mutex;
 };
 
+/* Lock classes of event lists, event handles and shared responses */
+LOCK_CLASS(events_class, "events");
+LOCK_CLASS(event_class, "event");
+LOCK_CLASS(events_snapshot_class, "events_snapshot");
+
 int events_open(struct events_handle **handle)
 {
 	struct events_handle *h;
@@ -58,123 +101,165 @@ int events_open(struct events_handle **handle)
 	h = *handle;
 
 	/* Init handle */
-	h->timestamp = 0;
+	h->seq = 0;
+	h->generation = 0;
 	h->events = NULL;
+	h->clients = NULL;
+	memset(h->snapshots, 0, sizeof(h->snapshots));
+	h->snapshot_next = 0;
 
 	/* Init mutex */
 	pthread_mutex_init(&h->mutex, NULL);
+	pthread_mutex_init(&h->snapshot_mutex, NULL);
 
 	return 0;
 }
 
-static int events_check_events(struct events_handle *h, time_t last)
+static int events_check_events(struct events_handle *h, uint64_t last)
 {
-	time_t last_ts;
-
-	/* Lock events access */
-	pthread_mutex_lock(&h->mutex);
-
-	last_ts = h->timestamp;
-
-	/* Unlock events access */
-	pthread_mutex_unlock(&h->mutex);
-
 	/* An event has been found */
-	if(last_ts > last)
+	if(__atomic_load_n(&h->seq, __ATOMIC_ACQUIRE) > last)
 		return 1;
 
 	return 0;
 }
 
-static char *events_get_events(struct events_handle *h, time_t *last)
+static char *events_get_events(struct events_handle *h, uint64_t *last,
+			       uint64_t *generation, size_t *len)
 {
-	struct json *root, *hev, *aev, *jev;
+	struct json_stream *root;
 	struct event_handle *eh;
 	struct event *ev;
-	char *str = NULL;
-	time_t max = *last;
 
 	/* Create a new JSON array */
-	root = json_new_array();
+	root = json_stream_new();
 	if(root == NULL)
 		return NULL;
+	json_stream_begin_array(root, NULL);
 
 	/* Lock events access */
-	pthread_mutex_lock(&h->mutex);
+	lock_mutex(events_class, &h->mutex);
+
+	/* Get generation before reading lists */
+	*generation = __atomic_load_n(&h->generation, __ATOMIC_ACQUIRE);
 
 	/* Fill list */
 	for(eh = h->events; eh != NULL; eh = eh->next)
 	{
 		/* Create a new entry */
-		hev = json_new();
-		if(hev == NULL)
-			continue;
-
-		/* Create a new array */
-		aev = json_new_array();
-		if(aev == NULL)
-			continue;
+		json_stream_begin_object(root, NULL);
+		json_stream_add(root, "name", json_new_string(eh->name));
+		json_stream_begin_array(root, "events");
 
 		/* Lock event list access */
-		pthread_mutex_lock(&eh->mutex);
+		lock_mutex(event_class, &eh->mutex);
 
 		for(ev = eh->evs; ev != NULL; ev = ev->next)
 		{
 			/* If event is too old, go to next handler */
-			if(ev->timestamp <= *last)
+			if(ev->seq <= *last)
 				break;
 
-			/* Update highest timestamp */
-			if(ev->timestamp > max)
-				max = ev->timestamp;
+			/* Add exported event to list */
+			if(ev->str != NULL)
+				json_stream_add_string(root, NULL, ev->str);
+		}
 
-			/* Create a new event */
-			jev = json_new();
-			if(jev == NULL)
-				continue;
+		/* Unlock event list access */
+		unlock_mutex(event_class, &eh->mutex);
 
-			/* Fill event */
-			json_set_string(jev, "name", ev->name);
-			json_set_int(jev, "type", ev->type);
-			json_set_int64(jev, "ts", ev->timestamp);
-			json_add(jev, "data", json_copy(ev->data));
+		/* Close entry */
+		json_stream_end_array(root);
+		json_stream_end_object(root);
+	}
 
-			/* Add event to list */
-			if(json_array_add(aev, jev) != 0)
-				json_free(jev);
-		}
+	/* Update last sequence number: events are added with events lock */
+	*last = h->seq;
 
-		/* Unlock event list access */
-		pthread_mutex_unlock(&eh->mutex);
+	/* Unlock events access */
+	unlock_mutex(events_class, &h->mutex);
+
+	/* Get string */
+	json_stream_end_array(root);
+	return json_stream_finish(root, len);
+}
+
+static void events_release_snapshot(struct events_snapshot *s)
+{
+	if(s == NULL ||
+	   __atomic_sub_fetch(&s->ref, 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+
+	/* Free snapshot */
+	free(s->str);
+	free(s);
+}
 
-		/* Fill object */
-		json_set_string(hev, "name", eh->name);
-		json_add(hev, "events", aev);
+static struct events_snapshot *events_get_snapshot(struct events_handle *h,
+						   uint64_t last)
+{
+	struct events_snapshot *s, *old;
+	uint64_t seq, generation;
+	unsigned int i;
+
+	/* Get current state */
+	seq = __atomic_load_n(&h->seq, __ATOMIC_ACQUIRE);
+	generation = __atomic_load_n(&h->generation, __ATOMIC_ACQUIRE);
 
-		/* Add to list */
-		if(json_array_add(root, hev) != 0)
-			json_free(hev);
+	/* Find a response already generated for this client state */
+	lock_mutex(events_snapshot_class, &h->snapshot_mutex);
+	for(i = 0; i < EVENTS_SNAPSHOTS; i++)
+	{
+		s = h->snapshots[i];
+		if(s != NULL && s->from == last && s->seq == seq &&
+		   s->generation == generation)
+		{
+			__atomic_add_fetch(&s->ref, 1, __ATOMIC_RELAXED);
+			unlock_mutex(events_snapshot_class, &h->snapshot_mutex);
+			return s;
+		}
 	}
+	unlock_mutex(events_snapshot_class, &h->snapshot_mutex);
 
-	/* Unlock events access */
-	pthread_mutex_unlock(&h->mutex);
+	/* Allocate a new snapshot */
+	s = malloc(sizeof(struct events_snapshot));
+	if(s == NULL)
+		return NULL;
+	s->from = last;
+	s->seq = last;
 
-	/* Update highest timestamp */
-	*last = max > 0 ? max : time(NULL);
+	/* Generate response */
+	s->str = events_get_events(h, &s->seq, &s->generation, &s->len);
+	if(s->str == NULL)
+	{
+		free(s);
+		return NULL;
+	}
 
-	/* Export JSON object to string */
-	str = (char *) json_export(root);
-	if(str != NULL)
-		str = strdup(str);
+	/* Share it: one reference for cache and one for caller */
+	s->ref = 2;
+	lock_mutex(events_snapshot_class, &h->snapshot_mutex);
+	old = h->snapshots[h->snapshot_next];
+	h->snapshots[h->snapshot_next] = s;
+	h->snapshot_next = (h->snapshot_next + 1) % EVENTS_SNAPSHOTS;
+	unlock_mutex(events_snapshot_class, &h->snapshot_mutex);
 
-	/* Free JSON object */
-	json_free(root);
+	/* Release replaced snapshot */
+	events_release_snapshot(old);
 
-	return str;
+	return s;
+}
+
+static void events_invalidate(struct events_handle *h)
+{
+	/* Responses including removed events can't be shared anymore */
+	__atomic_add_fetch(&h->generation, 1, __ATOMIC_RELEASE);
 }
 
 void events_close(struct events_handle *h)
 {
+	int i;
+
 	if(h == NULL)
 		return;
 
@@ -185,6 +270,10 @@ void events_close(struct events_handle *h)
 		event_close(h->events);
 	}
 
+	/* Free shared responses */
+	for(i = 0; i < EVENTS_SNAPSHOTS; i++)
+		events_release_snapshot(h->snapshots[i]);
+
 	/* Free handle */
 	free(h);
 }
@@ -209,14 +298,14 @@ int event_open(struct event_handle **handle, struct events_handle *events,
 	pthread_mutex_init(&h->mutex, NULL);
 
 	/* Lock events access */
-	pthread_mutex_lock(&events->mutex);
+	lock_mutex(events_class, &events->mutex);
 
 	/* Add handle to main list */
 	h->next = events->events;
 	events->events = h;
 
 	/* Unlock events access */
-	pthread_mutex_unlock(&events->mutex);
+	unlock_mutex(events_class, &events->mutex);
 
 	return 0;
 }
@@ -246,14 +335,19 @@ static struct event *event_remove_from_list(struct event_handle *h,
 int event_add(struct event_handle *h, const char *name, enum event_type type,
 	      struct json *data)
 {
+	struct events_client *c;
 	struct event *ev;
+	struct json *jev;
 
 	/* Check name */
 	if(name == NULL)
 		return -1;
 
+	/* Lock events access (sequence numbers must be visible in order) */
+	lock_mutex(events_class, &h->events->mutex);
+
 	/* Lock event list access */
-	pthread_mutex_lock(&h->mutex);
+	lock_mutex(event_class, &h->mutex);
 
 	/* Find event if already exist */
 	ev = event_remove_from_list(h, name);
@@ -266,7 +360,8 @@ int event_add(struct event_handle *h, const char *name, enum event_type type,
 		if(ev == NULL)
 		{
 			/* Unlock event list access */
-			pthread_mutex_unlock(&h->mutex);
+			unlock_mutex(event_class, &h->mutex);
+			unlock_mutex(events_class, &h->events->mutex);
 			return -1;
 		}
 
@@ -275,25 +370,48 @@ int event_add(struct event_handle *h, const char *name, enum event_type type,
 	}
 	else
 	{
-		/* Free previous data */
-		if(ev->data != NULL)
-			json_free(ev->data);
+		/* Free previous string */
+		if(ev->str != NULL)
+			free(ev->str);
 	}
 
 	/* Fill event */
 	ev->type = type;
 	ev->timestamp = time(NULL);
-	ev->data = data;
+	ev->seq = h->events->seq + 1;
+	ev->str = NULL;
+
+	/* Export event once for all clients */
+	jev = json_new();
+	if(jev != NULL)
+	{
+		json_set_string(jev, "name", ev->name);
+		json_set_int(jev, "type", ev->type);
+		json_set_int64(jev, "ts", ev->timestamp);
+		json_set_int64(jev, "seq", ev->seq);
+		json_add(jev, "data", data);
+		ev->str = strdup(json_export(jev));
+		json_free(jev);
+	}
+	else
+		json_free(data);
+
+	/* Publish sequence number */
+	__atomic_store_n(&h->events->seq, ev->seq, __ATOMIC_RELEASE);
 
 	/* Add to list */
 	ev->next = h->evs;
 	h->evs = ev;
 
-	/* Update last global timestamp */
-	h->events->timestamp = ev->timestamp;
-
 	/* Unlock event list access */
-	pthread_mutex_unlock(&h->mutex);
+	unlock_mutex(event_class, &h->mutex);
+
+	/* Wake up all waiting clients */
+	for(c = h->events->clients; c != NULL; c = c->next)
+		httpd_resume_stream(c->stream);
+
+	/* Unlock events access */
+	unlock_mutex(events_class, &h->events->mutex);
 
 	return 0;
 }
@@ -303,9 +421,9 @@ static void event_free(struct event *ev)
 	/* Free name event */
 	free(ev->name);
 
-	/* Free event data */
-	if(ev->data != NULL)
-		json_free(ev->data);
+	/* Free exported event */
+	if(ev->str != NULL)
+		free(ev->str);
 
 	/* Free event */
 	free(ev);
@@ -316,13 +434,13 @@ int event_remove(struct event_handle *h, const char *name)
 	struct event *ev;
 
 	/* Lock event list access */
-	pthread_mutex_lock(&h->mutex);
+	lock_mutex(event_class, &h->mutex);
 
 	/* Find event */
 	ev = event_remove_from_list(h, name);
 
 	/* Unlock event list access */
-	pthread_mutex_unlock(&h->mutex);
+	unlock_mutex(event_class, &h->mutex);
 
 	/* Event not found */
 	if(ev == NULL)
@@ -330,6 +448,7 @@ int event_remove(struct event_handle *h, const char *name)
 
 	/* Free event */
 	event_free(ev);
+	events_invalidate(h->events);
 
 	return 0;
 }
@@ -339,7 +458,7 @@ void event_flush(struct event_handle *h)
 	struct event *ev;
 
 	/* Lock event list access */
-	pthread_mutex_lock(&h->mutex);
+	lock_mutex(event_class, &h->mutex);
 
 	/* Remove all events */
 	while(h->evs != NULL)
@@ -350,7 +469,10 @@ void event_flush(struct event_handle *h)
 	}
 
 	/* Unlock event list access */
-	pthread_mutex_unlock(&h->mutex);
+	unlock_mutex(event_class, &h->mutex);
+
+	/* Release shared responses */
+	events_invalidate(h->events);
 }
 
 void event_close(struct event_handle *h)
@@ -361,7 +483,7 @@ void event_close(struct event_handle *h)
 		return;
 
 	/* Lock events access*/
-	pthread_mutex_lock(&h->events->mutex);
+	lock_mutex(events_class, &h->events->mutex);
 
 	/* Remove from event handle list */
 	ep = &h->events->events;
@@ -378,7 +500,7 @@ void event_close(struct event_handle *h)
 	}
 
 	/* Unlock events access*/
-	pthread_mutex_unlock(&h->events->mutex);
+	unlock_mutex(events_class, &h->events->mutex);
 
 	/* Flush event list */
 	event_flush(h);
@@ -391,42 +513,197 @@ void event_close(struct event_handle *h)
 	free(h);
 }
 
+static ssize_t events_stream_cb(void *user_data, uint64_t pos, char *buffer,
+				size_t size)
+{
+	struct events_client *c = user_data;
+	struct events_snapshot *snap;
+	int len;
+
+	/* Get new events */
+	if(c->buffer == NULL)
+	{
+		/* Wait for new events */
+		if(events_check_events(c->events, c->last) == 0)
+			return 0;
+
+		/* Get event list from last event sent */
+		snap = events_get_snapshot(c->events, c->last);
+		if(snap == NULL)
+			return -1;
+		c->last = snap->seq;
+
+		/* Generate message */
+		len = asprintf(&c->buffer, "id: %llu\ndata: %s\n\n",
+			       (unsigned long long) c->last, snap->str);
+		events_release_snapshot(snap);
+		if(len < 0)
+		{
+			c->buffer = NULL;
+			return -1;
+		}
+		c->len = len;
+		c->pos = 0;
+	}
+
+	/* Copy message */
+	if(size > c->len - c->pos)
+		size = c->len - c->pos;
+	memcpy(buffer, c->buffer + c->pos, size);
+	c->pos += size;
+
+	/* Message has been sent */
+	if(c->pos == c->len)
+	{
+		free(c->buffer);
+		c->buffer = NULL;
+	}
+
+	return size;
+}
+
+static void events_stream_free_cb(void *user_data)
+{
+	struct events_client *c = user_data;
+	struct events_handle *h = c->events;
+	struct events_client **cp;
+
+	/* Lock events access */
+	lock_mutex(events_class, &h->mutex);
+
+	/* Remove client from list */
+	for(cp = &h->clients; *cp != NULL; cp = &(*cp)->next)
+	{
+		if(*cp == c)
+		{
+			*cp = c->next;
+			break;
+		}
+	}
+
+	/* Unlock events access */
+	unlock_mutex(events_class, &h->mutex);
+
+	/* Free client */
+	if(c->buffer != NULL)
+		free(c->buffer);
+	free(c);
+}
+
+static int events_httpd_stream_events(struct events_handle *h,
+				      struct httpd_req *req,
+				      struct httpd_res **res)
+{
+	struct events_client *c;
+	const char *id;
+
+	/* Allocate client */
+	c = calloc(1, sizeof(struct events_client));
+	if(c == NULL)
+		return -1;
+	c->events = h;
+
+	/* Continue from last event received by client */
+	id = httpd_get_header(req, "Last-Event-ID");
+	if(id != NULL)
+		c->last = strtoull(id, NULL, 10);
+
+	/* Create HTTP stream */
+	*res = httpd_new_stream_response(req, EVENT_STREAM_BLOCK,
+					 &events_stream_cb, c,
+					 &events_stream_free_cb, &c->stream);
+	if(*res == NULL)
+	{
+		free(c);
+		return -1;
+	}
+	httpd_add_header(*res, HTTPD_HEADER_CONTENT_TYPE, EVENT_STREAM_TYPE);
+	httpd_add_header(*res, "Cache-Control", "no-cache");
+
+	/* Add client to waiting list */
+	lock_mutex(events_class, &h->mutex);
+	if(c->last > h->seq)
+		c->last = 0;
+	c->next = h->clients;
+	h->clients = c;
+	unlock_mutex(events_class, &h->mutex);
+
+	return 200;
+}
+
+static ssize_t events_snapshot_cb(void *user_data, uint64_t pos,
+				  char *buffer, size_t size)
+{
+	struct events_snapshot *s = user_data;
+
+	/* End of response */
+	if(pos >= s->len)
+		return -1;
+
+	/* Copy response */
+	if(size > s->len - pos)
+		size = s->len - pos;
+	memcpy(buffer, s->str + pos, size);
+
+	return size;
+}
+
+static void events_snapshot_free_cb(void *user_data)
+{
+	events_release_snapshot(user_data);
+}
+
 static int events_httpd_get_events(void *user_data, struct httpd_req *req,
 				   struct httpd_res **res)
 {
 	struct events_handle *h = user_data;
-	time_t last = 0;
-	char value[11];
+	struct events_snapshot *snap;
+	const char *accept;
+	uint64_t last = 0;
+	char value[21];
 	char *str;
 
+	/* Push events with Server-Sent Events if requested */
+	accept = httpd_get_header(req, "Accept");
+	if(accept != NULL && strstr(accept, EVENT_STREAM_TYPE) != NULL &&
+	   events_httpd_stream_events(h, req, res) >= 0)
+		return 200;
+
 	/* Get last event from session */
 	str = httpd_get_session_value(req, EVENT_SESSION_KEY);
 	if(str != NULL)
 	{
-		last = strtoul(str, NULL, 10);
+		last = strtoull(str, NULL, 10);
 		free(str);
-	}
 
-	/* Check if new events are available */
-	if(last > 0 && events_check_events(h, last) == 0)
-	{
-		/* Not changed */
-		return 304;
+		/* Check if new events are available */
+		if(events_check_events(h, last) == 0)
+		{
+			/* Not changed */
+			return 304;
+		}
 	}
 
-	/* Get event list from last event */
-	str = events_get_events(h, &last);
-	if(str == NULL)
+	/* Get event list from last event (shared between clients) */
+	snap = events_get_snapshot(h, last);
+	if(snap == NULL)
 		return 500;
 
 	/* Generate string for new session value */
-	snprintf(value, sizeof(value), "%lu", last);
+	snprintf(value, sizeof(value), "%llu", (unsigned long long) snap->seq);
 
 	/* Update last event in session */
 	httpd_set_session_value(req, EVENT_SESSION_KEY, value);
 
 	/* Create HTTP response */
-	*res = httpd_new_response(str, 1, 0);
+	*res = httpd_new_cb_response(snap->len, EVENT_STREAM_BLOCK,
+				     &events_snapshot_cb, snap,
+				     &events_snapshot_free_cb);
+	if(*res == NULL)
+	{
+		events_release_snapshot(snap);
+		return 500;
+	}
 	return 200;
 }
 
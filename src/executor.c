@@ -0,0 +1,710 @@
+/*
+ * executor.c - Shared worker pool and event loop for background tasks
+ *
+ * Copyright (c) 2014   A. Dilly
+ *
+ * AirCat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * AirCat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with AirCat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_EPOLL_CREATE1
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+#include "executor.h"
+#include "thread.h"
+
+#define LOAD(v) __atomic_load_n(&(v), __ATOMIC_ACQUIRE)
+#define STORE(v, x) __atomic_store_n(&(v), x, __ATOMIC_RELEASE)
+#define CAS(v, o, n) __atomic_compare_exchange_n(&(v), &(o), n, 0, \
+						 __ATOMIC_ACQ_REL, \
+						 __ATOMIC_ACQUIRE)
+#define ADD(v, x) __atomic_add_fetch(&(v), x, __ATOMIC_ACQ_REL)
+#define SUB(v, x) __atomic_sub_fetch(&(v), x, __ATOMIC_ACQ_REL)
+
+#define EXECUTOR_MAX_WORKERS 32
+#define EXECUTOR_EVENTS 32
+
+/* Task states: a wake up during a run moves task to TASK_RUNNING_WOKEN, so it
+ * is queued again when its callback returns */
+enum task_state {
+	TASK_IDLE,
+	TASK_QUEUED,
+	TASK_RUNNING,
+	TASK_RUNNING_WOKEN,
+	TASK_FINISHED
+};
+
+struct task {
+	/* Callback */
+	task_cb cb;
+	void *user_data;
+	char name[16];
+	int state;
+	/* Next task in a worker queue */
+	struct task *next;
+	/* Reactor: the task is in reactor list while it has a deadline or a
+	 * socket armed. Events refer to the task by its id, so an event
+	 * returned for a task joined meanwhile is discarded.
+	 */
+	uint64_t id;
+	uint64_t deadline;
+	int fd;
+	int fd_armed;
+	int in_reactor;
+	struct task *reactor_prev;
+	struct task *reactor_next;
+};
+
+struct executor_worker {
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	struct task *first;
+	struct task *last;
+};
+
+/* Configuration */
+static unsigned int executor_workers = 0;
+
+/* Worker pool */
+static struct executor_worker executor_pool[EXECUTOR_MAX_WORKERS];
+static unsigned int executor_count = 0;
+static unsigned int executor_next = 0;
+static unsigned long executor_pending = 0;
+static unsigned int executor_sleepers = 0;
+static pthread_mutex_t executor_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t executor_cond = PTHREAD_COND_INITIALIZER;
+static __thread struct executor_worker *executor_self = NULL;
+
+/* Join of finished tasks */
+static pthread_mutex_t executor_done_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t executor_done_cond = PTHREAD_COND_INITIALIZER;
+
+/* Reactor */
+static pthread_t reactor_thread;
+static pthread_mutex_t reactor_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct task *reactor_list = NULL;
+static uint64_t reactor_wakeup = 0;
+static uint64_t reactor_ids = 0;
+static int reactor_epoll = -1;
+static int reactor_event = -1;
+
+/* Statistics */
+static unsigned long executor_tasks = 0;
+static unsigned long executor_runs = 0;
+static unsigned long executor_steals = 0;
+
+static uint64_t executor_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void executor_push(struct task *t)
+{
+	struct executor_worker *w;
+
+	/* Queue in worker of caller, or spread over workers */
+	w = executor_self;
+	if(w == NULL)
+		w = &executor_pool[ADD(executor_next, 1) %
+				   LOAD(executor_count)];
+
+	/* Add task at end of queue (counted first, so a worker never sleeps
+	 * while it is queued) */
+	ADD(executor_pending, 1);
+	pthread_mutex_lock(&w->mutex);
+	t->next = NULL;
+	if(w->last != NULL)
+		w->last->next = t;
+	else
+		w->first = t;
+	w->last = t;
+	pthread_mutex_unlock(&w->mutex);
+
+	/* Wake up an idle worker */
+	pthread_mutex_lock(&executor_mutex);
+	if(executor_sleepers > 0)
+		pthread_cond_signal(&executor_cond);
+	pthread_mutex_unlock(&executor_mutex);
+}
+
+static struct task *executor_pop(struct executor_worker *w)
+{
+	struct task *t;
+
+	/* Take first task of queue */
+	pthread_mutex_lock(&w->mutex);
+	t = w->first;
+	if(t != NULL)
+	{
+		w->first = t->next;
+		if(w->first == NULL)
+			w->last = NULL;
+		t->next = NULL;
+	}
+	pthread_mutex_unlock(&w->mutex);
+
+	if(t != NULL)
+		SUB(executor_pending, 1);
+
+	return t;
+}
+
+static struct task *executor_get(struct executor_worker *w)
+{
+	unsigned int count, i;
+	struct task *t;
+
+	/* Own queue first */
+	t = executor_pop(w);
+	if(t != NULL)
+		return t;
+
+	/* Steal from other workers */
+	count = LOAD(executor_count);
+	for(i = 1; i < count; i++)
+	{
+		t = executor_pop(&executor_pool[(w - executor_pool + i) %
+						count]);
+		if(t != NULL)
+		{
+			ADD(executor_steals, 1);
+			return t;
+		}
+	}
+
+	return NULL;
+}
+
+static void reactor_remove(struct task *t)
+{
+	/* Remove task from reactor list (reactor mutex is locked) */
+	if(!t->in_reactor)
+		return;
+	if(t->reactor_prev != NULL)
+		t->reactor_prev->reactor_next = t->reactor_next;
+	else
+		reactor_list = t->reactor_next;
+	if(t->reactor_next != NULL)
+		t->reactor_next->reactor_prev = t->reactor_prev;
+	t->reactor_prev = NULL;
+	t->reactor_next = NULL;
+	t->in_reactor = 0;
+}
+
+static void reactor_add(struct task *t)
+{
+	/* Add task in reactor list (reactor mutex is locked) */
+	if(t->in_reactor)
+		return;
+	t->reactor_prev = NULL;
+	t->reactor_next = reactor_list;
+	if(reactor_list != NULL)
+		reactor_list->reactor_prev = t;
+	reactor_list = t;
+	t->in_reactor = 1;
+}
+
+#ifdef HAVE_EPOLL_CREATE1
+static void reactor_release_fd(struct task *t)
+{
+	/* Unregister socket of task (reactor mutex is locked) */
+	if(t->fd >= 0)
+		epoll_ctl(reactor_epoll, EPOLL_CTL_DEL, t->fd, NULL);
+	t->fd = -1;
+	t->fd_armed = 0;
+}
+#endif
+
+static void executor_finish(struct task *t)
+{
+#ifdef HAVE_EPOLL_CREATE1
+	/* Release timeout and socket (already released by owners which close
+	 * their socket) */
+	pthread_mutex_lock(&reactor_mutex);
+	reactor_release_fd(t);
+	t->deadline = 0;
+	reactor_remove(t);
+	pthread_mutex_unlock(&reactor_mutex);
+#endif
+
+	/* Task is finished: wake up joiner */
+	pthread_mutex_lock(&executor_done_mutex);
+	STORE(t->state, TASK_FINISHED);
+	pthread_cond_broadcast(&executor_done_cond);
+	pthread_mutex_unlock(&executor_done_mutex);
+}
+
+static void *executor_worker_thread(void *user_data)
+{
+	struct executor_worker *w = user_data;
+	char name[16];
+	struct task *t;
+	int state;
+	int ret;
+
+	/* Set thread scheduling and name: tasks are part of audio path */
+	snprintf(name, sizeof(name), "worker-%u",
+		 (unsigned int) (w - executor_pool));
+	thread_setup(THREAD_CACHE, name);
+	executor_self = w;
+
+	while(1)
+	{
+		/* Get next task */
+		t = executor_get(w);
+		if(t == NULL)
+		{
+			/* Sleep until a task is queued */
+			pthread_mutex_lock(&executor_mutex);
+			if(LOAD(executor_pending) == 0)
+			{
+				executor_sleepers++;
+				pthread_cond_wait(&executor_cond,
+						  &executor_mutex);
+				executor_sleepers--;
+			}
+			pthread_mutex_unlock(&executor_mutex);
+			continue;
+		}
+
+		/* Run task */
+		STORE(t->state, TASK_RUNNING);
+		ADD(executor_runs, 1);
+		ret = t->cb(t->user_data, t);
+
+		/* Task has finished */
+		if(ret == TASK_DONE)
+		{
+			executor_finish(t);
+			continue;
+		}
+
+		/* Park task unless it has been woken during the run */
+		state = TASK_RUNNING;
+		if(ret == TASK_WAIT && CAS(t->state, state, TASK_IDLE))
+			continue;
+
+		/* Run it again */
+		STORE(t->state, TASK_QUEUED);
+		executor_push(t);
+	}
+
+	return NULL;
+}
+
+#ifdef HAVE_EPOLL_CREATE1
+static void *executor_reactor_thread(void *user_data)
+{
+	struct epoll_event events[EXECUTOR_EVENTS];
+	struct task *t, *next;
+	uint64_t now, next_deadline, value;
+	int timeout;
+	int count, i;
+
+	/* Set thread scheduling and name */
+	thread_setup(THREAD_CACHE, "reactor");
+
+	while(1)
+	{
+		/* Get nearest deadline */
+		pthread_mutex_lock(&reactor_mutex);
+		next_deadline = 0;
+		for(t = reactor_list; t != NULL; t = t->reactor_next)
+			if(t->deadline != 0 &&
+			   (next_deadline == 0 || t->deadline < next_deadline))
+				next_deadline = t->deadline;
+		reactor_wakeup = next_deadline;
+		pthread_mutex_unlock(&reactor_mutex);
+
+		/* Wait for socket events until deadline */
+		timeout = -1;
+		if(next_deadline != 0)
+		{
+			now = executor_now();
+			timeout = next_deadline > now ? next_deadline - now : 0;
+		}
+		count = epoll_wait(reactor_epoll, events, EXECUTOR_EVENTS,
+				   timeout);
+		if(count < 0 && errno != EINTR)
+			break;
+
+		/* Lock reactor */
+		pthread_mutex_lock(&reactor_mutex);
+
+		/* Wake up tasks of socket events */
+		for(i = 0; i < count; i++)
+		{
+			/* New deadline */
+			if(events[i].data.u64 == 0)
+			{
+				if(read(reactor_event, &value, sizeof(value)) < 0)
+					value = 0;
+				continue;
+			}
+
+			/* Find task (it can have been joined meanwhile) */
+			for(t = reactor_list; t != NULL; t = t->reactor_next)
+				if(t->id == events[i].data.u64)
+					break;
+			if(t == NULL || !t->fd_armed)
+				continue;
+			t->fd_armed = 0;
+			t->deadline = 0;
+			task_wake(t);
+		}
+
+		/* Wake up tasks of expired timeouts */
+		now = executor_now();
+		for(t = reactor_list; t != NULL; t = next)
+		{
+			next = t->reactor_next;
+			if(t->deadline != 0 && t->deadline <= now)
+			{
+				t->deadline = 0;
+				t->fd_armed = 0;
+				task_wake(t);
+			}
+			if(t->deadline == 0 && !t->fd_armed)
+				reactor_remove(t);
+		}
+
+		/* Unlock reactor */
+		pthread_mutex_unlock(&reactor_mutex);
+	}
+
+	return NULL;
+}
+#endif
+
+static int executor_start(void)
+{
+	struct executor_worker *w;
+	unsigned int count;
+
+	/* Lock pool */
+	pthread_mutex_lock(&executor_mutex);
+
+#ifdef HAVE_EPOLL_CREATE1
+	/* Start reactor */
+	if(reactor_epoll < 0)
+	{
+		struct epoll_event ev;
+
+		reactor_epoll = epoll_create1(EPOLL_CLOEXEC);
+		reactor_event = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.u64 = 0;
+		if(reactor_epoll < 0 || reactor_event < 0 ||
+		   epoll_ctl(reactor_epoll, EPOLL_CTL_ADD, reactor_event,
+			     &ev) != 0 ||
+		   pthread_create(&reactor_thread, NULL,
+				  executor_reactor_thread, NULL) != 0)
+		{
+			if(reactor_epoll >= 0)
+				close(reactor_epoll);
+			if(reactor_event >= 0)
+				close(reactor_event);
+			reactor_epoll = -1;
+			reactor_event = -1;
+			pthread_mutex_unlock(&executor_mutex);
+			return -1;
+		}
+	}
+#endif
+
+	/* Start missing workers */
+	count = executor_count;
+	while(count < executor_workers && count < EXECUTOR_MAX_WORKERS)
+	{
+		w = &executor_pool[count];
+		memset(w, 0, sizeof(*w));
+		pthread_mutex_init(&w->mutex, NULL);
+		if(pthread_create(&w->thread, NULL, executor_worker_thread, w)
+		   != 0)
+			break;
+		count++;
+	}
+	STORE(executor_count, count);
+
+	/* Unlock pool */
+	pthread_mutex_unlock(&executor_mutex);
+
+	return count > 0 ? 0 : -1;
+}
+
+int executor_is_enabled(void)
+{
+#ifdef HAVE_EPOLL_CREATE1
+	return LOAD(executor_workers) > 0;
+#else
+	return 0;
+#endif
+}
+
+struct task *task_new(task_cb cb, void *user_data, const char *name)
+{
+	struct task *t;
+
+	if(cb == NULL || !executor_is_enabled())
+		return NULL;
+
+	/* Start pool on first task or when more workers are configured */
+	if(LOAD(executor_count) < LOAD(executor_workers) &&
+	   executor_start() != 0)
+		return NULL;
+
+	/* Allocate task */
+	t = calloc(1, sizeof(struct task));
+	if(t == NULL)
+		return NULL;
+
+	/* Init task */
+	t->cb = cb;
+	t->user_data = user_data;
+	t->fd = -1;
+	t->id = ADD(reactor_ids, 1);
+	if(name != NULL)
+		strncpy(t->name, name, sizeof(t->name) - 1);
+	ADD(executor_tasks, 1);
+
+	/* Queue first run */
+	t->state = TASK_QUEUED;
+	executor_push(t);
+
+	return t;
+}
+
+void task_wake(struct task *t)
+{
+	int state;
+
+	if(t == NULL)
+		return;
+
+	/* Queue an idle task or notice a running task */
+	state = LOAD(t->state);
+	while(1)
+	{
+		if(state == TASK_IDLE)
+		{
+			if(CAS(t->state, state, TASK_QUEUED))
+			{
+				executor_push(t);
+				return;
+			}
+		}
+		else if(state == TASK_RUNNING)
+		{
+			if(CAS(t->state, state, TASK_RUNNING_WOKEN))
+				return;
+		}
+		else
+			return;
+	}
+}
+
+void task_timeout(struct task *t, unsigned long timeout)
+{
+#ifdef HAVE_EPOLL_CREATE1
+	uint64_t value = 1;
+	int wake;
+
+	if(t == NULL)
+		return;
+
+	/* Arm deadline */
+	pthread_mutex_lock(&reactor_mutex);
+	t->deadline = executor_now() + timeout;
+	if(t->deadline == 0)
+		t->deadline = 1;
+	reactor_add(t);
+	wake = reactor_wakeup == 0 || t->deadline < reactor_wakeup;
+	if(wake)
+		reactor_wakeup = t->deadline;
+	pthread_mutex_unlock(&reactor_mutex);
+
+	/* Wake up reactor for an earlier deadline */
+	if(wake && write(reactor_event, &value, sizeof(value)) < 0)
+		fprintf(stderr, "[executor] can't wake up reactor\n");
+#endif
+}
+
+int task_wait_fd(struct task *t, int fd, int out)
+{
+#ifdef HAVE_EPOLL_CREATE1
+	struct epoll_event ev;
+	int ret = 0;
+
+	if(t == NULL || fd < 0)
+		return -1;
+
+	/* Socket is armed for one event */
+	memset(&ev, 0, sizeof(ev));
+	ev.events = (out ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT;
+	ev.data.u64 = t->id;
+
+	/* Lock reactor */
+	pthread_mutex_lock(&reactor_mutex);
+
+	/* Another socket is used: unregister previous one */
+	if(t->fd >= 0 && t->fd != fd)
+		reactor_release_fd(t);
+
+	/* Re-arm socket or register it (a closed socket is removed from
+	 * epoll, even if a new socket got the same number) */
+	if(t->fd < 0 || epoll_ctl(reactor_epoll, EPOLL_CTL_MOD, fd, &ev) != 0)
+		ret = epoll_ctl(reactor_epoll, EPOLL_CTL_ADD, fd, &ev);
+	if(ret == 0)
+	{
+		t->fd = fd;
+		t->fd_armed = 1;
+		reactor_add(t);
+	}
+
+	/* Unlock reactor */
+	pthread_mutex_unlock(&reactor_mutex);
+
+	return ret;
+#else
+	return -1;
+#endif
+}
+
+void task_release_fd(struct task *t)
+{
+#ifdef HAVE_EPOLL_CREATE1
+	if(t == NULL)
+		return;
+
+	/* Unregister socket while it is still open */
+	pthread_mutex_lock(&reactor_mutex);
+	reactor_release_fd(t);
+	pthread_mutex_unlock(&reactor_mutex);
+#endif
+}
+
+void task_join(struct task *t)
+{
+	if(t == NULL)
+		return;
+
+	/* Wait end of task */
+	pthread_mutex_lock(&executor_done_mutex);
+	while(LOAD(t->state) != TASK_FINISHED)
+		pthread_cond_wait(&executor_done_cond, &executor_done_mutex);
+	pthread_mutex_unlock(&executor_done_mutex);
+
+	/* Free task */
+	SUB(executor_tasks, 1);
+	free(t);
+}
+
+int executor_set_config(struct json *cfg)
+{
+	int workers = 0;
+
+	/* Default is a thread per component */
+	if(cfg != NULL)
+		workers = json_get_int(cfg, "workers");
+	if(workers < 0)
+		workers = 0;
+	else if(workers > EXECUTOR_MAX_WORKERS)
+		workers = EXECUTOR_MAX_WORKERS;
+	STORE(executor_workers, workers);
+
+	return 0;
+}
+
+struct json *executor_get_config(void)
+{
+	struct json *cfg;
+
+	/* Create a new object */
+	cfg = json_new();
+	if(cfg == NULL)
+		return NULL;
+
+	/* Set worker count */
+	json_set_int(cfg, "workers", LOAD(executor_workers));
+
+	return cfg;
+}
+
+/******************************************************************************
+ *                          Executor URLs for AirCat                          *
+ ******************************************************************************/
+
+static int executor_httpd_status(void *user_data, struct httpd_req *req,
+				 struct httpd_res **res)
+{
+	unsigned long timers = 0, sockets = 0;
+	struct json *root;
+	struct task *t;
+	char *str;
+
+	/* Count armed timeouts and sockets */
+	pthread_mutex_lock(&reactor_mutex);
+	for(t = reactor_list; t != NULL; t = t->reactor_next)
+	{
+		if(t->deadline != 0)
+			timers++;
+		if(t->fd_armed)
+			sockets++;
+	}
+	pthread_mutex_unlock(&reactor_mutex);
+
+	/* Create a new object */
+	root = json_new();
+
+	/* Set pool status */
+	json_set_bool(root, "enabled", executor_is_enabled());
+	json_set_int(root, "workers", LOAD(executor_count));
+	json_set_int64(root, "tasks", LOAD(executor_tasks));
+	json_set_int64(root, "queued", LOAD(executor_pending));
+	json_set_int64(root, "runs", LOAD(executor_runs));
+	json_set_int64(root, "steals", LOAD(executor_steals));
+	json_set_int64(root, "timers", timers);
+	json_set_int64(root, "sockets", sockets);
+
+	/* Get JSON string */
+	str = strdup(json_export(root));
+	*res = httpd_new_response(str, 1, 0);
+
+	/* Free JSON object */
+	json_free(root);
+
+	return 200;
+}
+
+struct url_table executor_urls[] = {
+	{"/status", 0, HTTPD_GET, 0, &executor_httpd_status},
+	{0, 0, 0, 0}
+};
@@ -27,13 +27,19 @@
 
 #include "decoder.h"
 #include "demux.h"
+#include "trace.h"
 #include "file.h"
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
 
+/* Maximum number of frames decoded in one batch */
+#define BATCH_FRAMES 16
+
 struct file_handle {
+	/* File URI */
+	char *uri;
 	/* Demuxer */
 	struct demux_handle *demux;
 	/* Audio decoder */
@@ -42,11 +48,16 @@ struct file_handle {
 	uint64_t pcm_pos;
 	unsigned long pcm_pos_off;
 	unsigned long pcm_remaining;
+	/* Decoded samples to drop up to exact position after a seek */
+	uint64_t skip;
 	/* File properties */
 	unsigned long samplerate;
 	unsigned long channels;
 	unsigned int bitrate;
 	unsigned long length;
+	/* Latency tracing */
+	struct trace *trace;
+	uint64_t frame_time;
 	/* Event callback */
 	file_event_cb event_cb;
 	void *event_udata;
@@ -76,11 +87,15 @@ int file_open(struct file_handle **handle, const char *uri)
 	h = *handle;
 
 	/* Init structure */
+	h->uri = strdup(uri);
 	h->demux = NULL;
 	h->dec = NULL;
 	h->pcm_pos = 0;
 	h->pcm_pos_off = 0;
 	h->pcm_remaining = 0;
+	h->skip = 0;
+	h->trace = NULL;
+	h->frame_time = 0;
 	h->event_cb = NULL;
 	h->event_udata = NULL;
 	h->buffering = 0;
@@ -95,7 +110,7 @@ int file_open(struct file_handle **handle, const char *uri)
 
 	/* Open demuxer */
 	if(demux_open(&h->demux, uri, &samplerate, &channels, 8192*2,
-		      use_thread) != 0)
+		      use_thread, 0) != 0)
 		return -1;
 
 	/* Get decoder configuration from demuxer (useful for MP4) */
@@ -125,6 +140,14 @@ int file_open(struct file_handle **handle, const char *uri)
 	return 0;
 }
 
+const char *file_get_uri(struct file_handle *h)
+{
+	if(h == NULL)
+		return NULL;
+
+	return h->uri;
+}
+
 unsigned long file_get_samplerate(struct file_handle *h)
 {
 	if(h == NULL)
@@ -141,19 +164,43 @@ unsigned char file_get_channels(struct file_handle *h)
 	return h->channels;
 }
 
-unsigned long file_set_pos(struct file_handle *h, unsigned long pos)
+static unsigned long file_seek(struct file_handle *h, unsigned long pos,
+			       int exact)
 {
+	unsigned long new_pos;
+	uint64_t skip = 0;
+	struct meta *meta;
+
 	if(h == NULL)
 		return -1;
 
 	/* Lock stream access */
 	pthread_mutex_lock(&h->mutex);
 
+	/* Set demuxer position */
+	new_pos = demux_set_pos(h->demux, pos);
+
+	/* Decode from found frame and drop samples up to asked position */
+	if(exact && new_pos != (unsigned long) -1)
+	{
+		meta = demux_get_meta(h->demux);
+		skip = demux_get_seek_skip(h->demux);
+		if(skip > 0 && meta->samplerate > 0)
+		{
+			/* Decoder samplerate can differ from demuxer one */
+			skip = skip * h->samplerate / meta->samplerate *
+			       h->channels;
+			new_pos = pos;
+		}
+	}
+
 	/* Set output position */
-	pos = demux_set_pos(h->demux, pos);
+	pos = new_pos;
 	h->pcm_pos = 0;
 	h->pcm_pos_off = pos * 1000;
 	h->pcm_remaining = 0;
+	h->skip = skip;
+	trace_reset(h->trace);
 
 	/* Notify new position */
 	if(h->event_cb != NULL)
@@ -165,6 +212,16 @@ unsigned long file_set_pos(struct file_handle *h, unsigned long pos)
 	return pos;
 }
 
+unsigned long file_set_pos(struct file_handle *h, unsigned long pos)
+{
+	return file_seek(h, pos, 0);
+}
+
+unsigned long file_set_pos_exact(struct file_handle *h, unsigned long pos)
+{
+	return file_seek(h, pos, 1);
+}
+
 unsigned long file_get_pos(struct file_handle *h)
 {
 	uint64_t pos;
@@ -193,6 +250,24 @@ long file_get_length(struct file_handle *h)
 	return h->length;
 }
 
+int file_get_seek_table(struct file_handle *h, uint32_t **table,
+			unsigned long *count)
+{
+	if(h == NULL)
+		return -1;
+
+	return demux_get_seek_table(h->demux, table, count);
+}
+
+int file_set_seek_table(struct file_handle *h, const uint32_t *table,
+			unsigned long count)
+{
+	if(h == NULL)
+		return -1;
+
+	return demux_set_seek_table(h->demux, table, count);
+}
+
 int file_get_status(struct file_handle *h)
 {
 	if(h == NULL)
@@ -207,15 +282,32 @@ int file_get_status(struct file_handle *h)
 	return FILE_OPENED;
 }
 
+static void file_trace(struct file_handle *h, size_t samples)
+{
+	if(h->trace == NULL || samples == 0 || !trace_is_enabled())
+		return;
+
+	/* Samples entered with first frame and leave decoder now */
+	trace_mark_at(h->trace, TRACE_INPUT, samples, h->samplerate,
+		      h->channels, h->frame_time != 0 ? h->frame_time :
+						       trace_now());
+	trace_mark(h->trace, TRACE_DECODE, samples, h->samplerate,
+		   h->channels);
+}
+
 int file_read(void *user_data, unsigned char *buffer, size_t size,
 	      struct a_format *fmt)
 {
 	struct file_handle *h = (struct file_handle *) user_data;
+	struct demux_frame *frames[BATCH_FRAMES];
+	struct decoder_frame batch[BATCH_FRAMES];
+	struct decoder_batch_info batch_info;
 	struct decoder_info info;
-	unsigned char *frame = NULL;
 	int total_samples = 0;
-	ssize_t len = 0;
+	size_t pos;
+	int len = 0;
 	int samples;
+	int i;
 
 	if(h == NULL)
 		return -1;
@@ -249,14 +341,15 @@ int file_read(void *user_data, unsigned char *buffer, size_t size,
 		}
 
 		h->pcm_remaining -= samples;
+		file_trace(h, samples);
 		total_samples += samples;
 	}
 
 	/* Fill output buffer */
 	while(total_samples < size)
 	{
-		/* Get frame */
-		len = demux_get_frame(h->demux, &frame);
+		/* Get next frames */
+		len = demux_get_frames(h->demux, frames, BATCH_FRAMES, &pos);
 		if(len <= 0)
 		{
 			/* File is buffering */
@@ -279,37 +372,50 @@ int file_read(void *user_data, unsigned char *buffer, size_t size,
 			h->buffering = 0;
 		}
 
-		/* Decode next frame */
-		samples = decoder_decode(h->dec, frame,
-					 len > 0 ? len : 0,
-					 &buffer[total_samples * 4],
-					 size - total_samples, &info);
-		if(samples <= 0)
+		/* Prepare frame list: skip used bytes in current frame */
+		for(i = 0; i < len; i++)
 		{
-			/* Set used bytes in frame */
-			if(len > 0 && info.used > 0)
-				demux_set_used_frame(h->demux, info.used);
-			break;
+			batch[i].data = frames[i]->data;
+			batch[i].len = frames[i]->len;
 		}
+		batch[0].data += pos;
+		batch[0].len -= pos;
 
-		/* Update used data in frame */
-		demux_set_used_frame(h->demux, info.used);
+		/* Decode frames in current audio format */
+		batch_info.samplerate = h->samplerate;
+		batch_info.channels = h->channels;
+		samples = decoder_decode_batch(h->dec, batch, len,
+					       &buffer[total_samples * 4],
+					       size - total_samples,
+					       &batch_info);
 
-		/* Update remaining counter */
-		h->pcm_remaining = info.remaining;
+		/* Update used frames */
+		demux_set_used_frames(h->demux, batch_info.frames,
+				      batch_info.used);
 
-		/* Check audio format */
-		if(info.samplerate != h->samplerate ||
-		   info.channels != h->channels)
-		{
-			/* Reset internal position */
-			decoder_decode(h->dec, NULL, 0, NULL, 0, NULL);
-			h->pcm_remaining += samples;
+		/* Update remaining counter */
+		h->pcm_remaining = batch_info.remaining;
+		if(samples <= 0)
 			break;
-		}
 
 		/* Update samples returned */
+		h->frame_time = frames[0]->time;
+		file_trace(h, samples);
 		total_samples += samples;
+
+		/* Output buffer is full or audio format has changed */
+		if(h->pcm_remaining > 0)
+			break;
+	}
+
+	/* Drop samples before exact position after a seek */
+	if(h->skip > 0 && total_samples > 0)
+	{
+		samples = (uint64_t) total_samples < h->skip ? total_samples :
+							       h->skip;
+		total_samples -= samples;
+		h->skip -= samples;
+		memmove(buffer, &buffer[samples * 4], total_samples * 4);
 	}
 
 	h->pcm_pos += total_samples;
@@ -344,6 +450,20 @@ int file_read(void *user_data, unsigned char *buffer, size_t size,
 	return total_samples;
 }
 
+void file_set_trace(struct file_handle *h, struct trace *trace)
+{
+	if(h == NULL)
+		return;
+
+	/* Lock stream access */
+	pthread_mutex_lock(&h->mutex);
+
+	h->trace = trace;
+
+	/* Unlock stream access */
+	pthread_mutex_unlock(&h->mutex);
+}
+
 int file_set_event_cb(struct file_handle *h, file_event_cb cb, void *user_data)
 {
 	/* Lock stream access */
@@ -372,6 +492,10 @@ void file_close(struct file_handle *h)
 	if(h->demux != NULL)
 		demux_close(h->demux);
 
+	/* Free URI */
+	if(h->uri != NULL)
+		free(h->uri);
+
 	/* Free handle */
 	free(h);
 }
@@ -27,6 +27,7 @@
 #include "fs_posix.h"
 #include "fs_http.h"
 #include "fs_smb.h"
+#include "fs_cache.h"
 #include "fs.h"
 
 void fs_init(void)
@@ -41,6 +42,9 @@ void fs_init(void)
 
 void fs_free(void)
 {
+	/* Free disk cache index */
+	fs_cache_free();
+
 	/* Free all file system */
 #ifdef HAVE_LIBSMBCLIENT
 	fs_smb_free();
@@ -91,6 +95,10 @@ struct fs_file *fs_open(const char *url, int flags, mode_t mode)
 		return NULL;
 	f->handle = h;
 
+	/* Memory mapping is only available on local files */
+	if(h != &fs_posix)
+		flags &= ~FS_O_MMAP;
+
 	/* Open file */
 	if(h->open(f, url, flags, mode) != 0)
 	{
@@ -99,6 +107,10 @@ struct fs_file *fs_open(const char *url, int flags, mode_t mode)
 		return NULL;
 	}
 
+	/* Read remote files through disk cache */
+	if(h != &fs_posix && (flags & O_ACCMODE) == O_RDONLY)
+		f = fs_cache_open(f, url);
+
 	return f;
 }
 
@@ -179,6 +191,15 @@ int fs_ftruncate(struct fs_file *f, off_t length)
 	return f->handle->ftruncate(f, length);
 }
 
+int fs_advise(struct fs_file *f, off_t offset, off_t len,
+	      enum fs_advice advice)
+{
+	if(f == NULL || f->handle->advise == NULL)
+		return -1;
+
+	return f->handle->advise(f, offset, len, advice);
+}
+
 void fs_close(struct fs_file *f)
 {
 	if(f == NULL)
@@ -0,0 +1,265 @@
+/*
+ * fs_aio.c - Asynchronous reads with io_uring for FS
+ *
+ * Copyright (c) 2014   A. Dilly
+ *
+ * AirCat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * AirCat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with AirCat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "fs.h"
+#include "fs_posix.h"
+
+#ifdef HAVE_LIBURING
+
+#include <liburing.h>
+
+struct fs_aio_req {
+	/* Read */
+	int fd;
+	unsigned char *buf;
+	size_t len;
+	off_t pos;
+	/* Bytes already read */
+	size_t done;
+	void *user;
+	int used;
+};
+
+struct fs_aio {
+	struct io_uring ring;
+	/* Requests */
+	struct fs_aio_req *reqs;
+	unsigned int depth;
+	unsigned int pending;
+};
+
+struct fs_aio *fs_aio_new(unsigned int depth)
+{
+	struct fs_aio *a;
+
+	if(depth == 0)
+		return NULL;
+
+	/* Allocate queue */
+	a = malloc(sizeof(struct fs_aio));
+	if(a == NULL)
+		return NULL;
+	a->reqs = calloc(depth, sizeof(struct fs_aio_req));
+	if(a->reqs == NULL)
+	{
+		free(a);
+		return NULL;
+	}
+	a->depth = depth;
+	a->pending = 0;
+
+	/* Create ring (it can be refused by kernel or sandbox) */
+	if(io_uring_queue_init(depth, &a->ring, 0) < 0)
+	{
+		free(a->reqs);
+		free(a);
+		return NULL;
+	}
+
+	return a;
+}
+
+int fs_aio_can_read(struct fs_file *f)
+{
+	/* Only local files read with read() */
+	return f != NULL && f->handle == &fs_posix && f->data == NULL &&
+	       f->fd >= 0;
+}
+
+static int fs_aio_submit(struct fs_aio *a, struct fs_aio_req *r)
+{
+	struct io_uring_sqe *sqe;
+
+	/* Get a submission entry */
+	sqe = io_uring_get_sqe(&a->ring);
+	if(sqe == NULL)
+		return -1;
+
+	/* Read remaining bytes */
+	io_uring_prep_read(sqe, r->fd, r->buf + r->done, r->len - r->done,
+			   r->pos + r->done);
+	io_uring_sqe_set_data(sqe, r);
+
+	/* Submit read */
+	if(io_uring_submit(&a->ring) < 0)
+		return -1;
+
+	return 0;
+}
+
+int fs_aio_read(struct fs_aio *a, struct fs_file *f, void *buf, size_t len,
+		off_t pos, void *user)
+{
+	struct fs_aio_req *r = NULL;
+	unsigned int i;
+
+	if(a == NULL || !fs_aio_can_read(f))
+		return -1;
+
+	/* Find a free request */
+	for(i = 0; i < a->depth; i++)
+	{
+		if(!a->reqs[i].used)
+		{
+			r = &a->reqs[i];
+			break;
+		}
+	}
+	if(r == NULL)
+		return -1;
+
+	/* Fill request */
+	r->fd = f->fd;
+	r->buf = buf;
+	r->len = len;
+	r->pos = pos;
+	r->done = 0;
+	r->user = user;
+
+	/* Submit read */
+	if(fs_aio_submit(a, r) != 0)
+		return -1;
+	r->used = 1;
+	a->pending++;
+
+	return 0;
+}
+
+int fs_aio_complete(struct fs_aio *a, void **user, ssize_t *res, int block)
+{
+	struct io_uring_cqe *cqe;
+	struct fs_aio_req *r;
+	int ret;
+
+	if(a == NULL || a->pending == 0)
+		return -1;
+
+	while(1)
+	{
+		/* Get a completion */
+		if(block)
+			ret = io_uring_wait_cqe(&a->ring, &cqe);
+		else
+			ret = io_uring_peek_cqe(&a->ring, &cqe);
+		if(ret == -EAGAIN && !block)
+			return 0;
+		if(ret < 0)
+		{
+			if(ret == -EINTR)
+				continue;
+			return -1;
+		}
+		r = io_uring_cqe_get_data(cqe);
+		ret = cqe->res;
+		io_uring_cqe_seen(&a->ring, cqe);
+
+		/* Retry interrupted read */
+		if((ret == -EINTR || ret == -EAGAIN) && fs_aio_submit(a, r) == 0)
+			continue;
+
+		/* Read remaining bytes of a short read */
+		if(ret > 0)
+		{
+			r->done += ret;
+			if(r->done < r->len && fs_aio_submit(a, r) == 0)
+				continue;
+		}
+		break;
+	}
+
+	/* Return result */
+	*user = r->user;
+	if(ret < 0 && r->done == 0)
+	{
+		errno = -ret;
+		*res = -1;
+	}
+	else
+		*res = r->done;
+
+	/* Release request */
+	r->used = 0;
+	a->pending--;
+
+	return 1;
+}
+
+unsigned int fs_aio_pending(struct fs_aio *a)
+{
+	return a != NULL ? a->pending : 0;
+}
+
+void fs_aio_free(struct fs_aio *a)
+{
+	void *user;
+	ssize_t res;
+
+	if(a == NULL)
+		return;
+
+	/* Wait pending reads since buffers are owned by caller */
+	while(fs_aio_complete(a, &user, &res, 1) == 1);
+
+	/* Free queue */
+	io_uring_queue_exit(&a->ring);
+	free(a->reqs);
+	free(a);
+}
+
+#else
+
+struct fs_aio *fs_aio_new(unsigned int depth)
+{
+	return NULL;
+}
+
+int fs_aio_can_read(struct fs_file *f)
+{
+	return 0;
+}
+
+int fs_aio_read(struct fs_aio *a, struct fs_file *f, void *buf, size_t len,
+		off_t pos, void *user)
+{
+	return -1;
+}
+
+int fs_aio_complete(struct fs_aio *a, void **user, ssize_t *res, int block)
+{
+	return -1;
+}
+
+unsigned int fs_aio_pending(struct fs_aio *a)
+{
+	return 0;
+}
+
+void fs_aio_free(struct fs_aio *a)
+{
+	return;
+}
+
+#endif
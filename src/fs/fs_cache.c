@@ -0,0 +1,682 @@
+/*
+ * fs_cache.c - A disk cache for remote files
+ *
+ * Copyright (c) 2014   A. Dilly
+ *
+ * AirCat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * AirCat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with AirCat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <utime.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "fs_cache.h"
+#include "utils.h"
+
+#define LOAD(v) __atomic_load_n(&(v), __ATOMIC_ACQUIRE)
+#define ADD(v, x) __atomic_add_fetch(&(v), x, __ATOMIC_ACQ_REL)
+
+#define MB (1024*1024)
+
+/* Size of a chunk (last chunk of a file can be shorter) */
+#define FS_CACHE_CHUNK_SIZE (256 * 1024)
+
+/* Default disk budget (in MB) */
+#define FS_CACHE_DEFAULT_SIZE 512
+
+/* Size of buffer used to copy a chunk from remote file */
+#define FS_CACHE_COPY_SIZE (16 * 1024)
+
+/* Chunk file name: file key and chunk index */
+#define FS_CACHE_NAME_FORMAT "%016llx-%lu"
+#define FS_CACHE_NAME_SIZE 32
+
+struct fs_cache_entry {
+	char name[FS_CACHE_NAME_SIZE];
+	size_t size;
+	time_t last_use;
+};
+
+struct fs_cache_handle {
+	/* Remote file */
+	struct fs_file *file;
+	struct stat st;
+	off_t file_pos;
+	/* Cache directory and file key */
+	char *path;
+	unsigned long generation;
+	unsigned long long key;
+	/* Position of reader */
+	off_t pos;
+	/* Current chunk (fd is -1 when chunk is not cached) */
+	unsigned long idx;
+	size_t len;
+	int fd;
+};
+
+/* Cache index: all chunks in cache directory */
+static pthread_mutex_t fs_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char *fs_cache_path = NULL;
+static size_t fs_cache_limit = 0;
+static unsigned long fs_cache_generation = 0;
+static struct fs_cache_entry *fs_cache_entries = NULL;
+static unsigned long fs_cache_count = 0;
+static unsigned long fs_cache_alloc = 0;
+static size_t fs_cache_used = 0;
+
+/* Statistics */
+static unsigned long fs_cache_hits = 0;
+static unsigned long fs_cache_misses = 0;
+static unsigned long fs_cache_evictions = 0;
+static uint64_t fs_cache_read_bytes = 0;
+static uint64_t fs_cache_fetched_bytes = 0;
+
+static struct fs_handle fs_cache;
+
+static long fs_cache_find(const char *name)
+{
+	unsigned long i;
+
+	for(i = 0; i < fs_cache_count; i++)
+	{
+		if(strcmp(fs_cache_entries[i].name, name) == 0)
+			return i;
+	}
+
+	return -1;
+}
+
+static int fs_cache_add(const char *name, size_t size, time_t last_use)
+{
+	struct fs_cache_entry *e;
+
+	/* Chunk is already in index */
+	if(fs_cache_find(name) >= 0)
+		return 0;
+
+	/* Grow index */
+	if(fs_cache_count == fs_cache_alloc)
+	{
+		e = realloc(fs_cache_entries, (fs_cache_alloc + 64) *
+					      sizeof(struct fs_cache_entry));
+		if(e == NULL)
+			return -1;
+		fs_cache_entries = e;
+		fs_cache_alloc += 64;
+	}
+
+	/* Add entry */
+	e = &fs_cache_entries[fs_cache_count++];
+	strncpy(e->name, name, FS_CACHE_NAME_SIZE - 1);
+	e->name[FS_CACHE_NAME_SIZE - 1] = '\0';
+	e->size = size;
+	e->last_use = last_use;
+	fs_cache_used += size;
+
+	return 0;
+}
+
+static void fs_cache_evict(const char *keep)
+{
+	char path[PATH_MAX];
+	unsigned long i, old;
+
+	/* Remove least recently used chunks until budget is respected */
+	while(fs_cache_used > fs_cache_limit && fs_cache_count > 0)
+	{
+		/* Find oldest chunk */
+		old = fs_cache_count;
+		for(i = 0; i < fs_cache_count; i++)
+		{
+			if(keep != NULL &&
+			   strcmp(fs_cache_entries[i].name, keep) == 0)
+				continue;
+			if(old == fs_cache_count ||
+			   fs_cache_entries[i].last_use <
+			   fs_cache_entries[old].last_use)
+				old = i;
+		}
+		if(old == fs_cache_count)
+			break;
+
+		/* Remove chunk file (a reader keeps its opened chunk) */
+		snprintf(path, sizeof(path), "%s/%s", fs_cache_path,
+			 fs_cache_entries[old].name);
+		unlink(path);
+
+		/* Remove entry */
+		fs_cache_used -= fs_cache_entries[old].size;
+		fs_cache_entries[old] = fs_cache_entries[--fs_cache_count];
+		fs_cache_evictions++;
+	}
+}
+
+static void fs_cache_scan(void)
+{
+	char path[PATH_MAX];
+	unsigned long long key;
+	struct dirent *dir;
+	struct stat st;
+	unsigned long idx;
+	char name[FS_CACHE_NAME_SIZE];
+	DIR *d;
+
+	/* Create cache directory if needed */
+	mkdir(fs_cache_path, 0755);
+
+	/* Open cache directory */
+	d = opendir(fs_cache_path);
+	if(d == NULL)
+		return;
+
+	/* Add all chunks to index */
+	while((dir = readdir(d)) != NULL)
+	{
+		snprintf(path, sizeof(path), "%s/%s", fs_cache_path,
+			 dir->d_name);
+
+		/* Remove chunks interrupted by a previous exit */
+		if(strncmp(dir->d_name, "tmp", 3) == 0)
+		{
+			unlink(path);
+			continue;
+		}
+
+		/* Check chunk name */
+		if(sscanf(dir->d_name, "%llx-%lu", &key, &idx) != 2)
+			continue;
+		snprintf(name, sizeof(name), FS_CACHE_NAME_FORMAT, key, idx);
+		if(strcmp(name, dir->d_name) != 0 || stat(path, &st) != 0 ||
+		   !S_ISREG(st.st_mode))
+			continue;
+
+		/* Last use is saved as modification time */
+		fs_cache_add(name, st.st_size, st.st_mtime);
+	}
+
+	/* Close directory */
+	closedir(d);
+
+	/* Apply budget */
+	fs_cache_evict(NULL);
+}
+
+static void fs_cache_reset(void)
+{
+	/* Free index */
+	free(fs_cache_entries);
+	fs_cache_entries = NULL;
+	fs_cache_count = 0;
+	fs_cache_alloc = 0;
+	fs_cache_used = 0;
+
+	/* Free directory: files opened with previous path are not indexed */
+	free(fs_cache_path);
+	fs_cache_path = NULL;
+	fs_cache_generation++;
+}
+
+struct fs_file *fs_cache_open(struct fs_file *file, const char *url)
+{
+	struct fs_cache_handle *h;
+	struct fs_file *f;
+	struct stat st;
+
+	if(file == NULL || url == NULL)
+		return file;
+
+	/* Only files with a known size can be cached */
+	memset(&st, 0, sizeof(st));
+	if(fs_fstat(file, &st) != 0 || st.st_size <= 0)
+		return file;
+
+	/* Allocate file and handle */
+	f = malloc(sizeof(struct fs_file));
+	h = calloc(1, sizeof(struct fs_cache_handle));
+	if(f == NULL || h == NULL)
+		goto error;
+	f->fd = -1;
+	f->data = h;
+	f->handle = &fs_cache;
+
+	/* Get cache directory */
+	pthread_mutex_lock(&fs_cache_mutex);
+	if(fs_cache_path != NULL)
+		h->path = strdup(fs_cache_path);
+	h->generation = fs_cache_generation;
+	pthread_mutex_unlock(&fs_cache_mutex);
+
+	/* Cache is disabled */
+	if(h->path == NULL)
+		goto error;
+
+	/* Init handle: file has just been opened */
+	h->file = file;
+	h->st = st;
+	h->file_pos = 0;
+	h->pos = 0;
+	h->idx = (unsigned long) -1;
+	h->fd = -1;
+
+	/* Generate file key from URL, size and modification time (FNV-1a) */
+	h->key = utils_hash_fnv1a(UTILS_FNV1A_INIT, url, strlen(url));
+	h->key = utils_hash_fnv1a(h->key, &st.st_size, sizeof(st.st_size));
+	h->key = utils_hash_fnv1a(h->key, &st.st_mtime, sizeof(st.st_mtime));
+
+	return f;
+
+error:
+	if(h != NULL)
+		free(h->path);
+	free(h);
+	free(f);
+	return file;
+}
+
+static int fs_cache_fetch(struct fs_cache_handle *h, unsigned long idx,
+			  const char *name, const char *path, size_t *len)
+{
+	unsigned char buffer[FS_CACHE_COPY_SIZE];
+	char tmp[PATH_MAX];
+	size_t count = 0;
+	size_t size;
+	ssize_t ret;
+	off_t pos;
+	int fd;
+
+	/* Get chunk size */
+	pos = (off_t) idx * FS_CACHE_CHUNK_SIZE;
+	size = h->st.st_size - pos;
+	if(size > FS_CACHE_CHUNK_SIZE)
+		size = FS_CACHE_CHUNK_SIZE;
+
+	/* Create a temporary file in cache directory */
+	snprintf(tmp, sizeof(tmp), "%s/tmpXXXXXX", h->path);
+	fd = mkstemp(tmp);
+	if(fd < 0)
+		return -1;
+
+	/* Go to chunk in remote file */
+	if(h->file_pos != pos)
+	{
+		if(fs_lseek(h->file, pos, SEEK_SET) != pos)
+			goto error;
+		h->file_pos = pos;
+	}
+
+	/* Copy chunk from remote file */
+	while(count < size)
+	{
+		ret = fs_read(h->file, buffer, size - count > sizeof(buffer) ?
+						sizeof(buffer) : size - count);
+		if(ret <= 0)
+			goto error;
+		h->file_pos += ret;
+		if(write(fd, buffer, ret) != ret)
+			goto error;
+		count += ret;
+	}
+
+	/* Chunk is complete: publish it */
+	if(rename(tmp, path) != 0)
+		goto error;
+
+	/* Add chunk to index */
+	pthread_mutex_lock(&fs_cache_mutex);
+	fs_cache_misses++;
+	fs_cache_fetched_bytes += size;
+	if(h->generation == fs_cache_generation &&
+	   fs_cache_add(name, size, time(NULL)) == 0)
+		fs_cache_evict(name);
+	pthread_mutex_unlock(&fs_cache_mutex);
+
+	*len = size;
+	return fd;
+
+error:
+	close(fd);
+	unlink(tmp);
+	return -1;
+}
+
+static int fs_cache_get_chunk(struct fs_cache_handle *h, unsigned long idx,
+			      size_t *len)
+{
+	char name[FS_CACHE_NAME_SIZE];
+	char path[PATH_MAX];
+	struct stat st;
+	long i;
+	int fd;
+
+	/* Get chunk path */
+	snprintf(name, sizeof(name), FS_CACHE_NAME_FORMAT, h->key, idx);
+	snprintf(path, sizeof(path), "%s/%s", h->path, name);
+
+	/* Chunk is not cached: get it from remote file */
+	fd = open(path, O_RDONLY);
+	if(fd < 0)
+		return fs_cache_fetch(h, idx, name, path, len);
+
+	/* Get chunk length */
+	if(fstat(fd, &st) != 0)
+	{
+		close(fd);
+		return -1;
+	}
+	*len = st.st_size;
+
+	/* Update last use in index */
+	pthread_mutex_lock(&fs_cache_mutex);
+	fs_cache_hits++;
+	if(h->generation == fs_cache_generation)
+	{
+		i = fs_cache_find(name);
+		if(i >= 0)
+			fs_cache_entries[i].last_use = time(NULL);
+		else if(fs_cache_add(name, st.st_size, time(NULL)) == 0)
+			fs_cache_evict(name);
+	}
+	pthread_mutex_unlock(&fs_cache_mutex);
+
+	/* Save last use for next run */
+	utime(path, NULL);
+
+	return fd;
+}
+
+static ssize_t fs_cache_read(struct fs_file *f, void *buf, size_t count)
+{
+	struct fs_cache_handle *h = f->data;
+	unsigned long idx;
+	size_t len = 0;
+	size_t size;
+	ssize_t ret;
+	int error = 0;
+	off_t off;
+
+	while(len < count && h->pos < h->st.st_size)
+	{
+		/* Open chunk with current position */
+		idx = h->pos / FS_CACHE_CHUNK_SIZE;
+		if(idx != h->idx)
+		{
+			if(h->fd >= 0)
+				close(h->fd);
+			h->fd = fs_cache_get_chunk(h, idx, &h->len);
+			h->idx = idx;
+		}
+
+		/* Chunk is not available: read from remote file */
+		if(h->fd < 0)
+		{
+			if(h->file_pos != h->pos)
+			{
+				if(fs_lseek(h->file, h->pos, SEEK_SET) !=
+				   h->pos)
+				{
+					error = 1;
+					break;
+				}
+				h->file_pos = h->pos;
+			}
+			ret = fs_read(h->file, (unsigned char *) buf + len,
+				      count - len);
+			if(ret <= 0)
+			{
+				error = ret < 0;
+				break;
+			}
+			h->file_pos += ret;
+			h->pos += ret;
+			len += ret;
+			continue;
+		}
+
+		/* End of chunk */
+		off = h->pos - (off_t) idx * FS_CACHE_CHUNK_SIZE;
+		if(off >= h->len)
+			break;
+
+		/* Read from chunk */
+		size = h->len - off;
+		if(size > count - len)
+			size = count - len;
+		ret = pread(h->fd, (unsigned char *) buf + len, size, off);
+		if(ret <= 0)
+		{
+			error = 1;
+			break;
+		}
+		ADD(fs_cache_read_bytes, ret);
+		h->pos += ret;
+		len += ret;
+	}
+
+	if(len == 0 && error)
+		return -1;
+
+	return len;
+}
+
+static ssize_t fs_cache_read_to(struct fs_file *f, void *buf, size_t count,
+				long timeout)
+{
+	return fs_cache_read(f, buf, count);
+}
+
+static ssize_t fs_cache_write(struct fs_file *f, const void *buf,
+			      size_t count)
+{
+	return -1;
+}
+
+static ssize_t fs_cache_write_to(struct fs_file *f, const void *buf,
+				 size_t count, long timeout)
+{
+	return -1;
+}
+
+static off_t fs_cache_lseek(struct fs_file *f, off_t offset, int whence)
+{
+	struct fs_cache_handle *h = f->data;
+
+	/* Calculate offset from beginning of file */
+	if(whence == SEEK_CUR)
+		offset += h->pos;
+	else if(whence == SEEK_END)
+		offset += h->st.st_size;
+	if(offset < 0)
+		return -1;
+
+	/* Chunk is opened on next read */
+	h->pos = offset;
+
+	return offset;
+}
+
+static int fs_cache_ftruncate(struct fs_file *f, off_t length)
+{
+	return -1;
+}
+
+static void fs_cache_close(struct fs_file *f)
+{
+	struct fs_cache_handle *h = f->data;
+
+	/* Close current chunk */
+	if(h->fd >= 0)
+		close(h->fd);
+
+	/* Close remote file */
+	fs_close(h->file);
+
+	/* Free handle */
+	free(h->path);
+	free(h);
+}
+
+static int fs_cache_advise(struct fs_file *f, off_t offset, off_t len,
+			   enum fs_advice advice)
+{
+	struct fs_cache_handle *h = f->data;
+
+	return fs_advise(h->file, offset, len, advice);
+}
+
+static int fs_cache_fstat(struct fs_file *f, struct stat *buf)
+{
+	struct fs_cache_handle *h = f->data;
+
+	memcpy(buf, &h->st, sizeof(struct stat));
+	return 0;
+}
+
+static struct fs_handle fs_cache = {
+	.read = fs_cache_read,
+	.read_to = fs_cache_read_to,
+	.write = fs_cache_write,
+	.write_to = fs_cache_write_to,
+	.lseek = fs_cache_lseek,
+	.ftruncate = fs_cache_ftruncate,
+	.close = fs_cache_close,
+	.advise = fs_cache_advise,
+	.fstat = fs_cache_fstat,
+};
+
+int fs_cache_set_config(struct json *cfg)
+{
+	const char *path = NULL;
+	int size = 0;
+
+	/* Get directory and budget in MB (cache is disabled by default) */
+	if(cfg != NULL)
+	{
+		path = json_get_string(cfg, "path");
+		size = json_get_int(cfg, "size");
+	}
+	if(size <= 0)
+		size = FS_CACHE_DEFAULT_SIZE;
+
+	/* Lock cache */
+	pthread_mutex_lock(&fs_cache_mutex);
+
+	/* Directory has changed: index it again */
+	if(path == NULL || *path == '\0' || fs_cache_path == NULL ||
+	   strcmp(path, fs_cache_path) != 0)
+	{
+		fs_cache_reset();
+		if(path != NULL && *path != '\0')
+		{
+			fs_cache_path = strdup(path);
+			if(fs_cache_path != NULL)
+				fs_cache_scan();
+		}
+	}
+
+	/* Set budget */
+	fs_cache_limit = (size_t) size * MB;
+	if(fs_cache_path != NULL)
+		fs_cache_evict(NULL);
+
+	/* Unlock cache */
+	pthread_mutex_unlock(&fs_cache_mutex);
+
+	return 0;
+}
+
+struct json *fs_cache_get_config(void)
+{
+	struct json *cfg;
+
+	/* Create a new object */
+	cfg = json_new();
+	if(cfg == NULL)
+		return NULL;
+
+	/* Set directory and budget in MB */
+	pthread_mutex_lock(&fs_cache_mutex);
+	if(fs_cache_path != NULL)
+		json_set_string(cfg, "path", fs_cache_path);
+	json_set_int(cfg, "size", fs_cache_limit / MB);
+	pthread_mutex_unlock(&fs_cache_mutex);
+
+	return cfg;
+}
+
+void fs_cache_free(void)
+{
+	pthread_mutex_lock(&fs_cache_mutex);
+	fs_cache_reset();
+	pthread_mutex_unlock(&fs_cache_mutex);
+}
+
+/******************************************************************************
+ *                          Disk cache URLs for AirCat                        *
+ ******************************************************************************/
+
+static int fs_cache_httpd_status(void *user_data, struct httpd_req *req,
+				 struct httpd_res **res)
+{
+	unsigned long total;
+	struct json *root;
+	char *str;
+
+	/* Create a new object */
+	root = json_new();
+
+	/* Set usage */
+	pthread_mutex_lock(&fs_cache_mutex);
+	json_set_bool(root, "enabled", (fs_cache_path != NULL));
+	json_set_int64(root, "limit", fs_cache_limit);
+	json_set_int64(root, "used", fs_cache_used);
+	json_set_int64(root, "chunks", fs_cache_count);
+
+	/* Set statistics: hits and misses are counted by chunk */
+	total = fs_cache_hits + fs_cache_misses;
+	json_set_int64(root, "hits", fs_cache_hits);
+	json_set_int64(root, "misses", fs_cache_misses);
+	json_set_double(root, "hit_rate", total > 0 ?
+			(double) fs_cache_hits / total : 0.0);
+	json_set_int64(root, "evictions", fs_cache_evictions);
+	json_set_int64(root, "fetched_bytes", fs_cache_fetched_bytes);
+	pthread_mutex_unlock(&fs_cache_mutex);
+	json_set_int64(root, "read_bytes", LOAD(fs_cache_read_bytes));
+
+	/* Get JSON string */
+	str = strdup(json_export(root));
+	*res = httpd_new_response(str, 1, 0);
+
+	/* Free JSON object */
+	json_free(root);
+
+	return 200;
+}
+
+struct url_table fs_cache_urls[] = {
+	{"/status", 0, HTTPD_GET, 0, &fs_cache_httpd_status},
+	{0, 0, 0, 0}
+};
@@ -24,6 +24,20 @@
 #include "fs_http.h"
 #include "http.h"
 
+/* Size of internal buffer */
+#define FS_HTTP_BUFFER_SIZE (32 * 1024)
+
+/* Maximum length read and dropped to reach a position in current respond (or
+ * to end it and keep connection alive) instead of doing a new request
+ */
+#define FS_HTTP_SKIP_SIZE (64 * 1024)
+
+/* Length asked by a range request: connection is kept alive between them, so
+ * it starts small after a seek and doubles while file is read sequentially
+ */
+#define FS_HTTP_RANGE_MIN_SIZE FS_HTTP_SKIP_SIZE
+#define FS_HTTP_RANGE_MAX_SIZE (1024 * 1024)
+
 struct fs_http_handle {
 	struct http_handle *http;
 	int is_seekable;
@@ -31,6 +45,14 @@ struct fs_http_handle {
 	long skip_len;
 	long pos;
 	char *url;
+	/* Internal buffer: data from buffer_pos in file */
+	unsigned char *buffer;
+	size_t buffer_len;
+	long buffer_pos;
+	/* Current respond: position in file and remaining length (or -1) */
+	long stream_pos;
+	long stream_len;
+	long range_size;
 };
 
 void fs_http_init(void)
@@ -43,54 +65,169 @@ void fs_http_free(void)
 	return;
 }
 
-static int fs_http_open(struct fs_file *f, const char *url, int flags,
-			mode_t mode)
+static int fs_http_request(struct fs_http_handle *h, long pos)
 {
-	struct fs_http_handle *h;
-	struct http_handle *http;
 	const char *ext;
+	long start = 0;
+	long total = 0;
+	char req[256];
+	long end;
 	int code;
 
-	/* Create a new HTTP client */
-	if(http_open(&http, 1) != 0)
-		goto error;
-
-	/* Prepare request with seek option */
-	http_set_option(http, HTTP_EXTRA_HEADER, "Range: bytes=0-\r\n", 0);
+	/* Prepare request with a range from position */
+	end = pos + h->range_size - 1;
+	if(h->size > 0 && end >= h->size)
+		end = h->size - 1;
+	snprintf(req, 255, "Range: bytes=%ld-%ld\r\n", pos, end);
+	http_set_option(h->http, HTTP_EXTRA_HEADER, req, 0);
 
 	/* Do request */
-	code = http_get(http, url);
+	code = http_get(h->http, h->url);
 	if(code != 200 && code != 206)
-		goto error;
+		return -1;
+
+	/* Get respond length */
+	ext = http_get_header(h->http, "Content-Length", 0);
+	h->stream_len = ext != NULL ? strtol(ext, NULL, 10) : -1;
+
+	/* Get range position and file length */
+	if(code == 206)
+	{
+		ext = http_get_header(h->http, "Content-Range", 0);
+		if(ext == NULL ||
+		   sscanf(ext, "bytes %ld-%*d/%ld", &start, &total) < 1)
+			return -1;
+		if(total > 0)
+			h->size = total;
+		h->is_seekable = 1;
+	}
+	else if(h->stream_len > 0)
+	{
+		/* Range is not supported: all file is sent */
+		h->size = h->stream_len;
+	}
+	h->stream_pos = start;
+
+	return 0;
+}
+
+static ssize_t fs_http_stream_read(struct fs_http_handle *h, void *buf,
+				   size_t count, long timeout)
+{
+	ssize_t len;
+
+	/* Respond is complete */
+	if(h->stream_len >= 0 && count > h->stream_len)
+		count = h->stream_len;
+	if(count == 0)
+		return 0;
+
+	/* Read from connection */
+	len = http_read_timeout(h->http, buf, count, timeout);
+	if(len > 0)
+	{
+		h->stream_pos += len;
+		if(h->stream_len > 0)
+			h->stream_len -= len;
+	}
+
+	return len;
+}
+
+static int fs_http_stream_drop(struct fs_http_handle *h, long len)
+{
+	ssize_t size;
+
+	/* Internal buffer is used to drop data */
+	h->buffer_len = 0;
+	while(len > 0)
+	{
+		size = fs_http_stream_read(h, h->buffer,
+					   len > FS_HTTP_BUFFER_SIZE ?
+					   FS_HTTP_BUFFER_SIZE : len, -1);
+		if(size <= 0)
+			return -1;
+		len -= size;
+	}
+
+	return 0;
+}
+
+static int fs_http_stream_seek(struct fs_http_handle *h, long pos)
+{
+	/* Current respond is already at position */
+	if(h->stream_pos == pos && h->stream_len != 0)
+		return 0;
+
+	/* Position is close in current respond: read until it */
+	if(pos > h->stream_pos && pos - h->stream_pos <= FS_HTTP_SKIP_SIZE &&
+	   (h->stream_len < 0 || pos < h->stream_pos + h->stream_len))
+		return fs_http_stream_drop(h, pos - h->stream_pos);
+
+	/* End current respond to keep connection alive or close connection */
+	if(h->stream_len < 0 || h->stream_len > FS_HTTP_SKIP_SIZE ||
+	   fs_http_stream_drop(h, h->stream_len) != 0)
+		http_close_connection(h->http);
+
+	/* Do a new range request: ask a larger range when reading sequentially */
+	if(pos == h->stream_pos && h->range_size < FS_HTTP_RANGE_MAX_SIZE)
+		h->range_size *= 2;
+	else if(pos != h->stream_pos)
+		h->range_size = FS_HTTP_RANGE_MIN_SIZE;
+	if(fs_http_request(h, pos) != 0)
+	{
+		h->stream_len = 0;
+		return -1;
+	}
+
+	/* Range is not supported: read until position */
+	if(h->stream_pos > pos)
+		return -1;
+	return fs_http_stream_drop(h, pos - h->stream_pos);
+}
+
+static int fs_http_open(struct fs_file *f, const char *url, int flags,
+			mode_t mode)
+{
+	struct fs_http_handle *h;
+	const char *ext;
 
 	/* Allocate a new handle */
-	h = malloc(sizeof(struct fs_http_handle));
+	h = calloc(1, sizeof(struct fs_http_handle));
 	if(h == NULL)
-		goto error;
+		return -1;
 
 	/* Init structure */
-	f->data = (void*) h;
 	h->url = strdup(url);
-	h->http = http;
-	h->skip_len = 0;
-	h->is_seekable = 0;
-	h->size = 0;
-	h->pos = 0;
+	h->buffer = malloc(FS_HTTP_BUFFER_SIZE);
+	h->range_size = FS_HTTP_RANGE_MIN_SIZE;
+	if(h->url == NULL || h->buffer == NULL)
+		goto error;
+
+	/* Create a new HTTP client */
+	if(http_open(&h->http, 1) != 0)
+		goto error;
+
+	/* Keep connection alive between range requests */
+	http_set_option(h->http, HTTP_KEEP_ALIVE, NULL, 1);
+
+	/* Do first request with seek option */
+	if(fs_http_request(h, 0) != 0)
+		goto error;
 
 	/* Get accepted range */
 	ext = http_get_header(h->http, "Accept-Ranges", 0);
 	if(ext != NULL && strncmp(ext, "bytes", 5) == 0)
 		h->is_seekable = 1;
-
-	/* Get file length */
-	ext = http_get_header(http, "Content-Length", 0);
-	if(ext != NULL)
-		h->size = strtoul(ext, NULL, 10);
+	f->data = (void*) h;
 
 	return 0;
 error:
 	/* Close HTTP client */
-	http_close(http);
+	http_close(h->http);
+	free(h->buffer);
+	free(h->url);
+	free(h);
 	return -1;
 }
 
@@ -100,6 +237,66 @@ static int fs_http_creat(struct fs_file *f, const char *url, mode_t mode)
 	return -1;
 }
 
+static ssize_t fs_http_read_buffer(struct fs_http_handle *h, void *buf,
+				   size_t count, long timeout)
+{
+	ssize_t ret = 0;
+	size_t len = 0;
+	size_t size;
+
+	while(len < count)
+	{
+		/* Copy from internal buffer */
+		if(h->pos >= h->buffer_pos &&
+		   h->pos < h->buffer_pos + h->buffer_len)
+		{
+			size = h->buffer_pos + h->buffer_len - h->pos;
+			if(size > count - len)
+				size = count - len;
+			memcpy((unsigned char *) buf + len,
+			       h->buffer + h->pos - h->buffer_pos, size);
+			h->pos += size;
+			len += size;
+			continue;
+		}
+
+		/* End of file */
+		if(h->size > 0 && h->pos >= h->size)
+			break;
+
+		/* Get current respond at position */
+		ret = fs_http_stream_seek(h, h->pos);
+		if(ret != 0)
+			break;
+
+		/* Read large blocks directly */
+		if(count - len >= FS_HTTP_BUFFER_SIZE)
+		{
+			ret = fs_http_stream_read(h, (unsigned char *) buf + len,
+						  count - len, timeout);
+			if(ret <= 0)
+				break;
+			h->pos += ret;
+			len += ret;
+			continue;
+		}
+
+		/* Fill internal buffer */
+		h->buffer_pos = h->pos;
+		h->buffer_len = 0;
+		ret = fs_http_stream_read(h, h->buffer, FS_HTTP_BUFFER_SIZE,
+					  timeout);
+		if(ret <= 0)
+			break;
+		h->buffer_len = ret;
+	}
+
+	if(len == 0 && ret < 0)
+		return -1;
+
+	return len;
+}
+
 static ssize_t fs_http_read_to(struct fs_file *f, void *buf, size_t count,
 			       long timeout)
 {
@@ -110,6 +307,10 @@ static ssize_t fs_http_read_to(struct fs_file *f, void *buf, size_t count,
 		return -1;
 	h = f->data;
 
+	/* Use range requests and internal buffer */
+	if(h->is_seekable)
+		return fs_http_read_buffer(h, buf, count, timeout);
+
 	/* Skip len */
 	while(h->skip_len > 0)
 	{
@@ -152,8 +353,6 @@ static ssize_t fs_http_write(struct fs_file *f, const void *buf, size_t count)
 static off_t fs_http_lseek(struct fs_file *f, off_t offset, int whence)
 {
 	struct fs_http_handle *h;
-	char req[256];
-	int code;
 
 	if(f == NULL || f->data == NULL)
 		return -1;
@@ -168,22 +367,16 @@ static off_t fs_http_lseek(struct fs_file *f, off_t offset, int whence)
 	{
 		if(h->size == 0)
 			return -1;
-		offset -= h->size;
+		offset += h->size;
 	}
+	if(offset < 0)
+		return -1;
 
-	/* Seek to desired position */
-	if(h->is_seekable)
-	{
-		/* Prepare a request with new location */
-		snprintf(req, 255, "Range: bytes=%ld-\r\n", offset);
-		http_set_option(h->http, HTTP_EXTRA_HEADER, req, 0);
-
-		/* Do a new request */
-		code = http_get(h->http, h->url);
-		if(code != 200 && code != 206)
-			return -1;
-	}
-	else
+	/* Seek to desired position: with range requests, respond is fetched at
+	 * position on next read, so seeking in internal buffer or close in
+	 * current respond doesn't need a new request
+	 */
+	if(!h->is_seekable)
 	{
 		/* Skip diff between current position and asked position */
 		h->skip_len = offset - h->pos;
@@ -192,8 +385,9 @@ static off_t fs_http_lseek(struct fs_file *f, off_t offset, int whence)
 			/* Free extra header */
 			http_set_option(h->http, HTTP_EXTRA_HEADER, NULL, 0);
 
-			/* Do a new request */
-			code = http_get(h->http, h->url);
+			/* Do a new request on a new connection */
+			http_close_connection(h->http);
+			http_get(h->http, h->url);
 
 			/* Update length to skip */
 			h->skip_len = offset;
@@ -223,9 +417,10 @@ static void fs_http_close(struct fs_file *f)
 	/* Close HTTP client */
 	http_close(h->http);
 
-	/* Free URL */
+	/* Free URL and buffer */
 	if(h->url != NULL)
 		free(h->url);
+	free(h->buffer);
 
 	/* Free local handle */
 	free(h);
@@ -17,15 +17,28 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <dirent.h>
 #include <fcntl.h>
 #include <mntent.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
 
 #include "fs_posix.h"
 
+/* Memory mapped file (FS_O_MMAP) */
+struct fs_posix_map {
+	unsigned char *data;
+	size_t size;
+	off_t pos;
+};
+
 void fs_posix_init(void)
 {
 	return;
@@ -36,20 +49,55 @@ void fs_posix_free(void)
 	return;
 }
 
+static void fs_posix_mmap(struct fs_file *f)
+{
+	struct fs_posix_map *m;
+	struct stat st;
+	void *data;
+
+	/* Only non empty regular files can be mapped */
+	if(fstat(f->fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0 ||
+	   (off_t) (size_t) st.st_size != st.st_size)
+		return;
+
+	/* Map file */
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, f->fd, 0);
+	if(data == MAP_FAILED)
+		return;
+
+	/* Allocate mapping (file is read with read() on failure) */
+	m = malloc(sizeof(struct fs_posix_map));
+	if(m == NULL)
+	{
+		munmap(data, st.st_size);
+		return;
+	}
+	m->data = data;
+	m->size = st.st_size;
+	m->pos = 0;
+	f->data = m;
+}
+
 static int fs_posix_open(struct fs_file *f, const char *url, int flags,
 			 mode_t mode)
 {
 	/* Open file */
-	f->fd = open(url, flags, mode);
+	f->data = NULL;
+	f->fd = open(url, flags & ~FS_O_MMAP, mode);
 	if(f->fd < 0)
 		return -1;
 
+	/* Map file in memory when read only */
+	if((flags & FS_O_MMAP) && (flags & O_ACCMODE) == O_RDONLY)
+		fs_posix_mmap(f);
+
 	return 0;
 }
 
 static int fs_posix_creat(struct fs_file *f, const char *url, mode_t mode)
 {
 	/* Create file */
+	f->data = NULL;
 	f->fd = creat(url, mode);
 	if(f->fd < 0)
 		return -1;
@@ -57,6 +105,22 @@ static int fs_posix_creat(struct fs_file *f, const char *url, mode_t mode)
 	return 0;
 }
 
+static ssize_t fs_posix_map_read(struct fs_posix_map *m, void *buf,
+				 size_t count)
+{
+	/* End of stream */
+	if(m->pos >= m->size)
+		return -1;
+
+	/* Copy from mapping */
+	if(count > m->size - m->pos)
+		count = m->size - m->pos;
+	memcpy(buf, m->data + m->pos, count);
+	m->pos += count;
+
+	return count;
+}
+
 static ssize_t fs_posix_read_to(struct fs_file *f, void *buf, size_t count,
 				long timeout)
 {
@@ -64,6 +128,10 @@ static ssize_t fs_posix_read_to(struct fs_file *f, void *buf, size_t count,
 	ssize_t len = 0;
 	fd_set readfs;
 
+	/* File is mapped: data is always available */
+	if(f->data != NULL)
+		return fs_posix_map_read(f->data, buf, count);
+
 	/* Use timeout */
 	if(timeout >= 0)
 	{
@@ -139,7 +207,23 @@ static ssize_t fs_posix_write(struct fs_file *f, const void *buf, size_t count)
 
 static off_t fs_posix_lseek(struct fs_file *f, off_t offset, int whence)
 {
-	return lseek(f->fd, offset, whence);
+	struct fs_posix_map *m = f->data;
+
+	if(m == NULL)
+		return lseek(f->fd, offset, whence);
+
+	/* Seek in mapping */
+	if(whence == SEEK_CUR)
+		offset += m->pos;
+	else if(whence == SEEK_END)
+		offset += m->size;
+	else if(whence != SEEK_SET)
+		return -1;
+	if(offset < 0)
+		return -1;
+	m->pos = offset;
+
+	return offset;
 }
 
 static int fs_posix_ftruncate(struct fs_file *f, off_t length)
@@ -149,13 +233,70 @@ static int fs_posix_ftruncate(struct fs_file *f, off_t length)
 
 static void fs_posix_close(struct fs_file *f)
 {
+	struct fs_posix_map *m = f->data;
+
 	if(f->fd < 0)
 		return;
 
+	/* Unmap file */
+	if(m != NULL)
+	{
+		munmap(m->data, m->size);
+		free(m);
+	}
+
 	/* Close file */
 	close(f->fd);
 }
 
+static int fs_posix_advise(struct fs_file *f, off_t offset, off_t len,
+			   enum fs_advice advice)
+{
+#ifdef HAVE_MADVISE
+	static const int madvices[] = {
+		[FS_ADVICE_NORMAL] = MADV_NORMAL,
+		[FS_ADVICE_SEQUENTIAL] = MADV_SEQUENTIAL,
+		[FS_ADVICE_RANDOM] = MADV_RANDOM,
+		[FS_ADVICE_WILLNEED] = MADV_WILLNEED,
+		[FS_ADVICE_DONTNEED] = MADV_DONTNEED,
+	};
+	struct fs_posix_map *m = f->data;
+	long page = sysconf(_SC_PAGESIZE);
+	off_t start, end;
+#endif
+#ifdef HAVE_POSIX_FADVISE
+	static const int fadvices[] = {
+		[FS_ADVICE_NORMAL] = POSIX_FADV_NORMAL,
+		[FS_ADVICE_SEQUENTIAL] = POSIX_FADV_SEQUENTIAL,
+		[FS_ADVICE_RANDOM] = POSIX_FADV_RANDOM,
+		[FS_ADVICE_WILLNEED] = POSIX_FADV_WILLNEED,
+		[FS_ADVICE_DONTNEED] = POSIX_FADV_DONTNEED,
+	};
+#endif
+	int ret = -1;
+
+	if(advice < FS_ADVICE_NORMAL || advice > FS_ADVICE_DONTNEED)
+		return -1;
+
+#ifdef HAVE_MADVISE
+	/* Give hint on pages of mapping */
+	if(m != NULL && offset < m->size)
+	{
+		start = offset - (offset % page);
+		end = len == 0 || offset + len > m->size ? m->size :
+							   offset + len;
+		ret = madvise(m->data + start, end - start, madvices[advice]);
+	}
+#endif
+#ifdef HAVE_POSIX_FADVISE
+	/* Give hint on page cache of file */
+	if(posix_fadvise(f->fd, offset, len, fadvices[advice]) == 0)
+		ret = 0;
+#endif
+
+	return ret;
+}
+
 static int fs_posix_opendir(struct fs_dir *d, const char *url)
 {
 	/* Open directory */
@@ -233,7 +374,7 @@ static struct fs_dirent *fs_posix_readdir(struct fs_dir *d)
 	d->c_dirent.offset = dir->d_off;
 	d->c_dirent.comment_len = 0;
 	d->c_dirent.comment = NULL;
-	d->c_dirent.name_len = dir->d_reclen;
+	d->c_dirent.name_len = strlen(dir->d_name);
 	strcpy(d->c_dirent.name, dir->d_name);
 
 	/* Get type */
@@ -253,10 +394,11 @@ static struct fs_dirent *fs_posix_readdir(struct fs_dir *d)
 	}
 
 	/* Generate path */
-	strncpy(&d->url[d->url_len], dir->d_name, dir->d_reclen);
+	memcpy(&d->url[d->url_len], dir->d_name, d->c_dirent.name_len + 1);
 
-	/* Stat directory */
-	stat(d->url, &d->c_dirent.stat);
+	/* Stat entry relative to directory (no path walk) */
+	if(fstatat(d->fd, dir->d_name, &d->c_dirent.stat, 0) != 0)
+		memset(&d->c_dirent.stat, 0, sizeof(struct stat));
 
 	return &d->c_dirent;
 }
@@ -305,6 +447,7 @@ struct fs_handle fs_posix = {
 	.lseek = fs_posix_lseek,
 	.ftruncate = fs_posix_ftruncate,
 	.close = fs_posix_close,
+	.advise = fs_posix_advise,
 	.mkdir = mkdir,
 	.unlink = unlink,
 	.rmdir = rmdir,
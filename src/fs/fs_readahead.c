@@ -0,0 +1,688 @@
+/*
+ * fs_readahead.c - A readahead layer for fs_file
+ *
+ * Copyright (c) 2014   A. Dilly
+ *
+ * AirCat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * AirCat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with AirCat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "budget.h"
+#include "json.h"
+#include "fs.h"
+#include "thread.h"
+
+/* Block size limits (in bytes) */
+#define FS_READAHEAD_MIN_SIZE (64 * 1024)
+#define FS_READAHEAD_MAX_SIZE (512 * 1024)
+#define FS_READAHEAD_DEFAULT_SIZE (128 * 1024)
+
+/* Block count: current block and prefetched block, more blocks are allocated
+ * when blocks are pinned by fs_readahead_map()
+ */
+#define FS_READAHEAD_BLOCKS 2
+#define FS_READAHEAD_MAX_BLOCKS 8
+
+enum fs_readahead_state {
+	FS_READAHEAD_EMPTY,	/* Block is not used */
+	FS_READAHEAD_WAITING,	/* Block must be loaded by thread */
+	FS_READAHEAD_READY	/* Block is loaded */
+};
+
+struct fs_readahead_block {
+	unsigned char *data;
+	/* Position in file and bytes read */
+	off_t pos;
+	size_t len;
+	int error;
+	/* Block state and request count (to drop a load when re-requested) */
+	enum fs_readahead_state state;
+	unsigned long req;
+	/* Mapped references on block data */
+	unsigned int pins;
+	/* Asynchronous load in flight and its request count */
+	int loading;
+	unsigned long load_req;
+};
+
+struct fs_readahead_handle {
+	/* Underlying file */
+	struct fs_file *file;
+	struct stat st;
+	off_t file_pos;
+	/* Blocks */
+	struct fs_readahead_block blocks[FS_READAHEAD_MAX_BLOCKS];
+	struct fs_readahead_block *cur;
+	size_t size;
+	int count;
+	/* Position of reader */
+	off_t pos;
+	/* Asynchronous reads (NULL when blocks are loaded with fs_read()) */
+	struct fs_aio *aio;
+	/* Prefetch thread */
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int stop;
+};
+
+static size_t fs_readahead_size = FS_READAHEAD_DEFAULT_SIZE;
+
+static struct fs_handle fs_readahead;
+
+static void *fs_readahead_thread(void *user_data);
+
+void fs_readahead_set_size(size_t size)
+{
+	/* Use default size */
+	if(size == 0)
+		size = FS_READAHEAD_DEFAULT_SIZE;
+
+	/* Check limits */
+	if(size < FS_READAHEAD_MIN_SIZE)
+		size = FS_READAHEAD_MIN_SIZE;
+	else if(size > FS_READAHEAD_MAX_SIZE)
+		size = FS_READAHEAD_MAX_SIZE;
+
+	__atomic_store_n(&fs_readahead_size, size, __ATOMIC_RELEASE);
+}
+
+size_t fs_readahead_get_size(void)
+{
+	return __atomic_load_n(&fs_readahead_size, __ATOMIC_ACQUIRE);
+}
+
+int fs_readahead_set_config(struct json *cfg)
+{
+	int size = 0;
+
+	/* Get block size in kB (default size if not set) */
+	if(cfg != NULL)
+		size = json_get_int(cfg, "size");
+	if(size < 0)
+		size = 0;
+	fs_readahead_set_size((size_t) size * 1024);
+
+	return 0;
+}
+
+struct json *fs_readahead_get_config(void)
+{
+	struct json *cfg;
+
+	/* Create a new object */
+	cfg = json_new();
+	if(cfg == NULL)
+		return NULL;
+
+	/* Set block size in kB */
+	json_set_int(cfg, "size", fs_readahead_get_size() / 1024);
+
+	return cfg;
+}
+
+struct fs_file *fs_readahead_open(struct fs_file *file, size_t size)
+{
+	struct fs_readahead_handle *h;
+	struct fs_file *f;
+	int i;
+
+	if(file == NULL)
+		return NULL;
+
+	/* Get block size */
+	if(size == 0)
+		size = fs_readahead_get_size();
+
+	/* Reserve memory for blocks */
+	if(budget_reserve(BUDGET_READAHEAD, size * FS_READAHEAD_BLOCKS) != 0)
+		return NULL;
+
+	/* Allocate file and handle */
+	f = malloc(sizeof(struct fs_file));
+	h = calloc(1, sizeof(struct fs_readahead_handle));
+	if(f == NULL || h == NULL)
+		goto error;
+	f->fd = -1;
+	f->data = h;
+	f->handle = &fs_readahead;
+
+	/* Init handle: file has just been opened */
+	h->file = file;
+	h->size = size;
+	h->file_pos = 0;
+	h->pos = 0;
+
+	/* Get file properties now since file is then used by thread */
+	if(fs_fstat(file, &h->st) != 0)
+		goto error;
+
+	/* Allocate blocks */
+	for(i = 0; i < FS_READAHEAD_BLOCKS; i++)
+	{
+		h->blocks[i].data = malloc(size);
+		if(h->blocks[i].data == NULL)
+			goto error;
+	}
+	h->count = FS_READAHEAD_BLOCKS;
+	h->cur = &h->blocks[0];
+
+	/* Load blocks in parallel with io_uring when possible */
+	if(fs_aio_can_read(file))
+		h->aio = fs_aio_new(FS_READAHEAD_MAX_BLOCKS);
+
+	/* Init thread */
+	pthread_mutex_init(&h->mutex, NULL);
+	pthread_cond_init(&h->cond, NULL);
+	if(pthread_create(&h->thread, NULL, fs_readahead_thread, h) != 0)
+	{
+		fs_aio_free(h->aio);
+		pthread_cond_destroy(&h->cond);
+		pthread_mutex_destroy(&h->mutex);
+		goto error;
+	}
+
+	return f;
+
+error:
+	if(h != NULL)
+	{
+		for(i = 0; i < FS_READAHEAD_BLOCKS; i++)
+			free(h->blocks[i].data);
+		free(h);
+	}
+	free(f);
+	budget_release(BUDGET_READAHEAD, size * FS_READAHEAD_BLOCKS);
+	return NULL;
+}
+
+static int fs_readahead_load(struct fs_readahead_handle *h,
+			     unsigned char *data, off_t pos, size_t *count)
+{
+	ssize_t len;
+
+	/* Go to block position */
+	*count = 0;
+	if(pos != h->file_pos)
+	{
+		if(fs_lseek(h->file, pos, SEEK_SET) != pos)
+			return -1;
+		h->file_pos = pos;
+	}
+
+	/* Read all block (a shorter block is end of file) */
+	while(*count < h->size)
+	{
+		len = fs_read(h->file, data + *count, h->size - *count);
+		if(len < 0)
+			return -1;
+		if(len == 0)
+			break;
+		*count += len;
+		h->file_pos += len;
+	}
+
+	return 0;
+}
+
+static int fs_readahead_submit(struct fs_readahead_handle *h)
+{
+	struct fs_readahead_block *b;
+	int i;
+
+	/* Submit all waiting blocks: current block first */
+	for(i = -1; i < h->count; i++)
+	{
+		b = i < 0 ? h->cur : &h->blocks[i];
+		if(b->state != FS_READAHEAD_WAITING || b->loading)
+			continue;
+
+		/* Read block (a shorter block is end of file) */
+		if(fs_aio_read(h->aio, h->file, b->data, h->size, b->pos, b)
+		   != 0)
+		{
+			b->len = 0;
+			b->error = -1;
+			b->state = FS_READAHEAD_READY;
+			pthread_cond_broadcast(&h->cond);
+			continue;
+		}
+		b->loading = 1;
+		b->load_req = b->req;
+	}
+
+	return fs_aio_pending(h->aio);
+}
+
+static void fs_readahead_complete(struct fs_readahead_handle *h)
+{
+	struct fs_readahead_block *b;
+	void *user;
+	ssize_t res;
+	int ret;
+
+	/* Unlock handle during I/O */
+	pthread_mutex_unlock(&h->mutex);
+
+	/* Wait a block */
+	ret = fs_aio_complete(h->aio, &user, &res, 1);
+
+	/* Lock handle */
+	pthread_mutex_lock(&h->mutex);
+	if(ret != 1)
+		return;
+
+	/* Block is ready if it has not been requested again */
+	b = user;
+	b->loading = 0;
+	if(b->req == b->load_req)
+	{
+		b->len = res < 0 ? 0 : res;
+		b->error = res < 0 ? -1 : 0;
+		b->state = FS_READAHEAD_READY;
+		pthread_cond_broadcast(&h->cond);
+	}
+}
+
+static void *fs_readahead_thread(void *user_data)
+{
+	struct fs_readahead_handle *h = user_data;
+	struct fs_readahead_block *b;
+	unsigned long req;
+	size_t count;
+	off_t pos;
+	int error;
+	int i;
+
+	/* Set thread scheduling and name */
+	thread_setup(THREAD_DEMUX, "readahead");
+
+	/* Lock handle */
+	pthread_mutex_lock(&h->mutex);
+
+	while(!h->stop)
+	{
+		/* Load blocks asynchronously: all waiting blocks are in flight
+		 * and the blocks are completed in any order
+		 */
+		if(h->aio != NULL)
+		{
+			if(fs_readahead_submit(h) == 0)
+				pthread_cond_wait(&h->cond, &h->mutex);
+			else
+				fs_readahead_complete(h);
+			continue;
+		}
+
+		/* Find a waiting block: current block first */
+		b = h->cur;
+		for(i = 0; b->state != FS_READAHEAD_WAITING; i++)
+		{
+			if(i >= h->count)
+			{
+				b = NULL;
+				break;
+			}
+			b = &h->blocks[i];
+		}
+
+		/* Wait for a request */
+		if(b == NULL)
+		{
+			pthread_cond_wait(&h->cond, &h->mutex);
+			continue;
+		}
+		pos = b->pos;
+		req = b->req;
+
+		/* Unlock handle during I/O */
+		pthread_mutex_unlock(&h->mutex);
+
+		/* Load block */
+		error = fs_readahead_load(h, b->data, pos, &count);
+
+		/* Lock handle */
+		pthread_mutex_lock(&h->mutex);
+
+		/* Block is ready if it has not been requested again */
+		if(b->req == req)
+		{
+			b->len = count;
+			b->error = error;
+			b->state = FS_READAHEAD_READY;
+			pthread_cond_broadcast(&h->cond);
+		}
+	}
+
+	/* Unlock handle */
+	pthread_mutex_unlock(&h->mutex);
+
+	/* Wait reads in flight before blocks are freed */
+	fs_aio_free(h->aio);
+
+	return NULL;
+}
+
+static void fs_readahead_request(struct fs_readahead_handle *h,
+				 struct fs_readahead_block *b, off_t pos)
+{
+	/* Block already requested */
+	if(b->state != FS_READAHEAD_EMPTY && b->pos == pos)
+		return;
+
+	/* Ask thread to load block */
+	b->state = FS_READAHEAD_WAITING;
+	b->pos = pos;
+	b->req++;
+	pthread_cond_broadcast(&h->cond);
+}
+
+static struct fs_readahead_block *fs_readahead_find(
+					       struct fs_readahead_handle *h,
+					       off_t pos,
+					       struct fs_readahead_block *keep)
+{
+	struct fs_readahead_block *b, *free = NULL;
+	int i;
+
+	/* Find block already requested for position */
+	for(i = 0; i < h->count; i++)
+	{
+		b = &h->blocks[i];
+		if(b->state != FS_READAHEAD_EMPTY && b->pos == pos)
+			return b;
+
+		/* Pinned and kept blocks cannot be reused */
+		if(b->pins > 0 || b == keep)
+			continue;
+
+		/* Prefer an empty block or else the first block in file */
+		if(free == NULL || (free->state != FS_READAHEAD_EMPTY &&
+		    (b->state == FS_READAHEAD_EMPTY || b->pos < free->pos)))
+			free = b;
+	}
+
+	/* A free block has been found */
+	if(free != NULL)
+		return free;
+
+	/* All blocks are pinned: allocate a new one */
+	if(h->count >= FS_READAHEAD_MAX_BLOCKS ||
+	   budget_reserve(BUDGET_READAHEAD, h->size) != 0)
+		return NULL;
+	b = &h->blocks[h->count];
+	b->data = malloc(h->size);
+	if(b->data == NULL)
+	{
+		budget_release(BUDGET_READAHEAD, h->size);
+		return NULL;
+	}
+	h->count++;
+
+	return b;
+}
+
+static struct fs_readahead_block *fs_readahead_get_block(
+					       struct fs_readahead_handle *h)
+{
+	struct fs_readahead_block *b, *next;
+	off_t pos;
+
+	/* Blocks are aligned on block size */
+	pos = h->pos - (h->pos % h->size);
+
+	/* Request block containing position */
+	b = fs_readahead_find(h, pos, NULL);
+	if(b == NULL)
+		return NULL;
+	fs_readahead_request(h, b, pos);
+	h->cur = b;
+
+	/* Wait block */
+	while(b->state != FS_READAHEAD_READY || b->pos != pos)
+		pthread_cond_wait(&h->cond, &h->mutex);
+
+	/* Prefetch next block when not at end of file */
+	if(b->len == h->size)
+	{
+		next = fs_readahead_find(h, pos + h->size, b);
+		if(next != NULL)
+			fs_readahead_request(h, next, pos + h->size);
+	}
+
+	return b;
+}
+
+static ssize_t fs_readahead_read(struct fs_file *f, void *buf, size_t count)
+{
+	struct fs_readahead_handle *h = f->data;
+	struct fs_readahead_block *b;
+	size_t len = 0;
+	size_t off, size;
+	int error = 0;
+
+	/* Lock handle */
+	pthread_mutex_lock(&h->mutex);
+
+	/* Copy from blocks */
+	while(len < count)
+	{
+		/* Get block with current position */
+		b = fs_readahead_get_block(h);
+		if(b == NULL)
+		{
+			error = -1;
+			break;
+		}
+
+		/* End of file or error: block is loaded again on next read */
+		off = h->pos - b->pos;
+		if(off >= b->len)
+		{
+			error = b->error;
+			if(error)
+				b->state = FS_READAHEAD_EMPTY;
+			break;
+		}
+
+		/* Copy data */
+		size = b->len - off;
+		if(size > count - len)
+			size = count - len;
+		memcpy((unsigned char *) buf + len, b->data + off, size);
+		h->pos += size;
+		len += size;
+	}
+
+	/* Unlock handle */
+	pthread_mutex_unlock(&h->mutex);
+
+	if(len == 0 && error)
+		return -1;
+
+	return len;
+}
+
+int fs_readahead_map(struct fs_file *f, off_t pos, size_t len,
+		     unsigned char **data, void **ref)
+{
+	struct fs_readahead_handle *h;
+	struct fs_readahead_block *b;
+	off_t old_pos;
+	int ret = -1;
+
+	if(f == NULL || f->handle != &fs_readahead || len == 0 || pos < 0)
+		return -1;
+	h = f->data;
+
+	/* Bytes must be in a single block */
+	if(pos % h->size + len > h->size)
+		return -1;
+
+	/* Lock handle */
+	pthread_mutex_lock(&h->mutex);
+
+	/* Get block with position */
+	old_pos = h->pos;
+	h->pos = pos;
+	b = fs_readahead_get_block(h);
+
+	/* Pin block if all bytes are available */
+	if(b != NULL && pos - b->pos + len <= b->len)
+	{
+		*data = b->data + (pos - b->pos);
+		*ref = b;
+		b->pins++;
+		h->pos = pos + len;
+		ret = 0;
+	}
+	else
+		h->pos = old_pos;
+
+	/* Unlock handle */
+	pthread_mutex_unlock(&h->mutex);
+
+	return ret;
+}
+
+void fs_readahead_unmap(struct fs_file *f, void *ref)
+{
+	struct fs_readahead_handle *h;
+	struct fs_readahead_block *b = ref;
+
+	if(f == NULL || f->handle != &fs_readahead || b == NULL)
+		return;
+	h = f->data;
+
+	/* Unpin block: it can be reused for next blocks */
+	pthread_mutex_lock(&h->mutex);
+	if(b->pins > 0)
+		b->pins--;
+	pthread_mutex_unlock(&h->mutex);
+}
+
+static ssize_t fs_readahead_read_to(struct fs_file *f, void *buf, size_t count,
+				    long timeout)
+{
+	return fs_readahead_read(f, buf, count);
+}
+
+static ssize_t fs_readahead_write(struct fs_file *f, const void *buf,
+				  size_t count)
+{
+	return -1;
+}
+
+static ssize_t fs_readahead_write_to(struct fs_file *f, const void *buf,
+				     size_t count, long timeout)
+{
+	return -1;
+}
+
+static off_t fs_readahead_lseek(struct fs_file *f, off_t offset, int whence)
+{
+	struct fs_readahead_handle *h = f->data;
+
+	/* Calculate offset from beginning of file */
+	if(whence == SEEK_CUR)
+	{
+		offset += h->pos;
+	}
+	else if(whence == SEEK_END)
+	{
+		if(h->st.st_size == 0)
+			return -1;
+		offset += h->st.st_size;
+	}
+	if(offset < 0)
+		return -1;
+
+	/* Lock handle */
+	pthread_mutex_lock(&h->mutex);
+
+	/* Blocks are loaded on next read */
+	h->pos = offset;
+
+	/* Unlock handle */
+	pthread_mutex_unlock(&h->mutex);
+
+	return offset;
+}
+
+static int fs_readahead_ftruncate(struct fs_file *f, off_t length)
+{
+	return -1;
+}
+
+static void fs_readahead_close(struct fs_file *f)
+{
+	struct fs_readahead_handle *h = f->data;
+	int i;
+
+	/* Stop thread */
+	pthread_mutex_lock(&h->mutex);
+	h->stop = 1;
+	pthread_cond_broadcast(&h->cond);
+	pthread_mutex_unlock(&h->mutex);
+	pthread_join(h->thread, NULL);
+
+	/* Close underlying file */
+	fs_close(h->file);
+
+	/* Free blocks */
+	for(i = 0; i < h->count; i++)
+		free(h->blocks[i].data);
+	budget_release(BUDGET_READAHEAD, h->size * h->count);
+
+	/* Free handle */
+	pthread_cond_destroy(&h->cond);
+	pthread_mutex_destroy(&h->mutex);
+	free(h);
+}
+
+static int fs_readahead_advise(struct fs_file *f, off_t offset, off_t len,
+			       enum fs_advice advice)
+{
+	struct fs_readahead_handle *h = f->data;
+
+	/* Hints don't move position: give them directly to underlying file */
+	return fs_advise(h->file, offset, len, advice);
+}
+
+static int fs_readahead_fstat(struct fs_file *f, struct stat *buf)
+{
+	struct fs_readahead_handle *h = f->data;
+
+	memcpy(buf, &h->st, sizeof(struct stat));
+	return 0;
+}
+
+static struct fs_handle fs_readahead = {
+	.read = fs_readahead_read,
+	.read_to = fs_readahead_read_to,
+	.write = fs_readahead_write,
+	.write_to = fs_readahead_write_to,
+	.lseek = fs_readahead_lseek,
+	.ftruncate = fs_readahead_ftruncate,
+	.close = fs_readahead_close,
+	.advise = fs_readahead_advise,
+	.fstat = fs_readahead_fstat,
+};
@@ -17,14 +17,13 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <dirent.h>
 #include <errno.h>
 #include <pthread.h>
 
-static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
@@ -36,6 +35,34 @@ static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 #include "fs_smb.h"
 
 #define FS_SMB_TIMEOUT 10
+#define FS_SMB_MAX_CONTEXTS 4
+
+/* A libsmbclient context: it holds its own connections to the server and is
+ * not thread-safe, so all calls on it are serialized by its mutex.
+ */
+struct fs_smb_ctx {
+	SMBCCTX *ctx;
+	pthread_mutex_t mutex;
+	unsigned int users;
+	struct fs_smb_ctx *next;
+};
+
+/* Pool of contexts for a server (with its credentials) */
+struct fs_smb_server {
+	char *name;
+	struct fs_smb_ctx *ctxs;
+	unsigned int count;
+	struct fs_smb_server *next;
+};
+
+/* Opened file or directory: bound to a context until closed */
+struct fs_smb_file {
+	struct fs_smb_ctx *c;
+	SMBCFILE *file;
+};
+
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct fs_smb_server *servers = NULL;
 
 static void fs_smb_get_auth(const char *srv, const char *shr,
 			    char *wg, int wglen, char *un, int unlen,
@@ -47,71 +74,221 @@ static void fs_smb_get_auth(const char *srv, const char *shr,
 
 void fs_smb_init(void)
 {
-	/* Initialize smbclient */
-	smbc_init(fs_smb_get_auth, 0);
-
 	return;
 }
 
 void fs_smb_free(void)
 {
-	return;
+	struct fs_smb_server *s;
+	struct fs_smb_ctx *c;
+
+	/* Lock pool access */
+	pthread_mutex_lock(&pool_mutex);
+
+	/* Free all contexts */
+	while(servers != NULL)
+	{
+		s = servers;
+		servers = s->next;
+
+		while(s->ctxs != NULL)
+		{
+			c = s->ctxs;
+			s->ctxs = c->next;
+			smbc_free_context(c->ctx, 1);
+			pthread_mutex_destroy(&c->mutex);
+			free(c);
+		}
+		free(s->name);
+		free(s);
+	}
+
+	/* Unlock pool access */
+	pthread_mutex_unlock(&pool_mutex);
 }
 
-static int fs_smb_open(struct fs_file *f, const char *url, int flags,
-		       mode_t mode)
+static struct fs_smb_ctx *fs_smb_new_ctx(void)
 {
-	/* Lock libsmbclient access */
-	pthread_mutex_lock(&mutex);
+	struct fs_smb_ctx *c;
 
-	/* Open file */
-	f->fd = smbc_open(url, flags, mode);
+	/* Allocate context */
+	c = malloc(sizeof(struct fs_smb_ctx));
+	if(c == NULL)
+		return NULL;
 
-	/* Unlock libsmbclient access */
-	pthread_mutex_unlock(&mutex);
+	/* Create libsmbclient context */
+	c->ctx = smbc_new_context();
+	if(c->ctx == NULL)
+	{
+		free(c);
+		return NULL;
+	}
+	smbc_setFunctionAuthData(c->ctx, fs_smb_get_auth);
 
-	/* Bad file descriptor */
-	if(f->fd < SMBC_BASE_FD)
-		return -1;
+	/* Initialize context */
+	if(smbc_init_context(c->ctx) == NULL)
+	{
+		smbc_free_context(c->ctx, 1);
+		free(c);
+		return NULL;
+	}
+
+	/* Init context */
+	pthread_mutex_init(&c->mutex, NULL);
+	c->users = 0;
+	c->next = NULL;
 
-	return 0;
+	return c;
 }
 
-static int fs_smb_creat(struct fs_file *f, const char *url, mode_t mode)
+static struct fs_smb_ctx *fs_smb_get_ctx(const char *url)
 {
-	/* Lock libsmbclient access */
-	pthread_mutex_lock(&mutex);
+	struct fs_smb_server *s;
+	struct fs_smb_ctx *c, *best = NULL;
+	const char *p;
+	size_t len;
 
-	/* Create file */
-	f->fd = smbc_creat(url, mode);
+	/* Get server part of URL (with credentials) */
+	p = url + 6;
+	len = strcspn(p, "/");
 
-	/* Unlock libsmbclient access */
-	pthread_mutex_unlock(&mutex);
+	/* Lock pool access */
+	pthread_mutex_lock(&pool_mutex);
 
-	/* Bad file descriptor */
-	if(f->fd < SMBC_BASE_FD)
-		return -1;
+	/* Find server */
+	for(s = servers; s != NULL; s = s->next)
+		if(strlen(s->name) == len && strncmp(s->name, p, len) == 0)
+			break;
+
+	/* Add a new server */
+	if(s == NULL)
+	{
+		s = calloc(1, sizeof(struct fs_smb_server));
+		if(s == NULL || (s->name = strndup(p, len)) == NULL)
+		{
+			pthread_mutex_unlock(&pool_mutex);
+			free(s);
+			return NULL;
+		}
+		s->next = servers;
+		servers = s;
+	}
 
-	return 0;
+	/* Find the least used context */
+	for(c = s->ctxs; c != NULL; c = c->next)
+		if(best == NULL || c->users < best->users)
+			best = c;
+
+	/* All contexts are busy: add a new one while the pool is not full */
+	if((best == NULL || best->users > 0) &&
+	   s->count < FS_SMB_MAX_CONTEXTS)
+	{
+		c = fs_smb_new_ctx();
+		if(c != NULL)
+		{
+			c->next = s->ctxs;
+			s->ctxs = c;
+			s->count++;
+			best = c;
+		}
+	}
+
+	/* Use context */
+	if(best != NULL)
+		best->users++;
+
+	/* Unlock pool access */
+	pthread_mutex_unlock(&pool_mutex);
+
+	return best;
+}
+
+static void fs_smb_put_ctx(struct fs_smb_ctx *c)
+{
+	/* Release context: it is kept in pool with its connections */
+	pthread_mutex_lock(&pool_mutex);
+	c->users--;
+	pthread_mutex_unlock(&pool_mutex);
+}
+
+static struct fs_smb_file *fs_smb_open_file(const char *url, int flags,
+					    mode_t mode, int dir)
+{
+	struct fs_smb_file *h;
+
+	/* Allocate file handle */
+	h = malloc(sizeof(struct fs_smb_file));
+	if(h == NULL)
+		return NULL;
+
+	/* Get a context for server */
+	h->c = fs_smb_get_ctx(url);
+	if(h->c == NULL)
+	{
+		free(h);
+		return NULL;
+	}
+
+	/* Lock context access */
+	pthread_mutex_lock(&h->c->mutex);
+
+	/* Open file or directory */
+	if(dir)
+		h->file = smbc_getFunctionOpendir(h->c->ctx)(h->c->ctx, url);
+	else
+		h->file = smbc_getFunctionOpen(h->c->ctx)(h->c->ctx, url,
+							  flags, mode);
+
+	/* Unlock context access */
+	pthread_mutex_unlock(&h->c->mutex);
+
+	/* Bad file */
+	if(h->file == NULL)
+	{
+		fs_smb_put_ctx(h->c);
+		free(h);
+		return NULL;
+	}
+
+	return h;
+}
+
+static int fs_smb_open(struct fs_file *f, const char *url, int flags,
+		       mode_t mode)
+{
+	/* Open file */
+	f->data = fs_smb_open_file(url, flags, mode, 0);
+	f->fd = -1;
+
+	return f->data != NULL ? 0 : -1;
+}
+
+static int fs_smb_creat(struct fs_file *f, const char *url, mode_t mode)
+{
+	/* Create file */
+	return fs_smb_open(f, url, O_CREAT | O_WRONLY | O_TRUNC, mode);
 }
 
 static ssize_t fs_smb_read(struct fs_file *f, void *buf, size_t count)
 {
+	struct fs_smb_file *h = f->data;
+	smbc_read_fn fn;
 	ssize_t len;
 
-	/* Lock libsmbclient access */
-	pthread_mutex_lock(&mutex);
+	/* Lock context access */
+	pthread_mutex_lock(&h->c->mutex);
 
 	/* Wait until data or error */
-	while((len = smbc_read(f->fd, buf, count)) < 0)
+	fn = smbc_getFunctionRead(h->c->ctx);
+	while((len = fn(h->c->ctx, h->file, buf, count)) < 0)
 	{
 		/* Skip timeout */
 		if(errno != EAGAIN)
 			break;
 	}
 
-	/* Unlock libsmbclient access */
-	pthread_mutex_unlock(&mutex);
+	/* Unlock context access */
+	pthread_mutex_unlock(&h->c->mutex);
 
 	/* End of file */
 	if(len == 0)
@@ -123,19 +300,22 @@ static ssize_t fs_smb_read(struct fs_file *f, void *buf, size_t count)
 static ssize_t fs_smb_read_to(struct fs_file *f, void *buf, size_t count,
 				long timeout)
 {
+	struct fs_smb_file *h = f->data;
+	smbc_read_fn fn;
 	ssize_t len;
 
 	/* No timeout */
 	if(timeout == -1)
 		return fs_smb_read(f, buf, count);
 
-	/* Lock libsmbclient access */
-	pthread_mutex_lock(&mutex);
+	/* Lock context access */
+	pthread_mutex_lock(&h->c->mutex);
 
 	/* Wait timeout */
+	fn = smbc_getFunctionRead(h->c->ctx);
 	do {
 		/* Attempt to read */
-		len = smbc_read(f->fd, buf, count);
+		len = fn(h->c->ctx, h->file, buf, count);
 		if(len <= 0)
 		{
 			/* End of file */
@@ -149,29 +329,32 @@ static ssize_t fs_smb_read_to(struct fs_file *f, void *buf, size_t count,
 		timeout -= FS_SMB_TIMEOUT;
 	} while(timeout > 0);
 
-	/* Unlock libsmbclient access */
-	pthread_mutex_unlock(&mutex);
+	/* Unlock context access */
+	pthread_mutex_unlock(&h->c->mutex);
 
 	return len;
 }
 
 static ssize_t fs_smb_write(struct fs_file *f, const void *buf, size_t count)
 {
+	struct fs_smb_file *h = f->data;
+	smbc_write_fn fn;
 	ssize_t len;
 
-	/* Lock libsmbclient access */
-	pthread_mutex_lock(&mutex);
+	/* Lock context access */
+	pthread_mutex_lock(&h->c->mutex);
 
 	/* Wait until data or error */
-	while((len = smbc_write(f->fd, buf, count)) < 0)
+	fn = smbc_getFunctionWrite(h->c->ctx);
+	while((len = fn(h->c->ctx, h->file, buf, count)) < 0)
 	{
 		/* Skip timeout */
 		if(errno != EAGAIN)
 			break;
 	}
 
-	/* Unlock libsmbclient access */
-	pthread_mutex_unlock(&mutex);
+	/* Unlock context access */
+	pthread_mutex_unlock(&h->c->mutex);
 
 	/* End of file */
 	if(len == 0)
@@ -183,19 +366,22 @@ static ssize_t fs_smb_write(struct fs_file *f, const void *buf, size_t count)
 static ssize_t fs_smb_write_to(struct fs_file *f, const void *buf,
 				 size_t count, long timeout)
 {
+	struct fs_smb_file *h = f->data;
+	smbc_write_fn fn;
 	ssize_t len;
 
 	/* No timeout */
 	if(timeout == -1)
 		return fs_smb_write(f, buf, count);
 
-	/* Lock libsmbclient access */
-	pthread_mutex_lock(&mutex);
+	/* Lock context access */
+	pthread_mutex_lock(&h->c->mutex);
 
 	/* Wait timeout */
+	fn = smbc_getFunctionWrite(h->c->ctx);
 	do {
 		/* Attempt to write */
-		len = smbc_write(f->fd, buf, count);
+		len = fn(h->c->ctx, h->file, buf, count);
 		if(len <= 0)
 		{
 			/* End of file */
@@ -209,71 +395,86 @@ static ssize_t fs_smb_write_to(struct fs_file *f, const void *buf,
 		timeout -= FS_SMB_TIMEOUT;
 	} while(timeout > 0);
 
-	/* Unlock libsmbclient access */
-	pthread_mutex_unlock(&mutex);
+	/* Unlock context access */
+	pthread_mutex_unlock(&h->c->mutex);
 
 	return len;
 }
 
 static off_t fs_smb_lseek(struct fs_file *f, off_t offset, int whence)
 {
+	struct fs_smb_file *h = f->data;
 	off_t ret;
 
-	/* Lock libsmbclient access */
-	pthread_mutex_lock(&mutex);
+	/* Lock context access */
+	pthread_mutex_lock(&h->c->mutex);
 
 	/* Lseek */
-	ret = smbc_lseek(f->fd, offset, whence);
+	ret = smbc_getFunctionLseek(h->c->ctx)(h->c->ctx, h->file, offset,
+					       whence);
 
-	/* Unlock libsmbclient access */
-	pthread_mutex_unlock(&mutex);
+	/* Unlock context access */
+	pthread_mutex_unlock(&h->c->mutex);
 
 	return ret;
 }
 
 static int fs_smb_ftruncate(struct fs_file *f, off_t length)
 {
+	struct fs_smb_file *h = f->data;
 	int ret;
 
-	/* Lock libsmbclient access */
-	pthread_mutex_lock(&mutex);
+	/* Lock context access */
+	pthread_mutex_lock(&h->c->mutex);
 
 	/* Ftruncate */
-	ret = smbc_ftruncate(f->fd, length);
+	ret = smbc_getFunctionFtruncate(h->c->ctx)(h->c->ctx, h->file, length);
 
-	/* Unlock libsmbclient access */
-	pthread_mutex_unlock(&mutex);
+	/* Unlock context access */
+	pthread_mutex_unlock(&h->c->mutex);
 
 	return ret;
 }
 
 static void fs_smb_close(struct fs_file *f)
 {
-	if(f->fd < SMBC_BASE_FD)
+	struct fs_smb_file *h = f->data;
+
+	if(h == NULL)
 		return;
 
-	/* Lock libsmbclient access */
-	pthread_mutex_lock(&mutex);
+	/* Lock context access */
+	pthread_mutex_lock(&h->c->mutex);
 
 	/* Close file */
-	smbc_close(f->fd);
+	smbc_getFunctionClose(h->c->ctx)(h->c->ctx, h->file);
 
-	/* Unlock libsmbclient access */
-	pthread_mutex_unlock(&mutex);
+	/* Unlock context access */
+	pthread_mutex_unlock(&h->c->mutex);
+
+	/* Release context */
+	fs_smb_put_ctx(h->c);
+	free(h);
 }
 
+/* Path operations borrow a context from pool for the call */
+#define FS_SMB_PATH_CALL(url, ret, call) do { \
+	struct fs_smb_ctx *c = fs_smb_get_ctx(url); \
+	if(c == NULL) \
+		return -1; \
+	pthread_mutex_lock(&c->mutex); \
+	ret = call; \
+	pthread_mutex_unlock(&c->mutex); \
+	fs_smb_put_ctx(c); \
+} while(0)
+
 static int fs_smb_mkdir(const char *url, mode_t mode)
 {
 	int ret;
 
-	/* Lock libsmbclient access */
-	pthread_mutex_lock(&mutex);
-
 	/* Mkdir */
-	ret = smbc_mkdir(url, mode);
-
-	/* Unlock libsmbclient access */
-	pthread_mutex_unlock(&mutex);
+	FS_SMB_PATH_CALL(url, ret,
+			 smbc_getFunctionMkdir(c->ctx)(c->ctx, url, mode));
 
 	return ret;
 }
@@ -282,14 +483,9 @@ static int fs_smb_unlink(const char *url)
 {
 	int ret;
 
-	/* Lock libsmbclient access */
-	pthread_mutex_lock(&mutex);
-
 	/* Unlink */
-	ret = smbc_unlink(url);
-
-	/* Unlock libsmbclient access */
-	pthread_mutex_unlock(&mutex);
+	FS_SMB_PATH_CALL(url, ret,
+			 smbc_getFunctionUnlink(c->ctx)(c->ctx, url));
 
 	return ret;
 }
@@ -298,14 +494,9 @@ static int fs_smb_rmdir(const char *url)
 {
 	int ret;
 
-	/* Lock libsmbclient access */
-	pthread_mutex_lock(&mutex);
-
 	/* Rmdir */
-	ret = smbc_rmdir(url);
-
-	/* Unlock libsmbclient access */
-	pthread_mutex_unlock(&mutex);
+	FS_SMB_PATH_CALL(url, ret,
+			 smbc_getFunctionRmdir(c->ctx)(c->ctx, url));
 
 	return ret;
 }
@@ -314,14 +505,10 @@ static int fs_smb_rename(const char *oldurl, const char *newurl)
 {
 	int ret;
 
-	/* Lock libsmbclient access */
-	pthread_mutex_lock(&mutex);
-
-	/* Rename */
-	ret = smbc_rename(oldurl, newurl);
-
-	/* Unlock libsmbclient access */
-	pthread_mutex_unlock(&mutex);
+	/* Rename (on same server) */
+	FS_SMB_PATH_CALL(oldurl, ret,
+			 smbc_getFunctionRename(c->ctx)(c->ctx, oldurl, c->ctx,
+							newurl));
 
 	return ret;
 }
@@ -330,34 +517,20 @@ static int fs_smb_chmod(const char *url, mode_t mode)
 {
 	int ret;
 
-	/* Lock libsmbclient access */
-	pthread_mutex_lock(&mutex);
-
 	/* Chmod */
-	ret = smbc_chmod(url, mode);
-
-	/* Unlock libsmbclient access */
-	pthread_mutex_unlock(&mutex);
+	FS_SMB_PATH_CALL(url, ret,
+			 smbc_getFunctionChmod(c->ctx)(c->ctx, url, mode));
 
 	return ret;
 }
 
 static int fs_smb_opendir(struct fs_dir *d, const char *url)
 {
-	/* Lock libsmbclient access */
-	pthread_mutex_lock(&mutex);
-
 	/* Open directory */
-	d->fd = smbc_opendir(url);
+	d->data = fs_smb_open_file(url, 0, 0, 1);
+	d->fd = -1;
 
-	/* Unlock libsmbclient access */
-	pthread_mutex_unlock(&mutex);
-
-	/* Bad file descriptor */
-	if(d->fd < SMBC_BASE_FD)
-		return -1;
-
-	return 0;
+	return d->data != NULL ? 0 : -1;
 }
 
 static int fs_smb_mount(struct fs_dir *d)
@@ -367,20 +540,21 @@ static int fs_smb_mount(struct fs_dir *d)
 
 static struct fs_dirent *fs_smb_readdir(struct fs_dir *d)
 {
+	struct fs_smb_file *h = d->data;
 	struct smbc_dirent *dir;
 
-	if(d->fd < SMBC_BASE_FD)
+	if(h == NULL)
 		return NULL;
 
-	/* Lock libsmbclient access */
-	pthread_mutex_lock(&mutex);
+	/* Lock context access */
+	pthread_mutex_lock(&h->c->mutex);
 
 	/* Read directory entry */
-	dir = smbc_readdir(d->fd);
+	dir = smbc_getFunctionReaddir(h->c->ctx)(h->c->ctx, h->file);
 	if(dir == NULL)
 	{
-		/* Unlock libsmbclient access */
-		pthread_mutex_unlock(&mutex);
+		/* Unlock context access */
+		pthread_mutex_unlock(&h->c->mutex);
 		return NULL;
 	}
 
@@ -416,70 +590,79 @@ static struct fs_dirent *fs_smb_readdir(struct fs_dir *d)
 	d->url[d->url_len+dir->namelen] = '\0';
 
 	/* Stat directory */
-	smbc_stat(d->url, &d->c_dirent.stat);
+	smbc_getFunctionStat(h->c->ctx)(h->c->ctx, d->url, &d->c_dirent.stat);
 
-	/* Unlock libsmbclient access */
-	pthread_mutex_unlock(&mutex);
+	/* Unlock context access */
+	pthread_mutex_unlock(&h->c->mutex);
 
 	return &d->c_dirent;
 }
 
 static off_t fs_smb_telldir(struct fs_dir *d)
 {
+	struct fs_smb_file *h = d->data;
 	off_t ret;
 
-	if(d->fd < SMBC_BASE_FD)
+	if(h == NULL)
 		return -1;
 
-	/* Lock libsmbclient access */
-	pthread_mutex_lock(&mutex);
+	/* Lock context access */
+	pthread_mutex_lock(&h->c->mutex);
 
 	/* Telldir */
-	ret = smbc_telldir(d->fd);
+	ret = smbc_getFunctionTelldir(h->c->ctx)(h->c->ctx, h->file);
 
-	/* Unlock libsmbclient access */
-	pthread_mutex_unlock(&mutex);
+	/* Unlock context access */
+	pthread_mutex_unlock(&h->c->mutex);
 
 	return ret;
 }
 
 static void fs_smb_closedir(struct fs_dir *d)
 {
-	if(d->fd < SMBC_BASE_FD)
+	struct fs_smb_file *h = d->data;
+
+	if(h == NULL)
 		return;
 
+	/* Lock context access */
+	pthread_mutex_lock(&h->c->mutex);
+
 	/* Close directory */
-	smbc_closedir(d->fd);
+	smbc_getFunctionClosedir(h->c->ctx)(h->c->ctx, h->file);
+
+	/* Unlock context access */
+	pthread_mutex_unlock(&h->c->mutex);
+
+	/* Release context */
+	fs_smb_put_ctx(h->c);
+	free(h);
 }
 
 static int fs_smb_stat(const char *url, struct stat *buf)
 {
 	int ret;
 
-	/* Lock libsmbclient access */
-	pthread_mutex_lock(&mutex);
-
 	/* Stat file */
-	ret = smbc_stat(url, buf);
-
-	/* Unlock libsmbclient access */
-	pthread_mutex_unlock(&mutex);
+	FS_SMB_PATH_CALL(url, ret,
+			 smbc_getFunctionStat(c->ctx)(c->ctx, url, buf));
 
 	return ret;
 }
 
 static int fs_smb_fstat(struct fs_file *f, struct stat *buf)
 {
+	struct fs_smb_file *h = f->data;
 	int ret;
 
-	/* Lock libsmbclient access */
-	pthread_mutex_lock(&mutex);
+	/* Lock context access */
+	pthread_mutex_lock(&h->c->mutex);
 
 	/* Fstat file */
-	ret = smbc_fstat(f->fd, buf);
+	ret = smbc_getFunctionFstat(h->c->ctx)(h->c->ctx, h->file, buf);
 
-	/* Unlock libsmbclient access */
-	pthread_mutex_unlock(&mutex);
+	/* Unlock context access */
+	pthread_mutex_unlock(&h->c->mutex);
 
 	return ret;
 }
@@ -488,30 +671,27 @@ static int fs_smb_statvfs(const char *url, struct statvfs *buf)
 {
 	int ret;
 
-	/* Lock libsmbclient access */
-	pthread_mutex_lock(&mutex);
-
 	/* Statvfs file */
-	ret = smbc_statvfs((char*)url, buf);
-
-	/* Unlock libsmbclient access */
-	pthread_mutex_unlock(&mutex);
+	FS_SMB_PATH_CALL(url, ret,
+			 smbc_getFunctionStatVFS(c->ctx)(c->ctx, (char*)url,
+							 buf));
 
 	return ret;
 }
 
 static int fs_smb_fstatvfs(struct fs_file *f, struct statvfs *buf)
 {
+	struct fs_smb_file *h = f->data;
 	int ret;
 
-	/* Lock libsmbclient access */
-	pthread_mutex_lock(&mutex);
+	/* Lock context access */
+	pthread_mutex_lock(&h->c->mutex);
 
 	/* Fstatvfs file */
-	ret = smbc_fstatvfs(f->fd, buf);
+	ret = smbc_getFunctionFstatVFS(h->c->ctx)(h->c->ctx, h->file, buf);
 
-	/* Unlock libsmbclient access */
-	pthread_mutex_unlock(&mutex);
+	/* Unlock context access */
+	pthread_mutex_unlock(&h->c->mutex);
 
 	return ret;
 }
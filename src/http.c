@@ -25,11 +25,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/select.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <pthread.h>
+#include <time.h>
 
 #define BUFFER_SIZE 8192
 #define MAX_SIZE_HEADER BUFFER_SIZE
@@ -37,6 +41,25 @@
 #define DEFAULT_USER_AGENT "tiny_http 0.1"
 #define MAX_FOLLOW 10
 
+/* Pool of idle keep-alive connections */
+#define POOL_MAX_PER_HOST 4
+#define POOL_MAX 16
+#define POOL_IDLE_TIMEOUT 15
+
+/* Cache of resolved hostnames (lifetime in seconds) */
+#define DNS_CACHE_SIZE 32
+#define DNS_CACHE_TTL 60
+#define DNS_MAX_ADDRS 8
+
+/* Connection attempts to the next address are started every
+ * CONNECT_STAGGER ms until one succeeds (timeouts in ms)
+ */
+#define CONNECT_STAGGER 250
+#define CONNECT_TIMEOUT 10000
+
+/* TLS sessions kept for resumption (one per server) */
+#define SSL_CACHE_SIZE 16
+
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
@@ -47,6 +70,9 @@
 
 #include "utils.h"
 #include "http.h"
+#include "pool.h"
+#include "thread.h"
+#include "executor.h"
 
 struct http_header {
 	char *name;
@@ -63,8 +89,23 @@ struct http_handle {
 	int is_ssl;
 #ifdef HAVE_OPENSSL
 	SSL *ssl;
-	SSL_CTX *ssl_ctx;
 #endif
+	/* Receive buffer: headers are parsed from it and the body bytes
+	 * received with them are returned first by http_read_timeout()
+	 */
+	unsigned char recv_buffer[BUFFER_SIZE];
+	size_t recv_pos;
+	size_t recv_len;
+	/* Respond content still to read (-1 if unknown) and server accepts
+	 * to keep connection alive after it
+	 */
+	long long content_len;
+	int server_keep_alive;
+	/* Chunked respond: bytes left in current chunk (0 when next chunk
+	 * header must be read)
+	 */
+	int chunked;
+	long long chunk_len;
 	/* Proxy config */
 	int proxy_use;
 	char *proxy_hostname;
@@ -78,8 +119,10 @@ struct http_handle {
 	char *extra;
 	int keep_alive;
 	struct http_header *headers;
-	/* Thread */
+	/* Thread (or task in task mode) */
 	pthread_t thread;
+	struct task *task;
+	int task_started;
 	pthread_mutex_t mutex;
 	int stop;
 	int running;
@@ -105,8 +148,61 @@ static unsigned int proxy_port = 0;
 static char *extra = NULL;
 static int follow = 0;
 static int max_follow = MAX_FOLLOW;
+static int keep_alive = 1;
 static pthread_mutex_t def_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+/* Idle connection in pool */
+struct http_pool_conn {
+	/* Socket */
+	int sock;
+	int is_ssl;
+#ifdef HAVE_OPENSSL
+	SSL *ssl;
+#endif
+	/* Server and proxy */
+	char *hostname;
+	unsigned int port;
+	char *proxy_hostname;
+	unsigned int proxy_port;
+	/* Time when connection has been released */
+	time_t idle;
+	struct http_pool_conn *next;
+};
+
+static struct http_pool_conn *pool = NULL;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void http_pool_expire(time_t now);
+
+/* Resolved hostname (addresses without port) */
+struct http_dns_entry {
+	char *hostname;
+	struct sockaddr_storage addrs[DNS_MAX_ADDRS];
+	socklen_t lens[DNS_MAX_ADDRS];
+	int count;
+	time_t expire;
+};
+
+static struct http_dns_entry dns_cache[DNS_CACHE_SIZE];
+static pthread_mutex_t dns_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#ifdef HAVE_OPENSSL
+/* Last TLS session of a server, to resume it on next connections */
+struct http_ssl_session {
+	char *hostname;
+	SSL_SESSION *session;
+	unsigned long used;
+};
+
+/* Context shared by all connections and its session cache */
+static SSL_CTX *ssl_ctx = NULL;
+static struct http_ssl_session ssl_sessions[SSL_CACHE_SIZE];
+static unsigned long ssl_used = 0;
+static unsigned long ssl_resumed = 0;
+static unsigned long ssl_full = 0;
+static pthread_mutex_t ssl_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
 int http_set_default_option(int option, const char *c_value,
 			    unsigned int i_value)
 {
@@ -142,6 +238,9 @@ int http_set_default_option(int option, const char *c_value,
 			if(max_follow <= 0)
 				max_follow = 1;
 			break;
+		case HTTP_KEEP_ALIVE:
+			keep_alive = i_value;
+			break;
 	}
 
 	/* Unlock default configuration */
@@ -180,6 +279,9 @@ int http_get_default_option(int option, char **c_value, unsigned int *i_value)
 		case HTTP_MAX_REDIRECT:
 			*i_value = max_follow;
 			break;
+		case HTTP_KEEP_ALIVE:
+			*i_value = keep_alive;
+			break;
 	}
 
 	/* Unlock default configuration */
@@ -190,6 +292,8 @@ int http_get_default_option(int option, char **c_value, unsigned int *i_value)
 
 void http_free_default_options(void)
 {
+	int i;
+
 	/* Lock default configuration */
 	pthread_mutex_lock(&def_mutex);
 
@@ -200,6 +304,35 @@ void http_free_default_options(void)
 
 	/* Unlock default configuration */
 	pthread_mutex_unlock(&def_mutex);
+
+	/* Close idle connections */
+	pthread_mutex_lock(&pool_mutex);
+	http_pool_expire(time(NULL) + POOL_IDLE_TIMEOUT);
+	pthread_mutex_unlock(&pool_mutex);
+
+	/* Free DNS cache */
+	pthread_mutex_lock(&dns_mutex);
+	for(i = 0; i < DNS_CACHE_SIZE; i++)
+	{
+		FREE_STR(dns_cache[i].hostname);
+	}
+	pthread_mutex_unlock(&dns_mutex);
+
+#ifdef HAVE_OPENSSL
+	/* Free TLS sessions and context */
+	pthread_mutex_lock(&ssl_mutex);
+	for(i = 0; i < SSL_CACHE_SIZE; i++)
+	{
+		if(ssl_sessions[i].session != NULL)
+			SSL_SESSION_free(ssl_sessions[i].session);
+		ssl_sessions[i].session = NULL;
+		FREE_STR(ssl_sessions[i].hostname);
+	}
+	if(ssl_ctx != NULL)
+		SSL_CTX_free(ssl_ctx);
+	ssl_ctx = NULL;
+	pthread_mutex_unlock(&ssl_mutex);
+#endif
 }
 
 int http_open(struct http_handle **handle, int use_default)
@@ -232,6 +365,7 @@ int http_open(struct http_handle **handle, int use_default)
 		h->extra = extra != NULL ? strdup(extra) : NULL;
 		h->follow = follow;
 		h->max_follow = max_follow;
+		h->keep_alive = keep_alive;
 
 		/* Unlock default configuration */
 		pthread_mutex_unlock(&def_mutex);
@@ -276,6 +410,9 @@ int http_set_option(struct http_handle *h, int option, const char *c_value,
 			if(h->max_follow <= 0)
 				h->max_follow = 1;
 			break;
+		case HTTP_KEEP_ALIVE:
+			h->keep_alive = i_value;
+			break;
 		default:
 			return -1;
 	}
@@ -283,64 +420,600 @@ int http_set_option(struct http_handle *h, int option, const char *c_value,
 	return 0;
 }
 
+static void http_close_socket(struct http_handle *h)
+{
+	if(h->sock < 0)
+		return;
+
+#ifdef HAVE_OPENSSL
+	/* Free SSL connection */
+	if(h->is_ssl)
+	{
+		/* Session is kept resumable only after a clean shutdown */
+		if(h->ssl != NULL)
+		{
+			SSL_shutdown(h->ssl);
+			SSL_free(h->ssl);
+		}
+		h->ssl = NULL;
+	}
+#endif
+
+	/* Close socket */
+	close(h->sock);
+	h->sock = -1;
+
+	/* Drop received bytes */
+	h->recv_pos = 0;
+	h->recv_len = 0;
+}
+
+static int http_is_alive(struct http_handle *h)
+{
+	struct timeval tv = { 0, 0 };
+	fd_set readfs;
+
+	/* Nothing can be read on an idle connection: data or end of stream
+	 * means it has been closed by server
+	 */
+	FD_ZERO(&readfs);
+	FD_SET(h->sock, &readfs);
+	return select(h->sock + 1, &readfs, NULL, NULL, &tv) == 0;
+}
+
+static void http_pool_close(struct http_pool_conn *c)
+{
+#ifdef HAVE_OPENSSL
+	/* Free SSL connection */
+	if(c->ssl != NULL)
+	{
+		SSL_shutdown(c->ssl);
+		SSL_free(c->ssl);
+	}
+#endif
+
+	/* Close socket */
+	close(c->sock);
+	FREE_STR(c->hostname);
+	FREE_STR(c->proxy_hostname);
+	free(c);
+}
+
+static int http_pool_match(struct http_handle *h, struct http_pool_conn *c,
+			   const char *hostname, unsigned int port)
+{
+	/* Same scheme, server and proxy */
+	if(c->is_ssl != h->is_ssl || c->port != port ||
+	   strcmp(c->hostname, hostname) != 0)
+		return 0;
+	if(!h->proxy_use)
+		return c->proxy_hostname == NULL;
+	return c->proxy_hostname != NULL && h->proxy_hostname != NULL &&
+	       c->proxy_port == h->proxy_port &&
+	       strcmp(c->proxy_hostname, h->proxy_hostname) == 0;
+}
+
+static void http_pool_expire(time_t now)
+{
+	struct http_pool_conn *c, **p;
+
+	/* Close connections idle for too long (pool must be locked) */
+	for(p = &pool; *p != NULL;)
+	{
+		c = *p;
+		if(c->idle + POOL_IDLE_TIMEOUT > now)
+		{
+			p = &c->next;
+			continue;
+		}
+		*p = c->next;
+		http_pool_close(c);
+	}
+}
+
+static int http_pool_get(struct http_handle *h, const char *hostname,
+			 unsigned int port)
+{
+	struct http_pool_conn *c, **p;
+
+	while(1)
+	{
+		/* Lock pool access */
+		pthread_mutex_lock(&pool_mutex);
+
+		/* Take the most recent connection to server */
+		http_pool_expire(time(NULL));
+		for(p = &pool; *p != NULL; p = &(*p)->next)
+			if(http_pool_match(h, *p, hostname, port))
+				break;
+		c = *p;
+		if(c != NULL)
+			*p = c->next;
+
+		/* Unlock pool access */
+		pthread_mutex_unlock(&pool_mutex);
+
+		if(c == NULL)
+			return -1;
+
+		/* Move connection to handle */
+		h->sock = c->sock;
+#ifdef HAVE_OPENSSL
+		h->ssl = c->ssl;
+#endif
+		h->hostname = c->hostname;
+		h->port = port;
+		FREE_STR(c->proxy_hostname);
+		free(c);
+
+		/* Connection may have been closed by server meanwhile */
+		if(http_is_alive(h))
+			return 0;
+		http_close_socket(h);
+		FREE_STR(h->hostname);
+	}
+}
+
+static void http_pool_put(struct http_handle *h)
+{
+	struct http_pool_conn *c, *o, **p, **oldest = NULL;
+	unsigned int count = 0, host = 0;
+
+	/* Connection can be reused only if the whole respond has been read
+	 * and server keeps it alive
+	 */
+	if(h->sock < 0 || h->hostname == NULL || !h->keep_alive ||
+	   !h->server_keep_alive || h->content_len != 0 ||
+	   h->recv_pos != h->recv_len)
+		return;
+
+	/* Allocate pool entry */
+	c = calloc(1, sizeof(struct http_pool_conn));
+	if(c == NULL)
+		return;
+	c->hostname = strdup(h->hostname);
+	if(h->proxy_use && h->proxy_hostname != NULL)
+		c->proxy_hostname = strdup(h->proxy_hostname);
+	if(c->hostname == NULL ||
+	   (h->proxy_use && h->proxy_hostname != NULL &&
+	    c->proxy_hostname == NULL))
+	{
+		FREE_STR(c->hostname);
+		free(c);
+		return;
+	}
+	c->port = h->port;
+	c->proxy_port = h->proxy_use ? h->proxy_port : 0;
+	c->is_ssl = h->is_ssl;
+	c->idle = time(NULL);
+
+	/* Move connection from handle */
+	c->sock = h->sock;
+#ifdef HAVE_OPENSSL
+	c->ssl = h->ssl;
+	h->ssl = NULL;
+#endif
+	h->sock = -1;
+	FREE_STR(h->hostname);
+
+	/* Lock pool access */
+	pthread_mutex_lock(&pool_mutex);
+	http_pool_expire(c->idle);
+
+	/* Count connections and find the oldest to the same server */
+	for(p = &pool; *p != NULL; p = &(*p)->next)
+	{
+		count++;
+		if(http_pool_match(h, *p, c->hostname, c->port))
+		{
+			host++;
+			oldest = p;
+		}
+	}
+
+	/* Drop the oldest connection to server when a limit is reached (the
+	 * pool is sorted from the most recent connection)
+	 */
+	if(host >= POOL_MAX_PER_HOST || count >= POOL_MAX)
+	{
+		/* Pool is full: drop the oldest connection of pool */
+		if(oldest == NULL)
+			for(oldest = &pool; (*oldest)->next != NULL;
+			    oldest = &(*oldest)->next);
+		o = *oldest;
+		*oldest = o->next;
+		http_pool_close(o);
+	}
+
+	/* Add connection at head (most recent first) */
+	c->next = pool;
+	pool = c;
+
+	/* Unlock pool access */
+	pthread_mutex_unlock(&pool_mutex);
+}
+
+static int http_resolve(const char *hostname, unsigned int port,
+			struct sockaddr_storage *addrs, socklen_t *lens)
+{
+	struct addrinfo *list[2][DNS_MAX_ADDRS];
+	struct addrinfo hints, *res, *ai;
+	struct http_dns_entry *e, *old = NULL;
+	time_t now = time(NULL);
+	int count = 0;
+	int n[2];
+	int i, j;
+
+	if(hostname == NULL)
+		return -1;
+
+	/* Lock DNS cache access */
+	pthread_mutex_lock(&dns_mutex);
+
+	/* Find hostname in cache */
+	for(i = 0; i < DNS_CACHE_SIZE; i++)
+	{
+		e = &dns_cache[i];
+		if(e->hostname != NULL && e->expire > now &&
+		   strcmp(e->hostname, hostname) == 0)
+		{
+			count = e->count;
+			memcpy(addrs, e->addrs, count * sizeof(*addrs));
+			memcpy(lens, e->lens, count * sizeof(*lens));
+			break;
+		}
+	}
+
+	/* Unlock DNS cache access */
+	pthread_mutex_unlock(&dns_mutex);
+
+	/* Resolve hostname */
+	if(count == 0)
+	{
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		if(getaddrinfo(hostname, NULL, &hints, &res) != 0)
+			return -1;
+
+		/* Interleave address families, starting with the first one */
+		for(ai = res, n[0] = n[1] = 0; ai != NULL; ai = ai->ai_next)
+		{
+			j = ai->ai_family != res->ai_family;
+			if(n[j] < DNS_MAX_ADDRS &&
+			   ai->ai_addrlen <= sizeof(*addrs))
+				list[j][n[j]++] = ai;
+		}
+		for(i = 0; count < DNS_MAX_ADDRS && i < 2 * DNS_MAX_ADDRS; i++)
+		{
+			j = i / 2;
+			ai = i % 2 == 0 ? (j < n[0] ? list[0][j] : NULL) :
+					   (j < n[1] ? list[1][j] : NULL);
+			if(ai == NULL)
+				continue;
+			memcpy(&addrs[count], ai->ai_addr, ai->ai_addrlen);
+			lens[count++] = ai->ai_addrlen;
+		}
+		freeaddrinfo(res);
+
+		if(count == 0)
+			return -1;
+
+		/* Lock DNS cache access */
+		pthread_mutex_lock(&dns_mutex);
+
+		/* Replace same hostname or the oldest entry */
+		for(i = 0; i < DNS_CACHE_SIZE; i++)
+		{
+			e = &dns_cache[i];
+			if(e->hostname != NULL &&
+			   strcmp(e->hostname, hostname) == 0)
+			{
+				old = e;
+				break;
+			}
+			if(old == NULL || e->expire < old->expire)
+				old = e;
+		}
+		if(old->hostname == NULL ||
+		   strcmp(old->hostname, hostname) != 0)
+		{
+			FREE_STR(old->hostname);
+			old->hostname = strdup(hostname);
+		}
+		memcpy(old->addrs, addrs, count * sizeof(*addrs));
+		memcpy(old->lens, lens, count * sizeof(*lens));
+		old->count = count;
+		old->expire = now + DNS_CACHE_TTL;
+
+		/* Unlock DNS cache access */
+		pthread_mutex_unlock(&dns_mutex);
+	}
+
+	/* Set port */
+	for(i = 0; i < count; i++)
+	{
+		if(addrs[i].ss_family == AF_INET6)
+			((struct sockaddr_in6 *) &addrs[i])->sin6_port =
+								   htons(port);
+		else
+			((struct sockaddr_in *) &addrs[i])->sin_port =
+								   htons(port);
+	}
+
+	return count;
+}
+
+static long http_elapsed(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000 +
+	       (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+static int http_connect_race(struct sockaddr_storage *addrs, socklen_t *lens,
+			     int count)
+{
+	int socks[DNS_MAX_ADDRS];
+	struct timespec start;
+	struct timeval tv;
+	socklen_t len;
+	fd_set writefs;
+	int started = 0;
+	int sock = -1;
+	int max, err;
+	long wait;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while(sock < 0)
+	{
+		/* Start connection to next address */
+		if(started < count)
+		{
+			i = started++;
+			socks[i] = socket(addrs[i].ss_family, SOCK_STREAM, 0);
+			if(socks[i] < 0)
+				continue;
+			fcntl(socks[i], F_SETFL,
+			      fcntl(socks[i], F_GETFL) | O_NONBLOCK);
+			if(connect(socks[i], (struct sockaddr *) &addrs[i],
+				   lens[i]) == 0)
+			{
+				sock = socks[i];
+				break;
+			}
+			if(errno != EINPROGRESS)
+			{
+				/* Try next address now */
+				close(socks[i]);
+				socks[i] = -1;
+				continue;
+			}
+		}
+
+		/* Wait until next attempt or end of timeout */
+		wait = CONNECT_TIMEOUT - http_elapsed(&start);
+		if(wait <= 0)
+			break;
+		if(started < count && wait > CONNECT_STAGGER)
+			wait = CONNECT_STAGGER;
+
+		/* Wait a connection */
+		FD_ZERO(&writefs);
+		for(i = 0, max = -1; i < started; i++)
+		{
+			if(socks[i] < 0)
+				continue;
+			FD_SET(socks[i], &writefs);
+			if(socks[i] > max)
+				max = socks[i];
+		}
+		if(max < 0)
+		{
+			/* All attempts have failed */
+			if(started == count)
+				break;
+			continue;
+		}
+		tv.tv_sec = wait / 1000;
+		tv.tv_usec = (wait % 1000) * 1000;
+		if(select(max + 1, NULL, &writefs, NULL, &tv) < 0 &&
+		   errno != EINTR)
+			break;
+
+		/* Check connections */
+		for(i = 0; i < started && sock < 0; i++)
+		{
+			if(socks[i] < 0 || !FD_ISSET(socks[i], &writefs))
+				continue;
+
+			/* Get result of connection */
+			len = sizeof(err);
+			if(getsockopt(socks[i], SOL_SOCKET, SO_ERROR, &err,
+				      &len) == 0 && err == 0)
+			{
+				sock = socks[i];
+				break;
+			}
+
+			/* Connection has failed */
+			close(socks[i]);
+			socks[i] = -1;
+		}
+	}
+
+	/* Close other attempts */
+	for(i = 0; i < started; i++)
+		if(socks[i] >= 0 && socks[i] != sock)
+			close(socks[i]);
+
+	/* Socket is blocking */
+	if(sock >= 0)
+		fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) & ~O_NONBLOCK);
+
+	return sock;
+}
+
+#ifdef HAVE_OPENSSL
+static int http_ssl_new_session(SSL *ssl, SSL_SESSION *session)
+{
+	struct http_ssl_session *e, *old = NULL;
+	const char *hostname;
+	int i;
+
+	/* Sessions are saved for the server name sent */
+	hostname = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+	if(hostname == NULL)
+		return 0;
+
+	/* Lock session cache access */
+	pthread_mutex_lock(&ssl_mutex);
+
+	/* Replace session of server or the least recently used one */
+	for(i = 0; i < SSL_CACHE_SIZE; i++)
+	{
+		e = &ssl_sessions[i];
+		if(e->hostname != NULL && strcmp(e->hostname, hostname) == 0)
+		{
+			old = e;
+			break;
+		}
+		if(old == NULL || e->used < old->used)
+			old = e;
+	}
+	if(old->hostname == NULL || strcmp(old->hostname, hostname) != 0)
+	{
+		FREE_STR(old->hostname);
+		old->hostname = strdup(hostname);
+	}
+	if(old->session != NULL)
+		SSL_SESSION_free(old->session);
+	old->session = session;
+	old->used = ++ssl_used;
+
+	/* Unlock session cache access */
+	pthread_mutex_unlock(&ssl_mutex);
+
+	/* Session reference is kept */
+	return 1;
+}
+
+static SSL *http_ssl_new(const char *hostname)
+{
+	SSL *ssl = NULL;
+	int i;
+
+	/* Lock session cache access */
+	pthread_mutex_lock(&ssl_mutex);
+
+	/* Create context shared by all connections */
+	if(ssl_ctx == NULL)
+	{
+		/* Init library */
+		SSL_library_init();
+
+		/* Create openssl context with a client session cache filled by
+		 * callback (TLS 1.3 sends sessions after handshake)
+		 */
+		ssl_ctx = SSL_CTX_new(SSLv23_client_method());
+		if(ssl_ctx == NULL)
+			goto end;
+		SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_CLIENT |
+					       SSL_SESS_CACHE_NO_INTERNAL_STORE);
+		SSL_CTX_sess_set_new_cb(ssl_ctx, http_ssl_new_session);
+	}
+
+	/* Create a new SSL object */
+	ssl = SSL_new(ssl_ctx);
+	if(ssl == NULL)
+		goto end;
+
+	/* Send server name and resume its last session */
+	SSL_set_tlsext_host_name(ssl, hostname);
+	for(i = 0; i < SSL_CACHE_SIZE; i++)
+	{
+		if(ssl_sessions[i].hostname != NULL &&
+		   ssl_sessions[i].session != NULL &&
+		   strcmp(ssl_sessions[i].hostname, hostname) == 0)
+		{
+			SSL_set_session(ssl, ssl_sessions[i].session);
+			ssl_sessions[i].used = ++ssl_used;
+			break;
+		}
+	}
+
+end:
+	/* Unlock session cache access */
+	pthread_mutex_unlock(&ssl_mutex);
+
+	return ssl;
+}
+#endif
+
+void http_get_tls_stats(unsigned long *resumed, unsigned long *full)
+{
+#ifdef HAVE_OPENSSL
+	*resumed = __atomic_load_n(&ssl_resumed, __ATOMIC_RELAXED);
+	*full = __atomic_load_n(&ssl_full, __ATOMIC_RELAXED);
+#else
+	*resumed = 0;
+	*full = 0;
+#endif
+}
+
 static int http_connect(struct http_handle *h, char *hostname,
 			unsigned int port)
 {
-	struct sockaddr_in server_addr;
-	struct hostent *server_ip;
+	struct sockaddr_storage addrs[DNS_MAX_ADDRS];
+	socklen_t lens[DNS_MAX_ADDRS];
+	int count;
 
 	/* Check if a socket is already opened */
 	if(h->sock >= 0)
 	{
-		/* Check keep_alive and if hostname/port have changed */
-		if(h->keep_alive && strcmp(h->hostname, hostname) == 0 &&
-		   h->port == port)
+		/* Check keep_alive and if hostname/port have changed (the last
+		 * response must have been read entirely)
+		 */
+		if(h->keep_alive && h->server_keep_alive &&
+		   h->content_len == 0 && strcmp(h->hostname, hostname) == 0 &&
+		   h->port == port && h->recv_pos == h->recv_len &&
+		   http_is_alive(h))
 			return 0;
 
-		/* Close previous socket */
-		close(h->sock);
+		/* Keep previous connection in pool or close it */
+		http_pool_put(h);
+		http_close_socket(h);
 	}
 
 	/* Reset hostname and port */
 	FREE_STR(h->hostname);
 	h->port = 0;
 
-	/* Open socket to HTTP server */
-	h->sock = socket(AF_INET, SOCK_STREAM, 0);
-	if(h->sock < 0)
-		return -1;
+	/* Reuse an idle connection to server */
+	if(h->keep_alive && http_pool_get(h, hostname, port) == 0)
+		return 0;
 
-	/* Get ip address from hostname */
-	server_ip = gethostbyname(h->proxy_use ? h->proxy_hostname : hostname);
-	if (server_ip == NULL)
+	/* Get addresses of server or proxy */
+	count = http_resolve(h->proxy_use ? h->proxy_hostname : hostname,
+			     h->proxy_use ? h->proxy_port : port, addrs, lens);
+	if(count <= 0)
 		return -1;
 
-	/* Set shoutcast server address */
-	memset(&server_addr, 0, sizeof(server_addr));
-	server_addr.sin_family = AF_INET;
-	server_addr.sin_port = htons(h->proxy_use ? h->proxy_port : port);
-	memcpy(&server_addr.sin_addr.s_addr, server_ip->h_addr,
-	       server_ip->h_length);
-
-	/* Connect to HTTP server */
-	if(connect(h->sock, (struct sockaddr *)&server_addr,
-		   sizeof(server_addr)) < 0)
+	/* Connect to the first address answering */
+	h->sock = http_connect_race(addrs, lens, count);
+	if(h->sock < 0)
 		return -1;
 
 #ifdef HAVE_OPENSSL
 	/* Create connection if HTTPS */
 	if(h->is_ssl)
 	{
-		/* Init library */
-		SSL_library_init();
-
-		/* Create openssl context */
-		h->ssl_ctx = SSL_CTX_new(SSLv23_client_method());
-		if(h->ssl_ctx == NULL)
-			return -1;
-
-		/* Create a new SSL object */
-		h->ssl = SSL_new(h->ssl_ctx);
+		/* Create a new SSL object (with last session of server) */
+		h->ssl = http_ssl_new(hostname);
 		if(h->ssl == NULL)
 			return -1;
 
@@ -351,6 +1024,12 @@ static int http_connect(struct http_handle *h, char *hostname,
 		/* Initiate the TLS/SSL handshake with server */
 		if(SSL_connect(h->ssl) != 1)
 			return -1;
+
+		/* Count abbreviated and full handshakes */
+		if(SSL_session_reused(h->ssl))
+			__atomic_add_fetch(&ssl_resumed, 1, __ATOMIC_RELAXED);
+		else
+			__atomic_add_fetch(&ssl_full, 1, __ATOMIC_RELAXED);
 	}
 #endif
 
@@ -370,44 +1049,68 @@ static void http_free_header(struct http_handle *h)
 		temp = h->headers;
 		h->headers = h->headers->next;
 
-		FREE_STR(temp->name);
-		FREE_STR(temp->value);
-
-		free(temp);
+		/* Name and value are in same block */
+		pool_free(temp);
 	}
 }
 
-static int http_read_line(struct http_handle *h, char *buffer, int length)
+static ssize_t http_recv(struct http_handle *h, void *buffer, size_t size)
 {
-	int ret;
-	int i;
-
-	for(i = 0; i < length-1; i++)
-	{
 #ifdef HAVE_OPENSSL
-		if(h->is_ssl)
-			ret = SSL_read(h->ssl, &buffer[i], 1);
-		else
+	if(h->is_ssl)
+		return SSL_read(h->ssl, buffer, size);
 #endif
-			ret = read(h->sock, &buffer[i], 1);
+	return read(h->sock, buffer, size);
+}
 
-		if(ret != 1)
-			return i;
+static int http_read_line(struct http_handle *h, char *buffer, int length)
+{
+	unsigned char *p, *end;
+	size_t len;
+	ssize_t ret;
+	int i = 0;
 
-		if(buffer[i] == '\n')
+	while(i < length-1)
+	{
+		/* Fill receive buffer with all bytes available */
+		if(h->recv_pos == h->recv_len)
+		{
+			ret = http_recv(h, h->recv_buffer, BUFFER_SIZE);
+			if(ret <= 0)
+				break;
+			h->recv_pos = 0;
+			h->recv_len = ret;
+		}
+
+		/* Copy bytes until end of line */
+		p = h->recv_buffer + h->recv_pos;
+		len = h->recv_len - h->recv_pos;
+		if(len > (size_t) (length - 1 - i))
+			len = length - 1 - i;
+		end = memchr(p, '\n', len);
+		if(end != NULL)
+			len = end - p + 1;
+		memcpy(&buffer[i], p, len);
+		h->recv_pos += len;
+		i += len;
+
+		/* End of line */
+		if(end != NULL)
 			break;
 	}
 
-	buffer[i+1] = 0;
-	return i+1;
+	buffer[i] = 0;
+	return i;
 }
 
 static int http_parse_header(struct http_handle *h)
 {
 	struct http_header *header;
-	char buffer[MAX_SIZE_LINE];
+	char buffer[MAX_SIZE_HEADER];
 	int status_code = 0;
+	int keep_alive;
 	char *temp, *end;
+	size_t len;
 	int size = 0;
 
 	/* Free previous header */
@@ -427,6 +1130,9 @@ static int http_parse_header(struct http_handle *h)
 	if(sscanf(buffer, "%*s %d %*s", &status_code) != 1)
 		return -1;
 
+	/* Connection is kept alive by default since HTTP/1.1 */
+	keep_alive = strncmp(buffer, "HTTP/1.1", 8) == 0;
+
 	while(http_read_line(h, buffer, MAX_SIZE_HEADER) != 0)
 	{
 		/* End of header */
@@ -447,14 +1153,39 @@ static int http_parse_header(struct http_handle *h)
 		while(*end != 0 && *end != '\r')
 			end++;
 
-		/* Add name and value to list */
-		header = malloc(sizeof(struct http_header));
-		header->name = strdup(buffer);
-		header->value = strndup(temp, end-temp);
+		/* Add name and value to list (in a single block) */
+		len = strlen(buffer) + 1;
+		header = pool_alloc(sizeof(struct http_header) + len +
+				    (end - temp) + 1);
+		if(header == NULL)
+			continue;
+		header->name = (char *) (header + 1);
+		header->value = header->name + len;
+		memcpy(header->name, buffer, len);
+		memcpy(header->value, temp, end - temp);
+		header->value[end - temp] = '\0';
 		header->next = h->headers;
 		h->headers = header;
 	}
 
+	/* Get respond length (ignored when respond is chunked) */
+	temp = http_get_header(h, "Transfer-Encoding", 0);
+	if(temp != NULL && (size = strlen(temp)) >= 7 &&
+	   strcasecmp(temp + size - 7, "chunked") == 0)
+	{
+		h->chunked = 1;
+		h->chunk_len = 0;
+	}
+	temp = http_get_header(h, "Content-Length", 0);
+	if(temp != NULL && !h->chunked)
+		h->content_len = strtoll(temp, NULL, 10);
+
+	/* Check if server keeps connection alive */
+	temp = http_get_header(h, "Connection", 0);
+	if(temp != NULL)
+		keep_alive = strcasecmp(temp, "keep-alive") == 0;
+	h->server_keep_alive = keep_alive;
+
 	return status_code;
 }
 
@@ -481,20 +1212,30 @@ int http_request(struct http_handle *h, const char *url, const char *method,
 	if(ret < 0 || port == 0)
 		goto end;
 
-	/* Check Protocol */
-	if(protocol == URL_HTTPS)
+	/* Check Protocol: connection can't be reused with another one */
+	if(h->is_ssl != (protocol == URL_HTTPS))
 	{
-		h->is_ssl = 1;
+		http_pool_put(h);
+		http_close_socket(h);
+		h->is_ssl = protocol == URL_HTTPS;
+	}
 #ifndef HAVE_OPENSSL
+	if(h->is_ssl)
+	{
 		fprintf(stderr, "SSL is not supported!\n");
 		goto end;
-#endif
 	}
+#endif
 
 	/* Connect to HTTP server */
 	if(http_connect(h, hostname, port) != 0)
 		goto end;
 
+	/* Connection is busy until respond is read */
+	h->content_len = -1;
+	h->server_keep_alive = 0;
+	h->chunked = 0;
+
 	/* Generate Auth string */
 	if(username != NULL || password != NULL)
 	{
@@ -550,6 +1291,14 @@ int http_request(struct http_handle *h, const char *url, const char *method,
 	/* Parse HTTP header response */
 	code = http_parse_header(h);
 
+	/* No content follows these responds */
+	if(code >= 0 && (strcmp(method, "HEAD") == 0 || code == 204 ||
+	   code == 304))
+	{
+		h->content_len = 0;
+		h->chunked = 0;
+	}
+
 	/* Follow redirection */
 	if(h->follow && (code == 301 || code == 302) &&
 	   h->i_follow < h->max_follow)
@@ -643,16 +1392,25 @@ char *http_get_header(struct http_handle *h, const char *name,
 	return NULL;
 }
 
-ssize_t http_read_timeout(struct http_handle *h, unsigned char *buffer,
-			  size_t size, long timeout)
+static ssize_t http_read_body(struct http_handle *h, unsigned char *buffer,
+			      size_t size, long timeout)
 {
 	struct timeval tv;
 	fd_set readfs;
 	ssize_t len = 0;
 	ssize_t ret;
 
-	if(h == NULL || h->sock < 0)
-		return -1;
+	/* Get body bytes received with headers */
+	if(h->recv_pos < h->recv_len)
+	{
+		len = h->recv_len - h->recv_pos;
+		if((size_t) len > size)
+			len = size;
+		memcpy(buffer, h->recv_buffer + h->recv_pos, len);
+		h->recv_pos += len;
+		buffer += len;
+		size -= len;
+	}
 
 	/* Get all buffer */
 	while(size > 0)
@@ -681,12 +1439,7 @@ ssize_t http_read_timeout(struct http_handle *h, unsigned char *buffer,
 		/* Read data from TCP socket */
 		if(timeout == -1 || FD_ISSET(h->sock, &readfs))
 		{
-	#ifdef HAVE_OPENSSL
-			if(h->is_ssl)
-				ret = SSL_read(h->ssl, buffer, size);
-			else
-	#endif
-				ret = read(h->sock, buffer, size);
+			ret = http_recv(h, buffer, size);
 
 			/* End of stream */
 			if(ret <= 0)
@@ -705,13 +1458,141 @@ ssize_t http_read_timeout(struct http_handle *h, unsigned char *buffer,
 	return len;
 }
 
-static void *http_thread(void *user_data)
+static int http_wait_data(struct http_handle *h, long timeout)
+{
+	struct timeval tv;
+	fd_set readfs;
+
+	/* Bytes are already received or no timeout is used */
+	if(timeout < 0 || h->recv_pos < h->recv_len)
+		return 1;
+
+	/* Wait for data on socket */
+	FD_ZERO(&readfs);
+	FD_SET(h->sock, &readfs);
+	tv.tv_sec = timeout / 1000;
+	tv.tv_usec = (timeout % 1000) * 1000;
+	return select(h->sock + 1, &readfs, NULL, NULL, &tv);
+}
+
+static int http_read_chunk_header(struct http_handle *h, long timeout)
+{
+	char buffer[MAX_SIZE_LINE];
+	char *end;
+	int ret;
+
+	/* Get chunk size line (skip end of previous chunk data) */
+	do {
+		ret = http_wait_data(h, timeout);
+		if(ret <= 0)
+			return ret;
+		if(http_read_line(h, buffer, MAX_SIZE_LINE) == 0)
+			return -1;
+	} while(buffer[0] == '\r' || buffer[0] == '\n');
+
+	/* Parse chunk size (extensions are ignored) */
+	h->chunk_len = strtoll(buffer, &end, 16);
+	if(end == buffer || h->chunk_len < 0)
+		return -1;
+
+	/* Last chunk: skip trailer and end respond */
+	if(h->chunk_len == 0)
+	{
+		do {
+			if(http_read_line(h, buffer, MAX_SIZE_LINE) == 0)
+				return -1;
+		} while(buffer[0] != '\r' && buffer[0] != '\n');
+		h->content_len = 0;
+	}
+
+	return 1;
+}
+
+static ssize_t http_read_chunked(struct http_handle *h, unsigned char *buffer,
+				 size_t size, long timeout)
+{
+	ssize_t len = 0;
+	ssize_t ret;
+	size_t count;
+
+	/* Data is read in place: only chunk bounds are tracked */
+	while(size > 0)
+	{
+		/* Get next chunk size */
+		if(h->chunk_len == 0)
+		{
+			ret = http_read_chunk_header(h, timeout);
+			if(ret < 0)
+			{
+				/* Bad chunk: connection can't be reused */
+				h->server_keep_alive = 0;
+				h->content_len = 0;
+				break;
+			}
+
+			/* Timeout or end of respond */
+			if(ret == 0 || h->content_len == 0)
+				break;
+		}
+
+		/* Read chunk data */
+		count = size;
+		if((long long) count > h->chunk_len)
+			count = h->chunk_len;
+		ret = http_read_body(h, buffer, count, timeout);
+		if(ret < 0)
+		{
+			h->server_keep_alive = 0;
+			h->content_len = 0;
+			break;
+		}
+		h->chunk_len -= ret;
+		len += ret;
+		buffer += ret;
+		size -= ret;
+
+		/* Timeout */
+		if((size_t) ret < count)
+			break;
+	}
+
+	/* End of respond */
+	if(len == 0 && h->content_len == 0)
+		return -1;
+
+	return len;
+}
+
+ssize_t http_read_timeout(struct http_handle *h, unsigned char *buffer,
+			  size_t size, long timeout)
 {
-	struct http_handle *h = user_data;
-	unsigned char buffer[BUFFER_SIZE];
-	size_t size = BUFFER_SIZE;
 	ssize_t len;
 
+	if(h == NULL || h->sock < 0)
+		return -1;
+
+	/* End of respond: connection is kept alive */
+	if(h->content_len == 0)
+		return -1;
+
+	/* Decode chunked respond */
+	if(h->chunked)
+		return http_read_chunked(h, buffer, size, timeout);
+
+	/* Read data until end of respond */
+	if(h->content_len > 0 && (long long) size > h->content_len)
+		size = h->content_len;
+	len = http_read_body(h, buffer, size, timeout);
+
+	/* Update respond length */
+	if(len > 0 && h->content_len > 0)
+		h->content_len -= len;
+
+	return len;
+}
+
+static int http_thread_request(struct http_handle *h)
+{
 	/* Do request */
 	h->code = http_request(h, h->url, h->method, h->buffer, h->length);
 
@@ -726,12 +1607,46 @@ static void *http_thread(void *user_data)
 
 	/* Bad request */
 	if(h->code < 0)
-		goto end;
+		return -1;
 
 	/* Call header callback */
 	if(h->head_cb)
 		h->head_cb(h->user_data, h->code, h);
 
+	return 0;
+}
+
+static void http_thread_end(struct http_handle *h)
+{
+	/* End of request: call complete callback */
+	if(h->comp_cb)
+		h->comp_cb(h->user_data, h->code);
+
+	/* Lock connection */
+	pthread_mutex_lock(&h->mutex);
+
+	/* Thread is stopped */
+	h->stop = 0;
+	h->running = 0;
+
+	/* Unlock connection */
+	pthread_mutex_unlock(&h->mutex);
+}
+
+static void *http_thread(void *user_data)
+{
+	struct http_handle *h = user_data;
+	unsigned char buffer[BUFFER_SIZE];
+	size_t size = BUFFER_SIZE;
+	ssize_t len;
+
+	/* Set thread scheduling and name */
+	thread_setup(THREAD_DEFAULT, "http");
+
+	/* Do request */
+	if(http_thread_request(h) != 0)
+		goto end;
+
 	/* Read until end of stream */
 	while(!h->stop)
 	{
@@ -747,21 +1662,58 @@ static void *http_thread(void *user_data)
 	}
 
 end:
-	/* End of request: call complete callback */
-	if(h->comp_cb)
-		h->comp_cb(h->user_data, h->code);
+	/* End of request */
+	http_thread_end(h);
 
-	/* Lock connection */
-	pthread_mutex_lock(&h->mutex);
+	return NULL;
+}
 
-	/* Thread is stopped */
-	h->stop = 0;
-	h->running = 0;
+static int http_task(void *user_data, struct task *t)
+{
+	struct http_handle *h = user_data;
+	unsigned char buffer[BUFFER_SIZE];
+	ssize_t len;
 
-	/* Unlock connection */
-	pthread_mutex_unlock(&h->mutex);
+	/* Do request on first run (connection and header are blocking) */
+	if(!h->task_started)
+	{
+		h->task_started = 1;
+		if(http_thread_request(h) != 0)
+			goto end;
+	}
 
-	return NULL;
+	/* Stop signal */
+	if(h->stop)
+		goto end;
+
+	/* Read data available on connection */
+	len = http_read_timeout(h, buffer, BUFFER_SIZE, 0);
+	if(len < 0)
+		goto end;
+
+	/* Send data to callback */
+	if(len > 0)
+	{
+		if(h->read_cb &&
+		   h->read_cb(h->user_data, h->code, buffer, len) < 0)
+			goto end;
+		return TASK_AGAIN;
+	}
+
+	/* Wait next data (with a timeout to check stop signal) */
+	if(h->sock >= 0)
+		task_wait_fd(t, h->sock, 0);
+	task_timeout(t, 1000);
+	return TASK_WAIT;
+
+end:
+	/* Release socket before it can be closed or reused by a new request */
+	task_release_fd(t);
+
+	/* End of request */
+	http_thread_end(h);
+
+	return TASK_DONE;
 }
 
 int http_request_thread(struct http_handle *h, const char *url,
@@ -813,8 +1765,22 @@ int http_request_thread(struct http_handle *h, const char *url,
 	h->comp_cb = comp_cb;
 	h->user_data = user_data;
 
-	/* Create thread */
-	if(pthread_create(&h->thread, NULL, http_thread, h) != 0)
+	/* Previous task has ended */
+	if(h->task != NULL)
+	{
+		task_join(h->task);
+		h->task = NULL;
+	}
+
+	/* Create task in task mode or thread */
+	if(executor_is_enabled())
+	{
+		h->task_started = 0;
+		h->task = task_new(http_task, h, "http");
+		if(h->task == NULL)
+			goto end;
+	}
+	else if(pthread_create(&h->thread, NULL, http_thread, h) != 0)
 		goto end;
 
 	/* Thread is now running */
@@ -868,6 +1834,14 @@ int http_download_to_file(struct http_handle *h, const char *url,
 	return 0;
 }
 
+int http_get_socket(struct http_handle *h)
+{
+	if(h == NULL)
+		return -1;
+
+	return h->sock;
+}
+
 int http_get_code(struct http_handle *h)
 {
 	int code;
@@ -908,22 +1882,30 @@ int http_status(struct http_handle *h)
 
 void http_close_connection(struct http_handle *h)
 {
-	/* Close socket */
-	if(h->sock >= 0)
+	int running;
+
+	/* Keep connection in pool if respond has been read */
+	pthread_mutex_lock(&h->mutex);
+	running = h->running;
+	if(running && h->task != NULL)
+		h->stop = 1;
+	pthread_mutex_unlock(&h->mutex);
+
+	/* Wait end of task before socket is closed, since it is registered in
+	 * event loop until then */
+	if(h->task != NULL)
 	{
-#ifdef HAVE_OPENSSL
-		if(h->is_ssl)
-		{
-			if(h->ssl != NULL)
-				SSL_free(h->ssl);
-			if(h->ssl_ctx != NULL)
-				SSL_CTX_free(h->ssl_ctx);
-		}
-#endif
-		close(h->sock);
-		h->sock = -1;
+		task_wake(h->task);
+		task_join(h->task);
+		h->task = NULL;
 	}
 
+	if(!running)
+		http_pool_put(h);
+
+	/* Close socket */
+	http_close_socket(h);
+
 	/* Lock connection */
 	pthread_mutex_lock(&h->mutex);
 
@@ -19,6 +19,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
 #include <dirent.h>
 #include <sys/stat.h>
 #include <pthread.h>
@@ -34,12 +37,25 @@
 #endif
 
 #include "httpd.h"
+#include "httpd_cache.h"
+#include "metrics.h"
+#include "lock.h"
 
 #define OPAQUE "11733b200778ce33060f31c9af70a870ba96ddd4"
 
 /* Session ID length */
 #define HTTPD_ID_SIZE 32
 
+/* Time to process requests */
+static struct metric httpd_metric_time = METRIC_INIT(METRIC_HISTOGRAM,
+	"aircat_http_request_seconds", "Duration of an HTTP request");
+
+/* Lock classes of URL list, URL groups, sessions and streams */
+LOCK_CLASS(httpd_class, "httpd");
+LOCK_CLASS(httpd_url_class, "httpd_url");
+LOCK_CLASS(httpd_session_class, "httpd_session");
+LOCK_CLASS(httpd_stream_class, "httpd_stream");
+
 /* Maximum time to wait end of connections for URL group remove:
  *   HTTPD_REMOVE_RETRY = number of retry,
  *   HTTPD_REMOVE_WAIT  = time to wait between to retry (in ms).
@@ -57,6 +73,10 @@
  *                           HTTPD_SESSION_MAX), oldest session is removed
  *                           except if its age is under HTTPD_SESSION_ABORT.
  *    HTTPD_SESSION_MAX    = maximum session number handled by server.
+ *    HTTPD_SESSION_SWEEP  = interval between two removals of expired sessions
+ *                           (in s).
+ *    HTTPD_SESSION_BUCKETS = number of buckets in session table (must be a
+ *                            power of 2): each bucket has its own lock.
  * Default expiration time is 1h.
  * Default minimum time life is 10min.
  */
@@ -64,11 +84,50 @@
 #define HTTPD_SESSION_EXPIRE 3600
 #define HTTPD_SESSION_ABORT 600
 #define HTTPD_SESSION_MAX 200
+#define HTTPD_SESSION_SWEEP 60
+#define HTTPD_SESSION_BUCKETS 64
+
+/* Web root cache parameters:
+ *    HTTPD_CACHE_SIZE     = default memory size of web root cache (in KiB),
+ *    HTTPD_CACHE_MAX_AGE  = cache lifetime of fingerprinted files (in s).
+ * Default size is 4MiB.
+ * Default lifetime is 1 year.
+ */
+#define HTTPD_CACHE_SIZE 4096
+#define HTTPD_CACHE_MAX_AGE 31536000
 
 /* Authentication method available */
 #define HTTPD_AUTH_HTTP 0
 #define HTTPD_AUTH_SESSION 1
 
+/* Polling method available */
+#define HTTPD_POLL_SELECT 0
+#define HTTPD_POLL_POLL 1
+#define HTTPD_POLL_EPOLL 2
+
+/* Epoll is available since libmicrohttpd 0.9.21 and renamed since 0.9.51 */
+#if MHD_VERSION >= 0x00095100
+#define HTTPD_USE_EPOLL MHD_USE_EPOLL
+#elif MHD_VERSION >= 0x00092100
+#define HTTPD_USE_EPOLL MHD_USE_EPOLL_LINUX_ONLY
+#endif
+#ifdef HTTPD_USE_EPOLL
+#define HTTPD_POLL_DEFAULT HTTPD_POLL_EPOLL
+#else
+#define HTTPD_POLL_DEFAULT HTTPD_POLL_POLL
+#endif
+
+/* Connection suspend/resume is available since libmicrohttpd 0.9.34 */
+#if MHD_VERSION >= 0x00093400
+#define HTTPD_USE_SUSPEND MHD_USE_SUSPEND_RESUME
+#endif
+
+/* Server threading parameters:
+ *    HTTPD_THREADS = default size of thread pool handling connections.
+ * Default size is 10 threads.
+ */
+#define HTTPD_THREADS 10
+
 /* Default page */
 #define HTTPD_DEFAULT_401 \
 "<!DOCTYPE html>\n" \
@@ -122,6 +181,9 @@ struct mime_type {
 } mime_type[] = {
 	{"html", "text/html"},
 	{"htm",  "text/html"},
+	{"css",  "text/css"},
+	{"js",   "application/javascript"},
+	{"json", "application/json"},
 	{"gif",  "image/gif"},
 	{"jpg",  "image/jpeg"},
 	{"jpeg", "image/jpeg"},
@@ -146,14 +208,19 @@ struct httpd_session {
 	/* Session values */
 	struct httpd_value *values;
 	pthread_mutex_t values_mutex;
-	/* Last time of activity on this session */
+	/* Last time of activity on this session (atomic) */
 	time_t time;
-	/* Counter for active connection on this session */
+	/* Counter for active connection on this session (atomic) */
 	int count;
-	/* Next session in list */
+	/* Next session in bucket */
 	struct httpd_session *next;
 };
 
+struct httpd_session_bucket {
+	struct httpd_session *sessions;
+	pthread_rwlock_t lock;
+};
+
 struct httpd_req_data {
 	/* Handle of HTTP Server */
 	struct httpd_handle *handle;
@@ -166,6 +233,23 @@ struct httpd_req_data {
 	/* POST uploaded data */
 	struct MHD_PostProcessor *post_proc;
 	struct httpd_value *post;
+	/* Start time of request (in us) */
+	uint64_t start;
+};
+
+struct httpd_stream {
+	/* Handle of HTTP Server */
+	struct httpd_handle *handle;
+	struct MHD_Connection *connection;
+	/* Response callbacks */
+	httpd_res_cb cb;
+	httpd_res_free_cb free_cb;
+	void *user_data;
+	/* Connection is suspended / resume has been requested */
+	int suspended;
+	int pending;
+	/* Next stream in list */
+	struct httpd_stream *next;
 };
 
 struct httpd_urls {
@@ -174,6 +258,10 @@ struct httpd_urls {
 	/* URL group */
 	void *user_data;
 	struct url_table *urls;
+	/* Lazy opening of user data */
+	httpd_open_cb open;
+	void *open_data;
+	pthread_mutex_t open_mutex;
 	/* Mutex and counter for active connections */
 	int abort;
 	int count;
@@ -182,6 +270,31 @@ struct httpd_urls {
 	struct httpd_urls *next;
 };
 
+struct httpd_route {
+	/* URL group and entry (NULL if no route) */
+	struct httpd_urls *urls;
+	struct url_table *url;
+	/* Priority of route: lowest is first in search order */
+	unsigned long priority;
+};
+
+struct httpd_route_node {
+	/* Character of URL */
+	char c;
+	/* Routes ending on this node:
+	 *  - strict: URL must end here,
+	 *  - extended: URL must start with this node,
+	 *  - root: URL must start with this node followed by '/' or end here
+	 *    (an empty extended URL in a named group).
+	 */
+	struct httpd_route strict;
+	struct httpd_route extended;
+	struct httpd_route root;
+	/* Children and next sibling */
+	struct httpd_route_node *child;
+	struct httpd_route_node *next;
+};
+
 struct httpd_handle {
 	/* MicroHTTPD handle */
 	struct MHD_Daemon *httpd;
@@ -192,13 +305,26 @@ struct httpd_handle {
 	char *password;
 	int auth_method;
 	unsigned int port;
-	/* URLs list */
+	/* Threading and connection limits */
+	int poll_method;
+	unsigned int threads;
+	unsigned int max_connections;
+	unsigned int max_ip_connections;
+	/* Web root cache */
+	struct httpd_cache *cache;
+	unsigned long cache_size;
+	/* URLs list and its router */
 	struct httpd_urls *urls;
+	struct httpd_route_node *router;
 	pthread_mutex_t mutex;
-	/* Session list */
-	struct httpd_session *sessions;
-	pthread_mutex_t session_mutex;
+	/* Session table */
+	struct httpd_session_bucket sessions[HTTPD_SESSION_BUCKETS];
 	unsigned long session_count;
+	time_t session_sweep;
+	/* Streamed responses */
+	struct httpd_stream *streams;
+	pthread_mutex_t stream_mutex;
+	int stopping;
 };
 
 static int httpd_request(void * user_data, struct MHD_Connection *c,
@@ -212,6 +338,7 @@ static void httpd_free_session(struct httpd_session *s);
 int httpd_open(struct httpd_handle **handle, struct json *config)
 {
 	struct httpd_handle *h;
+	int i;
 
 	/* Allocate structure */
 	*handle = malloc(sizeof(struct httpd_handle));
@@ -227,13 +354,29 @@ int httpd_open(struct httpd_handle **handle, struct json *config)
 	h->password = NULL;
 	h->port = 0;
 	h->urls = NULL;
-	h->sessions = NULL;
+	h->router = NULL;
 	h->session_count = 0;
+	h->session_sweep = 0;
 	h->auth_method = 0;
+	h->poll_method = HTTPD_POLL_DEFAULT;
+	h->threads = HTTPD_THREADS;
+	h->max_connections = 0;
+	h->max_ip_connections = 0;
+	h->cache = NULL;
+	h->cache_size = HTTPD_CACHE_SIZE;
+	h->streams = NULL;
+	h->stopping = 0;
 
 	/* Init mutex */
 	pthread_mutex_init(&h->mutex, NULL);
-	pthread_mutex_init(&h->session_mutex, NULL);
+	pthread_mutex_init(&h->stream_mutex, NULL);
+
+	/* Init session table */
+	for(i = 0; i < HTTPD_SESSION_BUCKETS; i++)
+	{
+		h->sessions[i].sessions = NULL;
+		pthread_rwlock_init(&h->sessions[i].lock, NULL);
+	}
 
 	/* Set configuration */
 	httpd_set_config(h, config);
@@ -243,6 +386,10 @@ int httpd_open(struct httpd_handle **handle, struct json *config)
 
 int httpd_start(struct httpd_handle *h)
 {
+	struct MHD_OptionItem options[4];
+	unsigned int flags = MHD_USE_SELECT_INTERNALLY;
+	int count = 0;
+
 	if(h == NULL)
 		return -1;
 
@@ -250,21 +397,59 @@ int httpd_start(struct httpd_handle *h)
 	if(h->httpd != NULL)
 		return 0;
 
+	/* Load web root in cache */
+	if(h->cache_size > 0)
+		h->cache = httpd_cache_open(h->path, h->cache_size * 1024);
+
+	/* Select polling method */
+	if(h->poll_method == HTTPD_POLL_POLL)
+		flags |= MHD_USE_POLL;
+#ifdef HTTPD_USE_EPOLL
+	else if(h->poll_method == HTTPD_POLL_EPOLL)
+		flags |= HTTPD_USE_EPOLL;
+#endif
+
+#ifdef HTTPD_USE_SUSPEND
+	/* Allow streamed responses to wait for data */
+	flags |= HTTPD_USE_SUSPEND;
+#endif
+
+	/* Set thread pool size and connection limits */
+	if(h->threads > 1)
+		options[count++] = (struct MHD_OptionItem) {
+				      MHD_OPTION_THREAD_POOL_SIZE, h->threads,
+				      NULL };
+	if(h->max_connections > 0)
+		options[count++] = (struct MHD_OptionItem) {
+				      MHD_OPTION_CONNECTION_LIMIT,
+				      h->max_connections, NULL };
+	if(h->max_ip_connections > 0)
+		options[count++] = (struct MHD_OptionItem) {
+				      MHD_OPTION_PER_IP_CONNECTION_LIMIT,
+				      h->max_ip_connections, NULL };
+	options[count] = (struct MHD_OptionItem) { MHD_OPTION_END, 0, NULL };
+
 	/* Start HTTP server */
-	h->httpd = MHD_start_daemon(MHD_USE_SELECT_INTERNALLY, h->port, 
+	h->httpd = MHD_start_daemon(flags, h->port,
 			    NULL, NULL,
 			    &httpd_request, h,
 			    MHD_OPTION_NOTIFY_COMPLETED, &httpd_completed, h,
-			    MHD_OPTION_THREAD_POOL_SIZE, 10,
+			    MHD_OPTION_ARRAY, options,
 			    MHD_OPTION_END);
 	if(h->httpd == NULL)
+	{
+		httpd_cache_close(h->cache);
+		h->cache = NULL;
 		return -1;
+	}
 
 	return 0;
 }
 
 int httpd_stop(struct httpd_handle *h)
 {
+	struct httpd_stream *s;
+
 	if(h == NULL)
 		return -1;
 
@@ -272,9 +457,27 @@ int httpd_stop(struct httpd_handle *h)
 	if(h->httpd == NULL)
 		return 0;
 
+	/* Resume all streams: a suspended connection can't be closed */
+	lock_mutex(httpd_stream_class, &h->stream_mutex);
+	h->stopping = 1;
+	for(s = h->streams; s != NULL; s = s->next)
+	{
+		if(s->suspended)
+		{
+			s->suspended = 0;
+			MHD_resume_connection(s->connection);
+		}
+	}
+	unlock_mutex(httpd_stream_class, &h->stream_mutex);
+
 	/* Stop HTTP server */
 	MHD_stop_daemon(h->httpd);
 	h->httpd = NULL;
+	h->stopping = 0;
+
+	/* Free web root cache (not used anymore by responses) */
+	httpd_cache_close(h->cache);
+	h->cache = NULL;
 
 	return 0;
 }
@@ -314,6 +517,11 @@ int httpd_set_config(struct httpd_handle *h, struct json *cfg)
 	h->password = NULL;
 	h->auth_method = -1;
 	h->port = 0;
+	h->poll_method = HTTPD_POLL_DEFAULT;
+	h->threads = HTTPD_THREADS;
+	h->max_connections = 0;
+	h->max_ip_connections = 0;
+	h->cache_size = HTTPD_CACHE_SIZE;
 
 	/* Get configuration */
 	if(cfg != NULL)
@@ -337,6 +545,29 @@ int httpd_set_config(struct httpd_handle *h, struct json *cfg)
 				h->auth_method = HTTPD_AUTH_SESSION;
 		}
 		h->port = json_get_int(cfg, "port");
+		str = json_get_string(cfg, "poll");
+		if(str != NULL)
+		{
+			if(strcmp(str, "select") == 0)
+				h->poll_method = HTTPD_POLL_SELECT;
+			else if(strcmp(str, "poll") == 0)
+				h->poll_method = HTTPD_POLL_POLL;
+#ifdef HTTPD_USE_EPOLL
+			else if(strcmp(str, "epoll") == 0)
+				h->poll_method = HTTPD_POLL_EPOLL;
+#endif
+		}
+		if(json_get_int(cfg, "threads") > 0)
+			h->threads = json_get_int(cfg, "threads");
+		if(json_get_int(cfg, "max_connections") > 0)
+			h->max_connections = json_get_int(cfg,
+							  "max_connections");
+		if(json_get_int(cfg, "max_ip_connections") > 0)
+			h->max_ip_connections = json_get_int(cfg,
+							 "max_ip_connections");
+		if(json_has_key(cfg, "cache_size") &&
+		   json_get_int(cfg, "cache_size") >= 0)
+			h->cache_size = json_get_int(cfg, "cache_size");
 	}
 
 	/* Set default values */
@@ -366,12 +597,176 @@ struct json *httpd_get_config(struct httpd_handle *h)
 	json_set_string(j, "web_path", h->path);
 	json_set_string(j, "password", h->password);
 	json_set_int(j, "port", h->port);
+	json_set_string(j, "poll", (h->poll_method == HTTPD_POLL_SELECT ?
+				    "select" :
+				    h->poll_method == HTTPD_POLL_POLL ? "poll" :
+				    "epoll"));
+	json_set_int(j, "threads", h->threads);
+	json_set_int(j, "max_connections", h->max_connections);
+	json_set_int(j, "max_ip_connections", h->max_ip_connections);
+	json_set_int(j, "cache_size", h->cache_size);
 
 	return j;
 }
 
-int httpd_add_urls(struct httpd_handle *h, const char *name,
-		   struct url_table *urls, void *user_data)
+static void httpd_free_router(struct httpd_route_node *n)
+{
+	struct httpd_route_node *next;
+
+	while(n != NULL)
+	{
+		/* Free children */
+		httpd_free_router(n->child);
+
+		/* Free node and go to next sibling */
+		next = n->next;
+		free(n);
+		n = next;
+	}
+}
+
+static int httpd_add_route(struct httpd_route_node *root, const char *prefix,
+			   const char *url, int type, struct httpd_urls *u,
+			   struct url_table *t, unsigned long priority)
+{
+	struct httpd_route_node *n = root, **np;
+	const char *str[2] = { prefix, url };
+	struct httpd_route *r;
+	const char *p;
+	int i;
+
+	/* Walk in tree with prefix then URL */
+	for(i = 0; i < 2; i++)
+	{
+		for(p = str[i]; *p != '\0'; p++)
+		{
+			/* Find child with character */
+			for(np = &n->child; *np != NULL && (*np)->c != *p;
+			    np = &(*np)->next);
+
+			/* Add a new child */
+			if(*np == NULL)
+			{
+				*np = calloc(1, sizeof(struct httpd_route_node));
+				if(*np == NULL)
+					return -1;
+				(*np)->c = *p;
+			}
+			n = *np;
+		}
+	}
+
+	/* Set route: first one added has the priority */
+	r = type == 0 ? &n->strict : type == 1 ? &n->extended : &n->root;
+	if(r->url == NULL)
+	{
+		r->urls = u;
+		r->url = t;
+		r->priority = priority;
+	}
+
+	return 0;
+}
+
+static void httpd_build_router(struct httpd_handle *h)
+{
+	struct httpd_route_node *root;
+	unsigned long priority = 0;
+	struct httpd_urls *u;
+	char *prefix;
+	int type;
+	int i;
+
+	/* Free previous router */
+	httpd_free_router(h->router);
+	h->router = NULL;
+
+	/* Allocate root node */
+	root = calloc(1, sizeof(struct httpd_route_node));
+	if(root == NULL)
+		return;
+
+	/* Add all URLs in search order */
+	for(u = h->urls; u != NULL; u = u->next)
+	{
+		/* Generate URL prefix of group */
+		prefix = malloc(strlen(u->name) + 2);
+		if(prefix == NULL)
+			goto error;
+		sprintf(prefix, "/%s", u->name);
+
+		for(i = 0; u->urls[i].url != NULL; i++, priority++)
+		{
+			/* A named group needs a '/' after its name */
+			if(*u->name != '\0' && *u->urls[i].url != '\0' &&
+			   *u->urls[i].url != '/')
+				continue;
+
+			/* Get route type */
+			type = !u->urls[i].extended ? 0 :
+			       *u->name != '\0' && *u->urls[i].url == '\0' ? 2 :
+			       1;
+
+			/* Add route */
+			if(httpd_add_route(root, prefix, u->urls[i].url, type, u,
+					   &u->urls[i], priority) != 0)
+			{
+				free(prefix);
+				goto error;
+			}
+		}
+		free(prefix);
+	}
+
+	h->router = root;
+	return;
+
+error:
+	/* URLs will be searched in list */
+	httpd_free_router(root);
+}
+
+static struct url_table *httpd_route_url(struct httpd_route_node *root,
+					 const char *url,
+					 struct httpd_urls **urls)
+{
+	struct httpd_route_node *n = root;
+	const struct httpd_route *best = NULL;
+	const char *p = url;
+
+	/* Walk in tree and keep route with highest priority */
+	while(n != NULL)
+	{
+		/* Check routes of node */
+		if(n->extended.url != NULL &&
+		   (best == NULL || n->extended.priority < best->priority))
+			best = &n->extended;
+		if(n->root.url != NULL && (*p == '\0' || *p == '/') &&
+		   (best == NULL || n->root.priority < best->priority))
+			best = &n->root;
+		if(*p == '\0')
+		{
+			if(n->strict.url != NULL &&
+			   (best == NULL || n->strict.priority < best->priority))
+				best = &n->strict;
+			break;
+		}
+
+		/* Go to next character */
+		for(n = n->child; n != NULL && n->c != *p; n = n->next);
+		p++;
+	}
+
+	if(best == NULL)
+		return NULL;
+
+	*urls = best->urls;
+	return best->url;
+}
+
+static int httpd_add_group(struct httpd_handle *h, const char *name,
+			   struct url_table *urls, void *user_data,
+			   httpd_open_cb open, void *open_data)
 {
 	struct httpd_urls *u;
 
@@ -387,9 +782,12 @@ int httpd_add_urls(struct httpd_handle *h, const char *name,
 	u->name = strdup(name);
 	u->urls = urls;
 	u->user_data = user_data;
+	u->open = open;
+	u->open_data = open_data;
 
 	/* Init mutex */
 	pthread_mutex_init(&u->mutex, NULL);
+	pthread_mutex_init(&u->open_mutex, NULL);
 	u->count = 0;
 	u->abort = 0;
 
@@ -397,18 +795,55 @@ int httpd_add_urls(struct httpd_handle *h, const char *name,
 	httpd_remove_urls(h, name);
 
 	/* Lock URLs list access */
-	pthread_mutex_lock(&h->mutex);
+	lock_mutex(httpd_class, &h->mutex);
 
 	/* Add new group */
 	u->next = h->urls;
 	h->urls = u;
 
+	/* Update router */
+	httpd_build_router(h);
+
 	/* Unlock URLs list access */
-	pthread_mutex_unlock(&h->mutex);
+	unlock_mutex(httpd_class, &h->mutex);
 
 	return 0;
 }
 
+int httpd_add_urls(struct httpd_handle *h, const char *name,
+		   struct url_table *urls, void *user_data)
+{
+	return httpd_add_group(h, name, urls, user_data, NULL, NULL);
+}
+
+int httpd_add_lazy_urls(struct httpd_handle *h, const char *name,
+			struct url_table *urls, httpd_open_cb open,
+			void *open_data)
+{
+	if(open == NULL)
+		return -1;
+
+	return httpd_add_group(h, name, urls, NULL, open, open_data);
+}
+
+static int httpd_open_urls(struct httpd_urls *u)
+{
+	void *user_data;
+
+	/* Lock opening: concurrent first requests wait for the same open */
+	pthread_mutex_lock(&u->open_mutex);
+
+	/* Open user data (again if last attempt failed) */
+	if(u->user_data == NULL)
+		u->user_data = u->open(u->open_data);
+	user_data = u->user_data;
+
+	/* Unlock opening */
+	pthread_mutex_unlock(&u->open_mutex);
+
+	return user_data != NULL ? 0 : -1;
+}
+
 static void httpd_free_urls(struct httpd_urls *u)
 {
 	if(u == NULL)
@@ -430,7 +865,7 @@ int httpd_remove_urls(struct httpd_handle *h, const char *name)
 		return 0;
 
 	/* Lock URLs list access */
-	pthread_mutex_lock(&h->mutex);
+	lock_mutex(httpd_class, &h->mutex);
 
 	/* Find URL group in list */
 	for(u = h->urls; u != NULL; u = u->next)
@@ -440,32 +875,32 @@ int httpd_remove_urls(struct httpd_handle *h, const char *name)
 	}
 
 	/* Unlock URLs list access */
-	pthread_mutex_unlock(&h->mutex);
+	unlock_mutex(httpd_class, &h->mutex);
 
 	/* Check URL group */
 	if(u == NULL)
 		return 0;
 
 	/* Lock this URL group access */
-	pthread_mutex_lock(&u->mutex);
+	lock_mutex(httpd_url_class, &u->mutex);
 
 	/* Abort all connections for this URL group */
 	u->abort = 1;
 
 	/* Unlock this URL group access */
-	pthread_mutex_unlock(&u->mutex);
+	unlock_mutex(httpd_url_class, &u->mutex);
 
 	/* Wait end of all connections */
 	for(i = 0; i < HTTPD_REMOVE_RETRY; i++)
 	{
 		/* Lock specific URL */
-		pthread_mutex_lock(&u->mutex);
+		lock_mutex(httpd_url_class, &u->mutex);
 
 		/* Get connection counter */
 		count = u->count;
 
 		/* Unlock specific URL */
-		pthread_mutex_unlock(&u->mutex);
+		unlock_mutex(httpd_url_class, &u->mutex);
 
 		/* No more connections */
 		if(count == 0)
@@ -480,7 +915,7 @@ int httpd_remove_urls(struct httpd_handle *h, const char *name)
 		return -1;
 
 	/* Lock URLs list access */
-	pthread_mutex_lock(&h->mutex);
+	lock_mutex(httpd_class, &h->mutex);
 
 	/* Remove URL group from list */
 	for(up = h->urls; up != NULL; up = up->next)
@@ -494,8 +929,11 @@ int httpd_remove_urls(struct httpd_handle *h, const char *name)
 		h->urls = u->next;
 	httpd_free_urls(u);
 
+	/* Update router */
+	httpd_build_router(h);
+
 	/* Unlock URLs list access */
-	pthread_mutex_unlock(&h->mutex);
+	unlock_mutex(httpd_class, &h->mutex);
 
 	return 0;
 }
@@ -504,6 +942,7 @@ int httpd_close(struct httpd_handle *h)
 {
 	struct httpd_session *s;
 	struct httpd_urls *u;
+	int i;
 
 	if(h == NULL)
 		return 0;
@@ -512,12 +951,16 @@ int httpd_close(struct httpd_handle *h)
 	if(h->httpd != NULL)
 		httpd_stop(h);
 
-	/* Free session list */
-	while(h->sessions != NULL)
+	/* Free session table */
+	for(i = 0; i < HTTPD_SESSION_BUCKETS; i++)
 	{
-		s = h->sessions;
-		h->sessions = s->next;
-		httpd_free_session(s);
+		while(h->sessions[i].sessions != NULL)
+		{
+			s = h->sessions[i].sessions;
+			h->sessions[i].sessions = s->next;
+			httpd_free_session(s);
+		}
+		pthread_rwlock_destroy(&h->sessions[i].lock);
 	}
 
 	/* Free URLs grouo */
@@ -527,6 +970,7 @@ int httpd_close(struct httpd_handle *h)
 		h->urls = u->next;
 		httpd_free_urls(u);
 	}
+	httpd_free_router(h->router);
 
 	/* Free configuration */
 	if(h->name != NULL)
@@ -592,74 +1036,114 @@ static void httpd_free_session(struct httpd_session *s)
 	free(s);
 }
 
+static struct httpd_session_bucket *httpd_get_bucket(struct httpd_handle *h,
+						    const char *id)
+{
+	uint64_t hash;
+
+	/* Hash session ID (FNV-1a) */
+	hash = utils_hash_fnv1a(UTILS_FNV1A_INIT, id, strlen(id));
+
+	return &h->sessions[hash & (HTTPD_SESSION_BUCKETS - 1)];
+}
+
 static void httpd_expire_session(struct httpd_handle *h, int force)
 {
-	struct httpd_session *s, **sp, **op = NULL;
-	time_t now, oldest;
+	struct httpd_session_bucket *b, *ob = NULL;
+	struct httpd_session *s, **sp, *o = NULL;
+	time_t now, oldest, last;
+	int count;
+	int i;
 
 	/* Get current time */
 	now = time(NULL);
 	oldest = now;
 
-	/* Lock session list access */
-	pthread_mutex_lock(&h->session_mutex);
+	/* Sweep sessions periodically or when no more session is available */
+	force = force && __atomic_load_n(&h->session_count, __ATOMIC_RELAXED) >=
+			 HTTPD_SESSION_MAX;
+	last = __atomic_load_n(&h->session_sweep, __ATOMIC_RELAXED);
+	if(!force && (now < last + HTTPD_SESSION_SWEEP ||
+		      !__atomic_compare_exchange_n(&h->session_sweep, &last,
+						   now, 0, __ATOMIC_RELAXED,
+						   __ATOMIC_RELAXED)))
+		return;
 
-	/* Find expired session */
-	sp = &h->sessions;
-	while((*sp) != NULL)
+	/* Find expired sessions in all buckets */
+	for(i = 0; i < HTTPD_SESSION_BUCKETS; i++)
 	{
-		s = *sp;
-		if(s->count == 0 && s->time + HTTPD_SESSION_EXPIRE < now)
-		{
-			/* Free session */
-			*sp = s->next;
-			httpd_free_session(s);
+		b = &h->sessions[i];
 
-			/* Update session count */
-			h->session_count--;
-		}
-		else if(s->count == 0 && s->time + HTTPD_SESSION_ABORT < oldest)
+		/* Lock bucket access */
+		pthread_rwlock_wrlock(&b->lock);
+
+		sp = &b->sessions;
+		while((*sp) != NULL)
 		{
-			/* Save ref and update min time */
-			op = sp;
-			oldest = s->time;
-		}
-		else
+			s = *sp;
+			count = __atomic_load_n(&s->count, __ATOMIC_ACQUIRE);
+			if(count == 0 && s->time + HTTPD_SESSION_EXPIRE < now)
+			{
+				/* Free session */
+				*sp = s->next;
+				httpd_free_session(s);
+
+				/* Update session count */
+				__atomic_sub_fetch(&h->session_count, 1,
+						   __ATOMIC_RELAXED);
+				continue;
+			}
+			else if(count == 0 &&
+				s->time + HTTPD_SESSION_ABORT < oldest)
+			{
+				/* Save ref and update min time */
+				ob = b;
+				o = s;
+				oldest = s->time;
+			}
 			sp = &s->next;
+		}
+
+		/* Unlock bucket access */
+		pthread_rwlock_unlock(&b->lock);
 	}
 
 	/* Free oldest session if found */
-	if(force && h->session_count >= HTTPD_SESSION_MAX && op != NULL)
+	if(!force || o == NULL ||
+	   __atomic_load_n(&h->session_count, __ATOMIC_RELAXED) <
+							      HTTPD_SESSION_MAX)
+		return;
+
+	/* Lock bucket access */
+	pthread_rwlock_wrlock(&ob->lock);
+
+	/* Find oldest session again: it may have been used since */
+	for(sp = &ob->sessions; *sp != NULL && *sp != o; sp = &(*sp)->next);
+	if(*sp != NULL && __atomic_load_n(&o->count, __ATOMIC_ACQUIRE) == 0)
 	{
 		/* Free session */
-		s = *op;
-		*op = s->next;
-		httpd_free_session(s);
+		*sp = o->next;
+		httpd_free_session(o);
 
 		/* Update session count */
-		h->session_count--;
+		__atomic_sub_fetch(&h->session_count, 1, __ATOMIC_RELAXED);
 	}
 
-	/* Unlock session list access */
-	pthread_mutex_unlock(&h->session_mutex);
+	/* Unlock bucket access */
+	pthread_rwlock_unlock(&ob->lock);
 }
 
 static void httpd_release_session(struct httpd_handle *h,
 				  struct httpd_session *s)
 {
-	/* Lock session list access */
-	pthread_mutex_lock(&h->session_mutex);
-
-	/* Decrement active connections */
-	s->count--;
-
-	/* Unlock session list access */
-	pthread_mutex_unlock(&h->session_mutex);
+	/* Decrement active connections: session can be freed after */
+	__atomic_sub_fetch(&s->count, 1, __ATOMIC_RELEASE);
 }
 
 static struct httpd_session *httpd_find_session(struct httpd_handle *h,
 						const char *id)
 {
+	struct httpd_session_bucket *b;
 	struct httpd_session *s;
 	time_t now;
 
@@ -670,49 +1154,44 @@ static struct httpd_session *httpd_find_session(struct httpd_handle *h,
 	/* Get current time */
 	now = time(NULL);
 
-	/* Lock session list access */
-	pthread_mutex_lock(&h->session_mutex);
+	/* Lock bucket access (shared by lookups) */
+	b = httpd_get_bucket(h, id);
+	pthread_rwlock_rdlock(&b->lock);
 
-	/* Find session ID in list */
-	for(s = h->sessions; s != NULL; s = s->next)
+	/* Find session ID in bucket */
+	for(s = b->sessions; s != NULL; s = s->next)
 	{
 		if(strcmp(s->id, id) == 0 &&
-		   s->time + HTTPD_SESSION_EXPIRE > now)
+		   __atomic_load_n(&s->time, __ATOMIC_RELAXED) +
+						      HTTPD_SESSION_EXPIRE > now)
 		{
 			/* Update time */
-			s->time = now;
-				/* Increment active connection */
-			s->count++;
+			__atomic_store_n(&s->time, now, __ATOMIC_RELAXED);
+
+			/* Increment active connection */
+			__atomic_add_fetch(&s->count, 1, __ATOMIC_ACQUIRE);
 
 			break;
 		}
 	}
 
-	/* Unlock session list access */
-	pthread_mutex_unlock(&h->session_mutex);
+	/* Unlock bucket access */
+	pthread_rwlock_unlock(&b->lock);
 
 	return s;
 }
 
 static struct httpd_session *httpd_new_session(struct httpd_handle *h)
 {
+	struct httpd_session_bucket *b;
 	struct httpd_session *s;
-	int count = 0;
 
 	/* Process expired sessions and force free if no more space */
 	httpd_expire_session(h, 1);
 
-	/* Lock session list access */
-	pthread_mutex_lock(&h->session_mutex);
-
-	/* Get session count */
-	count = h->session_count;
-
-	/* Unlock session list access */
-	pthread_mutex_unlock(&h->session_mutex);
-
 	/* Check session count */
-	if(count >= HTTPD_SESSION_MAX)
+	if(__atomic_load_n(&h->session_count, __ATOMIC_RELAXED) >=
+							      HTTPD_SESSION_MAX)
 		return NULL;
 
 	/* Create a new session */
@@ -734,18 +1213,19 @@ static struct httpd_session *httpd_new_session(struct httpd_handle *h)
 	s->values = NULL;
 	pthread_mutex_init(&s->values_mutex, NULL);
 
-	/* Lock session list access */
-	pthread_mutex_lock(&h->session_mutex);
+	/* Lock bucket access */
+	b = httpd_get_bucket(h, s->id);
+	pthread_rwlock_wrlock(&b->lock);
 
-	/* Add to list */
-	s->next = h->sessions;
-	h->sessions = s;
+	/* Add to bucket */
+	s->next = b->sessions;
+	b->sessions = s;
 
 	/* Update session count */
-	h->session_count++;
+	__atomic_add_fetch(&h->session_count, 1, __ATOMIC_RELAXED);
 
-	/* Unlock session list access */
-	pthread_mutex_unlock(&h->session_mutex);
+	/* Unlock bucket access */
+	pthread_rwlock_unlock(&b->lock);
 
 	return s;
 }
@@ -833,31 +1313,298 @@ static void httpd_dir_free_cb(void *user_data)
 	}
 }
 
-static ssize_t httpd_file_read_cb(void *user_data, uint64_t pos, char *buffer, 
-				  size_t size)
+static void httpd_set_mime_type(struct MHD_Response *response,
+				const char *path)
 {
-	FILE *fp = (FILE*) user_data;
+	const char *ext;
+	int i;
 
-	if(fp == NULL)
+	/* Get mime type */
+	ext = strrchr(path, '.');
+	if(ext != NULL && strlen(ext+1) <= 4)
+	{
+		for(i = 0; mime_type[i].ext != NULL; i++)
+		{
+		
+			if(strcmp(mime_type[i].ext, ext+1) == 0)
+			{
+				MHD_add_response_header(response,
+						   MHD_HTTP_HEADER_CONTENT_TYPE,
+						   mime_type[i].mime);
+				break;
+			}
+		}
+	}
+}
+
+static int httpd_parse_range(const char *range, uint64_t size,
+			     uint64_t *start, uint64_t *len)
+{
+	unsigned long long first, last;
+	char *end;
+
+	/* Only a single byte range is supported */
+	if(strncmp(range, "bytes=", 6) != 0 || strchr(range, ',') != NULL)
+		return 1;
+	range += 6;
+
+	/* Suffix range: last bytes of file */
+	if(*range == '-')
+	{
+		last = strtoull(range+1, &end, 10);
+		if(end == range+1 || *end != '\0')
+			return 1;
+		if(last == 0)
+			return -1;
+		if(last > size)
+			last = size;
+		*start = size - last;
+		*len = last;
 		return 0;
+	}
 
-	/* Seek in file */
-	fseek(fp, pos, SEEK_SET);
+	/* Get first byte */
+	first = strtoull(range, &end, 10);
+	if(end == range || *end != '-')
+		return 1;
+	range = end + 1;
+
+	/* Get last byte (up to end of file if not specified) */
+	last = size - 1;
+	if(*range != '\0')
+	{
+		last = strtoull(range, &end, 10);
+		if(*end != '\0' || last < first)
+			return 1;
+		if(last >= size)
+			last = size - 1;
+	}
+
+	/* Range is out of file */
+	if(first >= size)
+		return -1;
 
-	/* Read from file */
-	return fread(buffer, 1, size, fp);
+	*start = first;
+	*len = last - first + 1;
+	return 0;
 }
 
-static void httpd_file_free_cb(void *user_data)
+static struct MHD_Response *httpd_fd_response(struct MHD_Connection *c, int fd,
+					      const struct stat *s, int *code)
 {
-	FILE *fp = (FILE*) user_data;
+	struct MHD_Response *response;
+	char etag[40], date[32], content_range[64];
+	uint64_t size = s->st_size, start = 0, len = size;
+	const char *value;
+	struct tm tm;
+	int ret = 1;
+
+	/* Generate validators from modification time and size */
+	snprintf(etag, sizeof(etag), "\"%lx-%llx\"", (unsigned long) s->st_mtime,
+		 (unsigned long long) size);
+	gmtime_r(&s->st_mtime, &tm);
+	strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+
+	/* Check conditional and range requests */
+	*code = 200;
+	if(c != NULL)
+	{
+		/* Check if cached file is still valid */
+		value = MHD_lookup_connection_value(c, MHD_HEADER_KIND,
+						  MHD_HTTP_HEADER_IF_NONE_MATCH);
+		if(value != NULL)
+		{
+			if(strcmp(value, "*") == 0 ||
+			   strstr(value, etag) != NULL)
+				*code = 304;
+		}
+		else
+		{
+			value = MHD_lookup_connection_value(c, MHD_HEADER_KIND,
+					      MHD_HTTP_HEADER_IF_MODIFIED_SINCE);
+			if(value != NULL && strcmp(value, date) == 0)
+				*code = 304;
+		}
+
+		/* Get range if file has not changed since If-Range value */
+		value = MHD_lookup_connection_value(c, MHD_HEADER_KIND,
+						    MHD_HTTP_HEADER_RANGE);
+		if(*code == 200 && value != NULL)
+		{
+			ret = httpd_parse_range(value, size, &start, &len);
+			value = MHD_lookup_connection_value(c, MHD_HEADER_KIND,
+						       MHD_HTTP_HEADER_IF_RANGE);
+			if(value != NULL && strcmp(value, etag) != 0 &&
+			   strcmp(value, date) != 0)
+			{
+				start = 0;
+				len = size;
+				ret = 1;
+			}
+		}
+	}
+
+	/* Create HTTP response */
+	if(*code == 304 || ret < 0)
+	{
+		/* No content sent: file is not used */
+		close(fd);
+		response = MHD_create_response_from_data(0, NULL, 0, 0);
+		if(response == NULL)
+			return NULL;
 
-	/* Close file */
-	if(fp != NULL)
-		fclose(fp);
+		/* Range is not satisfiable */
+		if(ret < 0)
+		{
+			*code = 416;
+			snprintf(content_range, sizeof(content_range),
+				 "bytes */%llu", (unsigned long long) size);
+			MHD_add_response_header(response,
+						MHD_HTTP_HEADER_CONTENT_RANGE,
+						content_range);
+		}
+	}
+	else
+	{
+		/* Send file content directly from file descriptor, so kernel
+		 * can use sendfile() if possible
+		 */
+#if MHD_VERSION >= 0x00094400
+		response = MHD_create_response_from_fd_at_offset64(len, fd,
+								   start);
+#else
+		response = MHD_create_response_from_fd_at_offset(len, fd,
+								 start);
+#endif
+		if(response == NULL)
+		{
+			close(fd);
+			return NULL;
+		}
+
+		/* Partial content */
+		if(ret == 0)
+		{
+			*code = 206;
+			snprintf(content_range, sizeof(content_range),
+				 "bytes %llu-%llu/%llu",
+				 (unsigned long long) start,
+				 (unsigned long long) (start + len - 1),
+				 (unsigned long long) size);
+			MHD_add_response_header(response,
+						MHD_HTTP_HEADER_CONTENT_RANGE,
+						content_range);
+		}
+	}
+
+	/* Add validators */
+	MHD_add_response_header(response, MHD_HTTP_HEADER_ETAG, etag);
+	MHD_add_response_header(response, MHD_HTTP_HEADER_LAST_MODIFIED, date);
+	MHD_add_response_header(response, MHD_HTTP_HEADER_ACCEPT_RANGES,
+				"bytes");
+
+	return response;
 }
 
-static struct MHD_Response *httpd_file_response(const char *web_path,
+static struct MHD_Response *httpd_cache_response(struct httpd_handle *h,
+						 struct MHD_Connection *c,
+						 const char *url, int *code)
+{
+	static const char *encodings[HTTPD_CACHE_ENCODINGS] = {
+		NULL, "gzip", "br"
+	};
+	const struct httpd_cache_file *f;
+	struct MHD_Response *response;
+	enum httpd_cache_encoding e;
+	char cache_control[32];
+	const char *value;
+
+	/* Web root is not cached or has changed */
+	if(h->cache == NULL || strcmp(httpd_cache_get_path(h->cache),
+				      h->path) != 0)
+		return NULL;
+
+	/* Range requests are served from file */
+	if(MHD_lookup_connection_value(c, MHD_HEADER_KIND,
+				       MHD_HTTP_HEADER_RANGE) != NULL)
+		return NULL;
+
+	/* Find file in cache */
+	f = httpd_cache_find(h->cache, url);
+	if(f == NULL)
+		return NULL;
+
+	/* Check if cached file in client is still valid */
+	*code = 200;
+	value = MHD_lookup_connection_value(c, MHD_HEADER_KIND,
+					    MHD_HTTP_HEADER_IF_NONE_MATCH);
+	if(value != NULL)
+	{
+		if(strcmp(value, "*") == 0 || strstr(value, f->etag) != NULL)
+			*code = 304;
+	}
+	else
+	{
+		value = MHD_lookup_connection_value(c, MHD_HEADER_KIND,
+					      MHD_HTTP_HEADER_IF_MODIFIED_SINCE);
+		if(value != NULL && strcmp(value, f->date) == 0)
+			*code = 304;
+	}
+
+	/* Create HTTP response */
+	if(*code == 304)
+	{
+		response = MHD_create_response_from_data(0, NULL, 0, 0);
+		if(response == NULL)
+			return NULL;
+	}
+	else
+	{
+		/* Select variant accepted by client */
+		value = MHD_lookup_connection_value(c, MHD_HEADER_KIND,
+					       MHD_HTTP_HEADER_ACCEPT_ENCODING);
+		e = httpd_cache_select(f, value);
+
+		/* Send content from cache: it is not freed until server is
+		 * stopped
+		 */
+		response = MHD_create_response_from_data(f->variants[e].len,
+						 f->variants[e].data, MHD_NO,
+						 MHD_NO);
+		if(response == NULL)
+			return NULL;
+		if(encodings[e] != NULL)
+			MHD_add_response_header(response,
+					       MHD_HTTP_HEADER_CONTENT_ENCODING,
+					       encodings[e]);
+		httpd_set_mime_type(response, f->name);
+	}
+
+	/* Vary on encoding when precompressed variants are available */
+	if(f->variants[HTTPD_CACHE_GZIP].data != NULL ||
+	   f->variants[HTTPD_CACHE_BR].data != NULL)
+		MHD_add_response_header(response, MHD_HTTP_HEADER_VARY,
+					MHD_HTTP_HEADER_ACCEPT_ENCODING);
+
+	/* Fingerprinted files never change: others must be revalidated */
+	if(f->immutable)
+		snprintf(cache_control, sizeof(cache_control),
+			 "public, max-age=%d, immutable", HTTPD_CACHE_MAX_AGE);
+	else
+		strcpy(cache_control, "no-cache");
+	MHD_add_response_header(response, MHD_HTTP_HEADER_CACHE_CONTROL,
+				cache_control);
+
+	/* Add validators */
+	MHD_add_response_header(response, MHD_HTTP_HEADER_ETAG, f->etag);
+	MHD_add_response_header(response, MHD_HTTP_HEADER_LAST_MODIFIED,
+				f->date);
+
+	return response;
+}
+
+static struct MHD_Response *httpd_file_response(struct MHD_Connection *c,
+						const char *web_path,
 						const char *url, int *code,
 						const char *default_page)
 {
@@ -865,9 +1612,8 @@ static struct MHD_Response *httpd_file_response(const char *web_path,
 	struct dir_data *d_data;
 	struct stat s;
 	char *path;
-	char *ext;
-	FILE *fp;
 	int ret;
+	int fd;
 	int i;
 
 	/* Verify web path */
@@ -893,7 +1639,7 @@ static struct MHD_Response *httpd_file_response(const char *web_path,
 		}
 
 		*code = 404;
-		return httpd_file_response(web_path, "/404.html", &i,
+		return httpd_file_response(NULL, web_path, "/404.html", &i,
 					   HTTPD_DEFAULT_404);
 	}
 
@@ -938,44 +1684,32 @@ static struct MHD_Response *httpd_file_response(const char *web_path,
 	}
 
 	/* Check file size */
+	*code = 200;
 	if(s.st_size != 0)
 	{
 		/* Open File */
-		fp = fopen(path, "rb");
-		if(fp == NULL)
+		fd = open(path, O_RDONLY);
+		if(fd < 0)
 		{
 			free(path);
 			goto error;
 		}
 
 		/* Create HTTP response with file content */
-		response = MHD_create_response_from_callback(s.st_size, 8192,
-							   &httpd_file_read_cb,
-							   fp,
-							   &httpd_file_free_cb);
+		response = httpd_fd_response(c, fd, &s, code);
+		if(response == NULL)
+		{
+			free(path);
+			goto error;
+		}
 	}
 	else
 		response = MHD_create_response_from_data(0, NULL, 0, 0);
 
-	/* Get mime type */
-	ext = strrchr(path, '.');
-	if(ext != NULL && strlen(ext+1) <= 4)
-	{
-		for(i = 0; mime_type[i].ext != NULL; i++)
-		{
-		
-			if(strcmp(mime_type[i].ext, ext+1) == 0)
-			{
-				MHD_add_response_header(response,
-						   MHD_HTTP_HEADER_CONTENT_TYPE,
-						   mime_type[i].mime);
-				break;
-			}
-		}
-	}
+	/* Set mime type */
+	httpd_set_mime_type(response, path);
 	free(path);
 
-	*code = 200;
 	return response;
 
 error:
@@ -1281,7 +2015,7 @@ static int httpd_auth_by_http(struct httpd_handle *h, struct MHD_Connection *c)
 	if((ret == MHD_INVALID_NONCE) || (ret == MHD_NO))
 	{
 		/* Create HTTP response with failure page */
-		response = httpd_file_response(h->path, "/401.html", &code,
+		response = httpd_file_response(NULL, h->path, "/401.html", &code,
 					       HTTPD_DEFAULT_401);
 
 		/* Queue it with Authentication headers */
@@ -1347,8 +2081,8 @@ static int httpd_auth_by_session(const char *url, int method,
 		}
 
 		/* Respond with login page */
-		*response = httpd_file_response(h->path, "/login.html", code,
-					        HTTPD_DEFAULT_LOGIN);
+		*response = httpd_file_response(NULL, h->path, "/login.html",
+						code, HTTPD_DEFAULT_LOGIN);
 		return HTTPD_YES;
 	}
 
@@ -1359,7 +2093,8 @@ static int httpd_auth_by_session(const char *url, int method,
 		if(strcmp(url, "/logout") == 0)
 		{
 			/* Set expiration time to zero: remove session */
-			req->session->time = 0;
+			__atomic_store_n(&req->session->time, 0,
+					 __ATOMIC_RELAXED);
 
 			goto redirect;
 		}
@@ -1465,6 +2200,8 @@ static int httpd_request(void *user_data, struct MHD_Connection *c,
 	{
 		/* Allocate request data */
 		*ptr = calloc(1, sizeof(struct httpd_req_data));
+		if(*ptr != NULL)
+			((struct httpd_req_data *) *ptr)->start = metric_now();
 	}
 	req = *ptr;
 
@@ -1499,40 +2236,45 @@ static int httpd_request(void *user_data, struct MHD_Connection *c,
 	}
 
 	/* Lock URLs list access */
-	pthread_mutex_lock(&h->mutex);
+	lock_mutex(httpd_class, &h->mutex);
 
-	/* Find URL in list */
-	current_urls = h->urls;
-	while(current_urls != NULL)
+	/* Find URL with router or in list */
+	if(h->router != NULL)
+		current_url = httpd_route_url(h->router, url, &current_urls);
+	else
 	{
-		current_url = httpd_find_url(url, current_urls->name,
-					     current_urls->urls);
-		if(current_url != NULL)
-			break;
+		current_urls = h->urls;
+		while(current_urls != NULL)
+		{
+			current_url = httpd_find_url(url, current_urls->name,
+						     current_urls->urls);
+			if(current_url != NULL)
+				break;
 
-		current_urls = current_urls->next;
+			current_urls = current_urls->next;
+		}
 	}
 
 	/* No URL found */
 	if(current_urls == NULL || current_url == NULL)
 	{
 		/* Unlock URLs list access */
-		pthread_mutex_unlock(&h->mutex);
+		unlock_mutex(httpd_class, &h->mutex);
 
 		goto process_file;
 	}
 
 	/* Lock specific URL */
-	pthread_mutex_lock(&current_urls->mutex);
+	lock_mutex(httpd_url_class, &current_urls->mutex);
 
 	/* Check abort signal */
 	if(current_urls->abort)
 	{
 		/* Unlock specific URL */
-		pthread_mutex_unlock(&current_urls->mutex);
+		unlock_mutex(httpd_url_class, &current_urls->mutex);
 
 		/* Unlock URLs list access */
-		pthread_mutex_unlock(&h->mutex);
+		unlock_mutex(httpd_class, &h->mutex);
 
 		goto process_file;
 	}
@@ -1541,10 +2283,10 @@ static int httpd_request(void *user_data, struct MHD_Connection *c,
 	current_urls->count++;
 
 	/* Unlock specific URL */
-	pthread_mutex_unlock(&current_urls->mutex);
+	unlock_mutex(httpd_url_class, &current_urls->mutex);
 
 	/* Unlock URLs list access */
-	pthread_mutex_unlock(&h->mutex);
+	unlock_mutex(httpd_class, &h->mutex);
 
 	/* Check method */
 	if((current_url->method & method_code) == 0)
@@ -1553,13 +2295,31 @@ static int httpd_request(void *user_data, struct MHD_Connection *c,
 		code = 406;
 
 		/* Lock specific URL */
-		pthread_mutex_lock(&current_urls->mutex);
+		lock_mutex(httpd_url_class, &current_urls->mutex);
 
 		/* Decrement connection counter */
 		current_urls->count--;
 
 		/* Unlock specific URL */
-		pthread_mutex_unlock(&current_urls->mutex);
+		unlock_mutex(httpd_url_class, &current_urls->mutex);
+
+		goto end;
+	}
+
+	/* Open lazy URL group on its first request */
+	if(current_urls->open != NULL && httpd_open_urls(current_urls) != 0)
+	{
+		response = httpd_response("Service unavailable!");
+		code = 503;
+
+		/* Lock specific URL */
+		lock_mutex(httpd_url_class, &current_urls->mutex);
+
+		/* Decrement connection counter */
+		current_urls->count--;
+
+		/* Unlock specific URL */
+		unlock_mutex(httpd_url_class, &current_urls->mutex);
 
 		goto end;
 	}
@@ -1571,13 +2331,13 @@ static int httpd_request(void *user_data, struct MHD_Connection *c,
 				     &code);
 
 	/* Lock specific URL */
-	pthread_mutex_lock(&current_urls->mutex);
+	lock_mutex(httpd_url_class, &current_urls->mutex);
 
 	/* Decrement connection counter */
 	current_urls->count--;
 
 	/* Unlock specific URL */
-	pthread_mutex_unlock(&current_urls->mutex);
+	unlock_mutex(httpd_url_class, &current_urls->mutex);
 
 	/* Continue */
 	if(response == NULL)
@@ -1594,8 +2354,10 @@ process_file:
 		goto end;
 	}
 
-	/* Response with the requested file */
-	response = httpd_file_response(h->path, url, &code, NULL);
+	/* Response with the requested file (from web root cache if possible) */
+	response = httpd_cache_response(h, c, url, &code);
+	if(response == NULL)
+		response = httpd_file_response(c, h->path, url, &code, NULL);
 
 end:
 	if(response == NULL)
@@ -1649,6 +2411,9 @@ static void httpd_completed(void *user_data, struct MHD_Connection *c,
 		free(v);
 	}
 
+	/* Add request duration */
+	metric_since(&httpd_metric_time, req->start);
+
 	/* Free request data */
 	free(req);
 	*ptr = NULL;
@@ -1683,10 +2448,145 @@ struct httpd_res *httpd_new_cb_response(uint64_t size, size_t block_size,
 								     free_cb);
 }
 
-struct httpd_res *httpd_new_file_response(const char *path, const char *file,
+static ssize_t httpd_stream_cb(void *user_data, uint64_t pos, char *buffer,
+			       size_t size)
+{
+	struct httpd_stream *s = user_data;
+	struct httpd_handle *h = s->handle;
+	ssize_t len;
+
+	/* Get next data */
+	len = s->cb(s->user_data, pos, buffer, size);
+	if(len != 0)
+		return len;
+
+	/* No data available: suspend connection until resume */
+	lock_mutex(httpd_stream_class, &h->stream_mutex);
+	if(h->stopping)
+		len = MHD_CONTENT_READER_END_OF_STREAM;
+	else if(s->pending)
+		s->pending = 0;
+	else
+	{
+		s->suspended = 1;
+		MHD_suspend_connection(s->connection);
+	}
+	unlock_mutex(httpd_stream_class, &h->stream_mutex);
+
+	return len;
+}
+
+static void httpd_stream_free_cb(void *user_data)
+{
+	struct httpd_stream *s = user_data;
+	struct httpd_handle *h = s->handle;
+	struct httpd_stream **sp;
+
+	/* Remove stream from list */
+	lock_mutex(httpd_stream_class, &h->stream_mutex);
+	for(sp = &h->streams; *sp != NULL; sp = &(*sp)->next)
+	{
+		if(*sp == s)
+		{
+			*sp = s->next;
+			break;
+		}
+	}
+	s->connection = NULL;
+	unlock_mutex(httpd_stream_class, &h->stream_mutex);
+
+	/* Free user data */
+	if(s->free_cb != NULL)
+		s->free_cb(s->user_data);
+
+	free(s);
+}
+
+struct httpd_res *httpd_new_stream_response(struct httpd_req *req,
+					    size_t block_size,
+					    httpd_res_cb cb, void *user_data,
+					    httpd_res_free_cb free_cb,
+					    struct httpd_stream **stream)
+{
+#ifdef HTTPD_USE_SUSPEND
+	struct httpd_req_data *r;
+	struct MHD_Response *res;
+	struct httpd_handle *h;
+	struct httpd_stream *s;
+
+	if(req == NULL || req->priv_data == NULL || cb == NULL)
+		return NULL;
+	r = (struct httpd_req_data *) req->priv_data;
+	h = r->handle;
+
+	/* Allocate stream */
+	s = malloc(sizeof(struct httpd_stream));
+	if(s == NULL)
+		return NULL;
+	s->handle = h;
+	s->connection = r->connection;
+	s->cb = cb;
+	s->free_cb = free_cb;
+	s->user_data = user_data;
+	s->suspended = 0;
+	s->pending = 0;
+
+	/* Create response */
+	res = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, block_size,
+						&httpd_stream_cb, s,
+						&httpd_stream_free_cb);
+	if(res == NULL)
+	{
+		free(s);
+		return NULL;
+	}
+
+	/* Add stream to list */
+	lock_mutex(httpd_stream_class, &h->stream_mutex);
+	s->next = h->streams;
+	h->streams = s;
+	unlock_mutex(httpd_stream_class, &h->stream_mutex);
+
+	*stream = s;
+	return (struct httpd_res *) res;
+#else
+	return NULL;
+#endif
+}
+
+void httpd_resume_stream(struct httpd_stream *s)
+{
+	struct httpd_handle *h;
+
+	if(s == NULL)
+		return;
+	h = s->handle;
+
+	/* Resume connection or let callback be called again */
+	lock_mutex(httpd_stream_class, &h->stream_mutex);
+	if(s->suspended && s->connection != NULL)
+	{
+		s->suspended = 0;
+		MHD_resume_connection(s->connection);
+	}
+	else
+		s->pending = 1;
+	unlock_mutex(httpd_stream_class, &h->stream_mutex);
+}
+
+struct httpd_res *httpd_new_file_response(struct httpd_req *req,
+					  const char *path, const char *file,
 					  int *code)
 {
-	return (struct httpd_res *) httpd_file_response(path, file, code, NULL);
+	struct httpd_req_data *r = NULL;
+
+	/* Get connection for conditional and range requests */
+	if(req != NULL)
+		r = (struct httpd_req_data *) req->priv_data;
+
+	return (struct httpd_res *) httpd_file_response(
+					    r != NULL ? r->connection : NULL,
+					    path, file, code, NULL);
 }
 
 int httpd_add_header(struct httpd_res *res, const char *header,
@@ -1713,6 +2613,22 @@ const char *httpd_get_query(struct httpd_req *req, const char *key)
 					   key);
 }
 
+const char *httpd_get_header(struct httpd_req *req, const char *key)
+{
+	struct httpd_req_data *r;
+
+	if(req == NULL)
+		return NULL;
+
+	/* Get req_data */
+	r = (struct httpd_req_data *) req->priv_data;
+	if(r == NULL)
+		return NULL;
+
+	/* Return header value */
+	return MHD_lookup_connection_value(r->connection, MHD_HEADER_KIND, key);
+}
+
 int httpd_set_session_value(struct httpd_req *req, const char *key,
 			    const char *value)
 {
@@ -1728,7 +2644,7 @@ int httpd_set_session_value(struct httpd_req *req, const char *key,
 		return -1;
 
 	/* Lock session values access */
-	pthread_mutex_lock(&r->session->values_mutex);
+	lock_mutex(httpd_session_class, &r->session->values_mutex);
 
 	/* Find value */
 	vp = &r->session->values;
@@ -1780,7 +2696,8 @@ int httpd_set_session_value(struct httpd_req *req, const char *key,
 		if(v == NULL)
 		{
 			/* Unlock session values access */
-			pthread_mutex_unlock(&r->session->values_mutex);
+			unlock_mutex(httpd_session_class,
+				     &r->session->values_mutex);
 
 			return -1;
 		}
@@ -1799,7 +2716,7 @@ int httpd_set_session_value(struct httpd_req *req, const char *key,
 
 end:
 	/* Unlock session values access */
-	pthread_mutex_unlock(&r->session->values_mutex);
+	unlock_mutex(httpd_session_class, &r->session->values_mutex);
 
 	return 0;
 }
@@ -1819,7 +2736,7 @@ char *httpd_get_session_value(struct httpd_req *req, const char *key)
 		return NULL;
 
 	/* Lock session values access */
-	pthread_mutex_lock(&r->session->values_mutex);
+	lock_mutex(httpd_session_class, &r->session->values_mutex);
 
 	/* Find value */
 	for(v = r->session->values; v != NULL; v = v->next)
@@ -1834,7 +2751,7 @@ char *httpd_get_session_value(struct httpd_req *req, const char *key)
 	}
 
 	/* Unlock session values access */
-	pthread_mutex_unlock(&r->session->values_mutex);
+	unlock_mutex(httpd_session_class, &r->session->values_mutex);
 
 	return str;
 }
@@ -0,0 +1,426 @@
+/*
+ * httpd_cache.c - An in-memory cache of the web root for HTTP Server
+ *
+ * Copyright (c) 2014   A. Dilly
+ *
+ * AirCat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * AirCat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with AirCat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "httpd_cache.h"
+#include "utils.h"
+
+#define HTTPD_CACHE_MAX_PATH 512
+#define HTTPD_CACHE_FINGERPRINT 8
+
+struct httpd_cache {
+	/* Web root */
+	char *path;
+	/* Files sorted by name */
+	struct httpd_cache_file *files;
+	unsigned int count;
+	unsigned int alloc;
+	/* Memory budget */
+	size_t size;
+	size_t used;
+};
+
+static const char *httpd_cache_ext[HTTPD_CACHE_ENCODINGS] = {
+	"", ".gz", ".br"
+};
+
+static unsigned char *httpd_cache_load(const char *path, size_t max_len,
+				       size_t *len)
+{
+	unsigned char *data;
+	struct stat s;
+	ssize_t ret;
+	size_t pos;
+	int fd;
+
+	/* Open file */
+	fd = open(path, O_RDONLY);
+	if(fd < 0)
+		return NULL;
+
+	/* Check file size */
+	if(fstat(fd, &s) != 0 || !S_ISREG(s.st_mode) || s.st_size == 0 ||
+	   (size_t) s.st_size > max_len)
+	{
+		close(fd);
+		return NULL;
+	}
+
+	/* Allocate buffer */
+	data = malloc(s.st_size);
+	if(data == NULL)
+	{
+		close(fd);
+		return NULL;
+	}
+
+	/* Read all file */
+	for(pos = 0; pos < (size_t) s.st_size; pos += ret)
+	{
+		ret = read(fd, data + pos, s.st_size - pos);
+		if(ret <= 0)
+		{
+			free(data);
+			close(fd);
+			return NULL;
+		}
+	}
+	close(fd);
+
+	*len = pos;
+	return data;
+}
+
+static int httpd_cache_is_fingerprinted(const char *name)
+{
+	const char *base, *p;
+	size_t len;
+
+	/* Get base name */
+	base = strrchr(name, '/');
+	base = base != NULL ? base + 1 : name;
+
+	/* Find a hash separated by '.' or '-' before extension */
+	p = base;
+	while(*p != '\0')
+	{
+		/* Skip separator */
+		if(*p == '.' || *p == '-')
+		{
+			p++;
+			continue;
+		}
+
+		/* Check hexadecimal segment */
+		for(len = 0; isxdigit((unsigned char) p[len]); len++);
+		if(len >= HTTPD_CACHE_FINGERPRINT &&
+		   (p[len] == '.' || p[len] == '-') && p != base)
+			return 1;
+
+		/* Go to next segment */
+		for(; p[len] != '\0' && p[len] != '.' && p[len] != '-'; len++);
+		p += len;
+	}
+
+	return 0;
+}
+
+static void httpd_cache_add(struct httpd_cache *c, const char *path,
+			    const char *name, const struct stat *st)
+{
+	struct httpd_cache_file *f;
+	char v_path[HTTPD_CACHE_MAX_PATH];
+	uint64_t hash;
+	unsigned char *data;
+	struct tm tm;
+	size_t len;
+	int e;
+
+	/* Load file content */
+	data = httpd_cache_load(path, c->size - c->used, &len);
+	if(data == NULL)
+		return;
+
+	/* Grow file list */
+	if(c->count == c->alloc)
+	{
+		f = realloc(c->files, (c->alloc + 32) *
+				      sizeof(struct httpd_cache_file));
+		if(f == NULL)
+		{
+			free(data);
+			return;
+		}
+		c->files = f;
+		c->alloc += 32;
+	}
+
+	/* Init new file */
+	f = &c->files[c->count];
+	memset(f, 0, sizeof(struct httpd_cache_file));
+	f->name = strdup(name);
+	if(f->name == NULL)
+	{
+		free(data);
+		return;
+	}
+	f->variants[HTTPD_CACHE_IDENTITY].data = data;
+	f->variants[HTTPD_CACHE_IDENTITY].len = len;
+	f->immutable = httpd_cache_is_fingerprinted(name);
+	c->used += len;
+	c->count++;
+
+	/* Generate a strong ETag from content (FNV-1a) */
+	hash = utils_hash_fnv1a(UTILS_FNV1A_INIT, data, len);
+	snprintf(f->etag, sizeof(f->etag), "\"%016llx\"",
+		 (unsigned long long) hash);
+
+	/* Generate Last-Modified date */
+	gmtime_r(&st->st_mtime, &tm);
+	strftime(f->date, sizeof(f->date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+
+	/* Load precompressed variants only if smaller */
+	for(e = HTTPD_CACHE_GZIP; e < HTTPD_CACHE_ENCODINGS; e++)
+	{
+		if(snprintf(v_path, sizeof(v_path), "%s%s", path,
+			    httpd_cache_ext[e]) >= sizeof(v_path))
+			continue;
+		data = httpd_cache_load(v_path, c->size - c->used, &len);
+		if(data == NULL)
+			continue;
+		if(len >= f->variants[HTTPD_CACHE_IDENTITY].len)
+		{
+			free(data);
+			continue;
+		}
+		f->variants[e].data = data;
+		f->variants[e].len = len;
+		c->used += len;
+	}
+}
+
+static int httpd_cache_is_variant(const char *name)
+{
+	size_t len = strlen(name);
+	int e;
+
+	for(e = HTTPD_CACHE_GZIP; e < HTTPD_CACHE_ENCODINGS; e++)
+	{
+		if(len > 3 && strcmp(name + len - 3, httpd_cache_ext[e]) == 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+static void httpd_cache_scan(struct httpd_cache *c, const char *path,
+			     const char *prefix)
+{
+	char f_path[HTTPD_CACHE_MAX_PATH];
+	char f_name[HTTPD_CACHE_MAX_PATH];
+	struct dirent *entry;
+	struct stat st;
+	DIR *dir;
+
+	/* Open directory */
+	dir = opendir(path);
+	if(dir == NULL)
+		return;
+
+	/* Add all files and scan sub-directories */
+	while((entry = readdir(dir)) != NULL && c->used < c->size)
+	{
+		/* Skip hidden files and precompressed variants */
+		if(entry->d_name[0] == '.' || httpd_cache_is_variant(entry->d_name))
+			continue;
+
+		/* Generate paths */
+		if(snprintf(f_path, sizeof(f_path), "%s/%s", path,
+			    entry->d_name) >= sizeof(f_path) ||
+		   snprintf(f_name, sizeof(f_name), "%s%s", prefix,
+			    entry->d_name) >= sizeof(f_name) - 1)
+			continue;
+
+		/* Get file properties */
+		if(stat(f_path, &st) != 0)
+			continue;
+
+		if(S_ISDIR(st.st_mode))
+		{
+			strcat(f_name, "/");
+			httpd_cache_scan(c, f_path, f_name);
+		}
+		else if(S_ISREG(st.st_mode))
+			httpd_cache_add(c, f_path, f_name, &st);
+	}
+
+	closedir(dir);
+}
+
+static int httpd_cache_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct httpd_cache_file *) a)->name,
+		      ((const struct httpd_cache_file *) b)->name);
+}
+
+struct httpd_cache *httpd_cache_open(const char *path, size_t size)
+{
+	struct httpd_cache *c;
+
+	if(path == NULL || size == 0)
+		return NULL;
+
+	/* Allocate cache */
+	c = calloc(1, sizeof(struct httpd_cache));
+	if(c == NULL)
+		return NULL;
+	c->size = size;
+
+	/* Copy web root */
+	c->path = strdup(path);
+	if(c->path == NULL)
+	{
+		free(c);
+		return NULL;
+	}
+
+	/* Load web root */
+	httpd_cache_scan(c, path, "");
+	if(c->count == 0)
+	{
+		httpd_cache_close(c);
+		return NULL;
+	}
+
+	/* Sort files for lookup */
+	qsort(c->files, c->count, sizeof(struct httpd_cache_file),
+	      httpd_cache_cmp);
+
+	return c;
+}
+
+const char *httpd_cache_get_path(struct httpd_cache *c)
+{
+	return c->path;
+}
+
+const struct httpd_cache_file *httpd_cache_find(struct httpd_cache *c,
+						const char *url)
+{
+	char name[HTTPD_CACHE_MAX_PATH];
+	struct httpd_cache_file key;
+	size_t len;
+
+	/* Skip leading slashes */
+	while(*url == '/')
+		url++;
+
+	/* Use index for directories */
+	len = strlen(url);
+	if(len + 11 > sizeof(name))
+		return NULL;
+	strcpy(name, url);
+	if(len == 0 || url[len-1] == '/')
+		strcat(name, "index.html");
+
+	/* Find file */
+	key.name = name;
+	return bsearch(&key, c->files, c->count,
+		       sizeof(struct httpd_cache_file), httpd_cache_cmp);
+}
+
+enum httpd_cache_encoding httpd_cache_select(const struct httpd_cache_file *f,
+					     const char *accept_encoding)
+{
+	int accepted[HTTPD_CACHE_ENCODINGS] = { 1, 0, 0 };
+	enum httpd_cache_encoding best = HTTPD_CACHE_IDENTITY;
+	const char *p = accept_encoding;
+	const char *name;
+	size_t len;
+	double q;
+	int e;
+
+	if(p == NULL)
+		return HTTPD_CACHE_IDENTITY;
+
+	/* Parse list of codings */
+	while(*p != '\0')
+	{
+		/* Skip separators */
+		if(*p == ' ' || *p == ',')
+		{
+			p++;
+			continue;
+		}
+
+		/* Get coding name */
+		name = p;
+		for(len = 0; p[len] != '\0' && p[len] != ',' && p[len] != ';' &&
+			     p[len] != ' '; len++);
+
+		/* Get quality value */
+		q = 1.0;
+		for(p += len; *p == ' '; p++);
+		if(*p == ';')
+		{
+			for(p++; *p == ' '; p++);
+			if(strncmp(p, "q=", 2) == 0)
+				q = strtod(p + 2, NULL);
+		}
+
+		/* Accept coding */
+		if(q > 0)
+		{
+			if((len == 4 && strncmp(name, "gzip", 4) == 0) ||
+			   (len == 1 && *name == '*'))
+				accepted[HTTPD_CACHE_GZIP] = 1;
+			if((len == 2 && strncmp(name, "br", 2) == 0) ||
+			   (len == 1 && *name == '*'))
+				accepted[HTTPD_CACHE_BR] = 1;
+		}
+
+		/* Go to next coding */
+		for(; *p != '\0' && *p != ','; p++);
+	}
+
+	/* Select smallest accepted variant */
+	for(e = HTTPD_CACHE_GZIP; e < HTTPD_CACHE_ENCODINGS; e++)
+	{
+		if(accepted[e] && f->variants[e].data != NULL &&
+		   f->variants[e].len < f->variants[best].len)
+			best = e;
+	}
+
+	return best;
+}
+
+void httpd_cache_close(struct httpd_cache *c)
+{
+	unsigned int i;
+	int e;
+
+	if(c == NULL)
+		return;
+
+	/* Free files */
+	for(i = 0; i < c->count; i++)
+	{
+		for(e = 0; e < HTTPD_CACHE_ENCODINGS; e++)
+		{
+			if(c->files[i].variants[e].data != NULL)
+				free(c->files[i].variants[e].data);
+		}
+		free(c->files[i].name);
+	}
+	if(c->files != NULL)
+		free(c->files);
+
+	/* Free cache */
+	free(c->path);
+	free(c);
+}
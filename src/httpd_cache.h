@@ -0,0 +1,62 @@
+/*
+ * httpd_cache.h - An in-memory cache of the web root for HTTP Server
+ *
+ * Copyright (c) 2014   A. Dilly
+ *
+ * AirCat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * AirCat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with AirCat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HTTPD_CACHE_H
+#define _HTTPD_CACHE_H
+
+#include <stddef.h>
+
+enum httpd_cache_encoding {
+	HTTPD_CACHE_IDENTITY,
+	HTTPD_CACHE_GZIP,
+	HTTPD_CACHE_BR,
+	HTTPD_CACHE_ENCODINGS
+};
+
+struct httpd_cache_file {
+	/* Path relative to web root */
+	char *name;
+	/* Validators */
+	char etag[20];
+	char date[32];
+	/* File name is fingerprinted (content never changes) */
+	int immutable;
+	/* Content for each encoding (NULL if not available) */
+	struct {
+		unsigned char *data;
+		size_t len;
+	} variants[HTTPD_CACHE_ENCODINGS];
+};
+
+struct httpd_cache;
+
+/* Load all files of web root in memory up to size bytes. Precompressed
+ * variants are loaded from files with a ".gz" or ".br" extension next to
+ * original files. Files changed after loading are not reloaded.
+ */
+struct httpd_cache *httpd_cache_open(const char *path, size_t size);
+const char *httpd_cache_get_path(struct httpd_cache *c);
+/* Find a file with its URL (NULL if not cached) */
+const struct httpd_cache_file *httpd_cache_find(struct httpd_cache *c,
+						const char *url);
+/* Select smallest variant accepted by an Accept-Encoding header value */
+enum httpd_cache_encoding httpd_cache_select(const struct httpd_cache_file *f,
+					     const char *accept_encoding);
+void httpd_cache_close(struct httpd_cache *c);
+
+#endif
@@ -0,0 +1,336 @@
+/*
+ * image.c - Cover art thumbnails
+ *
+ * Copyright (c) 2014   A. Dilly
+ *
+ * AirCat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * AirCat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with AirCat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "image.h"
+
+static const unsigned int image_sizes[] = IMAGE_THUMB_SIZES;
+
+unsigned int image_thumbnail_size(unsigned long size)
+{
+	unsigned int i, count;
+
+	/* Find first size which is large enough */
+	count = sizeof(image_sizes) / sizeof(*image_sizes);
+	for(i = 0; i < count - 1 && image_sizes[i] < size; i++);
+
+	return image_sizes[i];
+}
+
+#ifdef HAVE_LIBJPEG
+
+#include <setjmp.h>
+#include <jpeglib.h>
+#ifdef HAVE_LIBPNG
+#include <png.h>
+#endif
+
+struct image_error {
+	struct jpeg_error_mgr mgr;
+	jmp_buf jmp;
+};
+
+struct image_rgb {
+	unsigned char *data;
+	unsigned int width;
+	unsigned int height;
+};
+
+static void image_error_exit(j_common_ptr cinfo)
+{
+	struct image_error *e = (struct image_error *) cinfo->err;
+
+	/* Go back to caller instead of exit() */
+	longjmp(e->jmp, 1);
+}
+
+static void image_output_message(j_common_ptr cinfo)
+{
+	/* Ignore warnings of corrupted images */
+}
+
+static int image_decode_jpeg(const unsigned char *data, size_t len,
+			     unsigned int size, struct image_rgb *img)
+{
+	struct jpeg_decompress_struct d;
+	struct image_error e;
+	unsigned char *volatile rgb = NULL;
+	unsigned int max, denom;
+	JSAMPROW row;
+
+	/* Handle errors */
+	d.err = jpeg_std_error(&e.mgr);
+	e.mgr.error_exit = image_error_exit;
+	e.mgr.output_message = image_output_message;
+	if(setjmp(e.jmp))
+	{
+		jpeg_destroy_decompress(&d);
+		free(rgb);
+		return -1;
+	}
+
+	/* Read header */
+	jpeg_create_decompress(&d);
+	jpeg_mem_src(&d, (unsigned char *) data, len);
+	jpeg_read_header(&d, TRUE);
+
+	/* Image is already small enough */
+	max = d.image_width > d.image_height ? d.image_width : d.image_height;
+	if(max <= size)
+	{
+		jpeg_destroy_decompress(&d);
+		return 1;
+	}
+
+	/* Let decoder scale down image as much as possible (it only computes
+	 * the needed DCT coefficients)
+	 */
+	for(denom = 1; denom < 8 && max / (denom * 2) >= size; denom *= 2);
+	d.scale_num = 1;
+	d.scale_denom = denom;
+	d.out_color_space = JCS_RGB;
+	jpeg_start_decompress(&d);
+
+	/* Allocate image */
+	rgb = malloc(d.output_width * d.output_height * 3);
+	if(rgb == NULL)
+	{
+		jpeg_destroy_decompress(&d);
+		return -1;
+	}
+
+	/* Decode all lines */
+	while(d.output_scanline < d.output_height)
+	{
+		row = rgb + d.output_scanline * d.output_width * 3;
+		jpeg_read_scanlines(&d, &row, 1);
+	}
+	img->data = rgb;
+	img->width = d.output_width;
+	img->height = d.output_height;
+
+	/* Free decoder */
+	jpeg_finish_decompress(&d);
+	jpeg_destroy_decompress(&d);
+
+	return 0;
+}
+
+#ifdef HAVE_LIBPNG
+static int image_decode_png(const unsigned char *data, size_t len,
+			    unsigned int size, struct image_rgb *img)
+{
+	png_color white = { 0xFF, 0xFF, 0xFF };
+	png_image png;
+
+	/* Read header */
+	memset(&png, 0, sizeof(png));
+	png.version = PNG_IMAGE_VERSION;
+	if(!png_image_begin_read_from_memory(&png, data, len))
+		return -1;
+
+	/* Image is already small enough */
+	if(png.width <= size && png.height <= size)
+	{
+		png_image_free(&png);
+		return 1;
+	}
+
+	/* Allocate image */
+	png.format = PNG_FORMAT_RGB;
+	img->data = malloc(PNG_IMAGE_SIZE(png));
+	if(img->data == NULL)
+	{
+		png_image_free(&png);
+		return -1;
+	}
+
+	/* Decode image (transparency is drawn on white) */
+	if(!png_image_finish_read(&png, &white, img->data, 0, NULL))
+	{
+		free(img->data);
+		png_image_free(&png);
+		return -1;
+	}
+	img->width = png.width;
+	img->height = png.height;
+
+	return 0;
+}
+#endif
+
+static void image_scale(const struct image_rgb *src, struct image_rgb *dst)
+{
+	unsigned int x, y, sx, sy, sx0, sx1, sy0, sy1, c;
+	unsigned long sum[3], n;
+	const unsigned char *p;
+	unsigned char *d = dst->data;
+
+	/* Average all source pixels covered by each destination pixel */
+	for(y = 0; y < dst->height; y++)
+	{
+		sy0 = y * src->height / dst->height;
+		sy1 = (y + 1) * src->height / dst->height;
+		if(sy1 <= sy0)
+			sy1 = sy0 + 1;
+
+		for(x = 0; x < dst->width; x++)
+		{
+			sx0 = x * src->width / dst->width;
+			sx1 = (x + 1) * src->width / dst->width;
+			if(sx1 <= sx0)
+				sx1 = sx0 + 1;
+
+			/* Sum pixels */
+			sum[0] = sum[1] = sum[2] = 0;
+			for(sy = sy0; sy < sy1; sy++)
+			{
+				p = src->data + (sy * src->width + sx0) * 3;
+				for(sx = sx0; sx < sx1; sx++)
+				{
+					sum[0] += *p++;
+					sum[1] += *p++;
+					sum[2] += *p++;
+				}
+			}
+
+			/* Set average */
+			n = (sx1 - sx0) * (sy1 - sy0);
+			for(c = 0; c < 3; c++)
+				*d++ = (sum[c] + n / 2) / n;
+		}
+	}
+}
+
+static int image_encode_jpeg(const struct image_rgb *img,
+			     unsigned char **thumb, size_t *thumb_len)
+{
+	struct jpeg_compress_struct c;
+	struct image_error e;
+	unsigned char *buffer = NULL;
+	unsigned long size = 0;
+	JSAMPROW row;
+
+	/* Handle errors */
+	c.err = jpeg_std_error(&e.mgr);
+	e.mgr.error_exit = image_error_exit;
+	e.mgr.output_message = image_output_message;
+	if(setjmp(e.jmp))
+	{
+		jpeg_destroy_compress(&c);
+		free(buffer);
+		return -1;
+	}
+
+	/* Prepare encoder */
+	jpeg_create_compress(&c);
+	jpeg_mem_dest(&c, &buffer, &size);
+	c.image_width = img->width;
+	c.image_height = img->height;
+	c.input_components = 3;
+	c.in_color_space = JCS_RGB;
+	jpeg_set_defaults(&c);
+	jpeg_set_quality(&c, IMAGE_THUMB_QUALITY, TRUE);
+	c.optimize_coding = TRUE;
+
+	/* Encode all lines */
+	jpeg_start_compress(&c, TRUE);
+	while(c.next_scanline < c.image_height)
+	{
+		row = img->data + c.next_scanline * img->width * 3;
+		jpeg_write_scanlines(&c, &row, 1);
+	}
+	jpeg_finish_compress(&c);
+	jpeg_destroy_compress(&c);
+
+	*thumb = buffer;
+	*thumb_len = size;
+
+	return 0;
+}
+
+int image_thumbnail(const unsigned char *data, size_t len, unsigned int size,
+		    unsigned char **thumb, size_t *thumb_len)
+{
+	struct image_rgb src, dst;
+	int ret = -1;
+
+	if(data == NULL || size == 0)
+		return -1;
+
+	/* Decode image (scaled down by decoder when possible) */
+	if(len >= 2 && data[0] == 0xFF && data[1] == 0xD8)
+		ret = image_decode_jpeg(data, len, size, &src);
+#ifdef HAVE_LIBPNG
+	else if(len >= 8 && png_sig_cmp(data, 0, 8) == 0)
+		ret = image_decode_png(data, len, size, &src);
+#endif
+	if(ret != 0)
+		return ret;
+
+	/* Get thumbnail size */
+	if(src.width >= src.height)
+	{
+		dst.width = size < src.width ? size : src.width;
+		dst.height = (src.height * dst.width + src.width / 2) /
+			     src.width;
+	}
+	else
+	{
+		dst.height = size < src.height ? size : src.height;
+		dst.width = (src.width * dst.height + src.height / 2) /
+			    src.height;
+	}
+	if(dst.width == 0)
+		dst.width = 1;
+	if(dst.height == 0)
+		dst.height = 1;
+
+	/* Scale image */
+	dst.data = malloc(dst.width * dst.height * 3);
+	if(dst.data == NULL)
+	{
+		free(src.data);
+		return -1;
+	}
+	image_scale(&src, &dst);
+	free(src.data);
+
+	/* Encode thumbnail */
+	ret = image_encode_jpeg(&dst, thumb, thumb_len);
+	free(dst.data);
+
+	return ret;
+}
+
+#else
+
+int image_thumbnail(const unsigned char *data, size_t len, unsigned int size,
+		    unsigned char **thumb, size_t *thumb_len)
+{
+	return -1;
+}
+
+#endif
@@ -0,0 +1,228 @@
+/*
+ * json_stream.c - An incremental JSON writer
+ *
+ * Copyright (c) 2014   A. Dilly
+ *
+ * AirCat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * AirCat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with AirCat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "json_stream.h"
+
+#define JSON_STREAM_SIZE 4096
+#define JSON_STREAM_MAX_DEPTH 16
+
+struct json_stream {
+	/* Output string */
+	char *buffer;
+	size_t len;
+	size_t size;
+	/* Values written in each opened object or array */
+	unsigned long count[JSON_STREAM_MAX_DEPTH];
+	unsigned int depth;
+	/* Error flag */
+	int error;
+};
+
+static int json_stream_write(struct json_stream *s, const char *str,
+			     size_t len)
+{
+	char *buffer;
+	size_t size;
+
+	if(s->error)
+		return -1;
+
+	/* Grow buffer (keep a byte for '\0') */
+	if(s->len + len >= s->size)
+	{
+		for(size = s->size; s->len + len >= size; size *= 2);
+		buffer = realloc(s->buffer, size);
+		if(buffer == NULL)
+		{
+			s->error = 1;
+			return -1;
+		}
+		s->buffer = buffer;
+		s->size = size;
+	}
+
+	/* Append string */
+	memcpy(s->buffer + s->len, str, len);
+	s->len += len;
+
+	return 0;
+}
+
+static int json_stream_key(struct json_stream *s, const char *key)
+{
+	const char *sep;
+
+	/* Add separator (same format than json_export()) */
+	if(s->depth > 0)
+	{
+		sep = s->count[s->depth-1]++ > 0 ? ", " : " ";
+		if(json_stream_write(s, sep, strlen(sep)) != 0)
+			return -1;
+	}
+
+	/* Add key */
+	if(key != NULL && (json_stream_write(s, "\"", 1) != 0 ||
+			   json_stream_write(s, key, strlen(key)) != 0 ||
+			   json_stream_write(s, "\": ", 3) != 0))
+		return -1;
+
+	return 0;
+}
+
+static int json_stream_begin(struct json_stream *s, const char *key,
+			     const char *c)
+{
+	/* Check depth */
+	if(s->depth == JSON_STREAM_MAX_DEPTH)
+	{
+		s->error = 1;
+		return -1;
+	}
+
+	/* Open object or array */
+	if(json_stream_key(s, key) != 0 || json_stream_write(s, c, 1) != 0)
+		return -1;
+	s->count[s->depth++] = 0;
+
+	return 0;
+}
+
+static int json_stream_end(struct json_stream *s, const char *c)
+{
+	/* Check depth */
+	if(s->depth == 0)
+	{
+		s->error = 1;
+		return -1;
+	}
+
+	/* Close object or array */
+	s->depth--;
+	if(json_stream_write(s, " ", 1) != 0)
+		return -1;
+	return json_stream_write(s, c, 1);
+}
+
+struct json_stream *json_stream_new(void)
+{
+	struct json_stream *s;
+
+	/* Allocate stream */
+	s = calloc(1, sizeof(struct json_stream));
+	if(s == NULL)
+		return NULL;
+
+	/* Allocate output string */
+	s->buffer = malloc(JSON_STREAM_SIZE);
+	if(s->buffer == NULL)
+	{
+		free(s);
+		return NULL;
+	}
+	s->size = JSON_STREAM_SIZE;
+
+	return s;
+}
+
+int json_stream_begin_object(struct json_stream *s, const char *key)
+{
+	return json_stream_begin(s, key, "{");
+}
+
+int json_stream_end_object(struct json_stream *s)
+{
+	return json_stream_end(s, "}");
+}
+
+int json_stream_begin_array(struct json_stream *s, const char *key)
+{
+	return json_stream_begin(s, key, "[");
+}
+
+int json_stream_end_array(struct json_stream *s)
+{
+	return json_stream_end(s, "]");
+}
+
+int json_stream_add(struct json_stream *s, const char *key, struct json *j)
+{
+	int ret;
+
+	/* Export and write value */
+	ret = json_stream_add_string(s, key, j != NULL ? json_export(j) :
+							 "null");
+
+	/* Free value */
+	json_free(j);
+
+	return ret;
+}
+
+int json_stream_add_string(struct json_stream *s, const char *key,
+			   const char *str)
+{
+	if(str == NULL)
+	{
+		s->error = 1;
+		return -1;
+	}
+
+	/* Write value */
+	if(json_stream_key(s, key) != 0)
+		return -1;
+	return json_stream_write(s, str, strlen(str));
+}
+
+char *json_stream_finish(struct json_stream *s, size_t *len)
+{
+	char *str = NULL;
+
+	if(s == NULL)
+		return NULL;
+
+	/* Terminate string if stream is complete */
+	if(!s->error && s->depth == 0)
+	{
+		s->buffer[s->len] = '\0';
+		if(len != NULL)
+			*len = s->len;
+		str = s->buffer;
+		s->buffer = NULL;
+	}
+
+	/* Free stream */
+	json_stream_free(s);
+
+	return str;
+}
+
+void json_stream_free(struct json_stream *s)
+{
+	if(s == NULL)
+		return;
+
+	/* Free output string */
+	if(s->buffer != NULL)
+		free(s->buffer);
+
+	free(s);
+}
@@ -0,0 +1,270 @@
+/*
+ * lock.c - Instrumented mutexes for lock contention profiling
+ *
+ * Copyright (c) 2014   A. Dilly
+ *
+ * AirCat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * AirCat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with AirCat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "lock.h"
+
+#ifdef LOCK_PROFILE
+
+#define LOAD(v) __atomic_load_n(&(v), __ATOMIC_ACQUIRE)
+#define CAS(v, o, n) __atomic_compare_exchange_n(&(v), &(o), n, 0, \
+						 __ATOMIC_ACQ_REL, \
+						 __ATOMIC_ACQUIRE)
+
+/* Maximum count of mutexes held at same time (all threads) and count of
+ * slots searched from hash of a mutex
+ */
+#define LOCK_HELD_MAX 256
+#define LOCK_HELD_PROBE 16
+
+/* Slot reserved while its hold is being started */
+#define LOCK_HELD_BUSY ((pthread_mutex_t *) 1)
+
+struct lock_held {
+	pthread_mutex_t *mutex;
+	struct lock_class *class;
+	uint64_t start;
+};
+
+struct lock_stat {
+	struct lock_class *class;
+	int64_t acquires;
+	int64_t contended;
+	int64_t wait;
+	int64_t hold;
+	uint64_t hold_count;
+};
+
+/* Registered lock classes (classes are never removed) */
+static struct lock_class *lock_list = NULL;
+
+/* Held mutexes: a mutex can be released by another thread than the one
+ * which locked it, so holds are shared between all threads (a held mutex is
+ * in one slot at most since only its holder adds or removes it)
+ */
+static struct lock_held lock_held[LOCK_HELD_MAX];
+
+static void lock_register(struct lock_class *c)
+{
+	struct lock_class *head;
+	int reg = 0;
+
+	/* Only first thread adds class to list */
+	if(!CAS(c->registered, reg, 1))
+		return;
+
+	/* Push class in list */
+	head = LOAD(lock_list);
+	do
+		c->next = head;
+	while(!CAS(lock_list, head, c));
+}
+
+static inline unsigned int lock_held_hash(pthread_mutex_t *m)
+{
+	return ((uintptr_t) m >> 4) * 2654435761u;
+}
+
+static void lock_hold_start(struct lock_class *c, pthread_mutex_t *m)
+{
+	pthread_mutex_t *free_slot;
+	struct lock_held *h;
+	unsigned int i, n;
+
+	/* Find a free slot (hold not counted when too many mutexes are held) */
+	i = lock_held_hash(m);
+	for(n = 0; n < LOCK_HELD_PROBE; n++)
+	{
+		h = &lock_held[(i + n) % LOCK_HELD_MAX];
+		free_slot = NULL;
+		if(CAS(h->mutex, free_slot, LOCK_HELD_BUSY))
+			break;
+	}
+	if(n == LOCK_HELD_PROBE)
+		return;
+
+	/* Start hold time and publish slot */
+	h->class = c;
+	h->start = metric_now();
+	__atomic_store_n(&h->mutex, m, __ATOMIC_RELEASE);
+}
+
+static void lock_acquired(struct lock_class *c, pthread_mutex_t *m)
+{
+	/* Register class on first acquire */
+	if(!LOAD(c->registered))
+		lock_register(c);
+	metric_inc(&c->acquires);
+
+	/* Start hold time */
+	lock_hold_start(c, m);
+}
+
+static void lock_released(pthread_mutex_t *m)
+{
+	struct lock_held *h;
+	unsigned int i, n;
+
+	/* Find hold of mutex (started by any thread) */
+	i = lock_held_hash(m);
+	for(n = 0; n < LOCK_HELD_PROBE; n++)
+	{
+		h = &lock_held[(i + n) % LOCK_HELD_MAX];
+		if(LOAD(h->mutex) == m)
+			break;
+	}
+	if(n == LOCK_HELD_PROBE)
+		return;
+
+	/* Add hold time and free slot */
+	metric_since(&h->class->hold, h->start);
+	__atomic_store_n(&h->mutex, NULL, __ATOMIC_RELEASE);
+}
+
+int lock_profile_lock(struct lock_class *c, pthread_mutex_t *m)
+{
+	uint64_t start;
+	int ret;
+
+	/* Mutex is free: no wait */
+	if(pthread_mutex_trylock(m) == 0)
+	{
+		lock_acquired(c, m);
+		return 0;
+	}
+
+	/* Wait for mutex */
+	start = metric_now();
+	ret = pthread_mutex_lock(m);
+	if(ret != 0)
+		return ret;
+	metric_inc(&c->contended);
+	metric_since(&c->wait, start);
+	lock_acquired(c, m);
+
+	return 0;
+}
+
+int lock_profile_trylock(struct lock_class *c, pthread_mutex_t *m)
+{
+	int ret;
+
+	ret = pthread_mutex_trylock(m);
+	if(ret == 0)
+		lock_acquired(c, m);
+
+	return ret;
+}
+
+int lock_profile_unlock(struct lock_class *c, pthread_mutex_t *m)
+{
+	lock_released(m);
+
+	return pthread_mutex_unlock(m);
+}
+
+int lock_profile_cond_wait(struct lock_class *c, pthread_cond_t *cond,
+			   pthread_mutex_t *m, const struct timespec *ts)
+{
+	int ret;
+
+	/* Mutex is released during wait: stop hold time */
+	lock_released(m);
+
+	if(ts != NULL)
+		ret = pthread_cond_timedwait(cond, m, ts);
+	else
+		ret = pthread_cond_wait(cond, m);
+
+	/* Mutex is held again (even on timeout): a wakeup is not an acquire */
+	lock_hold_start(c, m);
+
+	return ret;
+}
+
+static int lock_stat_cmp(const void *a, const void *b)
+{
+	const struct lock_stat *sa = a, *sb = b;
+
+	/* Most waited classes first */
+	return sa->wait < sb->wait ? 1 : (sa->wait > sb->wait ? -1 : 0);
+}
+
+void lock_dump(FILE *fp)
+{
+	struct lock_stat *stats;
+	struct lock_class *c;
+	struct lock_stat *s;
+	size_t count = 0, i;
+
+	/* Count registered classes */
+	for(c = LOAD(lock_list); c != NULL; c = c->next)
+		count++;
+	if(count == 0)
+		return;
+
+	/* Allocate statistics */
+	stats = calloc(count, sizeof(*stats));
+	if(stats == NULL)
+		return;
+
+	/* Get statistics of each class (new classes are added at head) */
+	for(c = LOAD(lock_list), i = 0; c != NULL && i < count; c = c->next)
+	{
+		s = &stats[i++];
+		s->class = c;
+		s->acquires = metric_get(&c->acquires, NULL);
+		s->contended = metric_get(&c->contended, NULL);
+		s->wait = metric_get(&c->wait, NULL);
+		s->hold = metric_get(&c->hold, &s->hold_count);
+	}
+	qsort(stats, i, sizeof(*stats), lock_stat_cmp);
+
+	/* Print statistics (times in us) */
+	fprintf(fp, "[lock] %-12s %12s %12s %8s %12s %10s %12s %10s\n", "name",
+		"acquires", "contended", "%", "wait", "avg wait", "hold",
+		"avg hold");
+	for(count = i, i = 0; i < count; i++)
+	{
+		s = &stats[i];
+		fprintf(fp, "[lock] %-12s %12lld %12lld %8.2f %12lld %10.1f "
+			"%12lld %10.1f\n", s->class->name,
+			(long long) s->acquires, (long long) s->contended,
+			s->acquires ? s->contended * 100.0 / s->acquires : 0.0,
+			(long long) s->wait,
+			s->contended ? (double) s->wait / s->contended : 0.0,
+			(long long) s->hold,
+			s->hold_count ? (double) s->hold / s->hold_count : 0.0);
+	}
+	fflush(fp);
+
+	free(stats);
+}
+
+#else
+
+void lock_dump(FILE *fp)
+{
+}
+
+#endif
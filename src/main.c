@@ -27,7 +27,16 @@
 #include "timers.h"
 #include "avahi.h"
 #include "httpd.h"
+#include "http.h"
 #include "fs.h"
+#include "fs_cache.h"
+#include "budget.h"
+#include "trace.h"
+#include "thread.h"
+#include "executor.h"
+#include "metrics.h"
+#include "lock.h"
+#include "db.h"
 
 #include "modules.h"
 
@@ -67,6 +76,7 @@ struct url_table config_urls[];
 static char *config_file = NULL;	/* Alternative configuration file */
 static int verbose = 0;			/* Verbosity */
 static int stop_signal = 0;		/* Stop signal */
+static int dump_signal = 0;		/* Lock statistics signal */
 
 static void print_usage(const char *name)
 {
@@ -149,6 +159,8 @@ void signal_handler(int signum)
 		printf("Received Stop signal...\n");
 		stop_signal = 1;
 	}
+	else if(signum == SIGUSR1)
+		dump_signal = 1;
 }
 
 int main(int argc, char* argv[])
@@ -173,6 +185,27 @@ int main(int argc, char* argv[])
 	/* Setup signal handler */
 	signal(SIGINT, signal_handler);
 	signal(SIGTERM, signal_handler);
+#ifdef LOCK_PROFILE
+	signal(SIGUSR1, signal_handler);
+#endif
+
+	/* Get realtime configuration from file */
+	cfg = config_get_json(config, "realtime");
+
+	/* Set thread scheduling before any thread is started */
+	thread_set_config(cfg);
+
+	/* Free realtime configuration */
+	json_free(cfg);
+
+	/* Get executor configuration from file */
+	cfg = config_get_json(config, "executor");
+
+	/* Set worker pool before any component is opened */
+	executor_set_config(cfg);
+
+	/* Free executor configuration */
+	json_free(cfg);
 
 	/* Open Avahi Client */
 	avahi_open(&avahi);
@@ -183,6 +216,42 @@ int main(int argc, char* argv[])
 	/* Open timer module */
 	timers_open(&timers);
 
+	/* Get memory configuration from file */
+	cfg = config_get_json(config, "memory");
+
+	/* Set global memory budget */
+	budget_set_config(cfg);
+
+	/* Free memory configuration */
+	json_free(cfg);
+
+	/* Get disk cache configuration from file */
+	cfg = config_get_json(config, "disk_cache");
+
+	/* Set disk cache for remote files */
+	fs_cache_set_config(cfg);
+
+	/* Free disk cache configuration */
+	json_free(cfg);
+
+	/* Get readahead configuration from file */
+	cfg = config_get_json(config, "readahead");
+
+	/* Set readahead block size of files */
+	fs_readahead_set_config(cfg);
+
+	/* Free readahead configuration */
+	json_free(cfg);
+
+	/* Get database configuration from file */
+	cfg = config_get_json(config, "database");
+
+	/* Set database connection settings */
+	db_set_config(cfg);
+
+	/* Free database configuration */
+	json_free(cfg);
+
 	/* Get Output configuration from file */
 	cfg = config_get_json(config, "output");
 
@@ -219,6 +288,11 @@ int main(int argc, char* argv[])
 	httpd_add_urls(httpd, "modules", modules_urls, modules);
 	httpd_add_urls(httpd, "events", events_urls, events);
 	httpd_add_urls(httpd, "timers", timers_urls, timers);
+	httpd_add_urls(httpd, "memory", budget_urls, NULL);
+	httpd_add_urls(httpd, "trace", trace_urls, NULL);
+	httpd_add_urls(httpd, "executor", executor_urls, NULL);
+	httpd_add_urls(httpd, "metrics", metrics_urls, NULL);
+	httpd_add_urls(httpd, "disk_cache", fs_cache_urls, NULL);
 
 	/* Start HTTP Server */
 	httpd_start(httpd);
@@ -245,6 +319,13 @@ int main(int argc, char* argv[])
 
 		/* Refresh modules */
 		modules_refresh(modules, httpd, avahi, outputs, events, timers);
+
+		/* Print lock statistics */
+		if(dump_signal)
+		{
+			dump_signal = 0;
+			lock_dump(stderr);
+		}
 	}
 
 	/* Unregister all timer events */
@@ -282,6 +363,9 @@ int main(int argc, char* argv[])
 	/* Free file system */
 	fs_free();
 
+	/* Close idle HTTP connections */
+	http_free_default_options();
+
 	return EXIT_SUCCESS;
 }
 
@@ -292,6 +376,24 @@ int main(int argc, char* argv[])
 static int config_httpd_default(void *user_data, struct httpd_req *req,
 				struct httpd_res **res)
 {
+	/* Set memory budget to default */
+	budget_set_config(NULL);
+
+	/* Set thread scheduling to default */
+	thread_set_config(NULL);
+
+	/* Set worker pool to default */
+	executor_set_config(NULL);
+
+	/* Set disk cache to default */
+	fs_cache_set_config(NULL);
+
+	/* Set readahead to default */
+	fs_readahead_set_config(NULL);
+
+	/* Set database settings to default */
+	db_set_config(NULL);
+
 	/* Set Audio output to default */
 	outputs_set_config(outputs, NULL);
 
@@ -312,6 +414,60 @@ static int config_httpd_reload(void *user_data, struct httpd_req *req,
 	/* Load config from file */
 	config_load(config);
 
+	/* Get memory configuration from file */
+	cfg = config_get_json(config, "memory");
+
+	/* Set memory budget configuration */
+	budget_set_config(cfg);
+
+	/* Free configuration */
+	json_free(cfg);
+
+	/* Get realtime configuration from file */
+	cfg = config_get_json(config, "realtime");
+
+	/* Set thread scheduling configuration */
+	thread_set_config(cfg);
+
+	/* Free configuration */
+	json_free(cfg);
+
+	/* Get executor configuration from file */
+	cfg = config_get_json(config, "executor");
+
+	/* Set worker pool configuration */
+	executor_set_config(cfg);
+
+	/* Free configuration */
+	json_free(cfg);
+
+	/* Get disk cache configuration from file */
+	cfg = config_get_json(config, "disk_cache");
+
+	/* Set disk cache configuration */
+	fs_cache_set_config(cfg);
+
+	/* Free configuration */
+	json_free(cfg);
+
+	/* Get readahead configuration from file */
+	cfg = config_get_json(config, "readahead");
+
+	/* Set readahead configuration */
+	fs_readahead_set_config(cfg);
+
+	/* Free configuration */
+	json_free(cfg);
+
+	/* Get database configuration from file */
+	cfg = config_get_json(config, "database");
+
+	/* Set database configuration */
+	db_set_config(cfg);
+
+	/* Free configuration */
+	json_free(cfg);
+
 	/* Get Audio output configuration from file */
 	cfg = config_get_json(config, "output");
 
@@ -347,6 +503,60 @@ static int config_httpd_save(void *user_data, struct httpd_req *req,
 {
 	struct json *cfg = NULL;
 
+	/* Get memory budget configuration */
+	cfg = budget_get_config();
+
+	/* Set memory configuration in file */
+	config_set_json(config, "memory", cfg);
+
+	/* Free configuration */
+	json_free(cfg);
+
+	/* Get thread scheduling configuration */
+	cfg = thread_get_config();
+
+	/* Set realtime configuration in file */
+	config_set_json(config, "realtime", cfg);
+
+	/* Free configuration */
+	json_free(cfg);
+
+	/* Get worker pool configuration */
+	cfg = executor_get_config();
+
+	/* Set executor configuration in file */
+	config_set_json(config, "executor", cfg);
+
+	/* Free configuration */
+	json_free(cfg);
+
+	/* Get disk cache configuration */
+	cfg = fs_cache_get_config();
+
+	/* Set disk cache configuration in file */
+	config_set_json(config, "disk_cache", cfg);
+
+	/* Free configuration */
+	json_free(cfg);
+
+	/* Get readahead configuration */
+	cfg = fs_readahead_get_config();
+
+	/* Set readahead configuration in file */
+	config_set_json(config, "readahead", cfg);
+
+	/* Free configuration */
+	json_free(cfg);
+
+	/* Get database configuration */
+	cfg = db_get_config();
+
+	/* Set database configuration in file */
+	config_set_json(config, "database", cfg);
+
+	/* Free configuration */
+	json_free(cfg);
+
 	/* Get Audio output configuration from module */
 	cfg = outputs_get_config(outputs);
 
@@ -392,6 +602,60 @@ static int config_httpd(void *user_data, struct httpd_req *req,
 		/* Create a JSON object */
 		json = json_new();
 
+		/* Get memory budget configuration */
+		if(req->resource == NULL || *req->resource == '\0' ||
+		   strcmp(req->resource, "memory") == 0)
+		{
+			tmp = budget_get_config();
+			if(tmp != NULL)
+				json_add(json, "memory", tmp);
+		}
+
+		/* Get thread scheduling configuration */
+		if(req->resource == NULL || *req->resource == '\0' ||
+		   strcmp(req->resource, "realtime") == 0)
+		{
+			tmp = thread_get_config();
+			if(tmp != NULL)
+				json_add(json, "realtime", tmp);
+		}
+
+		/* Get worker pool configuration */
+		if(req->resource == NULL || *req->resource == '\0' ||
+		   strcmp(req->resource, "executor") == 0)
+		{
+			tmp = executor_get_config();
+			if(tmp != NULL)
+				json_add(json, "executor", tmp);
+		}
+
+		/* Get disk cache configuration */
+		if(req->resource == NULL || *req->resource == '\0' ||
+		   strcmp(req->resource, "disk_cache") == 0)
+		{
+			tmp = fs_cache_get_config();
+			if(tmp != NULL)
+				json_add(json, "disk_cache", tmp);
+		}
+
+		/* Get readahead configuration */
+		if(req->resource == NULL || *req->resource == '\0' ||
+		   strcmp(req->resource, "readahead") == 0)
+		{
+			tmp = fs_readahead_get_config();
+			if(tmp != NULL)
+				json_add(json, "readahead", tmp);
+		}
+
+		/* Get database configuration */
+		if(req->resource == NULL || *req->resource == '\0' ||
+		   strcmp(req->resource, "database") == 0)
+		{
+			tmp = db_get_config();
+			if(tmp != NULL)
+				json_add(json, "database", tmp);
+		}
+
 		/* Get Audio output configuration from module */
 		if(req->resource == NULL || *req->resource == '\0' ||
 		   strcmp(req->resource, "output") == 0)
@@ -457,6 +721,54 @@ static int config_httpd(void *user_data, struct httpd_req *req,
 			   strcmp(req->resource, str) != 0)
 				continue;
 
+			/* Set memory budget configuration */
+			if(strcmp(str, "memory") == 0)
+			{
+				/* Set configuration */
+				budget_set_config(tmp);
+				continue;
+			}
+
+			/* Set thread scheduling configuration */
+			if(strcmp(str, "realtime") == 0)
+			{
+				/* Set configuration */
+				thread_set_config(tmp);
+				continue;
+			}
+
+			/* Set worker pool configuration */
+			if(strcmp(str, "executor") == 0)
+			{
+				/* Set configuration */
+				executor_set_config(tmp);
+				continue;
+			}
+
+			/* Set disk cache configuration */
+			if(strcmp(str, "disk_cache") == 0)
+			{
+				/* Set configuration */
+				fs_cache_set_config(tmp);
+				continue;
+			}
+
+			/* Set readahead configuration */
+			if(strcmp(str, "readahead") == 0)
+			{
+				/* Set configuration */
+				fs_readahead_set_config(tmp);
+				continue;
+			}
+
+			/* Set database configuration */
+			if(strcmp(str, "database") == 0)
+			{
+				/* Set configuration */
+				db_set_config(tmp);
+				continue;
+			}
+
 			/* Set Audio output configuration */
 			if(strcmp(str, "output") == 0)
 			{
@@ -20,6 +20,7 @@
 #include <stdlib.h>
 
 #include "meta.h"
+#include "meta_native.h"
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
@@ -28,7 +29,8 @@
 #ifndef HAVE_TAGLIB
 struct meta *meta_parse(const char *filename, int options)
 {
-	return NULL;
+	/* Only native parser is available */
+	return meta_native_parse(filename, options);
 }
 #endif
 
@@ -0,0 +1,240 @@
+/*
+ * meta_native.c - A fast tag extractor for scan (based on demuxers)
+ *
+ * Copyright (c) 2014   A. Dilly
+ *
+ * AirCat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * AirCat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with AirCat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "meta_native.h"
+#include "demux/demux_mp3.h"
+#include "demux/demux_mp4.h"
+#include "demux/id3.h"
+#include "fs.h"
+
+/* APE tag footer (before ID3v1 tag or at end of file) */
+#define APE_FOOTER_SIZE 32
+#define META_NATIVE_TAIL_SIZE (APE_FOOTER_SIZE + ID3V1_SIZE)
+
+static int meta_native_read(struct fs_file *f, unsigned char *buffer,
+			    size_t len)
+{
+	size_t pos = 0;
+	ssize_t ret;
+
+	/* Read all asked bytes */
+	while(pos < len)
+	{
+		ret = fs_read(f, buffer + pos, len - pos);
+		if(ret <= 0)
+			return -1;
+		pos += ret;
+	}
+
+	return 0;
+}
+
+static char *meta_native_strdup(const char *str)
+{
+	return str != NULL && *str != '\0' ? strdup(str) : NULL;
+}
+
+static void meta_native_get_properties(struct meta *m, const struct meta *d)
+{
+	/* Copy stream properties found by demuxer */
+	m->length = d->length;
+	m->bitrate = d->bitrate;
+	m->samplerate = d->samplerate;
+	m->channels = d->channels;
+	m->stream_offset = d->stream_offset;
+}
+
+static struct meta *meta_native_mp3(struct fs_file *f, size_t size,
+				    int options)
+{
+	unsigned char header[ID3V2_HEADER_SIZE];
+	unsigned char tail[META_NATIVE_TAIL_SIZE];
+	unsigned char *buffer;
+	struct demux *d = NULL;
+	unsigned long samplerate;
+	unsigned char channels;
+	struct meta *m;
+	size_t len;
+
+	/* Allocate meta */
+	m = calloc(1, sizeof(struct meta));
+	if(m == NULL)
+		return NULL;
+	m->type = FILE_FORMAT_MPEG;
+
+	/* Read ID3v2 tag at once */
+	if(meta_native_read(f, header, ID3V2_HEADER_SIZE) != 0)
+		goto error;
+	len = id3v2_size(header);
+	if(len > 0)
+	{
+		/* Tag is too big to be read */
+		if(len > META_NATIVE_TAG_MAX || len > size)
+			goto error;
+
+		/* Read tag */
+		buffer = malloc(len);
+		if(buffer == NULL)
+			goto error;
+		memcpy(buffer, header, ID3V2_HEADER_SIZE);
+		if(meta_native_read(f, buffer + ID3V2_HEADER_SIZE,
+				    len - ID3V2_HEADER_SIZE) != 0 ||
+		   id3v2_parse(buffer, len, m, options) != 0)
+		{
+			free(buffer);
+			goto error;
+		}
+		free(buffer);
+	}
+
+	/* Read end of file for ID3v1 and APE tags */
+	if(size >= len + META_NATIVE_TAIL_SIZE)
+	{
+		if(fs_lseek(f, size - META_NATIVE_TAIL_SIZE, SEEK_SET) < 0 ||
+		   meta_native_read(f, tail, META_NATIVE_TAIL_SIZE) != 0)
+			goto error;
+
+		/* APE tags are not supported */
+		if(memcmp(tail, "APETAGEX", 8) == 0 ||
+		   memcmp(&tail[ID3V1_SIZE], "APETAGEX", 8) == 0)
+			goto error;
+
+		/* Complete missing tags with ID3v1 */
+		id3v1_parse(&tail[APE_FOOTER_SIZE], m);
+	}
+
+	/* Get stream properties from first frames */
+	if(fs_lseek(f, 0, SEEK_SET) != 0 ||
+	   demux_mp3.open(&d, f, size, &samplerate, &channels, 0) != 0)
+		goto error;
+	meta_native_get_properties(m, demux_mp3.get_meta(d));
+	demux_mp3.close(d);
+
+	return m;
+
+error:
+	if(d != NULL)
+		demux_mp3.close(d);
+	meta_free(m);
+	return NULL;
+}
+
+static struct meta *meta_native_mp4(struct fs_file *f, size_t size,
+				    int options)
+{
+	struct demux *d = NULL;
+	unsigned long samplerate;
+	unsigned char channels;
+	unsigned int flags;
+	struct meta *dm;
+	struct meta *m;
+
+	/* Allocate meta */
+	m = calloc(1, sizeof(struct meta));
+	if(m == NULL)
+		return NULL;
+	m->type = FILE_FORMAT_AAC;
+
+	/* Parse "moov" atom with tags */
+	flags = DEMUX_META_TAGS;
+	if(options & TAG_PICTURE)
+		flags |= DEMUX_META_PICTURE;
+	if(demux_mp4.open(&d, f, size, &samplerate, &channels, flags) != 0)
+		goto error;
+	dm = demux_mp4.get_meta(d);
+
+	/* Copy tags */
+	m->title = meta_native_strdup(dm->title);
+	m->artist = meta_native_strdup(dm->artist);
+	m->album = meta_native_strdup(dm->album);
+	m->comment = meta_native_strdup(dm->comment);
+	m->genre = meta_native_strdup(dm->genre);
+	m->track = dm->track;
+	m->year = dm->year;
+	if(options & TAG_TOTAL_TRACK)
+		m->total_track = dm->total_track;
+	meta_native_get_properties(m, dm);
+
+	/* Copy picture */
+	if(dm->picture.data != NULL && dm->picture.size > 0)
+	{
+		m->picture.data = malloc(dm->picture.size);
+		if(m->picture.data != NULL)
+		{
+			memcpy(m->picture.data, dm->picture.data,
+			       dm->picture.size);
+			m->picture.size = dm->picture.size;
+			m->picture.mime = meta_native_strdup(dm->picture.mime);
+		}
+	}
+	demux_mp4.close(d);
+
+	return m;
+
+error:
+	if(d != NULL)
+		demux_mp4.close(d);
+	meta_free(m);
+	return NULL;
+}
+
+struct meta *meta_native_parse(const char *filename, int options)
+{
+	struct meta *m = NULL;
+	struct fs_file *f;
+	struct stat st;
+	const char *ext;
+	int len;
+
+	/* Get format from file extension (as demuxer) */
+	if(filename == NULL || (len = strlen(filename)) < 4)
+		return NULL;
+	ext = &filename[len-4];
+	if(strcasecmp(ext, ".mp3") != 0 && strcasecmp(ext, ".m4a") != 0 &&
+	   strcasecmp(ext, ".mp4") != 0)
+		return NULL;
+
+	/* Open file: only a few small regions are read */
+	f = fs_open(filename, O_RDONLY, 0);
+	if(f == NULL)
+		return NULL;
+	fs_advise(f, 0, 0, FS_ADVICE_RANDOM);
+	if(fs_fstat(f, &st) != 0)
+		goto end;
+
+	/* Parse file */
+	if(strcasecmp(ext, ".mp3") == 0)
+		m = meta_native_mp3(f, st.st_size, options);
+	else
+		m = meta_native_mp4(f, st.st_size, options);
+
+end:
+	fs_close(f);
+	return m;
+}
@@ -0,0 +1,42 @@
+/*
+ * meta_native.h - A fast tag extractor for scan (based on demuxers)
+ *
+ * Copyright (c) 2014   A. Dilly
+ *
+ * AirCat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * AirCat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with AirCat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _META_NATIVE_H
+#define _META_NATIVE_H
+
+#include "meta.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Largest ID3v2 tag read (larger tags are left to TagLib) */
+#define META_NATIVE_TAG_MAX (16 * 1024 * 1024)
+
+/**
+ * Get tags and properties of a MP3 or MP4/AAC file by reading only its tag
+ * region and first frames. NULL is returned if the format or the tag is not
+ * supported: a complete parser should be used then.
+ */
+struct meta *meta_native_parse(const char *filename, int options);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
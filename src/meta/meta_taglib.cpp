@@ -50,6 +50,7 @@
 #include <taglib/attachedpictureframe.h>
 
 #include "meta_taglib_file.h"
+#include "meta_native.h"
 #include "meta.h"
 
 #define COPY_STRING(d, s) d = ::strdup(s.toCString())
@@ -221,6 +222,14 @@ struct meta *meta_parse(const char *filename, int options)
 	File *file;
 	Tag *tag;
 
+	/* Use fast native parser during scan */
+	if(options & TAG_SCAN)
+	{
+		m = meta_native_parse(filename, options);
+		if(m != NULL)
+			return m;
+	}
+
 #if (TAGLIB_MAJOR_VERSION >= 1) &&  (TAGLIB_MINOR_VERSION >= 9)
 	/* Open file */
 	std::string strFileName = filename;
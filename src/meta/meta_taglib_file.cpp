@@ -29,12 +29,18 @@ MetaTaglibFile::MetaTaglibFile(const std::string& openFileName,
     isReadOnly = true;
     fileName = openFileName;
 
-    /* Open file */
-    file = fs_open(fileName.c_str(), O_RDONLY, 0);
+    /* Open file: map it since tags are parsed with many small reads */
+    file = fs_open(fileName.c_str(), O_RDONLY | FS_O_MMAP, 0);
+
+    /* Tags are only at start and end of file: avoid kernel readahead */
+    fs_advise(file, 0, 0, FS_ADVICE_RANDOM);
 }
 
 MetaTaglibFile::~MetaTaglibFile()
 {
+    /* Drop file from page cache: not needed when scanning a library */
+    fs_advise(file, 0, 0, FS_ADVICE_DONTNEED);
+
     /* Close file */
     fs_close(file);
 }
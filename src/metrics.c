@@ -0,0 +1,203 @@
+/*
+ * metrics.c - Registry of counters, gauges and histograms
+ *
+ * Copyright (c) 2014   A. Dilly
+ *
+ * AirCat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * AirCat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with AirCat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "metrics.h"
+
+#define LOAD(v) __atomic_load_n(&(v), __ATOMIC_ACQUIRE)
+#define ADD(v, x) __atomic_add_fetch(&(v), x, __ATOMIC_RELAXED)
+#define CAS(v, o, n) __atomic_compare_exchange_n(&(v), &(o), n, 0, \
+						 __ATOMIC_ACQ_REL, \
+						 __ATOMIC_ACQUIRE)
+
+/* Content type of Prometheus text format */
+#define METRICS_TYPE "text/plain; version=0.0.4"
+
+/* Upper bounds of histogram buckets (in us) */
+static const uint64_t metric_bounds[METRIC_BUCKETS - 1] = {
+	10, 50, 100, 500, 1000, 5000, 10000, 50000, 100000, 500000, 1000000
+};
+
+static const char *metric_types[] = {
+	[METRIC_COUNTER] = "counter",
+	[METRIC_GAUGE] = "gauge",
+	[METRIC_HISTOGRAM] = "histogram",
+};
+
+/* Registered metrics (metrics are never removed) */
+static struct metric *metric_list = NULL;
+
+/* Slot of calling thread (-1 until first update) */
+static unsigned int metric_next_slot = 0;
+static __thread int metric_slot = -1;
+
+static void metric_register(struct metric *m)
+{
+	struct metric *head;
+	int reg = 0;
+
+	/* Only first thread adds metric to list */
+	if(!CAS(m->registered, reg, 1))
+		return;
+
+	/* Push metric in list */
+	head = LOAD(metric_list);
+	do
+		m->next = head;
+	while(!CAS(metric_list, head, m));
+}
+
+static inline struct metric_slot *metric_get_slot(struct metric *m)
+{
+	/* Register metric on first update */
+	if(!LOAD(m->registered))
+		metric_register(m);
+
+	/* Threads get slots in turn */
+	if(metric_slot < 0)
+		metric_slot = ADD(metric_next_slot, 1) % METRIC_SLOTS;
+
+	return &m->slots[metric_slot];
+}
+
+void metric_add(struct metric *m, int64_t value)
+{
+	ADD(metric_get_slot(m)->value, value);
+}
+
+void metric_observe(struct metric *m, uint64_t us)
+{
+	struct metric_slot *s = metric_get_slot(m);
+	int i;
+
+	/* Find bucket of duration */
+	for(i = 0; i < METRIC_BUCKETS - 1 && us > metric_bounds[i]; i++);
+
+	/* Update bucket, count and sum */
+	ADD(s->buckets[i], 1);
+	ADD(s->count, 1);
+	ADD(s->value, us);
+}
+
+uint64_t metric_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+int64_t metric_get(struct metric *m, uint64_t *count)
+{
+	int64_t value = 0;
+	int i;
+
+	/* Sum slots */
+	if(count != NULL)
+		*count = 0;
+	for(i = 0; i < METRIC_SLOTS; i++)
+	{
+		value += LOAD(m->slots[i].value);
+		if(count != NULL)
+			*count += LOAD(m->slots[i].count);
+	}
+
+	return value;
+}
+
+static void metric_print(FILE *fp, struct metric *m)
+{
+	uint64_t buckets[METRIC_BUCKETS];
+	uint64_t count = 0;
+	int64_t value = 0;
+	int i, j;
+
+	/* Sum slots */
+	memset(buckets, 0, sizeof(buckets));
+	for(i = 0; i < METRIC_SLOTS; i++)
+	{
+		value += LOAD(m->slots[i].value);
+		count += LOAD(m->slots[i].count);
+		for(j = 0; j < METRIC_BUCKETS; j++)
+			buckets[j] += LOAD(m->slots[i].buckets[j]);
+	}
+
+	/* Print header */
+	fprintf(fp, "# HELP %s %s\n# TYPE %s %s\n", m->name, m->help, m->name,
+		metric_types[m->type]);
+
+	/* Print counter or gauge */
+	if(m->type != METRIC_HISTOGRAM)
+	{
+		fprintf(fp, "%s %lld\n", m->name, (long long) value);
+		return;
+	}
+
+	/* Print cumulative buckets, sum and count (in seconds) */
+	for(i = 0; i < METRIC_BUCKETS; i++)
+	{
+		buckets[i] += i > 0 ? buckets[i-1] : 0;
+		if(i < METRIC_BUCKETS - 1)
+			fprintf(fp, "%s_bucket{le=\"%g\"} %llu\n", m->name,
+				metric_bounds[i] / 1000000.0,
+				(unsigned long long) buckets[i]);
+	}
+	fprintf(fp, "%s_bucket{le=\"+Inf\"} %llu\n", m->name,
+		(unsigned long long) buckets[METRIC_BUCKETS - 1]);
+	fprintf(fp, "%s_sum %g\n%s_count %llu\n", m->name, value / 1000000.0,
+		m->name, (unsigned long long) count);
+}
+
+static int metrics_httpd_get(void *user_data, struct httpd_req *req,
+			     struct httpd_res **res)
+{
+	struct metric *m;
+	size_t len;
+	char *str;
+	FILE *fp;
+
+	/* Open a string stream */
+	fp = open_memstream(&str, &len);
+	if(fp == NULL)
+		return 500;
+
+	/* Print all registered metrics */
+	for(m = LOAD(metric_list); m != NULL; m = m->next)
+		metric_print(fp, m);
+	fclose(fp);
+
+	/* Create response */
+	*res = httpd_new_response(str, 1, 0);
+	httpd_add_header(*res, HTTPD_HEADER_CONTENT_TYPE, METRICS_TYPE);
+
+	return 200;
+}
+
+struct url_table metrics_urls[] = {
+	{"", 0, HTTPD_GET, 0, &metrics_httpd_get},
+	{0, 0, 0, 0}
+};
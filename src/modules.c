@@ -26,8 +26,10 @@
 #include <dirent.h>
 #include <string.h>
 #include <pthread.h>
+#include <time.h>
 
 #include "modules.h"
+#include "thread.h"
 
 #define FREE_STRING(s) if(s != NULL) free(s);
 
@@ -38,6 +40,13 @@ struct module_list {
 	char *description;
 	int enabled;
 	int opened;
+	int lazy;
+	/* Module startup */
+	struct module_attr attr;
+	pthread_t thread;
+	int starting;
+	int threaded;
+	int ret;
 	/* Module pointers */
 	void *lib;
 	void *handle;
@@ -47,6 +56,7 @@ struct module_list {
 	struct output_handle *out;
 	struct event_handle *event;
 	struct timer_handle *timer;
+	struct modules_handle *modules;
 	/* Next module in list */
 	struct module_list *next;
 };
@@ -130,6 +140,10 @@ int modules_open(struct modules_handle **handle, struct json *config,
 		l->description = strdup(mod->description);
 		l->enabled = 1;
 		l->opened = 0;
+		l->lazy = 0;
+		l->starting = 0;
+		l->threaded = 0;
+		l->modules = h;
 		l->lib = lib;
 		l->mod = mod;
 		l->handle = NULL;
@@ -185,9 +199,12 @@ int modules_set_config(struct modules_handle *h, struct json *cfg,
 		/* Get JSON */
 		c = json_get(h->configs, l->id);
 
-		/* Add enabled status */
+		/* Add enabled and lazy status */
 		if(cfg != NULL)
+		{
 			l->enabled = json_get_bool(c, "enabled");
+			l->lazy = json_get_bool(c, "lazy");
+		}
 
 		/* Update module configuration */
 		if(l->enabled != 0 && l->opened != 0 &&
@@ -227,11 +244,17 @@ struct json *modules_get_config(struct modules_handle *h, const char *name)
 			/* Get configuration */
 			cfg = l->mod->get_config(l->handle);
 		}
+		else if(l->opened != 0 && l->handle == NULL)
+		{
+			/* Lazy module not opened yet: keep its configuration */
+			cfg = json_copy(json_get(h->configs, l->id));
+		}
 		if(cfg == NULL)
 			cfg = json_new();
 
-		/* Add enabled status */
+		/* Add enabled and lazy status */
 		json_set_bool(cfg, "enabled", l->enabled);
+		json_set_bool(cfg, "lazy", l->lazy);
 
 		/* Update in local configuration */
 		json_add(h->configs, l->id, cfg);
@@ -296,15 +319,76 @@ void modules_free_list(char **list, int count)
 	free(list);
 }
 
+static void modules_open_module(struct module_list *l)
+{
+	struct timespec start, end;
+	unsigned long ms;
+
+	/* Open module */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	l->ret = l->mod->open(&l->handle, &l->attr);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	/* Log startup time with other diagnostics */
+	ms = (end.tv_sec - start.tv_sec) * 1000 +
+	     (end.tv_nsec - start.tv_nsec) / 1000000;
+	if(l->ret == 0)
+		fprintf(stderr, "[modules] %s opened in %lu ms\n", l->id, ms);
+}
+
+static void *modules_open_thread(void *user_data)
+{
+	/* Set thread scheduling and name */
+	thread_setup(THREAD_DEFAULT, "module-open");
+
+	modules_open_module((struct module_list *) user_data);
+
+	return NULL;
+}
+
+static void modules_open_failed(struct module_list *l)
+{
+	fprintf(stderr, "Failed to open %s module!\n", l->id);
+	if(l->mod->close != NULL)
+		l->mod->close(l->handle);
+	l->handle = NULL;
+}
+
+static void *modules_lazy_open(void *user_data)
+{
+	struct module_list *l = user_data;
+	struct modules_handle *h = l->modules;
+	void *handle;
+
+	/* Lock modules access */
+	pthread_mutex_lock(&h->mutex);
+
+	/* Open module if still enabled */
+	if(l->handle == NULL && l->enabled != 0 && l->opened != 0)
+	{
+		/* Get current module configuration */
+		l->attr.config = json_get(h->configs, l->id);
+
+		/* Open module */
+		modules_open_module(l);
+		if(l->ret != 0)
+			modules_open_failed(l);
+	}
+	handle = l->handle;
+
+	/* Unlock modules access */
+	pthread_mutex_unlock(&h->mutex);
+
+	return handle;
+}
+
 void modules_refresh(struct modules_handle *h, struct httpd_handle *httpd, 
 		     struct avahi_handle *avahi, struct outputs_handle *outputs,
 		     struct events_handle *events,
 		     struct timers_handle *timers)
 {
-	struct module_attr attr;
 	struct module_list *l;
 	struct json *cfg;
-	int ret;
 
 	if(h == NULL)
 		return;
@@ -375,39 +459,66 @@ void modules_refresh(struct modules_handle *h, struct httpd_handle *httpd,
 			db_open(&l->db, l->path, l->id);
 
 			/* Prepare attributes */
-			attr.path = l->path;
-			attr.output = l->out;
-			attr.event = l->event;
-			attr.timer = l->timer;
-			attr.avahi = avahi;
-			attr.db = l->db;
+			l->attr.path = l->path;
+			l->attr.output = l->out;
+			l->attr.event = l->event;
+			l->attr.timer = l->timer;
+			l->attr.avahi = avahi;
+			l->attr.db = l->db;
 
 			/* Get module configuration from file */
-			attr.config = json_get(h->configs, l->id);
+			l->attr.config = json_get(h->configs, l->id);
+
+			/* Open module in its own thread: modules are
+			 * independent, so their startups are done in parallel
+			 * and the slowest one only delays the others' URLs.
+			 * A lazy module is opened on its first HTTP request.
+			 */
+			l->starting = 1;
+			l->threaded = 0;
+			l->ret = 0;
+			if(l->mod->open == NULL ||
+			   (l->lazy != 0 && l->mod->urls != NULL))
+				continue;
+			if(pthread_create(&l->thread, NULL,
+					  &modules_open_thread, l) == 0)
+				l->threaded = 1;
+			else
+				modules_open_module(l);
+		}
+	}
 
-			/* Open module */
-			if(l->mod->open != NULL)
-			{
-				ret = l->mod->open(&l->handle, &attr);
-				if(ret != 0)
-				{
-					fprintf(stderr,
-						"Failed to open %s module!\n",
-						l->id);
-					if(l->mod->close != NULL)
-						l->mod->close(l->handle);
-					l->handle = NULL;
-					continue;
-				}
-			}
+	/* Wait end of module startups */
+	for(l = h->list; l != NULL; l = l->next)
+	{
+		if(l->starting == 0)
+			continue;
+		l->starting = 0;
+
+		/* Wait module thread */
+		if(l->threaded != 0)
+			pthread_join(l->thread, NULL);
+		l->threaded = 0;
+
+		/* Module cannot be opened: retry on next refresh call */
+		if(l->ret != 0)
+		{
+			modules_open_failed(l);
+			continue;
+		}
 
-			/* Add module URLs to HTTP server */
-			if(l->mod->urls != NULL)
+		/* Add module URLs to HTTP server */
+		if(l->mod->urls != NULL)
+		{
+			if(l->lazy != 0 && l->mod->open != NULL)
+				httpd_add_lazy_urls(httpd, l->id, l->mod->urls,
+						    &modules_lazy_open, l);
+			else
 				httpd_add_urls(httpd, l->id, l->mod->urls,
 					       l->handle);
-
-			l->opened = 1;
 		}
+
+		l->opened = 1;
 	}
 
 	/* Unlock modules access */
@@ -19,15 +19,23 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
 #include <pthread.h>
 
 #include <asoundlib.h>
 
 #include "output_alsa.h"
+#include "output_mix.h"
 #include "output.h"
 
 #include "resample.h"
 #include "cache.h"
+#include "pool.h"
+#include "trace.h"
+#include "thread.h"
+#include "lock.h"
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
@@ -41,11 +49,80 @@
 /* Maximum time before stopping PCM output (default: 5s) */
 #define MAX_SILENCE 5
 
+/* Maximum time to wait for a free period in mmap mode (in ms) */
+#define MAX_WAIT 1000
+
+/* Maximum count of pre-mix worker threads */
+#define MAX_WORKERS 8
+
+/* Cached time needed to play streams again after a format change (in ms) */
+#define REFORMAT_READY 200
+
+/* Pre-mix staging buffer states */
+enum output_stage_state {
+	STAGE_EMPTY,	/*!< Staging buffer can be filled by a worker */
+	STAGE_BUSY,	/*!< A worker is filling the staging buffer */
+	STAGE_READY,	/*!< Staging buffer contains a period to mix */
+	STAGE_MIXING	/*!< Mixer is reading the staging buffer */
+};
+
+/* Fades around a reconfiguration: the last period on previous PCM is faded
+ * out and the first period on new PCM is faded in, to avoid clicks */
+enum output_fade {
+	FADE_NONE,
+	FADE_IN,
+	FADE_OUT
+};
+
+/* Area given by output_alsa_reserve_stream(): samples are written directly in
+ * cache when resampler passes them through, or in a buffer which goes through
+ * resampler on commit */
+enum output_reserve {
+	RESERVE_NONE,
+	RESERVE_CACHE,
+	RESERVE_BUFFER
+};
+
+/* Default ALSA device */
+#define DEFAULT_DEVICE "default"
+
+/* Device sample formats, ordered by conversion cost from mixed samples */
+struct output_alsa_format {
+	const char *name;
+	snd_pcm_format_t alsa;
+	enum output_mix_format mix;
+	size_t size;
+};
+
+static const struct output_alsa_format output_alsa_formats[] = {
 #ifdef USE_FLOAT
- 	#define ALSA_FORMAT SND_PCM_FORMAT_FLOAT
-#else
-	#define ALSA_FORMAT SND_PCM_FORMAT_S32
+	{"float", SND_PCM_FORMAT_FLOAT, OUTPUT_MIX_FLOAT, 4},
 #endif
+	{"s32", SND_PCM_FORMAT_S32, OUTPUT_MIX_S32, 4},
+	{"s24", SND_PCM_FORMAT_S24, OUTPUT_MIX_S24, 4},
+	{"s16", SND_PCM_FORMAT_S16, OUTPUT_MIX_S16, 2},
+#ifndef USE_FLOAT
+	{"float", SND_PCM_FORMAT_FLOAT, OUTPUT_MIX_FLOAT, 4},
+#endif
+	{NULL, SND_PCM_FORMAT_UNKNOWN, 0, 0}
+};
+
+/* Atomic accessors for values shared between control calls and the mixer.
+ * The mixer never takes the output mutex: streams are published and removed
+ * with an RCU-like scheme (see output_alsa_synchronize()).
+ */
+#define LOAD(v) __atomic_load_n(&(v), __ATOMIC_ACQUIRE)
+#define STORE(v, x) __atomic_store_n(&(v), x, __ATOMIC_RELEASE)
+
+/* Statistics accessors: no ordering is required */
+#define STAT_GET(v) __atomic_load_n(&(v), __ATOMIC_RELAXED)
+#define STAT_SET(v, x) __atomic_store_n(&(v), x, __ATOMIC_RELAXED)
+#define STAT_INC(v) __atomic_add_fetch(&(v), 1, __ATOMIC_RELAXED)
+
+struct output_event {
+	output_stream_event_cb cb;
+	void *user_data;
+};
 
 struct output_stream {
 	/* Resample object */
@@ -53,47 +130,324 @@ struct output_stream {
 	/* Format */
 	unsigned long samplerate;
 	unsigned char channels;
-	/* Stream status */
+	/* Input and resampler settings (to open resampler again) */
+	a_read_cb input_callback;
+	void *user_data;
+	struct resample_profile profile;
+	double ratio;
+	/* Stream status (atomic) */
 	int is_playing;
 	int end_of_stream;
 	uint64_t played;
 	int abort;
-	/* Stream volume */
+	/* Input callback of cache is locked (after a flush or an abort of a
+	 * stream not playing) */
+	int input_locked;
+	/* Stream volume (atomic) */
 	unsigned int volume;
 	/* Stream cache */
 	struct cache_handle *cache;
 	unsigned long delay;
-	/* Stream event callback */
-	output_stream_event_cb event_cb;
-	void *event_ud;
+	/* Reserved area for zero-copy writes */
+	enum output_reserve reserve;
+	unsigned char *reserve_area;
+	unsigned char *reserve_buffer;
+	size_t reserve_size;
+	/* Committed samples not yet taken by resampler */
+	size_t reserve_pending;
+	struct a_format reserve_fmt;
+	/* Stream event callback (replaced atomically) */
+	struct output_event *event;
 	int buffering;
+	/* Cache starvations (atomic) */
+	int starved;
+	unsigned long starvations;
+	/* Pre-mix staging buffer (state is atomic) */
+	enum output_stage_state stage_state;
+	mix_sample_t *stage;
+	size_t stage_size;
+	size_t stage_pos;
+	/* Latency tracing (atomic) and samples mixed in last period (only used
+	 * by mixer thread) */
+	struct trace *trace;
+	size_t mixed;
 	/* Next output stream in list */
 	struct output_stream *next;
 };
 
+struct output_worker {
+	struct output *output;
+	pthread_t thread;
+	/* Worker pass counter: odd while the worker walks the stream list */
+	unsigned long epoch;
+};
+
 struct output {
 	/* ALSA output */
 	snd_pcm_t *alsa;
 	/* Format */
 	unsigned long samplerate;
 	unsigned char channels;
+	/* ALSA access mode and period size (in frames) */
+	int mmap;
+	snd_pcm_uframes_t period_size;
+	/* Device sample format and conversion from mixed samples */
+	const struct output_alsa_format *format;
+	output_mix_convert_cb convert;
 	/* General volume */
 	unsigned int volume;
+	/* Mixing kernels */
+	const struct output_mix *mix;
 	/* Thread objects */
 	pthread_t thread;
-	pthread_mutex_t mutex;
+	int running;
 	int stop;
+	/* Fade state (see enum output_fade) */
+	int fade;
+	/* Mixer pass counter: odd while the mixer walks the stream list */
+	unsigned long epoch;
+	/* Control plane lock: serializes stream list updates, never taken by
+	 * the mixer thread */
+	pthread_mutex_t mutex;
 	/* Stream list */
 	struct output_stream *streams;
+	/* Pre-mix worker pool */
+	struct output_worker workers[MAX_WORKERS];
+	unsigned int worker_count;
+	size_t stage_len;
+	unsigned long work_gen;
+	pthread_mutex_t work_mutex;
+	pthread_cond_t work_cond;
+	/* Idle state: the mixer sleeps on idle_cond when the PCM is stopped, and
+	 * is woken up by stream changes. Active is the count of streams which
+	 * provided or waited for data during last mixing pass.
+	 */
+	unsigned int active;
+	int wake;
+	pthread_mutex_t idle_mutex;
+	pthread_cond_t idle_cond;
+	/* Statistics (only updated by mixer thread) */
+	struct output_stats stats;
+	uint64_t mix_time_sum;
 };
 
+/* Lock classes of output and premix workers */
+LOCK_CLASS(alsa_class, "alsa");
+LOCK_CLASS(alsa_premix_class, "alsa_premix");
+
 static void *output_alsa_thread(void *user_data);
+static void *output_alsa_worker(void *user_data);
+static void output_alsa_stop(struct output *h, int fade);
+
+static const struct output_alsa_format *output_alsa_find_format(
+							       const char *name)
+{
+	const struct output_alsa_format *f;
+
+	if(name == NULL)
+		return NULL;
+
+	for(f = output_alsa_formats; f->name != NULL; f++)
+		if(strcmp(f->name, name) == 0)
+			return f;
+
+	return NULL;
+}
+
+static const struct output_alsa_format *output_alsa_native_format(
+						snd_pcm_t *alsa,
+						const struct output_alsa_format *pref)
+{
+	const struct output_alsa_format *f = NULL;
+	snd_pcm_hw_params_t *params;
+
+	if(snd_pcm_hw_params_malloc(&params) < 0)
+		return NULL;
+
+	/* Take preferred format if device supports it, or the cheapest one */
+	if(snd_pcm_hw_params_any(alsa, params) >= 0)
+	{
+		if(pref != NULL &&
+		   snd_pcm_hw_params_test_format(alsa, params, pref->alsa) == 0)
+			f = pref;
+		else
+		{
+			for(f = output_alsa_formats; f->name != NULL; f++)
+				if(snd_pcm_hw_params_test_format(alsa, params,
+								 f->alsa) == 0)
+					break;
+			if(f->name == NULL)
+				f = NULL;
+		}
+	}
+
+	snd_pcm_hw_params_free(params);
+
+	return f;
+}
+
+static int output_alsa_set_params(struct output *h, snd_pcm_access_t access,
+				  const struct output_attr *attr,
+				  unsigned int latency)
+{
+	snd_pcm_uframes_t buffer_size, period_size;
+	snd_pcm_hw_params_t *hw = NULL;
+	snd_pcm_sw_params_t *sw = NULL;
+	unsigned int rate, time;
+	int ret = -1;
+
+	if(snd_pcm_hw_params_malloc(&hw) < 0 ||
+	   snd_pcm_sw_params_malloc(&sw) < 0)
+		goto end;
+
+	/* Set access, format, channels and samplerate */
+	rate = h->samplerate;
+	if(snd_pcm_hw_params_any(h->alsa, hw) < 0 ||
+	   snd_pcm_hw_params_set_rate_resample(h->alsa, hw, 1) < 0 ||
+	   snd_pcm_hw_params_set_access(h->alsa, hw, access) < 0 ||
+	   snd_pcm_hw_params_set_format(h->alsa, hw, h->format->alsa) < 0 ||
+	   snd_pcm_hw_params_set_channels(h->alsa, hw, h->channels) < 0 ||
+	   snd_pcm_hw_params_set_rate_near(h->alsa, hw, &rate, 0) < 0 ||
+	   rate != h->samplerate)
+		goto end;
+
+	/* Set buffer size: use latency when not specified */
+	buffer_size = attr->buffer_size;
+	time = latency * 1000;
+	if(buffer_size > 0)
+		ret = snd_pcm_hw_params_set_buffer_size_near(h->alsa, hw,
+							     &buffer_size);
+	else
+		ret = snd_pcm_hw_params_set_buffer_time_near(h->alsa, hw,
+							     &time, 0);
+	if(ret < 0)
+		goto end;
+
+	/* Set period size: 4 periods in buffer when not specified */
+	period_size = attr->period_size;
+	time = latency * 1000 / 4;
+	if(period_size > 0)
+		ret = snd_pcm_hw_params_set_period_size_near(h->alsa, hw,
+							     &period_size, 0);
+	else
+		ret = snd_pcm_hw_params_set_period_time_near(h->alsa, hw,
+							     &time, 0);
+	if(ret < 0 || (ret = snd_pcm_hw_params(h->alsa, hw)) < 0)
+		goto end;
+
+	/* Get final buffer and period sizes */
+	ret = -1;
+	if(snd_pcm_hw_params_get_buffer_size(hw, &buffer_size) < 0 ||
+	   snd_pcm_hw_params_get_period_size(hw, &period_size, 0) < 0 ||
+	   period_size == 0)
+		goto end;
+
+	/* Start when buffer is full and wake up on each period */
+	if(snd_pcm_sw_params_current(h->alsa, sw) < 0 ||
+	   snd_pcm_sw_params_set_start_threshold(h->alsa, sw,
+				 (buffer_size / period_size) * period_size) < 0 ||
+	   snd_pcm_sw_params_set_avail_min(h->alsa, sw, period_size) < 0 ||
+	   snd_pcm_sw_params(h->alsa, sw) < 0)
+		goto end;
+
+	/* Mixing buffer is limited */
+	if(period_size > BUFFER_SIZE / h->channels)
+		period_size = BUFFER_SIZE / h->channels;
+	h->period_size = period_size;
+	h->mmap = access == SND_PCM_ACCESS_MMAP_INTERLEAVED;
+	ret = 0;
+
+end:
+	if(hw != NULL)
+		snd_pcm_hw_params_free(hw);
+	if(sw != NULL)
+		snd_pcm_sw_params_free(sw);
+	return ret;
+}
 
-int output_alsa_open(struct output **handle, unsigned long samplerate,
-		     unsigned char channels, unsigned int latency)
+static int output_alsa_open_pcm(struct output *h,
+				const struct output_attr *attr)
+{
+	const struct output_alsa_format *pref;
+	const char *device;
+	unsigned int latency;
+
+	/* Get device and preferred format */
+	device = attr->device != NULL ? attr->device : DEFAULT_DEVICE;
+	pref = output_alsa_find_format(attr->format);
+
+	/* Open alsa device without plug format conversion and look for a
+	 * native format: the conversion is then done in our mixer */
+	if(snd_pcm_open(&h->alsa, device, SND_PCM_STREAM_PLAYBACK,
+			SND_PCM_NO_AUTO_FORMAT) < 0)
+		goto error;
+	h->format = output_alsa_native_format(h->alsa, pref);
+	if(h->format == NULL)
+	{
+		/* No native format found: let ALSA convert samples */
+		snd_pcm_close(h->alsa);
+		h->alsa = NULL;
+		if(snd_pcm_open(&h->alsa, device, SND_PCM_STREAM_PLAYBACK,
+				0) < 0)
+			goto error;
+		h->format = pref != NULL ? pref : output_alsa_formats;
+	}
+	h->convert = output_mix_get_convert(h->format->mix);
+
+	/* Set latency to default */
+	latency = attr->latency;
+	if(latency < MIN_LATENCY)
+		latency = MIN_LATENCY;
+
+	/* Set parameters for output: use mmap access when available, in order
+	 * to mix directly into the DMA area */
+	if(output_alsa_set_params(h, SND_PCM_ACCESS_MMAP_INTERLEAVED, attr,
+				  latency) != 0 &&
+	   output_alsa_set_params(h, SND_PCM_ACCESS_RW_INTERLEAVED, attr,
+				  latency) != 0)
+		goto error;
+
+	/* Staging buffers hold one mixing pass */
+	h->stage_len = h->mmap ? h->period_size * h->channels : BUFFER_SIZE;
+
+	return 0;
+
+error:
+	if(h->alsa != NULL)
+		snd_pcm_close(h->alsa);
+	h->alsa = NULL;
+	return -1;
+}
+
+static int output_alsa_start(struct output *h, unsigned int premix_threads)
+{
+	/* Create pre-mix workers */
+	while(h->worker_count < premix_threads &&
+	      h->worker_count < MAX_WORKERS)
+	{
+		h->workers[h->worker_count].output = h;
+		h->workers[h->worker_count].epoch = 0;
+		if(pthread_create(&h->workers[h->worker_count].thread, NULL,
+				  output_alsa_worker,
+				  &h->workers[h->worker_count]) != 0)
+			break;
+		h->worker_count++;
+	}
+
+	/* Create thread: on failure, stop and join pre-mix workers */
+	if(pthread_create(&h->thread, NULL, output_alsa_thread, h) != 0)
+	{
+		output_alsa_stop(h, 0);
+		return -1;
+	}
+	h->running = 1;
+
+	return 0;
+}
+
+int output_alsa_open(struct output **handle, const struct output_attr *attr)
 {
 	struct output *h;
-	int ret;
 
 	/* Allocate handle */
 	*handle = malloc(sizeof(struct output));
@@ -102,57 +456,139 @@ int output_alsa_open(struct output **handle, unsigned long samplerate,
 	h = *handle;
 
 	/* Init structure */
+	h->alsa = NULL;
 	h->streams = NULL;
+	h->running = 0;
 	h->stop = 0;
+	h->fade = FADE_NONE;
+	h->epoch = 0;
+	h->active = 0;
+	h->wake = 0;
+	h->worker_count = 0;
+	h->work_gen = 0;
+	memset(&h->stats, 0, sizeof(h->stats));
+	h->mix_time_sum = 0;
 
 	/* Copy input and output format */
-	h->samplerate = samplerate;
-	h->channels = channels;
+	h->samplerate = attr->samplerate;
+	h->channels = attr->channels;
 	h->volume = OUTPUT_VOLUME_MAX;
 
-	/* Open alsa device */
-	if(snd_pcm_open(&h->alsa, "default", SND_PCM_STREAM_PLAYBACK, 0) < 0)
-		return -1;
-
-	/* Set latency to default */
-	if(latency < MIN_LATENCY)
-		latency = MIN_LATENCY;
-
-	/* Set parameters for output */
-	ret = snd_pcm_set_params(h->alsa, ALSA_FORMAT,
-				 SND_PCM_ACCESS_RW_INTERLEAVED, h->channels,
-				 h->samplerate, 1, latency*1000);
-	if(ret < 0)
-		return -1;
+	/* Select best mixing kernels for this CPU */
+	h->mix = output_mix_get();
 
 	/* Initialize mutex */
 	pthread_mutex_init(&h->mutex, NULL);
+	pthread_mutex_init(&h->work_mutex, NULL);
+	pthread_cond_init(&h->work_cond, NULL);
+	pthread_mutex_init(&h->idle_mutex, NULL);
+	pthread_cond_init(&h->idle_cond, NULL);
 
-	/* Create thread */
-	if(pthread_create(&h->thread, NULL, output_alsa_thread, h) != 0)
+	/* Open ALSA device */
+	if(output_alsa_open_pcm(h, attr) != 0)
 		return -1;
 
-	return 0;
+	/* Create pre-mix workers and mixer thread */
+	return output_alsa_start(h, attr->premix_threads);
+}
+
+static void output_alsa_wake(struct output *h)
+{
+	/* Wake up mixer if it is idle */
+	lock_mutex(alsa_premix_class, &h->idle_mutex);
+	h->wake = 1;
+	pthread_cond_signal(&h->idle_cond);
+	unlock_mutex(alsa_premix_class, &h->idle_mutex);
+}
+
+static void output_alsa_idle(struct output *h)
+{
+	struct timespec ts;
+
+	lock_mutex(alsa_premix_class, &h->idle_mutex);
+	if(!h->wake && !LOAD(h->stop))
+	{
+		if(h->active == 0)
+		{
+			/* Nothing to play: sleep until a stream change */
+			lock_cond_wait(alsa_premix_class, &h->idle_cond,
+				       &h->idle_mutex);
+		}
+		else
+		{
+			/* A stream is waiting for data: poll its cache */
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += MIN_LATENCY * 1000000L;
+			if(ts.tv_nsec >= 1000000000L)
+			{
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000L;
+			}
+			lock_cond_timedwait(alsa_premix_class, &h->idle_cond,
+					    &h->idle_mutex, &ts);
+		}
+	}
+	h->wake = 0;
+	unlock_mutex(alsa_premix_class, &h->idle_mutex);
+}
+
+static void output_alsa_wait_pass(struct output *h, unsigned long *counter)
+{
+	unsigned long epoch;
+
+	epoch = __atomic_load_n(counter, __ATOMIC_SEQ_CST);
+	if((epoch & 1) == 0)
+		return;
+	while(__atomic_load_n(counter, __ATOMIC_SEQ_CST) == epoch &&
+	      !LOAD(h->stop))
+		usleep(1000);
+}
+
+static void output_alsa_synchronize(struct output *h)
+{
+	unsigned int i;
+
+	/* Wait until the mixer and the workers have left the pass during
+	 * which an object was unlinked: after that, no reference on it can
+	 * remain in these threads.
+	 */
+	output_alsa_wait_pass(h, &h->epoch);
+	for(i = 0; i < h->worker_count; i++)
+		output_alsa_wait_pass(h, &h->workers[i].epoch);
 }
 
 int output_alsa_set_volume(struct output *h, unsigned int volume)
 {
-	pthread_mutex_lock(&h->mutex);
-	h->volume = volume;
-	pthread_mutex_unlock(&h->mutex);
+	STORE(h->volume, volume);
 
 	return 0;
 }
 
 unsigned int output_alsa_get_volume(struct output *h)
 {
-	unsigned int volume;
+	return LOAD(h->volume);
+}
 
-	pthread_mutex_lock(&h->mutex);
-	volume = h->volume;
-	pthread_mutex_unlock(&h->mutex);
+static void output_alsa_free_stream(struct output_stream *s)
+{
+	/* Free cache buffer */
+	if(s->cache != NULL)
+		cache_close(s->cache);
 
-	return volume;
+	/* Close resample module */
+	if(s->res != NULL)
+		resample_close(s->res);
+
+	/* Free event callback */
+	if(s->event != NULL)
+		free(s->event);
+
+	/* Free staging buffer and reserve buffer */
+	pool_free(s->stage);
+	pool_free(s->reserve_buffer);
+
+	/* Free stream */
+	free(s);
 }
 
 struct output_stream *output_alsa_add_stream(struct output *h,
@@ -160,6 +596,7 @@ struct output_stream *output_alsa_add_stream(struct output *h,
 					     unsigned char channels,
 					     unsigned long cache,
 					     int use_cache_thread,
+					     const struct resample_profile *profile,
 					     a_read_cb input_callback,
 					     void *user_data)
 {
@@ -174,17 +611,45 @@ struct output_stream *output_alsa_add_stream(struct output *h,
 	/* Fill the handler */
 	s->samplerate = samplerate;
 	s->channels = channels;
+	s->input_callback = input_callback;
+	s->user_data = user_data;
+	if(profile != NULL)
+		s->profile = *profile;
+	else
+		memset(&s->profile, 0, sizeof(s->profile));
+	s->ratio = 1.0;
 	s->res = NULL;
 	s->is_playing = 0;
 	s->end_of_stream = 0;
 	s->played = 0;
 	s->abort = 0;
+	s->input_locked = 0;
 	s->volume = OUTPUT_VOLUME_MAX;
 	s->cache = NULL;
 	s->delay = cache;
-	s->event_cb = NULL;
-	s->event_ud = NULL;
+	s->reserve = RESERVE_NONE;
+	s->reserve_area = NULL;
+	s->reserve_buffer = NULL;
+	s->reserve_size = 0;
+	s->reserve_pending = 0;
+	s->event = NULL;
 	s->buffering = 0;
+	s->starved = 0;
+	s->starvations = 0;
+	s->stage_state = STAGE_EMPTY;
+	s->stage = NULL;
+	s->stage_size = 0;
+	s->stage_pos = 0;
+	s->trace = NULL;
+	s->mixed = 0;
+
+	/* Allocate staging buffer for pre-mix */
+	if(h->worker_count > 0)
+	{
+		s->stage = pool_alloc(h->stage_len * sizeof(mix_sample_t));
+		if(s->stage == NULL)
+			goto error;
+	}
 
 	/* Add cache for write() */
 	if(input_callback == NULL)
@@ -199,7 +664,8 @@ struct output_stream *output_alsa_add_stream(struct output *h,
 
 	/* Open resample/mixer filter */
 	if(resample_open(&s->res, samplerate, channels, h->samplerate,
-			 h->channels, input_callback, out, user_data) != 0)
+			 h->channels, profile, input_callback, out,
+			 user_data) != 0)
 		goto error;
 
 	/* Add cache for read() */
@@ -212,83 +678,220 @@ struct output_stream *output_alsa_add_stream(struct output *h,
 			goto error;
 	}
 
-	/* Add stream to stream list */
+	/* Publish stream in stream list: the stream must be fully initialized
+	 * before the mixer can see it */
+	lock_mutex(alsa_class, &h->mutex);
 	s->next = h->streams;
-	h->streams = s;
+	__atomic_store_n(&h->streams, s, __ATOMIC_SEQ_CST);
+	unlock_mutex(alsa_class, &h->mutex);
+
+	/* Wake up idle mixer */
+	output_alsa_wake(h);
 
 	return s;
 
 error:
-	free(s);
+	output_alsa_free_stream(s);
 	return NULL;
 }
 
 int output_alsa_play_stream(struct output *h, struct output_stream *s)
 {
-	pthread_mutex_lock(&h->mutex);
-
 	/* Play */
-	s->is_playing = 1;
+	STORE(s->is_playing, 1);
 
 	/* Unlock cache after a flush */
 	cache_unlock(s->cache);
+	s->input_locked = 0;
 
-	pthread_mutex_unlock(&h->mutex);
+	/* Wake up idle mixer */
+	output_alsa_wake(h);
 
 	return 0;
 }
 
 int output_alsa_pause_stream(struct output *h, struct output_stream *s)
 {
-	pthread_mutex_lock(&h->mutex);
-
 	/* Pause */
-	s->is_playing = 0;
-
-	pthread_mutex_unlock(&h->mutex);
+	STORE(s->is_playing, 0);
 
 	return 0;
 }
 
-void output_alsa_flush_stream(struct output *h, struct output_stream *s)
+static void output_alsa_flush_stage(struct output_stream *s)
 {
-	pthread_mutex_lock(&h->mutex);
+	enum output_stage_state state;
 
-	/* Flush the cache */
-	cache_flush(s->cache);
+	if(s->stage == NULL)
+		return;
+
+	/* Wait for worker or mixer to release staging buffer and empty it */
+	while((state = LOAD(s->stage_state)) != STAGE_EMPTY)
+	{
+		if(state == STAGE_READY &&
+		   __atomic_compare_exchange_n(&s->stage_state, &state,
+					       STAGE_EMPTY, 0, __ATOMIC_ACQ_REL,
+					       __ATOMIC_ACQUIRE))
+			break;
+		usleep(100);
+	}
+}
+
+void output_alsa_flush_stream(struct output *h, struct output_stream *s,
+			      unsigned long ready)
+{
+	/* Flush the cache: cache and resample have their own locking, so the
+	 * mixer gets either old data or nothing during the flush */
+	cache_flush_ready(s->cache, ready);
 	resample_flush(s->res);
 
+	/* Drop staged period */
+	output_alsa_flush_stage(s);
+	s->reserve_pending = 0;
+	trace_reset(LOAD(s->trace));
+
 	/* Must unlock input callback in cache after a flush */
-	if(s->is_playing)
+	if(LOAD(s->is_playing))
 		cache_unlock(s->cache);
-	s->played = 0;
-
-	pthread_mutex_unlock(&h->mutex);
+	else
+		s->input_locked = 1;
+	STORE(s->played, 0);
 }
 
 ssize_t output_alsa_write_stream(struct output *h, struct output_stream *s,
 				 const unsigned char *buffer, size_t size,
 				 struct a_format *fmt)
 {
-	ssize_t ret = 0;
+	/* Write data to SR/Mixer filter */
+	if(LOAD(s->abort))
+		return 0;
 
-	pthread_mutex_lock(&h->mutex);
+	return resample_write(s->res, buffer, size, fmt);
+}
 
-	/* Write data to SR/Mixer filter */
-	if(!s->abort)
-		ret = resample_write(s->res, buffer, size, fmt);
+static size_t output_alsa_write_pending(struct output_stream *s, size_t len)
+{
+	size_t bytes = format_sample_size(s->reserve_fmt.sample);
+	ssize_t ret;
 
-	pthread_mutex_unlock(&h->mutex);
+	/* Write samples of reserve buffer to SR/Mixer filter */
+	ret = resample_write(s->res, s->reserve_buffer, len, &s->reserve_fmt);
+	if(ret < 0)
+		ret = len;
 
-	return ret;
+	/* Move remaining samples to beginning of buffer */
+	len -= ret;
+	if(len > 0 && ret > 0)
+		memmove(s->reserve_buffer, &s->reserve_buffer[ret * bytes],
+			len * bytes);
+	s->reserve_pending = len;
+
+	return len;
+}
+
+ssize_t output_alsa_reserve_stream(struct output *h, struct output_stream *s,
+				   size_t size, unsigned char **buffer)
+{
+	ssize_t ret;
+
+	if(s->input_callback != NULL || s->reserve != RESERVE_NONE)
+		return -1;
+	if(LOAD(s->abort))
+		return 0;
+
+	/* Give previously committed samples to resampler first */
+	if(s->reserve_pending > 0 &&
+	   output_alsa_write_pending(s, s->reserve_pending) > 0)
+		return 0;
+
+	/* Reserve 1 buffer at most: a format change is then handled by copy */
+	if(size > BUFFER_SIZE)
+		size = BUFFER_SIZE;
+
+	/* Resampler passes samples through: write them directly in cache */
+	if(resample_is_bypass(s->res))
+	{
+		ret = cache_write_reserve(s->cache, size, buffer);
+		if(ret > 0)
+		{
+			s->reserve = RESERVE_CACHE;
+			s->reserve_area = *buffer;
+			s->reserve_size = ret;
+		}
+		if(ret >= 0)
+			return ret;
+	}
+
+	/* Otherwise write in a buffer given to resampler on commit */
+	if(s->reserve_buffer == NULL)
+	{
+		s->reserve_buffer = pool_alloc(BUFFER_SIZE * 4);
+		if(s->reserve_buffer == NULL)
+			return -1;
+	}
+	*buffer = s->reserve_buffer;
+	s->reserve = RESERVE_BUFFER;
+	s->reserve_size = size;
+
+	return size;
+}
+
+ssize_t output_alsa_commit_stream(struct output *h, struct output_stream *s,
+				  size_t size, struct a_format *fmt)
+{
+	struct a_format out = A_FORMAT_INIT;
+	enum output_reserve reserve = s->reserve;
+
+	/* No area has been reserved */
+	s->reserve = RESERVE_NONE;
+	if(reserve == RESERVE_NONE)
+		return -1;
+
+	/* Samples can't go beyond reserved area */
+	if(size * format_sample_size(fmt->sample) > s->reserve_size * 4)
+		size = s->reserve_size * 4 / format_sample_size(fmt->sample);
+
+	/* Samples in cache and in output format are committed as is */
+	if(reserve == RESERVE_CACHE &&
+	   (fmt->samplerate == 0 || fmt->samplerate == s->samplerate) &&
+	   (fmt->channels == 0 || fmt->channels == s->channels) &&
+	   format_sample(fmt->sample) == format_sample(SAMPLE_NATIVE))
+	{
+		trace_mark(LOAD(s->trace), TRACE_RESAMPLE, size, h->samplerate,
+			   h->channels);
+		out.samplerate = h->samplerate;
+		out.channels = h->channels;
+		out.sample = format_sample(SAMPLE_NATIVE);
+		return cache_write_commit(s->cache, size, &out);
+	}
+
+	/* Format has changed: move samples out of cache and drop area */
+	if(reserve == RESERVE_CACHE)
+	{
+		if(s->reserve_buffer == NULL)
+			s->reserve_buffer = pool_alloc(BUFFER_SIZE * 4);
+		if(s->reserve_buffer != NULL)
+			memcpy(s->reserve_buffer, s->reserve_area,
+			       size * format_sample_size(fmt->sample));
+		cache_write_commit(s->cache, 0, fmt);
+		if(s->reserve_buffer == NULL)
+			return -1;
+	}
+
+	/* Give samples to resampler: remaining samples are kept for next
+	 * reservation */
+	if(LOAD(s->abort))
+		return 0;
+	s->reserve_fmt = *fmt;
+	output_alsa_write_pending(s, size);
+
+	return size;
 }
 
 int output_alsa_set_volume_stream(struct output *h, struct output_stream *s,
 				  unsigned int volume)
 {
-	pthread_mutex_lock(&h->mutex);
-	s->volume = volume;
-	pthread_mutex_unlock(&h->mutex);
+	STORE(s->volume, volume);
 
 	return 0;
 }
@@ -296,13 +899,7 @@ int output_alsa_set_volume_stream(struct output *h, struct output_stream *s,
 unsigned int output_alsa_get_volume_stream(struct output *h,
 					   struct output_stream *s)
 {
-	unsigned int volume;
-
-	pthread_mutex_lock(&h->mutex);
-	volume = s->volume;
-	pthread_mutex_unlock(&h->mutex);
-
-	return volume;
+	return LOAD(s->volume);
 }
 
 int output_alsa_set_cache_stream(struct output *h, struct output_stream *s,
@@ -310,48 +907,66 @@ int output_alsa_set_cache_stream(struct output *h, struct output_stream *s,
 {
 	int ret;
 
-	pthread_mutex_lock(&h->mutex);
-
 	/* Set new cache */
 	ret = cache_set_time(s->cache, cache);
 	if(ret == 0)
-		s->delay = cache;
+		STORE(s->delay, cache);
 
-	pthread_mutex_unlock(&h->mutex);
+	return ret;
+}
+
+int output_alsa_set_ratio_stream(struct output *h, struct output_stream *s,
+				 double ratio)
+{
+	int ret;
+
+	/* Keep ratio for a new resampler */
+	ret = resample_set_ratio(s->res, ratio);
+	if(ret == 0)
+		s->ratio = ratio;
 
 	return ret;
 }
 
+int output_alsa_set_trace_stream(struct output *h, struct output_stream *s,
+				 struct trace *trace)
+{
+	/* Trace resample, cache and mixer stages */
+	resample_set_trace(s->res, trace);
+	cache_set_trace(s->cache, trace);
+	STORE(s->trace, trace);
+
+	return 0;
+}
+
 unsigned long output_alsa_get_status_stream(struct output *h,
 					    struct output_stream *s,
 					    enum output_stream_key key)
 {
 	unsigned long ret = 0;
 
-	/* Lock stream access */
-	pthread_mutex_lock(&h->mutex);
-
 	switch(key)
 	{
 		case OUTPUT_STREAM_STATUS:
-			if(s->end_of_stream)
+			if(LOAD(s->end_of_stream))
 				ret = STREAM_ENDED;
-			else if(s->is_playing)
+			else if(LOAD(s->is_playing))
 				ret = STREAM_PLAYING;
 			else
 				ret = STREAM_PAUSED;
 			break;
 		case OUTPUT_STREAM_PLAYED:
-			ret = s->played * 1000 / h->samplerate / h->channels;
+			ret = LOAD(s->played) * 1000 / h->samplerate /
+			      h->channels;
 			break;
 		case OUTPUT_STREAM_CACHE_STATUS:
-			if(s->delay > 0 && cache_is_ready(s->cache) == 0)
+			if(LOAD(s->delay) > 0 && cache_is_ready(s->cache) == 0)
 				ret = CACHE_BUFFERING;
 			else
 				ret = CACHE_READY;
 			break;
 		case OUTPUT_STREAM_CACHE_FILLING:
-			if(s->delay > 0)
+			if(LOAD(s->delay) > 0)
 				ret = cache_get_filling(s->cache);
 			else
 				ret = 100;
@@ -359,28 +974,46 @@ unsigned long output_alsa_get_status_stream(struct output *h,
 		case OUTPUT_STREAM_CACHE_DELAY:
 			ret = cache_delay(s->cache);
 			break;
+		case OUTPUT_STREAM_STARVATIONS:
+			ret = STAT_GET(s->starvations);
+			break;
+		case OUTPUT_STREAM_DELAY:
+			ret = resample_delay(s->res) + cache_delay(s->cache) +
+			      STAT_GET(h->stats.delay);
+			break;
 		default:
 			ret = 0;
 	}
 
-	/* Unlock stream access */
-	pthread_mutex_unlock(&h->mutex);
-
 	return ret;
 }
 
 int output_alsa_set_stream_event_cb(struct output *h, struct output_stream *s,
 				    output_stream_event_cb cb, void *user_data)
 {
-	/* Lock callback access */
-	pthread_mutex_lock(&h->mutex);
+	struct output_event *e = NULL, *old;
+
+	/* Callback and its user data are replaced together */
+	if(cb != NULL)
+	{
+		e = malloc(sizeof(struct output_event));
+		if(e == NULL)
+			return -1;
+		e->cb = cb;
+		e->user_data = user_data;
+	}
 
 	/* Set event callback */
-	s->event_cb = cb;
-	s->event_ud = user_data;
+	lock_mutex(alsa_class, &h->mutex);
+	old = __atomic_exchange_n(&s->event, e, __ATOMIC_SEQ_CST);
+	unlock_mutex(alsa_class, &h->mutex);
 
-	/* Unlock callback access */
-	pthread_mutex_unlock(&h->mutex);
+	/* Free previous callback when mixer doesn't use it anymore */
+	if(old != NULL)
+	{
+		output_alsa_synchronize(h);
+		free(old);
+	}
 
 	return 0;
 }
@@ -391,272 +1024,621 @@ unsigned long output_alsa_abort_stream(struct output *h,
 {
 	unsigned long played;
 
-	/* Lock stream access */
-	pthread_mutex_lock(&h->mutex);
-
 	/* Pause stream */
-	s->is_playing = 0;
-	s->abort = 1;
+	STORE(s->is_playing, 0);
+	STORE(s->abort, 1);
 
 	/* Lock cache */
-	cache_lock(s->cache);
+	if(!s->input_locked)
+		cache_lock(s->cache);
+	s->input_locked = 1;
 
 	/* Calculate played status */
-	played = s->played * 1000 / h->samplerate / h->channels;
+	played = LOAD(s->played) * 1000 / h->samplerate / h->channels;
 
 	/* Add not played samples */
 	played += cache_delay(s->cache);
 	played += resample_delay(s->res);
 
-	/* Unlock stream access */
-	pthread_mutex_unlock(&h->mutex);
-
 	return played;
 }
 
 void output_alsa_restore_stream(struct output *h, struct output_stream *s,
 				unsigned long value)
 {
-	/* Lock stream access */
-	pthread_mutex_lock(&h->mutex);
-
 	/* Restore played status */
-	s->played = ((uint64_t)value) * h->samplerate * h->channels / 1000;
-
-	/* Unlock stream access */
-	pthread_mutex_unlock(&h->mutex);
-}
-
-static void output_alsa_free_stream(struct output_stream *s)
-{
-	/* Free cache buffer */
-	if(s->cache != NULL)
-		cache_close(s->cache);
-
-	/* Close resample module */
-	if(s->res != NULL)
-		resample_close(s->res);
-
-	/* Free stream */
-	free(s);
+	STORE(s->played, ((uint64_t)value) * h->samplerate * h->channels /
+			 1000);
 }
 
 int output_alsa_remove_stream(struct output *h, struct output_stream *s)
 {
-	struct output_stream *cur, *prev;
+	struct output_stream **lp;
 
-	/* Remove stream from list */
-	pthread_mutex_lock(&h->mutex);
-	prev = NULL;
-	cur = h->streams;
-	while(cur != NULL)
+	/* Unlink stream from list: the removed stream keeps its next pointer,
+	 * so the mixer can continue its walk if it is currently on it.
+	 */
+	lock_mutex(alsa_class, &h->mutex);
+	for(lp = &h->streams; *lp != NULL; lp = &(*lp)->next)
 	{
-		if(s == cur)
+		if(*lp == s)
 		{
-			if(prev == NULL)
-				h->streams = cur->next;
-			else
-				prev->next = cur->next;
+			__atomic_store_n(lp, s->next, __ATOMIC_SEQ_CST);
 			break;
 		}
-
-		prev = cur;
-		cur = cur->next;
 	}
-	pthread_mutex_unlock(&h->mutex);
+	unlock_mutex(alsa_class, &h->mutex);
 
-	/* Free stream */
+	/* Wait for the mixer to release the stream, then free it */
+	output_alsa_synchronize(h);
 	output_alsa_free_stream(s);
 
 	return 0;
 }
 
-#ifdef USE_FLOAT
-static inline float output_alsa_vol(float x, unsigned int v)
+static void output_alsa_notify(struct output_stream *s,
+			       enum stream_event event)
 {
-	return x * (v * 1.0 / OUTPUT_VOLUME_MAX);
+	struct output_event *e = LOAD(s->event);
+
+	if(e != NULL)
+		e->cb(e->user_data, event, NULL);
 }
 
-static inline float output_alsa_add(float a, float b)
+static int output_alsa_read_stream(struct output_stream *s,
+				   unsigned char *buffer, size_t len)
 {
-	float sum;
+	struct a_format fmt = A_FORMAT_INIT;
+	int in_size;
 
-	sum = a + b;
+	/* Get input data */
+	in_size = cache_read(s->cache, buffer, len, &fmt);
+	if(in_size < 0)
+	{
+		/* Cache and resample filters are released by
+		 * output_alsa_remove_stream(): they can still be used by
+		 * control calls.
+		 */
+		STORE(s->end_of_stream, 1);
 
-	if(sum > 1.0)
-		sum = 1.0;
-	else if(sum < -1.0)
-		sum = -1.0;
+		/* Notify end of stream */
+		output_alsa_notify(s, STREAM_EVENT_END);
 
-	return sum;
+		return in_size;
+	}
+	else if(in_size == 0)
+	{
+		/* Count cache starvation */
+		if(s->starved == 0)
+			STAT_INC(s->starvations);
+		s->starved = 1;
+
+		/* Notify cache is buffering */
+		if(LOAD(s->delay) > 0 && s->buffering == 0)
+		{
+			output_alsa_notify(s, STREAM_EVENT_BUFFERING);
+			s->buffering = 1;
+		}
+
+		return 0;
+	}
+	s->starved = 0;
+
+	/* Cache is full */
+	if(LOAD(s->delay) > 0 && s->buffering == 1)
+	{
+		/* Notify cache is ready */
+		output_alsa_notify(s, STREAM_EVENT_READY);
+		s->buffering = 0;
+	}
+
+	return in_size;
 }
-#else
-static inline int32_t output_alsa_vol(int32_t x, unsigned int v)
+
+static int output_alsa_take_stage(struct output_stream *s,
+				  mix_sample_t **buffer, size_t len)
 {
-	int64_t value;
+	enum output_stage_state state = STAGE_READY;
+	size_t size;
+
+	/* Only take a staged period which is ready */
+	if(!__atomic_compare_exchange_n(&s->stage_state, &state, STAGE_MIXING,
+					0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return 0;
 
-	value = ((int64_t)x * v) / OUTPUT_VOLUME_MAX;
+	/* Get samples */
+	*buffer = &s->stage[s->stage_pos];
+	size = s->stage_size - s->stage_pos;
+	if(size > len)
+		size = len;
+	s->stage_pos += size;
 
-	return (int32_t) value;
+	return size;
 }
 
-static inline int32_t output_alsa_add(int32_t a, int32_t b)
+static void output_alsa_release_stage(struct output_stream *s)
 {
-	int64_t sum;
+	/* Keep remaining samples for next pass */
+	STORE(s->stage_state, s->stage_pos < s->stage_size ? STAGE_READY :
+							      STAGE_EMPTY);
+}
+
+static void output_alsa_kick_workers(struct output *h)
+{
+	/* Wake up workers to render next period */
+	lock_mutex(alsa_premix_class, &h->work_mutex);
+	h->work_gen++;
+	pthread_cond_broadcast(&h->work_cond);
+	unlock_mutex(alsa_premix_class, &h->work_mutex);
+}
+
+static void *output_alsa_worker(void *user_data)
+{
+	struct output_worker *w = (struct output_worker *) user_data;
+	struct output *h = w->output;
+	enum output_stage_state state;
+	struct output_stream *s;
+	unsigned long gen = 0;
+	int size;
+
+	/* Set thread scheduling and name */
+	thread_setup(THREAD_OUTPUT, "alsa-premix");
 
-	sum = (int64_t)a + (int64_t)b;
+	while(1)
+	{
+		/* Wait for next mixing pass */
+		lock_mutex(alsa_premix_class, &h->work_mutex);
+		while(h->work_gen == gen && !LOAD(h->stop))
+			lock_cond_wait(alsa_premix_class, &h->work_cond,
+				       &h->work_mutex);
+		gen = h->work_gen;
+		unlock_mutex(alsa_premix_class, &h->work_mutex);
+		if(LOAD(h->stop))
+			break;
+
+		/* Enter rendering pass */
+		__atomic_add_fetch(&w->epoch, 1, __ATOMIC_SEQ_CST);
+
+		/* Render one period for all streams not yet claimed */
+		for(s = __atomic_load_n(&h->streams, __ATOMIC_SEQ_CST);
+		    s != NULL; s = LOAD(s->next))
+		{
+			if(!LOAD(s->is_playing) || LOAD(s->end_of_stream))
+				continue;
+
+			/* Claim staging buffer */
+			state = STAGE_EMPTY;
+			if(!__atomic_compare_exchange_n(&s->stage_state, &state,
+							STAGE_BUSY, 0,
+							__ATOMIC_ACQUIRE,
+							__ATOMIC_RELAXED))
+				continue;
 
-	/* Introduce some distorsion */
-	/*if(a > 0 && b > 0)
-		sum -= (int64_t)a * (int64_t)b / 0x7FFFFFFFLL;
-	else if(a < 0 && b < 0)
-		sum -= (int64_t)a * (int64_t)b / -0x80000000LL;*/
+			/* Fill staging buffer */
+			size = output_alsa_read_stream(s,
+						  (unsigned char *) s->stage,
+						  h->stage_len);
+			s->stage_size = size > 0 ? size : 0;
+			s->stage_pos = 0;
+			STORE(s->stage_state, size > 0 ? STAGE_READY :
+							 STAGE_EMPTY);
+		}
 
-	if(sum > 0x7FFFFFFFLL)
-		sum = 0x7FFFFFFFLL;
-	else if(sum < -0x80000000LL)
-		sum = -0x80000000LL;
+		/* Leave rendering pass */
+		__atomic_add_fetch(&w->epoch, 1, __ATOMIC_SEQ_CST);
+	}
 
-	return (int32_t) sum;
+	return NULL;
 }
-#endif
 
 static int output_alsa_mix_streams(struct output *h, unsigned char *in_buffer,
 				   unsigned char *out_buffer, size_t len)
 {
-	struct output_stream *s;
-	struct a_format fmt = A_FORMAT_INIT;
-#ifdef USE_FLOAT
-	float *p_in = (float*) in_buffer;
-	float *p_out = (float*) out_buffer;
-	float sample;
-#else
-	int32_t *p_in = (int32_t*) in_buffer;
-	int32_t *p_out = (int32_t*) out_buffer;
-	int32_t sample;
-#endif
+	struct output_stream *s, *head, *lone = NULL;
+	mix_sample_t *p_out = (mix_sample_t*) out_buffer;
+	mix_sample_t *p_in;
+	unsigned int volume;
+	unsigned int active = 0;
 	int out_size = 0;
 	int first = 1;
+	int count = 0;
 	int in_size;
-	int i;
 
-	pthread_mutex_lock(&h->mutex);
-	for(s = h->streams; s != NULL; s = s->next)
+	/* Enter mixing pass */
+	__atomic_add_fetch(&h->epoch, 1, __ATOMIC_SEQ_CST);
+	head = __atomic_load_n(&h->streams, __ATOMIC_SEQ_CST);
+
+	/* Look for a lone playing stream at unity volume: its cache can fill
+	 * the output buffer directly since copy is then an identity. With
+	 * pre-mix, the stream is always read from its staging buffer.
+	 */
+	for(s = head; h->worker_count == 0 && s != NULL && count < 2;
+	    s = LOAD(s->next))
+	{
+		if(LOAD(s->is_playing) && !s->end_of_stream)
+		{
+			lone = s;
+			count++;
+		}
+	}
+	if(count != 1 || LOAD(lone->volume) != OUTPUT_VOLUME_MAX)
+		lone = NULL;
+
+	for(s = lone != NULL ? lone : head; s != NULL; s = LOAD(s->next))
 	{
-		if(!s->is_playing || s->end_of_stream)
+		if(!LOAD(s->is_playing) || LOAD(s->end_of_stream))
 			continue;
+		active++;
 
-		/* Get input data */
-		in_size = cache_read(s->cache, in_buffer, len, &fmt);
+		/* Get input data: from staging buffer with pre-mix */
+		if(h->worker_count > 0)
+		{
+			in_size = output_alsa_take_stage(s, &p_in, len);
+		}
+		else
+		{
+			p_in = (mix_sample_t*) (s == lone ? out_buffer :
+							    in_buffer);
+			in_size = output_alsa_read_stream(s,
+						     (unsigned char *) p_in,
+						     len);
+		}
 		if(in_size <= 0)
+			continue;
+
+		/* Update played value (in ms) */
+		__atomic_add_fetch(&s->played, in_size, __ATOMIC_RELAXED);
+
+		/* Trace mixed samples until they are written */
+		trace_mark(LOAD(s->trace), TRACE_MIX, in_size, h->samplerate,
+			   h->channels);
+		s->mixed = in_size;
+
+		/* Pass-through: samples are already in output buffer */
+		if(s == lone)
+		{
+			out_size = in_size;
+			break;
+		}
+
+		/* Get stream volume */
+		volume = LOAD(s->volume);
+
+		/* Add it to output buffer */
+		if(first)
+		{
+			first = 0;
+			h->mix->copy(p_out, p_in, in_size, volume);
+			out_size = in_size;
+		}
+		else if(in_size > out_size)
 		{
-			if(in_size < 0)
+			/* Mix with previous streams and copy samples beyond
+			 * their end */
+			h->mix->add(p_out, p_in, out_size, volume);
+			h->mix->copy(&p_out[out_size], &p_in[out_size],
+				     in_size - out_size, volume);
+			out_size = in_size;
+		}
+		else
+			h->mix->add(p_out, p_in, in_size, volume);
+
+		/* Release staging buffer */
+		if(h->worker_count > 0)
+			output_alsa_release_stage(s);
+	}
+
+	/* Leave mixing pass */
+	__atomic_add_fetch(&h->epoch, 1, __ATOMIC_SEQ_CST);
+	h->active = lone != NULL ? 1 : active;
+
+	/* Render next period while this one is played */
+	if(h->worker_count > 0)
+		output_alsa_kick_workers(h);
+
+	return out_size;
+}
+
+static inline void output_alsa_time(struct timespec *ts)
+{
+	clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+static void output_alsa_account_mix(struct output *h,
+				    const struct timespec *start)
+{
+	struct timespec end;
+	unsigned long us, periods;
+	int i;
+
+	/* Get mix time */
+	output_alsa_time(&end);
+	us = (end.tv_sec - start->tv_sec) * 1000000 +
+	     (end.tv_nsec - start->tv_nsec) / 1000;
+
+	/* Update min/avg/max */
+	periods = STAT_GET(h->stats.periods) + 1;
+	h->mix_time_sum += us;
+	if(periods == 1 || us < STAT_GET(h->stats.mix_time_min))
+		STAT_SET(h->stats.mix_time_min, us);
+	if(us > STAT_GET(h->stats.mix_time_max))
+		STAT_SET(h->stats.mix_time_max, us);
+	STAT_SET(h->stats.mix_time_avg, h->mix_time_sum / periods);
+	STAT_SET(h->stats.periods, periods);
+
+	/* Update histogram */
+	for(i = 0; i < OUTPUT_STATS_HISTOGRAM_SIZE - 1 && us > 1; i++)
+		us >>= 1;
+	STAT_INC(h->stats.mix_time_histogram[i]);
+}
+
+static void output_alsa_trace(struct output *h, snd_pcm_sframes_t delay)
+{
+	struct output_stream *s;
+	struct trace *t;
+	uint64_t now, play;
+
+	/* Mixed samples have been written now and will be played after ALSA
+	 * delay */
+	now = trace_now();
+	play = now + (uint64_t) delay * 1000000000ULL / h->samplerate;
+
+	/* Walk stream list as in a mixing pass */
+	__atomic_add_fetch(&h->epoch, 1, __ATOMIC_SEQ_CST);
+	for(s = __atomic_load_n(&h->streams, __ATOMIC_SEQ_CST); s != NULL;
+	    s = LOAD(s->next))
+	{
+		t = LOAD(s->trace);
+		if(t != NULL && s->mixed > 0)
+		{
+			trace_mark_at(t, TRACE_WRITE, s->mixed, h->samplerate,
+				      h->channels, now);
+			trace_mark_at(t, TRACE_PLAY, s->mixed, h->samplerate,
+				      h->channels, play);
+		}
+		s->mixed = 0;
+	}
+	__atomic_add_fetch(&h->epoch, 1, __ATOMIC_SEQ_CST);
+}
+
+static void output_alsa_account_delay(struct output *h)
+{
+	snd_pcm_sframes_t delay;
+
+	/* Get ALSA delay */
+	if(snd_pcm_delay(h->alsa, &delay) < 0 || delay < 0)
+		delay = 0;
+	STAT_SET(h->stats.delay, delay * 1000 / h->samplerate);
+
+	/* Trace written samples */
+	if(trace_is_enabled())
+		output_alsa_trace(h, delay);
+}
+
+static int output_alsa_recover(struct output *h, int err)
+{
+	/* Count underruns */
+	if(err == -EPIPE)
+		STAT_INC(h->stats.xruns);
+
+	return snd_pcm_recover(h->alsa, err, 0);
+}
+
+static int output_alsa_fade(struct output *h, mix_sample_t *buffer,
+			    size_t frames)
+{
+	int fade = LOAD(h->fade);
+	int state = FADE_IN;
+	unsigned int volume;
+	size_t i;
+
+	if(fade == FADE_NONE || frames == 0)
+		return 0;
+
+	/* Apply a linear volume ramp on period */
+	for(i = 0; i < frames; i++)
+	{
+		volume = (fade == FADE_IN ? i : frames - 1 - i) *
+			 OUTPUT_VOLUME_MAX / frames;
+		h->mix->copy(&buffer[i * h->channels],
+			     &buffer[i * h->channels], h->channels, volume);
+	}
+
+	/* Fade in is done once (a fade out can be requested meanwhile) */
+	if(fade == FADE_IN)
+		__atomic_compare_exchange_n(&h->fade, &state, FADE_NONE, 0,
+					    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+
+	/* Mixer stops after a fade out */
+	return fade == FADE_OUT;
+}
+
+static void output_alsa_thread_mmap(struct output *h,
+				    unsigned char *in_buffer,
+				    unsigned char *mix_buffer)
+{
+	const snd_pcm_channel_area_t *areas;
+	snd_pcm_uframes_t offset, frames;
+	snd_pcm_sframes_t avail, ret;
+	unsigned char *dma_buffer, *out_buffer;
+	struct timespec ts;
+	size_t out_size;
+	time_t start = 0;
+	int stopped = 1;
+	int last = 0;
+
+	/* Prepare PCM for first mmap access */
+	snd_pcm_prepare(h->alsa);
+
+	while(!LOAD(h->stop))
+	{
+		/* Get free space in ring buffer */
+		avail = snd_pcm_avail_update(h->alsa);
+		if(avail < 0)
+		{
+			/* Recover from underrun */
+			if(output_alsa_recover(h, avail) < 0)
 			{
-				s->end_of_stream = 1;
-
-				/* Close cache filter */
-				if(s->cache != NULL)
-					cache_close(s->cache);
-				s->cache = NULL;
-
-				/* Close resample filter */
-				if(s->res != NULL)
-					resample_close(s->res);
-				s->res = NULL;
-
-				/* Notify end of stream */
-				if(s->event_cb != NULL)
-					s->event_cb(s->event_ud,
-						    STREAM_EVENT_END, NULL);
+				printf("snd_pcm_avail_update failed!\n");
+				break;
 			}
-			else if(s->delay > 0)
+			continue;
+		}
+
+		/* Not enough free space for a period */
+		if((snd_pcm_uframes_t) avail < h->period_size)
+		{
+			/* Ring buffer is full: start playback */
+			if(snd_pcm_state(h->alsa) != SND_PCM_STATE_RUNNING)
 			{
-				/* Notify cache is buffering */
-				if(s->event_cb != NULL && s->buffering == 0)
-					s->event_cb(s->event_ud,
-						    STREAM_EVENT_BUFFERING,
-						    NULL);
-				s->buffering = 1;
+				snd_pcm_start(h->alsa);
+				continue;
 			}
 
+			/* Wait for a free period */
+			ret = snd_pcm_wait(h->alsa, MAX_WAIT);
+			if(ret < 0 && output_alsa_recover(h, ret) < 0)
+			{
+				printf("snd_pcm_wait failed!\n");
+				break;
+			}
 			continue;
 		}
 
-		/* Cache is full */
-		if(s->delay > 0 && s->buffering == 1)
+		/* Get DMA area for next period */
+		frames = h->period_size;
+		ret = snd_pcm_mmap_begin(h->alsa, &areas, &offset, &frames);
+		if(ret < 0)
 		{
-			/* Notify cache is ready */
-			if(s->event_cb != NULL)
-				s->event_cb(s->event_ud, STREAM_EVENT_READY,
-					    NULL);
-			s->buffering = 0;
+			if(output_alsa_recover(h, ret) < 0)
+			{
+				printf("snd_pcm_mmap_begin failed!\n");
+				break;
+			}
+			continue;
 		}
+		dma_buffer = (unsigned char *) areas[0].addr +
+			     (areas[0].first / 8) +
+			     (offset * (areas[0].step / 8));
+
+		/* Mix streams directly into DMA area when device format is
+		 * the mix format */
+		out_buffer = h->convert != NULL ? mix_buffer : dma_buffer;
+		output_alsa_time(&ts);
+		out_size = output_alsa_mix_streams(h, in_buffer, out_buffer,
+						   frames * h->channels) /
+			   h->channels;
+		if(out_size == 0)
+		{
+			/* Nothing to fade out before a reconfiguration */
+			if(LOAD(h->fade) == FADE_OUT)
+			{
+				snd_pcm_mmap_commit(h->alsa, offset, 0);
+				break;
+			}
 
-		/* Update played value (in ms) */
-		s->played += in_size;
+			/* ALSA PCM is stopped */
+			if(stopped)
+			{
+				/* Release area, wait for a stream and
+				 * continue */
+				snd_pcm_mmap_commit(h->alsa, offset, 0);
+				output_alsa_idle(h);
+				continue;
+			}
+			else if(start == 0)
+			{
+				/* Start time counter */
+				start = time(NULL);
+			}
 
-		/* Add it to output buffer */
-		if(first)
-		{
-			first = 0;
-			for(i = 0; i < in_size; i++)
+			/* Maximum silence time elapsed */
+			if(time(NULL) - start > MAX_SILENCE)
 			{
-				sample = output_alsa_vol(p_in[i], s->volume);
-				p_out[i] = sample;
+				/* Stop ALSA PCM output and prepare for next
+				 * mmap access */
+				snd_pcm_mmap_commit(h->alsa, offset, 0);
+				snd_pcm_drain(h->alsa);
+				snd_pcm_prepare(h->alsa);
+				stopped = 1;
+				continue;
 			}
 		}
 		else
 		{
-			/* Add it to output buffer */
-			for(i = 0; i < in_size; i++)
+			stopped = 0;
+			start = 0;
+		}
+
+		/* Fill end of period with zero */
+		if(out_size < frames)
+			memset(out_buffer + out_size * h->channels * 4, 0,
+			       (frames - out_size) * h->channels * 4);
+
+		/* Fade in or out around a reconfiguration */
+		if(out_size > 0)
+			last = output_alsa_fade(h, (mix_sample_t *) out_buffer,
+						out_size);
+
+		/* Convert to device format */
+		if(h->convert != NULL)
+			h->convert(dma_buffer, (mix_sample_t *) out_buffer,
+				   frames * h->channels);
+
+		/* Give period to ALSA */
+		output_alsa_account_mix(h, &ts);
+		ret = snd_pcm_mmap_commit(h->alsa, offset, frames);
+		if(ret >= 0 && (snd_pcm_uframes_t) ret != frames)
+			STAT_INC(h->stats.short_writes);
+		if(ret < 0 || (snd_pcm_uframes_t) ret != frames)
+		{
+			if(output_alsa_recover(h, ret >= 0 ? -EPIPE : ret) < 0)
 			{
-				sample = output_alsa_vol(p_in[i], s->volume);
-				p_out[i] = output_alsa_add(p_out[i], sample);
+				printf("snd_pcm_mmap_commit failed!\n");
+				break;
 			}
 		}
+		output_alsa_account_delay(h);
 
-		/* Update out_size */
-		if(out_size < in_size);
-			out_size = in_size;
+		/* Last period has been faded out */
+		if(last)
+			break;
 	}
-	pthread_mutex_unlock(&h->mutex);
-
-	return out_size;
 }
 
-static void *output_alsa_thread(void *user_data)
+static void output_alsa_thread_rw(struct output *h, unsigned char *in_buffer,
+				  unsigned char *out_buffer,
+				  unsigned char *conv_buffer)
 {
-	struct output *h = (struct output *) user_data;
+	unsigned char *buffer = out_buffer;
 	snd_pcm_sframes_t frames;
-	unsigned char *in_buffer, *out_buffer;
+	struct timespec ts;
 	int in_size = BUFFER_SIZE;
 	int out_size = 0;
 	time_t start = 0;
 	int stopped = 1;
+	int last = 0;
 
-	/* Allocate buffer */
-	in_buffer = malloc(in_size * 4);
-	if(in_buffer == NULL)
-		return NULL;
-	out_buffer = malloc(in_size * 4);
-	if(out_buffer == NULL)
-	{
-		free(in_buffer);
-		return NULL;
-	}
-
-	/* Wait end signal */
-	while(!h->stop)
+	while(!LOAD(h->stop))
 	{
+		output_alsa_time(&ts);
 		out_size = output_alsa_mix_streams(h, in_buffer, out_buffer,
 						   in_size) / h->channels;
+
+		/* Fade in or out around a reconfiguration */
+		if(out_size > 0)
+			last = output_alsa_fade(h, (mix_sample_t *) out_buffer,
+						out_size);
+		else if(LOAD(h->fade) == FADE_OUT)
+			break;
+
 		if(out_size == 0)
 		{
 			/* ALSA PCM is stopped */
 			if(stopped)
 			{
-				/* Wait 10ms and continue */
-				usleep(MIN_LATENCY * 1000);
+				/* Wait for a stream and continue */
+				output_alsa_idle(h);
 				continue;
 			}
 			else if(start == 0)
@@ -686,12 +1668,21 @@ static void *output_alsa_thread(void *user_data)
 			start = 0;
 		}
 
+		/* Convert to device format */
+		if(h->convert != NULL)
+		{
+			h->convert(conv_buffer, (mix_sample_t *) out_buffer,
+				   out_size * h->channels);
+			buffer = conv_buffer;
+		}
+
 		/* Play pcm sample */
-		frames = snd_pcm_writei(h->alsa, out_buffer, out_size);
+		output_alsa_account_mix(h, &ts);
+		frames = snd_pcm_writei(h->alsa, buffer, out_size);
 
 		/* Try again to send frames */
 		if (frames < 0)
-			frames = snd_pcm_recover(h->alsa, frames, 0);
+			frames = output_alsa_recover(h, frames);
 
 		/* Problem with ALSA */
 		if (frames < 0)
@@ -702,18 +1693,240 @@ static void *output_alsa_thread(void *user_data)
 
 		/* Underrun */
 		if (frames > 0 && frames < (long) out_size)
+		{
+			STAT_INC(h->stats.short_writes);
 			printf("Short write (expected %li, wrote %li)\n",
 			      (long) out_size, frames);
+		}
+		output_alsa_account_delay(h);
+
+		/* Last period has been faded out */
+		if(last)
+			break;
+	}
+}
+
+static void *output_alsa_thread(void *user_data)
+{
+	struct output *h = (struct output *) user_data;
+	unsigned char *in_buffer, *out_buffer = NULL, *conv_buffer = NULL;
+
+	/* Set thread scheduling and name */
+	thread_setup(THREAD_OUTPUT, "alsa-mixer");
+
+	/* Allocate buffers: in mmap mode, streams are mixed directly into DMA
+	 * area when no conversion is needed */
+	in_buffer = pool_alloc(BUFFER_SIZE * 4);
+	if(in_buffer == NULL)
+		return NULL;
+	if(!h->mmap || h->convert != NULL)
+	{
+		out_buffer = pool_alloc(BUFFER_SIZE * 4);
+		if(out_buffer == NULL)
+			goto end;
+	}
+	if(!h->mmap && h->convert != NULL)
+	{
+		conv_buffer = pool_alloc(BUFFER_SIZE * h->format->size);
+		if(conv_buffer == NULL)
+			goto end;
 	}
 
+	/* Mix and play until end signal */
+	if(h->mmap)
+		output_alsa_thread_mmap(h, in_buffer, out_buffer);
+	else
+		output_alsa_thread_rw(h, in_buffer, out_buffer, conv_buffer);
+
+end:
 	/* Free buffers */
-	free(in_buffer);
-	free(out_buffer);
+	pool_free(in_buffer);
+	pool_free(out_buffer);
+	pool_free(conv_buffer);
 
 	return NULL;
 }
 
 
+int output_alsa_get_stats(struct output *h, struct output_stats *stats)
+{
+	int i;
+
+	/* Copy statistics */
+	stats->xruns = STAT_GET(h->stats.xruns);
+	stats->short_writes = STAT_GET(h->stats.short_writes);
+	stats->periods = STAT_GET(h->stats.periods);
+	stats->mix_time_min = STAT_GET(h->stats.mix_time_min);
+	stats->mix_time_avg = STAT_GET(h->stats.mix_time_avg);
+	stats->mix_time_max = STAT_GET(h->stats.mix_time_max);
+	for(i = 0; i < OUTPUT_STATS_HISTOGRAM_SIZE; i++)
+		stats->mix_time_histogram[i] =
+				  STAT_GET(h->stats.mix_time_histogram[i]);
+	stats->delay = STAT_GET(h->stats.delay);
+
+	return 0;
+}
+
+static void output_alsa_stop(struct output *h, int fade)
+{
+	unsigned int i;
+
+	/* Stop mixer thread, after a last faded period if asked */
+	if(h->running)
+	{
+		if(fade)
+			STORE(h->fade, FADE_OUT);
+		else
+			STORE(h->stop, 1);
+		output_alsa_wake(h);
+		pthread_join(h->thread, NULL);
+		h->running = 0;
+	}
+
+	/* Stop and join pre-mix workers */
+	STORE(h->stop, 1);
+	lock_mutex(alsa_premix_class, &h->work_mutex);
+	pthread_cond_broadcast(&h->work_cond);
+	unlock_mutex(alsa_premix_class, &h->work_mutex);
+	for(i = 0; i < h->worker_count; i++)
+		pthread_join(h->workers[i].thread, NULL);
+	h->worker_count = 0;
+}
+
+static void output_alsa_reformat_stream(struct output *h,
+					struct output_stream *s,
+					unsigned long samplerate,
+					unsigned char channels)
+{
+	struct resample_handle *res = NULL;
+	a_write_cb out = NULL;
+	void *user_data;
+	uint64_t played;
+
+	/* Convert played status to new format: samples dropped from cache and
+	 * resampler are counted as played, as with an abort */
+	played = LOAD(s->played) * 1000 / samplerate / channels;
+	played += cache_delay(s->cache) + resample_delay(s->res);
+	STORE(s->played, played * h->samplerate * h->channels / 1000);
+
+	/* Open a resampler to new format: write() goes to cache */
+	user_data = s->user_data;
+	if(s->input_callback == NULL)
+	{
+		out = &cache_write;
+		user_data = s->cache;
+	}
+	if(resample_open(&res, s->samplerate, s->channels, h->samplerate,
+			 h->channels, &s->profile, s->input_callback, out,
+			 user_data) != 0)
+	{
+		/* Stream can't be played anymore */
+		fprintf(stderr, "[alsa] can't open resampler for new format\n");
+		STORE(s->abort, 1);
+		STORE(s->end_of_stream, 1);
+		res = NULL;
+	}
+
+	/* Flush cache to new format and plug it to new resampler: buffered
+	 * data is lost but stream plays again as soon as a few samples are
+	 * cached. Input callback of a paused or aborted stream is already
+	 * locked by a previous flush or abort. */
+	if(s->input_locked)
+		cache_set_format_locked(s->cache, h->samplerate, h->channels,
+					res, REFORMAT_READY);
+	else
+		cache_set_format(s->cache, h->samplerate, h->channels, res,
+				 REFORMAT_READY);
+	if(s->res != NULL)
+		resample_close(s->res);
+	s->res = res;
+
+	/* Restore playback rate and latency tracing */
+	if(res != NULL && s->ratio != 1.0)
+		resample_set_ratio(res, s->ratio);
+	resample_set_trace(res, LOAD(s->trace));
+	trace_reset(LOAD(s->trace));
+
+	/* Unlock input callback as after a flush */
+	if(LOAD(s->is_playing))
+		cache_unlock(s->cache);
+	else
+		s->input_locked = 1;
+}
+
+int output_alsa_reconfigure(struct output *h, const struct output_attr *attr)
+{
+	unsigned long samplerate = h->samplerate;
+	unsigned char channels = h->channels;
+	size_t stage_len = h->stage_len;
+	int premix = h->worker_count > 0;
+	struct output_stream *s;
+	int reformat;
+
+	/* Fade out and stop mixer: streams, caches and resamplers are kept */
+	output_alsa_stop(h, 1);
+
+	/* Play remaining samples and close previous PCM */
+	if(h->alsa != NULL)
+	{
+		snd_pcm_drain(h->alsa);
+		snd_pcm_close(h->alsa);
+		h->alsa = NULL;
+	}
+
+	/* Open new PCM */
+	h->samplerate = attr->samplerate;
+	h->channels = attr->channels;
+	if(output_alsa_open_pcm(h, attr) != 0)
+	{
+		/* Keep previous format for streams */
+		h->samplerate = samplerate;
+		h->channels = channels;
+		return -1;
+	}
+	reformat = h->samplerate != samplerate || h->channels != channels;
+
+	/* The mixer and the workers are stopped: streams can be updated, with
+	 * the stream list locked against concurrent open and close */
+	lock_mutex(alsa_class, &h->mutex);
+	for(s = h->streams; s != NULL; s = s->next)
+	{
+		/* Open resamplers to new format */
+		if(reformat)
+			output_alsa_reformat_stream(h, s, samplerate,
+						    channels);
+
+		/* Staged period is kept when its size is kept */
+		if(!reformat && stage_len == h->stage_len &&
+		   premix == (attr->premix_threads > 0))
+			continue;
+		pool_free(s->stage);
+		s->stage = NULL;
+		s->stage_state = STAGE_EMPTY;
+		s->stage_size = 0;
+		s->stage_pos = 0;
+		s->mixed = 0;
+	}
+
+	/* Allocate staging buffers for pre-mix */
+	premix = attr->premix_threads > 0;
+	for(s = h->streams; premix && s != NULL; s = s->next)
+	{
+		if(s->stage == NULL)
+			s->stage = pool_alloc(h->stage_len *
+					      sizeof(mix_sample_t));
+		if(s->stage == NULL)
+			premix = 0;
+	}
+	unlock_mutex(alsa_class, &h->mutex);
+
+	/* Restart mixer with a fade in: without staging buffers for all
+	 * streams, pre-mix is disabled */
+	STORE(h->stop, 0);
+	STORE(h->fade, FADE_IN);
+	return output_alsa_start(h, premix ? attr->premix_threads : 0);
+}
+
 int output_alsa_close(struct output *h)
 {
 	struct output_stream *s;
@@ -721,12 +1934,8 @@ int output_alsa_close(struct output *h)
 	if(h == NULL)
 		return 0;
 
-	/* Stop thread */
-	h->stop = 1;
-
-	/* Join thread */
-	if(pthread_join(h->thread, NULL) < 0)
-		return -1;
+	/* Stop mixer thread and pre-mix workers */
+	output_alsa_stop(h, 0);
 
 	/* Free streams */
 	while(h->streams != NULL)
@@ -751,6 +1960,7 @@ int output_alsa_close(struct output *h)
 
 struct output_module output_alsa = {
 	.open = (void*) &output_alsa_open,
+	.reconfigure = (void*) &output_alsa_reconfigure,
 	.set_volume = (void*) &output_alsa_set_volume,
 	.get_volume = (void*) &output_alsa_get_volume,
 	.add_stream = (void*) &output_alsa_add_stream,
@@ -758,13 +1968,18 @@ struct output_module output_alsa = {
 	.pause_stream = (void*) &output_alsa_pause_stream,
 	.flush_stream = (void*) &output_alsa_flush_stream,
 	.write_stream = (void*) &output_alsa_write_stream,
+	.reserve_stream = (void*) &output_alsa_reserve_stream,
+	.commit_stream = (void*) &output_alsa_commit_stream,
 	.set_volume_stream = (void*) &output_alsa_set_volume_stream,
 	.get_volume_stream = (void*) &output_alsa_get_volume_stream,
 	.set_cache_stream = (void*) &output_alsa_set_cache_stream,
+	.set_ratio_stream = (void*) &output_alsa_set_ratio_stream,
+	.set_trace_stream = (void*) &output_alsa_set_trace_stream,
 	.get_status_stream = (void*) &output_alsa_get_status_stream,
 	.set_stream_event_cb = (void*) &output_alsa_set_stream_event_cb,
 	.abort_stream = (void*) &output_alsa_abort_stream,
 	.restore_stream = (void*) &output_alsa_restore_stream,
 	.remove_stream = (void*) &output_alsa_remove_stream,
+	.get_stats = (void*) &output_alsa_get_stats,
 	.close = (void*) &output_alsa_close,
 };
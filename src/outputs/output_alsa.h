@@ -21,7 +21,7 @@
 
 #include "outputs.h"
 
-struct output_module output_alsa;
+extern struct output_module output_alsa;
 
 #endif
 
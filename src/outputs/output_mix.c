@@ -0,0 +1,681 @@
+/*
+ * output_mix.c - Sample mixing kernels for audio outputs
+ *
+ * Copyright (c) 2014   A. Dilly
+ *
+ * AirCat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * AirCat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with AirCat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+	#if defined(__SSE2__)
+		#define MIX_SSE2 1
+		#include <emmintrin.h>
+	#endif
+	#if defined(__GNUC__)
+		#define MIX_AVX2 1
+		#include <immintrin.h>
+	#endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	#define MIX_NEON 1
+	#include <arm_neon.h>
+#endif
+
+#include "output_mix.h"
+#include "output.h"
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+/******************************************************************************
+ *                               Scalar kernels                               *
+ ******************************************************************************/
+
+#ifdef USE_FLOAT
+static inline float output_mix_vol(float x, unsigned int v)
+{
+	return x * (v * 1.0 / OUTPUT_VOLUME_MAX);
+}
+
+static inline float output_mix_sat(float a, float b)
+{
+	float sum;
+
+	sum = a + b;
+
+	if(sum > 1.0)
+		sum = 1.0;
+	else if(sum < -1.0)
+		sum = -1.0;
+
+	return sum;
+}
+#else
+static inline int32_t output_mix_vol(int32_t x, unsigned int v)
+{
+	int64_t value;
+
+	value = ((int64_t)x * v) / OUTPUT_VOLUME_MAX;
+
+	return (int32_t) value;
+}
+
+static inline int32_t output_mix_sat(int32_t a, int32_t b)
+{
+	int64_t sum;
+
+	sum = (int64_t)a + (int64_t)b;
+
+	if(sum > 0x7FFFFFFFLL)
+		sum = 0x7FFFFFFFLL;
+	else if(sum < -0x80000000LL)
+		sum = -0x80000000LL;
+
+	return (int32_t) sum;
+}
+#endif
+
+static void output_mix_copy_scalar(mix_sample_t *out, const mix_sample_t *in,
+				   size_t len, unsigned int volume)
+{
+	size_t i;
+
+	for(i = 0; i < len; i++)
+		out[i] = output_mix_vol(in[i], volume);
+}
+
+static void output_mix_add_scalar(mix_sample_t *out, const mix_sample_t *in,
+				  size_t len, unsigned int volume)
+{
+	size_t i;
+
+	for(i = 0; i < len; i++)
+		out[i] = output_mix_sat(out[i], output_mix_vol(in[i], volume));
+}
+
+/******************************************************************************
+ *                                SSE2 kernels                                *
+ ******************************************************************************/
+
+/* Volume is applied in double precision: the product of a 32-bit sample by a
+ * 16-bit volume fits exactly in a double mantissa and the quotient is never
+ * rounded across an integer, so a truncated conversion gives exactly the same
+ * result as the 64-bit integer division of the scalar path.
+ */
+
+#ifdef MIX_SSE2
+#ifdef USE_FLOAT
+static inline __m128 output_mix_vol_sse2(__m128 x, __m128d gain)
+{
+	__m128 lo, hi;
+
+	lo = _mm_cvtpd_ps(_mm_mul_pd(_mm_cvtps_pd(x), gain));
+	hi = _mm_cvtpd_ps(_mm_mul_pd(_mm_cvtps_pd(_mm_movehl_ps(x, x)), gain));
+
+	return _mm_movelh_ps(lo, hi);
+}
+
+static inline __m128 output_mix_sat_sse2(__m128 a, __m128 b)
+{
+	/* Operand order keeps NaN as the scalar path does */
+	return _mm_min_ps(_mm_set1_ps(1.0f),
+			  _mm_max_ps(_mm_set1_ps(-1.0f), _mm_add_ps(a, b)));
+}
+
+static void output_mix_copy_sse2(float *out, const float *in, size_t len,
+				 unsigned int volume)
+{
+	__m128d gain = _mm_set1_pd(volume * 1.0 / OUTPUT_VOLUME_MAX);
+	size_t i;
+
+	for(i = 0; i + 4 <= len; i += 4)
+		_mm_storeu_ps(&out[i],
+			      output_mix_vol_sse2(_mm_loadu_ps(&in[i]), gain));
+
+	output_mix_copy_scalar(&out[i], &in[i], len - i, volume);
+}
+
+static void output_mix_add_sse2(float *out, const float *in, size_t len,
+				unsigned int volume)
+{
+	__m128d gain = _mm_set1_pd(volume * 1.0 / OUTPUT_VOLUME_MAX);
+	__m128 x;
+	size_t i;
+
+	for(i = 0; i + 4 <= len; i += 4)
+	{
+		x = output_mix_vol_sse2(_mm_loadu_ps(&in[i]), gain);
+		_mm_storeu_ps(&out[i],
+			      output_mix_sat_sse2(_mm_loadu_ps(&out[i]), x));
+	}
+
+	output_mix_add_scalar(&out[i], &in[i], len - i, volume);
+}
+#else
+static inline __m128i output_mix_vol_sse2(__m128i x, __m128d vol,
+					  __m128d max)
+{
+	__m128d lo, hi;
+
+	lo = _mm_div_pd(_mm_mul_pd(_mm_cvtepi32_pd(x), vol), max);
+	hi = _mm_div_pd(_mm_mul_pd(_mm_cvtepi32_pd(_mm_srli_si128(x, 8)), vol),
+			max);
+
+	return _mm_unpacklo_epi64(_mm_cvttpd_epi32(lo), _mm_cvttpd_epi32(hi));
+}
+
+static inline __m128i output_mix_sat_sse2(__m128i a, __m128i b)
+{
+	__m128i sum, ovf, sat;
+
+	/* Overflow when operands have same sign and sum has not */
+	sum = _mm_add_epi32(a, b);
+	ovf = _mm_srai_epi32(_mm_andnot_si128(_mm_xor_si128(a, b),
+					      _mm_xor_si128(a, sum)), 31);
+
+	/* Saturated value: 0x7FFFFFFF for positive a, 0x80000000 otherwise */
+	sat = _mm_xor_si128(_mm_srai_epi32(a, 31), _mm_set1_epi32(0x7FFFFFFF));
+
+	return _mm_or_si128(_mm_and_si128(ovf, sat), _mm_andnot_si128(ovf, sum));
+}
+
+static void output_mix_copy_sse2(int32_t *out, const int32_t *in, size_t len,
+				 unsigned int volume)
+{
+	__m128d vol = _mm_set1_pd((double) volume);
+	__m128d max = _mm_set1_pd((double) OUTPUT_VOLUME_MAX);
+	size_t i = 0;
+
+	/* Unity volume is a plain copy */
+	if(volume == OUTPUT_VOLUME_MAX)
+	{
+		memcpy(out, in, len * sizeof(int32_t));
+		return;
+	}
+
+	for(i = 0; i + 4 <= len; i += 4)
+		_mm_storeu_si128((__m128i*) &out[i], output_mix_vol_sse2(
+				  _mm_loadu_si128((const __m128i*) &in[i]), vol,
+				  max));
+
+	output_mix_copy_scalar(&out[i], &in[i], len - i, volume);
+}
+
+static void output_mix_add_sse2(int32_t *out, const int32_t *in, size_t len,
+				unsigned int volume)
+{
+	__m128d vol = _mm_set1_pd((double) volume);
+	__m128d max = _mm_set1_pd((double) OUTPUT_VOLUME_MAX);
+	__m128i x;
+	size_t i;
+
+	for(i = 0; i + 4 <= len; i += 4)
+	{
+		x = _mm_loadu_si128((const __m128i*) &in[i]);
+		if(volume != OUTPUT_VOLUME_MAX)
+			x = output_mix_vol_sse2(x, vol, max);
+		_mm_storeu_si128((__m128i*) &out[i], output_mix_sat_sse2(
+				  _mm_loadu_si128((__m128i*) &out[i]), x));
+	}
+
+	output_mix_add_scalar(&out[i], &in[i], len - i, volume);
+}
+#endif
+
+static const struct output_mix output_mix_sse2 = {
+	.name = "sse2",
+	.copy = &output_mix_copy_sse2,
+	.add = &output_mix_add_sse2,
+};
+#endif
+
+/******************************************************************************
+ *                                AVX2 kernels                                *
+ ******************************************************************************/
+
+#ifdef MIX_AVX2
+#define AVX2 __attribute__((target("avx2")))
+
+#ifdef USE_FLOAT
+static inline AVX2 __m256 output_mix_vol_avx2(__m256 x, __m256d gain)
+{
+	__m128 lo, hi;
+
+	lo = _mm256_cvtpd_ps(_mm256_mul_pd(
+			    _mm256_cvtps_pd(_mm256_castps256_ps128(x)), gain));
+	hi = _mm256_cvtpd_ps(_mm256_mul_pd(
+			    _mm256_cvtps_pd(_mm256_extractf128_ps(x, 1)), gain));
+
+	return _mm256_insertf128_ps(_mm256_castps128_ps256(lo), hi, 1);
+}
+
+static inline AVX2 __m256 output_mix_sat_avx2(__m256 a, __m256 b)
+{
+	return _mm256_min_ps(_mm256_set1_ps(1.0f),
+			     _mm256_max_ps(_mm256_set1_ps(-1.0f),
+					   _mm256_add_ps(a, b)));
+}
+
+static AVX2 void output_mix_copy_avx2(float *out, const float *in, size_t len,
+				      unsigned int volume)
+{
+	__m256d gain = _mm256_set1_pd(volume * 1.0 / OUTPUT_VOLUME_MAX);
+	size_t i;
+
+	for(i = 0; i + 8 <= len; i += 8)
+		_mm256_storeu_ps(&out[i], output_mix_vol_avx2(
+						  _mm256_loadu_ps(&in[i]), gain));
+
+	output_mix_copy_scalar(&out[i], &in[i], len - i, volume);
+}
+
+static AVX2 void output_mix_add_avx2(float *out, const float *in, size_t len,
+				     unsigned int volume)
+{
+	__m256d gain = _mm256_set1_pd(volume * 1.0 / OUTPUT_VOLUME_MAX);
+	__m256 x;
+	size_t i;
+
+	for(i = 0; i + 8 <= len; i += 8)
+	{
+		x = output_mix_vol_avx2(_mm256_loadu_ps(&in[i]), gain);
+		_mm256_storeu_ps(&out[i], output_mix_sat_avx2(
+						    _mm256_loadu_ps(&out[i]), x));
+	}
+
+	output_mix_add_scalar(&out[i], &in[i], len - i, volume);
+}
+#else
+static inline AVX2 __m256i output_mix_vol_avx2(__m256i x, __m256d vol,
+					       __m256d max)
+{
+	__m256d lo, hi;
+
+	lo = _mm256_div_pd(_mm256_mul_pd(_mm256_cvtepi32_pd(
+				  _mm256_castsi256_si128(x)), vol), max);
+	hi = _mm256_div_pd(_mm256_mul_pd(_mm256_cvtepi32_pd(
+				  _mm256_extracti128_si256(x, 1)), vol), max);
+
+	return _mm256_inserti128_si256(_mm256_castsi128_si256(
+					       _mm256_cvttpd_epi32(lo)),
+				       _mm256_cvttpd_epi32(hi), 1);
+}
+
+static inline AVX2 __m256i output_mix_sat_avx2(__m256i a, __m256i b)
+{
+	__m256i sum, ovf, sat;
+
+	sum = _mm256_add_epi32(a, b);
+	ovf = _mm256_srai_epi32(_mm256_andnot_si256(_mm256_xor_si256(a, b),
+						    _mm256_xor_si256(a, sum)),
+				31);
+	sat = _mm256_xor_si256(_mm256_srai_epi32(a, 31),
+			       _mm256_set1_epi32(0x7FFFFFFF));
+
+	return _mm256_blendv_epi8(sum, sat, ovf);
+}
+
+static AVX2 void output_mix_copy_avx2(int32_t *out, const int32_t *in,
+				      size_t len, unsigned int volume)
+{
+	__m256d vol = _mm256_set1_pd((double) volume);
+	__m256d max = _mm256_set1_pd((double) OUTPUT_VOLUME_MAX);
+	size_t i;
+
+	if(volume == OUTPUT_VOLUME_MAX)
+	{
+		memcpy(out, in, len * sizeof(int32_t));
+		return;
+	}
+
+	for(i = 0; i + 8 <= len; i += 8)
+		_mm256_storeu_si256((__m256i*) &out[i], output_mix_vol_avx2(
+			       _mm256_loadu_si256((const __m256i*) &in[i]), vol,
+			       max));
+
+	output_mix_copy_scalar(&out[i], &in[i], len - i, volume);
+}
+
+static AVX2 void output_mix_add_avx2(int32_t *out, const int32_t *in,
+				     size_t len, unsigned int volume)
+{
+	__m256d vol = _mm256_set1_pd((double) volume);
+	__m256d max = _mm256_set1_pd((double) OUTPUT_VOLUME_MAX);
+	__m256i x;
+	size_t i;
+
+	for(i = 0; i + 8 <= len; i += 8)
+	{
+		x = _mm256_loadu_si256((const __m256i*) &in[i]);
+		if(volume != OUTPUT_VOLUME_MAX)
+			x = output_mix_vol_avx2(x, vol, max);
+		_mm256_storeu_si256((__m256i*) &out[i], output_mix_sat_avx2(
+				    _mm256_loadu_si256((__m256i*) &out[i]), x));
+	}
+
+	output_mix_add_scalar(&out[i], &in[i], len - i, volume);
+}
+#endif
+
+static const struct output_mix output_mix_avx2 = {
+	.name = "avx2",
+	.copy = &output_mix_copy_avx2,
+	.add = &output_mix_add_avx2,
+};
+#endif
+
+/******************************************************************************
+ *                                NEON kernels                                *
+ ******************************************************************************/
+
+/* Volume scaling needs double precision vectors to stay bit-exact, so it is
+ * only vectorized on AArch64. On 32-bit ARM, only unity volume (the common
+ * case) takes the NEON path.
+ */
+
+#ifdef MIX_NEON
+#ifdef USE_FLOAT
+static void output_mix_copy_neon(float *out, const float *in, size_t len,
+				 unsigned int volume)
+{
+#ifdef __aarch64__
+	float64x2_t gain = vdupq_n_f64(volume * 1.0 / OUTPUT_VOLUME_MAX);
+	float32x4_t x;
+	size_t i;
+
+	for(i = 0; i + 4 <= len; i += 4)
+	{
+		x = vld1q_f32(&in[i]);
+		x = vcombine_f32(
+			 vcvt_f32_f64(vmulq_f64(vcvt_f64_f32(vget_low_f32(x)),
+						gain)),
+			 vcvt_f32_f64(vmulq_f64(vcvt_high_f64_f32(x), gain)));
+		vst1q_f32(&out[i], x);
+	}
+
+	output_mix_copy_scalar(&out[i], &in[i], len - i, volume);
+#else
+	if(volume == OUTPUT_VOLUME_MAX)
+		memcpy(out, in, len * sizeof(float));
+	else
+		output_mix_copy_scalar(out, in, len, volume);
+#endif
+}
+
+static void output_mix_add_neon(float *out, const float *in, size_t len,
+				unsigned int volume)
+{
+	float32x4_t one = vdupq_n_f32(1.0f);
+	float32x4_t mone = vdupq_n_f32(-1.0f);
+	float32x4_t x;
+	size_t i;
+#ifdef __aarch64__
+	float64x2_t gain = vdupq_n_f64(volume * 1.0 / OUTPUT_VOLUME_MAX);
+#else
+	if(volume != OUTPUT_VOLUME_MAX)
+	{
+		output_mix_add_scalar(out, in, len, volume);
+		return;
+	}
+#endif
+
+	for(i = 0; i + 4 <= len; i += 4)
+	{
+		x = vld1q_f32(&in[i]);
+#ifdef __aarch64__
+		x = vcombine_f32(
+			 vcvt_f32_f64(vmulq_f64(vcvt_f64_f32(vget_low_f32(x)),
+						gain)),
+			 vcvt_f32_f64(vmulq_f64(vcvt_high_f64_f32(x), gain)));
+#endif
+		x = vaddq_f32(vld1q_f32(&out[i]), x);
+		vst1q_f32(&out[i], vminq_f32(vmaxq_f32(x, mone), one));
+	}
+
+	output_mix_add_scalar(&out[i], &in[i], len - i, volume);
+}
+#else
+#ifdef __aarch64__
+static inline int32x4_t output_mix_vol_neon(int32x4_t x, float64x2_t vol,
+					    float64x2_t max)
+{
+	float64x2_t lo, hi;
+
+	lo = vdivq_f64(vmulq_f64(vcvtq_f64_s64(vmovl_s32(vget_low_s32(x))),
+				 vol), max);
+	hi = vdivq_f64(vmulq_f64(vcvtq_f64_s64(vmovl_high_s32(x)), vol), max);
+
+	return vcombine_s32(vmovn_s64(vcvtq_s64_f64(lo)),
+			    vmovn_s64(vcvtq_s64_f64(hi)));
+}
+#endif
+
+static void output_mix_copy_neon(int32_t *out, const int32_t *in, size_t len,
+				 unsigned int volume)
+{
+#ifdef __aarch64__
+	float64x2_t vol = vdupq_n_f64((double) volume);
+	float64x2_t max = vdupq_n_f64((double) OUTPUT_VOLUME_MAX);
+	size_t i;
+#endif
+
+	if(volume == OUTPUT_VOLUME_MAX)
+	{
+		memcpy(out, in, len * sizeof(int32_t));
+		return;
+	}
+
+#ifdef __aarch64__
+	for(i = 0; i + 4 <= len; i += 4)
+		vst1q_s32(&out[i], output_mix_vol_neon(vld1q_s32(&in[i]), vol,
+						       max));
+
+	output_mix_copy_scalar(&out[i], &in[i], len - i, volume);
+#else
+	output_mix_copy_scalar(out, in, len, volume);
+#endif
+}
+
+static void output_mix_add_neon(int32_t *out, const int32_t *in, size_t len,
+				unsigned int volume)
+{
+	int32x4_t x;
+	size_t i;
+#ifdef __aarch64__
+	float64x2_t vol = vdupq_n_f64((double) volume);
+	float64x2_t max = vdupq_n_f64((double) OUTPUT_VOLUME_MAX);
+#else
+	if(volume != OUTPUT_VOLUME_MAX)
+	{
+		output_mix_add_scalar(out, in, len, volume);
+		return;
+	}
+#endif
+
+	for(i = 0; i + 4 <= len; i += 4)
+	{
+		x = vld1q_s32(&in[i]);
+#ifdef __aarch64__
+		if(volume != OUTPUT_VOLUME_MAX)
+			x = output_mix_vol_neon(x, vol, max);
+#endif
+		vst1q_s32(&out[i], vqaddq_s32(vld1q_s32(&out[i]), x));
+	}
+
+	output_mix_add_scalar(&out[i], &in[i], len - i, volume);
+}
+#endif
+
+static const struct output_mix output_mix_neon = {
+	.name = "neon",
+	.copy = &output_mix_copy_neon,
+	.add = &output_mix_add_neon,
+};
+#endif
+
+/******************************************************************************
+ *                             Format conversion                              *
+ ******************************************************************************/
+
+#ifdef USE_FLOAT
+static inline int32_t output_mix_to_int(float x, double scale, double max)
+{
+	double value = x * scale;
+
+	if(value >= max)
+		return (int32_t) max;
+	else if(value <= -max - 1.0)
+		return (int32_t) (-max - 1.0);
+
+	return (int32_t) value;
+}
+
+static void output_mix_convert_s16(void *out, const float *in, size_t len)
+{
+	int16_t *p = out;
+	size_t i;
+
+	for(i = 0; i < len; i++)
+		p[i] = output_mix_to_int(in[i], 32768.0, 32767.0);
+}
+
+static void output_mix_convert_s24(void *out, const float *in, size_t len)
+{
+	int32_t *p = out;
+	size_t i;
+
+	for(i = 0; i < len; i++)
+		p[i] = output_mix_to_int(in[i], 8388608.0, 8388607.0);
+}
+
+static void output_mix_convert_s32(void *out, const float *in, size_t len)
+{
+	int32_t *p = out;
+	size_t i;
+
+	for(i = 0; i < len; i++)
+		p[i] = output_mix_to_int(in[i], 2147483648.0, 2147483647.0);
+}
+#else
+static void output_mix_convert_s16(void *out, const int32_t *in, size_t len)
+{
+	int16_t *p = out;
+	size_t i;
+
+	for(i = 0; i < len; i++)
+		p[i] = in[i] >> 16;
+}
+
+static void output_mix_convert_s24(void *out, const int32_t *in, size_t len)
+{
+	int32_t *p = out;
+	size_t i;
+
+	for(i = 0; i < len; i++)
+		p[i] = in[i] >> 8;
+}
+
+static void output_mix_convert_float(void *out, const int32_t *in, size_t len)
+{
+	float *p = out;
+	size_t i;
+
+	for(i = 0; i < len; i++)
+		p[i] = in[i] / 2147483648.0f;
+}
+#endif
+
+output_mix_convert_cb output_mix_get_convert(enum output_mix_format format)
+{
+	switch(format)
+	{
+		case OUTPUT_MIX_S16:
+			return &output_mix_convert_s16;
+		case OUTPUT_MIX_S24:
+			return &output_mix_convert_s24;
+#ifdef USE_FLOAT
+		case OUTPUT_MIX_S32:
+			return &output_mix_convert_s32;
+#else
+		case OUTPUT_MIX_FLOAT:
+			return &output_mix_convert_float;
+#endif
+		default:
+			return NULL;
+	}
+}
+
+/******************************************************************************
+ *                              Kernel selection                              *
+ ******************************************************************************/
+
+static const struct output_mix output_mix_scalar = {
+	.name = "scalar",
+	.copy = &output_mix_copy_scalar,
+	.add = &output_mix_add_scalar,
+};
+
+static const struct output_mix *output_mix_current = &output_mix_scalar;
+static pthread_once_t output_mix_once = PTHREAD_ONCE_INIT;
+
+/* Kernel sets supported by CPU (scalar first, NULL terminated) */
+static const struct output_mix *output_mix_all[5] = { &output_mix_scalar };
+
+static void output_mix_select(void)
+{
+	int count = 1;
+
+	/* List supported kernel sets (from slowest to fastest) */
+#ifdef MIX_SSE2
+	output_mix_all[count++] = &output_mix_sse2;
+#endif
+#ifdef MIX_AVX2
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2"))
+		output_mix_all[count++] = &output_mix_avx2;
+#endif
+#ifdef MIX_NEON
+	output_mix_all[count++] = &output_mix_neon;
+#endif
+
+	/* Scalar kernels can be forced for debug purpose */
+	if(getenv("AIRCAT_MIX_SCALAR") != NULL)
+		return;
+
+	/* Best kernel set is the last one */
+	output_mix_current = output_mix_all[count-1];
+}
+
+const struct output_mix *output_mix_get(void)
+{
+	pthread_once(&output_mix_once, output_mix_select);
+
+	return output_mix_current;
+}
+
+const struct output_mix *output_mix_get_scalar(void)
+{
+	return &output_mix_scalar;
+}
+
+const struct output_mix * const *output_mix_get_all(void)
+{
+	pthread_once(&output_mix_once, output_mix_select);
+
+	return output_mix_all;
+}
@@ -0,0 +1,88 @@
+/*
+ * output_mix.h - Sample mixing kernels for audio outputs
+ *
+ * Copyright (c) 2014   A. Dilly
+ *
+ * AirCat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * AirCat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with AirCat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _OUTPUT_MIX_H
+#define _OUTPUT_MIX_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef USE_FLOAT
+typedef float mix_sample_t;
+#else
+typedef int32_t mix_sample_t;
+#endif
+
+/**
+ * Mixing kernel set. All kernels give exactly the same output: the SIMD
+ * versions are bit-exact with the scalar one.
+ *  - copy: out[i] = in[i] * volume,
+ *  - add: out[i] = saturate(out[i] + in[i] * volume).
+ * The volume is in range [0; OUTPUT_VOLUME_MAX].
+ */
+struct output_mix {
+	const char *name;
+	void (*copy)(mix_sample_t *out, const mix_sample_t *in, size_t len,
+		     unsigned int volume);
+	void (*add)(mix_sample_t *out, const mix_sample_t *in, size_t len,
+		    unsigned int volume);
+};
+
+/**
+ * Get best mixing kernel set for current CPU. The choice is done once at
+ * first call.
+ */
+const struct output_mix *output_mix_get(void);
+
+/**
+ * Get the scalar mixing kernel set (reference implementation).
+ */
+const struct output_mix *output_mix_get_scalar(void);
+
+/**
+ * Get all mixing kernel sets supported by current CPU, as a NULL terminated
+ * list which starts with the scalar set. Used to check the SIMD kernels
+ * against the scalar ones.
+ */
+const struct output_mix * const *output_mix_get_all(void);
+
+/**
+ * Sample formats which can be produced from mixed samples. All formats are in
+ * native endianness and S24 is stored in the lower 3 bytes of 32 bits.
+ */
+enum output_mix_format {
+	OUTPUT_MIX_S16,
+	OUTPUT_MIX_S24,
+	OUTPUT_MIX_S32,
+	OUTPUT_MIX_FLOAT
+};
+
+/**
+ * Conversion from mixed samples to a device sample format. The out buffer
+ * must not overlap the in buffer.
+ */
+typedef void (*output_mix_convert_cb)(void *out, const mix_sample_t *in,
+				      size_t len);
+
+/**
+ * Get conversion function for a sample format. NULL is returned when no
+ * conversion is needed (the format is the mix format).
+ */
+output_mix_convert_cb output_mix_get_convert(enum output_mix_format format);
+
+#endif
@@ -0,0 +1,911 @@
+/*
+ * output_rtp.c - RTP multicast network output module
+ *
+ * Copyright (c) 2014   A. Dilly
+ *
+ * AirCat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * AirCat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with AirCat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "output_rtp.h"
+#include "output_mix.h"
+#include "output.h"
+
+#include "resample.h"
+#include "cache.h"
+#include "rtp.h"
+#include "thread.h"
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+/* Default multicast group and port */
+#define DEFAULT_GROUP "239.255.77.77"
+#define DEFAULT_PORT 5004
+
+/* Multicast TTL: stay on local network */
+#define MULTICAST_TTL 1
+
+/* Maximum PCM payload in a RTP packet (fits in an ethernet frame) */
+#define PACKET_SIZE 1408
+
+/* RTP payload types for L16 (RFC 3551): static types are only defined for
+ * 44.1kHz, a dynamic type is used for other formats.
+ */
+#define PAYLOAD_L16_STEREO 10
+#define PAYLOAD_L16_MONO 11
+#define PAYLOAD_L16_DYNAMIC 96
+
+/* Interval between two RTCP sender reports (in s) */
+#define RTCP_INTERVAL 1
+
+/* Time between two checks when a playing stream has no data (in ms) */
+#define MIN_LATENCY 10
+
+/* Maximum time before stopping to send silence (default: 5s) */
+#define MAX_SILENCE 5
+
+/* Offset between NTP epoch (1900) and UNIX epoch (1970) */
+#define NTP_OFFSET 2208988800UL
+
+struct output_stream {
+	/* Resample object */
+	struct resample_handle *res;
+	/* Format */
+	unsigned long samplerate;
+	unsigned char channels;
+	/* Stream status */
+	int is_playing;
+	int end_of_stream;
+	uint64_t played;
+	int abort;
+	/* Stream volume */
+	unsigned int volume;
+	/* Stream cache */
+	struct cache_handle *cache;
+	unsigned long delay;
+	/* Stream event callback */
+	output_stream_event_cb event_cb;
+	void *event_ud;
+	int buffering;
+	/* Next output stream in list */
+	struct output_stream *next;
+};
+
+struct output {
+	/* Network output */
+	int sock;
+	struct sockaddr_in addr;
+	struct sockaddr_in rtcp_addr;
+	/* Format */
+	unsigned long samplerate;
+	unsigned char channels;
+	/* RTP session */
+	uint8_t payload;
+	uint32_t ssrc;
+	uint16_t seq;
+	uint32_t timestamp;
+	uint32_t packet_count;
+	uint32_t octet_count;
+	/* General volume */
+	unsigned int volume;
+	/* Mixing kernels and conversion to S16 */
+	const struct output_mix *mix;
+	output_mix_convert_cb convert;
+	/* Thread objects */
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int stop;
+	/* Stream list */
+	struct output_stream *streams;
+};
+
+static void *output_rtp_thread(void *user_data);
+
+static int output_rtp_parse_address(const char *device, struct in_addr *ip,
+				    unsigned int *port)
+{
+	char group[INET_ADDRSTRLEN];
+	const char *p;
+	size_t len;
+
+	/* Device is "group[:port]" */
+	if(device == NULL)
+		device = DEFAULT_GROUP;
+	p = strchr(device, ':');
+	len = p != NULL ? (size_t) (p - device) : strlen(device);
+	if(len >= sizeof(group))
+		return -1;
+	memcpy(group, device, len);
+	group[len] = '\0';
+
+	/* Get port */
+	*port = p != NULL ? strtoul(p + 1, NULL, 10) : DEFAULT_PORT;
+	if(*port == 0 || *port > 65534)
+		return -1;
+
+	/* Get IP address */
+	if(inet_aton(group, ip) == 0)
+		return -1;
+
+	return 0;
+}
+
+int output_rtp_open(struct output **handle, const struct output_attr *attr)
+{
+	struct output *h;
+	struct in_addr ip;
+	unsigned int port;
+	unsigned char opt;
+
+	/* Allocate handle */
+	*handle = malloc(sizeof(struct output));
+	if(*handle == NULL)
+		return -1;
+	h = *handle;
+
+	/* Init structure */
+	h->sock = -1;
+	h->streams = NULL;
+	h->stop = 0;
+
+	/* Copy output format */
+	h->samplerate = attr->samplerate;
+	h->channels = attr->channels;
+	h->volume = OUTPUT_VOLUME_MAX;
+
+	/* Select best mixing kernels and S16 conversion */
+	h->mix = output_mix_get();
+	h->convert = output_mix_get_convert(OUTPUT_MIX_S16);
+
+	/* Init RTP session */
+	if(h->samplerate == 44100 && h->channels <= 2)
+		h->payload = h->channels == 2 ? PAYLOAD_L16_STEREO :
+						PAYLOAD_L16_MONO;
+	else
+		h->payload = PAYLOAD_L16_DYNAMIC;
+	h->ssrc = ((uint32_t) time(NULL) << 16) ^ (uint32_t) getpid();
+	h->seq = h->ssrc & 0xFFFF;
+	h->timestamp = h->ssrc;
+	h->packet_count = 0;
+	h->octet_count = 0;
+
+	/* Get destination address */
+	if(output_rtp_parse_address(attr->device, &ip, &port) != 0)
+		return -1;
+	memset(&h->addr, 0, sizeof(h->addr));
+	h->addr.sin_family = AF_INET;
+	h->addr.sin_port = htons(port);
+	h->addr.sin_addr = ip;
+
+	/* RTCP is sent on next port */
+	h->rtcp_addr = h->addr;
+	h->rtcp_addr.sin_port = htons(port + 1);
+
+	/* Open socket */
+	if((h->sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+		return -1;
+
+	/* Set multicast options: loop is enabled for local receivers */
+	if(IN_MULTICAST(ntohl(ip.s_addr)))
+	{
+		opt = MULTICAST_TTL;
+		if(setsockopt(h->sock, IPPROTO_IP, IP_MULTICAST_TTL, &opt,
+			      sizeof(opt)) < 0)
+			fprintf(stderr, "Can't set multicast TTL!\n");
+		opt = 1;
+		if(setsockopt(h->sock, IPPROTO_IP, IP_MULTICAST_LOOP, &opt,
+			      sizeof(opt)) < 0)
+			fprintf(stderr, "Can't set multicast loop!\n");
+	}
+
+	/* Initialize mutex and idle condition */
+	pthread_mutex_init(&h->mutex, NULL);
+	pthread_cond_init(&h->cond, NULL);
+
+	/* Create thread */
+	if(pthread_create(&h->thread, NULL, output_rtp_thread, h) != 0)
+		return -1;
+
+	return 0;
+}
+
+int output_rtp_set_volume(struct output *h, unsigned int volume)
+{
+	pthread_mutex_lock(&h->mutex);
+	h->volume = volume;
+	pthread_mutex_unlock(&h->mutex);
+
+	return 0;
+}
+
+unsigned int output_rtp_get_volume(struct output *h)
+{
+	unsigned int volume;
+
+	pthread_mutex_lock(&h->mutex);
+	volume = h->volume;
+	pthread_mutex_unlock(&h->mutex);
+
+	return volume;
+}
+
+static void output_rtp_free_stream(struct output_stream *s)
+{
+	/* Free cache buffer */
+	if(s->cache != NULL)
+		cache_close(s->cache);
+
+	/* Close resample module */
+	if(s->res != NULL)
+		resample_close(s->res);
+
+	/* Free stream */
+	free(s);
+}
+
+struct output_stream *output_rtp_add_stream(struct output *h,
+					    unsigned long samplerate,
+					    unsigned char channels,
+					    unsigned long cache,
+					    int use_cache_thread,
+					    const struct resample_profile *profile,
+					    a_read_cb input_callback,
+					    void *user_data)
+{
+	struct output_stream *s;
+	a_write_cb out = NULL;
+
+	/* Alloc the stream handler */
+	s = malloc(sizeof(struct output_stream));
+	if(s == NULL)
+		return NULL;
+
+	/* Fill the handler */
+	s->samplerate = samplerate;
+	s->channels = channels;
+	s->res = NULL;
+	s->is_playing = 0;
+	s->end_of_stream = 0;
+	s->played = 0;
+	s->abort = 0;
+	s->volume = OUTPUT_VOLUME_MAX;
+	s->cache = NULL;
+	s->delay = cache;
+	s->event_cb = NULL;
+	s->event_ud = NULL;
+	s->buffering = 0;
+
+	/* Add cache for write() */
+	if(input_callback == NULL)
+	{
+		/* Open a new cache */
+		if(cache_open(&s->cache, cache, h->samplerate, h->channels, 0,
+			      NULL, NULL, NULL, NULL) != 0)
+			goto error;
+		out = &cache_write;
+		user_data = s->cache;
+	}
+
+	/* Open resample/mixer filter */
+	if(resample_open(&s->res, samplerate, channels, h->samplerate,
+			 h->channels, profile, input_callback, out,
+			 user_data) != 0)
+		goto error;
+
+	/* Add cache for read() */
+	if(input_callback != NULL)
+	{
+		/* Open a new cache */
+		if(cache_open(&s->cache, cache, h->samplerate, h->channels,
+			      use_cache_thread, &resample_read, s->res,
+			      NULL, NULL) != 0)
+			goto error;
+	}
+
+	/* Add stream to stream list */
+	pthread_mutex_lock(&h->mutex);
+	s->next = h->streams;
+	h->streams = s;
+	pthread_cond_signal(&h->cond);
+	pthread_mutex_unlock(&h->mutex);
+
+	return s;
+
+error:
+	output_rtp_free_stream(s);
+	return NULL;
+}
+
+int output_rtp_play_stream(struct output *h, struct output_stream *s)
+{
+	pthread_mutex_lock(&h->mutex);
+
+	/* Play */
+	s->is_playing = 1;
+
+	/* Unlock cache after a flush */
+	cache_unlock(s->cache);
+
+	/* Wake up idle thread */
+	pthread_cond_signal(&h->cond);
+
+	pthread_mutex_unlock(&h->mutex);
+
+	return 0;
+}
+
+int output_rtp_pause_stream(struct output *h, struct output_stream *s)
+{
+	pthread_mutex_lock(&h->mutex);
+
+	/* Pause */
+	s->is_playing = 0;
+
+	pthread_mutex_unlock(&h->mutex);
+
+	return 0;
+}
+
+void output_rtp_flush_stream(struct output *h, struct output_stream *s,
+			     unsigned long ready)
+{
+	pthread_mutex_lock(&h->mutex);
+
+	/* Flush the cache */
+	cache_flush_ready(s->cache, ready);
+	resample_flush(s->res);
+
+	/* Must unlock input callback in cache after a flush */
+	if(s->is_playing)
+		cache_unlock(s->cache);
+	s->played = 0;
+
+	pthread_mutex_unlock(&h->mutex);
+}
+
+ssize_t output_rtp_write_stream(struct output *h, struct output_stream *s,
+				const unsigned char *buffer, size_t size,
+				struct a_format *fmt)
+{
+	/* Write data to SR/Mixer filter */
+	if(s->abort)
+		return 0;
+
+	return resample_write(s->res, buffer, size, fmt);
+}
+
+int output_rtp_set_volume_stream(struct output *h, struct output_stream *s,
+				 unsigned int volume)
+{
+	pthread_mutex_lock(&h->mutex);
+	s->volume = volume;
+	pthread_mutex_unlock(&h->mutex);
+
+	return 0;
+}
+
+unsigned int output_rtp_get_volume_stream(struct output *h,
+					  struct output_stream *s)
+{
+	unsigned int volume;
+
+	pthread_mutex_lock(&h->mutex);
+	volume = s->volume;
+	pthread_mutex_unlock(&h->mutex);
+
+	return volume;
+}
+
+int output_rtp_set_cache_stream(struct output *h, struct output_stream *s,
+				unsigned long cache)
+{
+	int ret;
+
+	pthread_mutex_lock(&h->mutex);
+
+	/* Set new cache */
+	ret = cache_set_time(s->cache, cache);
+	if(ret == 0)
+		s->delay = cache;
+
+	pthread_mutex_unlock(&h->mutex);
+
+	return ret;
+}
+
+int output_rtp_set_ratio_stream(struct output *h, struct output_stream *s,
+				double ratio)
+{
+	return resample_set_ratio(s->res, ratio);
+}
+
+unsigned long output_rtp_get_status_stream(struct output *h,
+					   struct output_stream *s,
+					   enum output_stream_key key)
+{
+	unsigned long ret = 0;
+
+	/* Lock stream access */
+	pthread_mutex_lock(&h->mutex);
+
+	switch(key)
+	{
+		case OUTPUT_STREAM_STATUS:
+			if(s->end_of_stream)
+				ret = STREAM_ENDED;
+			else if(s->is_playing)
+				ret = STREAM_PLAYING;
+			else
+				ret = STREAM_PAUSED;
+			break;
+		case OUTPUT_STREAM_PLAYED:
+			ret = s->played * 1000 / h->samplerate / h->channels;
+			break;
+		case OUTPUT_STREAM_CACHE_STATUS:
+			if(s->delay > 0 && cache_is_ready(s->cache) == 0)
+				ret = CACHE_BUFFERING;
+			else
+				ret = CACHE_READY;
+			break;
+		case OUTPUT_STREAM_CACHE_FILLING:
+			if(s->delay > 0)
+				ret = cache_get_filling(s->cache);
+			else
+				ret = 100;
+			break;
+		case OUTPUT_STREAM_CACHE_DELAY:
+			ret = cache_delay(s->cache);
+			break;
+		case OUTPUT_STREAM_DELAY:
+			ret = resample_delay(s->res) + cache_delay(s->cache);
+			break;
+		default:
+			ret = 0;
+	}
+
+	/* Unlock stream access */
+	pthread_mutex_unlock(&h->mutex);
+
+	return ret;
+}
+
+int output_rtp_set_stream_event_cb(struct output *h, struct output_stream *s,
+				   output_stream_event_cb cb, void *user_data)
+{
+	/* Lock callback access */
+	pthread_mutex_lock(&h->mutex);
+
+	/* Set event callback */
+	s->event_cb = cb;
+	s->event_ud = user_data;
+
+	/* Unlock callback access */
+	pthread_mutex_unlock(&h->mutex);
+
+	return 0;
+}
+
+unsigned long output_rtp_abort_stream(struct output *h,
+				      struct output_stream *s)
+{
+	unsigned long played;
+
+	/* Lock stream access */
+	pthread_mutex_lock(&h->mutex);
+
+	/* Pause stream */
+	s->is_playing = 0;
+	s->abort = 1;
+
+	/* Lock cache */
+	cache_lock(s->cache);
+
+	/* Calculate played status */
+	played = s->played * 1000 / h->samplerate / h->channels;
+
+	/* Add not played samples */
+	played += cache_delay(s->cache);
+	played += resample_delay(s->res);
+
+	/* Unlock stream access */
+	pthread_mutex_unlock(&h->mutex);
+
+	return played;
+}
+
+void output_rtp_restore_stream(struct output *h, struct output_stream *s,
+			       unsigned long value)
+{
+	/* Lock stream access */
+	pthread_mutex_lock(&h->mutex);
+
+	/* Restore played status */
+	s->played = ((uint64_t)value) * h->samplerate * h->channels / 1000;
+
+	/* Unlock stream access */
+	pthread_mutex_unlock(&h->mutex);
+}
+
+int output_rtp_remove_stream(struct output *h, struct output_stream *s)
+{
+	struct output_stream **lp;
+
+	/* Remove stream from list */
+	pthread_mutex_lock(&h->mutex);
+	for(lp = &h->streams; *lp != NULL; lp = &(*lp)->next)
+	{
+		if(*lp == s)
+		{
+			*lp = s->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&h->mutex);
+
+	/* Free stream */
+	output_rtp_free_stream(s);
+
+	return 0;
+}
+
+static int output_rtp_mix_streams(struct output *h, unsigned char *in_buffer,
+				  unsigned char *out_buffer, size_t len)
+{
+	struct output_stream *s;
+	struct a_format fmt = A_FORMAT_INIT;
+	mix_sample_t *p_in = (mix_sample_t*) in_buffer;
+	mix_sample_t *p_out = (mix_sample_t*) out_buffer;
+	int out_size = 0;
+	int first = 1;
+	int in_size;
+
+	for(s = h->streams; s != NULL; s = s->next)
+	{
+		if(!s->is_playing || s->end_of_stream)
+			continue;
+
+		/* Get input data */
+		in_size = cache_read(s->cache, in_buffer, len, &fmt);
+		if(in_size <= 0)
+		{
+			if(in_size < 0)
+			{
+				/* Stream is released by remove_stream() */
+				s->end_of_stream = 1;
+
+				/* Notify end of stream */
+				if(s->event_cb != NULL)
+					s->event_cb(s->event_ud,
+						    STREAM_EVENT_END, NULL);
+			}
+			else if(s->delay > 0)
+			{
+				/* Notify cache is buffering */
+				if(s->buffering == 0 && s->event_cb != NULL)
+					s->event_cb(s->event_ud,
+						    STREAM_EVENT_BUFFERING,
+						    NULL);
+				s->buffering = 1;
+			}
+
+			continue;
+		}
+
+		/* Cache is full */
+		if(s->delay > 0 && s->buffering == 1)
+		{
+			/* Notify cache is ready */
+			if(s->event_cb != NULL)
+				s->event_cb(s->event_ud, STREAM_EVENT_READY,
+					    NULL);
+			s->buffering = 0;
+		}
+
+		/* Update played value (in ms) */
+		s->played += in_size;
+
+		/* Add it to output buffer */
+		if(first)
+		{
+			first = 0;
+			h->mix->copy(p_out, p_in, in_size, s->volume);
+			out_size = in_size;
+		}
+		else if(in_size > out_size)
+		{
+			/* Mix with previous streams and copy samples beyond
+			 * their end */
+			h->mix->add(p_out, p_in, out_size, s->volume);
+			h->mix->copy(&p_out[out_size], &p_in[out_size],
+				     in_size - out_size, s->volume);
+			out_size = in_size;
+		}
+		else
+			h->mix->add(p_out, p_in, in_size, s->volume);
+	}
+
+	return out_size;
+}
+
+static void output_rtp_send_report(struct output *h)
+{
+	unsigned char buffer[28];
+	struct timespec now;
+	uint32_t values[6];
+	int i;
+
+	/* Get NTP time of current RTP timestamp */
+	clock_gettime(CLOCK_REALTIME, &now);
+	values[0] = h->ssrc;
+	values[1] = now.tv_sec + NTP_OFFSET;
+	values[2] = (uint32_t) (((uint64_t) now.tv_nsec << 32) / 1000000000);
+	values[3] = h->timestamp;
+	values[4] = h->packet_count;
+	values[5] = h->octet_count;
+
+	/* Sender report header (RFC 3550): V=2, RC=0, PT=200, length=6 */
+	buffer[0] = 0x80;
+	buffer[1] = 200;
+	buffer[2] = 0;
+	buffer[3] = 6;
+	for(i = 0; i < 6; i++)
+	{
+		buffer[4 + i * 4] = (values[i] >> 24) & 0xFF;
+		buffer[5 + i * 4] = (values[i] >> 16) & 0xFF;
+		buffer[6 + i * 4] = (values[i] >> 8) & 0xFF;
+		buffer[7 + i * 4] = values[i] & 0xFF;
+	}
+
+	/* Send report */
+	sendto(h->sock, buffer, sizeof(buffer), 0,
+	       (struct sockaddr *) &h->rtcp_addr, sizeof(h->rtcp_addr));
+}
+
+static void output_rtp_send(struct output *h, unsigned char *packet,
+			    const mix_sample_t *samples, size_t frames,
+			    int marker)
+{
+	uint16_t *payload = (uint16_t *) (packet + RTP_HEADER_SIZE);
+	size_t len = frames * h->channels;
+	size_t i;
+
+	/* Convert to S16 in network byte order (L16) */
+	h->convert(payload, samples, len);
+	for(i = 0; i < len; i++)
+		payload[i] = htons(payload[i]);
+
+	/* Fill RTP header */
+	rtp_set_header(packet, h->payload, marker, h->seq++, h->timestamp,
+		       h->ssrc);
+
+	/* Send packet */
+	if(sendto(h->sock, packet, RTP_HEADER_SIZE + len * 2, 0,
+		  (struct sockaddr *) &h->addr, sizeof(h->addr)) > 0)
+	{
+		h->packet_count++;
+		h->octet_count += len * 2;
+	}
+}
+
+static void output_rtp_idle(struct output *h)
+{
+	struct output_stream *s;
+	struct timespec ts;
+
+	pthread_mutex_lock(&h->mutex);
+
+	/* Look for a playing stream */
+	for(s = h->streams; s != NULL; s = s->next)
+		if(s->is_playing && !s->end_of_stream)
+			break;
+
+	if(!h->stop)
+	{
+		if(s == NULL)
+		{
+			/* Nothing to play: sleep until a stream change */
+			pthread_cond_wait(&h->cond, &h->mutex);
+		}
+		else
+		{
+			/* A stream is waiting for data: poll its cache */
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += MIN_LATENCY * 1000000L;
+			if(ts.tv_nsec >= 1000000000L)
+			{
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&h->cond, &h->mutex, &ts);
+		}
+	}
+
+	pthread_mutex_unlock(&h->mutex);
+}
+
+static void *output_rtp_thread(void *user_data)
+{
+	struct output *h = (struct output *) user_data;
+	unsigned char *in_buffer, *out_buffer, *packet;
+	struct timespec next, now;
+	time_t start = 0, report = 0;
+	size_t frames, out_size;
+	int stopped = 1;
+
+	/* Set thread scheduling and name */
+	thread_setup(THREAD_OUTPUT, "rtp-output");
+
+	/* Packet size in frames */
+	frames = PACKET_SIZE / (2 * h->channels);
+
+	/* Allocate buffers */
+	in_buffer = malloc(frames * h->channels * 4);
+	out_buffer = malloc(frames * h->channels * 4);
+	packet = malloc(RTP_HEADER_SIZE + PACKET_SIZE);
+	if(in_buffer == NULL || out_buffer == NULL || packet == NULL)
+		goto end;
+
+	while(!h->stop)
+	{
+		/* Mix streams */
+		pthread_mutex_lock(&h->mutex);
+		out_size = output_rtp_mix_streams(h, in_buffer, out_buffer,
+						  frames * h->channels) /
+			   h->channels;
+		pthread_mutex_unlock(&h->mutex);
+
+		if(out_size == 0)
+		{
+			/* Nothing is sent */
+			if(stopped)
+			{
+				/* Wait for a stream and continue */
+				output_rtp_idle(h);
+				continue;
+			}
+			else if(start == 0)
+			{
+				/* Start time counter */
+				start = time(NULL);
+			}
+
+			/* Maximum silence time elapsed */
+			if(time(NULL) - start > MAX_SILENCE)
+			{
+				/* Stop sending packets */
+				stopped = 1;
+				continue;
+			}
+		}
+		else if(stopped)
+		{
+			/* Restart timeline: clock of packets starts now */
+			clock_gettime(CLOCK_MONOTONIC, &next);
+			start = 0;
+		}
+
+		/* Fill end of packet with zero */
+		if(out_size < frames)
+			memset(out_buffer + out_size * h->channels * 4, 0,
+			       (frames - out_size) * h->channels * 4);
+
+		/* Send packet: marker is set on first packet after silence */
+		output_rtp_send(h, packet, (mix_sample_t *) out_buffer, frames,
+				stopped);
+		h->timestamp += frames;
+		if(out_size > 0)
+			stopped = 0;
+
+		/* Send sender report to let receivers synchronize */
+		if(time(NULL) - report >= RTCP_INTERVAL)
+		{
+			output_rtp_send_report(h);
+			report = time(NULL);
+		}
+
+		/* Wait until next packet time */
+		next.tv_nsec += (long) (frames * 1000000000ULL / h->samplerate);
+		while(next.tv_nsec >= 1000000000L)
+		{
+			next.tv_nsec -= 1000000000L;
+			next.tv_sec++;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if(now.tv_sec > next.tv_sec + 1)
+		{
+			/* Too late: restart timeline */
+			next = now;
+			continue;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	}
+
+end:
+	/* Free buffers */
+	if(in_buffer != NULL)
+		free(in_buffer);
+	if(out_buffer != NULL)
+		free(out_buffer);
+	if(packet != NULL)
+		free(packet);
+
+	return NULL;
+}
+
+int output_rtp_close(struct output *h)
+{
+	struct output_stream *s;
+
+	if(h == NULL)
+		return 0;
+
+	/* Stop thread */
+	pthread_mutex_lock(&h->mutex);
+	h->stop = 1;
+	pthread_cond_signal(&h->cond);
+	pthread_mutex_unlock(&h->mutex);
+
+	/* Join thread */
+	if(pthread_join(h->thread, NULL) < 0)
+		return -1;
+
+	/* Free streams */
+	while(h->streams != NULL)
+	{
+		s = h->streams;
+		h->streams = s->next;
+		output_rtp_free_stream(s);
+	}
+
+	/* Close socket */
+	if(h->sock >= 0)
+		close(h->sock);
+
+	/* Free structure */
+	free(h);
+
+	return 0;
+}
+
+struct output_module output_rtp = {
+	.open = (void*) &output_rtp_open,
+	.set_volume = (void*) &output_rtp_set_volume,
+	.get_volume = (void*) &output_rtp_get_volume,
+	.add_stream = (void*) &output_rtp_add_stream,
+	.play_stream = (void*) &output_rtp_play_stream,
+	.pause_stream = (void*) &output_rtp_pause_stream,
+	.flush_stream = (void*) &output_rtp_flush_stream,
+	.write_stream = (void*) &output_rtp_write_stream,
+	.set_volume_stream = (void*) &output_rtp_set_volume_stream,
+	.get_volume_stream = (void*) &output_rtp_get_volume_stream,
+	.set_cache_stream = (void*) &output_rtp_set_cache_stream,
+	.set_ratio_stream = (void*) &output_rtp_set_ratio_stream,
+	.get_status_stream = (void*) &output_rtp_get_status_stream,
+	.set_stream_event_cb = (void*) &output_rtp_set_stream_event_cb,
+	.abort_stream = (void*) &output_rtp_abort_stream,
+	.restore_stream = (void*) &output_rtp_restore_stream,
+	.remove_stream = (void*) &output_rtp_remove_stream,
+	.close = (void*) &output_rtp_close,
+};
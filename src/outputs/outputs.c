@@ -27,7 +27,9 @@
 
 #include "outputs.h"
 #include "output_alsa.h"
+#include "output_rtp.h"
 #include "utils.h"
+#include "lock.h"
 
 #define FREE_STRING(s) if(s != NULL) free(s);
 
@@ -53,6 +55,9 @@ struct output_stream_handle {
 	unsigned int volume;
 	int cache;
 	int use_cache_thread;
+	struct resample_profile profile;
+	double ratio;
+	struct trace *trace;
 	void *input_callback;
 	void *user_data;
 	/* Stream status */
@@ -104,10 +109,20 @@ struct outputs_handle {
 	unsigned char channels;
 	unsigned int latency;
 	unsigned int volume;
+	char *device;
+	unsigned long period_size;
+	unsigned long buffer_size;
+	char *format;
+	unsigned int premix_threads;
+	/* Default resampler profile for streams */
+	struct resample_profile resample;
 	/* Mutex for thread-safe */
 	pthread_mutex_t mutex;
 };
 
+/* Lock class of outputs and their streams */
+LOCK_CLASS(outputs_class, "outputs");
+
 static int output_reset_volume_stream(struct outputs_handle *h,
 				      struct output_handle *handle,
 				      struct output_stream_handle *stream);
@@ -117,6 +132,8 @@ int outputs_open(struct outputs_handle **handle, struct json *config)
 	struct outputs_handle *h;
 	struct output_list list[] = {
 		{"alsa", "ALSA", "ALSA audio output.", &output_alsa, NULL},
+		{"rtp", "RTP", "RTP multicast network output.", &output_rtp,
+		 NULL},
 	};
 	struct output_list *l;
 	int i;
@@ -137,6 +154,11 @@ int outputs_open(struct outputs_handle **handle, struct json *config)
 	h->samplerate = 0;
 	h->channels = 0;
 	h->latency = 0;
+	h->device = NULL;
+	h->period_size = 0;
+	h->buffer_size = 0;
+	h->format = NULL;
+	h->premix_threads = 0;
 
 	/* Create output list */
 	for(i = 0; i < sizeof(list)/sizeof(struct output_list); i++)
@@ -181,17 +203,71 @@ static struct output_list *outputs_find_module(struct outputs_handle *h,
 	return NULL;
 }
 
+static int outputs_strcmp(const char *a, const char *b)
+{
+	if(a == NULL || b == NULL)
+		return a != b;
+	return strcmp(a, b);
+}
+
+static void outputs_get_profile(struct outputs_handle *h,
+				const struct resample_profile *profile,
+				struct resample_profile *p)
+{
+	/* Use output default values for unset fields */
+	*p = h->resample;
+	if(profile != NULL)
+	{
+		if(profile->quality != RESAMPLE_DEFAULT)
+			p->quality = profile->quality;
+		if(profile->threads != 0)
+			p->threads = profile->threads;
+		p->variable_rate = profile->variable_rate;
+	}
+}
+
 static void outputs_reload(struct outputs_handle *h, struct output_list *new,
-			   unsigned long samplerate, unsigned char channels,
-			   unsigned int latency)
+			   const struct output_attr *attr)
 {
 	struct output_stream_handle *stream;
+	struct resample_profile profile;
 	struct output_handle *handle;
+	struct output_attr cur;
 
 	/* Update value */
-	h->samplerate = samplerate;
-	h->channels = channels;
-	h->latency = latency;
+	h->samplerate = attr->samplerate;
+	h->channels = attr->channels;
+	h->latency = attr->latency;
+	h->period_size = attr->period_size;
+	h->buffer_size = attr->buffer_size;
+	h->premix_threads = attr->premix_threads;
+	if(h->device != attr->device)
+	{
+		FREE_STRING(h->device);
+		h->device = attr->device != NULL ? strdup(attr->device) : NULL;
+	}
+	if(h->format != attr->format)
+	{
+		FREE_STRING(h->format);
+		h->format = attr->format != NULL ? strdup(attr->format) : NULL;
+	}
+
+	/* Output attributes */
+	cur.samplerate = h->samplerate;
+	cur.channels = h->channels;
+	cur.latency = h->latency;
+	cur.device = h->device;
+	cur.period_size = h->period_size;
+	cur.buffer_size = h->buffer_size;
+	cur.format = h->format;
+	cur.premix_threads = h->premix_threads;
+
+	/* Reconfigure output module in place when supported: streams and their
+	 * caches are kept, so playback is only interrupted for a few ms */
+	if(new != NULL && new == h->current && h->mod != NULL &&
+	   h->handle != NULL && h->mod->reconfigure != NULL &&
+	   h->mod->reconfigure(h->handle, &cur) == 0)
+		return;
 
 	/* Close previous output module */
 	if(h->current != NULL && h->mod != NULL && h->handle != NULL)
@@ -225,8 +301,7 @@ static void outputs_reload(struct outputs_handle *h, struct output_list *new,
 		h->mod = h->current->mod;
 
 		/* Open output module */
-		if(h->mod->open(&h->handle, h->samplerate, h->channels,
-				h->latency) != 0)
+		if(h->mod->open(&h->handle, &cur) != 0)
 		{
 			h->mod->close(h->handle);
 			h->handle = NULL;
@@ -241,17 +316,36 @@ static void outputs_reload(struct outputs_handle *h, struct output_list *new,
 			    stream = stream->next)
 			{
 				/* Add stream */
+				outputs_get_profile(h, &stream->profile,
+						    &profile);
 				stream->stream = h->mod->add_stream(h->handle,
 						       stream->samplerate,
 						       stream->channels,
 						       stream->cache,
 						       stream->use_cache_thread,
+						       &profile,
 						       stream->input_callback,
 						       stream->user_data);
 
 				/* Reset volume */
 				output_reset_volume_stream(h, handle, stream);
 
+				/* Restore playback rate */
+				if(stream->stream != NULL &&
+				   stream->ratio != 1.0 &&
+				   h->mod->set_ratio_stream != NULL)
+					h->mod->set_ratio_stream(h->handle,
+								 stream->stream,
+								 stream->ratio);
+
+				/* Restore latency tracing */
+				if(stream->stream != NULL &&
+				   stream->trace != NULL &&
+				   h->mod->set_trace_stream != NULL)
+					h->mod->set_trace_stream(h->handle,
+								 stream->stream,
+								 stream->trace);
+
 				/* Restore played status */
 				if(h->mod->restore_stream != NULL)
 					h->mod->restore_stream(h->handle,
@@ -270,32 +364,39 @@ static void outputs_reload(struct outputs_handle *h, struct output_list *new,
 int outputs_set_config(struct outputs_handle *h, struct json *cfg)
 {
 	struct output_list *current = NULL;
-	unsigned long samplerate = 0;
-	unsigned char channels = 0;
-	unsigned int latency = 0;
+	struct output_attr attr;
 	const char *id;
 
 	if(h == NULL)
 		return -1;
 
 	/* Lock output access */
-	pthread_mutex_lock(&h->mutex);
+	lock_mutex(outputs_class, &h->mutex);
 
 	/* Free all configuration */
 	current = NULL;
-	samplerate = 0;
-	channels = 0;
-	latency = 0;
+	memset(&attr, 0, sizeof(attr));
 	h->volume = OUTPUT_VOLUME_MAX;
+	h->resample.quality = RESAMPLE_DEFAULT;
+	h->resample.threads = 0;
+	h->resample.variable_rate = 0;
 
 	/* Get configuration */
 	if(cfg != NULL)
 	{
 		id = json_get_string(cfg, "name");
 		current = outputs_find_module(h, id);
-		samplerate = json_get_int(cfg, "samplerate");
-		channels = json_get_int(cfg, "channels");
-		latency = json_get_int(cfg, "latency");
+		attr.samplerate = json_get_int(cfg, "samplerate");
+		attr.channels = json_get_int(cfg, "channels");
+		attr.latency = json_get_int(cfg, "latency");
+		attr.device = json_get_string(cfg, "device");
+		attr.period_size = json_get_int(cfg, "period_size");
+		attr.buffer_size = json_get_int(cfg, "buffer_size");
+		attr.format = json_get_string(cfg, "format");
+		attr.premix_threads = json_get_int(cfg, "premix_threads");
+		h->resample.quality = resample_quality_from_name(
+				     json_get_string(cfg, "resample_quality"));
+		h->resample.threads = json_get_int(cfg, "resample_threads");
 		h->volume = json_has_key(cfg, "volume") ?
 						   json_get_int(cfg, "volume") :
 						   OUTPUT_VOLUME_MAX;
@@ -307,22 +408,35 @@ int outputs_set_config(struct outputs_handle *h, struct json *cfg)
 		/* Choose ALSA as defaut module */
 		current = outputs_find_module(h, "alsa");
 	}
-	if(samplerate == 0)
-		samplerate = 44100;
-	if(channels == 0)
-		channels = 2;
+	if(attr.samplerate == 0)
+		attr.samplerate = 44100;
+	if(attr.channels == 0)
+		attr.channels = 2;
 	if(h->volume > OUTPUT_VOLUME_MAX)
 		h->volume = OUTPUT_VOLUME_MAX;
-	if(latency == 0 || latency > MAX_LATENCY)
-		latency = DEFAULT_LATENCY;
+	if(attr.latency == 0 || attr.latency > MAX_LATENCY)
+		attr.latency = DEFAULT_LATENCY;
+	if(attr.device != NULL && *attr.device == '\0')
+		attr.device = NULL;
+	if(attr.format != NULL && *attr.format == '\0')
+		attr.format = NULL;
+	if(h->resample.quality == RESAMPLE_DEFAULT)
+		h->resample.quality = RESAMPLE_HIGH;
+	if(h->resample.threads == 0)
+		h->resample.threads = 1;
 
 	/* Reload output */
-	if(current != h->current || samplerate != h->samplerate ||
-	   channels != h->channels || latency != h->latency)
-		outputs_reload(h, current, samplerate, channels, latency);
+	if(current != h->current || attr.samplerate != h->samplerate ||
+	   attr.channels != h->channels || attr.latency != h->latency ||
+	   outputs_strcmp(attr.device, h->device) != 0 ||
+	   attr.period_size != h->period_size ||
+	   attr.buffer_size != h->buffer_size ||
+	   outputs_strcmp(attr.format, h->format) != 0 ||
+	   attr.premix_threads != h->premix_threads)
+		outputs_reload(h, current, &attr);
 
 	/* Unlock output access */
-	pthread_mutex_unlock(&h->mutex);
+	unlock_mutex(outputs_class, &h->mutex);
 
 	return 0;
 }
@@ -341,7 +455,7 @@ struct json *outputs_get_config(struct outputs_handle *h)
 		return NULL;
 
 	/* Lock output access */
-	pthread_mutex_lock(&h->mutex);
+	lock_mutex(outputs_class, &h->mutex);
 
 	/* Fill configuration */
 	if(h->current != NULL)
@@ -349,10 +463,18 @@ struct json *outputs_get_config(struct outputs_handle *h)
 	json_set_string(cfg, "id", name);
 	json_set_int(cfg, "samplerate", h->samplerate);
 	json_set_int(cfg, "channels", h->channels);
+	json_set_string(cfg, "device", h->device);
+	json_set_int(cfg, "period_size", h->period_size);
+	json_set_int(cfg, "buffer_size", h->buffer_size);
+	json_set_string(cfg, "format", h->format);
+	json_set_int(cfg, "premix_threads", h->premix_threads);
+	json_set_string(cfg, "resample_quality",
+			resample_quality_name(h->resample.quality));
+	json_set_int(cfg, "resample_threads", h->resample.threads);
 	json_set_int(cfg, "volume", h->volume);
 
 	/* Unlock output access */
-	pthread_mutex_unlock(&h->mutex);
+	unlock_mutex(outputs_class, &h->mutex);
 
 	return cfg;
 }
@@ -365,14 +487,14 @@ int outputs_set_volume(struct outputs_handle *h, unsigned int volume)
 		return -1;
 
 	/* Lock output access */
-	pthread_mutex_lock(&h->mutex);
+	lock_mutex(outputs_class, &h->mutex);
 
 	if(h->current != NULL && h->mod != NULL && h->handle != NULL)
 		ret = h->mod->set_volume(h->handle, volume);
 	h->volume = volume;
 
 	/* Unlock output access */
-	pthread_mutex_unlock(&h->mutex);
+	unlock_mutex(outputs_class, &h->mutex);
 
 	return ret;
 }
@@ -384,13 +506,13 @@ unsigned int outputs_get_volue(struct outputs_handle *h)
 		return 0;
 
 	/* Lock output access */
-	pthread_mutex_lock(&h->mutex);
+	lock_mutex(outputs_class, &h->mutex);
 
 	if(h->current != NULL && h->mod != NULL && h->handle != NULL)
 		vol = h->mod->get_volume(h->handle);
 
 	/* Unlock output access */
-	pthread_mutex_unlock(&h->mutex);
+	unlock_mutex(outputs_class, &h->mutex);
 
 	return vol;
 }
@@ -431,6 +553,10 @@ void outputs_close(struct outputs_handle *h)
 		free(l);
 	}
 
+	/* Free configuration */
+	FREE_STRING(h->device);
+	FREE_STRING(h->format);
+
 	free(h);
 }
 
@@ -462,14 +588,14 @@ int output_open(struct output_handle **handle, struct outputs_handle *outputs,
 	h->volume = OUTPUT_VOLUME_MAX;
 
 	/* Lock output access */
-	pthread_mutex_lock(h->mutex);
+	lock_mutex(outputs_class, h->mutex);
 
 	/* Add output handle to outputs */
 	h->next = outputs->handles;
 	outputs->handles = h;
 
 	/* Unlock output access */
-	pthread_mutex_unlock(h->mutex);
+	unlock_mutex(outputs_class, h->mutex);
 
 	return 0;
 }
@@ -480,23 +606,26 @@ struct output_stream_handle *output_add_stream(struct output_handle *h,
 					       unsigned char channels,
 					       unsigned long cache,
 					       int use_cache_thread,
+				      const struct resample_profile *profile,
 					       a_read_cb input_callback,
 					       void *user_data)
 {
 	struct output_stream_handle *s = NULL;
+	struct resample_profile p;
 	struct output_stream *stream;
 
 	/* Lock output access */
-	pthread_mutex_lock(h->mutex);
+	lock_mutex(outputs_class, h->mutex);
 
 	/* Check output module */
 	if(h == NULL || h->outputs->mod == NULL)
 		goto end;
 
 	/* Add stream to output module */
+	outputs_get_profile(h->outputs, profile, &p);
 	stream = h->outputs->mod->add_stream(h->outputs->handle, samplerate,
 					     channels, cache, use_cache_thread,
-					     input_callback, user_data);
+					     &p, input_callback, user_data);
 	if(stream == NULL)
 		goto end;
 
@@ -512,6 +641,12 @@ struct output_stream_handle *output_add_stream(struct output_handle *h,
 	s->channels = channels;
 	s->cache = cache;
 	s->use_cache_thread = use_cache_thread;
+	s->profile.quality = profile != NULL ? profile->quality :
+					       RESAMPLE_DEFAULT;
+	s->profile.threads = profile != NULL ? profile->threads : 0;
+	s->profile.variable_rate = profile != NULL ? profile->variable_rate : 0;
+	s->ratio = 1.0;
+	s->trace = NULL;
 	s->input_callback = input_callback;
 	s->user_data = user_data;
 	s->stream = stream;
@@ -528,7 +663,7 @@ struct output_stream_handle *output_add_stream(struct output_handle *h,
 
 end:
 	/* Unlock output access */
-	pthread_mutex_unlock(h->mutex);
+	unlock_mutex(outputs_class, h->mutex);
 
 	return s;
 }
@@ -542,7 +677,7 @@ void output_remove_stream(struct output_handle *h,
 		return;
 
 	/* Lock output access */
-	pthread_mutex_lock(h->mutex);
+	lock_mutex(outputs_class, h->mutex);
 
 	/* Remove stream from streams */
 	lp = &h->streams;
@@ -562,7 +697,7 @@ void output_remove_stream(struct output_handle *h,
 	h->outputs->mod->remove_stream(h->outputs->handle, s->stream);
 
 	/* Unlock output access */
-	pthread_mutex_unlock(h->mutex);
+	unlock_mutex(outputs_class, h->mutex);
 
 	/* Free stream name */
 	free(s->name);
@@ -579,7 +714,7 @@ int output_set_volume(struct output_handle *h, unsigned int volume)
 		return -1;
 
 	/* Lock output access */
-	pthread_mutex_lock(h->mutex);
+	lock_mutex(outputs_class, h->mutex);
 
 	/* Set volume */
 	h->volume = volume;
@@ -588,7 +723,7 @@ int output_set_volume(struct output_handle *h, unsigned int volume)
 	output_reset_volume_stream(h->outputs, h, NULL);
 
 	/* Unlock output access */
-	pthread_mutex_unlock(h->mutex);
+	unlock_mutex(outputs_class, h->mutex);
 
 	return ret;
 }
@@ -601,13 +736,13 @@ unsigned int output_get_volue(struct output_handle *h)
 		return 0;
 
 	/* Lock output access */
-	pthread_mutex_lock(h->mutex);
+	lock_mutex(outputs_class, h->mutex);
 
 	/* Get current volume */
 	vol = h->volume;
 
 	/* Unlock output access */
-	pthread_mutex_unlock(h->mutex);
+	unlock_mutex(outputs_class, h->mutex);
 
 	return vol;
 }
@@ -620,7 +755,7 @@ void output_close(struct output_handle *h)
 		return;
 
 	/* Lock output access */
-	pthread_mutex_lock(h->mutex);
+	lock_mutex(outputs_class, h->mutex);
 
 	/* Close and remove all streams */
 	while(h->streams != NULL)
@@ -644,7 +779,7 @@ void output_close(struct output_handle *h)
 	}
 
 	/* Unlock output access */
-	pthread_mutex_unlock(h->mutex);
+	unlock_mutex(outputs_class, h->mutex);
 
 	/* Free output name */
 	free(h->name);
@@ -665,7 +800,7 @@ int output_play_stream(struct output_handle *h, struct output_stream_handle *s)
 		return -1;
 
 	/* Lock output access */
-	pthread_mutex_lock(h->mutex);
+	lock_mutex(outputs_class, h->mutex);
 
 	/* Check output module */
 	if(h->outputs != NULL && h->outputs->mod != NULL &&
@@ -678,7 +813,7 @@ int output_play_stream(struct output_handle *h, struct output_stream_handle *s)
 	s->is_playing = 1;
 
 	/* Unlock output access */
-	pthread_mutex_unlock(h->mutex);
+	unlock_mutex(outputs_class, h->mutex);
 
 	return ret;
 }
@@ -691,7 +826,7 @@ int output_pause_stream(struct output_handle *h, struct output_stream_handle *s)
 		return -1;
 
 	/* Lock output access */
-	pthread_mutex_lock(h->mutex);
+	lock_mutex(outputs_class, h->mutex);
 
 	/* Check output module */
 	if(h->outputs != NULL && h->outputs->mod != NULL &&
@@ -704,30 +839,38 @@ int output_pause_stream(struct output_handle *h, struct output_stream_handle *s)
 	s->is_playing = 0;
 
 	/* Unlock output access */
-	pthread_mutex_unlock(h->mutex);
+	unlock_mutex(outputs_class, h->mutex);
 
 	return ret;
 }
 
 void output_flush_stream(struct output_handle *h,
 			 struct output_stream_handle *s)
+{
+	output_flush_stream_ready(h, s, 0);
+}
+
+void output_flush_stream_ready(struct output_handle *h,
+			       struct output_stream_handle *s,
+			       unsigned long ready)
 {
 	if(h == NULL || s == NULL)
 		return;
 
 	/* Lock output access */
-	pthread_mutex_lock(h->mutex);
+	lock_mutex(outputs_class, h->mutex);
 
 	/* Check output module */
 	if(h->outputs != NULL && h->outputs->mod != NULL &&
 	   h->outputs->handle != NULL && s->stream != NULL)
 	{
 		/* Flush stream */
-		h->outputs->mod->flush_stream(h->outputs->handle, s->stream);
+		h->outputs->mod->flush_stream(h->outputs->handle, s->stream,
+					      ready);
 	}
 
 	/* Unlock output access */
-	pthread_mutex_unlock(h->mutex);
+	unlock_mutex(outputs_class, h->mutex);
 }
 
 ssize_t output_write_stream(struct output_handle *h, 
@@ -741,7 +884,7 @@ ssize_t output_write_stream(struct output_handle *h,
 		return -1;
 
 	/* Lock output access */
-	pthread_mutex_lock(h->mutex);
+	lock_mutex(outputs_class, h->mutex);
 
 	/* Check output module */
 	if(h->outputs != NULL && h->outputs->mod != NULL &&
@@ -754,7 +897,72 @@ ssize_t output_write_stream(struct output_handle *h,
 	}
 
 	/* Unlock output access */
-	pthread_mutex_unlock(h->mutex);
+	unlock_mutex(outputs_class, h->mutex);
+
+	return ret;
+}
+
+ssize_t output_stream_reserve(struct output_handle *h,
+			      struct output_stream_handle *s, size_t frames,
+			      unsigned char **buffer)
+{
+	ssize_t ret = -1;
+
+	if(h == NULL || s == NULL || buffer == NULL)
+		return -1;
+
+	/* Lock output access */
+	lock_mutex(outputs_class, h->mutex);
+
+	/* Check output module */
+	if(h->outputs != NULL && h->outputs->mod != NULL &&
+	   h->outputs->handle != NULL && s->stream != NULL &&
+	   h->outputs->mod->reserve_stream != NULL)
+	{
+		/* Reserve area in stream */
+		ret = h->outputs->mod->reserve_stream(h->outputs->handle,
+						      s->stream,
+						      frames * s->channels,
+						      buffer);
+		if(ret > 0)
+			ret /= s->channels;
+	}
+
+	/* Unlock output access */
+	unlock_mutex(outputs_class, h->mutex);
+
+	return ret;
+}
+
+ssize_t output_stream_commit(struct output_handle *h,
+			     struct output_stream_handle *s, size_t frames,
+			     struct a_format *fmt)
+{
+	unsigned char channels;
+	ssize_t ret = -1;
+
+	if(h == NULL || s == NULL || fmt == NULL)
+		return -1;
+
+	/* Lock output access */
+	lock_mutex(outputs_class, h->mutex);
+
+	/* Check output module */
+	channels = fmt->channels != 0 ? fmt->channels : s->channels;
+	if(h->outputs != NULL && h->outputs->mod != NULL &&
+	   h->outputs->handle != NULL && s->stream != NULL &&
+	   h->outputs->mod->commit_stream != NULL)
+	{
+		/* Commit samples written in area */
+		ret = h->outputs->mod->commit_stream(h->outputs->handle,
+						     s->stream,
+						     frames * channels, fmt);
+		if(ret > 0)
+			ret /= channels;
+	}
+
+	/* Unlock output access */
+	unlock_mutex(outputs_class, h->mutex);
 
 	return ret;
 }
@@ -801,7 +1009,7 @@ int output_set_volume_stream(struct output_handle *h,
 		return -1;
 
 	/* Lock output access */
-	pthread_mutex_lock(h->mutex);
+	lock_mutex(outputs_class, h->mutex);
 
 	/* Set volume */
 	s->volume = volume;
@@ -810,7 +1018,7 @@ int output_set_volume_stream(struct output_handle *h,
 	ret = output_reset_volume_stream(h->outputs, h, s);
 
 	/* Unlock output access */
-	pthread_mutex_unlock(h->mutex);
+	unlock_mutex(outputs_class, h->mutex);
 
 	return ret;
 }
@@ -824,7 +1032,7 @@ unsigned int output_get_volume_stream(struct output_handle *h,
 		return 0;
 
 	/* Lock output access */
-	pthread_mutex_lock(h->mutex);
+	lock_mutex(outputs_class, h->mutex);
 
 	/* Check output module */
 	if(h->outputs != NULL && h->outputs->mod != NULL &&
@@ -837,7 +1045,7 @@ unsigned int output_get_volume_stream(struct output_handle *h,
 	s->volume = ret;
 
 	/* Unlock output access */
-	pthread_mutex_unlock(h->mutex);
+	unlock_mutex(outputs_class, h->mutex);
 
 	return ret;
 }
@@ -851,7 +1059,7 @@ int output_set_cache_stream(struct output_handle *h,
 		return -1;
 
 	/* Lock output access */
-	pthread_mutex_lock(h->mutex);
+	lock_mutex(outputs_class, h->mutex);
 
 	/* Check output module */
 	if(h->outputs != NULL && h->outputs->mod != NULL &&
@@ -863,7 +1071,68 @@ int output_set_cache_stream(struct output_handle *h,
 	}
 
 	/* Unlock output access */
-	pthread_mutex_unlock(h->mutex);
+	unlock_mutex(outputs_class, h->mutex);
+
+	return ret;
+}
+
+int output_set_ratio_stream(struct output_handle *h,
+			    struct output_stream_handle *s, double ratio)
+{
+	int ret = -1;
+
+	if(h == NULL || s == NULL)
+		return -1;
+
+	/* Lock output access */
+	lock_mutex(outputs_class, h->mutex);
+
+	/* Save ratio for output reload */
+	s->ratio = ratio;
+
+	/* Check output module */
+	if(h->outputs != NULL && h->outputs->mod != NULL &&
+	   h->outputs->handle != NULL && s->stream != NULL &&
+	   h->outputs->mod->set_ratio_stream != NULL)
+	{
+		/* Set new playback rate */
+		ret = h->outputs->mod->set_ratio_stream(h->outputs->handle,
+							s->stream, ratio);
+	}
+
+	/* Unlock output access */
+	unlock_mutex(outputs_class, h->mutex);
+
+	return ret;
+}
+
+int output_set_trace_stream(struct output_handle *h,
+			    struct output_stream_handle *s,
+			    struct trace *trace)
+{
+	int ret = -1;
+
+	if(h == NULL || s == NULL)
+		return -1;
+
+	/* Lock output access */
+	lock_mutex(outputs_class, h->mutex);
+
+	/* Save trace for output reload */
+	s->trace = trace;
+
+	/* Check output module */
+	if(h->outputs != NULL && h->outputs->mod != NULL &&
+	   h->outputs->handle != NULL && s->stream != NULL &&
+	   h->outputs->mod->set_trace_stream != NULL)
+	{
+		/* Set new trace */
+		ret = h->outputs->mod->set_trace_stream(h->outputs->handle,
+							s->stream, trace);
+	}
+
+	/* Unlock output access */
+	unlock_mutex(outputs_class, h->mutex);
 
 	return ret;
 }
@@ -878,7 +1147,7 @@ unsigned long output_get_status_stream(struct output_handle *h,
 		return 0;
 
 	/* Lock output access */
-	pthread_mutex_lock(h->mutex);
+	lock_mutex(outputs_class, h->mutex);
 
 	/* Check output module */
 	if(h->outputs != NULL && h->outputs->mod != NULL &&
@@ -890,7 +1159,7 @@ unsigned long output_get_status_stream(struct output_handle *h,
 	}
 
 	/* Unlock output access */
-	pthread_mutex_unlock(h->mutex);
+	unlock_mutex(outputs_class, h->mutex);
 
 	return ret;
 }
@@ -905,7 +1174,7 @@ int output_set_stream_event_cb(struct output_handle *h,
 		return 0;
 
 	/* Lock output access */
-	pthread_mutex_lock(h->mutex);
+	lock_mutex(outputs_class, h->mutex);
 
 	/* Check output module */
 	if(h->outputs != NULL && h->outputs->mod != NULL &&
@@ -918,7 +1187,7 @@ int output_set_stream_event_cb(struct output_handle *h,
 	}
 
 	/* Unlock output access */
-	pthread_mutex_unlock(h->mutex);
+	unlock_mutex(outputs_class, h->mutex);
 
 	return ret;
 }
@@ -994,7 +1263,7 @@ static int outputs_httpd_volume(void *user_data, struct httpd_req *req,
 		json = json_new();
 
 		/* Lock output access */
-		pthread_mutex_lock(&h->mutex);
+		lock_mutex(outputs_class, &h->mutex);
 
 		/* Check URL */
 		if(req->resource == NULL || *req->resource == '\0')
@@ -1014,7 +1283,7 @@ static int outputs_httpd_volume(void *user_data, struct httpd_req *req,
 		}
 
 		/* Unlock output access */
-		pthread_mutex_unlock(&h->mutex);
+		unlock_mutex(outputs_class, &h->mutex);
 
 		/* Get JSON string */
 		str = strdup(json_export(json));
@@ -1048,7 +1317,7 @@ static int outputs_httpd_volume(void *user_data, struct httpd_req *req,
 			vol = OUTPUT_VOLUME_MAX;
 
 		/* Lock output access */
-		pthread_mutex_lock(&h->mutex);
+		lock_mutex(outputs_class, &h->mutex);
 
 		/* Check URL */
 		if(is_master)
@@ -1072,7 +1341,7 @@ static int outputs_httpd_volume(void *user_data, struct httpd_req *req,
 		output_reset_volume_stream(h, handle, s);
 
 		/* Unlock output access */
-		pthread_mutex_unlock(&h->mutex);
+		unlock_mutex(outputs_class, &h->mutex);
 	}
 
 	return 200;
@@ -1084,14 +1353,20 @@ static int outputs_httpd_status(void *user_data, struct httpd_req *req,
 	struct outputs_handle *h = user_data;
 	struct json *root, *list, *list2, *tmp, *tmp2;
 	struct output_stream_handle *s;
+	struct output_stats stats;
 	struct output_handle *l;
+	const char *histogram;
 	char *str;
+	int i;
+
+	/* Mix time histogram is exported on demand */
+	histogram = httpd_get_query(req, "histogram");
 
 	/* Create a new object */
 	root = json_new();
 
 	/* Lock output access */
-	pthread_mutex_lock(&h->mutex);
+	lock_mutex(outputs_class, &h->mutex);
 
 	/* Get output configuration */
 	if(h->current != NULL)
@@ -1110,6 +1385,37 @@ static int outputs_httpd_status(void *user_data, struct httpd_req *req,
 	json_set_int(root, "channels", h->channels);
 	json_set_int(root, "volume", h->volume);
 
+	/* Get output statistics */
+	if(h->mod != NULL && h->handle != NULL && h->mod->get_stats != NULL &&
+	   h->mod->get_stats(h->handle, &stats) == 0)
+	{
+		tmp = json_new();
+		if(tmp != NULL)
+		{
+			json_set_int64(tmp, "xruns", stats.xruns);
+			json_set_int64(tmp, "short_writes", stats.short_writes);
+			json_set_int64(tmp, "periods", stats.periods);
+			json_set_int64(tmp, "mix_time_min", stats.mix_time_min);
+			json_set_int64(tmp, "mix_time_avg", stats.mix_time_avg);
+			json_set_int64(tmp, "mix_time_max", stats.mix_time_max);
+			json_set_int64(tmp, "delay", stats.delay);
+
+			/* Add histogram */
+			if(histogram != NULL && strcmp(histogram, "0") != 0)
+			{
+				list = json_new_array();
+				for(i = 0; list != NULL &&
+				    i < OUTPUT_STATS_HISTOGRAM_SIZE; i++)
+					json_array_add(list, json_new_int64(
+						 stats.mix_time_histogram[i]));
+				json_add(tmp, "mix_time_histogram", list);
+			}
+
+			/* Add statistics to JSON object */
+			json_add(root, "stats", tmp);
+		}
+	}
+
 	/* Create a new JSON array */
 	list = json_new_array();
 	if(list != NULL)
@@ -1142,6 +1448,14 @@ static int outputs_httpd_status(void *user_data, struct httpd_req *req,
 				json_set_int(tmp2, "channels", s->channels);
 				json_set_int(tmp2, "volume", s->volume);
 
+				/* Get stream statistics */
+				if(h->mod != NULL && h->handle != NULL &&
+				   s->stream != NULL)
+					json_set_int64(tmp2, "starvations",
+						      h->mod->get_status_stream(
+						      h->handle, s->stream,
+						      OUTPUT_STREAM_STARVATIONS));
+
 				/* Add object to array */
 				if(json_array_add(list2, tmp2) != 0)
 					json_free(tmp2);
@@ -1157,7 +1471,7 @@ static int outputs_httpd_status(void *user_data, struct httpd_req *req,
 	}
 
 	/* Unlock output access */
-	pthread_mutex_unlock(&h->mutex);
+	unlock_mutex(outputs_class, &h->mutex);
 
 	/* Add list to JSON object */
 	json_add(root, "outputs", list);
@@ -1184,7 +1498,7 @@ static int outputs_httpd_list(void *user_data, struct httpd_req *req,
 	root = json_new_array();
 
 	/* Lock output access */
-	pthread_mutex_lock(&h->mutex);
+	lock_mutex(outputs_class, &h->mutex);
 
 	/* Fill array */
 	if(root != NULL)
@@ -1223,7 +1537,7 @@ static int outputs_httpd_list(void *user_data, struct httpd_req *req,
 	}
 
 	/* Unlock output access */
-	pthread_mutex_unlock(&h->mutex);
+	unlock_mutex(outputs_class, &h->mutex);
 
 	/* Get JSON string */
 	str = strdup(json_export(root));
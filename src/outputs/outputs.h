@@ -23,27 +23,72 @@
 #include "output.h"
 #include "json.h"
 
+struct output_attr {
+	/* Output format */
+	unsigned long samplerate;
+	unsigned char channels;
+	/* Output latency (in ms) */
+	unsigned int latency;
+	/* Device name (NULL for default device) */
+	const char *device;
+	/* Period and buffer size (in frames, 0 for automatic) */
+	unsigned long period_size;
+	unsigned long buffer_size;
+	/* Preferred sample format: "s16", "s24", "s32" or "float" (NULL for
+	 * automatic negotiation) */
+	const char *format;
+	/* Count of threads rendering streams one period ahead (0 to render
+	 * streams in the mixer thread) */
+	unsigned int premix_threads;
+};
+
+/* Mix time histogram size: bucket i counts periods mixed in [2^i; 2^(i+1)[ us
+ * and last bucket counts all longer periods.
+ */
+#define OUTPUT_STATS_HISTOGRAM_SIZE 16
+
+struct output_stats {
+	/* Device underruns and short writes */
+	unsigned long xruns;
+	unsigned long short_writes;
+	/* Mix time per period (in us) */
+	unsigned long periods;
+	unsigned long mix_time_min;
+	unsigned long mix_time_avg;
+	unsigned long mix_time_max;
+	unsigned long mix_time_histogram[OUTPUT_STATS_HISTOGRAM_SIZE];
+	/* Device delay (in ms) */
+	unsigned long delay;
+};
+
 struct output_module {
-	int (*open)(void **, unsigned long, unsigned char, unsigned int);
+	int (*open)(void **, const struct output_attr *);
+	int (*reconfigure)(void *, const struct output_attr *);
 	int (*set_volume)(void *, unsigned int);
 	unsigned int (*get_volume)(void *);
 	void *(*add_stream)(void *, unsigned long, unsigned char, unsigned long,
-			    int, a_read_cb, void *);
+			    int, const struct resample_profile *, a_read_cb,
+			    void *);
 	int (*play_stream)(void *, void *);
 	int (*pause_stream)(void *, void *);
-	void (*flush_stream)(void *, void *);
+	void (*flush_stream)(void *, void *, unsigned long);
 	int (*set_volume_stream)(void *, void *, unsigned int);
 	unsigned int (*get_volume_stream)(void *, void *);
 	int (*set_cache_stream)(void *, void *, unsigned long);
+	int (*set_ratio_stream)(void *, void *, double);
+	int (*set_trace_stream)(void *, void *, struct trace *);
 	unsigned long (*get_status_stream)(void *, void *,
 					   enum output_stream_key);
 	int (*set_stream_event_cb)(void *, void *, output_stream_event_cb,
 				   void *);
 	ssize_t (*write_stream)(void *, void *, const unsigned char *, size_t,
 				struct a_format *);
+	ssize_t (*reserve_stream)(void *, void *, size_t, unsigned char **);
+	ssize_t (*commit_stream)(void *, void *, size_t, struct a_format *);
 	unsigned long (*abort_stream)(void *, void *);
 	void (*restore_stream)(void *, void *, unsigned long);
 	int (*remove_stream)(void *, void *);
+	int (*get_stats)(void *, struct output_stats *);
 	int (*close)(void *);
 };
 
@@ -0,0 +1,273 @@
+/*
+ * pool.c - Recycled buffers for audio hot paths
+ *
+ * Copyright (c) 2014   A. Dilly
+ *
+ * AirCat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * AirCat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with AirCat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "pool.h"
+
+#define LOAD(v) __atomic_load_n(&(v), __ATOMIC_ACQUIRE)
+#define INC(v) __atomic_add_fetch(&(v), 1, __ATOMIC_RELAXED)
+
+/* Size classes: 2^POOL_MIN_SHIFT to 2^POOL_MAX_SHIFT bytes + POOL_SLACK */
+#define POOL_MIN_SHIFT 5
+#define POOL_MAX_SHIFT 16
+#define POOL_CLASSES (POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1)
+#define POOL_SLACK 64
+#define POOL_CLASS_SIZE(c) (((size_t) 1 << ((c) + POOL_MIN_SHIFT)) + \
+			    POOL_SLACK)
+#define POOL_LARGE POOL_CLASSES
+
+/* Blocks kept in a thread cache for each class: when it is full, POOL_BATCH
+ * blocks are moved to depot, and an empty cache takes back POOL_BATCH blocks
+ * from depot.
+ */
+#define POOL_CACHE_MAX 16
+#define POOL_BATCH 8
+
+/* Memory kept in depot for each class: above, blocks are really freed */
+#define POOL_DEPOT_SIZE (1024 * 1024)
+
+/* Header of each block: the class is kept while the block is used */
+struct pool_block {
+	struct pool_block *next;
+	size_t class;
+};
+
+struct pool_cache {
+	struct pool_block *list[POOL_CLASSES];
+	unsigned int count[POOL_CLASSES];
+	int registered;
+};
+
+struct pool_depot {
+	struct pool_block *list;
+	unsigned long count;
+	pthread_mutex_t mutex;
+};
+
+static __thread struct pool_cache pool_cache;
+static struct pool_depot pool_depot[POOL_CLASSES];
+static pthread_key_t pool_key;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+/* Statistics */
+static unsigned long pool_allocs = 0;
+static unsigned long pool_mallocs = 0;
+static unsigned long pool_frees = 0;
+
+static void pool_depot_put(size_t class, struct pool_block *list)
+{
+	struct pool_depot *d = &pool_depot[class];
+	struct pool_block *b;
+	unsigned long max;
+
+	/* Lock depot */
+	pthread_mutex_lock(&d->mutex);
+
+	/* Move blocks to depot while it is not full */
+	max = POOL_DEPOT_SIZE / POOL_CLASS_SIZE(class);
+	while(list != NULL && d->count < max)
+	{
+		b = list;
+		list = b->next;
+		b->next = d->list;
+		d->list = b;
+		d->count++;
+	}
+
+	/* Unlock depot */
+	pthread_mutex_unlock(&d->mutex);
+
+	/* Free remaining blocks */
+	while(list != NULL)
+	{
+		b = list;
+		list = b->next;
+		free(b);
+		INC(pool_frees);
+	}
+}
+
+static void pool_cache_flush(void *user_data)
+{
+	struct pool_cache *c = user_data;
+	size_t i;
+
+	/* Give all blocks of exiting thread to depot */
+	for(i = 0; i < POOL_CLASSES; i++)
+	{
+		pool_depot_put(i, c->list[i]);
+		c->list[i] = NULL;
+		c->count[i] = 0;
+	}
+}
+
+static void pool_init(void)
+{
+	size_t i;
+
+	/* Flush thread caches when threads exit */
+	pthread_key_create(&pool_key, &pool_cache_flush);
+
+	/* Init depots */
+	for(i = 0; i < POOL_CLASSES; i++)
+		pthread_mutex_init(&pool_depot[i].mutex, NULL);
+}
+
+static struct pool_cache *pool_get_cache(void)
+{
+	struct pool_cache *c = &pool_cache;
+
+	/* First use in this thread */
+	if(!c->registered)
+	{
+		pthread_once(&pool_once, &pool_init);
+		pthread_setspecific(pool_key, c);
+		c->registered = 1;
+	}
+
+	return c;
+}
+
+static size_t pool_get_class(size_t size)
+{
+	size_t class = 0;
+
+	while(class < POOL_CLASSES && POOL_CLASS_SIZE(class) < size)
+		class++;
+
+	return class;
+}
+
+void *pool_alloc(size_t size)
+{
+	struct pool_depot *d;
+	struct pool_cache *c;
+	struct pool_block *b;
+	size_t class;
+	int i;
+
+	INC(pool_allocs);
+
+	/* Too large for pool */
+	class = pool_get_class(size);
+	if(class == POOL_LARGE)
+	{
+		b = malloc(sizeof(struct pool_block) + size);
+		if(b == NULL)
+			return NULL;
+		INC(pool_mallocs);
+		goto end;
+	}
+
+	/* Refill thread cache from depot */
+	c = pool_get_cache();
+	if(c->list[class] == NULL)
+	{
+		d = &pool_depot[class];
+
+		/* Lock depot */
+		pthread_mutex_lock(&d->mutex);
+
+		/* Take a batch */
+		for(i = 0; i < POOL_BATCH && d->list != NULL; i++)
+		{
+			b = d->list;
+			d->list = b->next;
+			d->count--;
+			b->next = c->list[class];
+			c->list[class] = b;
+			c->count[class]++;
+		}
+
+		/* Unlock depot */
+		pthread_mutex_unlock(&d->mutex);
+	}
+
+	/* Take a block from thread cache */
+	b = c->list[class];
+	if(b != NULL)
+	{
+		c->list[class] = b->next;
+		c->count[class]--;
+		goto end;
+	}
+
+	/* Allocate a new block */
+	b = malloc(sizeof(struct pool_block) + POOL_CLASS_SIZE(class));
+	if(b == NULL)
+		return NULL;
+	INC(pool_mallocs);
+
+end:
+	b->next = NULL;
+	b->class = class;
+
+	return b + 1;
+}
+
+void pool_free(void *ptr)
+{
+	struct pool_block *b, *list;
+	struct pool_cache *c;
+	size_t class;
+	int i;
+
+	if(ptr == NULL)
+		return;
+
+	/* Get block header */
+	b = (struct pool_block *) ptr - 1;
+	class = b->class;
+
+	/* Large blocks are not recycled */
+	if(class == POOL_LARGE)
+	{
+		free(b);
+		INC(pool_frees);
+		return;
+	}
+
+	/* Add block to thread cache */
+	c = pool_get_cache();
+	b->next = c->list[class];
+	c->list[class] = b;
+	c->count[class]++;
+
+	/* Thread cache is full: move a batch to depot */
+	if(c->count[class] > POOL_CACHE_MAX)
+	{
+		list = c->list[class];
+		for(i = 1; i < POOL_BATCH; i++)
+			b = b->next;
+		c->list[class] = b->next;
+		c->count[class] -= POOL_BATCH;
+		b->next = NULL;
+		pool_depot_put(class, list);
+	}
+}
+
+void pool_get_stats(struct pool_stats *stats)
+{
+	stats->allocs = LOAD(pool_allocs);
+	stats->mallocs = LOAD(pool_mallocs);
+	stats->frees = LOAD(pool_frees);
+}
@@ -25,18 +25,25 @@
 #include <soxr.h>
 
 #include "resample.h"
+#include "resample_mix.h"
+#include "trace.h"
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
 
 #define BUFFER_SIZE 8192
+#define MAX_RATIO_DRIFT 0.01
 #define max(x,y) (x >= y ? x : y)
 #define min(x,y) (x > y ? y : x)
 
 struct resample_handle {
 	/* Libsoxr variables */
 	soxr_t soxr;
+	/* Pass-through mode: input and output formats are the same, so no
+	 * converter is created and samples are forwarded as is.
+	 */
+	int bypass;
 	/* Samplerate converter configuration */
 	unsigned long in_samplerate;
 	unsigned char in_channels;
@@ -45,6 +52,16 @@ struct resample_handle {
 	unsigned long new_samplerate;
 	unsigned char new_channels;
 	size_t fmt_has_changed;
+	/* Converter quality and threads */
+	enum resample_quality quality;
+	unsigned int threads;
+	/* Variable rate: output rate is adjusted by ratio */
+	int variable_rate;
+	double ratio;
+	/* Input sample format (output is always in native format) */
+	enum a_sample in_sample;
+	enum a_sample new_sample;
+	size_t in_bytes;
 	/* Input callback */
 	a_read_cb input_callback;
 	a_write_cb output_callback;
@@ -60,8 +77,14 @@ struct resample_handle {
 	unsigned char *tmp_buffer;
 	size_t tmp_size;
 	size_t tmp_len;
+	/* Latency tracing: input frames consumed since last mark */
+	struct trace *trace;
+	size_t trace_in;
 	/* Mutex for read()/write() calls */
 	pthread_mutex_t mutex;
+	/* Specialized mixing kernels (NULL to use mixing table) */
+	resample_mix_cb down_mix;
+	resample_mix_cb up_mix;
 	/* Mixing table: inspired from remix effect from sox */
 	struct {
 		unsigned num_in_channels;
@@ -72,12 +95,45 @@ struct resample_handle {
 	} * out_specs;
 };
 
+/* Quality names (indexed by enum resample_quality) */
+static const char *resample_quality_names[] = {
+	[RESAMPLE_DEFAULT] = "default",
+	[RESAMPLE_QUICK] = "quick",
+	[RESAMPLE_LOW] = "low",
+	[RESAMPLE_MEDIUM] = "medium",
+	[RESAMPLE_HIGH] = "high",
+	[RESAMPLE_VERY_HIGH] = "very-high",
+};
+
 static int resample_init(struct resample_handle *h);
 
+enum resample_quality resample_quality_from_name(const char *name)
+{
+	int i;
+
+	if(name == NULL)
+		return RESAMPLE_DEFAULT;
+
+	for(i = RESAMPLE_QUICK; i <= RESAMPLE_VERY_HIGH; i++)
+		if(strcmp(name, resample_quality_names[i]) == 0)
+			return i;
+
+	return RESAMPLE_DEFAULT;
+}
+
+const char *resample_quality_name(enum resample_quality quality)
+{
+	if(quality > RESAMPLE_VERY_HIGH)
+		quality = RESAMPLE_DEFAULT;
+	return resample_quality_names[quality];
+}
+
 int resample_open(struct resample_handle **handle, unsigned long in_samplerate,
 		  unsigned char in_channels, unsigned long out_samplerate,
-		  unsigned char out_channels, a_read_cb input_callback,
-		  a_write_cb output_callback, void *user_data)
+		  unsigned char out_channels,
+		  const struct resample_profile *profile,
+		  a_read_cb input_callback, a_write_cb output_callback,
+		  void *user_data)
 {
 	struct resample_handle *h;
 
@@ -106,10 +162,27 @@ int resample_open(struct resample_handle **handle, unsigned long in_samplerate,
 	h->out_channels = out_channels;
 	h->fmt_has_changed = 0;
 
+	/* Set converter profile */
+	h->quality = RESAMPLE_HIGH;
+	h->threads = 1;
+	if(profile != NULL)
+	{
+		if(profile->quality != RESAMPLE_DEFAULT)
+			h->quality = profile->quality;
+		if(profile->threads != 0)
+			h->threads = profile->threads;
+		h->variable_rate = profile->variable_rate;
+	}
+	h->ratio = 1.0;
+
+	/* Input is in native format until the input tells otherwise */
+	h->in_sample = format_sample(SAMPLE_NATIVE);
+	h->in_bytes = format_sample_size(h->in_sample);
+
 	/* Allocate input buffer */
 	h->in_len = 0;
 	h->in_size = BUFFER_SIZE;
-	h->in_buffer = malloc(h->in_size * 4); //32-bit wide sample
+	h->in_buffer = malloc(h->in_size * 4); //up to 32-bit wide sample
 	if(h->in_buffer == NULL)
 		return -1;
 
@@ -129,9 +202,29 @@ int resample_open(struct resample_handle **handle, unsigned long in_samplerate,
 	return resample_init(h);
 }
 
+static unsigned long resample_recipe(enum resample_quality quality)
+{
+	switch(quality)
+	{
+		case RESAMPLE_QUICK:
+			return SOXR_QQ;
+		case RESAMPLE_LOW:
+			return SOXR_LQ;
+		case RESAMPLE_MEDIUM:
+			return SOXR_MQ;
+		case RESAMPLE_VERY_HIGH:
+			return SOXR_VHQ;
+		default:
+			return SOXR_HQ;
+	}
+}
+
 static int resample_init(struct resample_handle *h)
 {
+	soxr_runtime_spec_t runtime_spec;
+	soxr_quality_spec_t q_spec;
 	soxr_io_spec_t io_spec;
+	soxr_datatype_t itype;
 	int i, j;
 
 	/* Alloc a second buffer for in channel < out_channel */
@@ -189,21 +282,78 @@ static int resample_init(struct resample_handle *h)
 		}
 	}
 
-	/* Set inout and output format */
+	/* Select specialized kernels for common layouts */
+	h->down_mix = NULL;
+	h->up_mix = NULL;
+	if(h->in_channels > h->out_channels)
+		h->down_mix = resample_mix_get_down(h->in_sample,
+						    h->in_channels,
+						    h->out_channels);
+	else if(h->in_channels < h->out_channels)
+		h->up_mix = resample_mix_get_up(h->in_channels,
+						h->out_channels);
+
+	/* Set input and output format: libsoxr converts the input samples to
+	 * the native format, so no widening pass is needed before it.
+	 */
+	switch(h->in_sample)
+	{
+		case SAMPLE_S16:
+			itype = SOXR_INT16_I;
+			break;
+		case SAMPLE_FLOAT:
+			itype = SOXR_FLOAT32_I;
+			break;
+		default:
+			itype = SOXR_INT32_I;
+	}
 #ifdef USE_FLOAT
-	io_spec = soxr_io_spec(SOXR_FLOAT32_I, SOXR_FLOAT32_I);
+	io_spec = soxr_io_spec(itype, SOXR_FLOAT32_I);
 #else
-	io_spec = soxr_io_spec(SOXR_INT32_I, SOXR_INT32_I);
+	io_spec = soxr_io_spec(itype, SOXR_INT32_I);
 #endif
 
-	/* Create converter */
-	h->soxr = soxr_create((double)h->in_samplerate,
-			      (double)h->out_samplerate,
-			      min(h->in_channels, h->out_channels), NULL,
-			      &io_spec, NULL, NULL);
+	/* Bytes per input sample */
+	h->in_bytes = format_sample_size(h->in_sample);
+
+	/* Same format on both sides: no converter is needed (unless rate can
+	 * be adjusted)
+	 */
+	h->bypass = h->in_samplerate == h->out_samplerate &&
+		    h->in_channels == h->out_channels &&
+		    h->in_sample == format_sample(SAMPLE_NATIVE) &&
+		    !h->variable_rate;
+	if(h->bypass)
+		return 0;
+
+	/* Set quality recipe and number of threads */
+	q_spec = soxr_quality_spec(resample_recipe(h->quality),
+				   h->variable_rate ? SOXR_VR : 0);
+	runtime_spec = soxr_runtime_spec(h->threads);
+
+	/* Create converter: with a variable rate, the rates given to libsoxr
+	 * are the maximum I/O ratio and the ratio is set afterwards
+	 */
+	if(h->variable_rate)
+		h->soxr = soxr_create((double)h->in_samplerate *
+				      (1.0 + MAX_RATIO_DRIFT) /
+				      (1.0 - MAX_RATIO_DRIFT),
+				      (double)h->out_samplerate,
+				      min(h->in_channels, h->out_channels),
+				      NULL, &io_spec, &q_spec, &runtime_spec);
+	else
+		h->soxr = soxr_create((double)h->in_samplerate,
+				      (double)h->out_samplerate,
+				      min(h->in_channels, h->out_channels),
+				      NULL, &io_spec, &q_spec, &runtime_spec);
 	if(h->soxr == NULL)
 		return -1;
 
+	/* Set current I/O ratio */
+	if(h->variable_rate)
+		soxr_set_io_ratio(h->soxr, (double)h->in_samplerate /
+				  ((double)h->out_samplerate * h->ratio), 0);
+
 	return 0;
 }
 
@@ -231,39 +381,51 @@ static void resample_free(struct resample_handle *h)
 	h->out_buffer = NULL;
 }
 
+/* Down-mixing channels in place: inspired from remix effect from sox */
+#define RESAMPLE_DOWN_MIX(type) do { \
+	type sample; \
+	type *p_in = (type*) buffer; \
+	type *p_out = (type*) buffer; \
+	for(i = len; i--; p_in += in_channels) \
+	{ \
+		for(j = 0; j < h->out_channels; j++) \
+		{ \
+			sample = 0; \
+			for(k = 0; k < h->out_specs[j].num_in_channels; k++) \
+			{ \
+				sample += \
+				   p_in[h->out_specs[j].in_specs[k].channel_num] \
+				   * h->out_specs[j].in_specs[k].multiplier; \
+			} \
+			*(p_out++) = sample; \
+		} \
+	} \
+} while(0)
+
 static int resample_down_mix(struct resample_handle *h, unsigned char *buffer,
 			     size_t len, unsigned char in_channels,
 			     unsigned char out_channels)
 {
-#ifdef USE_FLOAT
-	float sample = 0;
-	float *p_in = (float*) buffer;
-	float *p_out = (float*) buffer;
-#else
-	int32_t sample = 0;
-	int32_t *p_in = (int32_t*) buffer;
-	int32_t *p_out = (int32_t*) buffer;
-
-#endif
 	size_t i, j, k;
 
 	if(len <= 0)
 		return 0;
 
-	/* Down-mixing channels: inspired from remix effect from sox  */
-	for(i = len; i--; p_in += in_channels)
+	/* Use specialized kernel */
+	if(h->down_mix != NULL)
+		return h->down_mix(buffer, buffer, len);
+
+	/* Down-mix in input sample format */
+	switch(h->in_sample)
 	{
-		for(j = 0; j < h->out_channels; j++)
-		{
-			sample = 0;
-			for(k = 0; k < h->out_specs[j].num_in_channels; k++)
-			{
-				sample +=
-				   p_in[h->out_specs[j].in_specs[k].channel_num]
-				   * h->out_specs[j].in_specs[k].multiplier;
-			}
-			*(p_out++) = sample;
-		}
+		case SAMPLE_S16:
+			RESAMPLE_DOWN_MIX(int16_t);
+			break;
+		case SAMPLE_FLOAT:
+			RESAMPLE_DOWN_MIX(float);
+			break;
+		default:
+			RESAMPLE_DOWN_MIX(int32_t);
 	}
 
 	return len * out_channels / in_channels;
@@ -283,6 +445,10 @@ static int resample_up_mix(struct resample_handle *h, unsigned char *in_buffer,
 #endif
 	int i, j;
 
+	/* Use specialized kernel */
+	if(h->up_mix != NULL)
+		return h->up_mix(out_buffer, in_buffer, len);
+
 	/* Up-mixing channels: inspired from remix effect from sox */
 	for(i = len; i--; p_in += in_channels)
 	{
@@ -296,6 +462,33 @@ static int resample_up_mix(struct resample_handle *h, unsigned char *in_buffer,
 	return len *out_channels / in_channels;
 }
 
+static inline int resample_fmt_changed(struct resample_handle *h,
+				       struct a_format *fmt)
+{
+	/* Sample format is always known: SAMPLE_NATIVE is the mix format */
+	return (fmt->samplerate != 0 && fmt->samplerate != h->in_samplerate) ||
+	       (fmt->channels != 0 && fmt->channels != h->in_channels) ||
+	       format_sample(fmt->sample) != h->in_sample;
+}
+
+static inline void resample_set_new_fmt(struct resample_handle *h,
+					struct a_format *fmt)
+{
+	h->new_samplerate = fmt->samplerate != 0 ? fmt->samplerate :
+						  h->in_samplerate;
+	h->new_channels = fmt->channels != 0 ? fmt->channels : h->in_channels;
+	h->new_sample = format_sample(fmt->sample);
+}
+
+static inline void resample_trace(struct resample_handle *h, size_t out_len)
+{
+	/* Mark input frames consumed to produce output samples */
+	trace_mark_convert(h->trace, TRACE_RESAMPLE, h->trace_in,
+			   h->in_samplerate, 1, out_len, h->out_samplerate,
+			   h->out_channels);
+	h->trace_in = 0;
+}
+
 static int resample_process(struct resample_handle *h, unsigned char *buffer,
 			    size_t size, struct a_format *fmt)
 {
@@ -305,6 +498,7 @@ static int resample_process(struct resample_handle *h, unsigned char *buffer,
 	struct a_format in_fmt = A_FORMAT_INIT;
 	size_t in_scale; // samples * _scale => bytes * channels */
 	ssize_t len = 0; // => samples * channels
+	size_t traced = 0;
 	size_t out_len;
 
 	while(total_size < size)
@@ -313,19 +507,50 @@ static int resample_process(struct resample_handle *h, unsigned char *buffer,
 		if(h->fmt_has_changed > 0 || h->input_callback == NULL)
 			goto flush;
 
+		/* Pass-through: read directly in output buffer */
+		if(h->bypass && h->in_len == 0)
+		{
+			len = h->input_callback(h->user_data,
+						&buffer[total_size * 4],
+						min(size - total_size,
+						    h->in_size), &in_fmt);
+			if(len == 0)
+				break;
+			if(len < 0)
+			{
+				if(total_size > 0)
+					break;
+				return -1;
+			}
+
+			/* Same format: samples are ready */
+			if(!resample_fmt_changed(h, &in_fmt))
+			{
+				h->trace_in += len / h->in_channels;
+				total_size += len;
+				continue;
+			}
+
+			/* Format has changed: move samples to input buffer
+			 * and switch to a new engine */
+			resample_set_new_fmt(h, &in_fmt);
+			memcpy(h->in_buffer, &buffer[total_size * 4],
+			       len * format_sample_size(h->new_sample));
+			h->fmt_has_changed = len;
+			goto flush;
+		}
+
 		/* Fill as possible input buffer */
 		len = h->input_callback(h->user_data,
-					&h->in_buffer[h->in_len*4],
+					&h->in_buffer[h->in_len*h->in_bytes],
 					(h->in_size - h->in_len), &in_fmt);
 		if(len == 0)
 			break;
 
 		/* Check audio format */
-		if(h->fmt_has_changed == 0 && ((in_fmt.samplerate != 0 &&
-		    in_fmt.samplerate != h->in_samplerate) ||
-		   (in_fmt.channels != 0 && in_fmt.channels != h->in_channels)))
+		if(h->fmt_has_changed == 0 && resample_fmt_changed(h, &in_fmt))
 		{
-			/* When audio format (samplerate/channels) change, do
+			/* When audio format (samplerate/channels/sample) change, do
 			 * some tasks:
 			 *  1. save buffer len with new format,
 			 *  2. flush remaining data in resample/mixer engine,
@@ -334,8 +559,7 @@ static int resample_process(struct resample_handle *h, unsigned char *buffer,
 			 *  5. continue normal operation.
 			 */
 			h->fmt_has_changed = len;
-			h->new_samplerate = in_fmt.samplerate;
-			h->new_channels = in_fmt.channels;
+			resample_set_new_fmt(h, &in_fmt);
 			goto flush;
 		}
 
@@ -346,7 +570,7 @@ done:
 			if(h->in_channels > h->out_channels)
 			{
 				len = resample_down_mix(h,
-						     &h->in_buffer[h->in_len*4],
+					     &h->in_buffer[h->in_len*h->in_bytes],
 						     len, h->in_channels,
 						     h->out_channels);
 			}
@@ -354,11 +578,27 @@ done:
 		}
 
 flush:
+		/* Pass-through: copy remaining input samples as is */
+		if(h->bypass)
+		{
+			out_samples = min(h->in_len, size - total_size) /
+				      h->out_channels;
+			out_len = out_samples * h->out_channels;
+			memcpy(&buffer[total_size * 4], h->in_buffer,
+			       out_len * 4);
+			h->in_len -= out_len;
+			h->trace_in += out_samples;
+			if(h->in_len > 0)
+				memmove(h->in_buffer, &h->in_buffer[out_len*4],
+					h->in_len * 4);
+			goto processed;
+		}
+
 		/* End of stream handling */
 		p_in = len < 0 && h->in_len == 0 ? NULL : h->in_buffer;
 		in_scale = h->in_channels > h->out_channels ?
-							   h->out_channels * 4 :
-							   h->in_channels * 4;
+						   h->out_channels * h->in_bytes :
+						   h->in_channels * h->in_bytes;
 		p_out = h->in_channels < h->out_channels ? h->out_buffer :
 							&buffer[total_size * 4];
 		out_len = (size - total_size) / h->out_channels;
@@ -366,26 +606,38 @@ flush:
 			out_len *= h->in_channels;
 
 		/* Process data */
-		soxr_process(h->soxr, p_in, h->in_len * 4 / in_scale,
+		soxr_process(h->soxr, p_in, h->in_len * h->in_bytes / in_scale,
 			     &in_consumed, p_out, out_len, &out_samples);
 
 		/* Update input buffer position */
-		h->in_len -= in_consumed * in_scale / 4;
-		if(h->in_len > 0)
+		h->in_len -= in_consumed * in_scale / h->in_bytes;
+		h->trace_in += in_consumed;
+		if(in_consumed > 0 && (h->in_len > 0 || h->fmt_has_changed > 0))
 		{
-			/* Move remaining data in input buffer */
+			/* Move remaining data in input buffer with samples in
+			 * new format saved after them */
 			memmove(h->in_buffer,
 				&h->in_buffer[in_consumed*in_scale],
-				h->in_len * 4);
+				h->in_len * h->in_bytes + h->fmt_has_changed *
+				format_sample_size(h->new_sample));
 		}
 
+processed:
 		/* Audio format has changed and engine is flushed */
 		if(h->fmt_has_changed > 0 && out_samples == 0)
 		{
+			/* Mark samples of previous format */
+			if(h->trace != NULL)
+			{
+				resample_trace(h, total_size - traced);
+				traced = total_size;
+			}
+
 			/* Reset resample/mixer engine */
 			resample_free(h);
 			h->in_samplerate = h->new_samplerate;
 			h->in_channels = h->new_channels;
+			h->in_sample = h->new_sample;
 			resample_init(h);
 
 			/* Restore input buffer */
@@ -420,9 +672,14 @@ flush:
 		total_size += out_samples * h->out_channels;
 	}
 
+	/* Mark converted samples */
+	if(h->trace != NULL && total_size > traced)
+		resample_trace(h, total_size - traced);
+
 	/* Fill format */
 	fmt->samplerate = h->out_samplerate;
 	fmt->channels = h->out_channels;
+	fmt->sample = format_sample(SAMPLE_NATIVE);
 
 	return total_size;
 }
@@ -481,20 +738,35 @@ ssize_t resample_write(void *user_data, const unsigned char *buffer,
 	if(h->fmt_has_changed > 0)
 		goto flush;
 
+	/* Pass-through: give caller buffer to output callback */
+	if(h->bypass && h->in_len == 0 && h->tmp_len == 0 &&
+	   h->output_callback != NULL && !resample_fmt_changed(h, fmt))
+	{
+		in_fmt.samplerate = h->out_samplerate;
+		in_fmt.channels = h->out_channels;
+		in_fmt.sample = format_sample(SAMPLE_NATIVE);
+		trace_mark(h->trace, TRACE_RESAMPLE, size, h->out_samplerate,
+			   h->out_channels);
+		size = h->output_callback(h->user_data, buffer, size, &in_fmt);
+
+		/* Unlock buffer access */
+		pthread_mutex_unlock(&h->mutex);
+
+		return size;
+	}
+
 	/* Copy input data */
 	in_size = (h->in_size - h->in_len);
 	if(size > in_size)
 		size = in_size;
-	memcpy(&h->in_buffer[h->in_len*4], buffer, size*4);
+	memcpy(&h->in_buffer[h->in_len*format_sample_size(fmt->sample)],
+	       buffer, size * format_sample_size(fmt->sample));
 
 	/* Check format change */
-	if(h->fmt_has_changed == 0 && ((fmt->samplerate != 0 &&
-	    fmt->samplerate != h->in_samplerate) ||
-	   (fmt->channels != 0 && fmt->channels != h->in_channels)))
+	if(h->fmt_has_changed == 0 && resample_fmt_changed(h, fmt))
 	{
 		h->fmt_has_changed = size;
-		h->new_samplerate = fmt->samplerate;
-		h->new_channels = fmt->channels;
+		resample_set_new_fmt(h, fmt);
 		goto flush;
 	}
 
@@ -505,7 +777,7 @@ ssize_t resample_write(void *user_data, const unsigned char *buffer,
 		if(h->in_channels > h->out_channels)
 		{
 			len = resample_down_mix(h,
-					       &h->in_buffer[h->in_len*4],
+					 &h->in_buffer[h->in_len*h->in_bytes],
 					       len, h->in_channels,
 					       h->out_channels);
 		}
@@ -539,6 +811,26 @@ flush:
 	return size;
 }
 
+int resample_is_bypass(struct resample_handle *h)
+{
+	int ret;
+
+	if(h == NULL)
+		return 0;
+
+	/* Lock buffer access */
+	pthread_mutex_lock(&h->mutex);
+
+	/* Same format on both sides and no pending samples */
+	ret = h->bypass && h->in_len == 0 && h->tmp_len == 0 &&
+	      h->fmt_has_changed == 0;
+
+	/* Unlock buffer access */
+	pthread_mutex_unlock(&h->mutex);
+
+	return ret;
+}
+
 unsigned long resample_delay(struct resample_handle *h)
 {
 	double delay;
@@ -550,7 +842,13 @@ unsigned long resample_delay(struct resample_handle *h)
 	pthread_mutex_lock(&h->mutex);
 
 	/* Get delay from Soxr */
-	delay = soxr_delay(h->soxr) * 1000 / h->out_samplerate;
+	delay = h->soxr != NULL ?
+		soxr_delay(h->soxr) * 1000 / h->out_samplerate : 0;
+
+	/* Add input samples not yet converted */
+	if(h->fmt_has_changed == 0)
+		delay += h->in_len * 1000.0 / h->in_samplerate /
+			 h->in_channels;
 
 	/* Add delayed buffer if format changed */
 	if(h->fmt_has_changed > 0)
@@ -565,6 +863,33 @@ unsigned long resample_delay(struct resample_handle *h)
 	return (unsigned long) delay;
 }
 
+int resample_set_ratio(struct resample_handle *h, double ratio)
+{
+	if(h == NULL || !h->variable_rate)
+		return -1;
+
+	/* Bound ratio */
+	if(ratio > 1.0 + MAX_RATIO_DRIFT)
+		ratio = 1.0 + MAX_RATIO_DRIFT;
+	else if(ratio < 1.0 - MAX_RATIO_DRIFT)
+		ratio = 1.0 - MAX_RATIO_DRIFT;
+
+	/* Lock buffer access */
+	pthread_mutex_lock(&h->mutex);
+
+	/* Update I/O ratio: it is changed smoothly over the next samples */
+	h->ratio = ratio;
+	if(h->soxr != NULL)
+		soxr_set_io_ratio(h->soxr, (double)h->in_samplerate /
+				  ((double)h->out_samplerate * ratio),
+				  h->out_samplerate / 10);
+
+	/* Unlock buffer access */
+	pthread_mutex_unlock(&h->mutex);
+
+	return 0;
+}
+
 void resample_flush(struct resample_handle *h)
 {
 	if(h == NULL)
@@ -576,6 +901,7 @@ void resample_flush(struct resample_handle *h)
 	/* Reset values */
 	h->in_len = 0;
 	h->tmp_len = 0;
+	h->trace_in = 0;
 
 	/* Reset resample/mixer engine */
 	resample_free(h);
@@ -583,6 +909,7 @@ void resample_flush(struct resample_handle *h)
 	{
 		h->in_samplerate = h->new_samplerate;
 		h->in_channels = h->new_channels;
+		h->in_sample = h->new_sample;
 		h->fmt_has_changed = 0;
 	}
 	resample_init(h);
@@ -591,6 +918,21 @@ void resample_flush(struct resample_handle *h)
 	pthread_mutex_unlock(&h->mutex);
 }
 
+void resample_set_trace(struct resample_handle *h, struct trace *trace)
+{
+	if(h == NULL)
+		return;
+
+	/* Lock buffer access */
+	pthread_mutex_lock(&h->mutex);
+
+	h->trace = trace;
+	h->trace_in = 0;
+
+	/* Unlock buffer access */
+	pthread_mutex_unlock(&h->mutex);
+}
+
 int resample_close(struct resample_handle *h)
 {
 	if(h == NULL)
@@ -0,0 +1,289 @@
+/*
+ * resample_mix.c - Channel mixing kernels for resampler
+ *
+ * Copyright (c) 2014   A. Dilly
+ *
+ * AirCat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * AirCat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with AirCat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+	#if defined(__SSE2__)
+		#define MIX_SSE2 1
+		#include <emmintrin.h>
+	#endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	#define MIX_NEON 1
+	#include <arm_neon.h>
+#endif
+
+#include "resample_mix.h"
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+/* All kernels process blocks of frames with SIMD when available and finish
+ * with the scalar loop, which gives exactly the same result:
+ *  - stereo to mono: floor((L + R) / 2) for integers, (L + R) * 0.5 for float,
+ *  - 5.1 to stereo: (c0 + c2 + c4) / 3 and (c1 + c3 + c5) / 3,
+ *  - mono to stereo: the sample is duplicated.
+ * Down-mix kernels read a block before writing it, so they work in place.
+ */
+
+/******************************************************************************
+ *                               Stereo to mono                               *
+ ******************************************************************************/
+
+static size_t resample_mix_2to1_s16(void *out, const void *in, size_t len)
+{
+	const int16_t *p_in = in;
+	int16_t *p_out = out;
+	size_t i = 0;
+
+#if defined(MIX_SSE2)
+	const __m128i one = _mm_set1_epi16(1);
+	__m128i a, b;
+
+	for(; i + 16 <= len; i += 16)
+	{
+		/* Sum of each pair in 32-bit */
+		a = _mm_madd_epi16(_mm_loadu_si128((const __m128i *) &p_in[i]),
+				   one);
+		b = _mm_madd_epi16(_mm_loadu_si128((const __m128i *)
+						   &p_in[i+8]), one);
+		a = _mm_packs_epi32(_mm_srai_epi32(a, 1), _mm_srai_epi32(b, 1));
+		_mm_storeu_si128((__m128i *) &p_out[i/2], a);
+	}
+#elif defined(MIX_NEON)
+	int16x8x2_t x;
+
+	for(; i + 16 <= len; i += 16)
+	{
+		x = vld2q_s16(&p_in[i]);
+		vst1q_s16(&p_out[i/2], vhaddq_s16(x.val[0], x.val[1]));
+	}
+#endif
+
+	for(; i + 2 <= len; i += 2)
+		p_out[i/2] = ((int32_t) p_in[i] + p_in[i+1]) >> 1;
+
+	return len / 2;
+}
+
+static size_t resample_mix_2to1_s32(void *out, const void *in, size_t len)
+{
+	const int32_t *p_in = in;
+	int32_t *p_out = out;
+	size_t i = 0;
+
+#if defined(MIX_SSE2)
+	const __m128i one = _mm_set1_epi32(1);
+	__m128 x0, x1;
+	__m128i a, b;
+
+	for(; i + 8 <= len; i += 8)
+	{
+		/* Split left and right channels */
+		x0 = _mm_loadu_ps((const float *) &p_in[i]);
+		x1 = _mm_loadu_ps((const float *) &p_in[i+4]);
+		a = _mm_castps_si128(_mm_shuffle_ps(x0, x1,
+						    _MM_SHUFFLE(2, 0, 2, 0)));
+		b = _mm_castps_si128(_mm_shuffle_ps(x0, x1,
+						    _MM_SHUFFLE(3, 1, 3, 1)));
+
+		/* Mean without overflow */
+		a = _mm_add_epi32(_mm_add_epi32(_mm_srai_epi32(a, 1),
+						_mm_srai_epi32(b, 1)),
+				  _mm_and_si128(_mm_and_si128(a, b), one));
+		_mm_storeu_si128((__m128i *) &p_out[i/2], a);
+	}
+#elif defined(MIX_NEON)
+	int32x4x2_t x;
+
+	for(; i + 8 <= len; i += 8)
+	{
+		x = vld2q_s32(&p_in[i]);
+		vst1q_s32(&p_out[i/2], vhaddq_s32(x.val[0], x.val[1]));
+	}
+#endif
+
+	for(; i + 2 <= len; i += 2)
+		p_out[i/2] = (p_in[i] >> 1) + (p_in[i+1] >> 1) +
+			     (p_in[i] & p_in[i+1] & 1);
+
+	return len / 2;
+}
+
+static size_t resample_mix_2to1_float(void *out, const void *in, size_t len)
+{
+	const float *p_in = in;
+	float *p_out = out;
+	size_t i = 0;
+
+#if defined(MIX_SSE2)
+	const __m128 half = _mm_set1_ps(0.5f);
+	__m128 x0, x1;
+
+	for(; i + 8 <= len; i += 8)
+	{
+		x0 = _mm_loadu_ps(&p_in[i]);
+		x1 = _mm_loadu_ps(&p_in[i+4]);
+		x0 = _mm_add_ps(_mm_shuffle_ps(x0, x1, _MM_SHUFFLE(2, 0, 2, 0)),
+				_mm_shuffle_ps(x0, x1, _MM_SHUFFLE(3, 1, 3, 1)));
+		_mm_storeu_ps(&p_out[i/2], _mm_mul_ps(x0, half));
+	}
+#elif defined(MIX_NEON)
+	float32x4x2_t x;
+
+	for(; i + 8 <= len; i += 8)
+	{
+		x = vld2q_f32(&p_in[i]);
+		vst1q_f32(&p_out[i/2],
+			  vmulq_n_f32(vaddq_f32(x.val[0], x.val[1]), 0.5f));
+	}
+#endif
+
+	for(; i + 2 <= len; i += 2)
+		p_out[i/2] = (p_in[i] + p_in[i+1]) * 0.5f;
+
+	return len / 2;
+}
+
+/******************************************************************************
+ *                               5.1 to stereo                                *
+ ******************************************************************************/
+
+/* The loop has a fixed layout with no indirect channel index: compiler
+ * unrolls it and no more per-sample table walk is done.
+ */
+#define RESAMPLE_MIX_6TO2(type, acc, mean) do { \
+	const type *p_in = in; \
+	type *p_out = out; \
+	size_t i, o; \
+	for(i = 0, o = 0; i + 6 <= len; i += 6, o += 2) \
+	{ \
+		acc l = (acc) p_in[i] + p_in[i+2] + p_in[i+4]; \
+		acc r = (acc) p_in[i+1] + p_in[i+3] + p_in[i+5]; \
+		p_out[o] = mean(l); \
+		p_out[o+1] = mean(r); \
+	} \
+	return len / 3; \
+} while(0)
+
+#define MEAN_INT(x) ((x) / 3)
+#define MEAN_FLOAT(x) ((x) * (1.0f / 3.0f))
+
+static size_t resample_mix_6to2_s16(void *out, const void *in, size_t len)
+{
+	RESAMPLE_MIX_6TO2(int16_t, int32_t, MEAN_INT);
+}
+
+static size_t resample_mix_6to2_s32(void *out, const void *in, size_t len)
+{
+	RESAMPLE_MIX_6TO2(int32_t, int64_t, MEAN_INT);
+}
+
+static size_t resample_mix_6to2_float(void *out, const void *in, size_t len)
+{
+	RESAMPLE_MIX_6TO2(float, float, MEAN_FLOAT);
+}
+
+/******************************************************************************
+ *                               Mono to stereo                               *
+ ******************************************************************************/
+
+static size_t resample_mix_1to2(void *out, const void *in, size_t len)
+{
+	/* Native samples are 32-bit wide: only bits are copied */
+	const uint32_t *p_in = in;
+	uint32_t *p_out = out;
+	size_t i = 0;
+
+#if defined(MIX_SSE2)
+	__m128i x;
+
+	for(; i + 4 <= len; i += 4)
+	{
+		x = _mm_loadu_si128((const __m128i *) &p_in[i]);
+		_mm_storeu_si128((__m128i *) &p_out[i*2],
+				 _mm_unpacklo_epi32(x, x));
+		_mm_storeu_si128((__m128i *) &p_out[i*2+4],
+				 _mm_unpackhi_epi32(x, x));
+	}
+#elif defined(MIX_NEON)
+	uint32x4x2_t x;
+
+	for(; i + 4 <= len; i += 4)
+	{
+		x.val[0] = x.val[1] = vld1q_u32(&p_in[i]);
+		vst2q_u32(&p_out[i*2], x);
+	}
+#endif
+
+	for(; i < len; i++)
+		p_out[i*2] = p_out[i*2+1] = p_in[i];
+
+	return len * 2;
+}
+
+/******************************************************************************
+ *                              Kernel selection                              *
+ ******************************************************************************/
+
+resample_mix_cb resample_mix_get_down(enum a_sample sample,
+				      unsigned char in_channels,
+				      unsigned char out_channels)
+{
+	sample = format_sample(sample);
+
+	if(in_channels == 2 && out_channels == 1)
+	{
+		switch(sample)
+		{
+			case SAMPLE_S16:
+				return &resample_mix_2to1_s16;
+			case SAMPLE_FLOAT:
+				return &resample_mix_2to1_float;
+			default:
+				return &resample_mix_2to1_s32;
+		}
+	}
+	else if(in_channels == 6 && out_channels == 2)
+	{
+		switch(sample)
+		{
+			case SAMPLE_S16:
+				return &resample_mix_6to2_s16;
+			case SAMPLE_FLOAT:
+				return &resample_mix_6to2_float;
+			default:
+				return &resample_mix_6to2_s32;
+		}
+	}
+
+	return NULL;
+}
+
+resample_mix_cb resample_mix_get_up(unsigned char in_channels,
+				    unsigned char out_channels)
+{
+	if(in_channels == 1 && out_channels == 2)
+		return &resample_mix_1to2;
+
+	return NULL;
+}
@@ -0,0 +1,50 @@
+/*
+ * resample_mix.h - Channel mixing kernels for resampler
+ *
+ * Copyright (c) 2014   A. Dilly
+ *
+ * AirCat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * AirCat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with AirCat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RESAMPLE_MIX_H
+#define _RESAMPLE_MIX_H
+
+#include <stddef.h>
+
+#include "format.h"
+
+/**
+ * Channel mixing kernel: len is the count of input samples (all channels) and
+ * the count of output samples is returned. A down-mix kernel can be used in
+ * place (out == in), an up-mix kernel needs two distinct buffers.
+ */
+typedef size_t (*resample_mix_cb)(void *out, const void *in, size_t len);
+
+/**
+ * Get a specialized down-mix kernel for a sample format and a channel layout.
+ * Supported layouts are stereo to mono and 5.1 to stereo (with the same
+ * matrix as the generic table: each output is the mean of every second input
+ * channel). NULL is returned for other layouts.
+ */
+resample_mix_cb resample_mix_get_down(enum a_sample sample,
+				      unsigned char in_channels,
+				      unsigned char out_channels);
+
+/**
+ * Get a specialized up-mix kernel for native samples. Only mono to stereo is
+ * supported, NULL is returned for other layouts.
+ */
+resample_mix_cb resample_mix_get_up(unsigned char in_channels,
+				    unsigned char out_channels);
+
+#endif
@@ -16,12 +16,16 @@
  * You should have received a copy of the GNU General Public License
  * along with AirCat.  If not, see <http://www.gnu.org/licenses/>.
  */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <time.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -40,6 +44,11 @@
 #endif
 
 #include "rtp.h"
+#include "budget.h"
+#include "pool.h"
+#include "trace.h"
+#include "metrics.h"
+#include "lock.h"
 
 #ifndef MAX_RTP_PACKET_SIZE
 	#define MAX_RTP_PACKET_SIZE 1500
@@ -55,6 +64,52 @@
 /* Margin of delay on pool when set delay: pool = delay + margin */
 #define MIN_POOL_MARGIN 10
 
+/* Minimum slot count of jitter buffer (slots bitmap is made of 64-bit words) */
+#define MIN_SLOT_COUNT 64
+
+/* Adaptive delay:
+ *  RTP_ADAPT_BUCKETS: histogram size of transit time deviation (in packets),
+ *  RTP_ADAPT_PERCENTILE: percentile of packets arriving before their play,
+ *  RTP_ADAPT_MARGIN: packets added to the percentile to get target delay,
+ *  RTP_ADAPT_WINDOW: packets after which half of history is forgotten,
+ *  RTP_ADAPT_STEP: minimum packets between two adjustments of delay.
+ */
+#define RTP_ADAPT_BUCKETS 256
+#define RTP_ADAPT_PERCENTILE 99
+#define RTP_ADAPT_MARGIN 2
+#define RTP_ADAPT_WINDOW 512
+#define RTP_ADAPT_STEP 25
+
+/* Resend requests:
+ *  RESEND_REORDER: packets received after a missing packet before requesting
+ *                  it (it can be only reordered),
+ *  RESEND_MERGE: maximum count of received packets between two missing ranges
+ *                to request them in a single range,
+ *  RESEND_MAX_RANGES: maximum ranges requested in a round,
+ *  RESEND_RETRY: round trip times before a packet is requested again,
+ *  RESEND_*_RTT: default, minimum and maximum round trip time (in ms).
+ */
+#define RESEND_REORDER 2
+#define RESEND_MERGE 4
+#define RESEND_MAX_RANGES 8
+#define RESEND_RETRY 2
+#define RESEND_DEFAULT_RTT 50
+#define RESEND_MIN_RTT 10
+#define RESEND_MAX_RTT 1000
+
+/* Request time of a packet not requested and of a packet skipped since it
+ * would arrive after being played (request times are never lower than 2)
+ */
+#define RESEND_NONE 0
+#define RESEND_SKIPPED 1
+
+/* Slot of a sequence number in jitter buffer and its status */
+#define RTP_SLOT(h, seq) ((uint16_t) (seq) & h->slot_mask)
+#define RTP_SLOT_USED(h, i) (h->slot_used[(i) / 64] & (1ULL << ((i) % 64)))
+
+/* Address is in multicast range 224.0.0.0/4 */
+#define RTP_IS_MULTICAST(ip) ((ip) != NULL && ((ip)[0] & 0xF0) == 0xE0)
+
 /**
  * RTP Header structure
  */
@@ -62,6 +117,8 @@ struct rtp_packet {
 	/* Packet buffer (header + data) */
 	unsigned char *buffer;
 	size_t len;
+	/* Arrival time (in ns) when tracing is enabled */
+	uint64_t time;
 	/* Next packet in list */
 	struct rtp_packet *next;
 };
@@ -79,7 +136,12 @@ struct rtp_handle {
 	size_t max_packet_size;
 	/* Jitter buffer */
 	struct rtp_packet *pool;
-	struct rtp_packet *packets;
+	struct rtp_packet **slots;	/*!< Queued packets: a packet is stored
+					     at its sequence number modulo the
+					     slot count (a power of two) */
+	uint64_t *slot_used;		/*!< Bitmap of used slots */
+	unsigned int slot_mask;		/*!< Slot count - 1 */
+	uint16_t queued_count;		/*!< Count of used slots */
 	uint16_t pool_packet_count;
 	uint16_t delay_packet_count;
 	uint16_t resent_packet_count;
@@ -92,6 +154,46 @@ struct rtp_handle {
 	uint16_t first_seq;
 	uint16_t first_ts;
 	uint32_t drop_count;
+	/* Timestamp of last packet returned by rtp_read() */
+	uint32_t read_ts;
+	int read_ts_valid;
+	uint64_t read_time;
+	/* Reception statistics (RFC 3550 section 6.4.1 and appendix A) */
+	unsigned long clock_rate;	/*!< Timestamp rate (Hz) */
+	uint32_t received;		/*!< Packets received from socket */
+	uint32_t base_seq;		/*!< First sequence number received */
+	uint32_t cycles;		/*!< Sequence number cycles (<< 16) */
+	uint16_t max_seq;		/*!< Highest sequence number received */
+	uint32_t expected_prior;	/*!< Expected packets at last report */
+	uint32_t received_prior;	/*!< Received packets at last report */
+	uint16_t last_seq;		/*!< Sequence number of last packet */
+	uint32_t last_ts;		/*!< Timestamp of last packet */
+	uint32_t packet_ts;		/*!< Timestamp duration of a packet */
+	uint32_t transit;		/*!< Relative transit time of last packet */
+	uint32_t jitter;		/*!< Interarrival jitter (scaled by 16) */
+	/* Adaptive delay */
+	int adaptive;			/*!< Delay follows observed jitter */
+	uint16_t min_delay_packet_count;/*!< Minimum delay */
+	uint16_t target_packet_count;	/*!< Current target delay */
+	uint16_t late_packet_count;	/*!< Delay needed by late and lost
+					     packets (lowered each window) */
+	uint32_t transit_min;		/*!< Minimal transit in window */
+	uint32_t transit_prev_min;	/*!< Minimal transit in last window */
+	uint16_t histogram[RTP_ADAPT_BUCKETS];
+					/*!< Transit deviation (in packets) */
+	uint32_t histogram_total;	/*!< Packets in histogram */
+	unsigned int window_count;	/*!< Packets in current window */
+	unsigned int step_count;	/*!< Packets since last adjustment */
+	uint32_t inserted;		/*!< Silences inserted by adjustments */
+	uint32_t dropped;		/*!< Packets dropped by adjustments */
+	/* Resend requests */
+	uint32_t *slot_request;		/*!< Last request time of missing packet
+					     in slot (in ms) */
+	uint32_t last_request;		/*!< Time of last requests (in ms) */
+	uint32_t rtt;			/*!< Round trip time of resends (ms) */
+	uint32_t resend_requested;	/*!< Packets requested */
+	uint32_t resend_received;	/*!< Requested packets received */
+	uint32_t resend_skipped;	/*!< Packets not requested (too late) */
 	/* RTP module params */
 	uint16_t max_misorder;
 	uint16_t max_dropout;
@@ -108,11 +210,146 @@ struct rtp_handle {
 	pthread_mutex_t mutex;
 };
 
+/* Packets are taken from the global memory budget: when it is exhausted, the
+ * jitter buffer stops growing and new packets are dropped. A packet and its
+ * buffer are a single block recycled by the buffer pool.
+ */
+#define RTP_PACKET_SIZE(h) (sizeof(struct rtp_packet) + h->max_packet_size)
+
+/* Lock class of RTP receivers */
+LOCK_CLASS(rtp_class, "rtp");
+
+/* Packet counters of all RTP receivers */
+static struct metric rtp_metric_lost = METRIC_INIT(METRIC_COUNTER,
+	"aircat_rtp_lost_packets_total", "RTP packets missing when played");
+static struct metric rtp_metric_late = METRIC_INIT(METRIC_COUNTER,
+	"aircat_rtp_late_packets_total", "RTP packets dropped as too late");
+static struct metric rtp_metric_resend = METRIC_INIT(METRIC_COUNTER,
+	"aircat_rtp_resend_requested_total", "RTP packets requested again");
+static struct metric rtp_metric_resent = METRIC_INIT(METRIC_COUNTER,
+	"aircat_rtp_resend_received_total", "RTP requested packets received");
+
+static struct rtp_packet *rtp_packet_alloc(struct rtp_handle *h)
+{
+	struct rtp_packet *p;
+
+	/* Reserve memory */
+	if(budget_reserve(BUDGET_RTP, RTP_PACKET_SIZE(h)) != 0)
+		return NULL;
+
+	/* Create a new empty packet with its buffer */
+	p = pool_alloc(RTP_PACKET_SIZE(h));
+	if(p == NULL)
+		goto error;
+	p->buffer = (unsigned char *) (p + 1);
+	p->len = 0;
+	p->next = NULL;
+
+	return p;
+
+error:
+	budget_release(BUDGET_RTP, RTP_PACKET_SIZE(h));
+	return NULL;
+}
+
+static void rtp_packet_free(struct rtp_handle *h, struct rtp_packet *p)
+{
+	pool_free(p);
+	budget_release(BUDGET_RTP, RTP_PACKET_SIZE(h));
+}
+
+static void rtp_packet_release(struct rtp_handle *h, struct rtp_packet *p)
+{
+	/* Remove packet when more packets have been allocated */
+	if(h->extra_count > 0)
+	{
+		h->extra_count--;
+		rtp_packet_free(h, p);
+		return;
+	}
+
+	/* Reset and move packet to pool */
+	p->len = 0;
+	p->next = h->pool;
+	h->pool = p;
+}
+
+static uint32_t rtp_get_time(void)
+{
+	struct timespec now;
+	uint32_t ms;
+
+	/* Get monotonic time in ms (never lower than 2) */
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = now.tv_sec * 1000 + now.tv_nsec / 1000000;
+	return ms > RESEND_SKIPPED ? ms : RESEND_SKIPPED + 1;
+}
+
+static void rtp_slot_add(struct rtp_handle *h, struct rtp_packet *p,
+			 uint16_t seq)
+{
+	unsigned int i = RTP_SLOT(h, seq);
+	uint32_t rtt;
+
+	/* Requested packet: update round trip time */
+	if(h->slot_request[i] > RESEND_SKIPPED)
+	{
+		rtt = rtp_get_time() - h->slot_request[i];
+		h->rtt = (h->rtt * 7 + rtt) / 8;
+		if(h->rtt < RESEND_MIN_RTT)
+			h->rtt = RESEND_MIN_RTT;
+		else if(h->rtt > RESEND_MAX_RTT)
+			h->rtt = RESEND_MAX_RTT;
+		h->resend_received++;
+		metric_inc(&rtp_metric_resent);
+	}
+	h->slot_request[i] = RESEND_NONE;
+
+	/* Store packet in its slot */
+	h->slots[i] = p;
+	h->slot_used[i / 64] |= 1ULL << (i % 64);
+	h->queued_count++;
+}
+
+static struct rtp_packet *rtp_slot_remove(struct rtp_handle *h, unsigned int i)
+{
+	struct rtp_packet *p;
+
+	/* Packet is no more expected */
+	h->slot_request[i] = RESEND_NONE;
+
+	/* Slot is empty */
+	if(!RTP_SLOT_USED(h, i))
+		return NULL;
+
+	/* Remove packet from its slot */
+	p = h->slots[i];
+	h->slots[i] = NULL;
+	h->slot_used[i / 64] &= ~(1ULL << (i % 64));
+	h->queued_count--;
+
+	return p;
+}
+
+static int rtp_join_group(int sock, const unsigned char *ip)
+{
+	struct ip_mreq mreq;
+
+	/* Receive packets of group on default interface */
+	memset(&mreq, 0, sizeof(mreq));
+	memcpy(&mreq.imr_multiaddr, ip, 4);
+	mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+
+	return setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq,
+			  sizeof(mreq));
+}
+
 int rtp_open(struct rtp_handle **handle, struct rtp_attr *attr)
 {
 	struct sockaddr_in addr;
 	struct rtp_handle *h;
 	struct rtp_packet *p;
+	unsigned int count;
 	int opt, i;
 
 	/* Check attributes */
@@ -162,36 +399,71 @@ int rtp_open(struct rtp_handle **handle, struct rtp_attr *attr)
 
 	/* Init jitter buffer */
 	h->pool = NULL;
-	h->packets = NULL;
+	h->slots = NULL;
+	h->slot_used = NULL;
+	h->slot_request = NULL;
+	h->queued_count = 0;
 	h->filling = 1;
 	h->packet_count = 0;
 	h->extra_count = 0;
 	h->first_seq = attr->seq;
 	h->first_ts = attr->timestamp;
 	h->drop_count = 0;
+	h->read_ts = 0;
+	h->read_ts_valid = 0;
+
+	/* Init statistics and adaptive delay */
+	h->clock_rate = attr->clock_rate;
+	h->received = 0;
+	h->expected_prior = 0;
+	h->received_prior = 0;
+	h->packet_ts = 0;
+	h->jitter = 0;
+	h->adaptive = attr->adaptive && attr->clock_rate > 0;
+	h->min_delay_packet_count = attr->min_delay_packet_count;
+	if(h->min_delay_packet_count > h->delay_packet_count)
+		h->min_delay_packet_count = h->delay_packet_count;
+	h->target_packet_count = h->adaptive ? h->min_delay_packet_count :
+					       h->delay_packet_count;
+	h->late_packet_count = 0;
+	memset(h->histogram, 0, sizeof(h->histogram));
+	h->histogram_total = 0;
+	h->window_count = 0;
+	h->step_count = 0;
+	h->inserted = 0;
+	h->dropped = 0;
+
+	/* Init resend requests */
+	h->last_request = 0;
+	h->rtt = RESEND_DEFAULT_RTT;
+	h->resend_requested = 0;
+	h->resend_received = 0;
+	h->resend_skipped = 0;
 
 	/* Allocate pool */
 	for(i = 0; i < h->pool_packet_count; i++)
 	{
 		/* Create a new empty packet */
-		p = malloc(sizeof(struct rtp_packet));
+		p = rtp_packet_alloc(h);
 		if(p == NULL)
-			continue;
-
-		/* Allocate buffer */
-		p->buffer = malloc(h->max_packet_size);
-		if(p->buffer == NULL)
-		{
-			free(p);
-			continue;
-		}
-		p->len = 0;
+			break;
 
 		/* Add packet to pool */
 		p->next = h->pool;
 		h->pool = p;
 	}
 
+	/* Allocate slots: all sequence numbers accepted after first expected
+	 * packet (up to the dropout) must have a distinct slot
+	 */
+	for(count = MIN_SLOT_COUNT; count < h->max_dropout + 1U; count <<= 1);
+	h->slot_mask = count - 1;
+	h->slots = calloc(count, sizeof(struct rtp_packet *));
+	h->slot_used = calloc(count / 64, sizeof(uint64_t));
+	h->slot_request = calloc(count, sizeof(uint32_t));
+	if(h->slots == NULL || h->slot_used == NULL || h->slot_request == NULL)
+		return -1;
+
 	/* Init thread mutex */
 	pthread_mutex_init(&h->mutex, NULL);
 
@@ -222,6 +494,13 @@ int rtp_open(struct rtp_handle **handle, struct rtp_attr *attr)
 	}
 #endif
 
+	/* Several receivers of a multicast group can share the port */
+	opt = 1;
+	if(RTP_IS_MULTICAST(attr->ip) &&
+	   setsockopt(h->sock, SOL_SOCKET, SO_REUSEADDR, &opt,
+		      sizeof(opt)) < 0)
+		return -1;
+
 	/* Bind */
 	memset(&addr, 0, sizeof(addr));
 	addr.sin_family = AF_INET;
@@ -230,6 +509,10 @@ int rtp_open(struct rtp_handle **handle, struct rtp_attr *attr)
 	if(bind(h->sock, (struct sockaddr *) &addr, sizeof(addr)) != 0)
 		return -1;
 
+	/* Join multicast group */
+	if(RTP_IS_MULTICAST(attr->ip) && rtp_join_group(h->sock, attr->ip) != 0)
+		return -1;
+
 	/* Open RTCP socket */
 	if(attr->rtcp_port != 0)
 	{
@@ -268,6 +551,15 @@ int rtp_open(struct rtp_handle **handle, struct rtp_attr *attr)
 				h->rtcp_sock = -1;
 				return 0;
 			}
+
+			/* Join multicast group for sender reports */
+			if(RTP_IS_MULTICAST(attr->ip) &&
+			   rtp_join_group(h->rtcp_sock, attr->ip) != 0)
+			{
+				close(h->rtcp_sock);
+				h->rtcp_sock = -1;
+				return 0;
+			}
 		}
 	}
 
@@ -331,12 +623,13 @@ static void rtp_recv_rtcp(struct rtp_handle *h, unsigned char *buffer,
 		h->rtcp_cb(h->rtcp_data, buffer, len);
 }
 
+static ssize_t rtp_check(struct rtp_handle *h, unsigned char *buffer, int len);
+
 static ssize_t rtp_recv(struct rtp_handle *h, unsigned char *buffer,
 			size_t size)
 {
 	struct sockaddr src_addr;
 	socklen_t sockaddr_size;
-	unsigned char payload;
 	int len;
 
 	if(h == NULL || buffer == NULL || size == 0)
@@ -351,6 +644,13 @@ static ssize_t rtp_recv(struct rtp_handle *h, unsigned char *buffer,
 	if(len <= 0)
 		return len;
 
+	return rtp_check(h, buffer, len);
+}
+
+static ssize_t rtp_check(struct rtp_handle *h, unsigned char *buffer, int len)
+{
+	unsigned char payload;
+
 check:
 	/* Verify packet size */
 	if(len < 12)
@@ -397,34 +697,259 @@ check:
 	return len;
 }
 
+static void rtp_adapt_set_target(struct rtp_handle *h)
+{
+	uint32_t limit, sum;
+	unsigned int target;
+	unsigned int i;
+
+	/* Get percentile of transit deviation */
+	limit = h->histogram_total * RTP_ADAPT_PERCENTILE / 100;
+	for(i = 0, sum = 0; i < RTP_ADAPT_BUCKETS - 1; i++)
+	{
+		sum += h->histogram[i];
+		if(sum >= limit)
+			break;
+	}
+	target = i + RTP_ADAPT_MARGIN;
+
+	/* Keep delay needed by late and lost packets */
+	if(target < h->late_packet_count)
+		target = h->late_packet_count;
+
+	/* Keep delay in limits */
+	if(target < h->min_delay_packet_count)
+		target = h->min_delay_packet_count;
+	if(target > h->delay_packet_count)
+		target = h->delay_packet_count;
+	h->target_packet_count = target;
+}
+
+static void rtp_adapt_update(struct rtp_handle *h, uint32_t transit)
+{
+	uint32_t base, dev;
+	unsigned int i;
+
+	/* First packet */
+	if(h->histogram_total == 0 && h->window_count == 0)
+	{
+		h->transit_min = transit;
+		h->transit_prev_min = transit;
+	}
+
+	/* Transit deviation from fastest packet of current and last windows:
+	 * a drift between sender and receiver clocks is followed since the
+	 * last window is forgotten.
+	 */
+	if((int32_t) (transit - h->transit_min) < 0)
+		h->transit_min = transit;
+	base = (int32_t) (h->transit_prev_min - h->transit_min) < 0 ?
+						 h->transit_prev_min :
+						 h->transit_min;
+	dev = (int32_t) (transit - base) > 0 ? transit - base : 0;
+
+	/* Add deviation to histogram (in packets needed to wait it) */
+	i = (dev + h->packet_ts - 1) / h->packet_ts;
+	if(i >= RTP_ADAPT_BUCKETS)
+		i = RTP_ADAPT_BUCKETS - 1;
+	h->histogram[i]++;
+	h->histogram_total++;
+
+	/* New window: forget half of history */
+	if(++h->window_count >= RTP_ADAPT_WINDOW)
+	{
+		h->histogram_total = 0;
+		for(i = 0; i < RTP_ADAPT_BUCKETS; i++)
+		{
+			h->histogram[i] >>= 1;
+			h->histogram_total += h->histogram[i];
+		}
+		h->transit_prev_min = h->transit_min;
+		h->transit_min = transit;
+		if(h->late_packet_count > 0)
+			h->late_packet_count--;
+		h->window_count = 0;
+	}
+
+	/* Update target delay */
+	rtp_adapt_set_target(h);
+}
+
+static void rtp_adapt_late(struct rtp_handle *h, uint16_t count)
+{
+	if(!h->adaptive)
+		return;
+
+	/* Delay was too short by count packets: grow it */
+	if(h->late_packet_count < h->target_packet_count + count)
+		h->late_packet_count = h->target_packet_count + count;
+	rtp_adapt_set_target(h);
+}
+
+static void rtp_stats_update(struct rtp_handle *h, unsigned char *buffer)
+{
+	struct timespec now;
+	uint32_t transit;
+	uint16_t seq;
+	uint32_t ts;
+	int32_t d;
+
+	/* Get RTP fields */
+	seq = rtp_get_sequence(buffer);
+	ts = rtp_get_timestamp(buffer);
+
+	/* Update highest sequence number */
+	if(h->received == 0)
+	{
+		h->base_seq = seq;
+		h->max_seq = seq;
+		h->cycles = 0;
+	}
+	else if((int16_t) (seq - h->max_seq) > 0)
+	{
+		if(seq < h->max_seq)
+			h->cycles += 1 << 16;
+		h->max_seq = seq;
+	}
+	h->received++;
+
+	/* Jitter needs timestamp rate */
+	if(h->clock_rate == 0)
+		return;
+
+	/* Get packet duration from consecutive packets */
+	if(h->received > 1 && seq == (uint16_t) (h->last_seq + 1) &&
+	   ts != h->last_ts)
+		h->packet_ts = ts - h->last_ts;
+	h->last_seq = seq;
+	h->last_ts = ts;
+
+	/* Get relative transit time in timestamp units */
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	transit = (uint64_t) now.tv_sec * h->clock_rate +
+		  (uint64_t) now.tv_nsec * h->clock_rate / 1000000000ULL - ts;
+
+	/* Update interarrival jitter */
+	if(h->received > 1)
+	{
+		d = transit - h->transit;
+		if(d < 0)
+			d = -d;
+		h->jitter += d - ((h->jitter + 8) >> 4);
+	}
+	h->transit = transit;
+
+	/* Update adaptive delay */
+	if(h->adaptive && h->packet_ts > 0)
+		rtp_adapt_update(h, transit);
+}
+
+#ifdef HAVE_RECVMMSG
+static int _rtp_put(struct rtp_handle *h, unsigned char *buffer, size_t len,
+		    struct rtp_packet *packet);
+
+/* Receive up to count packets from RTP socket with a single call: packets land
+ * directly in pool packets which are then queued in jitter buffer. The count of
+ * received packets is returned, or -1 when the pool is empty or the call is not
+ * supported (packets must then be received one by one).
+ */
+static int rtp_recv_batch(struct rtp_handle *h, unsigned int count)
+{
+	struct rtp_packet *packets[MAX_RTP_RCV];
+	struct mmsghdr msgs[MAX_RTP_RCV];
+	struct iovec iovs[MAX_RTP_RCV];
+	struct rtp_packet *p;
+	unsigned int n, i;
+	ssize_t len;
+	int ret;
+
+	/* Take packets from pool */
+	for(n = 0; n < count && n < MAX_RTP_RCV && h->pool != NULL; n++)
+	{
+		p = h->pool;
+		h->pool = p->next;
+
+		/* Receive packet in its buffer */
+		packets[n] = p;
+		iovs[n].iov_base = p->buffer;
+		iovs[n].iov_len = h->max_packet_size;
+		memset(&msgs[n], 0, sizeof(struct mmsghdr));
+		msgs[n].msg_hdr.msg_iov = &iovs[n];
+		msgs[n].msg_hdr.msg_iovlen = 1;
+	}
+	if(n == 0)
+		return -1;
+
+	/* Get all pending messages from socket */
+	ret = recvmmsg(h->sock, msgs, n, MSG_DONTWAIT, NULL);
+
+	/* Queue received packets */
+	for(i = 0; i < n; i++)
+	{
+		p = packets[i];
+
+		/* Check and queue packet */
+		if(ret > 0 && i < (unsigned int) ret && msgs[i].msg_len > 0)
+		{
+			len = rtp_check(h, p->buffer, msgs[i].msg_len);
+
+			/* Drop packet after a flush */
+			if(len > 0 && h->drop_count > 0)
+			{
+				h->drop_count--;
+				len = 0;
+			}
+
+			/* Update statistics */
+			if(len > 0)
+				rtp_stats_update(h, p->buffer);
+
+			/* Add packet to jitter buffer */
+			if(len > 0 && _rtp_put(h, p->buffer, len, p) == 0)
+				continue;
+		}
+
+		/* Move back unused packet to pool */
+		p->len = 0;
+		p->next = h->pool;
+		h->pool = p;
+	}
+
+	/* Not supported by system */
+	if(ret < 0)
+		return errno == ENOSYS ? -1 : 0;
+
+	return ret;
+}
+#endif
+
 static void _rtp_flush(struct rtp_handle *h, uint16_t seq, uint32_t timestamp)
 {
 	struct rtp_packet *p;
+	unsigned int i;
 
 	if(h == NULL)
 		return;
 
 	/* Reset and move packets to pool */
-	while(h->packets != NULL)
+	for(i = 0; i <= h->slot_mask && h->queued_count > 0; i++)
 	{
-		p = h->packets;
-		h->packets = p->next;
-
-		/* Remove packet when more packets have been allocated */
-		if(h->extra_count > 0)
+		/* Skip empty words of bitmap */
+		if(i % 64 == 0 && h->slot_used[i / 64] == 0)
 		{
-			h->extra_count--;
-			free(p->buffer);
-			free(p);
+			i += 63;
 			continue;
 		}
 
-		/* Reset and move packet */
-		p->len = 0;
-		p->next = h->pool;
-		h->pool = p;
+		/* Move packet */
+		p = rtp_slot_remove(h, i);
+		if(p != NULL)
+			rtp_packet_release(h, p);
 	}
 
+	/* Forget resend requests */
+	memset(h->slot_request, 0, (h->slot_mask + 1) * sizeof(uint32_t));
+
 	/* Reset expected values */
 	h->packet_count = 0;
 	h->extra_count = 0;
@@ -434,13 +959,29 @@ static void _rtp_flush(struct rtp_handle *h, uint16_t seq, uint32_t timestamp)
 
 	/* Reset totally buffer if sequence number and timestamp are null */
 	if(seq == 0 && timestamp == 0)
+	{
 		h->ssrc = 0;
+
+		/* Forget statistics of previous session */
+		h->received = 0;
+		h->expected_prior = 0;
+		h->received_prior = 0;
+		h->packet_ts = 0;
+		h->jitter = 0;
+		memset(h->histogram, 0, sizeof(h->histogram));
+		h->histogram_total = 0;
+		h->window_count = 0;
+	}
 }
 
-static int _rtp_put(struct rtp_handle *h, unsigned char *buffer, size_t len)
+/* Queue a packet in jitter buffer: the packet is copied from buffer in a packet
+ * from pool, or packet is queued directly if it already holds buffer (it must
+ * be moved back to pool by caller when it is dropped).
+ */
+static int _rtp_put(struct rtp_handle *h, unsigned char *buffer, size_t len,
+		    struct rtp_packet *packet)
 {
-	struct rtp_packet **root, *p;
-	uint16_t prev_seq;
+	struct rtp_packet *p;
 	int16_t delta;
 	uint32_t ssrc;
 	uint16_t seq;
@@ -485,56 +1026,27 @@ static int _rtp_put(struct rtp_handle *h, unsigned char *buffer, size_t len)
 	if(delta < 0)
 	{
 		/* Drop packet: arrived too late */
+		rtp_adapt_late(h, -delta);
+		metric_inc(&rtp_metric_late);
 		return -1;
 	}
 
-	/* Find packet in packets */
-	prev_seq = h->first_seq-1;
-	root = &h->packets;
-	p = *root;
-	while(p != NULL)
-	{
-		/* Calculate delta position in queue
-		 * Note: no overflow handling is needed
-		 * since delta is a signed short.
-		 */
-		delta = seq - rtp_get_sequence(p->buffer);
-
-		/* Previous packet found */
-		if(delta < 0)
-			break;
-		else if(delta == 0)
-		{
-			/* Duplicate packet: drop it */
-			return -1;
-		}
-
-		prev_seq = rtp_get_sequence(p->buffer);
-		root = &p->next;
-		p = *root;
-	}
+	/* Duplicate packet: drop it */
+	if(RTP_SLOT_USED(h, RTP_SLOT(h, seq)))
+		return -1;
 
-	/* Discontinuity in sequence: call resent callback */
-	if(h->resent_cb != NULL && ++prev_seq != seq)
+	/* Get a new packet to queue */
+	if(packet != NULL)
 	{
-		delta = seq - prev_seq;
-		if(delta > 0)
-			h->resent_cb(h->resent_data, prev_seq, delta);
+		/* Packet already received in a pool packet */
+		p = packet;
 	}
-
-	/* Get a new packet to queue */
-	if(h->pool == NULL)
+	else if(h->pool == NULL)
 	{
 		/* Allocate new packet */
-		p = malloc(sizeof(struct rtp_packet));
+		p = rtp_packet_alloc(h);
 		if(p == NULL)
 			return -1;
-		p->buffer = malloc(h->max_packet_size);
-		if(p->buffer == NULL)
-		{
-			free(p);
-			return -1;
-		}
 		h->extra_count++;
 	}
 	else
@@ -546,12 +1058,13 @@ static int _rtp_put(struct rtp_handle *h, unsigned char *buffer, size_t len)
 	/* Copy packet into list */
 	if(len > h->max_packet_size)
 		len = h->max_packet_size;
-	memcpy(p->buffer, buffer, len);
+	if(p != packet)
+		memcpy(p->buffer, buffer, len);
 	p->len = len;
+	p->time = trace_is_enabled() ? trace_now() : 0;
 
-	/* Add to list */
-	p->next = *root;
-	*root = p;
+	/* Add to jitter buffer */
+	rtp_slot_add(h, p, seq);
 
 	/* Update packet count (latest - oldest)
 	 * Note: overflow is handled by the signed type of delta.
@@ -561,7 +1074,7 @@ static int _rtp_put(struct rtp_handle *h, unsigned char *buffer, size_t len)
 	{
 		delta = seq - h->first_seq;
 		h->packet_count = delta + 1;
-		if(h->packet_count > h->delay_packet_count)
+		if(h->packet_count > h->target_packet_count)
 			h->filling = 0;
 	}
 
@@ -575,17 +1088,50 @@ static ssize_t rtp_get(struct rtp_handle *h, unsigned char *buffer, size_t size)
 	size_t offset;
 	ssize_t len;
 
+	/* No packet timestamp until a packet is returned */
+	h->read_ts_valid = 0;
+
 	/* Jitter buffer is not full */
-	if(h->filling || h->packets == NULL)
+	if(h->filling || h->queued_count == 0)
 		return RTP_NO_PACKET;
 
-	/* Get next packet */
-	p = h->packets->buffer;
-	len = h->packets->len;
+	/* Adaptive delay: move delay toward target by inserting a silence or
+	 * dropping a packet at packet boundary
+	 */
+	if(h->adaptive && ++h->step_count >= RTP_ADAPT_STEP)
+	{
+		if(h->packet_count < h->target_packet_count)
+		{
+			/* Insert a silence of a packet */
+			h->step_count = 0;
+			h->inserted++;
+			return RTP_NO_PACKET;
+		}
+		else if(h->packet_count > h->target_packet_count + 1)
+		{
+			/* Drop next packet */
+			packet = rtp_slot_remove(h, RTP_SLOT(h, h->first_seq));
+			if(packet != NULL)
+				rtp_packet_release(h, packet);
+			h->packet_count--;
+			h->first_seq++;
+			h->step_count = 0;
+			h->dropped++;
+		}
+	}
 
-	/* Check sequence number */
-	if(h->first_seq == rtp_get_sequence(p))
+	/* Get next packet */
+	packet = rtp_slot_remove(h, RTP_SLOT(h, h->first_seq));
+	if(packet != NULL)
 	{
+		p = packet->buffer;
+		len = packet->len;
+
+		/* Save packet timestamp */
+		h->read_ts = rtp_get_timestamp(p);
+		h->read_ts_valid = 1;
+		h->read_time = packet->time;
+
 		/* Get data offset in packet */
 		offset = 12 + ((p[0] &  0x0F) * 4);
 		if(p[0] & 0x10)
@@ -604,29 +1150,14 @@ static ssize_t rtp_get(struct rtp_handle *h, unsigned char *buffer, size_t size)
 			len = size;
 		memcpy(buffer, p, len);
 
-		/* Remove packet from list */
-		packet = h->packets;
-		h->packets = packet->next;
-
 		/* Move packet to pool */
-		if(h->extra_count > 0)
-		{
-			/* Free packet */
-			free(packet->buffer);
-			free(packet);
-			h->extra_count--;
-		}
-		else
-		{
-			/* Move packet to pool */
-			packet->len = 0;
-			packet->next = h->pool;
-			h->pool = packet;
-		}
+		rtp_packet_release(h, packet);
 	}
 	else
 	{
 		/* Packet not received: lost packet */
+		rtp_adapt_late(h, 1);
+		metric_inc(&rtp_metric_lost);
 		len = RTP_LOST_PACKET;
 	}
 
@@ -644,6 +1175,116 @@ static ssize_t rtp_get(struct rtp_handle *h, unsigned char *buffer, size_t size)
 	return len;
 }
 
+static void rtp_resend_range(struct rtp_handle *h, uint16_t start,
+			     uint16_t end, uint32_t now)
+{
+	unsigned int count = 0;
+	unsigned int i;
+	uint16_t pos;
+
+	/* Mark missing packets as requested */
+	for(pos = start; pos != (uint16_t) (end + 1); pos++)
+	{
+		i = RTP_SLOT(h, h->first_seq + pos);
+		if(!RTP_SLOT_USED(h, i))
+		{
+			h->slot_request[i] = now;
+			count++;
+		}
+	}
+	h->resend_requested += count;
+	metric_add(&rtp_metric_resend, count);
+
+	/* Request range */
+	h->resent_cb(h->resent_data, (uint16_t) (h->first_seq + start),
+		     end - start + 1);
+}
+
+/* Request missing packets: nearby missing packets are merged in ranges, which
+ * are requested at most once per round trip time. A packet is not requested
+ * when it would arrive after being played.
+ */
+static void rtp_resend_schedule(struct rtp_handle *h)
+{
+	unsigned int ranges = 0;
+	uint16_t pos, skip, limit;
+	uint16_t start = 0, end = 0;
+	int has_range = 0;
+	uint32_t now;
+	unsigned int i;
+
+	if(h->resent_cb == NULL || h->packet_count <= RESEND_REORDER)
+		return;
+
+	/* Only one round of requests per round trip time */
+	now = rtp_get_time();
+	if(now - h->last_request < h->rtt)
+		return;
+
+	/* Packets played before a resend can arrive are skipped */
+	skip = 0;
+	if(h->clock_rate > 0 && h->packet_ts > 0)
+		skip = ((uint64_t) h->rtt * h->clock_rate / 1000 +
+			h->packet_ts - 1) / h->packet_ts;
+
+	/* Find missing packets, except last ones which can be reordered */
+	limit = h->packet_count - RESEND_REORDER;
+	for(pos = 0; pos < limit && ranges < RESEND_MAX_RANGES; pos++)
+	{
+		/* Skip full words of bitmap */
+		i = RTP_SLOT(h, h->first_seq + pos);
+		if(i % 64 == 0 && pos + 64 <= limit &&
+		   h->slot_used[i / 64] == ~0ULL)
+		{
+			pos += 63;
+			continue;
+		}
+
+		/* Packet is received or requested recently */
+		if(RTP_SLOT_USED(h, i) || h->slot_request[i] == RESEND_SKIPPED ||
+		   (h->slot_request[i] != RESEND_NONE &&
+		    now - h->slot_request[i] < h->rtt * RESEND_RETRY))
+			continue;
+
+		/* Too late to request packet */
+		if(pos < skip)
+		{
+			h->slot_request[i] = RESEND_SKIPPED;
+			h->resend_skipped++;
+			continue;
+		}
+
+		/* Merge with previous range */
+		if(has_range && pos - end <= RESEND_MERGE + 1)
+		{
+			end = pos;
+			continue;
+		}
+
+		/* Request previous range */
+		if(has_range)
+		{
+			rtp_resend_range(h, start, end, now);
+			ranges++;
+		}
+
+		/* Start a new range */
+		start = end = pos;
+		has_range = 1;
+	}
+
+	/* Request last range */
+	if(has_range && ranges < RESEND_MAX_RANGES)
+	{
+		rtp_resend_range(h, start, end, now);
+		ranges++;
+	}
+
+	/* Update time of last requests */
+	if(ranges > 0)
+		h->last_request = now;
+}
+
 ssize_t rtp_read(struct rtp_handle *h, unsigned char *buffer, size_t size)
 {
 	unsigned char packet[MAX_RTP_PACKET_SIZE];
@@ -678,11 +1319,22 @@ ssize_t rtp_read(struct rtp_handle *h, unsigned char *buffer, size_t size)
 		}
 
 		/* Lock buffer access */
-		pthread_mutex_lock(&h->mutex);
+		lock_mutex(rtp_class, &h->mutex);
 
 		/* Packets are available on RTP socket */
 		if(FD_ISSET(h->sock, &readfs))
 		{
+#ifdef HAVE_RECVMMSG
+			/* Get all pending packets in pool with a single call */
+			len = rtp_recv_batch(h, MAX_RTP_RCV - i);
+			if(len >= 0)
+			{
+				if(len > 1)
+					i += len - 1;
+				goto next;
+			}
+#endif
+
 			/* Get next packet from RTP socket */
 			len = rtp_recv(h, packet, MAX_RTP_PACKET_SIZE);
 			if(len <= 0)
@@ -695,26 +1347,38 @@ ssize_t rtp_read(struct rtp_handle *h, unsigned char *buffer, size_t size)
 				goto next;
 			}
 
+			/* Update statistics */
+			rtp_stats_update(h, packet);
+
 			/* Add packet to jitter buffer */
-			_rtp_put(h, packet, len);
+			_rtp_put(h, packet, len, NULL);
 		}
 next:
 		/* Unlock buffer access */
-		pthread_mutex_unlock(&h->mutex);
+		unlock_mutex(rtp_class, &h->mutex);
 	}
 
+	/* Lock buffer access */
+	lock_mutex(rtp_class, &h->mutex);
+
+	/* Request missing packets */
+	rtp_resend_schedule(h);
+
+	/* Unlock buffer access */
+	unlock_mutex(rtp_class, &h->mutex);
+
 	/* Just receive packets */
 	if(buffer == NULL || size == 0)
 		return 0;
 
 	/* Lock buffer access */
-	pthread_mutex_lock(&h->mutex);
+	lock_mutex(rtp_class, &h->mutex);
 
 	/* Get next packet in jitter buffer */
 	len = rtp_get(h, buffer, size);
 
 	/* Unlock buffer access */
-	pthread_mutex_unlock(&h->mutex);
+	unlock_mutex(rtp_class, &h->mutex);
 
 	return len;
 }
@@ -737,13 +1401,13 @@ int rtp_put(struct rtp_handle *h, unsigned char *buffer, size_t len)
 		return -1;
 
 	/* Lock buffer access */
-	pthread_mutex_lock(&h->mutex);
+	lock_mutex(rtp_class, &h->mutex);
 
 	/* Flush buffer */
-	ret = _rtp_put(h, buffer, len);
+	ret = _rtp_put(h, buffer, len, NULL);
 
 	/* Unlock buffer access */
-	pthread_mutex_unlock(&h->mutex);
+	unlock_mutex(rtp_class, &h->mutex);
 
 	return ret;
 }
@@ -751,7 +1415,6 @@ int rtp_put(struct rtp_handle *h, unsigned char *buffer, size_t len)
 uint16_t rtp_set_delay_packet(struct rtp_handle *h, uint16_t delay)
 {
 	struct rtp_packet *p;
-	int16_t delta;
 	long count;
 	int i;
 
@@ -759,13 +1422,16 @@ uint16_t rtp_set_delay_packet(struct rtp_handle *h, uint16_t delay)
 		return 0;
 
 	/* Lock buffer access */
-	pthread_mutex_lock(&h->mutex);
+	lock_mutex(rtp_class, &h->mutex);
 
 	/* Update delay */
 	if(delay > h->delay_packet_count)
 	{
-		/* Bigger delay: switch to filling state */
-		h->filling = 1;
+		/* Bigger delay: switch to filling state (an adaptive delay
+		 * only gets a bigger maximum)
+		 */
+		if(!h->adaptive)
+			h->filling = 1;
 
 		/* Pool is not enough big */
 		delay += MIN_POOL_MARGIN;
@@ -783,18 +1449,10 @@ uint16_t rtp_set_delay_packet(struct rtp_handle *h, uint16_t delay)
 			for(i = 0; i < count; i++)
 			{
 				/* Allocate packet */
-				p = malloc(sizeof(struct rtp_packet));
+				p = rtp_packet_alloc(h);
 				if(p == NULL)
-					continue;
-				/* Allocate its buffer */
-				p->buffer = malloc(h->max_packet_size);
-				if(p->buffer == NULL)
-				{
-					free(p);
-					continue;
-				}
+					break;
 				/* Add to pool */
-				p->len = 0;
 				p->next = h->pool;
 				h->pool = p;
 			}
@@ -806,34 +1464,12 @@ uint16_t rtp_set_delay_packet(struct rtp_handle *h, uint16_t delay)
 	{
 		/* Lower delay: drop some packets */
 		count = h->delay_packet_count - delay;
-		for(i = 0; i < count && h->packets != NULL; i++)
+		for(i = 0; i < count; i++)
 		{
-			/* Get packet */
-			p = h->packets;
-
-			/* Check its sequence number */
-			delta = rtp_get_sequence(p->buffer) - h->first_seq;
-			if(delta > count)
-				break;
-
-			/* Remove packet from list */
-			h->packets = p->next;
-
 			/* Move packet */
-			if(h->extra_count > 0)
-			{
-				/* Free extra packets */
-				h->extra_count--;
-				free(p->buffer);
-				free(p);
-			}
-			else
-			{
-				/* Move packet to pool */
-				p->len = 0;
-				p->next = h->pool;
-				h->pool = p;
-			}
+			p = rtp_slot_remove(h, RTP_SLOT(h, h->first_seq + i));
+			if(p != NULL)
+				rtp_packet_release(h, p);
 		}
 		h->packet_count -= count;
 		h->first_seq += count;
@@ -843,19 +1479,113 @@ uint16_t rtp_set_delay_packet(struct rtp_handle *h, uint16_t delay)
 	}
 	h->delay_packet_count = delay;
 
+	/* Update target delay */
+	if(h->adaptive)
+		rtp_adapt_set_target(h);
+	else
+		h->target_packet_count = delay;
+
 	/* Unlock buffer access */
-	pthread_mutex_unlock(&h->mutex);
+	unlock_mutex(rtp_class, &h->mutex);
 
 	return 0;
 }
 
+int rtp_get_stats(struct rtp_handle *h, struct rtp_stats *stats)
+{
+	uint32_t expected, interval, received;
+
+	if(h == NULL || stats == NULL)
+		return -1;
+
+	/* Lock buffer access */
+	lock_mutex(rtp_class, &h->mutex);
+
+	/* Get lost packets (RFC 3550 appendix A.3) */
+	expected = h->received > 0 ?
+			h->cycles + h->max_seq - h->base_seq + 1 : 0;
+	stats->received = h->received;
+	stats->lost = expected > h->received ? expected - h->received : 0;
+
+	/* Get fraction of lost packets since last call */
+	interval = expected - h->expected_prior;
+	received = h->received - h->received_prior;
+	h->expected_prior = expected;
+	h->received_prior = h->received;
+	stats->fraction_lost = interval == 0 || interval <= received ? 0 :
+			       ((interval - received) << 8) / interval;
+
+	/* Get jitter and delay */
+	stats->jitter = h->jitter >> 4;
+	stats->delay_packet_count = h->target_packet_count;
+	stats->inserted = h->inserted;
+	stats->dropped = h->dropped;
+
+	/* Get resend requests */
+	stats->resend_requested = h->resend_requested;
+	stats->resend_received = h->resend_received;
+	stats->resend_skipped = h->resend_skipped;
+	stats->rtt = h->rtt;
+
+	/* Unlock buffer access */
+	unlock_mutex(rtp_class, &h->mutex);
+
+	return 0;
+}
+
+int rtp_get_read_timestamp(struct rtp_handle *h, uint32_t *ts)
+{
+	int ret = -1;
+
+	if(h == NULL || ts == NULL)
+		return -1;
+
+	/* Lock buffer access */
+	lock_mutex(rtp_class, &h->mutex);
+
+	/* Get timestamp of last packet read */
+	if(h->read_ts_valid)
+	{
+		*ts = h->read_ts;
+		ret = 0;
+	}
+
+	/* Unlock buffer access */
+	unlock_mutex(rtp_class, &h->mutex);
+
+	return ret;
+}
+
+int rtp_get_read_time(struct rtp_handle *h, uint64_t *time)
+{
+	int ret = -1;
+
+	if(h == NULL || time == NULL)
+		return -1;
+
+	/* Lock buffer access */
+	lock_mutex(rtp_class, &h->mutex);
+
+	/* Get arrival time of last packet read */
+	if(h->read_ts_valid && h->read_time != 0)
+	{
+		*time = h->read_time;
+		ret = 0;
+	}
+
+	/* Unlock buffer access */
+	unlock_mutex(rtp_class, &h->mutex);
+
+	return ret;
+}
+
 void rtp_flush(struct rtp_handle *h, uint16_t seq, uint32_t timestamp)
 {
 	if(h == NULL)
 		return;
 
 	/* Lock buffer access */
-	pthread_mutex_lock(&h->mutex);
+	lock_mutex(rtp_class, &h->mutex);
 
 	/* Flush buffer */
 	_rtp_flush(h, seq, timestamp);
@@ -865,12 +1595,13 @@ void rtp_flush(struct rtp_handle *h, uint16_t seq, uint32_t timestamp)
 		h->drop_count = h->packet_count;
 
 	/* Unlock buffer access */
-	pthread_mutex_unlock(&h->mutex);
+	unlock_mutex(rtp_class, &h->mutex);
 }
 
 int rtp_close(struct rtp_handle *h)
 {
 	struct rtp_packet *p;
+	unsigned int i;
 
 	if(h == NULL)
 		return 0;
@@ -881,19 +1612,18 @@ int rtp_close(struct rtp_handle *h)
 		p = h->pool;
 		h->pool = p->next;
 
-		free(p->buffer);
-		free(p);
+		rtp_packet_free(h, p);
 	}
 
 	/* Free packets */
-	while(h->packets != NULL)
+	for(i = 0; h->slots != NULL && i <= h->slot_mask; i++)
 	{
-		p = h->packets;
-		h->packets = p->next;
-
-		free(p->buffer);
-		free(p);
+		if(h->slots[i] != NULL)
+			rtp_packet_free(h, h->slots[i]);
 	}
+	free(h->slots);
+	free(h->slot_used);
+	free(h->slot_request);
 
 	/* Close socket */
 	if(h->sock > 0)
@@ -903,3 +1633,29 @@ int rtp_close(struct rtp_handle *h)
 
 	return 0;
 }
+
+size_t rtp_set_header(unsigned char *buffer, uint8_t payload, int marker,
+		      uint16_t seq, uint32_t timestamp, uint32_t ssrc)
+{
+	/* Version 2, no padding, no extension and no CSRC */
+	buffer[0] = 0x80;
+	buffer[1] = (marker ? 0x80 : 0x00) | (payload & 0x7F);
+
+	/* Sequence number */
+	buffer[2] = (seq >> 8) & 0xFF;
+	buffer[3] = seq & 0xFF;
+
+	/* Timestamp */
+	buffer[4] = (timestamp >> 24) & 0xFF;
+	buffer[5] = (timestamp >> 16) & 0xFF;
+	buffer[6] = (timestamp >> 8) & 0xFF;
+	buffer[7] = timestamp & 0xFF;
+
+	/* SSRC */
+	buffer[8] = (ssrc >> 24) & 0xFF;
+	buffer[9] = (ssrc >> 16) & 0xFF;
+	buffer[10] = (ssrc >> 8) & 0xFF;
+	buffer[11] = ssrc & 0xFF;
+
+	return RTP_HEADER_SIZE;
+}
@@ -38,6 +38,10 @@
 #include <openssl/md5.h>
 #endif
 
+#ifdef HAVE_EPOLL_CREATE1
+#include <sys/epoll.h>
+#endif
+
 #include "utils.h"
 #include "rtsp.h"
 
@@ -62,7 +66,9 @@ struct rtsp_header {
 struct rtsp_client {
 	/* Socket fd */
 	int sock;
-	struct pollfd *poll_entry;
+	/* Events waited (registered) and received on socket */
+	short events;
+	short revents;
 	struct sockaddr_in addr;
 	/* IP Address */
 	unsigned char server_ip[4];
@@ -70,6 +76,10 @@ struct rtsp_client {
 	unsigned int server_port;
 	unsigned int port;
 	char *name;
+	/* Receive buffer: data read from socket and not yet used */
+	char rx_buffer[BUFFER_SIZE];
+	size_t rx_pos;
+	size_t rx_len;
 	/* Header buffer */
 	char req_buffer[BUFFER_SIZE];
 	size_t req_len;
@@ -114,7 +124,15 @@ struct rtsp_handle {
 			     void *);
 	int (*close_callback)(struct rtsp_client *, void *);
 	void *user_data;
+#ifdef HAVE_EPOLL_CREATE1
+	/* Sockets are registered once in an epoll instance */
+	int epoll_fd;
+	struct epoll_event *epoll_events;
+#else
 	struct pollfd *poll_table;
+#endif
+	/* Events received on server socket */
+	short revents;
 	struct rtsp_client *clients;
 };
 
@@ -159,7 +177,8 @@ static void rtsp_accept(struct rtsp_handle *h)
 	/* Fill client structure */
 	memset(c, 0, sizeof(struct rtsp_client));
 	c->sock = sock;
-	c->poll_entry = NULL;
+	c->events = POLLIN;
+	c->revents = 0;
         c->state = RTSPSTATE_WAIT_REQUEST;
 	c->addr = addr;
 	c->headers = NULL;
@@ -190,6 +209,24 @@ static void rtsp_accept(struct rtsp_handle *h)
 	/* User data */
 	c->user_data = NULL;
 
+#ifdef HAVE_EPOLL_CREATE1
+	/* Register client socket */
+	{
+		struct epoll_event ev;
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = c->events;
+		ev.data.ptr = c;
+		if(epoll_ctl(h->epoll_fd, EPOLL_CTL_ADD, sock, &ev) != 0)
+		{
+			close(sock);
+			free(c->name);
+			free(c);
+			return;
+		}
+	}
+#endif
+
 	/* Update user number */
 	c->next = h->clients;
 	h->clients = c;
@@ -302,131 +339,216 @@ static int rtsp_parse_request(struct rtsp_client *c)
 	return 0;
 }
 
+static char *rtsp_find_request(struct rtsp_client *c)
+{
+	char *p, *end;
+
+	/* Search for end of request in received data */
+	end = c->rx_buffer + c->rx_len;
+	for(p = c->rx_buffer + c->rx_pos; p < end; p++)
+	{
+		if(*p != '\n')
+			continue;
+		if(p + 1 < end && p[1] == '\n')
+			return p + 2;
+		if(p + 2 < end && p[1] == '\r' && p[2] == '\n')
+			return p + 3;
+	}
+
+	return NULL;
+}
+
+static int rtsp_client_pending(struct rtsp_client *c)
+{
+	/* Received data can be used without waiting socket */
+	return (c->state == RTSPSTATE_WAIT_REQUEST &&
+		rtsp_find_request(c) != NULL) ||
+	       (c->state == RTSPSTATE_WAIT_PACKET && c->rx_pos < c->rx_len);
+}
+
+static short rtsp_client_events(struct rtsp_client *c)
+{
+	/* Events to wait on client socket for its state */
+	switch(c->state)
+	{
+		case RTSPSTATE_SEND_REPLY:
+		case RTSPSTATE_SEND_PACKET:
+			return POLLOUT;
+		case RTSPSTATE_WAIT_REQUEST:
+		case RTSPSTATE_WAIT_PACKET:
+			return POLLIN;
+		default:
+			return 0;
+	}
+}
+
+static void rtsp_update_client(struct rtsp_handle *h, struct rtsp_client *c)
+{
+	short events;
+
+	/* Events to wait have not changed */
+	events = rtsp_client_events(c);
+	if(events == c->events)
+		return;
+	c->events = events;
+
+#ifdef HAVE_EPOLL_CREATE1
+	/* Update registration of client socket */
+	{
+		struct epoll_event ev;
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = events;
+		ev.data.ptr = c;
+		epoll_ctl(h->epoll_fd, EPOLL_CTL_MOD, c->sock, &ev);
+	}
+#endif
+}
+
+static ssize_t rtsp_recv(struct rtsp_client *c, void *buffer, size_t len)
+{
+	/* Get data from socket */
+	if(c->rx_pos == c->rx_len)
+		return recv(c->sock, buffer, len, 0);
+
+	/* Get received data first */
+	if(len > c->rx_len - c->rx_pos)
+		len = c->rx_len - c->rx_pos;
+	memcpy(buffer, c->rx_buffer + c->rx_pos, len);
+	c->rx_pos += len;
+	if(c->rx_pos == c->rx_len)
+		c->rx_pos = c->rx_len = 0;
+
+	return len;
+}
+
 static int rtsp_handle_client(struct rtsp_handle *h, struct rtsp_client *c)
 {
 	const char *ptr;
+	char *end;
 	int len;
 
 	/* Return error */
-	if(c->poll_entry->revents & (POLLERR | POLLHUP))
+	if(c->revents & (POLLERR | POLLHUP))
 		return -1;
 
 	switch(c->state)
 	{
 		case RTSPSTATE_WAIT_REQUEST:
 		{
-			/* Return if no event */
-			if(!(c->poll_entry->revents & POLLIN))
-				return 0;
-
-			/* Read data until end of request or end of reception */
-			while(1)
+			/* Find a complete request in received data */
+			end = rtsp_find_request(c);
+			if(end == NULL)
 			{
-				/* Read one byte */
-				len = recv(c->sock, c->buffer_ptr, 1, 0);
+				/* Return if no event */
+				if(!(c->revents & POLLIN))
+					return 0;
+
+				/* Move start of request at buffer start */
+				c->rx_len -= c->rx_pos;
+				memmove(c->rx_buffer, c->rx_buffer + c->rx_pos,
+					c->rx_len);
+				c->rx_pos = 0;
+
+				/* Read as much data as possible */
+				len = recv(c->sock, c->rx_buffer + c->rx_len,
+					   BUFFER_SIZE - c->rx_len, 0);
 				if(len <= 0)
 				{
-					if(errno != EAGAIN && errno != EINTR)
-						return -1;
 					/* Peer closed connection */
-					if(c->buffer_ptr == c->req_buffer)
+					if(len == 0 ||
+					   (errno != EAGAIN && errno != EINTR))
 						return -1;
 					return 0;
 				}
-				c->buffer_ptr += len;
-
-				/* search for end of request. */
-				ptr = c->buffer_ptr;
-				if((ptr >= c->req_buffer + 2 &&
-				   !memcmp(ptr-2,"\n\n", 2)) ||
-				  (ptr >= c->req_buffer + 4 &&
-				   !memcmp(ptr-4, "\r\n\r\n", 4)))
-				{
-					/* Terminate string by '\0' */
-					*c->buffer_ptr = 0;
+				c->rx_len += len;
 
-					/* Reached end of request */
-					if(rtsp_parse_request(c) < 0)
+				/* Search for end of request */
+				end = rtsp_find_request(c);
+				if(end == NULL)
+				{
+					/* Too long request: close connection */
+					if(c->rx_len >= c->req_len - 1)
 						return -1;
+					return 0;
+				}
+			}
 
-					/* Look for CSeq header */
-					if(rtsp_get_header(c, "CSeq", 1)
-					    == NULL)
-						return -1;
+			/* Copy request: next data is kept for body or next
+			 * requests (pipelining)
+			 */
+			len = end - (c->rx_buffer + c->rx_pos);
+			if(len >= c->req_len - 1)
+				return -1;
+			memcpy(c->req_buffer, c->rx_buffer + c->rx_pos, len);
+			c->rx_pos += len;
+			if(c->rx_pos == c->rx_len)
+				c->rx_pos = c->rx_len = 0;
+			c->buffer_ptr = c->req_buffer + len;
 
-					/* Call callback function */
-					if(h->request_callback(c, c->request, 
-							       c->url,
-							       h->user_data)
-					    < 0)
-						return -1;
+			/* Terminate string by '\0' */
+			*c->buffer_ptr = 0;
 
-					/* Prepare response */
-					ptr = rtsp_get_header(c,
-							      "Content-Length",
-							      1);
-					if(ptr == NULL || atol(ptr) == 0)
-					{
-						if(c->resp_buffer == NULL)
-						{
-							/* No response from 
-							 * callback: send a bad
-							 * request
-							 */
-							c->resp_buffer = strdup(
-							 "RTSP/1.0 400 "
-							 "Bad Request\r\n\r\n");
-							c->resp_len = strlen(
-								c->resp_buffer);
-							if(c->packet_buffer
-							    != NULL)
-							{
-								free(
-							      c->packet_buffer);
-								c->packet_buffer
-									 = NULL;
-								c->packet_len =
-									      0;
-							}
-						}
-						c->buffer_ptr = c->resp_buffer;
-						c->buffer_end = c->resp_buffer +
-								c->resp_len;
-						c->state = RTSPSTATE_SEND_REPLY;
-					}
-					else /* Read packet */
+			/* Reached end of request */
+			if(rtsp_parse_request(c) < 0)
+				return -1;
+
+			/* Look for CSeq header */
+			if(rtsp_get_header(c, "CSeq", 1) == NULL)
+				return -1;
+
+			/* Call callback function */
+			if(h->request_callback(c, c->request, c->url,
+					       h->user_data) < 0)
+				return -1;
+
+			/* Prepare response */
+			ptr = rtsp_get_header(c, "Content-Length", 1);
+			if(ptr == NULL || atol(ptr) == 0)
+			{
+				if(c->resp_buffer == NULL)
+				{
+					/* No response from callback: send a
+					 * bad request
+					 */
+					c->resp_buffer = strdup("RTSP/1.0 400 "
+							    "Bad Request\r\n\r\n");
+					c->resp_len = strlen(c->resp_buffer);
+					if(c->packet_buffer != NULL)
 					{
-						c->in_content_len = atol(ptr);
-						c->buffer_ptr = (char*)
-								   c->in_buffer;
-						c->buffer_end = (char*)
-						       c->in_buffer + c->in_len;
-						c->state =
-							  RTSPSTATE_WAIT_PACKET;
+						free(c->packet_buffer);
+						c->packet_buffer = NULL;
+						c->packet_len = 0;
 					}
-					break;
-				}
-				else if(ptr >= c->buffer_end)
-				{
-					/* Too long request: close connection */
-					return -1;
 				}
+				c->buffer_ptr = c->resp_buffer;
+				c->buffer_end = c->resp_buffer + c->resp_len;
+				c->state = RTSPSTATE_SEND_REPLY;
+			}
+			else /* Read packet */
+			{
+				c->in_content_len = atol(ptr);
+				c->buffer_ptr = (char*) c->in_buffer;
+				c->buffer_end = (char*) c->in_buffer +
+						c->in_len;
+				c->state = RTSPSTATE_WAIT_PACKET;
 			}
 			break;
 		}
 		case RTSPSTATE_WAIT_PACKET:
 		{
-			/* Return if no event */
-			if(!(c->poll_entry->revents & POLLIN))
+			/* Return if no event and no received data */
+			if(!(c->revents & POLLIN) &&
+			   c->rx_pos == c->rx_len)
 				return 0;
 
 			/* Read until end of buffer_size or content length */
 			len = min(c->buffer_end-c->buffer_ptr,
 				  c->in_content_len);
-			len = recv(c->sock, c->buffer_ptr, len, 0);
+			len = rtsp_recv(c, c->buffer_ptr, len);
 			if(len <= 0)
 			{
-				if(errno != EAGAIN && errno != EINTR)
+				if(len == 0 || (errno != EAGAIN && errno != EINTR))
 					return -1;
 				return 0;
 			}
@@ -482,7 +604,7 @@ static int rtsp_handle_client(struct rtsp_handle *h, struct rtsp_client *c)
 		case RTSPSTATE_SEND_REPLY:
 		{
 			/* Return if no event */
-			if(!(c->poll_entry->revents & POLLOUT))
+			if(!(c->revents & POLLOUT))
 				return 0;
 
 			/* Send data */
@@ -536,7 +658,7 @@ static int rtsp_handle_client(struct rtsp_handle *h, struct rtsp_client *c)
 		case RTSPSTATE_SEND_PACKET:
 		{
 			/* Return if no event */
-			if(!(c->poll_entry->revents & POLLOUT))
+			if(!(c->revents & POLLOUT))
 				return 0;
 
 			/* Send data */
@@ -615,7 +737,12 @@ static void rtsp_close_client(struct rtsp_handle *h, struct rtsp_client *c)
 
 	/* Close client socket */
 	if(c->sock >= 0)
+	{
+#ifdef HAVE_EPOLL_CREATE1
+		epoll_ctl(h->epoll_fd, EPOLL_CTL_DEL, c->sock, NULL);
+#endif
 		close(c->sock);
+	}
 
 	/* Free client structure */
 	free(c);
@@ -650,12 +777,23 @@ int rtsp_open(struct rtsp_handle **handle, unsigned int port,
 	h->read_callback = read_callback;
 	h->close_callback = close_callback;
 	h->user_data = user_data;
+	h->revents = 0;
 	h->clients = NULL;
 
+#ifdef HAVE_EPOLL_CREATE1
+	/* Create epoll instance and its event table */
+	h->epoll_events = malloc((max_user+1)*sizeof(*h->epoll_events));
+	if(h->epoll_events == NULL)
+		return -1;
+	h->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if(h->epoll_fd < 0)
+		return -1;
+#else
 	/* Prepare poll table */
 	h->poll_table = malloc((max_user+1)*sizeof(*h->poll_table));
 	if(h->poll_table == NULL)
 		return -1;
+#endif
 
 	/* Open socket */
 	if((h->sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
@@ -677,17 +815,53 @@ int rtsp_open(struct rtsp_handle **handle, unsigned int port,
 	if(listen(h->sock, 5) != 0)
 		return -1;
 
+#ifdef HAVE_EPOLL_CREATE1
+	/* Register server socket */
+	{
+		struct epoll_event ev;
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		if(epoll_ctl(h->epoll_fd, EPOLL_CTL_ADD, h->sock, &ev) != 0)
+			return -1;
+	}
+#endif
+
 	return 0;
 }
 
-int rtsp_loop(struct rtsp_handle *h, unsigned int timeout)
+#ifdef HAVE_EPOLL_CREATE1
+static int rtsp_wait(struct rtsp_handle *h, int timeout)
 {
-	struct pollfd *poll_entry;
-	struct rtsp_client *c, *c_next;
+	struct rtsp_client *c;
 	int ret;
+	int i;
 
-	if(h == NULL || h->sock == -1)
-		return -1;
+	/* Wait for events on registered sockets */
+	ret = epoll_wait(h->epoll_fd, h->epoll_events, h->max_user + 1,
+			 timeout);
+	if(ret <= 0)
+		return ret;
+
+	/* Dispatch events (epoll flags are the same as poll ones) */
+	for(i = 0; i < ret; i++)
+	{
+		c = h->epoll_events[i].data.ptr;
+		if(c == NULL)
+			h->revents = h->epoll_events[i].events;
+		else
+			c->revents = h->epoll_events[i].events;
+	}
+
+	return ret;
+}
+#else
+static int rtsp_wait(struct rtsp_handle *h, int timeout)
+{
+	struct pollfd *poll_entry;
+	struct rtsp_client *c;
+	int ret;
 
 	poll_entry = h->poll_table;
 
@@ -697,48 +871,75 @@ int rtsp_loop(struct rtsp_handle *h, unsigned int timeout)
 	poll_entry++;
 
 	/* Fill poll table */
-	c = h->clients;
-	while (c != NULL)
+	for(c = h->clients; c != NULL; c = c->next)
 	{
-		switch(c->state)
-		{
-			case RTSPSTATE_SEND_REPLY:
-			case RTSPSTATE_SEND_PACKET:
-				c->poll_entry = poll_entry;
-				poll_entry->fd = c->sock;
-				poll_entry->events = POLLOUT;
-				poll_entry++;
-				break;
-			case RTSPSTATE_WAIT_REQUEST:
-			case RTSPSTATE_WAIT_PACKET:
-				c->poll_entry = poll_entry;
-				poll_entry->fd = c->sock;
-				poll_entry->events = POLLIN;
-				poll_entry++;
-				break;
-			default:
-				c->poll_entry = NULL;
-				break;
-		}
-		c = c->next;
+		if(c->events == 0)
+			continue;
+		poll_entry->fd = c->sock;
+		poll_entry->events = c->events;
+		poll_entry++;
 	}
 
-	/* Wait for an event with a timeout (in ms) */
+	/* Wait for events */
 	ret = poll(h->poll_table, poll_entry - h->poll_table, timeout);
 	if(ret <= 0)
 		return ret;
 
-	/* Handle events */
+	/* Get events (clients are in same order than in poll table) */
+	poll_entry = h->poll_table;
+	h->revents = poll_entry->revents;
+	poll_entry++;
+	for(c = h->clients; c != NULL; c = c->next)
+	{
+		if(c->events == 0)
+			continue;
+		c->revents = poll_entry->revents;
+		poll_entry++;
+	}
+
+	return ret;
+}
+#endif
+
+int rtsp_loop(struct rtsp_handle *h, unsigned int timeout)
+{
+	struct rtsp_client *c, *c_next;
+	int pending;
+	int ret;
+
+	if(h == NULL || h->sock == -1)
+		return -1;
+
+	/* Wait for an event with a timeout (in ms): don't wait when a client has
+	 * already received data to process
+	 */
+	for(c = h->clients; c != NULL && !rtsp_client_pending(c); c = c->next);
+	pending = c != NULL;
+	ret = rtsp_wait(h, pending ? 0 : timeout);
+	if(ret < 0 || (ret == 0 && !pending))
+		return ret;
+
+	/* Handle clients with events or received data */
 	for(c = h->clients; c != NULL; c = c_next)
 	{
 		c_next = c->next;
+		if(c->revents == 0 && !rtsp_client_pending(c))
+			continue;
 		if(rtsp_handle_client(h, c) < 0)
+		{
 			rtsp_close_client(h, c);
+			continue;
+		}
+		c->revents = 0;
+
+		/* Update events to wait */
+		rtsp_update_client(h, c);
 	}
 
 	/* Check for new connection */
-	if(h->poll_table->revents & POLLIN)
+	if(h->revents & POLLIN)
 		rtsp_accept(h);
+	h->revents = 0;
 
 	return 0;
 }
@@ -1167,9 +1368,17 @@ int rtsp_close(struct rtsp_handle *h)
 	}
 	h->sock = -1;
 
+#ifdef HAVE_EPOLL_CREATE1
+	/* Close epoll instance */
+	if(h->epoll_fd >= 0)
+		close(h->epoll_fd);
+	if(h->epoll_events != NULL)
+		free(h->epoll_events);
+#else
 	/* Free poll table */
 	if(h->poll_table != NULL)
 		free(h->poll_table);
+#endif
 
 	/* Free structure */
 	free(h);
@@ -20,13 +20,21 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <pthread.h>
+#include <time.h>
 #include <sys/time.h>
+#include <sys/mman.h>
 
 #include "http.h"
 #include "decoder.h"
 #include "shoutcast.h"
 #include "vring.h"
+#include "budget.h"
+#include "pool.h"
+#include "thread.h"
+#include "executor.h"
+#include "metrics.h"
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
@@ -68,17 +76,41 @@
 
 /**
  * Thread timeout in ms.
+ *  READ_TIMEOUT: maximum time a reader waits for data from thread (in ms).
  */
 #define THREAD_TIMEOUT 100
+#define READ_TIMEOUT 50
+
+/**
+ * Standby: when the cache of a stream kept connected is full, oldest data is
+ * dropped by STANDBY_DROP_SIZE bytes to make room for live data.
+ */
+#define STANDBY_DROP_SIZE MAX_RW_SIZE
+
+/**
+ * Fast start settings: playback starts before the cache is full when the
+ * download rate allows it. The cache then keeps filling up to its size.
+ *  FAST_START_LEN: minimum audio length buffered before playing (in ms).
+ *  FAST_START_MIN_SIZE: minimum size buffered before playing.
+ *  FAST_START_MARGIN: part of measured download rate which is relied on (in
+ *                     %), to absorb network jitter.
+ */
+#define FAST_START_LEN 250
+#define FAST_START_MIN_SIZE (MIN_CACHE_LEN + MAX_RW_SIZE)
+#define FAST_START_MARGIN 75
 
 /**
  * Pause buffer settings:
- *  BLOCK_SIZE: basic block size.
- *  CHECK_POOL: pool is check every CHECK_POOL seconds and only two block are 
- *              kept. Others are freed.
+ *  CHUNK_SIZE: size of a pause buffer chunk (multiple of page size).
+ *  DEFAULT_PAUSE_RAM: memory used by pause buffer of a stream before next
+ *                     chunks are spilled to a temporary file.
+ *  MAX_SPARE_CHUNKS: count of free chunks kept in memory for next writes.
+ *  SPILL_TEMPLATE: temporary file template for spilled chunks.
  */
-#define BLOCK_SIZE 8192
-#define CHECK_POOL 30
+#define CHUNK_SIZE (1024 * 1024)
+#define DEFAULT_PAUSE_RAM (16 * CHUNK_SIZE)
+#define MAX_SPARE_CHUNKS 2
+#define SPILL_TEMPLATE "/tmp/aircat_pause_XXXXXX"
 
 /**
  * State of metadata demultiplexing in stream
@@ -90,7 +122,75 @@ enum shout_state {
 };
 
 /**
- * Shoutcast data cache: used for metadata cache and pause buffer
+ * Maximum size of a metadata field (length byte is multiplied by 16)
+ */
+#define MAX_META_SIZE (255 * 16)
+
+/**
+ * Relay settings:
+ *  RELAY_SIZE: size of relay buffer shared by all listeners.
+ *  RELAY_BURST: bytes sent at once to a new listener (or a listener which is
+ *               too late) so its player can start immediately.
+ */
+#define RELAY_SIZE (512 * 1024)
+#define RELAY_BURST (64 * 1024)
+
+/**
+ * ICY metadata demultiplexer state
+ */
+struct shout_demux {
+	enum shout_state state;		/*!< State of stream demultiplexing */
+	unsigned int remaining;		/*!< Remaining bytes before next
+					     state */
+	int meta_len;			/*!< Read length from current meta data
+					     field */
+	int meta_size;			/*!< Size of current meta data field */
+	char meta_buf[MAX_META_SIZE];	/*!< Current metadata when it is split
+					     between two reads */
+};
+
+/**
+ * Relay of live stream (before pause buffer) to local listeners: audio is
+ * kept in a ring buffer with its absolute position, so each listener only
+ * needs its own position. It is shared with listeners and freed by the last
+ * user, so a listener can outlive the stream.
+ */
+struct shout_relay {
+	int refs;			/*!< Users count (stream and listeners) */
+	pthread_mutex_t mutex;		/*!< Mutex for relay access */
+	pthread_cond_t cond;		/*!< Signal for new data */
+	unsigned char *buffer;		/*!< Ring buffer (only with listeners) */
+	unsigned long long pos;		/*!< Bytes written since stream start */
+	unsigned long long start;	/*!< Position of first byte in buffer */
+	char title[MAX_META_SIZE];	/*!< Current metadata string */
+	size_t title_len;		/*!< Length of metadata string */
+	unsigned long title_id;		/*!< Incremented on metadata change */
+	int eos;			/*!< End of stream */
+	struct shout_demux demux;	/*!< Demultiplexer of live stream */
+	struct shout_listener *listeners;
+					/*!< Connected listeners */
+};
+
+/**
+ * Relay listener
+ */
+struct shout_listener {
+	struct shout_relay *relay;	/*!< Relay of stream */
+	unsigned long long pos;		/*!< Position of next byte to send */
+	int metadata;			/*!< Insert ICY metadata */
+	unsigned int remaining;		/*!< Bytes before next metadata */
+	unsigned long title_id;		/*!< Last metadata sent */
+	unsigned char meta[1 + MAX_META_SIZE];
+					/*!< Metadata field being sent */
+	size_t meta_pos;		/*!< Bytes of field already sent */
+	size_t meta_len;		/*!< Size of field */
+	shout_wake_cb wake;		/*!< Called on new data */
+	void *wake_data;		/*!< User data for wake callback */
+	struct shout_listener *next;	/*!< Next listener of relay */
+};
+
+/**
+ * Shoutcast data cache: used for metadata cache
  */
 struct shout_data {
 	struct shout_data *next;	/*!< Next data block in cache */
@@ -99,6 +199,17 @@ struct shout_data {
 	char data[0];			/*!< Data block */
 };
 
+/**
+ * Pause buffer chunk: in memory or in spill file. A file chunk is mapped only
+ * while it is written or read, so at most two of them are in memory.
+ */
+struct shout_chunk {
+	struct shout_chunk *next;	/*!< Next chunk in pause buffer */
+	unsigned char *data;		/*!< Chunk data (NULL if not mapped) */
+	off_t offset;			/*!< Offset in spill file (-1 if chunk
+					     is in memory) */
+};
+
 /**
  * Shoutcast handler
  */
@@ -110,29 +221,34 @@ struct shout_handle {
 	unsigned long cache_len;	/*!< Cache size in seconds */
 	size_t cache_size;		/*!< Cache size in bytes */
 	int is_ready;			/*!< Flag for cache status */
+	int fast_start;			/*!< Play before cache is full */
+	int is_filling;			/*!< Download rate is measured */
+	struct timeval start_fill;	/*!< Timestamp of buffering start */
+	size_t start_len;		/*!< Cache length at buffering start */
 	struct shout_data *metas;	/*!< Metadata cache (first) */
 	struct shout_data *metas_last;	/*!< Last metadata in cache */
 	/* Pause buffer */
-	struct shout_data *pauses;	/*!< First block in pause buffer */
-	struct shout_data *pauses_last;	/*!< Last block in pause buffer */
-	struct shout_data *pool;	/*!< Current pause buffer block */
-	struct shout_data *pool_last;	/*!< Last pause buffer block in pool */
-	unsigned long pause_count;	/*!< Count of pause buffer block */
+	struct shout_chunk *pauses;	/*!< First chunk in pause buffer (read) */
+	struct shout_chunk *pauses_last;/*!< Last chunk in pause buffer
+					     (written) */
+	struct shout_chunk *spares;	/*!< Free chunks */
+	unsigned int spare_count;	/*!< Count of free chunks in memory */
+	size_t pause_read;		/*!< Read position in first chunk */
+	size_t pause_write;		/*!< Write position in last chunk */
+	size_t pause_size;		/*!< Bytes in pause buffer */
+	size_t pause_ram;		/*!< Memory used by chunks */
+	int spill_fd;			/*!< Spill file for chunks */
+	off_t spill_size;		/*!< Size of spill file */
 	int is_paused;			/*!< Stream is paused: buffering */
 	struct timeval start_pause;	/*!< Timestamp of pause start */
 	unsigned long pause_len;	/*!< Duration of pause buffer (ms) */
-	time_t last_pool_check;		/*!< Last pool check */
 	size_t skip_size;		/*!< Len to skip in pause buffer */
 	int end_pause;			/*!< End of stream during pause */
 	/* Metadata handling */
-	enum shout_state state;		/*!< State of stream demultiplexing */
 	unsigned int metaint;		/*!< Bytes between two meta data */
-	unsigned int remaining;		/*!< Remaining bytes before next
-					     state */
-	int meta_len;			/*!< Read length from current meta data 
-					     field */
-	int meta_size;			/*!< Size of current meta data field */
-	struct shout_data *meta;	/*!< Current metadata */
+	struct shout_demux demux;	/*!< Demultiplexer of played stream */
+	/* Relay to local listeners */
+	struct shout_relay *relay;	/*!< Relay of live stream */
 	/* Radio info */
 	struct radio_info info;		/*!< Radio information */
 	/* Decoder and stream properties */
@@ -154,11 +270,31 @@ struct shout_handle {
 	int use_thread;			/*!< Internal thread usage */
 	int stop;			/*!< Stop signal for thread */
 	pthread_t thread;		/*!< Internal thread */
+	struct task *task;		/*!< Internal task (task mode) */
+	/* Standby */
+	int is_standby;			/*!< Stream is kept connected idle */
+	int standby_stop;		/*!< Stop signal for standby thread */
+	pthread_t standby_thread;	/*!< Standby thread */
+	struct task *standby_task;	/*!< Standby task (task mode) */
 	pthread_mutex_t mutex;		/*!< Mutex for thread */
 	pthread_mutex_t meta_mutex;		/*!< Mutex for metadata */
 	pthread_mutex_t pause_mutex;		/*!< Mutex for pause buffer */
 };
 
+/* Counters of all radio streams */
+static struct metric shoutcast_metric_connects = METRIC_INIT(METRIC_COUNTER,
+	"aircat_shoutcast_connections_total",
+	"Radio stream connections (including reconnections)");
+static struct metric shoutcast_metric_errors = METRIC_INIT(METRIC_COUNTER,
+	"aircat_shoutcast_connection_errors_total",
+	"Radio stream connections which failed");
+static struct metric shoutcast_metric_ends = METRIC_INIT(METRIC_COUNTER,
+	"aircat_shoutcast_disconnections_total",
+	"Radio streams closed by server or network");
+static struct metric shoutcast_metric_bytes = METRIC_INIT(METRIC_COUNTER,
+	"aircat_shoutcast_received_bytes_total",
+	"Bytes received from radio streams");
+
 static inline int shoutcast_sync(struct shout_handle *h);
 static ssize_t shoutcast_sync_mp3_stream(struct shout_handle *h,
 					 unsigned char *buffer, size_t in_len);
@@ -170,6 +306,12 @@ static ssize_t shoutcast_get_buffer(struct shout_handle *h,
 				    unsigned char **buffer);
 static ssize_t shoutcast_forward_buffer(struct shout_handle *h, size_t size);
 static void *shoutcast_thread(void *user_data);
+static void *shoutcast_standby_thread(void *user_data);
+static int shoutcast_task(void *user_data, struct task *t);
+static int shoutcast_standby_task(void *user_data, struct task *t);
+static size_t shoutcast_demux(struct shout_handle *h, struct shout_demux *d,
+			      unsigned char *buffer, size_t len,
+			      struct shout_relay *r);
 
 int shoutcast_open(struct shout_handle **handle, const char *url,
 		   unsigned long cache_size, int use_thread)
@@ -192,14 +334,28 @@ int shoutcast_open(struct shout_handle **handle, const char *url,
 
 	/* Init structure */
 	h->cache_len = cache_size > 0 ? cache_size : DEFAULT_CACHE_SIZE;
-	h->state = SHOUT_DATA;
+	h->demux.state = SHOUT_DATA;
 	h->is_ready = 1;
+	h->fast_start = 1;
+	h->spill_fd = -1;
 
 	/* Init thread mutex */
 	pthread_mutex_init(&h->mutex, NULL);
 	pthread_mutex_init(&h->meta_mutex, NULL);
 	pthread_mutex_init(&h->pause_mutex, NULL);
 
+	/* Create relay */
+	h->relay = calloc(1, sizeof(struct shout_relay));
+	if(h->relay == NULL)
+	{
+		shoutcast_close(h);
+		return -1;
+	}
+	h->relay->refs = 1;
+	h->relay->demux.state = SHOUT_DATA;
+	pthread_mutex_init(&h->relay->mutex, NULL);
+	pthread_cond_init(&h->relay->cond, NULL);
+
 	/* Init HTTP client */
 	if(http_open(&h->http, 1) != 0)
 	{
@@ -212,9 +368,13 @@ int shoutcast_open(struct shout_handle **handle, const char *url,
 	http_set_option(h->http, HTTP_FOLLOW_REDIRECT, NULL, 1);
 
 	/* Connect and get header from server */
+	metric_inc(&shoutcast_metric_connects);
 	code = http_get(h->http, url);
 	if(code != 200)
+	{
+		metric_inc(&shoutcast_metric_errors);
 		return -1;
+	}
 
 	/* Fill info radio structure */
 	h->info.description = http_get_header(h->http, "icy-description", 0);
@@ -258,7 +418,8 @@ int shoutcast_open(struct shout_handle **handle, const char *url,
 
 	/* Update metaint with extracted info */
 	h->metaint = h->info.metaint;
-	h->remaining = h->metaint;
+	h->demux.remaining = h->metaint;
+	h->relay->demux.remaining = h->metaint;
 
 	/* Calculate input buffer size */
 	h->cache_size = h->cache_len * 1000;
@@ -268,7 +429,7 @@ int shoutcast_open(struct shout_handle **handle, const char *url,
 		h->cache_size *= DEFAULT_BITRATE / 8;
 
 	/* Create a ring buffer for input data */
-	if(vring_open(&h->ring, h->cache_size, MAX_RW_SIZE) != 0)
+	if(vring_open(&h->ring, h->cache_size, MAX_RW_SIZE, 0) != 0)
 		return -1;
 
 	/* Synchronize to first frame in stream */
@@ -291,7 +452,15 @@ int shoutcast_open(struct shout_handle **handle, const char *url,
 	/* Start internal thread */
 	if(use_thread)
 	{
-		if(pthread_create(&h->thread, NULL, shoutcast_thread, h) != 0)
+		/* Use a task of shared pool when enabled */
+		if(executor_is_enabled())
+		{
+			h->task = task_new(shoutcast_task, h, "shoutcast");
+			if(h->task == NULL)
+				return -1;
+		}
+		else if(pthread_create(&h->thread, NULL, shoutcast_thread, h)
+			!= 0)
 			return -1;
 		h->use_thread = 1;
 	}
@@ -493,6 +662,9 @@ static void *shoutcast_thread(void *user_data)
 	struct shout_handle *h = user_data;
 	ssize_t len;
 
+	/* Set thread scheduling and name */
+	thread_setup(THREAD_DEMUX, "shoutcast");
+
 	/* Fill buffer until end */
 	while(!h->stop)
 	{
@@ -508,14 +680,104 @@ static void *shoutcast_thread(void *user_data)
 	return NULL;
 }
 
+static void *shoutcast_standby_thread(void *user_data)
+{
+	struct shout_handle *h = user_data;
+
+	/* Set thread scheduling and name */
+	thread_setup(THREAD_DEMUX, "shoutcast-next");
+
+	/* Keep cache filled with live stream until promotion */
+	while(!h->standby_stop)
+	{
+		/* Fill cache from stream */
+		if(shoutcast_fill_buffer(h, THREAD_TIMEOUT) < 0)
+		{
+			/* End of stream */
+			h->stop = 1;
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+static int shoutcast_task_step(struct shout_handle *h, struct task *t)
+{
+	unsigned char *buffer;
+	int sock;
+
+	/* Fill cache with data available on stream */
+	if(shoutcast_fill_buffer(h, 0) < 0)
+		return -1;
+
+	/* Cache is full: check again later since the ring buffer can't wake
+	 * the task when reader frees some space */
+	sock = http_get_socket(h->http);
+	if(vring_write(h->ring, &buffer) == 0 || sock < 0 ||
+	   task_wait_fd(t, sock, 0) != 0)
+	{
+		task_timeout(t, THREAD_TIMEOUT);
+		return 0;
+	}
+
+	/* Wait next data from stream (with a timeout to check stop signal) */
+	task_timeout(t, THREAD_TIMEOUT * 10);
+
+	return 0;
+}
+
+static int shoutcast_task(void *user_data, struct task *t)
+{
+	struct shout_handle *h = user_data;
+
+	/* Fill buffer until end */
+	if(!h->stop && shoutcast_task_step(h, t) == 0)
+		return TASK_WAIT;
+
+	/* End of stream: release socket before it is closed */
+	h->stop = 1;
+	task_release_fd(t);
+
+	return TASK_DONE;
+}
+
+static int shoutcast_standby_task(void *user_data, struct task *t)
+{
+	struct shout_handle *h = user_data;
+
+	/* Keep cache filled with live stream until promotion (socket is
+	 * released since it is then read by promoted stream)
+	 */
+	if(h->standby_stop)
+	{
+		task_release_fd(t);
+		return TASK_DONE;
+	}
+
+	/* Fill cache from stream */
+	if(shoutcast_task_step(h, t) != 0)
+	{
+		/* End of stream: release socket before it is closed */
+		h->stop = 1;
+		task_release_fd(t);
+		return TASK_DONE;
+	}
+
+	return TASK_WAIT;
+}
+
 int shoutcast_read(void *user_data, unsigned char *buffer, size_t size,
 		   struct a_format *fmt)
 {
 	struct shout_handle *h = (struct shout_handle *) user_data;
+	struct decoder_batch_info batch_info;
+	struct decoder_frame frame;
 	struct decoder_info info;
 	unsigned char *in_buffer;
 	int total_samples = 0;
 	ssize_t len = 0;
+	size_t used;
 	int samples;
 
 	if(h == NULL)
@@ -544,9 +806,12 @@ int shoutcast_read(void *user_data, unsigned char *buffer, size_t size,
 	/* Fill output buffer */
 	while(total_samples < size)
 	{
-		/* Fill input buffer as possible */
+		/* Fill input buffer as possible or wait data from thread */
 		if(!h->use_thread)
 			len = shoutcast_fill_buffer(h, 0);
+		else if(h->is_ready && !h->stop)
+			vring_wait_readable(h->ring, MIN_CACHE_LEN + 1,
+					    READ_TIMEOUT);
 
 		/* Lock pause buffer access */
 		pthread_mutex_lock(&h->pause_mutex);
@@ -581,42 +846,35 @@ int shoutcast_read(void *user_data, unsigned char *buffer, size_t size,
 			continue;
 		}
 
-		/* Decode next frame */
-		samples = decoder_decode(h->dec, in_buffer, len > 0 ? len : 0,
-					 &buffer[total_samples * 4],
-					 size - total_samples, &info);
-		if(samples <= 0)
-		{
-			/* Forward used bytes in ring buffer */
-			if(len > 0 && info.used > 0)
-				shoutcast_forward_buffer(h, info.used);
-
-			/* Unlock pause buffer access */
-			pthread_mutex_unlock(&h->pause_mutex);
-			break;
-		}
-
-		/* Forward ring buffer to next frame */
-		shoutcast_forward_buffer(h, info.used);
+		/* Decode all buffered data in current audio format */
+		frame.data = in_buffer;
+		frame.len = len;
+		batch_info.samplerate = h->samplerate;
+		batch_info.channels = h->channels;
+		samples = decoder_decode_batch(h->dec, &frame, 1,
+					       &buffer[total_samples * 4],
+					       size - total_samples,
+					       &batch_info);
+
+		/* Forward used bytes in ring buffer */
+		used = batch_info.frames > 0 ? len : batch_info.used;
+		if(used > 0)
+			shoutcast_forward_buffer(h, used);
 
 		/* Unlock pause buffer access */
 		pthread_mutex_unlock(&h->pause_mutex);
 
 		/* Update remaining counter */
-		h->pcm_remaining = info.remaining;
-
-		/* Check audio format */
-		if(info.samplerate != h->samplerate ||
-		   info.channels != h->channels)
-		{
-			/* Reset internal position */
-			decoder_decode(h->dec, NULL, 0, NULL, 0, NULL);
-			h->pcm_remaining += samples;
+		h->pcm_remaining = batch_info.remaining;
+		if(samples <= 0)
 			break;
-		}
 
 		/* Update samples returned */
 		total_samples += samples;
+
+		/* Output buffer is full or audio format has changed */
+		if(h->pcm_remaining > 0)
+			break;
 	}
 
 	/* Fill audio format */
@@ -689,6 +947,89 @@ int shoutcast_get_filling(struct shout_handle *h)
 	return 100;
 }
 
+int shoutcast_set_fast_start(struct shout_handle *h, int enable)
+{
+	/* Lock pause buffer access */
+	pthread_mutex_lock(&h->pause_mutex);
+
+	/* Set fast start */
+	h->fast_start = enable;
+
+	/* Unlock pause buffer access */
+	pthread_mutex_unlock(&h->pause_mutex);
+
+	return 0;
+}
+
+static void shoutcast_join_standby(struct shout_handle *h)
+{
+	/* Stop standby thread or task */
+	h->standby_stop = 1;
+	if(h->standby_task != NULL)
+	{
+		task_wake(h->standby_task);
+		task_join(h->standby_task);
+		h->standby_task = NULL;
+	}
+	else
+		pthread_join(h->standby_thread, NULL);
+}
+
+int shoutcast_set_standby(struct shout_handle *h, int enable)
+{
+	int ret;
+
+	if(h == NULL || h->use_thread)
+		return -1;
+
+	/* Nothing to do */
+	if((enable != 0) == h->is_standby)
+		return 0;
+
+	if(enable)
+	{
+		/* Start standby thread */
+		h->standby_stop = 0;
+		h->is_standby = 1;
+		if(executor_is_enabled())
+		{
+			/* Use a task of shared pool */
+			h->standby_task = task_new(shoutcast_standby_task, h,
+						   "shoutcast-next");
+			ret = h->standby_task != NULL ? 0 : -1;
+		}
+		else
+			ret = pthread_create(&h->standby_thread, NULL,
+					     shoutcast_standby_thread, h);
+		if(ret != 0)
+		{
+			h->is_standby = 0;
+			return -1;
+		}
+
+		return 0;
+	}
+
+	/* Stop standby thread */
+	shoutcast_join_standby(h);
+	h->is_standby = 0;
+
+	/* Lock pause buffer access */
+	pthread_mutex_lock(&h->pause_mutex);
+
+	/* Cache has been cut anywhere in stream: resynchronize it and play as
+	 * soon as ready (immediately if cache is full)
+	 */
+	h->is_ready = 0;
+	h->is_filling = 0;
+	h->resync = 1;
+
+	/* Unlock pause buffer access */
+	pthread_mutex_unlock(&h->pause_mutex);
+
+	return 0;
+}
+
 int shoutcast_play(struct shout_handle *h)
 {
 	/* Update pause duration */
@@ -765,10 +1106,10 @@ unsigned long shoutcast_skip(struct shout_handle *h, unsigned long skip)
 		skip = h->pause_len;
 
 	/* Update skip size if pause buffer is bigger */
-	if(h->pause_len > 0)
+	if(h->pause_len > 0 && h->pause_size > h->skip_size)
 	{
-		h->skip_size += skip * (((h->pause_count + 1) * BLOCK_SIZE) -
-				h->skip_size) / h->pause_len;
+		h->skip_size += (unsigned long long) skip *
+				(h->pause_size - h->skip_size) / h->pause_len;
 		h->pause_len -= skip;
 		h->is_ready = 0;
 	}
@@ -808,6 +1149,547 @@ int shoutcast_set_event_cb(struct shout_handle *h, shoutcast_event_cb cb,
 	return 0;
 }
 
+static size_t shoutcast_pause_ram = DEFAULT_PAUSE_RAM;
+
+void shoutcast_set_pause_ram(size_t size)
+{
+	__atomic_store_n(&shoutcast_pause_ram,
+			 size > 0 ? size : DEFAULT_PAUSE_RAM, __ATOMIC_RELAXED);
+}
+
+size_t shoutcast_get_pause_ram(void)
+{
+	return __atomic_load_n(&shoutcast_pause_ram, __ATOMIC_RELAXED);
+}
+
+static int shoutcast_chunk_map(struct shout_handle *h, struct shout_chunk *c)
+{
+	void *data;
+
+	/* Chunk is in memory or already mapped */
+	if(c->data != NULL)
+		return 0;
+
+	/* Map chunk from spill file */
+	data = mmap(NULL, CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+		    h->spill_fd, c->offset);
+	if(data == MAP_FAILED)
+		return -1;
+	c->data = data;
+
+	return 0;
+}
+
+static void shoutcast_chunk_unmap(struct shout_chunk *c)
+{
+	/* Chunk stays in spill file */
+	if(c->offset >= 0 && c->data != NULL)
+	{
+		munmap(c->data, CHUNK_SIZE);
+		c->data = NULL;
+	}
+}
+
+/* Chunks in memory are taken from the global memory budget: when it is
+ * exhausted or when the pause memory limit of the stream is reached, next
+ * chunks are spilled to a temporary file. The pause buffer stops growing only
+ * when the file can't grow anymore.
+ */
+static struct shout_chunk *shoutcast_chunk_alloc(struct shout_handle *h)
+{
+	struct shout_chunk *c, **p;
+	char path[] = SPILL_TEMPLATE;
+
+	/* Reuse a free chunk which is in memory */
+	for(p = &h->spares; *p != NULL; p = &(*p)->next)
+	{
+		if((*p)->offset < 0)
+			break;
+	}
+	if(*p == NULL && h->pause_ram + CHUNK_SIZE > shoutcast_get_pause_ram())
+		p = &h->spares;
+	if(*p != NULL)
+	{
+		c = *p;
+		*p = c->next;
+		if(c->offset < 0)
+			h->spare_count--;
+		goto end;
+	}
+
+	/* Allocate a new chunk */
+	c = malloc(sizeof(struct shout_chunk));
+	if(c == NULL)
+		return NULL;
+	c->data = NULL;
+	c->offset = -1;
+
+	/* Allocate chunk in memory */
+	if(h->pause_ram + CHUNK_SIZE <= shoutcast_get_pause_ram() &&
+	   budget_reserve(BUDGET_SHOUTCAST, CHUNK_SIZE) == 0)
+	{
+		c->data = malloc(CHUNK_SIZE);
+		if(c->data != NULL)
+		{
+			h->pause_ram += CHUNK_SIZE;
+			goto end;
+		}
+		budget_release(BUDGET_SHOUTCAST, CHUNK_SIZE);
+	}
+
+	/* Create spill file (removed as soon as it is closed) */
+	if(h->spill_fd < 0)
+	{
+		h->spill_fd = mkstemp(path);
+		if(h->spill_fd < 0)
+			goto error;
+		unlink(path);
+		h->spill_size = 0;
+	}
+
+	/* Grow spill file: space is allocated now since a write in a mapping
+	 * can't fail gracefully
+	 */
+	if(posix_fallocate(h->spill_fd, h->spill_size, CHUNK_SIZE) != 0)
+		goto error;
+	c->offset = h->spill_size;
+	h->spill_size += CHUNK_SIZE;
+
+end:
+	/* Map chunk for writing */
+	if(shoutcast_chunk_map(h, c) != 0)
+		goto error;
+	c->next = NULL;
+
+	return c;
+
+error:
+	/* Keep chunk in file for later */
+	if(c->offset >= 0)
+	{
+		c->next = h->spares;
+		h->spares = c;
+		return NULL;
+	}
+	free(c);
+	return NULL;
+}
+
+static void shoutcast_chunk_free(struct shout_handle *h, struct shout_chunk *c)
+{
+	/* Unmap chunk from spill file */
+	shoutcast_chunk_unmap(c);
+
+	/* Keep file chunks and some memory chunks for next writes */
+	if(c->offset >= 0 || h->spare_count < MAX_SPARE_CHUNKS)
+	{
+		if(c->offset < 0)
+			h->spare_count++;
+		c->next = h->spares;
+		h->spares = c;
+		return;
+	}
+
+	/* Free memory chunk */
+	free(c->data);
+	free(c);
+	h->pause_ram -= CHUNK_SIZE;
+	budget_release(BUDGET_SHOUTCAST, CHUNK_SIZE);
+}
+
+static void shoutcast_pause_free(struct shout_handle *h)
+{
+	struct shout_chunk *c;
+
+	/* Move all chunks to free list */
+	while(h->pauses != NULL)
+	{
+		c = h->pauses;
+		h->pauses = c->next;
+		shoutcast_chunk_unmap(c);
+		c->next = h->spares;
+		h->spares = c;
+	}
+	h->pauses_last = NULL;
+	h->pause_read = 0;
+	h->pause_write = 0;
+	h->pause_size = 0;
+
+	/* Free all chunks */
+	while(h->spares != NULL)
+	{
+		c = h->spares;
+		h->spares = c->next;
+		if(c->offset < 0)
+		{
+			free(c->data);
+			h->pause_ram -= CHUNK_SIZE;
+			budget_release(BUDGET_SHOUTCAST, CHUNK_SIZE);
+		}
+		free(c);
+	}
+	h->spare_count = 0;
+
+	/* Close spill file */
+	if(h->spill_fd >= 0)
+		close(h->spill_fd);
+	h->spill_fd = -1;
+	h->spill_size = 0;
+}
+
+static void shoutcast_relay_wake(struct shout_relay *r)
+{
+	struct shout_listener *l;
+
+	/* Wake up blocking readers and listeners waiting for a callback */
+	pthread_cond_broadcast(&r->cond);
+	for(l = r->listeners; l != NULL; l = l->next)
+		if(l->wake != NULL)
+			l->wake(l->wake_data);
+}
+
+static void shoutcast_relay_write(struct shout_relay *r,
+				  const unsigned char *data, size_t len)
+{
+	size_t pos, count;
+
+	/* Lock relay access */
+	pthread_mutex_lock(&r->mutex);
+
+	/* Copy audio in ring buffer when some listeners are connected */
+	if(r->buffer != NULL)
+	{
+		/* Only last bytes are kept */
+		if(len > RELAY_SIZE)
+		{
+			r->pos += len - RELAY_SIZE;
+			data += len - RELAY_SIZE;
+			len = RELAY_SIZE;
+		}
+
+		/* Copy with wrap around */
+		pos = r->pos % RELAY_SIZE;
+		count = RELAY_SIZE - pos < len ? RELAY_SIZE - pos : len;
+		memcpy(r->buffer + pos, data, count);
+		memcpy(r->buffer, data + count, len - count);
+		r->pos += len;
+
+		/* Wake up listeners */
+		shoutcast_relay_wake(r);
+	}
+
+	/* Unlock relay access */
+	pthread_mutex_unlock(&r->mutex);
+}
+
+static void shoutcast_relay_set_title(struct shout_relay *r, const char *data,
+				      size_t size)
+{
+	size_t len;
+
+	/* Get metadata string length (field is padded with zeros) */
+	len = strnlen(data, size);
+	if(len == 0)
+		return;
+
+	/* Lock relay access */
+	pthread_mutex_lock(&r->mutex);
+
+	/* Update metadata when it changes */
+	if(len != r->title_len || memcmp(r->title, data, len) != 0)
+	{
+		memcpy(r->title, data, len);
+		r->title_len = len;
+		r->title_id++;
+	}
+
+	/* Unlock relay access */
+	pthread_mutex_unlock(&r->mutex);
+}
+
+static void shoutcast_relay_release(struct shout_relay *r)
+{
+	int refs;
+
+	/* Lock relay access */
+	pthread_mutex_lock(&r->mutex);
+
+	/* Free ring buffer with last reference */
+	refs = --r->refs;
+	if(refs == 0 && r->buffer != NULL)
+	{
+		free(r->buffer);
+		r->buffer = NULL;
+		budget_release(BUDGET_SHOUTCAST, RELAY_SIZE);
+	}
+
+	/* Unlock relay access */
+	pthread_mutex_unlock(&r->mutex);
+
+	/* Free relay */
+	if(refs == 0)
+	{
+		pthread_cond_destroy(&r->cond);
+		pthread_mutex_destroy(&r->mutex);
+		free(r);
+	}
+}
+
+static void shoutcast_relay_end(struct shout_relay *r)
+{
+	/* Lock relay access */
+	pthread_mutex_lock(&r->mutex);
+
+	/* Notify listeners of end of stream */
+	r->eos = 1;
+	shoutcast_relay_wake(r);
+
+	/* Unlock relay access */
+	pthread_mutex_unlock(&r->mutex);
+}
+
+static ssize_t shoutcast_http_read(struct shout_handle *h,
+				   unsigned char *buffer, size_t size,
+				   unsigned long timeout)
+{
+	ssize_t len;
+
+	/* Read live stream */
+	len = http_read_timeout(h->http, buffer, size, timeout);
+
+	/* Copy audio to relay */
+	if(len > 0)
+	{
+		metric_add(&shoutcast_metric_bytes, len);
+		shoutcast_demux(h, &h->relay->demux, buffer, len, h->relay);
+	}
+	else if(len < 0)
+	{
+		metric_inc(&shoutcast_metric_ends);
+		shoutcast_relay_end(h->relay);
+	}
+
+	return len;
+}
+
+struct shout_listener *shoutcast_listen(struct shout_handle *h, int metadata)
+{
+	struct shout_listener *l;
+	struct shout_relay *r;
+
+	if(h == NULL || h->relay == NULL)
+		return NULL;
+	r = h->relay;
+
+	/* Allocate listener */
+	l = calloc(1, sizeof(struct shout_listener));
+	if(l == NULL)
+		return NULL;
+	l->metadata = metadata;
+	l->remaining = SHOUT_RELAY_METAINT;
+	l->title_id = ~0UL;
+
+	/* Lock relay access */
+	pthread_mutex_lock(&r->mutex);
+
+	/* First listener: allocate ring buffer */
+	if(r->buffer == NULL && !r->eos &&
+	   budget_reserve(BUDGET_SHOUTCAST, RELAY_SIZE) == 0)
+	{
+		r->buffer = malloc(RELAY_SIZE);
+		if(r->buffer == NULL)
+			budget_release(BUDGET_SHOUTCAST, RELAY_SIZE);
+		r->start = r->pos;
+	}
+	if(r->buffer == NULL)
+	{
+		/* Unlock relay access */
+		pthread_mutex_unlock(&r->mutex);
+		free(l);
+		return NULL;
+	}
+
+	/* Start with last received bytes */
+	l->pos = r->pos - r->start > RELAY_BURST ? r->pos - RELAY_BURST :
+						   r->start;
+	l->relay = r;
+	r->refs++;
+
+	/* Add to listener list */
+	l->next = r->listeners;
+	r->listeners = l;
+
+	/* Unlock relay access */
+	pthread_mutex_unlock(&r->mutex);
+
+	return l;
+}
+
+static void shoutcast_listen_meta(struct shout_listener *l)
+{
+	struct shout_relay *r = l->relay;
+	size_t size;
+
+	/* Send metadata only when it has changed */
+	l->meta_pos = 0;
+	if(l->title_id == r->title_id || r->title_len == 0)
+	{
+		l->meta[0] = 0;
+		l->meta_len = 1;
+		return;
+	}
+
+	/* Copy metadata padded with zeros */
+	size = (r->title_len + 15) / 16;
+	l->meta[0] = size;
+	memcpy(l->meta + 1, r->title, r->title_len);
+	memset(l->meta + 1 + r->title_len, 0, (size * 16) - r->title_len);
+	l->meta_len = 1 + (size * 16);
+	l->title_id = r->title_id;
+}
+
+ssize_t shoutcast_listen_read(struct shout_listener *l, unsigned char *buffer,
+			      size_t size, unsigned long timeout)
+{
+	struct shout_relay *r = l->relay;
+	struct timespec ts;
+	size_t len = 0, count, pos;
+	unsigned long long avail;
+
+	/* Lock relay access */
+	pthread_mutex_lock(&r->mutex);
+
+	/* Wait for new data */
+	if(timeout > 0 && l->meta_pos == l->meta_len && l->pos == r->pos &&
+	   !r->eos)
+	{
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += timeout / 1000;
+		ts.tv_nsec += (timeout % 1000) * 1000000;
+		if(ts.tv_nsec >= 1000000000)
+		{
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		while(l->pos == r->pos && !r->eos &&
+		      pthread_cond_timedwait(&r->cond, &r->mutex, &ts) == 0);
+	}
+
+	/* Listener is too late: go back near live */
+	if(r->pos - l->pos > RELAY_SIZE)
+		l->pos = r->pos - RELAY_BURST;
+
+	/* Fill buffer with audio and metadata */
+	while(len < size)
+	{
+		/* Send metadata field */
+		if(l->meta_pos < l->meta_len)
+		{
+			count = l->meta_len - l->meta_pos;
+			if(count > size - len)
+				count = size - len;
+			memcpy(buffer + len, l->meta + l->meta_pos, count);
+			l->meta_pos += count;
+			len += count;
+			continue;
+		}
+
+		/* Metadata field reached */
+		if(l->metadata && l->remaining == 0)
+		{
+			shoutcast_listen_meta(l);
+			l->remaining = SHOUT_RELAY_METAINT;
+			continue;
+		}
+
+		/* Get available audio */
+		avail = r->pos - l->pos;
+		if(avail == 0 || r->buffer == NULL)
+			break;
+		count = size - len;
+		if(count > avail)
+			count = avail;
+		if(l->metadata && count > l->remaining)
+			count = l->remaining;
+
+		/* Copy audio with wrap around */
+		pos = l->pos % RELAY_SIZE;
+		if(count > RELAY_SIZE - pos)
+			count = RELAY_SIZE - pos;
+		memcpy(buffer + len, r->buffer + pos, count);
+		l->pos += count;
+		l->remaining -= count;
+		len += count;
+	}
+
+	/* End of stream */
+	if(len == 0 && r->eos)
+		len = -1;
+
+	/* Unlock relay access */
+	pthread_mutex_unlock(&r->mutex);
+
+	return len;
+}
+
+void shoutcast_listen_set_wake(struct shout_listener *l, shout_wake_cb cb,
+			       void *user_data)
+{
+	struct shout_relay *r;
+
+	if(l == NULL)
+		return;
+	r = l->relay;
+
+	/* Lock relay access */
+	pthread_mutex_lock(&r->mutex);
+
+	/* Set callback */
+	l->wake = cb;
+	l->wake_data = user_data;
+
+	/* Unlock relay access */
+	pthread_mutex_unlock(&r->mutex);
+}
+
+void shoutcast_unlisten(struct shout_listener *l)
+{
+	struct shout_listener **lp;
+	struct shout_relay *r;
+
+	if(l == NULL)
+		return;
+	r = l->relay;
+
+	/* Lock relay access */
+	pthread_mutex_lock(&r->mutex);
+
+	/* Remove from listener list: callback is not called anymore */
+	for(lp = &r->listeners; *lp != NULL; lp = &(*lp)->next)
+	{
+		if(*lp == l)
+		{
+			*lp = l->next;
+			break;
+		}
+	}
+
+	/* Free ring buffer when last listener leaves */
+	if(r->listeners == NULL && r->buffer != NULL)
+	{
+		free(r->buffer);
+		r->buffer = NULL;
+		budget_release(BUDGET_SHOUTCAST, RELAY_SIZE);
+	}
+
+	/* Unlock relay access */
+	pthread_mutex_unlock(&r->mutex);
+
+	/* Release relay */
+	shoutcast_relay_release(r);
+	free(l);
+}
+
 int shoutcast_close(struct shout_handle *h)
 {
 	struct shout_data *m;
@@ -819,9 +1701,20 @@ int shoutcast_close(struct shout_handle *h)
 	if(h->use_thread)
 	{
 		h->stop = 1;
-		pthread_join(h->thread, NULL);
+		vring_wake(h->ring);
+		if(h->task != NULL)
+		{
+			task_wake(h->task);
+			task_join(h->task);
+		}
+		else
+			pthread_join(h->thread, NULL);
 	}
 
+	/* Stop standby thread */
+	if(h->is_standby)
+		shoutcast_join_standby(h);
+
 	/* Close decoder */
 	if(h->dec != NULL)
 		decoder_close(h->dec);
@@ -839,23 +1732,17 @@ int shoutcast_close(struct shout_handle *h)
 	{
 		m = h->metas;
 		h->metas = m->next;
-		free(m);
+		pool_free(m);
 	}
-	if(h->meta != NULL)
-		free(h->meta);
 
 	/* Free pause buffer */
-	while(h->pauses != NULL)
-	{
-		m = h->pauses;
-		h->pauses = m->next;
-		free(m);
-	}
-	while(h->pool != NULL)
+	shoutcast_pause_free(h);
+
+	/* End relay for listeners */
+	if(h->relay != NULL)
 	{
-		m = h->pool;
-		h->pool = m->next;
-		free(m);
+		shoutcast_relay_end(h->relay);
+		shoutcast_relay_release(h->relay);
 	}
 
 	/* Free handler */
@@ -868,39 +1755,45 @@ static ssize_t shoutcast_read_stream(struct shout_handle *h,
 				     unsigned char *buffer, size_t size,
 				     unsigned long timeout, int skip)
 {
-	struct shout_data *b, *b2;
+	struct shout_chunk *c;
 	ssize_t len;
-	size_t pos;
 	size_t r_len = 0;
 	int eos = 0;
 
 	/* No pause has been performed */
-	if(buffer != NULL && h->pauses == NULL && h->pool == NULL)
-		return http_read_timeout(h->http, buffer, size, timeout);
+	if(buffer != NULL && h->pauses == NULL)
+		return shoutcast_http_read(h, buffer, size, timeout);
 
 	/* Fill pause buffer */
-	do {
-		/* Skipping: do not retrieve data from HTTP stream */
-		if(skip)
-			break;
-
-		/* No block is ready for filling */
-		if(h->pool == NULL)
+	while(!skip)
+	{
+		/* Last chunk is full: add a new one */
+		if(h->pauses_last == NULL || h->pause_write == CHUNK_SIZE)
 		{
-			/* Allocate a block */
-			h->pool = malloc(sizeof(struct shout_data)+BLOCK_SIZE);
-			if(h->pool == NULL)
+			c = shoutcast_chunk_alloc(h);
+			if(c == NULL)
 				break;
-			h->pool->remaining = BLOCK_SIZE;
-			h->pool->next = NULL;
-			h->pool_last = h->pool;
+
+			/* Previous chunk is not written anymore */
+			if(h->pauses_last != NULL)
+			{
+				if(h->pauses_last != h->pauses)
+					shoutcast_chunk_unmap(h->pauses_last);
+				h->pauses_last->next = c;
+			}
+			else
+			{
+				h->pauses = c;
+				h->pause_read = 0;
+			}
+			h->pauses_last = c;
+			h->pause_write = 0;
 		}
 
 		/* Get data from HTTP stream */
-		pos = BLOCK_SIZE - h->pool->remaining;
-		len = http_read_timeout(h->http,
-					(unsigned char*) h->pool->data + pos,
-					h->pool->remaining, 0);
+		c = h->pauses_last;
+		len = shoutcast_http_read(h, c->data + h->pause_write,
+					  CHUNK_SIZE - h->pause_write, 0);
 		if(len <= 0)
 		{
 			/* Sleep the timeout */
@@ -912,139 +1805,249 @@ static ssize_t shoutcast_read_stream(struct shout_handle *h,
 			break;
 		}
 
-		/* Update remaining space in block */
-		h->pool->remaining -= len;
-		if(h->pool->remaining == 0)
-		{
-			/* Remove block from pool */
-			b = h->pool;
-			h->pool = b->next;
-			if(h->pool == NULL)
-				h->pool_last = NULL;
-
-			/* Add block to buffer pause */
-			if(h->pauses_last != NULL)
-				h->pauses_last->next = b;
-			else
-				h->pauses = b;
-			h->pauses_last = b;
-			b->remaining = BLOCK_SIZE;
-			b->next = NULL;
-			h->pause_count++;
-		}
-	} while(h->pool != NULL);
+		/* Update pause buffer */
+		h->pause_write += len;
+		h->pause_size += len;
+	}
 
 	/* Stream is paused: do not return data */
 	if(buffer == NULL)
 		return eos;
 
-	/* Skipping: flush pool */
-	if(skip && h->pool != NULL)
+	/* Get data from pause buffer */
+	while(h->pause_size > 0 && size > 0)
 	{
-		/* Some data are remaining */
-		if(h->pool->remaining < BLOCK_SIZE)
-		{
-			/* Remove from pool */
-			b = h->pool;
-			h->pool = b->next;
-			if(h->pool == NULL)
-				h->pool_last = NULL;
+		/* Map first chunk for reading */
+		c = h->pauses;
+		if(shoutcast_chunk_map(h, c) != 0)
+			break;
 
-			/* Add to pause buffer */
-			if(h->pauses_last != NULL)
-				h->pauses_last->next = b;
-			else
-				h->pauses = b;
-			h->pauses_last = b;
-
-			/* Move data to end of block */
-			len = BLOCK_SIZE - b->remaining;
-			memmove(b->data + b->remaining, b->data, len);
-			b->remaining = len;
-			b->next = NULL;
-			h->pause_count++;
-		}
+		/* Copy data from pause buffer */
+		len = (c == h->pauses_last ? h->pause_write : CHUNK_SIZE) -
+		      h->pause_read;
+		if((size_t) len > size)
+			len = size;
+		memcpy(buffer + r_len, c->data + h->pause_read, len);
+
+		/* Update pause buffer */
+		h->pause_read += len;
+		h->pause_size -= len;
+		r_len += len;
+		size -= len;
 
-		/* Free all other blocks in pool */
-		while(h->pool != NULL)
+		/* Chunk is read: get next */
+		if(h->pause_read == CHUNK_SIZE)
 		{
-			b = h->pool;
-			h->pool = b->next;
-			free(b);
+			h->pauses = c->next;
+			if(h->pauses == NULL)
+				h->pauses_last = NULL;
+			h->pause_read = 0;
+			shoutcast_chunk_free(h, c);
 		}
-		h->pool_last = NULL;
 	}
 
-	/* Get data from pause buffer */
-	while(h->pauses != NULL && size > 0)
+	/* Skipping: pause buffer is empty, stream is read directly again */
+	if(skip && h->pause_size == 0)
+		shoutcast_pause_free(h);
+
+	/* End of stream */
+	if(eos && r_len == 0)
+		return -1;
+
+	return r_len;
+}
+
+static void shoutcast_add_meta(struct shout_handle *h, const char *data,
+			       size_t size)
+{
+	struct shout_data *m;
+	size_t len;
+
+	/* Get metadata string length (field is padded with zeros) */
+	len = data != NULL ? strnlen(data, size) : 0;
+
+	/* Lock meta string access */
+	pthread_mutex_lock(&h->meta_mutex);
+
+	/* Empty or same metadata: update bytes before next metadata */
+	if(h->metas_last != NULL && (len == 0 ||
+	   (strncmp(h->metas_last->data, data, len) == 0 &&
+	    h->metas_last->data[len] == '\0')))
 	{
-		/* Copy data from pause buffer */
-		b = h->pauses;
-		pos = BLOCK_SIZE - b->remaining;
-		len = size > b->remaining ? b->remaining : size;
-		memcpy(buffer + r_len, b->data + pos, len);
+		h->metas_last->remaining += h->metaint;
+		goto end;
+	}
+	if(len == 0)
+		goto end;
+
+	/* Metadata has changed: add a copy in cache */
+	m = pool_alloc(sizeof(struct shout_data) + len + 1);
+	if(m == NULL)
+		goto end;
+	memcpy(m->data, data, len);
+	m->data[len] = '\0';
+	m->remaining = h->metaint;
+	m->next = NULL;
+	if(h->metas_last != NULL)
+		h->metas_last->next = m;
+	else
+		h->metas = m;
+	h->metas_last = m;
 
-		/* Update block values */
-		b->remaining -= len;
-		r_len += len;
-		size -= len;
+end:
+	/* Unlock meta string access */
+	pthread_mutex_unlock(&h->meta_mutex);
+}
 
-		/* Block is empty: get next */
-		if(b->remaining == 0)
+static size_t shoutcast_demux(struct shout_handle *h, struct shout_demux *d,
+			      unsigned char *buffer, size_t len,
+			      struct shout_relay *r)
+{
+	unsigned char *in = buffer;
+	unsigned char *out = buffer;
+	unsigned char *end = buffer + len;
+	const char *meta;
+	size_t count;
+
+	/* No meta data */
+	if(h->metaint == 0)
+	{
+		if(r != NULL)
+			shoutcast_relay_write(r, buffer, len);
+		return len;
+	}
+
+	/* Process whole received span: audio parts are packed at start of
+	 * buffer (or copied to relay) and metadata are parsed in place
+	 */
+	while(in < end)
+	{
+		switch(d->state)
 		{
-			/* Remove block from pause buffer */
-			h->pauses = b->next;
-			if(h->pauses == NULL)
-				h->pauses_last = NULL;
+			case SHOUT_DATA:
+				/* Move audio until next metadata field */
+				count = end - in;
+				if(count > d->remaining)
+					count = d->remaining;
+				if(r != NULL)
+					shoutcast_relay_write(r, in, count);
+				else if(out != in)
+					memmove(out, in, count);
+				out += count;
+				in += count;
 
-			/* Update block and set to pause block */
-			b->remaining = BLOCK_SIZE;
-			b->next = NULL;
-			if(!skip)
-			{
-				/* Add block to pool */
-				if(h->pool_last != NULL)
-					h->pool_last->next = b;
-				else
-					h->pool = b;
-				h->pool_last = b;
-			}
-			else
-				free(b);
-			h->pause_count--;
+				/* Meta data field reached */
+				d->remaining -= count;
+				if(d->remaining == 0)
+					d->state = SHOUT_META_LEN;
+				break;
+			case SHOUT_META_LEN:
+				/* Set meta data size */
+				d->meta_size = *in++ * 16;
+				d->meta_len = 0;
+				if(d->meta_size > 0)
+				{
+					d->state = SHOUT_META_DATA;
+					break;
+				}
 
-			/* Check pool size */
-			if(h->last_pool_check + CHECK_POOL <= time(NULL) &&
-			   !skip)
-			{
-				/* Update last check pool timer */
-				h->last_pool_check = time(NULL);
+				/* No meta data change */
+				if(r == NULL)
+					shoutcast_add_meta(h, NULL, 0);
+				d->remaining = h->metaint;
+				d->state = SHOUT_DATA;
+				break;
+			case SHOUT_META_DATA:
+				/* Get meta data field in span or copy its
+				 * parts when it is split
+				 */
+				count = end - in;
+				if(count > (size_t) (d->meta_size - d->meta_len))
+					count = d->meta_size - d->meta_len;
+				if(d->meta_len == 0 &&
+				   count == (size_t) d->meta_size)
+					meta = (const char *) in;
+				else
+				{
+					memcpy(d->meta_buf + d->meta_len, in,
+					       count);
+					meta = d->meta_buf;
+				}
+				d->meta_len += count;
+				in += count;
 
-				/* Free all blocks which are useless */
-				if(h->pool != NULL && h->pool->next != NULL)
+				/* Meta data field end */
+				if(d->meta_len == d->meta_size)
 				{
-					/* Keep only two block */
-					b = h->pool->next->next;
-					h->pool_last = h->pool->next;
-					h->pool_last->next = NULL;
-
-					/* Free all blocks */
-					while(b != NULL)
-					{
-						b2 = b;
-						b = b->next;
-						free(b2);
-					}
+					if(r != NULL)
+						shoutcast_relay_set_title(r,
+								meta,
+								d->meta_size);
+					else
+						shoutcast_add_meta(h, meta,
+								d->meta_size);
+					d->remaining = h->metaint;
+					d->state = SHOUT_DATA;
 				}
-			}
+				break;
 		}
 	}
 
-	/* End of stream */
-	if(eos && r_len == 0)
-		return -1;
+	return out - buffer;
+}
 
-	return r_len;
+static void shoutcast_set_ready(struct shout_handle *h, int skip)
+{
+	/* Lock event access */
+	pthread_mutex_lock(&h->mutex);
+
+	/* Notify cache is ready */
+	if(h->event_cb != NULL)
+		h->event_cb(h->event_udata, SHOUT_EVENT_READY, NULL);
+
+	/* Unlock event access */
+	pthread_mutex_unlock(&h->mutex);
+
+	/* Update cache status */
+	h->is_ready = 1;
+	h->is_filling = 0;
+	if(skip)
+		h->resync = 1;
+}
+
+static int shoutcast_can_start(struct shout_handle *h)
+{
+	unsigned long long rate, byterate;
+	struct timeval now;
+	unsigned long elapsed;
+	size_t len, mark;
+
+	/* Get stream byterate */
+	byterate = (h->info.bitrate > 0 ? h->info.bitrate : DEFAULT_BITRATE) *
+		   1000 / 8;
+
+	/* Get download rate since buffering start */
+	gettimeofday(&now, NULL);
+	elapsed = ((now.tv_sec - h->start_fill.tv_sec) * 1000) +
+		  ((now.tv_usec - h->start_fill.tv_usec) / 1000);
+	if(elapsed == 0)
+		elapsed = 1;
+	len = vring_get_length(h->ring);
+	rate = len > h->start_len ? (len - h->start_len) * 1000ULL / elapsed : 0;
+	rate = rate * FAST_START_MARGIN / 100;
+
+	/* Low watermark: while the cache is filled at download rate, playback
+	 * must not consume it before it is full. A link faster than realtime
+	 * only needs the minimum length.
+	 */
+	mark = byterate * FAST_START_LEN / 1000;
+	if(mark < FAST_START_MIN_SIZE)
+		mark = FAST_START_MIN_SIZE;
+	if(rate < byterate &&
+	   h->cache_size - h->cache_size * rate / byterate > mark)
+		mark = h->cache_size - h->cache_size * rate / byterate;
+
+	return len >= mark;
 }
 
 static ssize_t shoutcast_fill_buffer(struct shout_handle *h,
@@ -1082,6 +2085,14 @@ static ssize_t shoutcast_fill_buffer(struct shout_handle *h,
 		return 0;
 	}
 
+	/* Start measure of download rate while buffering */
+	if(!h->is_ready && !h->is_filling)
+	{
+		gettimeofday(&h->start_fill, NULL);
+		h->start_len = vring_get_length(h->ring);
+		h->is_filling = 1;
+	}
+
 	/* Unlock pause buffer access */
 	pthread_mutex_unlock(&h->pause_mutex);
 
@@ -1110,35 +2121,29 @@ static ssize_t shoutcast_fill_buffer(struct shout_handle *h,
 			/* Lock pause buffer access */
 			pthread_mutex_lock(&h->pause_mutex);
 
-			/* Cache is full */
-			if(size == 0 && h->is_ready == 0 && !h->is_paused)
+			/* Standby: drop oldest data to keep only live audio */
+			if(size == 0 && h->is_standby)
 			{
-				/* Lock event access */
-				pthread_mutex_lock(&h->mutex);
-
-				/* Notify cache is ready */
-				if(h->event_cb != NULL)
-					h->event_cb(h->event_udata,
-						    SHOUT_EVENT_READY, NULL);
+				shoutcast_forward_buffer(h, STANDBY_DROP_SIZE);
 
-				/* Unlock event access */
-				pthread_mutex_unlock(&h->mutex);
-
-				/* Update cache status */
-				h->is_ready = 1;
-				if(skip)
-					h->resync = 1;
+				/* Unlock pause buffer access */
+				pthread_mutex_unlock(&h->pause_mutex);
+				break;
 			}
 
+			/* Cache is full */
+			if(size == 0 && h->is_ready == 0 && !h->is_paused)
+				shoutcast_set_ready(h, skip);
+
 			/* Unlock pause buffer access */
 			pthread_mutex_unlock(&h->pause_mutex);
 
-			/* Wait timeout */
-			usleep(timeout*1000);
+			/* Wait until reader frees some space or timeout */
+			if(timeout > 0)
+				vring_wait_writable(h->ring, MAX_RW_SIZE,
+						    timeout);
 			break;
 		}
-		else if(h->remaining > 0 && size > h->remaining)
-			size = h->remaining;
 
 		/* Read data from HTTP stream */
 		len = shoutcast_read_stream(h, buffer, size, timeout, skip);
@@ -1164,102 +2169,21 @@ static ssize_t shoutcast_fill_buffer(struct shout_handle *h,
 			break;
 		}
 
-		/* No meta data */
-		if(h->metaint == 0)
-			continue;
-
-		/* Update remaining length */
-		h->remaining -= len;
-
-		/* Process data */
-		switch(h->state)
-		{
-			case SHOUT_DATA:
-				/* Meta data field reached */
-				if(h->remaining == 0)
-				{
-					h->remaining = 1;
-					h->state = SHOUT_META_LEN;
-				}
-
-				/* Forward in ring buffer */
-				vring_write_forward(h->ring, len);
-				break;
-			case SHOUT_META_LEN:
-				/* Set meta data size */
-				h->meta_size = buffer[0] * 16;
-				h->meta_len = 0;
-
-				/* Lock meta string access */
-				pthread_mutex_lock(&h->meta_mutex);
-
-				if(h->meta_size > 0)
-				{
-					h->remaining = h->meta_size;
-					h->state = SHOUT_META_DATA;
-
-					/* Allocate a new meta */
-					h->meta = calloc(1,
-						     sizeof(struct shout_data) +
-						     h->meta_size);
-				}
-				else
-				{
-					h->remaining = h->metaint;
-					h->state = SHOUT_DATA;
-
-					/* Update bytes before next metadata */
-					if(h->metas_last != NULL)
-						h->metas_last->remaining +=
-								     h->metaint;
-				}
+		/* Remove metadata and forward audio in ring buffer */
+		len = shoutcast_demux(h, &h->demux, buffer, len, NULL);
+		if(len > 0)
+			vring_write_forward(h->ring, len);
 
-				/* Unlock meta string access */
-				pthread_mutex_unlock(&h->meta_mutex);
-
-				break;
-			case SHOUT_META_DATA:
-				/* Lock meta string access */
-				pthread_mutex_lock(&h->meta_mutex);
-
-				/* Copy data to metadata */
-				if(h->meta != NULL)
-					memcpy(h->meta->data+h->meta_len, 
-					       buffer, len);
-				h->meta_len += len;
-
-				/* Meta data field end */
-				if(h->remaining == 0)
-				{
-					h->remaining = h->metaint;
-					h->state = SHOUT_DATA;
-
-					/* Bad metadata */
-					if(h->meta == NULL)
-					{
-						/* Unlock meta string access */
-						pthread_mutex_unlock(
-								&h->meta_mutex);
-						break;
-					}
-
-					/* Update remaining bytes */
-					h->meta->remaining = h->metaint;
-
-					/* Add meta to cache */
-					if(h->metas_last != NULL)
-						h->metas_last->next = h->meta;
-					else
-						h->metas = h->meta;
-					h->metas_last = h->meta;
-					h->meta = NULL;
-				}
+		/* Lock pause buffer access */
+		pthread_mutex_lock(&h->pause_mutex);
 
-				/* Unlock meta string access */
-				pthread_mutex_unlock(&h->meta_mutex);
+		/* Enough data is buffered to play without underrun */
+		if(h->fast_start && h->is_ready == 0 && !h->is_paused &&
+		   shoutcast_can_start(h))
+			shoutcast_set_ready(h, skip);
 
-				break;
-		}
+		/* Unlock pause buffer access */
+		pthread_mutex_unlock(&h->pause_mutex);
 	} while(!h->is_ready);
 
 	return vring_get_length(h->ring);
@@ -1272,13 +2196,13 @@ static ssize_t shoutcast_get_buffer(struct shout_handle *h,
 
 	/* Get data from ring buffer */
 	len = vring_read(h->ring, buffer, 0, 0);
-	if(len > 0 && len <= MIN_CACHE_LEN)
+	if(len >= 0 && len <= MIN_CACHE_LEN)
 	{
 		/* Lock event access */
 		pthread_mutex_lock(&h->mutex);
 
-		/* Notify cache is empty */
-		if(h->event_cb != NULL && h->is_ready == 1)
+		/* Notify cache is empty (underrun during playback) */
+		if(h->event_cb != NULL && h->is_ready == 1 && !h->stop)
 			h->event_cb(h->event_udata, SHOUT_EVENT_BUFFERING,
 				    NULL);
 
@@ -1317,7 +2241,7 @@ static ssize_t shoutcast_forward_buffer(struct shout_handle *h, size_t size)
 		/* Get next metadata in cache */
 		m = h->metas;
 		h->metas = m->next;
-		free(m);
+		pool_free(m);
 
 		/* Lock event access */
 		pthread_mutex_lock(&h->mutex);
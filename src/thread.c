@@ -0,0 +1,329 @@
+/*
+ * thread.c - Scheduling, CPU affinity and names of threads
+ *
+ * Copyright (c) 2014   A. Dilly
+ *
+ * AirCat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * AirCat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with AirCat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "thread.h"
+
+/* Maximum length of a thread name (without final '\0') */
+#define THREAD_NAME_SIZE 15
+
+struct thread_config {
+	int policy;
+	int priority;
+	/* CPU list as given in configuration and parsed mask */
+	char *cpus;
+	cpu_set_t mask;
+	/* Failure has already been reported */
+	int warned;
+};
+
+static const char *thread_names[THREAD_CLASS_COUNT] = {
+	[THREAD_OUTPUT] = "output",
+	[THREAD_CACHE] = "cache",
+	[THREAD_DEMUX] = "demux",
+	[THREAD_RTSP] = "rtsp",
+	[THREAD_DEFAULT] = "default",
+};
+
+static const struct {
+	const char *name;
+	int policy;
+} thread_policies[] = {
+	{"other", SCHED_OTHER},
+	{"fifo", SCHED_FIFO},
+	{"rr", SCHED_RR},
+	{NULL, 0}
+};
+
+static struct thread_config thread_configs[THREAD_CLASS_COUNT];
+static int thread_lock_memory = 0;
+/* CPUs of process at first configuration: a new thread inherits settings of
+ * its creator, so threads without CPU list are given back all CPUs */
+static cpu_set_t thread_all_cpus;
+static int thread_has_all_cpus = 0;
+static pthread_mutex_t thread_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void thread_warn(struct thread_config *c, const char *class,
+			const char *what, int err)
+{
+	/* Report only first failure of a class */
+	if(c->warned)
+		return;
+	c->warned = 1;
+
+	fprintf(stderr, "[thread] can't set %s of %s threads: %s\n", what,
+		class, strerror(err));
+}
+
+void thread_setup(enum thread_class class, const char *name)
+{
+	struct sched_param param;
+	struct thread_config *c;
+	char str[THREAD_NAME_SIZE + 1];
+	int policy;
+	int ret;
+
+	if(class >= THREAD_CLASS_COUNT)
+		class = THREAD_DEFAULT;
+
+	/* Set thread name */
+	if(name != NULL)
+	{
+		strncpy(str, name, THREAD_NAME_SIZE);
+		str[THREAD_NAME_SIZE] = '\0';
+#ifdef HAVE_PTHREAD_SETNAME_NP
+		pthread_setname_np(pthread_self(), str);
+#endif
+	}
+
+	/* Lock configuration */
+	pthread_mutex_lock(&thread_mutex);
+	c = &thread_configs[class];
+
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+	/* Set CPU affinity */
+	if(c->cpus != NULL)
+	{
+		ret = pthread_setaffinity_np(pthread_self(), sizeof(c->mask),
+					     &c->mask);
+		if(ret != 0)
+			thread_warn(c, thread_names[class], "CPU affinity",
+				    ret);
+	}
+	else if(thread_has_all_cpus)
+		pthread_setaffinity_np(pthread_self(), sizeof(thread_all_cpus),
+				       &thread_all_cpus);
+#endif
+
+	/* Set scheduling policy and priority (a thread created by a realtime
+	 * thread is realtime too) */
+	if(pthread_getschedparam(pthread_self(), &policy, &param) != 0 ||
+	   policy != c->policy || param.sched_priority != c->priority)
+	{
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = c->priority;
+		ret = pthread_setschedparam(pthread_self(), c->policy, &param);
+		if(ret != 0)
+			thread_warn(c, thread_names[class],
+				    "realtime priority", ret);
+	}
+
+	/* Unlock configuration */
+	pthread_mutex_unlock(&thread_mutex);
+}
+
+static int thread_parse_cpus(const char *str, cpu_set_t *mask)
+{
+	unsigned long first, last;
+	char *end;
+
+	CPU_ZERO(mask);
+
+	/* Parse a list of CPUs and ranges: "0,2-3" */
+	while(*str != '\0')
+	{
+		/* Get first CPU */
+		first = strtoul(str, &end, 10);
+		if(end == str)
+			return -1;
+		last = first;
+
+		/* Get last CPU of range */
+		if(*end == '-')
+		{
+			str = end + 1;
+			last = strtoul(str, &end, 10);
+			if(end == str || last < first)
+				return -1;
+		}
+		if(last >= CPU_SETSIZE)
+			return -1;
+
+		/* Add CPUs */
+		for(; first <= last; first++)
+			CPU_SET(first, mask);
+
+		/* Go to next item */
+		if(*end == ',')
+			end++;
+		else if(*end != '\0')
+			return -1;
+		str = end;
+	}
+
+	return CPU_COUNT(mask) > 0 ? 0 : -1;
+}
+
+static void thread_set_class(struct thread_config *c, const char *class,
+			     struct json *cfg)
+{
+	const char *str;
+	int min, max;
+	int i;
+
+	/* Reset to default settings */
+	c->policy = SCHED_OTHER;
+	c->priority = 0;
+	if(c->cpus != NULL)
+		free(c->cpus);
+	c->cpus = NULL;
+	c->warned = 0;
+	if(cfg == NULL)
+		return;
+
+	/* Get policy */
+	str = json_get_string(cfg, "policy");
+	for(i = 0; str != NULL && thread_policies[i].name != NULL; i++)
+	{
+		if(strcmp(thread_policies[i].name, str) == 0)
+		{
+			c->policy = thread_policies[i].policy;
+			break;
+		}
+	}
+
+	/* Get realtime priority */
+	if(c->policy != SCHED_OTHER)
+	{
+		min = sched_get_priority_min(c->policy);
+		max = sched_get_priority_max(c->policy);
+		c->priority = json_get_int(cfg, "priority");
+		if(c->priority < min)
+			c->priority = min;
+		else if(c->priority > max)
+			c->priority = max;
+	}
+
+	/* Get CPU list */
+	str = json_get_string(cfg, "cpus");
+	if(str != NULL && *str != '\0')
+	{
+		if(thread_parse_cpus(str, &c->mask) == 0)
+			c->cpus = strdup(str);
+		else
+			fprintf(stderr, "[thread] bad CPU list for %s threads: "
+				"%s\n", class, str);
+	}
+}
+
+int thread_set_config(struct json *cfg)
+{
+	int lock;
+	int i;
+
+	/* Lock configuration */
+	pthread_mutex_lock(&thread_mutex);
+
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+	/* Get CPUs of process */
+	if(!thread_has_all_cpus &&
+	   pthread_getaffinity_np(pthread_self(), sizeof(thread_all_cpus),
+				  &thread_all_cpus) == 0)
+		thread_has_all_cpus = 1;
+#endif
+
+	/* Set settings of each class (default when cfg is NULL) */
+	for(i = 0; i < THREAD_CLASS_COUNT; i++)
+		thread_set_class(&thread_configs[i], thread_names[i],
+				 json_get(cfg, thread_names[i]));
+
+	/* Lock or unlock memory: pages are locked once they have been touched
+	 * when supported, so the reserved but unused part of thread stacks does
+	 * not take RAM */
+	lock = cfg != NULL ? json_get_bool(cfg, "lock_memory") : 0;
+	if(lock && !thread_lock_memory)
+	{
+#ifdef MCL_ONFAULT
+		if(mlockall(MCL_CURRENT | MCL_FUTURE | MCL_ONFAULT) != 0 &&
+		   mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+#else
+		if(mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+#endif
+		{
+			fprintf(stderr, "[thread] can't lock memory: %s\n",
+				strerror(errno));
+			lock = 0;
+		}
+	}
+	else if(!lock && thread_lock_memory)
+		munlockall();
+	thread_lock_memory = lock;
+
+	/* Unlock configuration */
+	pthread_mutex_unlock(&thread_mutex);
+
+	return 0;
+}
+
+struct json *thread_get_config(void)
+{
+	struct thread_config *c;
+	struct json *cfg, *tmp;
+	int i, j;
+
+	/* Create a new object */
+	cfg = json_new();
+	if(cfg == NULL)
+		return NULL;
+
+	/* Lock configuration */
+	pthread_mutex_lock(&thread_mutex);
+
+	/* Set memory lock */
+	json_set_bool(cfg, "lock_memory", thread_lock_memory);
+
+	/* Set settings of each class */
+	for(i = 0; i < THREAD_CLASS_COUNT; i++)
+	{
+		tmp = json_new();
+		if(tmp == NULL)
+			continue;
+		c = &thread_configs[i];
+
+		/* Set policy */
+		for(j = 0; thread_policies[j].name != NULL; j++)
+			if(thread_policies[j].policy == c->policy)
+				break;
+		json_set_string(tmp, "policy", thread_policies[j].name);
+
+		/* Set priority and CPU list */
+		json_set_int(tmp, "priority", c->priority);
+		json_set_string(tmp, "cpus", (c->cpus != NULL ? c->cpus : ""));
+		json_add(cfg, thread_names[i], tmp);
+	}
+
+	/* Unlock configuration */
+	pthread_mutex_unlock(&thread_mutex);
+
+	return cfg;
+}
@@ -19,12 +19,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <pthread.h>
 
 #include "timers.h"
 #include "utils.h"
+#include "thread.h"
+#include "lock.h"
 
 #define TIMER_ID_SIZE 10
+#define TIMERS_HEAP_SIZE 16
 
 struct timer_event {
 	/* Name */
@@ -34,9 +38,11 @@ struct timer_event {
 	/* Configuration */
 	enum timer_type type;
 	enum timer_day day;
-	time_t next_wakeup;
+	uint64_t next_wakeup;	/* in ms */
 	uint64_t time;
 	int enable;
+	/* Position in heap (-1 if not scheduled) */
+	long index;
 	/* Callback */
 	timer_event_cb cb;
 	void *user_data;
@@ -58,15 +64,25 @@ struct timer_handle {
 struct timers_handle {
 	/* Timer list */
 	struct timer_handle *timers;
+	/* Scheduled events sorted by next wake up (min-heap) */
+	struct timer_event **heap;
+	unsigned long heap_len;
+	unsigned long heap_size;
 	/* Event thread */
 	pthread_t thread;
 	pthread_cond_t cond;
 	int running;
 	int stop;
+	/* Event callback in progress (called without lock) */
+	struct timer_event *current;
+	pthread_cond_t done;
 	/* Mutex used for timers access */
 	pthread_mutex_t mutex;
 };
 
+/* Lock class of timers */
+LOCK_CLASS(timers_class, "timers");
+
 static void *timers_thread(void *user_data);
 
 int timers_open(struct timers_handle **handle)
@@ -81,11 +97,16 @@ int timers_open(struct timers_handle **handle)
 
 	/* Init handle */
 	h->timers = NULL;
+	h->heap = NULL;
+	h->heap_len = 0;
+	h->heap_size = 0;
 	h->running = 0;
 	h->stop = 0;
+	h->current = NULL;
 
 	/* Init thread mutex and condition */
 	pthread_cond_init(&h->cond, NULL);
+	pthread_cond_init(&h->done, NULL);
 	pthread_mutex_init(&h->mutex, NULL);
 
 	return 0;
@@ -114,8 +135,10 @@ int timers_stop(struct timers_handle *h)
 		return -1;
 
 	/* Send signal to stop thread */
+	lock_mutex(timers_class, &h->mutex);
 	h->stop = 1;
 	pthread_cond_signal(&h->cond);
+	unlock_mutex(timers_class, &h->mutex);
 
 	/* Wait end of thread */
 	pthread_join(h->thread, NULL);
@@ -125,6 +148,15 @@ int timers_stop(struct timers_handle *h)
 	return 0;
 }
 
+static inline uint64_t timers_now(void)
+{
+	struct timespec ts;
+
+	/* Get current date in ms */
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 static inline time_t timers_calc_next_time(struct timer_event *e)
 {
 	enum timer_day day;
@@ -146,7 +178,7 @@ static inline time_t timers_calc_next_time(struct timer_event *e)
 
 	/* Add time before next day */
 	day = 1 << tm.tm_wday;
-	while(next < now || (e->day & day) == 0)
+	while(next <= now || (e->day & day) == 0)
 	{
 		next += 86400;
 		day = day == 64 ? 1 : day << 1;
@@ -162,75 +194,186 @@ static void timers_update_time(struct timer_event *e)
 	{
 		case TIMER_ONE_SHUT:
 		case TIMER_PERIODIC:
+			e->next_wakeup += e->time * 1000;
+			break;
+		case TIMER_DELAY:
 			e->next_wakeup += e->time;
 			break;
 		case TIMER_DATE:
-			e->next_wakeup = e->time;
+			e->next_wakeup = e->time * 1000;
 			break;
 		case TIMER_TIME:
-			e->next_wakeup = timers_calc_next_time(e);
+			e->next_wakeup = (uint64_t) timers_calc_next_time(e) *
+					 1000;
 			break;
 		default:
 			e->enable = 0;
 	}
 }
 
+static void timers_heap_swap(struct timers_handle *h, unsigned long a,
+			     unsigned long b)
+{
+	struct timer_event *e = h->heap[a];
+
+	h->heap[a] = h->heap[b];
+	h->heap[b] = e;
+	h->heap[a]->index = a;
+	h->heap[b]->index = b;
+}
+
+static void timers_heap_fix(struct timers_handle *h, unsigned long i)
+{
+	unsigned long c;
+
+	/* Move event up */
+	while(i > 0 &&
+	      h->heap[i]->next_wakeup < h->heap[(i-1)/2]->next_wakeup)
+	{
+		timers_heap_swap(h, i, (i-1)/2);
+		i = (i-1)/2;
+	}
+
+	/* Move event down */
+	while((c = 2 * i + 1) < h->heap_len)
+	{
+		if(c + 1 < h->heap_len &&
+		   h->heap[c+1]->next_wakeup < h->heap[c]->next_wakeup)
+			c++;
+		if(h->heap[i]->next_wakeup <= h->heap[c]->next_wakeup)
+			break;
+		timers_heap_swap(h, i, c);
+		i = c;
+	}
+}
+
+static int timers_schedule(struct timers_handle *h, struct timer_event *e)
+{
+	struct timer_event **heap;
+	unsigned long size;
+
+	/* Already scheduled: update position */
+	if(e->index >= 0)
+	{
+		timers_heap_fix(h, e->index);
+		return 0;
+	}
+
+	/* Grow heap */
+	if(h->heap_len == h->heap_size)
+	{
+		size = h->heap_size > 0 ? h->heap_size * 2 : TIMERS_HEAP_SIZE;
+		heap = realloc(h->heap, size * sizeof(struct timer_event *));
+		if(heap == NULL)
+			return -1;
+		h->heap = heap;
+		h->heap_size = size;
+	}
+
+	/* Add event at end and move it up */
+	e->index = h->heap_len;
+	h->heap[h->heap_len++] = e;
+	timers_heap_fix(h, e->index);
+
+	return 0;
+}
+
+static void timers_unschedule(struct timers_handle *h, struct timer_event *e)
+{
+	unsigned long i = e->index;
+
+	if(e->index < 0)
+		return;
+
+	/* Replace event by last one */
+	e->index = -1;
+	if(i != --h->heap_len)
+	{
+		h->heap[i] = h->heap[h->heap_len];
+		h->heap[i]->index = i;
+		timers_heap_fix(h, i);
+	}
+}
+
+static void timers_wait_event(struct timers_handle *h, struct timer_event *e)
+{
+	/* Event callback is in progress: wait its end (except from itself) */
+	while(h->current == e && !pthread_equal(pthread_self(), h->thread))
+		lock_cond_wait(timers_class, &h->done, &h->mutex);
+
+	/* Callback must not use event anymore */
+	if(h->current == e)
+		h->current = NULL;
+}
+
 static void *timers_thread(void *user_data)
 {
-	pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 	struct timers_handle *h = user_data;
-	struct timer_handle *t;
 	struct timer_event *e;
 	struct timespec ts;
-	time_t now;
+	timer_event_cb cb;
+	void *cb_data;
+	uint64_t now;
 
-	/* Lock condition */
-	pthread_mutex_lock(&mutex);
+	/* Set thread scheduling and name */
+	thread_setup(THREAD_DEFAULT, "timers");
+
+	/* Lock timers access */
+	lock_mutex(timers_class, &h->mutex);
 
 	/* Loop until stop signal */
 	while(!h->stop)
 	{
-		/* Get current time */
-		now = time(NULL);
-
-		/* Lock timers access */
-		pthread_mutex_lock(&h->mutex);
-
-		/* Process timers */
-		for(t = h->timers; t != NULL; t = t->next)
+		/* No event scheduled: wait a new one or stop signal */
+		if(h->heap_len == 0)
 		{
-			/* Process events */
-			for(e = t->events; e != NULL; e = e->next)
-			{
-				/* Check event */
-				if(e->enable && e->next_wakeup < now)
-				{
-					/* Do task */
-					e->cb(e->user_data);
-
-					/* Update event */
-					if(e->type == TIMER_ONE_SHUT ||
-					   e->type == TIMER_DATE)
-						e->enable = 0;
-					else
-						timers_update_time(e);
-				}
-			}
+			lock_cond_wait(timers_class, &h->cond, &h->mutex);
+			continue;
 		}
 
-		/* Unlock timers access */
-		pthread_mutex_unlock(&h->mutex);
+		/* Sleep until next event */
+		e = h->heap[0];
+		now = timers_now();
+		if(e->next_wakeup > now)
+		{
+			ts.tv_sec = e->next_wakeup / 1000;
+			ts.tv_nsec = (e->next_wakeup % 1000) * 1000000;
+			lock_cond_timedwait(timers_class, &h->cond, &h->mutex,
+					    &ts);
+			continue;
+		}
 
-		/* Prepare sleep: 1 minute */
-		ts.tv_sec = now + 60;
-		ts.tv_nsec = 0;
+		/* Update event before doing task */
+		if(e->type == TIMER_ONE_SHUT || e->type == TIMER_DATE ||
+		   e->type == TIMER_DELAY)
+		{
+			e->enable = 0;
+			timers_unschedule(h, e);
+		}
+		else
+		{
+			/* Don't try to catch up missed periods */
+			timers_update_time(e);
+			if(e->type == TIMER_PERIODIC && e->next_wakeup <= now)
+				e->next_wakeup = now + e->time * 1000;
+			timers_schedule(h, e);
+		}
 
-		/* Sleep or wait stop signal */
-		pthread_cond_timedwait(&h->cond, &mutex, &ts);
+		/* Do task without lock */
+		cb = e->cb;
+		cb_data = e->user_data;
+		h->current = e;
+		unlock_mutex(timers_class, &h->mutex);
+		cb(cb_data);
+		lock_mutex(timers_class, &h->mutex);
+
+		/* Task is done */
+		h->current = NULL;
+		pthread_cond_broadcast(&h->done);
 	}
 
-	/* Unlock condition */
-	pthread_mutex_unlock(&mutex);
+	/* Unlock timers access */
+	unlock_mutex(timers_class, &h->mutex);
 
 	return NULL;
 }
@@ -257,9 +400,12 @@ void timers_close(struct timers_handle *h)
 
 	/* Destroy mutex and cond */
 	pthread_cond_destroy(&h->cond);
+	pthread_cond_destroy(&h->done);
 	pthread_mutex_destroy(&h->mutex);
 
-	/* Free handle */
+	/* Free heap and handle */
+	if(h->heap != NULL)
+		free(h->heap);
 	free(h);
 }
 
@@ -280,14 +426,14 @@ int timer_open(struct timer_handle **handle, struct timers_handle *timers,
 	h->name = name != NULL ? strdup(name) : NULL;
 
 	/* Lock timers access*/
-	pthread_mutex_lock(&h->timers->mutex);
+	lock_mutex(timers_class, &h->timers->mutex);
 
 	/* Add to timer list */
 	h->next = timers->timers;
 	timers->timers = h;
 
 	/* Unlock timers access*/
-	pthread_mutex_unlock(&h->timers->mutex);
+	unlock_mutex(timers_class, &h->timers->mutex);
 
 	return 0;
 }
@@ -320,10 +466,11 @@ int timer_event_add(struct timer_handle *h, const char *name,
 	e->type = type;
 	e->time = value;
 	e->day = day;
-	e->next_wakeup = time(NULL);
+	e->index = -1;
+	e->next_wakeup = timers_now();
 
 	/* Disable event if date is passed */
-	if(type == TIMER_DATE && (e->time + 60) < e->next_wakeup)
+	if(type == TIMER_DATE && (e->time + 60) * 1000 < e->next_wakeup)
 		e->enable = 0;
 
 	/* Prepare event */
@@ -331,14 +478,18 @@ int timer_event_add(struct timer_handle *h, const char *name,
 		timers_update_time(e);
 
 	/* Lock timers access */
-	pthread_mutex_lock(&h->timers->mutex);
+	lock_mutex(timers_class, &h->timers->mutex);
 
 	/* Add to list */
 	e->next = h->events;
 	h->events = e;
 
+	/* Schedule event and wake up thread */
+	if(e->enable && timers_schedule(h->timers, e) == 0)
+		pthread_cond_signal(&h->timers->cond);
+
 	/* Unlock timers access */
-	pthread_mutex_unlock(&h->timers->mutex);
+	unlock_mutex(timers_class, &h->timers->mutex);
 
 	return 0;
 }
@@ -348,7 +499,7 @@ int timer_event_enable(struct timer_handle *h, const char *id, int enable)
 	struct timer_event *e;
 
 	/* Lock timers access */
-	pthread_mutex_lock(&h->timers->mutex);
+	lock_mutex(timers_class, &h->timers->mutex);
 
 	/* Find event and remove from list */
 	for(e = h->events; e != NULL; e = e->next)
@@ -358,17 +509,25 @@ int timer_event_enable(struct timer_handle *h, const char *id, int enable)
 			/* Enable/Disable event */
 			e->enable = enable;
 
-			/* Update event */
-			timers_update_time(e);
+			/* Update event from now and (un)schedule it */
+			if(enable)
+			{
+				e->next_wakeup = timers_now();
+				timers_update_time(e);
+				if(timers_schedule(h->timers, e) == 0)
+					pthread_cond_signal(&h->timers->cond);
+			}
+			else
+				timers_unschedule(h->timers, e);
 
 			/* Unlock timers access */
-			pthread_mutex_unlock(&h->timers->mutex);
+			unlock_mutex(timers_class, &h->timers->mutex);
 			return 0;
 		}
 	}
 
 	/* Unlock timers access */
-	pthread_mutex_unlock(&h->timers->mutex);
+	unlock_mutex(timers_class, &h->timers->mutex);
 
 	return -1;
 }
@@ -390,7 +549,7 @@ int timer_event_remove(struct timer_handle *h, const char *id)
 	struct timer_event **ep, *e = NULL;
 
 	/* Lock timers access */
-	pthread_mutex_lock(&h->timers->mutex);
+	lock_mutex(timers_class, &h->timers->mutex);
 
 	/* Find event and remove from list */
 	ep = &h->events;
@@ -404,10 +563,18 @@ int timer_event_remove(struct timer_handle *h, const char *id)
 		}
 		else
 			ep = &e->next;
+		e = NULL;
+	}
+
+	/* Unschedule event and wait end of its callback */
+	if(e != NULL)
+	{
+		timers_unschedule(h->timers, e);
+		timers_wait_event(h->timers, e);
 	}
 
 	/* Unlock timers access */
-	pthread_mutex_unlock(&h->timers->mutex);
+	unlock_mutex(timers_class, &h->timers->mutex);
 
 	/* Event not found */
 	if(e == NULL)
@@ -427,12 +594,19 @@ void timer_close(struct timer_handle *h)
 	if(h == NULL)
 		return;
 
+	/* Lock timers access */
+	lock_mutex(timers_class, &h->timers->mutex);
+
 	/* Free events */
 	while(h->events != NULL)
 	{
 		e = h->events;
 		h->events = e->next;
 
+		/* Unschedule event and wait end of its callback */
+		timers_unschedule(h->timers, e);
+		timers_wait_event(h->timers, e);
+
 		/* Free event */
 		timer_event_free(e);
 	}
@@ -441,9 +615,6 @@ void timer_close(struct timer_handle *h)
 	if(h->name != NULL)
 		free(h->name);
 
-	/* Lock timers access */
-	pthread_mutex_lock(&h->timers->mutex);
-
 	/* Remove from timer list */
 	tp = &h->timers->timers;
 	while((*tp) != NULL)
@@ -459,7 +630,7 @@ void timer_close(struct timer_handle *h)
 	}
 
 	/* Unlock timers access*/
-	pthread_mutex_unlock(&h->timers->mutex);
+	unlock_mutex(timers_class, &h->timers->mutex);
 
 	/* Free handle */
 	free(h);
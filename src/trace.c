@@ -0,0 +1,597 @@
+/*
+ * trace.c - Audio latency tracing
+ *
+ * Copyright (c) 2014   A. Dilly
+ *
+ * AirCat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * AirCat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with AirCat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "trace.h"
+#include "json_stream.h"
+
+#define LOAD(v) __atomic_load_n(&(v), __ATOMIC_ACQUIRE)
+#define STORE(v, x) __atomic_store_n(&(v), x, __ATOMIC_RELEASE)
+
+/* Marks kept for each stage: it must cover the largest buffer between two
+ * stages (a mark is done for each buffer, usually every 10 to 50ms).
+ */
+#define TRACE_MARKS 512
+/* Latencies kept for percentiles and events kept for Chrome trace dump */
+#define TRACE_SAMPLES 1024
+#define TRACE_EVENTS 4096
+
+/* Tolerance on positions (in us) */
+#define TRACE_EPSILON 0.001
+
+static const char *trace_names[TRACE_STAGE_COUNT] = {
+	[TRACE_INPUT] = "input",
+	[TRACE_DECODE] = "decode",
+	[TRACE_RESAMPLE] = "resample",
+	[TRACE_CACHE_WRITE] = "cache_write",
+	[TRACE_CACHE_READ] = "cache_read",
+	[TRACE_MIX] = "mix",
+	[TRACE_WRITE] = "write",
+	[TRACE_PLAY] = "play",
+};
+
+/* A position is the audio time (in us) given by a stage since last reset,
+ * which doesn't depend on sample format. The age is the time spent in
+ * pipeline by the sample at this position.
+ */
+struct trace_point {
+	double pos;
+	uint64_t time;
+	uint64_t age;
+};
+
+struct trace_samples {
+	uint32_t values[TRACE_SAMPLES];
+	unsigned int next;
+	unsigned int count;
+};
+
+struct trace_stage_data {
+	/* Positions of consumed and produced samples */
+	double in_pos;
+	double out_pos;
+	/* Last marks */
+	struct trace_point points[TRACE_MARKS];
+	unsigned int next;
+	unsigned int count;
+	/* Last latencies (in us) */
+	struct trace_samples latency;
+};
+
+struct trace_event {
+	uint64_t start;
+	uint64_t end;
+	enum trace_stage stage;
+};
+
+struct trace_data {
+	struct trace_stage_data stages[TRACE_STAGE_COUNT];
+	/* End to end latencies (in us) */
+	struct trace_samples total;
+	/* Last events */
+	struct trace_event events[TRACE_EVENTS];
+	unsigned int event_next;
+	unsigned int event_count;
+};
+
+struct trace {
+	char *name;
+	unsigned int id;
+	struct trace_data *data;
+	pthread_mutex_t mutex;
+	struct trace *next;
+};
+
+/* Global trace list */
+static struct trace *trace_list = NULL;
+static unsigned int trace_count = 0;
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int trace_enabled = 0;
+
+struct trace *trace_new(const char *name)
+{
+	struct trace *t;
+
+	/* Allocate trace */
+	t = calloc(1, sizeof(struct trace));
+	if(t == NULL)
+		return NULL;
+	t->name = strdup(name != NULL ? name : "stream");
+	pthread_mutex_init(&t->mutex, NULL);
+
+	/* Add to list */
+	pthread_mutex_lock(&trace_mutex);
+	t->id = ++trace_count;
+	t->next = trace_list;
+	trace_list = t;
+	pthread_mutex_unlock(&trace_mutex);
+
+	return t;
+}
+
+void trace_free(struct trace *t)
+{
+	struct trace **p;
+
+	if(t == NULL)
+		return;
+
+	/* Remove from list */
+	pthread_mutex_lock(&trace_mutex);
+	for(p = &trace_list; *p != NULL; p = &(*p)->next)
+	{
+		if(*p == t)
+		{
+			*p = t->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&trace_mutex);
+
+	/* Free trace */
+	pthread_mutex_destroy(&t->mutex);
+	free(t->data);
+	free(t->name);
+	free(t);
+}
+
+static void trace_clear(struct trace *t, int all)
+{
+	unsigned int i;
+
+	if(t->data == NULL)
+		return;
+
+	/* Clear everything */
+	if(all)
+	{
+		memset(t->data, 0, sizeof(struct trace_data));
+		return;
+	}
+
+	/* Only reset positions */
+	for(i = 0; i < TRACE_STAGE_COUNT; i++)
+	{
+		t->data->stages[i].in_pos = 0;
+		t->data->stages[i].out_pos = 0;
+		t->data->stages[i].next = 0;
+		t->data->stages[i].count = 0;
+	}
+}
+
+void trace_reset(struct trace *t)
+{
+	if(t == NULL)
+		return;
+
+	pthread_mutex_lock(&t->mutex);
+	trace_clear(t, 0);
+	pthread_mutex_unlock(&t->mutex);
+}
+
+int trace_is_enabled(void)
+{
+	return LOAD(trace_enabled);
+}
+
+uint64_t trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline double trace_duration(size_t size, unsigned long samplerate,
+				    unsigned char channels)
+{
+	if(samplerate == 0 || channels == 0)
+		return 0;
+
+	return (double) size * 1000000.0 / samplerate / channels;
+}
+
+static void trace_add_sample(struct trace_samples *s, uint64_t ns)
+{
+	uint64_t us = ns / 1000;
+
+	s->values[s->next] = us > UINT32_MAX ? UINT32_MAX : us;
+	s->next = (s->next + 1) % TRACE_SAMPLES;
+	if(s->count < TRACE_SAMPLES)
+		s->count++;
+}
+
+static struct trace_point *trace_find(struct trace_stage_data *st,
+				      double pos)
+{
+	struct trace_point *p;
+	unsigned int first, lo, hi, mid;
+
+	if(st->count == 0)
+		return NULL;
+
+	/* Find oldest mark which includes position: marks are sorted by
+	 * position from oldest to newest.
+	 */
+	first = (st->next + TRACE_MARKS - st->count) % TRACE_MARKS;
+	lo = 0;
+	hi = st->count;
+	while(lo < hi)
+	{
+		mid = (lo + hi) / 2;
+		p = &st->points[(first + mid) % TRACE_MARKS];
+		if(p->pos + TRACE_EPSILON < pos)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	/* Position not reached yet by this stage */
+	if(lo == st->count)
+		return NULL;
+
+	/* Position is older than all marks */
+	p = &st->points[(first + lo) % TRACE_MARKS];
+	if(lo == 0 && st->count == TRACE_MARKS)
+		return NULL;
+
+	return p;
+}
+
+static void trace_add(struct trace *t, enum trace_stage stage, double in_len,
+		      double out_len, uint64_t time)
+{
+	struct trace_stage_data *st;
+	struct trace_point *prev = NULL, *p;
+	struct trace_event *e;
+	uint64_t latency = 0;
+	int i;
+
+	if(t == NULL || stage >= TRACE_STAGE_COUNT || !LOAD(trace_enabled))
+		return;
+
+	/* Lock trace access */
+	pthread_mutex_lock(&t->mutex);
+
+	/* Allocate marks on first use */
+	if(t->data == NULL)
+	{
+		t->data = calloc(1, sizeof(struct trace_data));
+		if(t->data == NULL)
+			goto end;
+	}
+	st = &t->data->stages[stage];
+
+	/* Update stage positions */
+	st->in_pos += in_len;
+	st->out_pos += out_len;
+
+	/* Find when last consumed sample left previous stage */
+	for(i = stage - 1; i >= 0; i--)
+	{
+		if(t->data->stages[i].count > 0)
+		{
+			prev = trace_find(&t->data->stages[i], st->in_pos);
+			break;
+		}
+	}
+
+	/* Add mark */
+	p = &st->points[st->next];
+	st->next = (st->next + 1) % TRACE_MARKS;
+	if(st->count < TRACE_MARKS)
+		st->count++;
+	p->pos = st->out_pos;
+	p->time = time;
+	p->age = 0;
+	if(prev == NULL)
+		goto end;
+
+	/* Get latency of stage */
+	if(time > prev->time)
+		latency = time - prev->time;
+	p->age = prev->age + latency;
+	trace_add_sample(&st->latency, latency);
+	if(stage == TRACE_PLAY)
+		trace_add_sample(&t->data->total, p->age);
+
+	/* Add event */
+	e = &t->data->events[t->data->event_next];
+	t->data->event_next = (t->data->event_next + 1) % TRACE_EVENTS;
+	if(t->data->event_count < TRACE_EVENTS)
+		t->data->event_count++;
+	e->start = time - latency;
+	e->end = time;
+	e->stage = stage;
+
+end:
+	/* Unlock trace access */
+	pthread_mutex_unlock(&t->mutex);
+}
+
+void trace_mark_at(struct trace *t, enum trace_stage stage, size_t size,
+		   unsigned long samplerate, unsigned char channels,
+		   uint64_t time)
+{
+	double len;
+
+	if(t == NULL || !LOAD(trace_enabled))
+		return;
+
+	len = trace_duration(size, samplerate, channels);
+	trace_add(t, stage, len, len, time);
+}
+
+void trace_mark(struct trace *t, enum trace_stage stage, size_t size,
+		unsigned long samplerate, unsigned char channels)
+{
+	if(t == NULL || !LOAD(trace_enabled))
+		return;
+
+	trace_mark_at(t, stage, size, samplerate, channels, trace_now());
+}
+
+void trace_mark_convert(struct trace *t, enum trace_stage stage,
+			size_t in_size, unsigned long in_samplerate,
+			unsigned char in_channels, size_t out_size,
+			unsigned long out_samplerate,
+			unsigned char out_channels)
+{
+	if(t == NULL || !LOAD(trace_enabled))
+		return;
+
+	trace_add(t, stage,
+		  trace_duration(in_size, in_samplerate, in_channels),
+		  trace_duration(out_size, out_samplerate, out_channels),
+		  trace_now());
+}
+
+/******************************************************************************
+ *                           Trace URLs for AirCat                            *
+ ******************************************************************************/
+
+static int trace_cmp(const void *a, const void *b)
+{
+	uint32_t v1 = *(const uint32_t *) a, v2 = *(const uint32_t *) b;
+
+	return v1 < v2 ? -1 : v1 > v2;
+}
+
+static struct json *trace_get_percentiles(const struct trace_samples *s)
+{
+	uint32_t values[TRACE_SAMPLES];
+	struct json *tmp;
+	unsigned int n = s->count;
+
+	tmp = json_new();
+	if(tmp == NULL)
+		return NULL;
+
+	/* Sort last values */
+	memcpy(values, s->values, n * sizeof(uint32_t));
+	qsort(values, n, sizeof(uint32_t), &trace_cmp);
+
+	/* Add percentiles (in us) */
+	json_set_int(tmp, "count", n);
+	if(n > 0)
+	{
+		json_set_int64(tmp, "p50", values[(n - 1) * 50 / 100]);
+		json_set_int64(tmp, "p90", values[(n - 1) * 90 / 100]);
+		json_set_int64(tmp, "p99", values[(n - 1) * 99 / 100]);
+		json_set_int64(tmp, "max", values[n - 1]);
+	}
+
+	return tmp;
+}
+
+static int trace_httpd_start(void *user_data, struct httpd_req *req,
+			     struct httpd_res **res)
+{
+	struct trace *t;
+
+	/* Forget previous traces */
+	pthread_mutex_lock(&trace_mutex);
+	for(t = trace_list; t != NULL; t = t->next)
+	{
+		pthread_mutex_lock(&t->mutex);
+		trace_clear(t, 1);
+		pthread_mutex_unlock(&t->mutex);
+	}
+
+	/* Enable tracing */
+	STORE(trace_enabled, 1);
+	pthread_mutex_unlock(&trace_mutex);
+
+	return 200;
+}
+
+static int trace_httpd_stop(void *user_data, struct httpd_req *req,
+			    struct httpd_res **res)
+{
+	/* Disable tracing: last traces are kept */
+	STORE(trace_enabled, 0);
+
+	return 200;
+}
+
+static int trace_httpd_status(void *user_data, struct httpd_req *req,
+			      struct httpd_res **res)
+{
+	struct json_stream *s;
+	struct json *tmp;
+	struct trace *t;
+	char *str;
+	int i;
+
+	/* Create a new stream */
+	s = json_stream_new();
+	if(s == NULL)
+		return 500;
+	json_stream_begin_object(s, NULL);
+	json_stream_add(s, "enabled", json_new_bool(LOAD(trace_enabled)));
+
+	/* Add latency percentiles of each stage (in us) for all streams */
+	json_stream_begin_array(s, "streams");
+	pthread_mutex_lock(&trace_mutex);
+	for(t = trace_list; t != NULL; t = t->next)
+	{
+		json_stream_begin_object(s, NULL);
+		json_stream_add(s, "id", json_new_int(t->id));
+		json_stream_add(s, "name", json_new_string(t->name));
+
+		/* Lock trace access */
+		pthread_mutex_lock(&t->mutex);
+
+		if(t->data != NULL)
+		{
+			tmp = json_new();
+			for(i = 1; i < TRACE_STAGE_COUNT; i++)
+			{
+				json_add(tmp, trace_names[i],
+					 trace_get_percentiles(
+					     &t->data->stages[i].latency));
+			}
+			json_stream_add(s, "stages", tmp);
+			json_stream_add(s, "total",
+				      trace_get_percentiles(&t->data->total));
+		}
+
+		/* Unlock trace access */
+		pthread_mutex_unlock(&t->mutex);
+
+		json_stream_end_object(s);
+	}
+	pthread_mutex_unlock(&trace_mutex);
+	json_stream_end_array(s);
+
+	/* Get JSON string */
+	json_stream_end_object(s);
+	str = json_stream_finish(s, NULL);
+	if(str == NULL)
+		return 500;
+
+	*res = httpd_new_response(str, 1, 0);
+	return 200;
+}
+
+static void trace_add_name(struct json_stream *s, const char *event,
+			   unsigned int pid, int tid, const char *name)
+{
+	struct json *tmp, *args;
+
+	/* Create a metadata event */
+	tmp = json_new();
+	if(tmp == NULL)
+		return;
+	json_set_string(tmp, "name", event);
+	json_set_string(tmp, "ph", "M");
+	json_set_int(tmp, "pid", pid);
+	if(tid >= 0)
+		json_set_int(tmp, "tid", tid);
+	args = json_new();
+	json_set_string(args, "name", name);
+	json_add(tmp, "args", args);
+
+	json_stream_add(s, NULL, tmp);
+}
+
+static int trace_httpd_chrome(void *user_data, struct httpd_req *req,
+			      struct httpd_res **res)
+{
+	struct json_stream *s;
+	struct trace_event *e;
+	struct json *tmp;
+	struct trace *t;
+	unsigned int i, first;
+	char *str;
+
+	/* Create a new stream */
+	s = json_stream_new();
+	if(s == NULL)
+		return 500;
+	json_stream_begin_object(s, NULL);
+	json_stream_begin_array(s, "traceEvents");
+
+	/* Add events of all streams: a process for each stream and a thread for
+	 * each stage, and one complete event for each latency.
+	 */
+	pthread_mutex_lock(&trace_mutex);
+	for(t = trace_list; t != NULL; t = t->next)
+	{
+		/* Lock trace access */
+		pthread_mutex_lock(&t->mutex);
+
+		if(t->data == NULL)
+			goto next;
+
+		/* Name stream and stages */
+		trace_add_name(s, "process_name", t->id, -1, t->name);
+		for(i = 1; i < TRACE_STAGE_COUNT; i++)
+			trace_add_name(s, "thread_name", t->id, i,
+				       trace_names[i]);
+
+		/* Add events from oldest */
+		first = (t->data->event_next + TRACE_EVENTS -
+			 t->data->event_count) % TRACE_EVENTS;
+		for(i = 0; i < t->data->event_count; i++)
+		{
+			e = &t->data->events[(first + i) % TRACE_EVENTS];
+			tmp = json_new();
+			if(tmp == NULL)
+				continue;
+			json_set_string(tmp, "name", trace_names[e->stage]);
+			json_set_string(tmp, "cat", "audio");
+			json_set_string(tmp, "ph", "X");
+			json_set_int64(tmp, "ts", e->start / 1000);
+			json_set_int64(tmp, "dur", (e->end - e->start) / 1000);
+			json_set_int(tmp, "pid", t->id);
+			json_set_int(tmp, "tid", e->stage);
+			json_stream_add(s, NULL, tmp);
+		}
+
+next:
+		/* Unlock trace access */
+		pthread_mutex_unlock(&t->mutex);
+	}
+	pthread_mutex_unlock(&trace_mutex);
+	json_stream_end_array(s);
+	json_stream_add(s, "displayTimeUnit", json_new_string("ms"));
+
+	/* Get JSON string */
+	json_stream_end_object(s);
+	str = json_stream_finish(s, NULL);
+	if(str == NULL)
+		return 500;
+
+	*res = httpd_new_response(str, 1, 0);
+	return 200;
+}
+
+struct url_table trace_urls[] = {
+	{"/start",  0, HTTPD_PUT, 0, &trace_httpd_start},
+	{"/stop",   0, HTTPD_PUT, 0, &trace_httpd_stop},
+	{"/status", 0, HTTPD_GET, 0, &trace_httpd_status},
+	{"/chrome", 0, HTTPD_GET, 0, &trace_httpd_chrome},
+	{0, 0, 0, 0}
+};
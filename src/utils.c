@@ -22,9 +22,12 @@
 #include <unistd.h>
 #include <time.h>
 #include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
 #include <dirent.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
@@ -184,6 +187,19 @@ char *md5_encode_str(const unsigned char *buffer, long length)
 	return hash;
 }
 
+uint64_t utils_hash_fnv1a(uint64_t hash, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	while(len-- > 0)
+	{
+		hash ^= *p++;
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
 int parse_url(const char *url, int *protocol, char **hostname,
 	      unsigned int *port, char **username, char **password,
 	      char **resource)
@@ -330,7 +346,6 @@ int _scandir(const char *path, struct _dirent ***list,
 	size_t count = 0;
 	size_t size = 0;
 	size_t nlen = 0;
-	char *file;
 	DIR *dp;
 
 	/* Open directory */
@@ -346,14 +361,9 @@ int _scandir(const char *path, struct _dirent ***list,
 		   (dir->d_name[1] == '.' && dir->d_name[2] == '\0')))
 			continue;
 
-		/* Generate complete file path */
-		asprintf(&file, "%s/%s", path, dir->d_name);
-		if(file == NULL)
-			break;
-
-		/* Get stat of file */
-		stat(file, &st);
-		free(file);
+		/* Get stat of file (relative to directory) */
+		if(fstatat(dirfd(dp), dir->d_name, &st, 0) != 0)
+			continue;
 
 		/* Check if entry will be added */
 		if(selector != NULL && selector(dir, &st) == 0)
@@ -400,3 +410,116 @@ int _scandir(const char *path, struct _dirent ***list,
 	return count;
 }
 
+/* Directory entry as returned by getdents64() */
+struct dir_iter_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+struct dir_iter {
+	int fd;
+	/* Current entry */
+	struct dir_entry entry;
+	/* Batch of entries */
+	size_t pos;
+	size_t len;
+	char buffer[DIR_ITER_BUFFER_SIZE];
+};
+
+static struct dir_iter *dir_iter_new(int fd)
+{
+	struct dir_iter *it;
+
+	if(fd < 0)
+		return NULL;
+
+	/* Allocate iterator */
+	it = malloc(sizeof(struct dir_iter));
+	if(it == NULL)
+	{
+		close(fd);
+		return NULL;
+	}
+	it->fd = fd;
+	it->pos = 0;
+	it->len = 0;
+
+	return it;
+}
+
+struct dir_iter *dir_iter_open(const char *path)
+{
+	return dir_iter_new(open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+}
+
+struct dir_iter *dir_iter_openat(struct dir_iter *parent, const char *name)
+{
+	return dir_iter_new(openat(parent->fd, name,
+				   O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+}
+
+struct dir_entry *dir_iter_read(struct dir_iter *it)
+{
+	struct dir_iter_dirent64 *d;
+	struct stat st;
+	long len;
+
+	while(1)
+	{
+		/* Read next batch of entries */
+		if(it->pos >= it->len)
+		{
+			len = syscall(SYS_getdents64, it->fd, it->buffer,
+				      DIR_ITER_BUFFER_SIZE);
+			if(len <= 0)
+				return NULL;
+			it->len = len;
+			it->pos = 0;
+		}
+
+		/* Get entry */
+		d = (struct dir_iter_dirent64 *) (it->buffer + it->pos);
+		it->pos += d->d_reclen;
+
+		/* Skip . and .. */
+		if(d->d_name[0] == '.' && (d->d_name[1] == '\0' ||
+		   (d->d_name[1] == '.' && d->d_name[2] == '\0')))
+			continue;
+
+		/* Fill entry */
+		it->entry.inode = d->d_ino;
+		it->entry.type = d->d_type;
+		it->entry.name = d->d_name;
+		it->entry.name_len = strlen(d->d_name);
+
+		/* Type is not given by this file system */
+		if(it->entry.type == DT_UNKNOWN &&
+		   fstatat(it->fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+			it->entry.type = IFTODT(st.st_mode);
+
+		return &it->entry;
+	}
+}
+
+int dir_iter_stat(struct dir_iter *it, const struct dir_entry *e,
+		  struct stat *st, int follow)
+{
+	/* Get status of directory itself */
+	if(e == NULL)
+		return fstat(it->fd, st);
+
+	return fstatat(it->fd, e->name, st, follow ? 0 : AT_SYMLINK_NOFOLLOW);
+}
+
+void dir_iter_close(struct dir_iter *it)
+{
+	if(it == NULL)
+		return;
+
+	/* Close directory */
+	close(it->fd);
+	free(it);
+}
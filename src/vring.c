@@ -16,32 +16,132 @@
  * along with AirCat.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
 #include <pthread.h>
 
 #include "vring.h"
+#include "budget.h"
+#include "lock.h"
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
 
+#ifdef HAVE_MEMFD_CREATE
+#include <sys/mman.h>
+#endif
+
+#define LOAD(v) __atomic_load_n(&(v), __ATOMIC_ACQUIRE)
+#define ADD(v, x) __atomic_add_fetch(&(v), x, __ATOMIC_RELEASE)
+#define SUB(v, x) __atomic_sub_fetch(&(v), x, __ATOMIC_RELEASE)
+
 struct vring_handle {
 	/* Ring buffer */
 	unsigned char *buffer;
 	size_t buffer_size;
 	size_t max_rw_size;
-	/* Buffer status */
+	size_t alloc_size;
+	/* Buffer is mapped twice back to back: no copy is needed on overlap */
+	int mirror;
+	/* Buffer status: read_pos is only used by reader and write_pos by
+	 * writer, buffer_len is shared with acquire/release ordering.
+	 */
 	size_t buffer_len;
 	size_t read_pos;
 	size_t write_pos;
-	/* Mutex thread */
+	/* Mutex thread (not used in SPSC mode) */
 	pthread_mutex_t mutex;
+	int spsc;
+	/* Blocking wait: forward functions signal cond only when someone is
+	 * waiting and vring_wake() increments wake to abort all waits.
+	 */
+	pthread_mutex_t wait_mutex;
+	pthread_cond_t cond;
+	int waiting;
+	unsigned int wake;
 };
 
+/* Lock classes of reader access and blocking wait */
+LOCK_CLASS(vring_class, "vring");
+LOCK_CLASS(vring_wait_class, "vring_wait");
+
+static inline void vring_lock(struct vring_handle *h)
+{
+	if(!h->spsc)
+		lock_mutex(vring_class, &h->mutex);
+}
+
+static inline void vring_unlock(struct vring_handle *h)
+{
+	if(!h->spsc)
+		unlock_mutex(vring_class, &h->mutex);
+}
+
+#ifdef HAVE_MEMFD_CREATE
+static int vring_mirror_open(struct vring_handle *h)
+{
+	unsigned char *addr;
+	size_t size;
+	long page;
+	int fd;
+
+	/* Both mappings must be aligned on a page */
+	page = sysconf(_SC_PAGESIZE);
+	if(page <= 0)
+		return -1;
+	size = (h->buffer_size + page - 1) / page * page;
+
+	/* Create an anonymous file */
+	fd = memfd_create("vring", 0);
+	if(fd < 0)
+		return -1;
+	if(ftruncate(fd, size) != 0)
+		goto error;
+
+	/* Reserve a contiguous address range for both mappings */
+	addr = mmap(NULL, size * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1,
+		    0);
+	if(addr == MAP_FAILED)
+		goto error;
+
+	/* Map the same file twice */
+	if(mmap(addr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd,
+		0) == MAP_FAILED ||
+	   mmap(addr + size, size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+	{
+		munmap(addr, size * 2);
+		goto error;
+	}
+
+	/* File is kept alive by mappings */
+	close(fd);
+
+	/* Extra space at end of buffer is usable */
+	h->buffer = addr;
+	h->buffer_size = size;
+	h->alloc_size = size;
+	h->mirror = 1;
+
+	return 0;
+
+error:
+	close(fd);
+	return -1;
+}
+#endif
+
 int vring_open(struct vring_handle **handle, size_t buffer_size,
-	       size_t max_rw_size)
+	       size_t max_rw_size, int flags)
 {
 	struct vring_handle *h;
 
@@ -61,47 +161,166 @@ int vring_open(struct vring_handle **handle, size_t buffer_size,
 	h->buffer_len = 0;
 	h->read_pos = 0;
 	h->write_pos = 0;
+	h->buffer = NULL;
+	h->mirror = 0;
+	h->spsc = flags & VRING_SPSC ? 1 : 0;
 
-	/* Allocate buffer */
-	h->buffer = malloc(h->buffer_size+h->max_rw_size);
-	if(h->buffer == NULL)
+	/* Reserve buffer in memory budget */
+	h->alloc_size = h->buffer_size + h->max_rw_size;
+	if(budget_reserve(BUDGET_VRING, h->alloc_size) != 0)
 		return -1;
 
-	/* Init mutex */
+#ifdef HAVE_MEMFD_CREATE
+	/* Use a mirrored buffer when available */
+	if(vring_mirror_open(h) == 0)
+	{
+		/* Adjust reservation to mapped size */
+		budget_release(BUDGET_VRING, buffer_size + max_rw_size);
+		if(budget_reserve(BUDGET_VRING, h->alloc_size) != 0)
+		{
+			munmap(h->buffer, h->alloc_size * 2);
+			h->buffer = NULL;
+			return -1;
+		}
+	}
+	else
+#endif
+	{
+		/* Allocate buffer with a reserve for overlap */
+		h->buffer = malloc(h->alloc_size);
+		if(h->buffer == NULL)
+		{
+			budget_release(BUDGET_VRING, h->alloc_size);
+			return -1;
+		}
+	}
+
+	/* Init mutex and condition */
 	pthread_mutex_init(&h->mutex, NULL);
+	pthread_mutex_init(&h->wait_mutex, NULL);
+	pthread_cond_init(&h->cond, NULL);
+	h->waiting = 0;
+	h->wake = 0;
 
 	return 0;
 }
 
-size_t vring_get_length(struct vring_handle *h)
+static void vring_signal(struct vring_handle *h)
 {
-	size_t len;
+	/* Length update must be visible before checking waiters */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
 
-	/* Lock access to ring buffer */
-	pthread_mutex_lock(&h->mutex);
+	/* Wake up waiters */
+	if(__atomic_load_n(&h->waiting, __ATOMIC_SEQ_CST))
+	{
+		lock_mutex(vring_wait_class, &h->wait_mutex);
+		pthread_cond_broadcast(&h->cond);
+		unlock_mutex(vring_wait_class, &h->wait_mutex);
+	}
+}
+
+static size_t vring_wait(struct vring_handle *h, size_t len,
+			 unsigned long timeout, int readable)
+{
+	struct timespec ts;
+	unsigned int wake;
+	size_t avail;
 
-	/* Copy length */
-	len = h->buffer_len;
+	/* Calculate end of wait */
+	if(timeout > 0)
+	{
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += timeout / 1000;
+		ts.tv_nsec += (timeout % 1000) * 1000000L;
+		if(ts.tv_nsec >= 1000000000L)
+		{
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+	}
 
-	/* Unlock access to ring buffer */
-	pthread_mutex_unlock(&h->mutex);
+	/* Lock wait access */
+	lock_mutex(vring_wait_class, &h->wait_mutex);
 
-	return len;
+	/* Register as waiter before checking length */
+	__atomic_add_fetch(&h->waiting, 1, __ATOMIC_SEQ_CST);
+	wake = h->wake;
+
+	while(1)
+	{
+		/* Get available data or space */
+		avail = __atomic_load_n(&h->buffer_len, __ATOMIC_SEQ_CST);
+		if(!readable)
+			avail = h->buffer_size - avail;
+		if(avail >= len || h->wake != wake)
+			break;
+
+		/* Sleep until a forward, a wake up or timeout */
+		if(timeout == 0)
+			lock_cond_wait(vring_wait_class, &h->cond,
+				       &h->wait_mutex);
+		else if(lock_cond_timedwait(vring_wait_class, &h->cond,
+					    &h->wait_mutex, &ts) == ETIMEDOUT)
+			break;
+	}
+
+	/* Unregister */
+	__atomic_sub_fetch(&h->waiting, 1, __ATOMIC_SEQ_CST);
+
+	/* Unlock wait access */
+	unlock_mutex(vring_wait_class, &h->wait_mutex);
+
+	return avail;
+}
+
+size_t vring_wait_readable(struct vring_handle *h, size_t len,
+			   unsigned long timeout)
+{
+	if(len > h->buffer_size)
+		len = h->buffer_size;
+
+	return vring_wait(h, len, timeout, 1);
+}
+
+size_t vring_wait_writable(struct vring_handle *h, size_t len,
+			   unsigned long timeout)
+{
+	if(len > h->buffer_size)
+		len = h->buffer_size;
+
+	return vring_wait(h, len, timeout, 0);
+}
+
+void vring_wake(struct vring_handle *h)
+{
+	/* Abort all current waits */
+	lock_mutex(vring_wait_class, &h->wait_mutex);
+	h->wake++;
+	pthread_cond_broadcast(&h->cond);
+	unlock_mutex(vring_wait_class, &h->wait_mutex);
+}
+
+size_t vring_get_length(struct vring_handle *h)
+{
+	return LOAD(h->buffer_len);
 }
 
 ssize_t vring_read(struct vring_handle *h, unsigned char **buffer,
 		   size_t len, size_t pos)
 {
+	size_t buffer_len;
+
 	/* Limit length access */
 	if(len > h->max_rw_size || len == 0)
 		len = h->max_rw_size;
 
 	/* Lock access to ring buffer */
-	pthread_mutex_lock(&h->mutex);
+	vring_lock(h);
 
-	/* Get available length */
-	if(len > h->buffer_len - pos)
-		len = h->buffer_len - pos;
+	/* Get available length: data is visible after this load */
+	buffer_len = LOAD(h->buffer_len);
+	if(len > buffer_len - pos)
+		len = buffer_len - pos;
 
 	/* Set buffer pointer */
 	*buffer = h->buffer + h->read_pos + pos;
@@ -109,36 +328,42 @@ ssize_t vring_read(struct vring_handle *h, unsigned char **buffer,
 		*buffer -= h->buffer_size;
 
 	/* Unlock access to ring buffer */
-	pthread_mutex_unlock(&h->mutex);
+	vring_unlock(h);
 
 	return len;
 }
 
 ssize_t vring_read_forward(struct vring_handle *h, size_t len)
 {
+	size_t buffer_len;
+
 	/* Lock access to ring buffer */
-	pthread_mutex_lock(&h->mutex);
+	vring_lock(h);
 
 	/* Check buffer length */
-	if(len > h->buffer_len)
-		len = h->buffer_len;
+	buffer_len = LOAD(h->buffer_len);
+	if(len > buffer_len)
+		len = buffer_len;
 
 	/* No update */
 	if(len == 0)
 	{
 		/* Unlock access to ring buffer */
-		pthread_mutex_unlock(&h->mutex);
+		vring_unlock(h);
 		return 0;
 	}
 
-	/* Update read position and available length */
+	/* Update read position (owned by reader) and release space */
 	h->read_pos += len;
 	if(h->read_pos >= h->buffer_size)
 		h->read_pos -= h->buffer_size;
-	h->buffer_len -= len;
+	SUB(h->buffer_len, len);
 
 	/* Unlock access to ring buffer */
-	pthread_mutex_unlock(&h->mutex);
+	vring_unlock(h);
+
+	/* Some space is available for writer */
+	vring_signal(h);
 
 	return len;
 }
@@ -146,16 +371,18 @@ ssize_t vring_read_forward(struct vring_handle *h, size_t len)
 ssize_t vring_write(struct vring_handle *h, unsigned char **buffer)
 {
 	ssize_t len = h->max_rw_size;
+	size_t buffer_len;
 
 	/* Lock access to ring buffer */
-	pthread_mutex_lock(&h->mutex);
+	vring_lock(h);
 
 	/* Check available space in ring buffer */
-	if(len > h->buffer_size - h->buffer_len)
-		len = h->buffer_size - h->buffer_len;
+	buffer_len = LOAD(h->buffer_len);
+	if(len > h->buffer_size - buffer_len)
+		len = h->buffer_size - buffer_len;
 
 	/* Unlock access to ring buffer */
-	pthread_mutex_unlock(&h->mutex);
+	vring_unlock(h);
 
 	/* Set buffer pointer */
 	*buffer = h->buffer + h->write_pos;
@@ -165,23 +392,29 @@ ssize_t vring_write(struct vring_handle *h, unsigned char **buffer)
 
 ssize_t vring_write_forward(struct vring_handle *h, size_t len)
 {
+	size_t buffer_len;
 	size_t size = 0;
 	size_t rem = 0;
 
 	/* Lock access to ring buffer */
-	pthread_mutex_lock(&h->mutex);
+	vring_lock(h);
 
 	/* Check available space in ring buffer */
-	if(len > h->buffer_size - h->buffer_len)
-		len = h->buffer_size - h->buffer_len;
+	buffer_len = LOAD(h->buffer_len);
+	if(len > h->buffer_size - buffer_len)
+		len = h->buffer_size - buffer_len;
 
 	/* Unlock access to ring buffer */
-	pthread_mutex_unlock(&h->mutex);
+	vring_unlock(h);
 
 	/* No available space */
 	if(len == 0)
 		return 0;
 
+	/* Mirrored buffer: data is already at both places */
+	if(h->mirror)
+		goto update;
+
 	/* Overlap in ring buffer */
 	if(h->write_pos + len > h->buffer_size)
 	{
@@ -199,17 +432,21 @@ ssize_t vring_write_forward(struct vring_handle *h, size_t len)
 		memcpy(h->buffer + rem, h->buffer + h->write_pos, size);
 	}
 
+update:
 	/* Lock access to ring buffer */
-	pthread_mutex_lock(&h->mutex);
+	vring_lock(h);
 
-	/* Update write position and available length */
+	/* Update write position (owned by writer) and publish data */
 	h->write_pos += len;
 	if(h->write_pos >= h->buffer_size)
 		h->write_pos -= h->buffer_size;
-	h->buffer_len += len;
+	ADD(h->buffer_len, len);
 
 	/* Unlock access to ring buffer */
-	pthread_mutex_unlock(&h->mutex);
+	vring_unlock(h);
+
+	/* Some data is available for reader */
+	vring_signal(h);
 
 	return len;
 }
@@ -221,7 +458,15 @@ void vring_close(struct vring_handle *h)
 
 	/* Free ring buffer */
 	if(h->buffer != NULL)
-		free(h->buffer);
+	{
+#ifdef HAVE_MEMFD_CREATE
+		if(h->mirror)
+			munmap(h->buffer, h->alloc_size * 2);
+		else
+#endif
+			free(h->buffer);
+		budget_release(BUDGET_VRING, h->alloc_size);
+	}
 
 	/* Free handle */
 	free(h);
@@ -0,0 +1,625 @@
+/*
+ * bench_decode.c - Decoder and demuxer throughput benchmark
+ *
+ * Run the decoders (pcm, mp3, aac, alac) and the demuxers (mp3, mp4) over a
+ * list of files, without any audio output, and report for each pass:
+ *  - the real-time factor (duration of audio / processing time),
+ *  - the processing time per sample (one sample for all channels),
+ *  - the peak RSS of the process,
+ *  - the memory allocations per frame.
+ * WAV files are fed to the PCM decoder in chunks of PCM_CHUNK_SIZE bytes.
+ *
+ * Usage: bench_decode [-j] [-n runs] file...
+ *  -j: print results in JSON (for regression tracking between releases),
+ *  -n: run each pass several times and keep the fastest run.
+ *
+ * Copyright (c) 2014   A. Dilly
+ *
+ * AirCat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * AirCat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with AirCat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "decoder.h"
+#include "demux.h"
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef VERSION
+#define VERSION "unknown"
+#endif
+
+/* Frames decoded in one batch (as in file_read()) */
+#define BATCH_FRAMES 16
+/* Output buffer size in samples */
+#define OUTPUT_SIZE 8192
+/* Demuxer cache size (as in file_open()) */
+#define DEMUX_CACHE_SIZE 8192*2
+/* Chunk size for PCM files */
+#define PCM_CHUNK_SIZE 4096
+/* WAV header length */
+#define WAV_HEADER_SIZE 44
+/* Maximum successive calls without any frame from demuxer */
+#define MAX_IDLE 1000
+
+/* Allocation counter: allocations made by AirCat code (objects linked in this
+ * program, not libraries as libmad or libfaad) are redirected to these
+ * wrappers by the linker (see BENCH_WRAP_LDFLAGS in configure.ac). Without
+ * linker support, allocations are not counted and reported as unknown.
+ */
+static unsigned long alloc_count = 0;
+
+#ifdef HAVE_LD_WRAP
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+int __real_posix_memalign(void **ptr, size_t align, size_t size);
+void *__real_aligned_alloc(size_t align, size_t size);
+char *__real_strdup(const char *str);
+
+void *__wrap_malloc(size_t size)
+{
+	__sync_fetch_and_add(&alloc_count, 1);
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+	__sync_fetch_and_add(&alloc_count, 1);
+	return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	__sync_fetch_and_add(&alloc_count, 1);
+	return __real_realloc(ptr, size);
+}
+
+int __wrap_posix_memalign(void **ptr, size_t align, size_t size)
+{
+	__sync_fetch_and_add(&alloc_count, 1);
+	return __real_posix_memalign(ptr, align, size);
+}
+
+void *__wrap_aligned_alloc(size_t align, size_t size)
+{
+	__sync_fetch_and_add(&alloc_count, 1);
+	return __real_aligned_alloc(align, size);
+}
+
+char *__wrap_strdup(const char *str)
+{
+	__sync_fetch_and_add(&alloc_count, 1);
+	return __real_strdup(str);
+}
+
+#define BENCH_ALLOCS 1
+#else
+#define BENCH_ALLOCS 0
+#endif
+
+struct bench_pass {
+	uint64_t ns;			/* Processing time */
+	unsigned long frames;		/* Frames processed */
+	unsigned long allocs;		/* Allocations during pass */
+	long peak_rss;			/* Peak RSS after pass (in kB) */
+};
+
+struct bench_result {
+	const char *file;
+	const char *codec;
+	unsigned long samplerate;
+	unsigned char channels;
+	unsigned long long samples;	/* Samples decoded (for all channels) */
+	double duration;		/* Audio duration (in s) */
+	struct bench_pass decode;
+	struct bench_pass demux;
+};
+
+static uint64_t bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static long bench_peak_rss(void)
+{
+	struct rusage usage;
+
+	if(getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0;
+
+	return usage.ru_maxrss;
+}
+
+static const char *bench_codec_name(int codec)
+{
+	switch(codec)
+	{
+		case CODEC_PCM:
+			return "pcm";
+		case CODEC_AAC:
+			return "aac";
+		case CODEC_ALAC:
+			return "alac";
+		case CODEC_MP3:
+			return "mp3";
+		default:
+			return "unknown";
+	}
+}
+
+static int bench_is_wav(const char *file)
+{
+	size_t len = strlen(file);
+
+	return len >= 4 && strcasecmp(&file[len-4], ".wav") == 0;
+}
+
+static void bench_account(struct bench_result *res,
+			  const struct decoder_batch_info *info, int samples)
+{
+	if(samples <= 0 || info->channels == 0 || info->samplerate == 0)
+		return;
+
+	/* Format can change during stream */
+	res->samples += samples / info->channels;
+	res->duration += (double) samples / info->channels / info->samplerate;
+}
+
+static int bench_decode_pcm(const char *file, struct bench_result *res)
+{
+	unsigned char output[OUTPUT_SIZE * 4];
+	struct decoder_frame list[BATCH_FRAMES];
+	struct decoder_batch_info info;
+	struct decoder_handle *dec;
+	unsigned char *data = NULL;
+	unsigned long allocs;
+	uint64_t start;
+	size_t len = 0;
+	size_t pos;
+	long size;
+	FILE *fp;
+	int samples;
+	int count;
+
+	/* Load file in memory: I/O is not part of this benchmark */
+	fp = fopen(file, "rb");
+	if(fp == NULL)
+		return -1;
+	if(fseek(fp, 0, SEEK_END) == 0 && (size = ftell(fp)) > WAV_HEADER_SIZE)
+	{
+		rewind(fp);
+		data = malloc(size);
+		if(data != NULL)
+			len = fread(data, 1, size, fp);
+	}
+	fclose(fp);
+	if(len <= WAV_HEADER_SIZE)
+	{
+		free(data);
+		return -1;
+	}
+
+	allocs = alloc_count;
+	start = bench_now();
+
+	/* Open decoder with WAV header */
+	if(decoder_open(&dec, CODEC_PCM, data, WAV_HEADER_SIZE,
+			&res->samplerate, &res->channels) != 0)
+	{
+		free(data);
+		return -1;
+	}
+
+	/* Decode chunks */
+	info.remaining = 0;
+	for(pos = WAV_HEADER_SIZE; pos < len || info.remaining > 0; )
+	{
+		/* Prepare chunk list */
+		for(count = 0; count < BATCH_FRAMES && pos < len; count++)
+		{
+			list[count].data = &data[pos];
+			list[count].len = len - pos > PCM_CHUNK_SIZE ?
+					  PCM_CHUNK_SIZE : len - pos;
+			pos += list[count].len;
+		}
+
+		/* Decode chunks */
+		info.samplerate = 0;
+		info.channels = 0;
+		samples = decoder_decode_batch(dec, list, count, output,
+					       OUTPUT_SIZE, &info);
+		if(samples <= 0 && info.frames == 0 && info.used == 0)
+			break;
+		bench_account(res, &info, samples);
+		res->decode.frames += info.frames;
+
+		/* Rewind to first chunk not fully used */
+		while(count > (int) info.frames)
+			pos -= list[--count].len;
+		pos += info.used;
+	}
+
+	decoder_close(dec);
+	res->decode.ns = bench_now() - start;
+	res->decode.allocs = alloc_count - allocs;
+	res->decode.peak_rss = bench_peak_rss();
+	res->codec = bench_codec_name(CODEC_PCM);
+
+	free(data);
+
+	return 0;
+}
+
+static int bench_decode_file(const char *file, struct bench_result *res)
+{
+	unsigned char output[OUTPUT_SIZE * 4];
+	struct demux_frame *frames[BATCH_FRAMES];
+	struct decoder_frame list[BATCH_FRAMES];
+	struct decoder_batch_info info;
+	const unsigned char *config;
+	struct decoder_handle *dec;
+	struct demux_handle *demux;
+	unsigned long samplerate;
+	unsigned char channels;
+	unsigned long allocs;
+	size_t config_size;
+	uint64_t start;
+	int idle = 0;
+	int samples;
+	size_t pos;
+	int codec;
+	int count;
+	int i;
+
+	allocs = alloc_count;
+
+	/* Open demuxer (without thread) */
+	if(demux_open(&demux, file, &samplerate, &channels, DEMUX_CACHE_SIZE,
+		      0, 0) != 0)
+		return -1;
+
+	/* Open decoder */
+	if(demux_get_dec_config(demux, &codec, &config, &config_size) != 0 ||
+	   decoder_open(&dec, codec, config, config_size, &res->samplerate,
+			&res->channels) != 0)
+	{
+		demux_close(demux);
+		return -1;
+	}
+	res->codec = bench_codec_name(codec);
+
+	/* Decode all frames: only decoder calls are timed */
+	while(idle < MAX_IDLE)
+	{
+		count = demux_get_frames(demux, frames, BATCH_FRAMES, &pos);
+		if(count < 0)
+			break;
+		if(count == 0)
+		{
+			idle++;
+			continue;
+		}
+		idle = 0;
+
+		/* Prepare frame list */
+		for(i = 0; i < count; i++)
+		{
+			list[i].data = frames[i]->data;
+			list[i].len = frames[i]->len;
+		}
+		list[0].data += pos;
+		list[0].len -= pos;
+
+		/* Decode frames */
+		info.samplerate = 0;
+		info.channels = 0;
+		start = bench_now();
+		samples = decoder_decode_batch(dec, list, count, output,
+					       OUTPUT_SIZE, &info);
+		res->decode.ns += bench_now() - start;
+		bench_account(res, &info, samples);
+		res->decode.frames += info.frames;
+
+		/* Skip frame when decoder is stuck on it */
+		if(samples <= 0 && info.frames == 0 && info.used == 0)
+			info.frames = 1;
+		demux_set_used_frames(demux, info.frames, info.used);
+	}
+
+	/* Get remaining samples */
+	do {
+		info.samplerate = 0;
+		info.channels = 0;
+		start = bench_now();
+		samples = decoder_decode_batch(dec, NULL, 0, output,
+					       OUTPUT_SIZE, &info);
+		res->decode.ns += bench_now() - start;
+		bench_account(res, &info, samples);
+	} while(samples > 0);
+
+	decoder_close(dec);
+	demux_close(demux);
+	res->decode.allocs = alloc_count - allocs;
+	res->decode.peak_rss = bench_peak_rss();
+
+	return 0;
+}
+
+static int bench_demux_file(const char *file, struct bench_result *res)
+{
+	struct demux_handle *demux;
+	unsigned long samplerate;
+	unsigned char channels;
+	unsigned char *frame;
+	unsigned long allocs;
+	uint64_t start;
+	int idle = 0;
+	ssize_t len;
+
+	allocs = alloc_count;
+	start = bench_now();
+
+	/* Open demuxer (without thread) */
+	if(demux_open(&demux, file, &samplerate, &channels, DEMUX_CACHE_SIZE,
+		      0, 0) != 0)
+		return -1;
+
+	/* Parse all frames */
+	while(idle < MAX_IDLE)
+	{
+		len = demux_get_next_frame(demux, &frame);
+		if(len < 0)
+			break;
+		if(len == 0)
+		{
+			idle++;
+			continue;
+		}
+		idle = 0;
+		res->demux.frames++;
+	}
+
+	demux_close(demux);
+	res->demux.ns = bench_now() - start;
+	res->demux.allocs = alloc_count - allocs;
+	res->demux.peak_rss = bench_peak_rss();
+
+	return 0;
+}
+
+static int bench_file(const char *file, int runs, struct bench_result *res)
+{
+	struct bench_result run;
+	int ret = 0;
+	int i;
+
+	memset(res, 0, sizeof(struct bench_result));
+	res->file = file;
+
+	for(i = 0; i < runs; i++)
+	{
+		memset(&run, 0, sizeof(struct bench_result));
+		run.file = file;
+
+		/* Decoder pass */
+		if(bench_is_wav(file))
+			ret = bench_decode_pcm(file, &run);
+		else
+			ret = bench_decode_file(file, &run);
+		if(ret != 0)
+			return -1;
+
+		/* Demuxer pass */
+		if(!bench_is_wav(file) && bench_demux_file(file, &run) != 0)
+			return -1;
+
+		/* Keep the fastest run */
+		if(i == 0 || run.decode.ns < res->decode.ns)
+			res->decode = run.decode;
+		if(i == 0 || run.demux.ns < res->demux.ns)
+			res->demux = run.demux;
+		res->codec = run.codec;
+		res->samplerate = run.samplerate;
+		res->channels = run.channels;
+		res->samples = run.samples;
+		res->duration = run.duration;
+	}
+
+	return 0;
+}
+
+static double bench_realtime(const struct bench_result *res,
+			     const struct bench_pass *pass)
+{
+	return pass->ns > 0 ? res->duration * 1e9 / pass->ns : 0;
+}
+
+static double bench_ns_per_sample(const struct bench_result *res,
+				  const struct bench_pass *pass)
+{
+	return res->samples > 0 ? (double) pass->ns / res->samples : 0;
+}
+
+static double bench_allocs_per_frame(const struct bench_pass *pass)
+{
+	return pass->frames > 0 ? (double) pass->allocs / pass->frames : 0;
+}
+
+static const char *bench_allocs(const struct bench_pass *pass, char *buf,
+				size_t len, const char *fmt, const char *unknown)
+{
+	/* Allocations are not counted */
+	if(!BENCH_ALLOCS)
+		return unknown;
+
+	snprintf(buf, len, fmt, bench_allocs_per_frame(pass));
+	return buf;
+}
+
+static void bench_print_text(const struct bench_result *res)
+{
+	char buf[32];
+
+	printf("%s: %s, %lu Hz, %u channels, %.2f s\n", res->file, res->codec,
+	       res->samplerate, res->channels, res->duration);
+	printf("  decode: %8.1fx realtime, %8.2f ns/sample, %8ld kB peak RSS,"
+	       " %6s allocs/frame (%lu frames)\n",
+	       bench_realtime(res, &res->decode),
+	       bench_ns_per_sample(res, &res->decode), res->decode.peak_rss,
+	       bench_allocs(&res->decode, buf, sizeof(buf), "%.2f", "n/a"),
+	       res->decode.frames);
+	if(res->demux.frames > 0)
+		printf("  demux:  %8.1fx realtime, %8.2f ns/sample, %8ld kB "
+		       "peak RSS, %6s allocs/frame (%lu frames)\n",
+		       bench_realtime(res, &res->demux),
+		       bench_ns_per_sample(res, &res->demux),
+		       res->demux.peak_rss,
+		       bench_allocs(&res->demux, buf, sizeof(buf), "%.2f",
+				    "n/a"),
+		       res->demux.frames);
+}
+
+static void bench_print_json_string(const char *str)
+{
+	putchar('"');
+	for(; *str != '\0'; str++)
+	{
+		if(*str == '"' || *str == '\\')
+			printf("\\%c", *str);
+		else if((unsigned char) *str < 0x20)
+			printf("\\u%04x", *str);
+		else
+			putchar(*str);
+	}
+	putchar('"');
+}
+
+static void bench_print_json_pass(const char *name,
+				  const struct bench_result *res,
+				  const struct bench_pass *pass)
+{
+	char buf[32];
+
+	printf("\"%s\": {\"realtime\": %.3f, \"ns_per_sample\": %.3f, "
+	       "\"peak_rss_kb\": %ld, \"allocs_per_frame\": %s, "
+	       "\"frames\": %lu, \"ns\": %llu}", name,
+	       bench_realtime(res, pass), bench_ns_per_sample(res, pass),
+	       pass->peak_rss,
+	       bench_allocs(pass, buf, sizeof(buf), "%.3f", "null"),
+	       pass->frames, (unsigned long long) pass->ns);
+}
+
+static void bench_print_json(const struct bench_result *res, int first)
+{
+	printf("%s\n    {\"file\": ", first ? "" : ",");
+	bench_print_json_string(res->file);
+	printf(", \"codec\": \"%s\", \"samplerate\": %lu, \"channels\": %u, "
+	       "\"samples\": %llu, \"duration\": %.3f,\n     ",
+	       res->codec, res->samplerate, res->channels, res->samples,
+	       res->duration);
+	bench_print_json_pass("decode", res, &res->decode);
+	if(res->demux.frames > 0)
+	{
+		printf(",\n     ");
+		bench_print_json_pass("demux", res, &res->demux);
+	}
+	printf("}");
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-j] [-n runs] file...\n"
+			"  -j       print results in JSON\n"
+			"  -n runs  keep fastest of several runs (default: 1)\n",
+		name);
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench_result res;
+	int json = 0;
+	int runs = 1;
+	int count = 0;
+	int ret = 0;
+	int opt;
+	int i;
+
+	/* Parse options */
+	while((opt = getopt(argc, argv, "jn:h")) != -1)
+	{
+		switch(opt)
+		{
+			case 'j':
+				json = 1;
+				break;
+			case 'n':
+				runs = atoi(optarg);
+				if(runs > 0)
+					break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if(optind >= argc)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	if(json)
+	{
+#ifdef USE_FLOAT
+		printf("{\"version\": \"%s\", \"sample\": \"float\", ", VERSION);
+#else
+		printf("{\"version\": \"%s\", \"sample\": \"s32\", ", VERSION);
+#endif
+		printf("\"runs\": %d, \"results\": [", runs);
+	}
+
+	/* Benchmark all files */
+	for(i = optind; i < argc; i++)
+	{
+		if(bench_file(argv[i], runs, &res) != 0)
+		{
+			fprintf(stderr, "%s: failed to decode file\n", argv[i]);
+			ret = 1;
+			continue;
+		}
+
+		if(json)
+			bench_print_json(&res, count == 0);
+		else
+			bench_print_text(&res);
+		count++;
+	}
+
+	if(json)
+		printf("\n]}\n");
+
+	return ret;
+}
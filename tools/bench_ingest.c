@@ -0,0 +1,1080 @@
+/*
+ * bench_ingest.c - Load generator for stream ingest (ICY and RTP)
+ *
+ * Serve synthetic streams and drive concurrent ingest sessions of aircat in
+ * this process, with the same components as the radio and AirTunes modules:
+ *  - ICY: a Shoutcast server on loopback sends silent MP3 frames (48 kHz,
+ *    stereo) at the given bitrate, with ICY metadata every metaint bytes and
+ *    a new title at each metadata period. A link can start slowly (rate ramps
+ *    up from 10%), stall periodically or send a burst on connect. Each session
+ *    opens the stream with shoutcast_open() and reads it at playback rate as
+ *    the mixer does.
+ *  - RTP: a sender emits RAOP-style packets (payload 0x60, 352 frames of
+ *    44.1 kHz stereo) with controlled jitter, loss and reordering. Each session
+ *    reads its RTP receiver (jitter buffer) at packet rate as the RAOP module
+ *    does. Payloads are not decoded.
+ * For each session type, it reports the time to first audio, the buffering
+ * events and underruns during playback, the input data rate and the CPU used
+ * by each session thread (all ingest work of a session is done in its thread).
+ * With -x, only the ICY server runs, to load a running aircat.
+ *
+ * Usage: bench_ingest [-j] [-x] [-n icy] [-r rtp] [-d duration] [options]
+ *  -j: print results in JSON,
+ *  -x: only serve ICY streams on http://127.0.0.1:port/N,
+ * see usage() for other options.
+ *
+ * Copyright (c) 2014   A. Dilly
+ *
+ * AirCat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * AirCat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with AirCat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "shoutcast.h"
+#include "rtp.h"
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef VERSION
+#define VERSION "unknown"
+#endif
+
+#define LOAD(v) __atomic_load_n(&(v), __ATOMIC_ACQUIRE)
+#define STORE(v, x) __atomic_store_n(&(v), x, __ATOMIC_RELEASE)
+#define ADD(v, x) __atomic_add_fetch(&(v), x, __ATOMIC_RELAXED)
+#define SUB(v, x) __atomic_sub_fetch(&(v), x, __ATOMIC_RELEASE)
+
+/* Synthetic MP3 stream: MPEG-1 layer III at 48 kHz, so a frame of 1152
+ * samples (24 ms) is exactly 3 bytes per kbit/s without padding */
+#define MP3_FRAME_SIZE(br) ((br) * 3)
+/* Period of ICY server sends (in ms) */
+#define ICY_TICK 10
+/* Maximum metadata block (length byte is in 16 bytes units) */
+#define ICY_META_SIZE (255 * 16)
+
+/* RAOP-style RTP stream */
+#define RTP_PAYLOAD 0x60
+#define RTP_SAMPLERATE 44100
+#define RTP_FRAMES 352
+#define RTP_PACKET_SIZE (RTP_HEADER_SIZE + RTP_FRAMES * 4)
+/* Packets held by sender for jitter and reordering */
+#define RTP_PENDING 256
+
+/* Frames read by a session at each period (as a mixer period) */
+#define READ_FRAMES 1024
+/* Wait between two reads before first audio and maximum tune in (in ms) */
+#define TUNE_WAIT 5
+#define TUNE_TIMEOUT 30000
+
+struct ingest_config {
+	/* Sessions */
+	unsigned int icy_sessions;
+	unsigned int rtp_sessions;
+	unsigned long duration;		/* Playback duration (in ms) */
+	unsigned long interval;		/* Delay between session starts */
+	/* ICY stream */
+	unsigned int port;
+	unsigned int bitrate;		/* In kbit/s */
+	unsigned long metaint;		/* 0 to disable metadata */
+	unsigned long meta_period;	/* Title change period (in ms) */
+	unsigned long burst;		/* Audio sent on connect (in ms) */
+	unsigned long slow_start;	/* Rate ramp up duration (in ms) */
+	unsigned long stall_period;	/* Link stalls each period (in ms) */
+	unsigned long stall_length;	/*  for this length (in ms) */
+	unsigned long cache;		/* Cache of sessions (in s) */
+	/* RTP stream */
+	unsigned int rtp_port;
+	unsigned long jitter;		/* Maximum added delay (in ms) */
+	unsigned int loss;		/* Lost packets (in %) */
+	unsigned int reorder;		/* Late packets (in %) */
+	unsigned long delay;		/* Jitter buffer delay (in ms) */
+};
+
+struct ingest_session {
+	const char *type;
+	unsigned int id;
+	pthread_t thread;
+	int started;
+	int failed;
+	/* Times (in ns) */
+	uint64_t start;
+	uint64_t first_audio;
+	uint64_t end;
+	uint64_t cpu;
+	/* Playback */
+	unsigned long buffering;
+	unsigned long underruns;
+	unsigned long long frames;
+	/* Input data sent by generator (in bytes) */
+	unsigned long long in_bytes;
+	/* RTP receiver and sender */
+	struct rtp_handle *rtp;
+	pthread_t sender;
+	int sender_started;
+	uint64_t first_packet;
+	unsigned long sent;
+	unsigned long dropped;
+	struct rtp_stats stats;
+};
+
+struct ingest_pending {
+	uint64_t due;
+	size_t len;
+	unsigned char packet[RTP_PACKET_SIZE];
+};
+
+static struct ingest_config cfg = {
+	.icy_sessions = 4,
+	.duration = 10000,
+	.port = 8100,
+	.bitrate = 128,
+	.metaint = 16000,
+	.meta_period = 5000,
+	.rtp_port = 6100,
+	.delay = 100,
+};
+static struct ingest_session *sessions = NULL;
+static int json = 0;
+static int stop = 0;
+/* Connections served by ICY server */
+static int icy_conns = 0;
+
+static uint64_t ingest_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t ingest_thread_cpu(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void ingest_sleep_until(uint64_t t)
+{
+	struct timespec ts;
+
+	ts.tv_sec = t / 1000000000ULL;
+	ts.tv_nsec = t % 1000000000ULL;
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0);
+}
+
+static void ingest_sleep(unsigned long ms)
+{
+	ingest_sleep_until(ingest_now() + ms * 1000000ULL);
+}
+
+/******************************************************************************
+ *                                ICY server                                  *
+ ******************************************************************************/
+
+static int mp3_bitrate_index(unsigned int bitrate)
+{
+	static const unsigned int bitrates[] = {
+		0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320
+	};
+	int i;
+
+	/* Index of bitrate in MPEG-1 layer III frame header */
+	for(i = 1; i < (int) (sizeof(bitrates) / sizeof(*bitrates)); i++)
+		if(bitrates[i] == bitrate)
+			return i;
+
+	return -1;
+}
+
+struct icy_conn {
+	int sock;
+	struct ingest_session *s;
+	unsigned long meta_remaining;
+	unsigned int title;
+	unsigned int meta_sent;
+};
+
+static int icy_send(int sock, const unsigned char *buffer, size_t len)
+{
+	ssize_t ret;
+
+	while(len > 0)
+	{
+		ret = send(sock, buffer, len, MSG_NOSIGNAL);
+		if(ret <= 0)
+			return -1;
+		buffer += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static int icy_send_meta(struct icy_conn *c)
+{
+	unsigned char meta[ICY_META_SIZE + 1];
+	size_t len;
+
+	/* Send title only when it has changed */
+	memset(meta, 0, sizeof(meta));
+	if(c->title == c->meta_sent)
+		return icy_send(c->sock, meta, 1);
+	c->meta_sent = c->title;
+
+	/* Length is given in 16 bytes blocks */
+	len = snprintf((char *) &meta[1], ICY_META_SIZE,
+		       "StreamTitle='Synthetic title %u';", c->title);
+	meta[0] = (len + 15) / 16;
+
+	return icy_send(c->sock, meta, meta[0] * 16 + 1);
+}
+
+static int icy_send_audio(struct icy_conn *c, const unsigned char *buffer,
+			  size_t len)
+{
+	size_t size;
+
+	/* No metadata */
+	if(c->meta_remaining == 0)
+		return icy_send(c->sock, buffer, len);
+
+	/* Insert metadata every metaint bytes */
+	while(len > 0)
+	{
+		size = len < c->meta_remaining ? len : c->meta_remaining;
+		if(icy_send(c->sock, buffer, size) != 0)
+			return -1;
+		buffer += size;
+		len -= size;
+		c->meta_remaining -= size;
+
+		if(c->meta_remaining == 0)
+		{
+			if(icy_send_meta(c) != 0)
+				return -1;
+			c->meta_remaining = cfg.metaint;
+		}
+	}
+
+	return 0;
+}
+
+static int icy_read_request(struct icy_conn *c, int *metadata,
+			    unsigned int *id)
+{
+	char buffer[2048];
+	size_t len = 0;
+	ssize_t ret;
+	char *p;
+
+	/* Read request until end of header */
+	while(len < sizeof(buffer) - 1)
+	{
+		ret = recv(c->sock, &buffer[len], sizeof(buffer) - len - 1, 0);
+		if(ret <= 0)
+			return -1;
+		len += ret;
+		buffer[len] = '\0';
+		if(strstr(buffer, "\r\n\r\n") != NULL)
+			break;
+	}
+
+	/* Get stream number from URL: "GET /N" */
+	if(strncmp(buffer, "GET /", 5) != 0)
+		return -1;
+	*id = strtoul(&buffer[5], NULL, 10);
+
+	/* Client wants metadata */
+	p = strcasestr(buffer, "icy-metadata:");
+	*metadata = p != NULL && atoi(p + 13) == 1;
+
+	return 0;
+}
+
+static void *icy_serve(void *user_data)
+{
+	unsigned char frame[MP3_FRAME_SIZE(320)];
+	struct icy_conn *c = user_data;
+	unsigned long long sent = 0;
+	unsigned int id = 0;
+	char header[512];
+	uint64_t start, t, ms;
+	double budget, rate;
+	size_t frame_size;
+	int metadata;
+	int len;
+
+	/* Build a silent frame: header (no CRC, 48 kHz, stereo) and an empty
+	 * side information */
+	frame_size = MP3_FRAME_SIZE(cfg.bitrate);
+	memset(frame, 0, sizeof(frame));
+	frame[0] = 0xFF;
+	frame[1] = 0xFB;
+	frame[2] = (mp3_bitrate_index(cfg.bitrate) << 4) | (1 << 2);
+	frame[3] = 0x00;
+
+	/* Parse request and send ICY header */
+	if(icy_read_request(c, &metadata, &id) != 0)
+		goto end;
+	if(sessions != NULL && id < cfg.icy_sessions)
+		c->s = &sessions[id];
+	len = snprintf(header, sizeof(header),
+		       "ICY 200 OK\r\n"
+		       "icy-name: bench_ingest %u\r\n"
+		       "icy-genre: Synthetic\r\n"
+		       "icy-pub: 0\r\n"
+		       "icy-br: %u\r\n"
+		       "content-type: audio/mpeg\r\n", id, cfg.bitrate);
+	if(metadata && cfg.metaint > 0)
+	{
+		len += snprintf(&header[len], sizeof(header) - len,
+				"icy-metaint: %lu\r\n", cfg.metaint);
+		c->meta_remaining = cfg.metaint;
+		c->meta_sent = ~0U;
+	}
+	len += snprintf(&header[len], sizeof(header) - len, "\r\n");
+	if(icy_send(c->sock, (unsigned char *) header, len) != 0)
+		goto end;
+
+	/* Send audio at stream bitrate (in bytes per ms) */
+	rate = cfg.bitrate / 8.0;
+	budget = cfg.burst * rate;
+	start = ingest_now();
+	for(t = start; !LOAD(stop); t += ICY_TICK * 1000000ULL)
+	{
+		ingest_sleep_until(t);
+		ms = (t - start) / 1000000ULL;
+
+		/* Link stalls for a while in each period */
+		if(cfg.stall_period > 0 && ms >= cfg.stall_period &&
+		   ms % cfg.stall_period < cfg.stall_length)
+			continue;
+
+		/* Rate ramps up from 10% during slow start */
+		if(ms < cfg.slow_start)
+			budget += ICY_TICK * rate *
+				  (0.1 + 0.9 * ms / cfg.slow_start);
+		else
+			budget += ICY_TICK * rate;
+
+		/* Change title */
+		if(cfg.meta_period > 0)
+			c->title = ms / cfg.meta_period;
+
+		/* Send whole frames */
+		for(; budget >= frame_size; budget -= frame_size)
+		{
+			if(icy_send_audio(c, frame, frame_size) != 0)
+				goto end;
+			sent += frame_size;
+		}
+		if(c->s != NULL)
+			STORE(c->s->in_bytes, sent);
+	}
+
+end:
+	close(c->sock);
+	free(c);
+	SUB(icy_conns, 1);
+
+	return NULL;
+}
+
+static void *icy_server(void *user_data)
+{
+	int sock = *(int *) user_data;
+	struct pollfd pfd;
+	struct icy_conn *c;
+	pthread_t thread;
+	int fd;
+
+	/* Accept connections until end */
+	pfd.fd = sock;
+	pfd.events = POLLIN;
+	while(!LOAD(stop))
+	{
+		if(poll(&pfd, 1, 100) <= 0)
+			continue;
+		fd = accept(sock, NULL, NULL);
+		if(fd < 0)
+			continue;
+
+		/* Serve stream in its own thread */
+		c = calloc(1, sizeof(*c));
+		if(c == NULL)
+		{
+			close(fd);
+			continue;
+		}
+		c->sock = fd;
+		ADD(icy_conns, 1);
+		if(pthread_create(&thread, NULL, icy_serve, c) != 0)
+		{
+			SUB(icy_conns, 1);
+			close(fd);
+			free(c);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+
+	return NULL;
+}
+
+static int icy_listen(unsigned int port)
+{
+	struct sockaddr_in addr;
+	int sock;
+	int opt = 1;
+
+	/* Open a TCP server on loopback */
+	sock = socket(AF_INET, SOCK_STREAM, 0);
+	if(sock < 0)
+		return -1;
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if(bind(sock, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+	   listen(sock, 128) != 0)
+	{
+		close(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+/******************************************************************************
+ *                                ICY session                                 *
+ ******************************************************************************/
+
+static void icy_event(void *user_data, enum shoutcast_event event, void *data)
+{
+	struct ingest_session *s = user_data;
+
+	/* Cache is starved during playback */
+	if(event == SHOUT_EVENT_BUFFERING && s->first_audio != 0)
+		s->buffering++;
+}
+
+static void *icy_session(void *user_data)
+{
+	struct ingest_session *s = user_data;
+	struct a_format fmt = A_FORMAT_INIT;
+	struct shout_handle *shout;
+	unsigned char *buffer;
+	unsigned long samplerate;
+	unsigned char channels;
+	uint64_t cpu, next, end;
+	char url[64];
+	int len;
+
+	cpu = ingest_thread_cpu();
+	s->start = ingest_now();
+
+	/* Tune in as radio module does */
+	snprintf(url, sizeof(url), "http://127.0.0.1:%u/%u", cfg.port, s->id);
+	if(shoutcast_open(&shout, url, cfg.cache, 0) != 0)
+	{
+		shoutcast_close(shout);
+		s->failed = 1;
+		return NULL;
+	}
+	shoutcast_set_event_cb(shout, icy_event, s);
+	samplerate = shoutcast_get_samplerate(shout);
+	channels = shoutcast_get_channels(shout);
+	if(samplerate == 0 || channels == 0)
+		goto fail;
+
+	buffer = malloc(READ_FRAMES * channels * 4);
+	if(buffer == NULL)
+		goto fail;
+
+	/* Read at playback rate until end of test */
+	end = next = 0;
+	while(!LOAD(stop) && (end == 0 || next < end))
+	{
+		len = shoutcast_read(shout, buffer, READ_FRAMES * channels,
+				     &fmt);
+		if(len < 0)
+			break;
+
+		/* Wait for first audio */
+		if(s->first_audio == 0)
+		{
+			if(len == 0)
+			{
+				if(ingest_now() - s->start >=
+				   TUNE_TIMEOUT * 1000000ULL)
+					break;
+				ingest_sleep(TUNE_WAIT);
+				continue;
+			}
+			s->first_audio = ingest_now();
+			next = s->first_audio;
+			end = next + cfg.duration * 1000000ULL;
+		}
+
+		/* Mixer gets less than a period */
+		if(len < READ_FRAMES * channels)
+			s->underruns++;
+
+		/* Wait next period */
+		s->frames += len / channels;
+		next += READ_FRAMES * 1000000000ULL / samplerate;
+		ingest_sleep_until(next);
+	}
+	s->end = ingest_now();
+	s->cpu = ingest_thread_cpu() - cpu;
+
+	free(buffer);
+	shoutcast_close(shout);
+
+	return NULL;
+
+fail:
+	s->failed = 1;
+	shoutcast_close(shout);
+	return NULL;
+}
+
+/******************************************************************************
+ *                                RTP sender                                  *
+ ******************************************************************************/
+
+static void *rtp_sender(void *user_data)
+{
+	struct ingest_session *s = user_data;
+	struct ingest_pending *pending;
+	struct sockaddr_in addr;
+	unsigned int seed = s->id + 1;
+	unsigned int count = 0;
+	uint64_t start, next, due;
+	uint16_t seq;
+	uint32_t ts, ssrc;
+	int sock;
+	int i, j;
+
+	/* Open socket to session receiver */
+	pending = calloc(RTP_PENDING, sizeof(*pending));
+	sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if(pending == NULL || sock < 0)
+		goto end;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(cfg.rtp_port + s->id * 2);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	/* Random start of stream */
+	seq = rand_r(&seed);
+	ts = rand_r(&seed);
+	ssrc = rand_r(&seed);
+
+	start = next = ingest_now();
+	STORE(s->first_packet, start);
+	while(!LOAD(stop))
+	{
+		/* Queue packets which are due */
+		for(; next <= ingest_now(); next = start + (uint64_t) s->sent *
+		    RTP_FRAMES * 1000000000ULL / RTP_SAMPLERATE)
+		{
+			s->sent++;
+			seq++;
+			ts += RTP_FRAMES;
+
+			/* Lost packet */
+			if(rand_r(&seed) % 100 < cfg.loss)
+			{
+				s->dropped++;
+				continue;
+			}
+
+			/* Add jitter, and two packets of delay when late */
+			due = next;
+			if(cfg.jitter > 0)
+				due += (uint64_t) (rand_r(&seed) %
+					(cfg.jitter * 1000)) * 1000ULL;
+			if(rand_r(&seed) % 100 < cfg.reorder)
+				due += 2ULL * RTP_FRAMES * 1000000000ULL /
+				       RTP_SAMPLERATE;
+
+			/* Queue is full: send oldest packet now */
+			if(count == RTP_PENDING)
+			{
+				sendto(sock, pending[0].packet, pending[0].len,
+				       0, (struct sockaddr *) &addr,
+				       sizeof(addr));
+				memmove(pending, &pending[1],
+					--count * sizeof(*pending));
+			}
+
+			/* Build a RAOP packet with a silent payload */
+			pending[count].due = due;
+			pending[count].len = RTP_PACKET_SIZE;
+			memset(pending[count].packet, 0, RTP_PACKET_SIZE);
+			rtp_set_header(pending[count].packet, RTP_PAYLOAD,
+				       s->sent == 1, seq, ts, ssrc);
+			count++;
+		}
+
+		/* Send packets after their delay */
+		due = next;
+		for(i = 0, j = 0; i < (int) count; i++)
+		{
+			if(pending[i].due <= ingest_now())
+			{
+				sendto(sock, pending[i].packet, pending[i].len,
+				       0, (struct sockaddr *) &addr,
+				       sizeof(addr));
+				ADD(s->in_bytes, pending[i].len);
+				continue;
+			}
+			if(pending[i].due < due)
+				due = pending[i].due;
+			if(i != j)
+				pending[j] = pending[i];
+			j++;
+		}
+		count = j;
+
+		/* Wait for next packet or next delayed packet */
+		ingest_sleep_until(due);
+	}
+
+end:
+	if(sock >= 0)
+		close(sock);
+	free(pending);
+
+	return NULL;
+}
+
+/******************************************************************************
+ *                                RTP session                                 *
+ ******************************************************************************/
+
+static int rtp_session_open(struct ingest_session *s)
+{
+	struct rtp_attr attr;
+
+	/* Open receiver as RAOP module does */
+	memset(&attr, 0, sizeof(attr));
+	attr.port = cfg.rtp_port + s->id * 2;
+	attr.payload = RTP_PAYLOAD;
+	attr.max_packet_size = RTP_PACKET_SIZE;
+	attr.pool_packet_count = 1000UL * RTP_SAMPLERATE / RTP_FRAMES / 1000;
+	attr.delay_packet_count = cfg.delay * RTP_SAMPLERATE / RTP_FRAMES /
+				  1000;
+	if(attr.delay_packet_count == 0)
+		attr.delay_packet_count = 1;
+	attr.clock_rate = RTP_SAMPLERATE;
+	attr.fill_ratio = 5;
+
+	return rtp_open(&s->rtp, &attr);
+}
+
+static void *rtp_session(void *user_data)
+{
+	unsigned char packet[RTP_PACKET_SIZE];
+	struct ingest_session *s = user_data;
+	uint64_t cpu, next, end;
+	int buffering = 0;
+	ssize_t len;
+
+	cpu = ingest_thread_cpu();
+	s->start = ingest_now();
+
+	/* Start sender */
+	if(pthread_create(&s->sender, NULL, rtp_sender, s) != 0)
+	{
+		s->failed = 1;
+		return NULL;
+	}
+	s->sender_started = 1;
+
+	/* Read a packet at each packet period */
+	next = s->start;
+	end = 0;
+	while(!LOAD(stop) && (end == 0 || next < end))
+	{
+		do
+		{
+			len = rtp_read(s->rtp, packet, sizeof(packet));
+		} while(len == RTP_DISCARDED_PACKET);
+
+		if(s->first_audio == 0)
+		{
+			/* Jitter buffer is filling */
+			if(len <= 0)
+			{
+				if(next - s->start >= TUNE_TIMEOUT * 1000000ULL)
+					break;
+				next += RTP_FRAMES * 1000000000ULL /
+					RTP_SAMPLERATE;
+				ingest_sleep_until(next);
+				continue;
+			}
+			s->first_audio = ingest_now();
+			s->start = LOAD(s->first_packet);
+			end = s->first_audio + cfg.duration * 1000000ULL;
+		}
+
+		/* Lost packet is replaced by a silence, and jitter buffer
+		 * refills when it is empty */
+		if(len == RTP_LOST_PACKET)
+			s->underruns++;
+		else if(len == RTP_NO_PACKET && !buffering)
+			s->buffering++;
+		buffering = len == RTP_NO_PACKET;
+
+		s->frames += RTP_FRAMES;
+		next += RTP_FRAMES * 1000000000ULL / RTP_SAMPLERATE;
+		ingest_sleep_until(next);
+	}
+	s->end = ingest_now();
+	s->cpu = ingest_thread_cpu() - cpu;
+	rtp_get_stats(s->rtp, &s->stats);
+
+	return NULL;
+}
+
+/******************************************************************************
+ *                                  Report                                    *
+ ******************************************************************************/
+
+static int ingest_cmp(const void *a, const void *b)
+{
+	double da = *(const double *) a, db = *(const double *) b;
+
+	return da < db ? -1 : (da > db ? 1 : 0);
+}
+
+static void ingest_report(const char *type, struct ingest_session *s,
+			  unsigned int count, int first)
+{
+	double ttfa[count > 0 ? count : 1];
+	double sum = 0, cpu = 0, cpu_max = 0, rate = 0, load;
+	unsigned long buffering = 0, underruns = 0;
+	unsigned long sent = 0, received = 0, lost = 0;
+	unsigned int i, ok = 0, failed = 0;
+	double play;
+
+	/* Gather sessions which played */
+	for(i = 0; i < count; i++)
+	{
+		if(s[i].failed || s[i].first_audio == 0)
+		{
+			failed++;
+			continue;
+		}
+		ttfa[ok] = (s[i].first_audio - s[i].start) / 1e6;
+		sum += ttfa[ok++];
+		buffering += s[i].buffering;
+		underruns += s[i].underruns;
+		sent += s[i].sent;
+		received += s[i].stats.received;
+		lost += s[i].stats.lost;
+
+		/* Input rate and CPU load of session thread */
+		play = (s[i].end - s[i].start) / 1e9;
+		if(play > 0)
+		{
+			rate += s[i].in_bytes * 8 / play / 1000;
+			load = s[i].cpu / 1e9 / play * 100;
+			cpu += load;
+			if(load > cpu_max)
+				cpu_max = load;
+		}
+	}
+	if(count == 0)
+		return;
+	qsort(ttfa, ok, sizeof(*ttfa), ingest_cmp);
+	if(ok == 0)
+		ttfa[0] = 0;
+
+	if(!json)
+	{
+		printf("%-4s %u sessions, %u failed\n", type, count, failed);
+		if(ok == 0)
+			return;
+		printf("     time to first audio: min %.1f ms, avg %.1f ms, "
+		       "p95 %.1f ms, max %.1f ms\n", ttfa[0], sum / ok,
+		       ttfa[(ok - 1) * 95 / 100], ttfa[ok - 1]);
+		printf("     buffering events: %lu, underruns: %lu\n",
+		       buffering, underruns);
+		printf("     input: %.1f kbit/s per session, %.1f kbit/s "
+		       "total\n", rate / ok, rate);
+		printf("     session CPU: avg %.2f%%, max %.2f%%\n", cpu / ok,
+		       cpu_max);
+		if(strcmp(type, "rtp") == 0)
+			printf("     packets: %lu sent, %lu received, %lu "
+			       "lost\n", sent, received, lost);
+		return;
+	}
+
+	printf("%s\n    {\"type\": \"%s\", \"sessions\": %u, \"failed\": %u",
+	       first ? "" : ",", type, count, failed);
+	if(ok > 0)
+		printf(", \"ttfa_ms\": {\"min\": %.3f, \"avg\": %.3f, "
+		       "\"p95\": %.3f, \"max\": %.3f}, \"buffering\": %lu, "
+		       "\"underruns\": %lu, \"kbps\": %.3f, \"cpu\": %.4f, "
+		       "\"cpu_max\": %.4f", ttfa[0], sum / ok,
+		       ttfa[(ok - 1) * 95 / 100], ttfa[ok - 1], buffering,
+		       underruns, rate / ok, cpu / ok / 100, cpu_max / 100);
+	if(ok > 0 && strcmp(type, "rtp") == 0)
+		printf(", \"sent\": %lu, \"received\": %lu, \"lost\": %lu",
+		       sent, received, lost);
+	printf("}");
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-j] [-x] [options]\n"
+			"  -j             print results in JSON\n"
+			"  -x             only serve ICY streams "
+			"(for a running aircat)\n"
+			"  -n count       ICY sessions (default: 4)\n"
+			"  -r count       RTP sessions (default: 0)\n"
+			"  -d duration    playback of each session in s "
+			"(default: 10, 0 with -x: no end)\n"
+			"  -i interval    delay between session starts in ms\n"
+			"ICY streams:\n"
+			"  -p port        server port (default: 8100)\n"
+			"  -b bitrate     MP3 bitrate in kbit/s "
+			"(default: 128)\n"
+			"  -m metaint     icy-metaint in bytes, 0 to disable "
+			"(default: 16000)\n"
+			"  -M period      title change period in ms "
+			"(default: 5000)\n"
+			"  -B burst       audio sent on connect in ms\n"
+			"  -s ramp        slow start duration in ms\n"
+			"  -S period:len  link stalls len ms each period ms\n"
+			"  -c cache       cache of sessions in s\n"
+			"RTP streams:\n"
+			"  -P port        first receiver port (default: 6100)\n"
+			"  -J jitter      maximum jitter in ms\n"
+			"  -l loss        lost packets in %%\n"
+			"  -o reorder     late packets in %%\n"
+			"  -D delay       jitter buffer delay in ms "
+			"(default: 100)\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int count, i;
+	pthread_t server;
+	int serve_only = 0;
+	int sock;
+	int opt;
+	char *p;
+
+	/* Parse options */
+	while((opt = getopt(argc, argv,
+			    "jxn:r:d:i:p:b:m:M:B:s:S:c:P:J:l:o:D:h")) != -1)
+	{
+		switch(opt)
+		{
+			case 'j':
+				json = 1;
+				break;
+			case 'x':
+				serve_only = 1;
+				break;
+			case 'n':
+				cfg.icy_sessions = strtoul(optarg, NULL, 10);
+				break;
+			case 'r':
+				cfg.rtp_sessions = strtoul(optarg, NULL, 10);
+				break;
+			case 'd':
+				cfg.duration = strtoul(optarg, NULL, 10) * 1000;
+				break;
+			case 'i':
+				cfg.interval = strtoul(optarg, NULL, 10);
+				break;
+			case 'p':
+				cfg.port = strtoul(optarg, NULL, 10);
+				break;
+			case 'b':
+				cfg.bitrate = strtoul(optarg, NULL, 10);
+				if(mp3_bitrate_index(cfg.bitrate) > 0)
+					break;
+				fprintf(stderr, "Bad MP3 bitrate: %s\n",
+					optarg);
+				return 1;
+			case 'm':
+				cfg.metaint = strtoul(optarg, NULL, 10);
+				break;
+			case 'M':
+				cfg.meta_period = strtoul(optarg, NULL, 10);
+				break;
+			case 'B':
+				cfg.burst = strtoul(optarg, NULL, 10);
+				break;
+			case 's':
+				cfg.slow_start = strtoul(optarg, NULL, 10);
+				break;
+			case 'S':
+				cfg.stall_period = strtoul(optarg, &p, 10);
+				if(*p == ':')
+					cfg.stall_length = strtoul(p + 1, NULL,
+								   10);
+				if(cfg.stall_length < cfg.stall_period)
+					break;
+				usage(argv[0]);
+				return 1;
+			case 'c':
+				cfg.cache = strtoul(optarg, NULL, 10);
+				break;
+			case 'P':
+				cfg.rtp_port = strtoul(optarg, NULL, 10);
+				break;
+			case 'J':
+				cfg.jitter = strtoul(optarg, NULL, 10);
+				break;
+			case 'l':
+				cfg.loss = strtoul(optarg, NULL, 10);
+				break;
+			case 'o':
+				cfg.reorder = strtoul(optarg, NULL, 10);
+				break;
+			case 'D':
+				cfg.delay = strtoul(optarg, NULL, 10);
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if(optind < argc || (!serve_only && cfg.duration == 0))
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	/* Start ICY server */
+	sock = icy_listen(cfg.port);
+	if(sock < 0)
+	{
+		fprintf(stderr, "Can't listen on port %u\n", cfg.port);
+		return 1;
+	}
+	if(pthread_create(&server, NULL, icy_server, &sock) != 0)
+		return 1;
+
+	/* Only serve streams to a running aircat */
+	if(serve_only)
+	{
+		fprintf(stderr, "Serving %u kbit/s streams on "
+			"http://127.0.0.1:%u/N\n", cfg.bitrate, cfg.port);
+		if(cfg.duration == 0)
+			pthread_join(server, NULL);
+		ingest_sleep(cfg.duration);
+		STORE(stop, 1);
+		pthread_join(server, NULL);
+		close(sock);
+		return 0;
+	}
+
+	/* Allocate sessions */
+	count = cfg.icy_sessions + cfg.rtp_sessions;
+	sessions = calloc(count > 0 ? count : 1, sizeof(*sessions));
+	if(sessions == NULL)
+		return 1;
+
+	/* Open RTP receivers before any packet is sent */
+	for(i = 0; i < count; i++)
+	{
+		sessions[i].type = i < cfg.icy_sessions ? "icy" : "rtp";
+		sessions[i].id = i < cfg.icy_sessions ? i :
+				 i - cfg.icy_sessions;
+		if(i >= cfg.icy_sessions && rtp_session_open(&sessions[i]) != 0)
+		{
+			fprintf(stderr, "Can't open RTP receiver on port %u\n",
+				cfg.rtp_port + sessions[i].id * 2);
+			sessions[i].failed = 1;
+		}
+	}
+
+	/* Start sessions */
+	for(i = 0; i < count; i++)
+	{
+		if(sessions[i].failed)
+			continue;
+		if(pthread_create(&sessions[i].thread, NULL,
+				  i < cfg.icy_sessions ? icy_session :
+				  rtp_session, &sessions[i]) != 0)
+		{
+			sessions[i].failed = 1;
+			continue;
+		}
+		sessions[i].started = 1;
+		if(cfg.interval > 0)
+			ingest_sleep(cfg.interval);
+	}
+
+	/* Wait end of sessions and stop generators */
+	for(i = 0; i < count; i++)
+		if(sessions[i].started)
+			pthread_join(sessions[i].thread, NULL);
+	STORE(stop, 1);
+	for(i = 0; i < count; i++)
+	{
+		if(sessions[i].sender_started)
+			pthread_join(sessions[i].sender, NULL);
+		if(sessions[i].rtp != NULL)
+			rtp_close(sessions[i].rtp);
+	}
+	pthread_join(server, NULL);
+	close(sock);
+
+	/* Wait end of connections (they update sessions) */
+	while(LOAD(icy_conns) > 0)
+		ingest_sleep(ICY_TICK);
+
+	/* Print report */
+	if(json)
+		printf("{\"version\": \"%s\", \"duration\": %lu, "
+		       "\"bitrate\": %u, \"results\": [", VERSION,
+		       cfg.duration / 1000, cfg.bitrate);
+	ingest_report("icy", sessions, cfg.icy_sessions, 1);
+	ingest_report("rtp", sessions + cfg.icy_sessions, cfg.rtp_sessions,
+		      cfg.icy_sessions == 0);
+	if(json)
+		printf("\n]}\n");
+
+	free(sessions);
+
+	return 0;
+}
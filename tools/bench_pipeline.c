@@ -0,0 +1,710 @@
+/*
+ * bench_pipeline.c - Microbenchmarks of the core audio pipeline
+ *
+ * Measure the components which handle every sample during playback:
+ *  - cache: cache_write() / cache_read() round trips for several cache
+ *    lengths,
+ *  - vring: producer/consumer handoff in a single thread and with two threads
+ *    (with and without VRING_SPSC),
+ *  - resample: resample_read() for common rate pairs and channel maps,
+ *  - mixer: ALSA mixer thread with 1 to 8 streams on the ALSA "null" device.
+ * Times are given per frame (one sample for all channels) or per byte for
+ * vring, and the fastest of all runs is kept.
+ *
+ * Usage: bench_pipeline [-j] [-n runs] [-d duration] [-D device] [test...]
+ *  -j: print results in JSON (for comparison between builds),
+ *  -n: run each case several times and keep the fastest run,
+ *  -d: duration of each mixer case (in ms),
+ *  -D: ALSA device for mixer cases (default: "null"),
+ *  test: only run these tests ("cache", "vring", "resample" or "mixer").
+ *
+ * Copyright (c) 2014   A. Dilly
+ *
+ * AirCat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * AirCat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with AirCat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "format.h"
+#include "cache.h"
+#include "vring.h"
+#include "resample.h"
+#include "outputs.h"
+#include "output_alsa.h"
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef VERSION
+#define VERSION "unknown"
+#endif
+
+/* Samplerate and channels of cache and mixer cases */
+#define BENCH_SAMPLERATE 44100
+#define BENCH_CHANNELS 2
+/* Chunk of a cache round trip or of a read from resampler (in samples) */
+#define CHUNK_SIZE 4096
+/* Audio moved through cache and resampler in each run (in s) */
+#define AUDIO_DURATION 20
+/* vring size, chunk size and data moved in each run (in bytes) */
+#define VRING_SIZE (256 * 1024)
+#define VRING_CHUNK 4096
+#define VRING_TOTAL (256 * 1024 * 1024)
+/* Maximum mixed streams */
+#define MAX_STREAMS 8
+
+struct bench_result {
+	const char *test;
+	char name[64];
+	const char *unit;
+	uint64_t ns;			/* Processing time */
+	unsigned long long count;	/* Units processed */
+	double duration;		/* Audio duration processed (in s) */
+	double load;			/* Mixer thread load (0 to 1) */
+};
+
+static int json = 0;
+static int result_count = 0;
+
+/* Input for cache, resampler and mixer: a noise in native sample format */
+static unsigned char noise[CHUNK_SIZE * 8 * 4];
+
+static uint64_t bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void bench_init_noise(void)
+{
+	uint32_t seed = 1;
+	size_t i;
+
+	for(i = 0; i < sizeof(noise) / 4; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+#ifdef USE_FLOAT
+		((float *) noise)[i] = (float) (int32_t) seed / 4294967296.0f;
+#else
+		((int32_t *) noise)[i] = (int32_t) seed >> 2;
+#endif
+	}
+}
+
+static double bench_ns_per_unit(const struct bench_result *res)
+{
+	return res->count > 0 ? (double) res->ns / res->count : 0;
+}
+
+static double bench_realtime(const struct bench_result *res)
+{
+	return res->ns > 0 ? res->duration * 1e9 / res->ns : 0;
+}
+
+static void bench_print(const struct bench_result *res)
+{
+	if(!json)
+	{
+		printf("%-9s %-24s %10.3f ns/%s", res->test, res->name,
+		       bench_ns_per_unit(res), res->unit);
+		if(res->duration > 0)
+			printf(", %10.1fx realtime", bench_realtime(res));
+		if(res->load > 0)
+			printf(", %5.1f%% mixer load", res->load * 100);
+		printf("\n");
+		return;
+	}
+
+	printf("%s\n    {\"test\": \"%s\", \"case\": \"%s\", \"unit\": \"%s\", "
+	       "\"count\": %llu, \"ns\": %llu, \"ns_per_unit\": %.3f",
+	       result_count == 0 ? "" : ",", res->test, res->name, res->unit,
+	       res->count, (unsigned long long) res->ns,
+	       bench_ns_per_unit(res));
+	if(res->duration > 0)
+		printf(", \"realtime\": %.3f", bench_realtime(res));
+	if(res->load > 0)
+		printf(", \"load\": %.4f", res->load);
+	printf("}");
+}
+
+static void bench_keep(struct bench_result *best,
+		       const struct bench_result *run, int i)
+{
+	/* Keep the fastest run */
+	if(i == 0 || bench_ns_per_unit(run) < bench_ns_per_unit(best))
+		*best = *run;
+}
+
+/******************************************************************************
+ *                                  Cache                                     *
+ ******************************************************************************/
+
+static int bench_cache_run(unsigned long time, struct bench_result *res)
+{
+	unsigned char buffer[CHUNK_SIZE * 4];
+	struct a_format fmt = A_FORMAT_INIT;
+	struct cache_handle *cache;
+	unsigned long long total;
+	uint64_t start;
+	ssize_t len;
+	int i;
+
+	/* Open a cache filled by cache_write() */
+	if(cache_open(&cache, time, BENCH_SAMPLERATE, BENCH_CHANNELS, 0, NULL,
+		      NULL, NULL, NULL) != 0)
+		return -1;
+	fmt.samplerate = BENCH_SAMPLERATE;
+	fmt.channels = BENCH_CHANNELS;
+
+	/* Fill cache until it is ready */
+	for(i = 0; !cache_is_ready(cache); i++)
+	{
+		len = cache_write(cache, noise, CHUNK_SIZE, &fmt);
+		if(len <= 0)
+			break;
+	}
+
+	/* Move audio through a full cache: a read makes room for a write */
+	total = (unsigned long long) AUDIO_DURATION * BENCH_SAMPLERATE *
+		BENCH_CHANNELS;
+	res->count = 0;
+	start = bench_now();
+	while(res->count < total)
+	{
+		len = cache_read(cache, buffer, CHUNK_SIZE, &fmt);
+		if(len <= 0)
+			break;
+		cache_write(cache, noise, len, &fmt);
+		res->count += len;
+	}
+	res->ns = bench_now() - start;
+
+	cache_close(cache);
+
+	/* Cache has been starved */
+	if(res->count < total)
+		return -1;
+
+	res->count /= BENCH_CHANNELS;
+	res->duration = (double) res->count / BENCH_SAMPLERATE;
+
+	return 0;
+}
+
+static int bench_cache(int runs)
+{
+	static const unsigned long times[] = {50, 200, 1000, 5000};
+	struct bench_result best, run;
+	unsigned int i;
+	int ret = 0;
+	int r;
+
+	for(i = 0; i < sizeof(times) / sizeof(*times); i++)
+	{
+		memset(&best, 0, sizeof(best));
+		for(r = 0; r < runs; r++)
+		{
+			memset(&run, 0, sizeof(run));
+			run.test = "cache";
+			run.unit = "frame";
+			snprintf(run.name, sizeof(run.name), "%lums", times[i]);
+			if(bench_cache_run(times[i], &run) != 0)
+				break;
+			bench_keep(&best, &run, r);
+		}
+		if(r < runs)
+		{
+			fprintf(stderr, "cache: failed with %lu ms\n", times[i]);
+			ret = -1;
+			continue;
+		}
+		bench_print(&best);
+		result_count++;
+	}
+
+	return ret;
+}
+
+/******************************************************************************
+ *                                  vring                                     *
+ ******************************************************************************/
+
+static void bench_vring_produce(struct vring_handle *ring, int wait)
+{
+	size_t total = 0;
+	unsigned char *p;
+
+	while(total < VRING_TOTAL)
+	{
+		/* Wait for space */
+		if(vring_write(ring, &p) < VRING_CHUNK)
+		{
+			if(wait)
+				vring_wait_writable(ring, VRING_CHUNK, 0);
+			continue;
+		}
+
+		/* Write a chunk */
+		memcpy(p, noise, VRING_CHUNK);
+		vring_write_forward(ring, VRING_CHUNK);
+		total += VRING_CHUNK;
+	}
+}
+
+static size_t bench_vring_consume(struct vring_handle *ring, int wait,
+				  unsigned char *buffer)
+{
+	unsigned char *p;
+	ssize_t len;
+
+	/* Wait for data */
+	len = vring_read(ring, &p, VRING_CHUNK, 0);
+	if(len < VRING_CHUNK)
+	{
+		if(wait)
+			vring_wait_readable(ring, VRING_CHUNK, 0);
+		return 0;
+	}
+
+	/* Read a chunk */
+	memcpy(buffer, p, len);
+	vring_read_forward(ring, len);
+
+	return len;
+}
+
+static void *bench_vring_thread(void *user_data)
+{
+	bench_vring_produce(user_data, 1);
+
+	return NULL;
+}
+
+static int bench_vring_run(int threads, int flags, struct bench_result *res)
+{
+	unsigned char buffer[VRING_CHUNK];
+	struct vring_handle *ring;
+	pthread_t thread;
+	uint64_t start;
+	size_t total = 0;
+	unsigned char *p;
+
+	/* Open ring buffer */
+	if(vring_open(&ring, VRING_SIZE, VRING_CHUNK, flags) != 0)
+		return -1;
+
+	start = bench_now();
+	if(threads == 1)
+	{
+		/* Write and read back each chunk */
+		while(total < VRING_TOTAL)
+		{
+			if(vring_write(ring, &p) < VRING_CHUNK)
+				break;
+			memcpy(p, noise, VRING_CHUNK);
+			vring_write_forward(ring, VRING_CHUNK);
+			total += bench_vring_consume(ring, 0, buffer);
+		}
+	}
+	else
+	{
+		/* Producer thread and consumer in this thread */
+		if(pthread_create(&thread, NULL, bench_vring_thread, ring) != 0)
+		{
+			vring_close(ring);
+			return -1;
+		}
+		while(total < VRING_TOTAL)
+			total += bench_vring_consume(ring, 1, buffer);
+		pthread_join(thread, NULL);
+	}
+	res->ns = bench_now() - start;
+	res->count = total;
+
+	vring_close(ring);
+
+	return total < VRING_TOTAL ? -1 : 0;
+}
+
+static int bench_vring(int runs)
+{
+	struct bench_result best, run;
+	int threads, spsc, r;
+	int ret = 0;
+
+	for(threads = 1; threads <= 2; threads++)
+	{
+		for(spsc = 0; spsc <= 1; spsc++)
+		{
+			memset(&best, 0, sizeof(best));
+			for(r = 0; r < runs; r++)
+			{
+				memset(&run, 0, sizeof(run));
+				run.test = "vring";
+				run.unit = "byte";
+				snprintf(run.name, sizeof(run.name),
+					 "%d thread%s%s", threads,
+					 threads > 1 ? "s" : "",
+					 spsc ? " spsc" : "");
+				if(bench_vring_run(threads,
+						   spsc ? VRING_SPSC : 0,
+						   &run) != 0)
+					break;
+				bench_keep(&best, &run, r);
+			}
+			if(r < runs)
+			{
+				fprintf(stderr, "vring: failed with %d "
+					"threads\n", threads);
+				ret = -1;
+				continue;
+			}
+			bench_print(&best);
+			result_count++;
+		}
+	}
+
+	return ret;
+}
+
+/******************************************************************************
+ *                                Resampler                                   *
+ ******************************************************************************/
+
+struct bench_input {
+	unsigned long samplerate;
+	unsigned char channels;
+};
+
+static int bench_input_read(void *user_data, unsigned char *buffer,
+			    size_t size, struct a_format *fmt)
+{
+	struct bench_input *in = user_data;
+
+	/* Give noise in a whole count of frames */
+	if(size > sizeof(noise) / 4)
+		size = sizeof(noise) / 4;
+	size -= size % in->channels;
+	memcpy(buffer, noise, size * 4);
+
+	fmt->samplerate = in->samplerate;
+	fmt->channels = in->channels;
+	fmt->sample = SAMPLE_NATIVE;
+
+	return size;
+}
+
+static int bench_resample_run(unsigned long in_rate, unsigned char in_ch,
+			      unsigned long out_rate, unsigned char out_ch,
+			      struct bench_result *res)
+{
+	struct a_format fmt = A_FORMAT_INIT;
+	unsigned char buffer[CHUNK_SIZE * 4];
+	struct resample_handle *r;
+	struct bench_input in;
+	unsigned long long total;
+	uint64_t start;
+	int len;
+
+	/* Open resampler with default profile */
+	in.samplerate = in_rate;
+	in.channels = in_ch;
+	if(resample_open(&r, in_rate, in_ch, out_rate, out_ch, NULL,
+			 &bench_input_read, NULL, &in) != 0)
+		return -1;
+
+	/* Read converted samples */
+	total = (unsigned long long) AUDIO_DURATION * out_rate * out_ch;
+	res->count = 0;
+	start = bench_now();
+	while(res->count < total)
+	{
+		len = resample_read(r, buffer, CHUNK_SIZE - CHUNK_SIZE % out_ch,
+				    &fmt);
+		if(len <= 0)
+			break;
+		res->count += len;
+	}
+	res->ns = bench_now() - start;
+
+	resample_close(r);
+
+	if(res->count < total)
+		return -1;
+
+	res->count /= out_ch;
+	res->duration = (double) res->count / out_rate;
+
+	return 0;
+}
+
+static int bench_resample(int runs)
+{
+	static const struct {
+		unsigned long in_rate;
+		unsigned char in_ch;
+		unsigned long out_rate;
+		unsigned char out_ch;
+	} cases[] = {
+		{44100, 2, 44100, 2},
+		{48000, 2, 44100, 2},
+		{44100, 2, 48000, 2},
+		{22050, 2, 44100, 2},
+		{44100, 1, 44100, 2},
+		{44100, 2, 44100, 1},
+		{48000, 1, 44100, 2},
+		{48000, 6, 44100, 2},
+	};
+	struct bench_result best, run;
+	unsigned int i;
+	int ret = 0;
+	int r;
+
+	for(i = 0; i < sizeof(cases) / sizeof(*cases); i++)
+	{
+		memset(&best, 0, sizeof(best));
+		for(r = 0; r < runs; r++)
+		{
+			memset(&run, 0, sizeof(run));
+			run.test = "resample";
+			run.unit = "frame";
+			snprintf(run.name, sizeof(run.name), "%lu>%lu %u>%u",
+				 cases[i].in_rate, cases[i].out_rate,
+				 cases[i].in_ch, cases[i].out_ch);
+			if(bench_resample_run(cases[i].in_rate, cases[i].in_ch,
+					      cases[i].out_rate,
+					      cases[i].out_ch, &run) != 0)
+				break;
+			bench_keep(&best, &run, r);
+		}
+		if(r < runs)
+		{
+			fprintf(stderr, "resample: failed with %s\n", run.name);
+			ret = -1;
+			continue;
+		}
+		bench_print(&best);
+		result_count++;
+	}
+
+	return ret;
+}
+
+/******************************************************************************
+ *                                  Mixer                                     *
+ ******************************************************************************/
+
+static int bench_mixer_run(const char *device, unsigned int streams,
+			   unsigned long duration, struct bench_result *res)
+{
+	struct output_stream *s[MAX_STREAMS];
+	struct output_attr attr;
+	struct output_stats stats;
+	struct bench_input in;
+	struct output *h;
+	unsigned int i;
+	uint64_t start;
+
+	/* Open output on device: the null device doesn't pace the mixer,
+	 * so it mixes periods as fast as possible */
+	memset(&attr, 0, sizeof(attr));
+	attr.samplerate = BENCH_SAMPLERATE;
+	attr.channels = BENCH_CHANNELS;
+	attr.device = device;
+	if(output_alsa.open((void **) &h, &attr) != 0)
+		return -1;
+
+	/* Add streams at a lower volume, so they are all really mixed */
+	memset(&stats, 0, sizeof(stats));
+	in.samplerate = BENCH_SAMPLERATE;
+	in.channels = BENCH_CHANNELS;
+	for(i = 0; i < streams; i++)
+	{
+		s[i] = output_alsa.add_stream(h, BENCH_SAMPLERATE,
+					      BENCH_CHANNELS, 0, 0, NULL,
+					      &bench_input_read, &in);
+		if(s[i] == NULL)
+			break;
+		output_alsa.set_volume_stream(h, s[i], OUTPUT_VOLUME_MAX / 2);
+	}
+
+	/* Play during duration */
+	if(i == streams)
+	{
+		start = bench_now();
+		for(i = 0; i < streams; i++)
+			output_alsa.play_stream(h, s[i]);
+		usleep(duration * 1000);
+		output_alsa.get_stats(h, &stats);
+		res->ns = bench_now() - start;
+	}
+
+	/* Remove streams */
+	while(i-- > 0)
+		output_alsa.remove_stream(h, s[i]);
+	output_alsa.close(h);
+
+	if(stats.periods == 0 || res->ns == 0)
+		return -1;
+
+	/* Mix time is given per period */
+	res->count = stats.periods;
+	res->load = (double) stats.mix_time_avg * stats.periods * 1000 /
+		    res->ns;
+	res->ns = (uint64_t) stats.mix_time_avg * stats.periods * 1000;
+
+	return 0;
+}
+
+static int bench_mixer(int runs, const char *device, unsigned long duration)
+{
+	struct bench_result best, run;
+	unsigned int streams;
+	int r;
+
+	for(streams = 1; streams <= MAX_STREAMS; streams++)
+	{
+		memset(&best, 0, sizeof(best));
+		for(r = 0; r < runs; r++)
+		{
+			memset(&run, 0, sizeof(run));
+			run.test = "mixer";
+			run.unit = "period";
+			snprintf(run.name, sizeof(run.name), "%u stream%s",
+				 streams, streams > 1 ? "s" : "");
+			if(bench_mixer_run(device, streams, duration,
+					   &run) != 0)
+				break;
+			bench_keep(&best, &run, r);
+		}
+		if(r < runs)
+		{
+			fprintf(stderr, "mixer: failed to open ALSA device "
+				"\"%s\"\n", device);
+			return -1;
+		}
+		bench_print(&best);
+		result_count++;
+	}
+
+	return 0;
+}
+
+static int bench_selected(char **tests, int count, const char *name)
+{
+	int i;
+
+	if(count == 0)
+		return 1;
+
+	for(i = 0; i < count; i++)
+		if(strcmp(tests[i], name) == 0)
+			return 1;
+
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-j] [-n runs] [-d duration] [-D device] "
+			"[test...]\n"
+			"  -j           print results in JSON\n"
+			"  -n runs      keep fastest of several runs "
+			"(default: 1)\n"
+			"  -d duration  duration of mixer cases in ms "
+			"(default: 1000)\n"
+			"  -D device    ALSA device of mixer cases "
+			"(default: null)\n"
+			"  test         cache, vring, resample or mixer "
+			"(default: all)\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long duration = 1000;
+	const char *device = "null";
+	char **tests;
+	int runs = 1;
+	int count;
+	int ret = 0;
+	int opt;
+
+	/* Parse options */
+	while((opt = getopt(argc, argv, "jn:d:D:h")) != -1)
+	{
+		switch(opt)
+		{
+			case 'j':
+				json = 1;
+				break;
+			case 'n':
+				runs = atoi(optarg);
+				if(runs > 0)
+					break;
+				usage(argv[0]);
+				return 1;
+			case 'd':
+				duration = strtoul(optarg, NULL, 10);
+				if(duration > 0)
+					break;
+				usage(argv[0]);
+				return 1;
+			case 'D':
+				device = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	tests = &argv[optind];
+	count = argc - optind;
+
+	bench_init_noise();
+
+	if(json)
+	{
+#ifdef USE_FLOAT
+		printf("{\"version\": \"%s\", \"sample\": \"float\", ", VERSION);
+#else
+		printf("{\"version\": \"%s\", \"sample\": \"s32\", ", VERSION);
+#endif
+		printf("\"runs\": %d, \"results\": [", runs);
+	}
+
+	/* Run selected tests */
+	if(bench_selected(tests, count, "cache") && bench_cache(runs) != 0)
+		ret = 1;
+	if(bench_selected(tests, count, "vring") && bench_vring(runs) != 0)
+		ret = 1;
+	if(bench_selected(tests, count, "resample") &&
+	   bench_resample(runs) != 0)
+		ret = 1;
+	if(bench_selected(tests, count, "mixer") &&
+	   bench_mixer(runs, device, duration) != 0)
+		ret = 1;
+
+	if(json)
+		printf("\n]}\n");
+
+	return ret;
+}
@@ -0,0 +1,453 @@
+/*
+ * check_alac.c - Conformance check of ALAC predictor and deinterlace
+ *
+ * Check the optimized ALAC stages against plain scalar references (the
+ * original decoder code) bit for bit:
+ *  - the adaptive FIR predictor for all orders (generic filter and the
+ *    versions specialized for orders 4 and 8), coefficient tables included,
+ *  - the deinterlace kernel (SSE2 or NEON when available, with its scalar
+ *    tail) for 16-bit and 24-bit streams, mono and stereo, with and without
+ *    mid/side mixing and uncompressed bytes, in S16, S32 and float output,
+ *  - full uncompressed frames, where 24-bit samples are given left aligned
+ *    on 32 bits (and their upper 16 bits in S16 output).
+ *
+ * Usage: check_alac
+ * Exit status is 0 on success and 1 on mismatch.
+ *
+ * Copyright (c) 2014   A. Dilly
+ *
+ * AirCat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * AirCat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with AirCat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Predictor and deinterlace kernels are static */
+#include "decoder_alac.c"
+
+/* Maximum samples per channel in a frame */
+#define FRAME_MAX 4096
+/* Random buffers checked for each configuration */
+#define RUNS 4
+
+static const int lengths[] = {
+	0, 1, 2, 3, 4, 5, 7, 8, 9, 15, 16, 17, 31, 33, 352, 1023, FRAME_MAX
+};
+#define LENGTHS (sizeof(lengths) / sizeof(*lengths))
+
+static const enum a_sample samples[] = {
+	SAMPLE_S16, SAMPLE_S32, SAMPLE_FLOAT
+};
+static const char *sample_names[] = {
+	[SAMPLE_S16] = "s16", [SAMPLE_S32] = "s32", [SAMPLE_FLOAT] = "float"
+};
+#define SAMPLES (sizeof(samples) / sizeof(*samples))
+
+static uint32_t check_seed = 0x12345678;
+
+static uint32_t check_rand(void)
+{
+	/* Xorshift: same sequence on all hosts */
+	check_seed ^= check_seed << 13;
+	check_seed ^= check_seed >> 17;
+	check_seed ^= check_seed << 5;
+
+	return check_seed;
+}
+
+/* Random signed value on bits (bits <= 32) */
+static int32_t check_rand_bits(int bits)
+{
+	return (int32_t) (check_rand() << (32 - bits)) >> (32 - bits);
+}
+
+/******************************************************************************
+ *                              Scalar references                             *
+ ******************************************************************************/
+
+/* Adaptive FIR of original decoder (general case only) */
+static void ref_fir(int32_t *error_buffer, int32_t *buffer_out, int output_size,
+		    int readsamplesize, int16_t *predictor_coef_table,
+		    int predictor_coef_num, int predictor_quantitization)
+{
+	int32_t val;
+	int predictor_num;
+	int error_val;
+	int outval;
+	int sign;
+	int sum;
+	int i, j;
+
+	*buffer_out = *error_buffer;
+
+	if (!predictor_coef_num)
+	{
+		if (output_size <= 1)
+			return;
+		memcpy(buffer_out+1, error_buffer+1, (output_size-1) * 4);
+		return;
+	}
+
+	if (predictor_coef_num == 0x1f)
+	{
+		for (i = 0; i < output_size - 1; i++)
+			buffer_out[i+1] = SIGN_EXTENDED32((buffer_out[i] + error_buffer[i+1]), readsamplesize);
+		return;
+	}
+
+	for (i = 0; i < predictor_coef_num; i++)
+	{
+		val = buffer_out[i] + error_buffer[i+1];
+		buffer_out[i+1] = SIGN_EXTENDED32(val, readsamplesize);
+	}
+
+	for (i = predictor_coef_num + 1; i < output_size; i++)
+	{
+		sum = 0;
+		error_val = error_buffer[i];
+
+		for (j = 0; j < predictor_coef_num; j++)
+			sum += (buffer_out[predictor_coef_num-j] - buffer_out[0]) * predictor_coef_table[j];
+
+		outval = (1 << (predictor_quantitization-1)) + sum;
+		outval = outval >> predictor_quantitization;
+		outval = outval + buffer_out[0] + error_val;
+		outval = SIGN_EXTENDED32(outval, readsamplesize);
+
+		buffer_out[predictor_coef_num+1] = outval;
+
+		if (error_val > 0)
+		{
+			predictor_num = predictor_coef_num - 1;
+
+			while (predictor_num >= 0 && error_val > 0)
+			{
+				val = buffer_out[0] - buffer_out[predictor_coef_num - predictor_num];
+				sign = SIGN_ONLY(val);
+				predictor_coef_table[predictor_num] -= sign;
+				val *= sign;
+				error_val -= ((val >> predictor_quantitization) * (predictor_coef_num - predictor_num));
+				predictor_num--;
+			}
+		}
+		else if (error_val < 0)
+		{
+			predictor_num = predictor_coef_num - 1;
+
+			while (predictor_num >= 0 && error_val < 0)
+			{
+				val = buffer_out[0] - buffer_out[predictor_coef_num - predictor_num];
+				sign = - SIGN_ONLY(val);
+				predictor_coef_table[predictor_num] -= sign;
+				val *= sign;
+				error_val -= ((val >> predictor_quantitization) * (predictor_coef_num - predictor_num));
+				predictor_num--;
+			}
+		}
+		buffer_out++;
+	}
+}
+
+/* Sample value of sample_size bits after deinterlace of original decoder */
+static int32_t ref_sample(const int32_t *buffer_a, const int32_t *buffer_b,
+			  int uncompressed_bytes, const int32_t *ubuf_a,
+			  const int32_t *ubuf_b, int sample_size, int i, int ch,
+			  uint8_t interlacing_shift,
+			  uint8_t interlacing_leftweight)
+{
+	int32_t left, right;
+
+	left = buffer_a[i];
+	right = buffer_b != NULL ? buffer_b[i] : 0;
+
+	/* weighted interlacing */
+	if (buffer_b != NULL && interlacing_leftweight)
+	{
+		right = buffer_a[i] - ((buffer_b[i] * interlacing_leftweight) >> interlacing_shift);
+		left = right + buffer_b[i];
+	}
+
+	if (uncompressed_bytes)
+	{
+		uint32_t mask = ~(0xFFFFFFFF << (uncompressed_bytes * 8));
+		left = ((uint32_t) left << (uncompressed_bytes * 8)) | (ubuf_a[i] & mask);
+		if (buffer_b != NULL)
+			right = ((uint32_t) right << (uncompressed_bytes * 8)) | (ubuf_b[i] & mask);
+	}
+
+	/* 16-bit samples are truncated to int16, 24-bit ones to 3 bytes */
+	return (int32_t) ((uint32_t) (ch ? right : left) << (32 - sample_size))
+	       >> (32 - sample_size);
+}
+
+/* Expected output for a sample value of sample_size bits */
+static void ref_store(void *out, int idx, enum a_sample sample,
+		      int sample_size, int32_t v)
+{
+	int32_t s = (uint32_t) v << (32 - sample_size);
+
+	switch(sample)
+	{
+		case SAMPLE_S16:
+			((int16_t*)out)[idx] = s >> 16;
+			break;
+		case SAMPLE_FLOAT:
+			((float*)out)[idx] = (float)s / 0x7fffffff;
+			break;
+		default:
+			((int32_t*)out)[idx] = s;
+	}
+}
+
+/******************************************************************************
+ *                                   Checks                                   *
+ ******************************************************************************/
+
+static int check_fir(void)
+{
+	static const int orders[] = {
+		0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 12, 16, 30, 0x1f
+	};
+	static const int sizes[] = { 16, 17, 24, 25 };
+	static int32_t error[FRAME_MAX], ref_out[FRAME_MAX], out[FRAME_MAX];
+	int16_t ref_coefs[32], coefs[32];
+	int o, s, l, run, i, quant, coef_max;
+
+	for(o = 0; o < (int) (sizeof(orders) / sizeof(*orders)); o++)
+	for(s = 0; s < (int) (sizeof(sizes) / sizeof(*sizes)); s++)
+	for(l = 0; l < (int) LENGTHS; l++)
+	for(run = 0; run < RUNS; run++)
+	{
+		/* Small prediction errors as in real streams */
+		for(i = 0; i < lengths[l]; i++)
+			error[i] = check_rand_bits(run & 1 ? 6 : 10);
+		if(lengths[l] > 0)
+			error[0] = check_rand_bits(sizes[s]);
+
+		/* Coefficients of a stable predictor (sum of coefficients is
+		 * below half of 1 << quant): adaptation can still make sums
+		 * overflow, which wraps as check is built with -fwrapv
+		 */
+		quant = 9 + check_rand() % 7;
+		coef_max = (1 << quant) / (2 * orders[o] + 1) + 1;
+		for(i = 0; i < 32; i++)
+			ref_coefs[i] = coefs[i] = (int32_t) (check_rand() %
+						    (2 * coef_max)) - coef_max;
+
+		ref_fir(error, ref_out, lengths[l], sizes[s], ref_coefs,
+			orders[o], quant);
+		decoder_alac_predictor_decompress_fir_adapt(error, out,
+							    lengths[l],
+							    sizes[s], coefs,
+							    orders[o], quant);
+
+		if(memcmp(ref_out, out, lengths[l] * sizeof(*out)) != 0 ||
+		   memcmp(ref_coefs, coefs, sizeof(coefs)) != 0)
+		{
+			fprintf(stderr, "fir: mismatch (order %d, %d bits, len "
+				"%d, quantization %d)\n", orders[o], sizes[s],
+				lengths[l], quant);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int check_deinterlace_one(int sample_size, int channels,
+				 int uncompressed_bytes, uint8_t shift,
+				 uint8_t weight, int len, enum a_sample sample)
+{
+	static int32_t a[FRAME_MAX], b[FRAME_MAX], ua[FRAME_MAX], ub[FRAME_MAX];
+	static int32_t ref_out[FRAME_MAX * 2], out[FRAME_MAX * 2];
+	size_t bytes = format_sample_size(sample);
+	int readsamplesize, i, c;
+
+	/* Samples as given by predictor */
+	readsamplesize = sample_size - uncompressed_bytes * 8 + channels - 1;
+	for(i = 0; i < len; i++)
+	{
+		a[i] = check_rand_bits(readsamplesize);
+		b[i] = check_rand_bits(readsamplesize);
+		ua[i] = check_rand();
+		ub[i] = check_rand();
+	}
+
+	/* Get expected and kernel output */
+	for(i = 0; i < len; i++)
+		for(c = 0; c < channels; c++)
+			ref_store(ref_out, i * channels + c, sample,
+				  sample_size,
+				  ref_sample(a, channels == 2 ? b : NULL,
+					     uncompressed_bytes, ua, ub,
+					     sample_size, i, c, shift,
+					     weight));
+	decoder_alac_deinterlace(a, channels == 2 ? b : NULL,
+				 uncompressed_bytes, ua, ub, out, sample,
+				 sample_size, channels, len, shift, weight);
+
+	if(memcmp(ref_out, out, len * channels * bytes) == 0)
+		return 0;
+
+	fprintf(stderr, "deinterlace: mismatch (%d bits, %d channels, %d "
+		"uncompressed bytes, shift %u, weight %u, len %d, %s)\n",
+		sample_size, channels, uncompressed_bytes, shift, weight, len,
+		sample_names[sample]);
+
+	return -1;
+}
+
+static int check_deinterlace(void)
+{
+	static const uint8_t weights[] = { 0, 1, 2, 3, 17, 63 };
+	static const uint8_t shifts[] = { 0, 1, 2, 5 };
+	int size, channels, ubytes, w, sh, l, s;
+
+	for(size = 16; size <= 24; size += 8)
+	for(channels = 1; channels <= 2; channels++)
+	for(ubytes = 0; ubytes <= (size == 24 ? 1 : 0); ubytes++)
+	for(w = 0; w < (int) sizeof(weights); w++)
+	for(sh = 0; sh < (int) sizeof(shifts); sh++)
+	for(l = 0; l < (int) LENGTHS; l++)
+	for(s = 0; s < (int) SAMPLES; s++)
+	{
+		/* Mixing is only for stereo */
+		if(channels == 1 && (w > 0 || sh > 0))
+			continue;
+
+		if(check_deinterlace_one(size, channels, ubytes, shifts[sh],
+					 weights[w], lengths[l],
+					 samples[s]) != 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+struct check_bits {
+	unsigned char *p;
+	int bits;
+};
+
+static void check_put_bits(struct check_bits *w, uint32_t v, int bits)
+{
+	/* Write MSB first */
+	while(bits-- > 0)
+	{
+		if(w->bits == 0)
+			*w->p = 0;
+		*w->p |= ((v >> bits) & 1) << (7 - w->bits);
+		if(++w->bits == 8)
+		{
+			w->bits = 0;
+			w->p++;
+		}
+	}
+}
+
+static int check_frame_one(int sample_size, int channels, int len,
+			   enum a_sample sample)
+{
+	static unsigned char frame[FRAME_MAX * 2 * 3 + 16];
+	static int32_t values[FRAME_MAX * 2];
+	static int32_t ref_out[FRAME_MAX * 2], out[FRAME_MAX * 2];
+	struct alac_decoder alac;
+	struct check_bits w = { frame, 0 };
+	size_t bytes = format_sample_size(sample);
+	int i, size;
+
+	/* Prepare decoder */
+	memset(&alac, 0, sizeof(alac));
+	alac.samples_per_frame = FRAME_MAX;
+	alac.sample_size = sample_size;
+	alac.numchannels = channels;
+	for(i = 0; i < 2; i++)
+	{
+		alac.predicterror_buffer[i] = malloc(FRAME_MAX * 4);
+		alac.outputsamples_buffer[i] = malloc(FRAME_MAX * 4);
+		alac.uncompressed_bytes_buffer[i] = malloc(FRAME_MAX * 4);
+	}
+
+	/* Write an uncompressed frame with its size */
+	check_put_bits(&w, channels - 1, 3);
+	check_put_bits(&w, 0, 16);
+	check_put_bits(&w, 1, 1);
+	check_put_bits(&w, 0, 2);
+	check_put_bits(&w, 1, 1);
+	check_put_bits(&w, len, 32);
+	for(i = 0; i < len * channels; i++)
+	{
+		values[i] = check_rand_bits(sample_size);
+		check_put_bits(&w, values[i], sample_size);
+		ref_store(ref_out, i, sample, sample_size, values[i]);
+	}
+
+	/* Decode frame */
+	decoder_alac_decode_frame(&alac, frame, w.p - frame + 1, out, sample,
+				  &size);
+	for(i = 0; i < 2; i++)
+	{
+		free(alac.predicterror_buffer[i]);
+		free(alac.outputsamples_buffer[i]);
+		free(alac.uncompressed_bytes_buffer[i]);
+	}
+
+	if(size == len * channels &&
+	   memcmp(ref_out, out, len * channels * bytes) == 0)
+		return 0;
+
+	fprintf(stderr, "frame: mismatch (%d bits, %d channels, len %d, %s)\n",
+		sample_size, channels, len, sample_names[sample]);
+
+	return -1;
+}
+
+static int check_frame(void)
+{
+	int size, channels, l, s;
+
+	for(size = 16; size <= 24; size += 8)
+	for(channels = 1; channels <= 2; channels++)
+	for(l = 1; l < (int) LENGTHS; l++)
+	for(s = 0; s < (int) SAMPLES; s++)
+		if(check_frame_one(size, channels, lengths[l], samples[s]) != 0)
+			return -1;
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *simd = "scalar";
+	int ret = 0;
+
+#if defined(ALAC_SSE2)
+	simd = "sse2";
+#elif defined(ALAC_NEON)
+	simd = "neon";
+#endif
+
+	if(check_fir() != 0)
+		ret = 1;
+	else
+		printf("fir: ok\n");
+
+	if(check_deinterlace() != 0)
+		ret = 1;
+	else
+		printf("deinterlace (%s): ok\n", simd);
+
+	if(check_frame() != 0)
+		ret = 1;
+	else
+		printf("uncompressed frames: ok\n");
+
+	return ret;
+}
@@ -0,0 +1,187 @@
+/*
+ * check_keyset.c - Check of keyset pagination of Files module listings
+ *
+ * Fill a table with sort keys containing NULL values and duplicates, then
+ * page through it with the keyset cursors of files_keyset_where() (as
+ * files_list_files() does), in ascending and descending orders and for
+ * several page sizes, and check the pages give back the full ordered list
+ * with no missing nor repeated row.
+ *
+ * Usage: check_keyset
+ * Exit status is 0 on success and 1 on mismatch.
+ *
+ * Copyright (c) 2014   A. Dilly
+ *
+ * AirCat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * AirCat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with AirCat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+
+#include <sqlite3.h>
+
+#include "db.h"
+#include "files_keyset.h"
+
+#define ROW_COUNT 40
+#define PAGE_MAX 7
+
+/* Only string helpers of database are used by keyset: provide them as db.c
+ * does (the rest of db.c needs the metrics part of HTTP server)
+ */
+char *db_mprintf(const char *str, ...)
+{
+	char *result;
+	va_list vl;
+
+	va_start(vl, str);
+	result = sqlite3_vmprintf(str, vl);
+	va_end(vl);
+
+	return result;
+}
+
+void db_free(void *ptr)
+{
+	sqlite3_free(ptr);
+}
+
+struct check_page {
+	int64_t ids[ROW_COUNT];
+	int count;
+	char *key;
+	int64_t id;
+};
+
+static int check_add_row(void *user_data, int col_count, char **values,
+			 char **names)
+{
+	struct check_page *p = user_data;
+
+	/* Too many rows */
+	if(p->count >= ROW_COUNT)
+		return 1;
+
+	/* Keep id and key of last row */
+	if(p->key != NULL)
+		free(p->key);
+	p->key = values[1] != NULL ? strdup(values[1]) : NULL;
+	p->id = strtoll(values[0], NULL, 10);
+	p->ids[p->count++] = p->id;
+
+	return 0;
+}
+
+static int check_order(sqlite3 *db, int desc, int page_size)
+{
+	struct check_page all = { .count = 0, .key = NULL };
+	struct check_page p = { .count = 0, .key = NULL };
+	const char *dir = desc ? "DESC" : "ASC";
+	char *keyset = NULL;
+	int64_t ids[ROW_COUNT];
+	int count = 0;
+	int pages = 0;
+	char *sql;
+	int i;
+
+	/* Get full ordered list */
+	sql = db_mprintf("SELECT id,title FROM song "
+			 "ORDER BY title %s,id %s", dir, dir);
+	sqlite3_exec(db, sql, check_add_row, &all, NULL);
+	db_free(sql);
+
+	/* Page through list */
+	do {
+		/* Get next page */
+		p.count = 0;
+		sql = db_mprintf("SELECT id,title FROM song WHERE 1 %s "
+				 "ORDER BY title %s,id %s LIMIT %d",
+				 keyset != NULL ? keyset : "", dir, dir,
+				 page_size);
+		sqlite3_exec(db, sql, check_add_row, &p, NULL);
+		db_free(sql);
+		if(keyset != NULL)
+			db_free(keyset);
+		keyset = NULL;
+
+		/* Append page */
+		for(i = 0; i < p.count && count < ROW_COUNT; i++)
+			ids[count++] = p.ids[i];
+
+		/* Generate cursor of next page */
+		if(p.count == page_size)
+			keyset = files_keyset_where("title", "id", desc, p.key,
+						    p.id);
+	} while(keyset != NULL && ++pages <= ROW_COUNT);
+	if(keyset != NULL)
+		db_free(keyset);
+	if(p.key != NULL)
+		free(p.key);
+	if(all.key != NULL)
+		free(all.key);
+
+	/* Compare with full list */
+	if(count != all.count || memcmp(ids, all.ids, count * sizeof(*ids)))
+	{
+		fprintf(stderr, "%s order with pages of %d: got %d rows "
+			"instead of %d\n", dir, page_size, count, all.count);
+		return -1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	sqlite3 *db;
+	char *sql;
+	int ret = 0;
+	int i, size;
+
+	/* Open database in memory */
+	if(sqlite3_open(":memory:", &db) != SQLITE_OK)
+	{
+		fprintf(stderr, "Failed to open database\n");
+		return 1;
+	}
+
+	/* Fill table with NULL and duplicated keys spread over the ids */
+	sqlite3_exec(db, "CREATE TABLE song (id INTEGER PRIMARY KEY, "
+			 "title TEXT)", NULL, NULL, NULL);
+	for(i = 1; i <= ROW_COUNT; i++)
+	{
+		sql = i % 3 == 0 ? db_mprintf("INSERT INTO song "
+					      "VALUES (%d, NULL)", i) :
+				   db_mprintf("INSERT INTO song "
+					      "VALUES (%d, 'title %d')", i,
+					      i % 5);
+		sqlite3_exec(db, sql, NULL, NULL, NULL);
+		db_free(sql);
+	}
+
+	/* Check both orders with all page sizes */
+	for(size = 1; size <= PAGE_MAX; size++)
+	{
+		if(check_order(db, 0, size) != 0 ||
+		   check_order(db, 1, size) != 0)
+			ret = 1;
+	}
+
+	/* Close database */
+	sqlite3_close(db);
+
+	return ret;
+}
@@ -0,0 +1,223 @@
+/*
+ * check_mix.c - Conformance check of SIMD mixing kernels
+ *
+ * Run all mixing kernel sets supported by the CPU (SSE2, AVX2, NEON) against
+ * the scalar reference set and check the output is the same bit for bit, for:
+ *  - lengths from 0 to LEN_MAX (odd lengths and vector tails),
+ *  - unaligned buffers,
+ *  - volumes from 0 to OUTPUT_VOLUME_MAX,
+ *  - random samples and samples at full scale (to exercise the clipping of
+ *    the add kernels).
+ * The check is built twice: for int32 samples (check_mix) and for float
+ * samples (check_mix_float, with USE_FLOAT).
+ *
+ * Usage: check_mix
+ * Exit status is 0 on success, 1 on mismatch and 77 (skipped) when the CPU has
+ * no SIMD kernel set.
+ *
+ * Copyright (c) 2014   A. Dilly
+ *
+ * AirCat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * AirCat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with AirCat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "output_mix.h"
+#include "output.h"
+
+/* Maximum length of buffers (in samples) */
+#define LEN_MAX 133
+/* Length of long buffers */
+#define LEN_LONG 4099
+/* Random buffers checked for each length */
+#define RUNS 8
+
+/* Exit status for a skipped test */
+#define SKIP 77
+
+static const unsigned int volumes[] = {
+	0, 1, 2, 3, 1000, 32767, 32768, 40000, OUTPUT_VOLUME_MAX - 1,
+	OUTPUT_VOLUME_MAX
+};
+#define VOLUMES (sizeof(volumes) / sizeof(*volumes))
+
+static uint32_t check_seed = 0x12345678;
+
+static uint32_t check_rand(void)
+{
+	/* Xorshift: same sequence on all hosts */
+	check_seed ^= check_seed << 13;
+	check_seed ^= check_seed >> 17;
+	check_seed ^= check_seed << 5;
+
+	return check_seed;
+}
+
+static mix_sample_t check_sample(int full_scale)
+{
+	uint32_t r = check_rand();
+
+#ifdef USE_FLOAT
+	/* Full scale, out of range or random in [-1.5; 1.5] */
+	if(full_scale)
+	{
+		static const float values[] = {
+			1.0, -1.0, 0.999999, -0.999999, 1.5, -1.5, 0.5, -0.5
+		};
+		return values[r % 8];
+	}
+	return ((float) (r >> 8) / (1 << 24)) * 3.0 - 1.5;
+#else
+	/* Full scale or random in whole range */
+	if(full_scale)
+	{
+		static const int32_t values[] = {
+			INT32_MAX, INT32_MIN, INT32_MAX - 1, INT32_MIN + 1,
+			0x40000000, -0x40000000, 0x7FFF0000, -0x7FFF0000
+		};
+		return values[r % 8];
+	}
+	return (int32_t) r;
+#endif
+}
+
+static void check_fill(mix_sample_t *buf, size_t len, int full_scale)
+{
+	size_t i;
+
+	for(i = 0; i < len; i++)
+		buf[i] = check_sample(full_scale);
+}
+
+static int check_compare(const struct output_mix *mix, const char *op,
+			 const mix_sample_t *ref, const mix_sample_t *out,
+			 size_t len, size_t offset, unsigned int volume)
+{
+	size_t i;
+
+	/* Compare bit for bit (not with float comparison) */
+	if(memcmp(ref, out, len * sizeof(*out)) == 0)
+		return 0;
+
+	for(i = 0; i < len && memcmp(&ref[i], &out[i], sizeof(*out)) == 0;
+	     i++);
+#ifdef USE_FLOAT
+	fprintf(stderr, "%s %s: mismatch at %zu (len %zu, offset %zu, volume "
+		"%u): %.9g instead of %.9g\n", mix->name, op, i, len, offset,
+		volume, out[i], ref[i]);
+#else
+	fprintf(stderr, "%s %s: mismatch at %zu (len %zu, offset %zu, volume "
+		"%u): %d instead of %d\n", mix->name, op, i, len, offset,
+		volume, out[i], ref[i]);
+#endif
+
+	return -1;
+}
+
+static int check_kernels(const struct output_mix *mix,
+			 const struct output_mix *ref, size_t len,
+			 size_t offset, int full_scale)
+{
+	static mix_sample_t in_buf[LEN_LONG + 4], mix_buf[LEN_LONG + 4];
+	static mix_sample_t ref_out[LEN_LONG + 4], out_buf[LEN_LONG + 4];
+	mix_sample_t *in = &in_buf[offset];
+	mix_sample_t *out = &out_buf[offset];
+	size_t v;
+
+	for(v = 0; v < VOLUMES; v++)
+	{
+		/* Generate input and current mix */
+		check_fill(in, len, full_scale);
+		check_fill(mix_buf, len, full_scale);
+
+		/* Check copy */
+		ref->copy(ref_out, in, len, volumes[v]);
+		mix->copy(out, in, len, volumes[v]);
+		if(check_compare(mix, "copy", ref_out, out, len, offset,
+				 volumes[v]) != 0)
+			return -1;
+
+		/* Check add */
+		memcpy(ref_out, mix_buf, len * sizeof(*ref_out));
+		memcpy(out, mix_buf, len * sizeof(*out));
+		ref->add(ref_out, in, len, volumes[v]);
+		mix->add(out, in, len, volumes[v]);
+		if(check_compare(mix, "add", ref_out, out, len, offset,
+				 volumes[v]) != 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int check_mix(const struct output_mix *mix,
+		     const struct output_mix *ref)
+{
+	size_t len, offset;
+	int run;
+
+	/* All short lengths, aligned and unaligned */
+	for(len = 0; len <= LEN_MAX; len++)
+		for(offset = 0; offset < 4; offset++)
+			for(run = 0; run < RUNS; run++)
+				if(check_kernels(mix, ref, len, offset,
+						 run & 1) != 0)
+					return -1;
+
+	/* Long odd buffers */
+	for(offset = 0; offset < 4; offset++)
+		for(run = 0; run < 2; run++)
+			if(check_kernels(mix, ref, LEN_LONG, offset, run) != 0)
+				return -1;
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	const struct output_mix * const *all = output_mix_get_all();
+	const struct output_mix *ref = output_mix_get_scalar();
+	int count = 0;
+	int ret = 0;
+
+	/* Check all SIMD kernel sets against scalar set */
+	for(; *all != NULL; all++)
+	{
+		if(*all == ref)
+			continue;
+		count++;
+
+		if(check_mix(*all, ref) != 0)
+		{
+			ret = 1;
+			continue;
+		}
+#ifdef USE_FLOAT
+		printf("%s (float): ok\n", (*all)->name);
+#else
+		printf("%s (int32): ok\n", (*all)->name);
+#endif
+	}
+
+	/* No SIMD kernel on this CPU */
+	if(count == 0)
+	{
+		printf("no SIMD mixing kernel: skipped\n");
+		return SKIP;
+	}
+
+	return ret;
+}